@@ -0,0 +1,637 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimHelperRemote.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#include "clsim/I3CLSimHelperRemote.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include <icetray/serialization.h>
+
+#ifdef HAS_PBA_IN_ICETRAY
+#include <icetray/portable_binary_archive.hpp>
+#else
+#include <boost/archive/portable_binary_iarchive.hpp>
+#include <boost/archive/portable_binary_oarchive.hpp>
+#endif
+
+// Writing to a closed connection must not raise SIGPIPE. Without
+// MSG_NOSIGNAL, it is disabled per socket using SO_NOSIGPIPE or,
+// if that is not available either, ignored for the whole process.
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#define I3CLSIM_REMOTE_NO_MSG_NOSIGNAL
+#endif
+
+namespace I3CLSimHelper
+{
+    namespace Remote
+    {
+        namespace {
+            // only allow reasonably sized messages, anything larger is most
+            // probably garbage from something that does not speak our protocol
+            const uint64_t maxPayloadSize = 1ull<<34;
+
+            std::string ErrnoString(const std::string &what)
+            {
+                return what + ": " + std::string(std::strerror(errno));
+            }
+
+            // call for every socket that is used to send messages
+            void DisableSigPipe(int socket)
+            {
+#ifdef I3CLSIM_REMOTE_NO_MSG_NOSIGNAL
+#ifdef SO_NOSIGPIPE
+                int flag=1;
+                ::setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &flag, sizeof(flag));
+#else
+                ::signal(SIGPIPE, SIG_IGN);
+#endif
+#endif
+            }
+
+            // little-endian encoding of the message header
+            void PutLE(unsigned char *buffer, uint64_t value, std::size_t size)
+            {
+                for (std::size_t i=0;i<size;++i) buffer[i]=static_cast<unsigned char>(value >> (8*i));
+            }
+
+            uint64_t GetLE(const unsigned char *buffer, std::size_t size)
+            {
+                uint64_t value=0;
+                for (std::size_t i=0;i<size;++i) value |= static_cast<uint64_t>(buffer[i]) << (8*i);
+                return value;
+            }
+
+            // splits "unix:/path" or "tcp:host:port"
+            void ParseAddress(const std::string &address,
+                              bool &isUnix,
+                              std::string &hostOrPath,
+                              std::string &port)
+            {
+                if (address.compare(0, 5, "unix:")==0) {
+                    isUnix=true;
+                    hostOrPath=address.substr(5);
+                    if (hostOrPath.empty())
+                        throw std::runtime_error("Missing socket path in address \"" + address + "\"");
+                    if (hostOrPath.size() >= sizeof(((struct sockaddr_un *)0)->sun_path))
+                        throw std::runtime_error("Socket path in address \"" + address + "\" is too long");
+                } else if (address.compare(0, 4, "tcp:")==0) {
+                    isUnix=false;
+                    const std::string rest = address.substr(4);
+                    const std::size_t colon = rest.rfind(':');
+                    if ((colon==std::string::npos) || (colon+1==rest.size()))
+                        throw std::runtime_error("Missing port in address \"" + address + "\"");
+                    hostOrPath=rest.substr(0, colon);
+                    port=rest.substr(colon+1);
+                } else {
+                    throw std::runtime_error("Address \"" + address + "\" has to start with \"unix:\" or \"tcp:\"");
+                }
+            }
+
+            void SendAll(int socket, const void *data, std::size_t size)
+            {
+                const char *ptr = static_cast<const char *>(data);
+                while (size>0) {
+                    const ssize_t ret = ::send(socket, ptr, size, MSG_NOSIGNAL);
+                    if (ret<0) {
+                        if (errno==EINTR) continue;
+                        throw std::runtime_error(ErrnoString("send() failed"));
+                    }
+                    ptr+=ret;
+                    size-=static_cast<std::size_t>(ret);
+                }
+            }
+
+            // returns false if the connection was closed before the first byte
+            bool ReceiveAll(int socket, void *data, std::size_t size)
+            {
+                char *ptr = static_cast<char *>(data);
+                bool first=true;
+                while (size>0) {
+                    const ssize_t ret = ::recv(socket, ptr, size, 0);
+                    if (ret<0) {
+                        if (errno==EINTR) continue;
+                        throw std::runtime_error(ErrnoString("recv() failed"));
+                    }
+                    if (ret==0) {
+                        if (first) return false;
+                        throw std::runtime_error("Connection closed in the middle of a message");
+                    }
+                    first=false;
+                    ptr+=ret;
+                    size-=static_cast<std::size_t>(ret);
+                }
+                return true;
+            }
+
+            void ReceiveAllOrThrow(int socket, void *data, std::size_t size)
+            {
+                if (size==0) return;
+                if (!ReceiveAll(socket, data, size))
+                    throw std::runtime_error("Connection closed in the middle of a message");
+            }
+
+            void SendHeader(int socket, MessageType_t type, uint32_t identifier, uint64_t payloadSize)
+            {
+                MessageHeader_t header;
+                header.magic=protocolMagic;
+                header.type=static_cast<uint32_t>(type);
+                header.identifier=identifier;
+                header.reserved=0;
+                header.payloadSize=payloadSize;
+
+                unsigned char buffer[headerSize];
+                PutLE(buffer+0, header.magic, 4);
+                PutLE(buffer+4, header.type, 4);
+                PutLE(buffer+8, header.identifier, 4);
+                PutLE(buffer+12, header.reserved, 4);
+                PutLE(buffer+16, header.payloadSize, 8);
+                SendAll(socket, buffer, headerSize);
+            }
+
+            void ExpectType(const MessageHeader_t &header, MessageType_t type)
+            {
+                if (header.type != static_cast<uint32_t>(type))
+                    throw std::runtime_error("Unexpected message type " + boost::lexical_cast<std::string>(header.type) +
+                                             " (expected " + boost::lexical_cast<std::string>(static_cast<uint32_t>(type)) + ")");
+            }
+        }
+
+        int Connect(const std::string &address)
+        {
+            bool isUnix; std::string hostOrPath, port;
+            ParseAddress(address, isUnix, hostOrPath, port);
+
+            if (isUnix) {
+                const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+                if (fd<0) throw std::runtime_error(ErrnoString("socket() failed"));
+
+                struct sockaddr_un addr;
+                std::memset(&addr, 0, sizeof(addr));
+                addr.sun_family = AF_UNIX;
+                std::strncpy(addr.sun_path, hostOrPath.c_str(), sizeof(addr.sun_path)-1);
+
+                if (::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+                    const std::string error = ErrnoString("Could not connect to \"" + address + "\"");
+                    ::close(fd);
+                    throw std::runtime_error(error);
+                }
+                DisableSigPipe(fd);
+                return fd;
+            }
+
+            struct addrinfo hints;
+            std::memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+
+            struct addrinfo *result;
+            const int ret = ::getaddrinfo(hostOrPath.c_str(), port.c_str(), &hints, &result);
+            if (ret!=0)
+                throw std::runtime_error("Could not resolve \"" + address + "\": " + std::string(::gai_strerror(ret)));
+
+            int fd=-1;
+            for (struct addrinfo *rp = result; rp != NULL; rp = rp->ai_next) {
+                fd = ::socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+                if (fd<0) continue;
+                if (::connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) break;
+                ::close(fd);
+                fd=-1;
+            }
+            ::freeaddrinfo(result);
+
+            if (fd<0) throw std::runtime_error("Could not connect to \"" + address + "\"");
+
+            // messages are large and we always wait for the answer anyway
+            int flag=1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+            DisableSigPipe(fd);
+
+            return fd;
+        }
+
+        void SocketPair(int &socket1, int &socket2)
+        {
+            int fds[2];
+            if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+                throw std::runtime_error(ErrnoString("socketpair() failed"));
+            DisableSigPipe(fds[0]);
+            DisableSigPipe(fds[1]);
+            socket1=fds[0];
+            socket2=fds[1];
+        }
+
+        int Listen(const std::string &address)
+        {
+            bool isUnix; std::string hostOrPath, port;
+            ParseAddress(address, isUnix, hostOrPath, port);
+
+            if (isUnix) {
+                const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+                if (fd<0) throw std::runtime_error(ErrnoString("socket() failed"));
+
+                struct sockaddr_un addr;
+                std::memset(&addr, 0, sizeof(addr));
+                addr.sun_family = AF_UNIX;
+                std::strncpy(addr.sun_path, hostOrPath.c_str(), sizeof(addr.sun_path)-1);
+
+                if ((::bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) ||
+                    (::listen(fd, 4) != 0)) {
+                    const std::string error = ErrnoString("Could not listen on \"" + address + "\"");
+                    ::close(fd);
+                    throw std::runtime_error(error);
+                }
+                return fd;
+            }
+
+            struct addrinfo hints;
+            std::memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+
+            struct addrinfo *result;
+            const int ret = ::getaddrinfo(hostOrPath.empty()?NULL:hostOrPath.c_str(), port.c_str(), &hints, &result);
+            if (ret!=0)
+                throw std::runtime_error("Could not resolve \"" + address + "\": " + std::string(::gai_strerror(ret)));
+
+            int fd=-1;
+            for (struct addrinfo *rp = result; rp != NULL; rp = rp->ai_next) {
+                fd = ::socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+                if (fd<0) continue;
+                int flag=1;
+                ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+                if ((::bind(fd, rp->ai_addr, rp->ai_addrlen) == 0) &&
+                    (::listen(fd, 4) == 0)) break;
+                ::close(fd);
+                fd=-1;
+            }
+            ::freeaddrinfo(result);
+
+            if (fd<0) throw std::runtime_error("Could not listen on \"" + address + "\"");
+
+            return fd;
+        }
+
+        int Accept(int listenSocket, double timeout)
+        {
+            struct pollfd pfd;
+            pfd.fd = listenSocket;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+
+            const int ret = ::poll(&pfd, 1, static_cast<int>(timeout*1000.));
+            if (ret<0) {
+                if (errno==EINTR) return -1;
+                throw std::runtime_error(ErrnoString("poll() failed"));
+            }
+            if (ret==0) return -1; // timeout
+
+            const int fd = ::accept(listenSocket, NULL, NULL);
+            if (fd<0) {
+                if ((errno==EINTR) || (errno==EAGAIN) || (errno==ECONNABORTED)) return -1;
+                throw std::runtime_error(ErrnoString("accept() failed"));
+            }
+
+            int flag=1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)); // fails silently for unix sockets
+            DisableSigPipe(fd);
+
+            return fd;
+        }
+
+        void Shutdown(int socket)
+        {
+            if (socket>=0) ::shutdown(socket, SHUT_RDWR);
+        }
+
+        void Close(int socket)
+        {
+            if (socket>=0) ::close(socket);
+        }
+
+        void RemoveSocketFile(const std::string &address)
+        {
+            if (address.compare(0, 5, "unix:")!=0) return;
+            ::unlink(address.substr(5).c_str());
+        }
+
+        uint64_t ConfigurationHash(const std::vector<I3CLSimRandomValueConstPtr> &wlenGenerators,
+                                   I3CLSimFunctionConstPtr wlenBias,
+                                   I3CLSimMediumPropertiesConstPtr mediumProperties,
+                                   I3CLSimSimpleGeometryConstPtr geometry)
+        {
+            std::ostringstream os(std::ios::binary);
+            {
+                boost::archive::portable_binary_oarchive ar(os);
+                ar << wlenGenerators;
+                ar << wlenBias;
+                ar << mediumProperties;
+
+                // the geometry is not serializable, write its columns
+                const bool hasGeometry = static_cast<bool>(geometry);
+                ar << hasGeometry;
+                if (hasGeometry) {
+                    const double omRadius = geometry->GetOMRadius();
+                    ar << omRadius;
+                    ar << geometry->GetStringIDVector();
+                    ar << geometry->GetDomIDVector();
+                    ar << geometry->GetPosXVector();
+                    ar << geometry->GetPosYVector();
+                    ar << geometry->GetPosZVector();
+                    ar << geometry->GetSubdetectorVector();
+                }
+            }
+            const std::string data = os.str();
+
+            // 64-bit FNV-1a
+            uint64_t hash = 14695981039346656037ull;
+            for (std::size_t i=0;i<data.size();++i)
+            {
+                hash ^= static_cast<uint64_t>(static_cast<unsigned char>(data[i]));
+                hash *= 1099511628211ull;
+            }
+            return hash;
+        }
+
+        void SendHello(int socket, uint64_t workgroupSize, uint64_t maxNumWorkitems, uint64_t configurationHash)
+        {
+            Hello_t hello;
+            hello.version=protocolVersion;
+            hello.stepSize=sizeof(I3CLSimStep);
+            hello.photonSize=sizeof(I3CLSimPhoton);
+            hello.byteOrder=byteOrderMark;
+            hello.workgroupSize=workgroupSize;
+            hello.maxNumWorkitems=maxNumWorkitems;
+            hello.configurationHash=configurationHash;
+
+            SendHeader(socket, messageHello, 0, sizeof(Hello_t));
+            SendAll(socket, &hello, sizeof(Hello_t));
+        }
+
+        Hello_t ReceiveHello(int socket)
+        {
+            MessageHeader_t header;
+            if (!ReceiveHeader(socket, header))
+                throw std::runtime_error("Connection closed before the handshake");
+            ExpectType(header, messageHello);
+            if (header.payloadSize != sizeof(Hello_t))
+                throw std::runtime_error("Invalid handshake message size");
+
+            Hello_t hello;
+            ReceiveAllOrThrow(socket, &hello, sizeof(Hello_t));
+
+            if (hello.byteOrder == 0x04030201)
+                throw std::runtime_error("The other side uses a different byte order, this is not supported.");
+            if (hello.version != protocolVersion)
+                throw std::runtime_error("Protocol version mismatch (" + boost::lexical_cast<std::string>(hello.version) +
+                                         " vs. " + boost::lexical_cast<std::string>(protocolVersion) + ")");
+            if ((hello.stepSize != sizeof(I3CLSimStep)) || (hello.photonSize != sizeof(I3CLSimPhoton)))
+                throw std::runtime_error("I3CLSimStep/I3CLSimPhoton sizes do not match. Both sides need to run the same build of clsim.");
+
+            return hello;
+        }
+
+        void SendSteps(int socket, uint32_t identifier, const I3CLSimStepSeries &steps)
+        {
+            const uint64_t size = static_cast<uint64_t>(steps.size())*sizeof(I3CLSimStep);
+            SendHeader(socket, messageSteps, identifier, size);
+            if (size>0) SendAll(socket, &(steps[0]), size);
+        }
+
+        void SendResult(int socket, const I3CLSimStepToPhotonConverter::ConversionResult_t &result)
+        {
+            const I3CLSimPhotonSeriesView photons = result.GetPhotonView();
+            const uint64_t numPhotons = photons.size();
+            const uint32_t hasHistories = (result.photonHistories)?1:0;
+
+            if ((hasHistories) && (result.photonHistories->size() != numPhotons))
+                throw std::runtime_error("Number of photon histories does not match the number of photons");
+
+            // payload: number of photons, the photons, a flag, [the histories]
+            uint64_t size = sizeof(uint64_t) + numPhotons*sizeof(I3CLSimPhoton) + sizeof(uint32_t);
+            if (hasHistories) {
+                for (std::size_t i=0;i<numPhotons;++i) {
+                    size += sizeof(uint32_t) + (*result.photonHistories)[i].size()*4*sizeof(float);
+                }
+            }
+
+            SendHeader(socket, messagePhotons, result.identifier, size);
+            SendAll(socket, &numPhotons, sizeof(uint64_t));
+            if (numPhotons>0) SendAll(socket, photons.data(), numPhotons*sizeof(I3CLSimPhoton));
+            SendAll(socket, &hasHistories, sizeof(uint32_t));
+
+            if (!hasHistories) return;
+
+            std::vector<float> buffer;
+            for (std::size_t i=0;i<numPhotons;++i) {
+                const I3CLSimPhotonHistory &history = (*result.photonHistories)[i];
+                const uint32_t numEntries = history.size();
+                SendAll(socket, &numEntries, sizeof(uint32_t));
+                if (numEntries==0) continue;
+
+                buffer.resize(numEntries*4);
+                for (uint32_t j=0;j<numEntries;++j) {
+                    buffer[j*4+0]=history.GetX(j);
+                    buffer[j*4+1]=history.GetY(j);
+                    buffer[j*4+2]=history.GetZ(j);
+                    buffer[j*4+3]=history.GetDistanceInAbsorptionLengths(j);
+                }
+                SendAll(socket, &(buffer[0]), buffer.size()*sizeof(float));
+            }
+        }
+
+        void SendError(int socket, const std::string &message)
+        {
+            SendHeader(socket, messageError, 0, message.size());
+            if (!message.empty()) SendAll(socket, message.data(), message.size());
+        }
+
+        void SendLightSource(int socket, uint32_t identifier, const I3CLSimLightSource &lightSource)
+        {
+            const uint32_t type = static_cast<uint32_t>(lightSource.GetType());
+
+            std::ostringstream os(std::ios::binary);
+            {
+                boost::archive::portable_binary_oarchive ar(os);
+                if (lightSource.GetType() == I3CLSimLightSource::Particle) {
+                    ar << lightSource.GetParticle();
+                } else if (lightSource.GetType() == I3CLSimLightSource::Flasher) {
+                    ar << lightSource.GetFlasherPulse();
+                } else {
+                    throw std::runtime_error("Cannot send a light source of unknown type");
+                }
+            }
+            const std::string data = os.str();
+
+            SendHeader(socket, messageLightSource, identifier, sizeof(uint32_t)+data.size());
+            SendAll(socket, &type, sizeof(uint32_t));
+            if (!data.empty()) SendAll(socket, data.data(), data.size());
+        }
+
+        void SendMarker(int socket, uint32_t marker)
+        {
+            SendHeader(socket, messageMarker, marker, 0);
+        }
+
+        bool ReceiveHeader(int socket, MessageHeader_t &header)
+        {
+            unsigned char buffer[headerSize];
+            if (!ReceiveAll(socket, buffer, headerSize)) return false;
+
+            header.magic=static_cast<uint32_t>(GetLE(buffer+0, 4));
+            header.type=static_cast<uint32_t>(GetLE(buffer+4, 4));
+            header.identifier=static_cast<uint32_t>(GetLE(buffer+8, 4));
+            header.reserved=static_cast<uint32_t>(GetLE(buffer+12, 4));
+            header.payloadSize=GetLE(buffer+16, 8);
+
+            if (header.magic != protocolMagic)
+                throw std::runtime_error("Received a message with an invalid magic number. Is the other side running clsim?");
+            if (header.payloadSize > maxPayloadSize)
+                throw std::runtime_error("Received a message with an unreasonably large payload");
+
+            return true;
+        }
+
+        I3CLSimStepSeriesPtr ReceiveSteps(int socket, const MessageHeader_t &header)
+        {
+            ExpectType(header, messageSteps);
+            if (header.payloadSize % sizeof(I3CLSimStep) != 0)
+                throw std::runtime_error("Invalid step message size");
+
+            I3CLSimStepSeriesPtr steps(new I3CLSimStepSeries());
+            steps->resize(header.payloadSize/sizeof(I3CLSimStep));
+            if (!steps->empty()) ReceiveAllOrThrow(socket, &((*steps)[0]), header.payloadSize);
+            return steps;
+        }
+
+        I3CLSimStepToPhotonConverter::ConversionResult_t ReceiveResult(int socket, const MessageHeader_t &header)
+        {
+            ExpectType(header, messagePhotons);
+
+            uint64_t bytesLeft = header.payloadSize;
+            uint64_t numPhotons;
+            if (bytesLeft < sizeof(uint64_t)+sizeof(uint32_t))
+                throw std::runtime_error("Invalid photon message size");
+            ReceiveAllOrThrow(socket, &numPhotons, sizeof(uint64_t));
+            bytesLeft -= sizeof(uint64_t)+sizeof(uint32_t);
+            if (numPhotons > bytesLeft/sizeof(I3CLSimPhoton))
+                throw std::runtime_error("Invalid photon message size");
+
+            I3CLSimPhotonSeriesPtr photons(new I3CLSimPhotonSeries());
+            photons->resize(numPhotons);
+            if (numPhotons>0) ReceiveAllOrThrow(socket, &((*photons)[0]), numPhotons*sizeof(I3CLSimPhoton));
+            bytesLeft -= numPhotons*sizeof(I3CLSimPhoton);
+
+            uint32_t hasHistories;
+            ReceiveAllOrThrow(socket, &hasHistories, sizeof(uint32_t));
+
+            I3CLSimPhotonHistorySeriesPtr photonHistories;
+            if (hasHistories) {
+                photonHistories = I3CLSimPhotonHistorySeriesPtr(new I3CLSimPhotonHistorySeries());
+                photonHistories->resize(numPhotons);
+
+                std::vector<float> buffer;
+                for (uint64_t i=0;i<numPhotons;++i) {
+                    uint32_t numEntries;
+                    if (bytesLeft < sizeof(uint32_t))
+                        throw std::runtime_error("Invalid photon message size");
+                    ReceiveAllOrThrow(socket, &numEntries, sizeof(uint32_t));
+                    bytesLeft -= sizeof(uint32_t);
+                    if (numEntries==0) continue;
+
+                    if (static_cast<uint64_t>(numEntries)*4*sizeof(float) > bytesLeft)
+                        throw std::runtime_error("Invalid photon message size");
+                    buffer.resize(numEntries*4);
+                    ReceiveAllOrThrow(socket, &(buffer[0]), buffer.size()*sizeof(float));
+                    bytesLeft -= buffer.size()*sizeof(float);
+
+                    I3CLSimPhotonHistory &history = (*photonHistories)[i];
+                    for (uint32_t j=0;j<numEntries;++j) {
+                        history.push_back(buffer[j*4+0], buffer[j*4+1], buffer[j*4+2], buffer[j*4+3]);
+                    }
+                }
+            }
+
+            if (bytesLeft != 0)
+                throw std::runtime_error("Invalid photon message size");
+
+            return I3CLSimStepToPhotonConverter::ConversionResult_t(header.identifier, photons, photonHistories);
+        }
+
+        std::string ReceiveError(int socket, const MessageHeader_t &header)
+        {
+            ExpectType(header, messageError);
+
+            std::string message(header.payloadSize, '\0');
+            if (!message.empty()) ReceiveAllOrThrow(socket, &(message[0]), message.size());
+            return message;
+        }
+
+        I3CLSimLightSourcePtr ReceiveLightSource(int socket, const MessageHeader_t &header)
+        {
+            ExpectType(header, messageLightSource);
+            if (header.payloadSize < sizeof(uint32_t))
+                throw std::runtime_error("Invalid light source message size");
+
+            uint32_t type;
+            ReceiveAllOrThrow(socket, &type, sizeof(uint32_t));
+
+            std::string data(header.payloadSize-sizeof(uint32_t), '\0');
+            if (!data.empty()) ReceiveAllOrThrow(socket, &(data[0]), data.size());
+
+            std::istringstream is(data, std::ios::binary);
+            boost::archive::portable_binary_iarchive ar(is);
+
+            if (type == static_cast<uint32_t>(I3CLSimLightSource::Particle)) {
+                I3Particle particle;
+                ar >> particle;
+                return I3CLSimLightSourcePtr(new I3CLSimLightSource(particle));
+            } else if (type == static_cast<uint32_t>(I3CLSimLightSource::Flasher)) {
+                I3CLSimFlasherPulse flasherPulse;
+                ar >> flasherPulse;
+                return I3CLSimLightSourcePtr(new I3CLSimLightSource(flasherPulse));
+            }
+
+            throw std::runtime_error("Received a light source of unknown type");
+        }
+    };
+};
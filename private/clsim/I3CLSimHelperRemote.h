@@ -0,0 +1,148 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimHelperRemote.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMHELPERREMOTE_H_INCLUDED
+#define I3CLSIMHELPERREMOTE_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "clsim/I3CLSimStep.h"
+#include "clsim/I3CLSimLightSource.h"
+#include "clsim/I3CLSimStepToPhotonConverter.h"
+
+/**
+ * Socket and message helpers shared by I3CLSimStepToPhotonConverterRemote
+ * and I3CLSimStepToPhotonConverterServer. The Geant4 worker processes of
+ * I3CLSimLightSourceToStepConverterGeant4 use the same messages.
+ *
+ * Addresses are either "unix:/path/to/socket" for a local socket
+ * or "tcp:host:port". Message headers are sent in little-endian
+ * byte order. Steps and photons are sent in their binary
+ * in-memory layout, so both ends have to run the same build on
+ * the same architecture with the same byte order (this is checked
+ * when connecting). Both
+ * ends also exchange a hash of their converter configuration
+ * and refuse to talk to each other if it does not match.
+ *
+ * All functions throw std::runtime_error on errors.
+ */
+namespace I3CLSimHelper
+{
+    namespace Remote
+    {
+        const uint32_t protocolMagic = 0x434c5352; // "CLSR"
+        const uint32_t protocolVersion = 3;
+        
+        // sent in host byte order to detect peers with a different one
+        const uint32_t byteOrderMark = 0x01020304;
+        
+        enum MessageType_t
+        {
+            messageHello = 1,   // payload: Hello_t
+            messageSteps = 2,   // payload: I3CLSimSteps
+            messagePhotons = 3, // payload: a conversion result
+            messageError = 4,   // payload: the error message
+            messageLightSource = 5, // payload: a serialized I3CLSimLightSource
+            messageMarker = 6   // no payload, the identifier is the marker
+        };
+        
+        // sent as headerSize bytes in little-endian byte order
+        struct MessageHeader_t
+        {
+            uint32_t magic;
+            uint32_t type;
+            uint32_t identifier;
+            uint32_t reserved;
+            uint64_t payloadSize;
+        };
+        const std::size_t headerSize = 24;
+        
+        // sent by both sides when connecting
+        struct Hello_t
+        {
+            uint32_t version;
+            uint32_t stepSize;
+            uint32_t photonSize;
+            uint32_t byteOrder;       // byteOrderMark
+            uint64_t workgroupSize;   // only set by the server
+            uint64_t maxNumWorkitems; // only set by the server
+            uint64_t configurationHash;
+        };
+        
+        // returns a connected socket
+        int Connect(const std::string &address);
+        
+        // creates a pair of connected local sockets
+        void SocketPair(int &socket1, int &socket2);
+        
+        // returns a listening socket
+        int Listen(const std::string &address);
+        
+        // Returns a connected socket or -1 if no client
+        // connected within the timeout (in seconds).
+        int Accept(int listenSocket, double timeout);
+        
+        // Unblocks all threads waiting for the socket. Call
+        // Close() once these threads have been joined.
+        void Shutdown(int socket);
+        void Close(int socket);
+        
+        // removes the socket file of a "unix:" address
+        void RemoveSocketFile(const std::string &address);
+        
+        // Hash of the serialized wavelength generators, wavelength bias,
+        // medium properties and geometry. Pointers may be (null).
+        uint64_t ConfigurationHash(const std::vector<I3CLSimRandomValueConstPtr> &wlenGenerators,
+                                   I3CLSimFunctionConstPtr wlenBias,
+                                   I3CLSimMediumPropertiesConstPtr mediumProperties,
+                                   I3CLSimSimpleGeometryConstPtr geometry);
+        
+        void SendHello(int socket, uint64_t workgroupSize, uint64_t maxNumWorkitems, uint64_t configurationHash);
+        
+        // throws if the other side is not compatible
+        Hello_t ReceiveHello(int socket);
+        
+        void SendSteps(int socket, uint32_t identifier, const I3CLSimStepSeries &steps);
+        void SendResult(int socket, const I3CLSimStepToPhotonConverter::ConversionResult_t &result);
+        void SendError(int socket, const std::string &message);
+        void SendLightSource(int socket, uint32_t identifier, const I3CLSimLightSource &lightSource);
+        void SendMarker(int socket, uint32_t marker);
+        
+        // Returns false if the other side has closed the
+        // connection cleanly (i.e. between two messages).
+        bool ReceiveHeader(int socket, MessageHeader_t &header);
+        
+        // read the payload of the message described by "header"
+        I3CLSimStepSeriesPtr ReceiveSteps(int socket, const MessageHeader_t &header);
+        I3CLSimStepToPhotonConverter::ConversionResult_t ReceiveResult(int socket, const MessageHeader_t &header);
+        std::string ReceiveError(int socket, const MessageHeader_t &header);
+        I3CLSimLightSourcePtr ReceiveLightSource(int socket, const MessageHeader_t &header);
+    };
+};
+
+#endif //I3CLSIMHELPERREMOTE_H_INCLUDED
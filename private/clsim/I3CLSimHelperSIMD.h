@@ -0,0 +1,316 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimHelperSIMD.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMHELPERSIMD_H_INCLUDED
+#define I3CLSIMHELPERSIMD_H_INCLUDED
+
+#include <cmath>
+#include <cstddef>
+#include <stdint.h>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Minimal single precision SIMD "packets" for the native
+ * photon propagator. The instruction set is selected at
+ * compile time. The CLSIM_NATIVE_SIMD CMake option adds the
+ * necessary compiler flags for the native propagator:
+ *
+ *  - AVX-512F: 16 lanes (CLSIM_NATIVE_SIMD=AVX512)
+ *  - AVX2:      8 lanes (CLSIM_NATIVE_SIMD=AVX2)
+ *  - otherwise: 8 lanes using plain loops (the compiler
+ *               may or may not vectorize these)
+ *
+ * IsSupportedByCPU() checks at runtime whether the CPU
+ * actually implements the selected instruction set.
+ *
+ * Only the operations needed by the propagator are provided.
+ * Transcendental functions (log, sincos) are implemented
+ * on top of these primitives using the Cephes single
+ * precision polynomials, so all backends share the same
+ * approximations.
+ */
+namespace I3CLSimHelper
+{
+#if defined(__AVX512F__)
+
+    struct FloatPacket
+    {
+        static const std::size_t width = 16;
+        static const char *name() {return "AVX-512";}
+        static inline bool IsSupportedByCPU() {return __builtin_cpu_supports("avx512f");}
+
+        typedef __m512 vec_t;
+        typedef __mmask16 mask_t;
+
+        static inline vec_t load(const float *p) {return _mm512_loadu_ps(p);}
+        static inline void store(float *p, vec_t a) {_mm512_storeu_ps(p, a);}
+        static inline vec_t set1(float a) {return _mm512_set1_ps(a);}
+
+        static inline vec_t add(vec_t a, vec_t b) {return _mm512_add_ps(a, b);}
+        static inline vec_t sub(vec_t a, vec_t b) {return _mm512_sub_ps(a, b);}
+        static inline vec_t mul(vec_t a, vec_t b) {return _mm512_mul_ps(a, b);}
+        static inline vec_t div(vec_t a, vec_t b) {return _mm512_div_ps(a, b);}
+        static inline vec_t fmadd(vec_t a, vec_t b, vec_t c) {return _mm512_fmadd_ps(a, b, c);}
+        static inline vec_t min(vec_t a, vec_t b) {return _mm512_min_ps(a, b);}
+        static inline vec_t max(vec_t a, vec_t b) {return _mm512_max_ps(a, b);}
+        static inline vec_t sqrt(vec_t a) {return _mm512_sqrt_ps(a);}
+        static inline vec_t floor(vec_t a) {return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);}
+        static inline vec_t round(vec_t a) {return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);}
+
+        static inline mask_t less(vec_t a, vec_t b) {return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);}
+        static inline mask_t greater(vec_t a, vec_t b) {return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ);}
+        static inline mask_t equal(vec_t a, vec_t b) {return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ);}
+        static inline mask_t maskAnd(mask_t a, mask_t b) {return a & b;}
+        static inline mask_t maskFromLanes(const uint8_t *lanes)
+        {
+            mask_t m = 0;
+            for (std::size_t i=0;i<width;++i) if (lanes[i]) m |= static_cast<mask_t>(1u << i);
+            return m;
+        }
+
+        // m ? a : b
+        static inline vec_t select(mask_t m, vec_t a, vec_t b) {return _mm512_mask_blend_ps(m, b, a);}
+
+        // a = mant * 2^exp with mant in [1,2); only valid for positive, normal numbers
+        static inline void splitExponent(vec_t a, vec_t &mant, vec_t &exp)
+        {
+            mant = _mm512_getmant_ps(a, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_src);
+            exp = _mm512_getexp_ps(a);
+        }
+
+        // stores floor(a) as 32bit integers
+        static inline void storeFloorInt(int32_t *p, vec_t a)
+        {
+            _mm512_storeu_si512(reinterpret_cast<void *>(p), _mm512_cvt_roundps_epi32(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+        }
+    };
+
+#elif defined(__AVX2__)
+
+    struct FloatPacket
+    {
+        static const std::size_t width = 8;
+        static const char *name() {return "AVX2";}
+#ifdef __FMA__
+        static inline bool IsSupportedByCPU() {return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");}
+#else
+        static inline bool IsSupportedByCPU() {return __builtin_cpu_supports("avx2");}
+#endif
+
+        typedef __m256 vec_t;
+        typedef __m256 mask_t;
+
+        static inline vec_t load(const float *p) {return _mm256_loadu_ps(p);}
+        static inline void store(float *p, vec_t a) {_mm256_storeu_ps(p, a);}
+        static inline vec_t set1(float a) {return _mm256_set1_ps(a);}
+
+        static inline vec_t add(vec_t a, vec_t b) {return _mm256_add_ps(a, b);}
+        static inline vec_t sub(vec_t a, vec_t b) {return _mm256_sub_ps(a, b);}
+        static inline vec_t mul(vec_t a, vec_t b) {return _mm256_mul_ps(a, b);}
+        static inline vec_t div(vec_t a, vec_t b) {return _mm256_div_ps(a, b);}
+#ifdef __FMA__
+        static inline vec_t fmadd(vec_t a, vec_t b, vec_t c) {return _mm256_fmadd_ps(a, b, c);}
+#else
+        static inline vec_t fmadd(vec_t a, vec_t b, vec_t c) {return _mm256_add_ps(_mm256_mul_ps(a, b), c);}
+#endif
+        static inline vec_t min(vec_t a, vec_t b) {return _mm256_min_ps(a, b);}
+        static inline vec_t max(vec_t a, vec_t b) {return _mm256_max_ps(a, b);}
+        static inline vec_t sqrt(vec_t a) {return _mm256_sqrt_ps(a);}
+        static inline vec_t floor(vec_t a) {return _mm256_floor_ps(a);}
+        static inline vec_t round(vec_t a) {return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);}
+
+        static inline mask_t less(vec_t a, vec_t b) {return _mm256_cmp_ps(a, b, _CMP_LT_OQ);}
+        static inline mask_t greater(vec_t a, vec_t b) {return _mm256_cmp_ps(a, b, _CMP_GT_OQ);}
+        static inline mask_t equal(vec_t a, vec_t b) {return _mm256_cmp_ps(a, b, _CMP_EQ_OQ);}
+        static inline mask_t maskAnd(mask_t a, mask_t b) {return _mm256_and_ps(a, b);}
+        static inline mask_t maskFromLanes(const uint8_t *lanes)
+        {
+            int32_t bits[width];
+            for (std::size_t i=0;i<width;++i) bits[i] = lanes[i]?-1:0;
+            return _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(bits)));
+        }
+
+        // m ? a : b
+        static inline vec_t select(mask_t m, vec_t a, vec_t b) {return _mm256_blendv_ps(b, a, m);}
+
+        // a = mant * 2^exp with mant in [1,2); only valid for positive, normal numbers
+        static inline void splitExponent(vec_t a, vec_t &mant, vec_t &exp)
+        {
+            const __m256i bits = _mm256_castps_si256(a);
+            const __m256i e = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127));
+            const __m256i m = _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f800000));
+            mant = _mm256_castsi256_ps(m);
+            exp = _mm256_cvtepi32_ps(e);
+        }
+
+        // stores floor(a) as 32bit integers
+        static inline void storeFloorInt(int32_t *p, vec_t a)
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), _mm256_cvttps_epi32(_mm256_floor_ps(a)));
+        }
+    };
+
+#else
+
+    struct FloatPacket
+    {
+        static const std::size_t width = 8;
+        static const char *name() {return "generic";}
+        static inline bool IsSupportedByCPU() {return true;}
+
+        struct vec_t {float v[width];};
+        struct mask_t {bool v[width];};
+
+        static inline vec_t load(const float *p) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=p[i]; return r;}
+        static inline void store(float *p, const vec_t &a) {for (std::size_t i=0;i<width;++i) p[i]=a.v[i];}
+        static inline vec_t set1(float a) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=a; return r;}
+
+        static inline vec_t add(const vec_t &a, const vec_t &b) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=a.v[i]+b.v[i]; return r;}
+        static inline vec_t sub(const vec_t &a, const vec_t &b) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=a.v[i]-b.v[i]; return r;}
+        static inline vec_t mul(const vec_t &a, const vec_t &b) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=a.v[i]*b.v[i]; return r;}
+        static inline vec_t div(const vec_t &a, const vec_t &b) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=a.v[i]/b.v[i]; return r;}
+        static inline vec_t fmadd(const vec_t &a, const vec_t &b, const vec_t &c) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=a.v[i]*b.v[i]+c.v[i]; return r;}
+        static inline vec_t min(const vec_t &a, const vec_t &b) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=(b.v[i]<a.v[i])?b.v[i]:a.v[i]; return r;}
+        static inline vec_t max(const vec_t &a, const vec_t &b) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=(b.v[i]>a.v[i])?b.v[i]:a.v[i]; return r;}
+        static inline vec_t sqrt(const vec_t &a) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=std::sqrt(a.v[i]); return r;}
+        static inline vec_t floor(const vec_t &a) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=std::floor(a.v[i]); return r;}
+        static inline vec_t round(const vec_t &a) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=std::floor(a.v[i]+0.5f); return r;}
+
+        static inline mask_t less(const vec_t &a, const vec_t &b) {mask_t r; for (std::size_t i=0;i<width;++i) r.v[i]=(a.v[i]<b.v[i]); return r;}
+        static inline mask_t greater(const vec_t &a, const vec_t &b) {mask_t r; for (std::size_t i=0;i<width;++i) r.v[i]=(a.v[i]>b.v[i]); return r;}
+        static inline mask_t equal(const vec_t &a, const vec_t &b) {mask_t r; for (std::size_t i=0;i<width;++i) r.v[i]=(a.v[i]==b.v[i]); return r;}
+        static inline mask_t maskAnd(const mask_t &a, const mask_t &b) {mask_t r; for (std::size_t i=0;i<width;++i) r.v[i]=(a.v[i] && b.v[i]); return r;}
+        static inline mask_t maskFromLanes(const uint8_t *lanes) {mask_t r; for (std::size_t i=0;i<width;++i) r.v[i]=(lanes[i]!=0); return r;}
+
+        // m ? a : b
+        static inline vec_t select(const mask_t &m, const vec_t &a, const vec_t &b) {vec_t r; for (std::size_t i=0;i<width;++i) r.v[i]=m.v[i]?a.v[i]:b.v[i]; return r;}
+
+        // a = mant * 2^exp with mant in [1,2); only valid for positive, normal numbers
+        static inline void splitExponent(const vec_t &a, vec_t &mant, vec_t &exp)
+        {
+            for (std::size_t i=0;i<width;++i) {
+                int e;
+                mant.v[i] = 2.f*std::frexp(a.v[i], &e);
+                exp.v[i] = static_cast<float>(e-1);
+            }
+        }
+
+        // stores floor(a) as 32bit integers
+        static inline void storeFloorInt(int32_t *p, const vec_t &a)
+        {
+            for (std::size_t i=0;i<width;++i) p[i]=static_cast<int32_t>(std::floor(a.v[i]));
+        }
+    };
+
+#endif
+
+    /**
+     * Natural logarithm for positive, normal arguments
+     * (Cephes logf, relative error ~1e-7).
+     */
+    template <typename P>
+    inline typename P::vec_t packetLog(typename P::vec_t x)
+    {
+        typedef typename P::vec_t vec_t;
+
+        vec_t m, e;
+        P::splitExponent(x, m, e);
+
+        // move the mantissa to [sqrt(1/2), sqrt(2))
+        const typename P::mask_t big = P::greater(m, P::set1(1.41421356237f));
+        m = P::select(big, P::mul(m, P::set1(0.5f)), m);
+        e = P::select(big, P::add(e, P::set1(1.f)), e);
+
+        const vec_t f = P::sub(m, P::set1(1.f));
+        const vec_t z = P::mul(f, f);
+
+        vec_t y = P::set1(7.0376836292E-2f);
+        y = P::fmadd(y, f, P::set1(-1.1514610310E-1f));
+        y = P::fmadd(y, f, P::set1(1.1676998740E-1f));
+        y = P::fmadd(y, f, P::set1(-1.2420140846E-1f));
+        y = P::fmadd(y, f, P::set1(1.4249322787E-1f));
+        y = P::fmadd(y, f, P::set1(-1.6668057665E-1f));
+        y = P::fmadd(y, f, P::set1(2.0000714765E-1f));
+        y = P::fmadd(y, f, P::set1(-2.4999993993E-1f));
+        y = P::fmadd(y, f, P::set1(3.3333331174E-1f));
+        y = P::mul(P::mul(y, f), z);
+
+        y = P::fmadd(e, P::set1(-2.12194440E-4f), y);
+        y = P::fmadd(z, P::set1(-0.5f), y);
+
+        vec_t r = P::add(f, y);
+        r = P::fmadd(e, P::set1(0.693359375f), r);
+        return r;
+    }
+
+    /**
+     * Sine and cosine for arguments in [-pi,pi]
+     * (Cephes sinf/cosf polynomials).
+     */
+    template <typename P>
+    inline void packetSinCos(typename P::vec_t x, typename P::vec_t &s, typename P::vec_t &c)
+    {
+        typedef typename P::vec_t vec_t;
+
+        // reduce to [-pi/4,pi/4] using x = k*pi/2 + r
+        const vec_t k = P::round(P::mul(x, P::set1(0.63661977236758134f)));
+        vec_t r = P::fmadd(k, P::set1(-1.5703125f), x);
+        r = P::fmadd(k, P::set1(-4.837512969970703125E-4f), r);
+        r = P::fmadd(k, P::set1(-7.54978995489188216E-8f), r);
+
+        const vec_t r2 = P::mul(r, r);
+
+        vec_t ps = P::set1(-1.9515295891E-4f);
+        ps = P::fmadd(ps, r2, P::set1(8.3321608736E-3f));
+        ps = P::fmadd(ps, r2, P::set1(-1.6666654611E-1f));
+        ps = P::fmadd(P::mul(ps, r2), r, r);
+
+        vec_t pc = P::set1(2.443315711809948E-5f);
+        pc = P::fmadd(pc, r2, P::set1(-1.388731625493765E-3f));
+        pc = P::fmadd(pc, r2, P::set1(4.166664568298827E-2f));
+        pc = P::mul(P::mul(pc, r2), r2);
+        pc = P::fmadd(r2, P::set1(-0.5f), pc);
+        pc = P::add(pc, P::set1(1.f));
+
+        // quadrant q = k mod 4 (k is in [-2,2])
+        const vec_t q = P::sub(k, P::mul(P::set1(4.f), P::floor(P::mul(k, P::set1(0.25f)))));
+        const typename P::mask_t q1 = P::equal(q, P::set1(1.f));
+        const typename P::mask_t q2 = P::equal(q, P::set1(2.f));
+        const typename P::mask_t q3 = P::equal(q, P::set1(3.f));
+
+        const vec_t zero = P::set1(0.f);
+        const vec_t nps = P::sub(zero, ps);
+        const vec_t npc = P::sub(zero, pc);
+
+        s = P::select(q1, pc, P::select(q2, nps, P::select(q3, npc, ps)));
+        c = P::select(q1, nps, P::select(q2, npc, P::select(q3, ps, pc)));
+    }
+}
+
+#endif //I3CLSIMHELPERSIMD_H_INCLUDED
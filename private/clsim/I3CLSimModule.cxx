@@ -38,6 +38,7 @@
 
 #include "dataclasses/physics/I3MCTree.h"
 #include "dataclasses/physics/I3MCTreeUtils.h"
+#include "dataclasses/calibration/I3Calibration.h"
 
 #include "phys-services/I3SummaryService.h"
 
@@ -47,10 +48,12 @@
 #include "clsim/I3CLSimLightSourceToStepConverterGeant4.h"
 
 #include "clsim/I3CLSimModuleHelper.h"
+#include "clsim/I3CLSimPhotonSeriesColumns.h"
 
 #include <limits>
 #include <set>
 #include <deque>
+#include <algorithm>
 
 
 namespace {
@@ -122,7 +125,8 @@ geometryIsConfigured_(false)
 
     maxNumParallelEvents_=1000;
     AddParameter("MaxNumParallelEvents",
-                 "Maximum number of events that will be processed by the GPU in parallel.",
+                 "Maximum number of events that will be held by this module and processed in parallel.\n"
+                 "Events are pushed as soon as all of their photons are available.",
                  maxNumParallelEvents_);
 
     MCTreeName_="I3MCTree";
@@ -141,9 +145,40 @@ geometryIsConfigured_(false)
                  "Name of the I3CLSimPhotonSeriesMap frame object that will be written to the frame.",
                  photonSeriesMapName_);
 
+    MCPESeriesMapName_="";
+    AddParameter("MCPESeriesMapName",
+                 "If set, photons are converted to photo-electrons on the OpenCL devices and an\n"
+                 "I3MCPESeriesMap with this name is written instead of the I3PhotonSeriesMap. The\n"
+                 "wavelength and angular acceptances and the relative DOM efficiency from the last\n"
+                 "Calibration frame are applied in the kernel, so only photons that make a hit are\n"
+                 "transferred from the device. DOMs are assumed to face down. This needs StopDetectedPhotons\n"
+                 "and cannot be used with the native propagator or remote workers. The \"StatisticsName\"\n"
+                 "object will not contain the numbers of photons at the DOMs in this mode.",
+                 MCPESeriesMapName_);
+
+    wavelengthAcceptance_=I3CLSimFunctionConstPtr();
+    AddParameter("WavelengthAcceptance",
+                 "Wavelength acceptance of the DOMs as an I3CLSimFunction (used with \"MCPESeriesMapName\").",
+                 wavelengthAcceptance_);
+
+    angularAcceptance_=I3CLSimFunctionConstPtr();
+    AddParameter("AngularAcceptance",
+                 "Angular acceptance of the DOMs as an I3CLSimFunction of the cosine of the photon\n"
+                 "direction w.r.t. the PMT axis (used with \"MCPESeriesMapName\").",
+                 angularAcceptance_);
+
+    defaultRelativeDOMEfficiency_=1.;
+    AddParameter("DefaultRelativeDOMEfficiency",
+                 "Relative DOM efficiency for DOMs that do not have a valid entry in I3Calibration\n"
+                 "(used with \"MCPESeriesMapName\").",
+                 defaultRelativeDOMEfficiency_);
+
     omKeyMaskName_="";
     AddParameter("OMKeyMaskName",
-                 "Name of a I3VectorOMKey or I3VectorModuleKey with masked DOMs. DOMs in this list will not record I3Photons.",
+                 "Name of a I3VectorOMKey or I3VectorModuleKey with masked DOMs. DOMs in this list will not record I3Photons.\n"
+                 "With UseDOMGrid, masked DOMs are skipped on the device and photons pass through them\n"
+                 "if StopDetectedPhotons is set (OpenCL devices only, this cannot be combined with\n"
+                 "UseNativePropagator or RemoteWorkers).",
                  omKeyMaskName_);
 
     ignoreMuons_=false;
@@ -151,9 +186,11 @@ geometryIsConfigured_(false)
                  "If set to True, muons will not be propagated.",
                  ignoreMuons_);
 
+#ifndef I3CLSIM_WITHOUT_OPENCL
     AddParameter("OpenCLDeviceList",
                  "A vector of I3CLSimOpenCLDevice objects, describing the devices to be used for simulation.",
                  openCLDeviceList_);
+#endif
 
     DOMRadius_=0.16510*I3Units::m; // 13 inch diameter
     AddParameter("DOMRadius",
@@ -199,9 +236,16 @@ geometryIsConfigured_(false)
                  "Approximate maximum number of Cherenkov photons generated per step by Geant4.",
                  geant4MaxNumPhotonsPerStep_);
 
+    geant4NumWorkerProcesses_=0;
+    AddParameter("Geant4NumWorkerProcesses",
+                 "Run Geant4 in this many separate worker processes. Light sources are\n"
+                 "distributed among them. Set to 0 to run Geant4 in a thread of this process.",
+                 geant4NumWorkerProcesses_);
+
     statisticsName_="";
     AddParameter("StatisticsName",
-                 "Collect statistics in this frame object (e.g. number of photons generated or reaching the DOMs)",
+                 "Collect statistics in this frame object (e.g. number of photons generated or reaching the DOMs).\n"
+                 "Photons reaching the DOMs are not counted when using \"MCPESeriesMapName\".",
                  statisticsName_);
 
     AddParameter("IgnoreStrings",
@@ -247,6 +291,103 @@ geometryIsConfigured_(false)
                  "easy to observe.",
                  enableDoubleBuffering_);
 
+    numOpenCLBuffers_=0;
+    AddParameter("NumOpenCLBuffers",
+                 "Number of step/photon buffer sets in the OpenCL device pipeline. Steps are uploaded,\n"
+                 "propagated and downloaded using separate command queues, so with more than one buffer\n"
+                 "the device keeps working on queued bunches while results are copied back to the host.\n"
+                 "Each buffer set needs its own photon output buffer on the device.\n"
+                 "0 means 2 if EnableDoubleBuffering is set and 1 otherwise.",
+                 numOpenCLBuffers_);
+
+    useMappedOpenCLBuffers_=false;
+    AddParameter("UseMappedOpenCLBuffers",
+                 "Transfer steps and photons through pinned host buffers that stay mapped\n"
+                 "for the lifetime of the module. Steps are uploaded from and photons downloaded\n"
+                 "into this memory directly instead of going through the driver's staging buffers,\n"
+                 "and photons are converted straight from the mapped memory without allocating\n"
+                 "an intermediate photon series for each kernel call.",
+                 useMappedOpenCLBuffers_);
+
+    compactPhotonOutput_=false;
+    AddParameter("CompactPhotonOutput",
+                 "Let the OpenCL kernel write a compact 40 byte record for each detected photon\n"
+                 "instead of the full 80 byte one. Directions, wavelengths and the position relative\n"
+                 "to the DOM are stored with half precision and expanded on the host. The start\n"
+                 "position, time and direction of photons are not available in this mode.\n"
+                 "Cannot be used together with SaveAllPhotons or PhotonHistoryEntries.",
+                 compactPhotonOutput_);
+
+    mediumPropertiesLookupTableBins_=0;
+    AddParameter("MediumPropertiesLookupTableBins",
+                 "If set to a value > 1, all wavelength-dependent medium properties are sampled\n"
+                 "for each layer on a grid of this many wavelength bins when the kernel is compiled.\n"
+                 "The kernel interpolates linearly in these tables instead of evaluating the\n"
+                 "original functions. Set to 0 to disable.",
+                 mediumPropertiesLookupTableBins_);
+
+    opticalDepthTableBins_=0;
+    AddParameter("OpticalDepthTableBins",
+                 "If set to a value > 1, the cumulative optical depth below each ice layer is\n"
+                 "tabulated for this many wavelength bins. The kernel uses these tables to find\n"
+                 "the layer of the next scatter or absorption with a binary search instead of\n"
+                 "stepping through the layers one by one. This mostly helps photons that travel\n"
+                 "through many layers (e.g. with FixedNumberOfAbsorptionLengths). Set to 0 to disable.",
+                 opticalDepthTableBins_);
+
+    useDOMGrid_=false;
+    AddParameter("UseDOMGrid",
+                 "Use a uniform 3D grid of cells for finding the DOMs a photon might hit instead of\n"
+                 "the default 2D grid of strings. The grid is uploaded to the device as buffers and works\n"
+                 "with any DOM layout (tilted strings, DOM clusters, very large detectors, ...).\n"
+                 "The compiled kernel does not depend on the geometry, so this also allows more than\n"
+                 "one Geometry frame per file (each one only costs a buffer upload).",
+                 useDOMGrid_);
+
+    distanceCullingMargin_=NAN;
+    AddParameter("DistanceCullingMargin",
+                 "If set (i.e. not NaN), photons are stopped as soon as they cannot reach any DOM\n"
+                 "anymore. A coarse field with the distance to the closest DOM is calculated from the\n"
+                 "geometry and a photon is dropped once this distance is larger than its remaining\n"
+                 "absorption lengths plus this margin (in units of the largest absorption length of\n"
+                 "the medium). This does not change the results, but saves time for light sources\n"
+                 "far away from most DOMs. It has no effect with SaveAllPhotons or the native propagator.",
+                 distanceCullingMargin_);
+
+    stepPreCullingProbability_=0.;
+    AddParameter("StepPreCullingProbability",
+                 "If larger than 0, steps are thinned out before they are sent to the devices if an\n"
+                 "upper limit on the probability of their photons reaching any DOM is smaller than\n"
+                 "this value. The limit is calculated from the distance to the closest DOM and the\n"
+                 "absorption lengths of the medium layers in between. Photons of such steps are only\n"
+                 "kept with a probability of (limit/StepPreCullingProbability) and their weights are\n"
+                 "scaled up accordingly, so the results are unbiased on average. Photon weights can\n"
+                 "be larger than 1 with this option. Cannot be used with \"SaveAllPhotons\".",
+                 stepPreCullingProbability_);
+
+    photonSplittingFactor_=1;
+    AddParameter("PhotonSplittingFactor",
+                 "If larger than 1, photons that get closer to a DOM than \"PhotonSplittingDistance\"\n"
+                 "are split into this number of copies, each with a fraction of the original weight.\n"
+                 "Photons that get further away from all DOMs than \"PhotonRouletteDistance\" survive\n"
+                 "with a probability of 1/PhotonSplittingFactor and their weight is scaled up accordingly.\n"
+                 "This gives more (lower-weight) photons per DOM for the same number of generated\n"
+                 "photons. Photon weights can be larger than 1 with this option. Cannot be used with\n"
+                 "\"SaveAllPhotons\" or \"PhotonHistoryEntries\" and has no effect with the native propagator.",
+                 photonSplittingFactor_);
+
+    photonSplittingDistance_=10.*I3Units::m;
+    AddParameter("PhotonSplittingDistance",
+                 "Photons closer to a DOM than this are split (see \"PhotonSplittingFactor\").\n"
+                 "Distances are lower bounds from a coarse distance field of the geometry.",
+                 photonSplittingDistance_);
+
+    photonRouletteDistance_=100.*I3Units::m;
+    AddParameter("PhotonRouletteDistance",
+                 "Photons further away from all DOMs than this play Russian roulette\n"
+                 "(see \"PhotonSplittingFactor\").",
+                 photonRouletteDistance_);
+
     doublePrecision_=false;
     AddParameter("DoublePrecision",
                  "Enables double-precision support in the kernel. This slows down calculations and\n"
@@ -291,10 +432,31 @@ geometryIsConfigured_(false)
                  "If set to zero (the default) the largest possible workgroup size will be chosen.",
                  limitWorkgroupSize_);
 
+    useNativePropagator_=false;
+    AddParameter("UseNativePropagator",
+                 "Propagate photons on the host CPU using a multi-threaded C++ implementation\n"
+                 "of the OpenCL kernel. It is used in addition to all devices in \"OpenCLDeviceList\"\n"
+                 "and does not require an OpenCL runtime.",
+                 useNativePropagator_);
+
+    numNativePropagatorThreads_=0;
+    AddParameter("NumNativePropagatorThreads",
+                 "The number of threads used by the native propagator. If set to zero (the default)\n"
+                 "one thread per available hardware core will be used.",
+                 numNativePropagatorThreads_);
+
+    AddParameter("RemoteWorkers",
+                 "Addresses of worker processes running an I3CLSimStepToPhotonConverterServer,\n"
+                 "either \"unix:/path/to/socket\" or \"tcp:host:port\". Steps are distributed among these\n"
+                 "in addition to all other devices. The workers have to be configured exactly like this module\n"
+                 "(ice model, geometry, wavelength bias etc.) and run the same build of clsim. Workers with\n"
+                 "a different configuration are rejected when connecting.",
+                 remoteWorkers_);
+
     // add an outbox
     AddOutBox("OutBox");
 
-    frameListPhysicsFrameCounter_=0;
+    frameCacheFirstEntry_=0;
 }
 
 I3CLSimModule::~I3CLSimModule()
@@ -320,6 +482,12 @@ void I3CLSimModule::StartThread()
     photonNumGeneratedPerParticle_.clear();
     photonWeightSumGeneratedPerParticle_.clear();
     
+    // the thread numbers its bunches starting from 0
+    nextBunchToComplete_=0;
+    bunchesCompletedOutOfOrder_.clear();
+    flushMarkersReached_ = boost::shared_ptr<I3CLSimQueue<std::pair<uint32_t, uint32_t> > >
+    (new I3CLSimQueue<std::pair<uint32_t, uint32_t> >(0)); // no maximum size
+    
     // re-set flags
     threadStarted_=false;
     threadFinishedOK_=false;
@@ -387,11 +555,17 @@ void I3CLSimModule::Configure()
     GetParameter("MCTreeName", MCTreeName_);
     GetParameter("FlasherPulseSeriesName", flasherPulseSeriesName_);
     GetParameter("PhotonSeriesMapName", photonSeriesMapName_);
+    GetParameter("MCPESeriesMapName", MCPESeriesMapName_);
+    GetParameter("WavelengthAcceptance", wavelengthAcceptance_);
+    GetParameter("AngularAcceptance", angularAcceptance_);
+    GetParameter("DefaultRelativeDOMEfficiency", defaultRelativeDOMEfficiency_);
     GetParameter("OMKeyMaskName", omKeyMaskName_);
     GetParameter("IgnoreMuons", ignoreMuons_);
     GetParameter("ParameterizationList", parameterizationList_);
 
+#ifndef I3CLSIM_WITHOUT_OPENCL
     GetParameter("OpenCLDeviceList", openCLDeviceList_);
+#endif
 
     GetParameter("DOMRadius", DOMRadius_);
     GetParameter("DOMOversizeFactor", DOMOversizeFactor_);
@@ -402,6 +576,7 @@ void I3CLSimModule::Configure()
     GetParameter("Geant4PhysicsListName", geant4PhysicsListName_);
     GetParameter("Geant4MaxBetaChangePerStep", geant4MaxBetaChangePerStep_);
     GetParameter("Geant4MaxNumPhotonsPerStep", geant4MaxNumPhotonsPerStep_);
+    GetParameter("Geant4NumWorkerProcesses", geant4NumWorkerProcesses_);
 
     GetParameter("StatisticsName", statisticsName_);
     collectStatistics_ = (statisticsName_!="");
@@ -415,6 +590,17 @@ void I3CLSimModule::Configure()
     GetParameter("UseHardcodedDeepCoreSubdetector", useHardcodedDeepCoreSubdetector_);
 
     GetParameter("EnableDoubleBuffering", enableDoubleBuffering_);
+    GetParameter("NumOpenCLBuffers", numOpenCLBuffers_);
+    GetParameter("UseMappedOpenCLBuffers", useMappedOpenCLBuffers_);
+    GetParameter("CompactPhotonOutput", compactPhotonOutput_);
+    GetParameter("MediumPropertiesLookupTableBins", mediumPropertiesLookupTableBins_);
+    GetParameter("OpticalDepthTableBins", opticalDepthTableBins_);
+    GetParameter("UseDOMGrid", useDOMGrid_);
+    GetParameter("DistanceCullingMargin", distanceCullingMargin_);
+    GetParameter("StepPreCullingProbability", stepPreCullingProbability_);
+    GetParameter("PhotonSplittingFactor", photonSplittingFactor_);
+    GetParameter("PhotonSplittingDistance", photonSplittingDistance_);
+    GetParameter("PhotonRouletteDistance", photonRouletteDistance_);
     GetParameter("DoublePrecision", doublePrecision_);
     GetParameter("StopDetectedPhotons", stopDetectedPhotons_);
     GetParameter("SaveAllPhotons", saveAllPhotons_);
@@ -426,6 +612,11 @@ void I3CLSimModule::Configure()
 
     GetParameter("LimitWorkgroupSize", limitWorkgroupSize_);
 
+    GetParameter("UseNativePropagator", useNativePropagator_);
+    GetParameter("NumNativePropagatorThreads", numNativePropagatorThreads_);
+
+    GetParameter("RemoteWorkers", remoteWorkers_);
+
     if (pancakeFactor_ != DOMOversizeFactor_) {
         log_warn("***** You set the \"DOMOversizeFactor\" to a different value than the \"DOMPancakeFactor\". Be sure you know what you are doing!");
     }
@@ -434,6 +625,49 @@ void I3CLSimModule::Configure()
         log_fatal("The \"SaveAllPhotons\" option cannot be used when \"StopDetectedPhotons\" is active.");
     }
     
+    if ((isnan(stepPreCullingProbability_)) || (stepPreCullingProbability_ < 0.) || (stepPreCullingProbability_ > 1.))
+        log_fatal("The \"StepPreCullingProbability\" parameter has to be between 0 and 1.");
+    
+    if ((saveAllPhotons_) && (stepPreCullingProbability_ > 0.)) {
+        log_fatal("The \"SaveAllPhotons\" option cannot be used with \"StepPreCullingProbability\".");
+    }
+    
+    if (photonSplittingFactor_ < 1)
+        log_fatal("The \"PhotonSplittingFactor\" parameter has to be at least 1.");
+    
+    if ((photonSplittingFactor_ > 1) && (saveAllPhotons_))
+        log_fatal("The \"SaveAllPhotons\" option cannot be used with \"PhotonSplittingFactor\".");
+    
+    if ((photonSplittingFactor_ > 1) && (photonHistoryEntries_ > 0))
+        log_fatal("The \"PhotonHistoryEntries\" option cannot be used with \"PhotonSplittingFactor\".");
+    
+    if ((photonSplittingFactor_ > 1) && (photonSplittingDistance_ >= photonRouletteDistance_))
+        log_fatal("\"PhotonSplittingDistance\" has to be smaller than \"PhotonRouletteDistance\".");
+    
+    if (MCPESeriesMapName_ != "")
+    {
+        if ((!wavelengthAcceptance_) || (!angularAcceptance_))
+            log_fatal("\"MCPESeriesMapName\" needs both \"WavelengthAcceptance\" and \"AngularAcceptance\".");
+        if (!stopDetectedPhotons_)
+            log_fatal("\"MCPESeriesMapName\" can only be used when \"StopDetectedPhotons\" is active.");
+        if ((saveAllPhotons_) || (photonHistoryEntries_ > 0) || (compactPhotonOutput_))
+            log_fatal("\"MCPESeriesMapName\" cannot be used with \"SaveAllPhotons\", \"PhotonHistoryEntries\" or \"CompactPhotonOutput\".");
+#ifdef I3CLSIM_WITHOUT_OPENCL
+        log_fatal("\"MCPESeriesMapName\" needs OpenCL devices, but clsim has been built without OpenCL support.");
+#endif
+        if ((useNativePropagator_) || (!remoteWorkers_.empty()))
+            log_fatal("\"MCPESeriesMapName\" needs OpenCL devices, it cannot be used with \"UseNativePropagator\" or \"RemoteWorkers\".");
+        if ((isnan(defaultRelativeDOMEfficiency_)) || (defaultRelativeDOMEfficiency_ < 0.))
+            log_fatal("The \"DefaultRelativeDOMEfficiency\" parameter has to be >= 0.");
+    }
+    
+    // Masked DOMs are only skipped on OpenCL devices. Everywhere else
+    // they would stop photons, so the result would depend on the
+    // device a bunch of steps ends up on.
+    if ((useDOMGrid_) && (omKeyMaskName_ != "") && (stopDetectedPhotons_) && (!saveAllPhotons_) &&
+        ((useNativePropagator_) || (!remoteWorkers_.empty())))
+        log_fatal("\"OMKeyMaskName\" with \"UseDOMGrid\" and \"StopDetectedPhotons\" needs OpenCL devices, it cannot be used with \"UseNativePropagator\" or \"RemoteWorkers\".");
+    
     if ((flasherPulseSeriesName_=="") && (MCTreeName_==""))
         log_fatal("You need to set at least one of the \"MCTreeName\" and \"FlasherPulseSeriesName\" parameters.");
     
@@ -444,12 +678,14 @@ void I3CLSimModule::Configure()
     if (!mediumProperties_) log_fatal("You have to specify the \"MediumProperties\" parameter!");
 
     if (maxNumParallelEvents_ <= 0) log_fatal("Values <= 0 are invalid for the \"MaxNumParallelEvents\" parameter!");
-    // maxNumParallelEvents_ is the number of frames buffered by this module.
-    // Since we use double-buffering, divide the number by 2.
-    maxNumParallelEvents_ /= 2;
-    if (maxNumParallelEvents_==0) maxNumParallelEvents_=1;
 
-    if (openCLDeviceList_.empty()) log_fatal("You have to provide at least one OpenCL device using the \"OpenCLDeviceList\" parameter.");
+#ifndef I3CLSIM_WITHOUT_OPENCL
+    if ((openCLDeviceList_.empty()) && (!useNativePropagator_) && (remoteWorkers_.empty()))
+        log_fatal("You have to provide at least one OpenCL device using the \"OpenCLDeviceList\" parameter, set \"UseNativePropagator\" or configure \"RemoteWorkers\".");
+#else
+    if ((!useNativePropagator_) && (remoteWorkers_.empty()))
+        log_fatal("clsim has been built without OpenCL support. You have to set \"UseNativePropagator\" or configure \"RemoteWorkers\".");
+#endif
     
     // fill wavelengthGenerators_[0] (index 0 is the Cherenkov generator)
     wavelengthGenerators_.clear();
@@ -479,6 +715,7 @@ void I3CLSimModule::Configure()
     }
 
     currentParticleCacheIndex_ = 1;
+    currentFlushMarker_ = 1;
     geometryIsConfigured_ = false;
     totalSimulatedEnergyForFlush_ = 0.;
     totalNumParticlesForFlush_ = 0;
@@ -513,9 +750,6 @@ void I3CLSimModule::Configure()
 
 bool I3CLSimModule::Thread(boost::this_thread::disable_interruption &di)
 {
-    // do some setup while the main thread waits..
-    numBunchesSentToOpenCL_.assign(openCLStepsToPhotonsConverters_.size(), 0);
-    
     // notify the main thread that everything is set up
     {
         boost::unique_lock<boost::mutex> guard(threadStarted_mutex_);
@@ -525,24 +759,30 @@ bool I3CLSimModule::Thread(boost::this_thread::disable_interruption &di)
 
     // the main thread is running again
     
+    // bunch identifiers are consecutive, the main thread relies on that
     uint32_t counter=0;
-    std::size_t lastDeviceIndexToUse=0;
     
     for (;;)
     {
         // retrieve steps from Geant4
         I3CLSimStepSeriesConstPtr steps;
+        uint32_t flushMarker=0;
         bool barrierWasJustReset=false;
         
         {
             boost::this_thread::restore_interruption ri(di);
             try {
-                steps = geant4ParticleToStepsConverter_->GetConversionResultWithBarrierInfo(barrierWasJustReset);
+                steps = geant4ParticleToStepsConverter_->GetConversionResultWithMarkerInfo(flushMarker, barrierWasJustReset);
             } catch(boost::thread_interrupted &i) {
                 return false;
+            } catch(I3CLSimLightSourceToStepConverter_exception &e) {
+                log_fatal("Geant4 failed: %s", e.what());
             }
         }
         
+        // thin out steps that will most probably not reach any DOM
+        if (stepPreCuller_) steps = stepPreCuller_->Process(steps);
+        
         if (!steps) 
         {
             log_debug("Got NULL I3CLSimStepSeriesConstPtr from Geant4.");
@@ -556,10 +796,30 @@ bool I3CLSimModule::Thread(boost::this_thread::disable_interruption &di)
             log_debug("Got %zu steps from Geant4, sending them to OpenCL",
                      steps->size());
 
+            // tell the devices which DOM mask to use for each step
+            {
+                boost::unique_lock<boost::mutex> guard(domMaskIndexPerParticle_mutex_);
+
+                if (!domMaskIndexPerParticle_.empty())
+                {
+                    I3CLSimStepSeriesPtr maskedSteps(new I3CLSimStepSeries(*steps));
+                    
+                    BOOST_FOREACH(I3CLSimStep &step, *maskedSteps)
+                    {
+                        std::map<uint32_t, uint16_t>::const_iterator it = domMaskIndexPerParticle_.find(step.identifier);
+                        step.SetDummy2((it==domMaskIndexPerParticle_.end())?0:it->second);
+                    }
+                    
+                    steps = maskedSteps;
+                }
+            }
+
             
             // collect statistics if requested
             if (collectStatistics_)
             {
+                boost::unique_lock<boost::mutex> guard(photonsGeneratedPerParticle_mutex_);
+
                 BOOST_FOREACH(const I3CLSimStep &step, *steps)
                 {
                     const uint32_t particleID = step.identifier;
@@ -575,41 +835,28 @@ bool I3CLSimModule::Thread(boost::this_thread::disable_interruption &di)
                 }
             }
 
-            // determine which OpenCL device to use
-            std::vector<std::size_t> fillLevels(openCLStepsToPhotonsConverters_.size());
-            for (std::size_t i=0;i<openCLStepsToPhotonsConverters_.size();++i)
-            {
-                fillLevels[i]=openCLStepsToPhotonsConverters_[i]->QueueSize();
-            }
-            
-            std::size_t minimumFillLevel = fillLevels[0];
-            for (std::size_t i=1;i<openCLStepsToPhotonsConverters_.size();++i)
-            {
-                if (fillLevels[i] < minimumFillLevel)
-                {
-                    minimumFillLevel=fillLevels[i];
-                }
-            }
-            
-            std::size_t deviceIndexToUse=lastDeviceIndexToUse;
-            do {
-                ++deviceIndexToUse;
-                if (deviceIndexToUse>=fillLevels.size()) deviceIndexToUse=0;
-            } while (fillLevels[deviceIndexToUse] != minimumFillLevel);
-            lastDeviceIndexToUse=deviceIndexToUse;
-            
-            // send to OpenCL
+            // send to OpenCL (the scheduler decides which device to use)
             {
                 boost::this_thread::restore_interruption ri(di);
                 try {
-                    openCLStepsToPhotonsConverters_[deviceIndexToUse]->EnqueueSteps(steps, counter);
+                    stepBunchScheduler_->EnqueueSteps(steps, counter);
                 } catch(boost::thread_interrupted &i) {
                     return false;
+                } catch(I3CLSimStepToPhotonConverter_exception &e) {
+                    // a device failed, the main thread reports it
+                    // when it asks the scheduler for results
+                    log_debug("stopping: %s", e.what());
+                    return false;
                 }
             }
             
-            ++numBunchesSentToOpenCL_[deviceIndexToUse];
-            ++counter; // this may overflow, but it is not used for anything important/unique
+            ++counter; // this will overflow, the main thread compares identifiers modulo 2^32
+        }
+        
+        if (flushMarker!=0) {
+            // all steps of the frames up to this marker are on their way
+            log_trace("Geant4 flush marker %" PRIu32 " has been reached.", flushMarker);
+            flushMarkersReached_->Put(std::make_pair(flushMarker, counter));
         }
         
         if (barrierWasJustReset) {
@@ -647,7 +894,19 @@ void I3CLSimModule::DigestGeometry(I3FramePtr frame)
     log_trace("%s", __PRETTY_FUNCTION__);
     
     if (geometryIsConfigured_)
-        log_fatal("This module currently supports only a single geometry per input file.");
+    {
+        if (!useDOMGrid_)
+            log_fatal("This module only supports a single geometry per input file unless \"UseDOMGrid\" is enabled.");
+        if (useNativePropagator_)
+            log_fatal("The native propagator does not support more than one geometry per input file.");
+        if (!remoteWorkers_.empty())
+            log_fatal("Remote workers do not support more than one geometry per input file.");
+        
+        // the new geometry applies to all frames from here on,
+        // finish everything that came before it
+        log_info("New Geometry frame, waiting for all pending frames..");
+        FlushFrameCache(0);
+    }
     
     //log_debug("Retrieving geometry..");
     //I3GeometryConstPtr geometryObject = frame->Get<I3GeometryConstPtr>();
@@ -696,13 +955,75 @@ void I3CLSimModule::DigestGeometry(I3FramePtr frame)
         );
     }
     
+    if (geometryIsConfigured_)
+    {
+        // the kernels do not depend on the geometry, just upload the new one
+        log_info("Uploading the new geometry..");
+#ifndef I3CLSIM_WITHOUT_OPENCL
+        BOOST_FOREACH(I3CLSimStepToPhotonConverterOpenCLPtr &converter, openCLStepsToPhotonsConverters_)
+        {
+            converter->UpdateGeometry(geometry_);
+        }
+#endif
+        if (stepPreCuller_) stepPreCuller_->UpdateGeometry(geometry_);
+        domMaskIndices_.clear(); // the converters do not keep masks for the old geometry
+        log_info("Geometry update complete.");
+        return;
+    }
+    
+    // Geant4 worker processes are forked from this process. Do this
+    // before any step-to-photon converter starts its threads.
+    log_info("Starting Geant4..");
+    geant4ParticleToStepsConverter_ =
+    I3CLSimModuleHelper::createGeant4(randomService_,
+                                      mediumProperties_,
+                                      wavelengthGenerationBias_,
+                                      parameterizationList_,
+                                      geant4PhysicsListName_,
+                                      geant4MaxBetaChangePerStep_,
+                                      geant4MaxNumPhotonsPerStep_,
+                                      geant4NumWorkerProcesses_);
+    
     log_info("Initializing CLSim..");
     // initialize OpenCL converters
+    stepBunchScheduler_.reset(); // its feeder threads use the converters
+#ifndef I3CLSIM_WITHOUT_OPENCL
     openCLStepsToPhotonsConverters_.clear();
+#endif
+    remoteStepsToPhotonsConverters_.clear();
+    nativeStepsToPhotonsConverter_.reset();
+    stepsToPhotonsConverters_.clear();
     
     uint64_t granularity=0;
     uint64_t maxBunchSize=0;
     
+#ifndef I3CLSIM_WITHOUT_OPENCL
+    I3CLSimModuleHelper::OpenCLOptions openCLOptions;
+    openCLOptions.enableDoubleBuffering = enableDoubleBuffering_;
+    openCLOptions.doublePrecision = doublePrecision_;
+    openCLOptions.stopDetectedPhotons = stopDetectedPhotons_;
+    openCLOptions.saveAllPhotons = saveAllPhotons_;
+    openCLOptions.saveAllPhotonsPrescale = saveAllPhotonsPrescale_;
+    openCLOptions.fixedNumberOfAbsorptionLengths = fixedNumberOfAbsorptionLengths_;
+    openCLOptions.pancakeFactor = pancakeFactor_;
+    openCLOptions.photonHistoryEntries = photonHistoryEntries_;
+    openCLOptions.limitWorkgroupSize = limitWorkgroupSize_;
+    openCLOptions.numBuffers = numOpenCLBuffers_;
+    openCLOptions.useMappedBuffers = useMappedOpenCLBuffers_;
+    openCLOptions.compactPhotonOutput = compactPhotonOutput_;
+    openCLOptions.mediumPropertiesLookupTableBins = mediumPropertiesLookupTableBins_;
+    openCLOptions.opticalDepthTableBins = opticalDepthTableBins_;
+    openCLOptions.useDOMGrid = useDOMGrid_;
+    openCLOptions.distanceCullingMargin = distanceCullingMargin_;
+    openCLOptions.photonSplittingFactor = photonSplittingFactor_;
+    openCLOptions.photonSplittingDistance = photonSplittingDistance_;
+    openCLOptions.photonRouletteDistance = photonRouletteDistance_;
+    if (MCPESeriesMapName_ != "") {
+        openCLOptions.hitWavelengthAcceptance = wavelengthAcceptance_;
+        openCLOptions.hitAngularAcceptance = angularAcceptance_;
+        openCLOptions.hitOversizeFactor = DOMOversizeFactor_;
+    }
+    
     BOOST_FOREACH(const I3CLSimOpenCLDevice &openCLdevice, openCLDeviceList_)
     {
 #ifdef I3_LOG4CPLUS_LOGGING
@@ -720,24 +1041,20 @@ void I3CLSimModule::DigestGeometry(I3FramePtr frame)
                                               mediumProperties_,
                                               wavelengthGenerationBias_,
                                               wavelengthGenerators_,
-                                              enableDoubleBuffering_,
-                                              doublePrecision_,
-                                              stopDetectedPhotons_,
-                                              saveAllPhotons_,
-                                              saveAllPhotonsPrescale_,
-                                              fixedNumberOfAbsorptionLengths_,
-                                              pancakeFactor_,
-                                              photonHistoryEntries_,
-                                              limitWorkgroupSize_);
+                                              openCLOptions);
         if (!openCLStepsToPhotonsConverter)
             log_fatal("Could not initialize OpenCL!");
         
+        if (MCPESeriesMapName_ != "")
+            openCLStepsToPhotonsConverter->SetHitDOMEfficiencies(hitDOMEfficiencies_, defaultRelativeDOMEfficiency_);
+        
         if (openCLStepsToPhotonsConverter->GetWorkgroupSize()==0)
             log_fatal("Internal error: converter.GetWorkgroupSize()==0.");
         if (openCLStepsToPhotonsConverter->GetMaxNumWorkitems()==0)
             log_fatal("Internal error: converter.GetMaxNumWorkitems()==0.");
         
         openCLStepsToPhotonsConverters_.push_back(openCLStepsToPhotonsConverter);
+        stepsToPhotonsConverters_.push_back(openCLStepsToPhotonsConverter);
         
         if (granularity==0) {
             granularity = openCLStepsToPhotonsConverter->GetWorkgroupSize();
@@ -784,21 +1101,107 @@ void I3CLSimModule::DigestGeometry(I3FramePtr frame)
         }
         
     }
+#endif
+    
+    BOOST_FOREACH(const std::string &address, remoteWorkers_)
+    {
+        log_info(" -> remote worker at %s", address.c_str());
+        
+        I3CLSimStepToPhotonConverterRemotePtr remoteStepsToPhotonsConverter(new I3CLSimStepToPhotonConverterRemote(address));
+        
+        // the worker has its own configuration, it has to match these
+        remoteStepsToPhotonsConverter->SetWlenGenerators(wavelengthGenerators_);
+        remoteStepsToPhotonsConverter->SetWlenBias(wavelengthGenerationBias_);
+        remoteStepsToPhotonsConverter->SetMediumProperties(mediumProperties_);
+        remoteStepsToPhotonsConverter->SetGeometry(geometry_);
+        
+        try {
+            remoteStepsToPhotonsConverter->Initialize();
+        } catch (I3CLSimStepToPhotonConverter_exception &e) {
+            log_fatal("Could not connect to remote worker: %s", e.what());
+        }
+        
+        remoteStepsToPhotonsConverters_.push_back(remoteStepsToPhotonsConverter);
+        stepsToPhotonsConverters_.push_back(remoteStepsToPhotonsConverter);
+        
+        // same as for OpenCL devices
+        const uint64_t currentGranularity = remoteStepsToPhotonsConverter->GetWorkgroupSize();
+        if (granularity==0) {
+            granularity = currentGranularity;
+        } else {
+            const uint64_t newGranularity = boost::math::lcm(currentGranularity, granularity);
+            if (newGranularity != granularity) {
+                log_info("remote worker work group size is not compatible (%" PRIu64 "), changing granularity from %" PRIu64 " to %" PRIu64,
+                         currentGranularity, granularity, newGranularity);
+            }
+            granularity=newGranularity;
+        }
+        
+        const uint64_t currentMaxBunchSize = remoteStepsToPhotonsConverter->GetMaxNumWorkitems();
+        const uint64_t newMaxBunchSize = (maxBunchSize==0)?currentMaxBunchSize:std::min(maxBunchSize, currentMaxBunchSize);
+        maxBunchSize = newMaxBunchSize - newMaxBunchSize%granularity;
+        
+        if (maxBunchSize==0)
+            log_fatal("maximum bunch sizes are incompatible with kernel work group sizes.");
+    }
+    
+    if (useNativePropagator_)
+    {
+        log_info(" -> native propagator on the host CPU");
+        
+        nativeStepsToPhotonsConverter_ =
+        I3CLSimModuleHelper::initializeNative(randomService_,
+                                              geometry_,
+                                              mediumProperties_,
+                                              wavelengthGenerationBias_,
+                                              wavelengthGenerators_,
+                                              stopDetectedPhotons_,
+                                              saveAllPhotons_,
+                                              saveAllPhotonsPrescale_,
+                                              fixedNumberOfAbsorptionLengths_,
+                                              pancakeFactor_,
+                                              photonHistoryEntries_,
+                                              numNativePropagatorThreads_);
+        if (!nativeStepsToPhotonsConverter_)
+            log_fatal("Could not initialize the native propagator!");
+        
+        stepsToPhotonsConverters_.push_back(nativeStepsToPhotonsConverter_);
+        
+        // the native propagator has a work group size of one, so it never
+        // changes the granularity. Just respect its maximum bunch size.
+        if (granularity==0) granularity=1;
+        
+        const uint64_t currentMaxBunchSize = nativeStepsToPhotonsConverter_->GetMaxNumWorkitems();
+        if (maxBunchSize==0) {
+            maxBunchSize = currentMaxBunchSize - currentMaxBunchSize%granularity;
+        } else if (currentMaxBunchSize < maxBunchSize) {
+            maxBunchSize = currentMaxBunchSize - currentMaxBunchSize%granularity;
+        }
+        
+        if (maxBunchSize==0)
+            log_fatal("maximum bunch sizes are incompatible with kernel work group sizes.");
+    }
+    
+    // distributes step bunches over all devices
+    stepBunchScheduler_ = I3CLSimStepBunchSchedulerPtr(new I3CLSimStepBunchScheduler(stepsToPhotonsConverters_));
+    
+    stepPreCuller_.reset();
+    if (stepPreCullingProbability_ > 0.)
+    {
+        log_info("Steps with a hit probability below %g will be thinned out.", stepPreCullingProbability_);
+        stepPreCuller_ = I3CLSimStepPreCullerPtr(new I3CLSimStepPreCuller(geometry_,
+                                                                          mediumProperties_,
+                                                                          stepPreCullingProbability_,
+                                                                          granularity,
+                                                                          static_cast<uint32_t>(randomService_->Integer(0xffffffff))));
+    }
     
     
     log_info("Initializing Geant4..");
     // initialize Geant4 (will set bunch sizes according to the OpenCL settings)
-    geant4ParticleToStepsConverter_ =
-    I3CLSimModuleHelper::initializeGeant4(randomService_,
-                                          mediumProperties_,
-                                          wavelengthGenerationBias_,
-                                          granularity,
-                                          maxBunchSize,
-                                          parameterizationList_,
-                                          geant4PhysicsListName_,
-                                          geant4MaxBetaChangePerStep_,
-                                          geant4MaxNumPhotonsPerStep_,
-                                          false); // the multiprocessor version is not yet safe to use
+    geant4ParticleToStepsConverter_->SetBunchSizeGranularity(granularity);
+    geant4ParticleToStepsConverter_->SetMaxBunchSize(maxBunchSize);
+    geant4ParticleToStepsConverter_->Initialize();
 
     
     log_info("Initialization complete.");
@@ -819,27 +1222,16 @@ namespace {
     }
 }
 
-void I3CLSimModule::AddPhotonsToFrames(const I3CLSimPhotonSeries &photons,
+void I3CLSimModule::AddPhotonsToFrames(const I3CLSimPhotonSeriesView &photons,
                                        I3CLSimPhotonHistorySeriesConstPtr photonHistories,
-                                       const std::vector<I3PhotonSeriesMapPtr> &photonsForFrameList_,
-                                       std::vector<int32_t> &currentPhotonIdForFrame_,
-                                       const std::vector<I3FramePtr> &frameList_,
+                                       std::deque<frameCacheEntry> &frameCache_,
+                                       std::size_t frameCacheFirstEntry_,
                                        const std::map<uint32_t, particleCacheEntry> &particleCache_,
-#ifdef GRANULAR_GEOMETRY_SUPPORT
-                                       const std::vector<std::set<ModuleKey> > &maskedOMKeys_,
-#else
-                                       const std::vector<std::set<OMKey> > &maskedOMKeys_,
-#endif
                                        bool collectStatistics_,
                                        std::map<uint32_t, uint64_t> &photonNumAtOMPerParticle,
                                        std::map<uint32_t, double> &photonWeightSumAtOMPerParticle
                                        )
 {
-    if (photonsForFrameList_.size() != frameList_.size())
-        log_fatal("Internal error: cache sizes differ. (1)");
-    if (photonsForFrameList_.size() != currentPhotonIdForFrame_.size())
-        log_fatal("Internal error: cache sizes differ. (2)");
-    
     if (photonHistories) {
         if (photonHistories->size() != photons.size())
         {
@@ -849,349 +1241,418 @@ void I3CLSimModule::AddPhotonsToFrames(const I3CLSimPhotonSeries &photons,
     }
     
     
-    for (std::size_t i=0;i<photons.size();++i)
+    // Sort the photons by particle and DOM first. This way the particle
+    // cache, the DOM mask and the output map only have to be consulted
+    // once for each run of photons from the same particle on the same DOM.
+    I3CLSimPhotonSeriesColumns columns(photons);
+    columns.SortByIdentifierAndOMKey();
+
+    const std::vector<float> &times = columns.GetTimes();
+    const std::vector<float> &weights = columns.GetWeights();
+    const std::vector<float> &wavelengths = columns.GetWavelengths();
+    const std::vector<int16_t> &stringIDs = columns.GetStringIDs();
+    const std::vector<uint16_t> &omIDs = columns.GetOMIDs();
+    const std::vector<uint32_t> &identifiers = columns.GetIdentifiers();
+    const std::vector<uint32_t> &indices = columns.GetIndices();
+
+    std::size_t particleRunStart=0;
+    while (particleRunStart < columns.size())
     {
-        const I3CLSimPhoton &photon = photons[i];
+        const std::size_t particleRunEnd = columns.FindIdentifierRunEnd(particleRunStart);
+        const uint32_t identifier = identifiers[particleRunStart];
         
         // find identifier in particle cache
-        std::map<uint32_t, particleCacheEntry>::const_iterator it = particleCache_.find(photon.identifier);
+        std::map<uint32_t, particleCacheEntry>::const_iterator it = particleCache_.find(identifier);
         if (it == particleCache_.end())
             log_fatal("Internal error: unknown particle id from OpenCL: %" PRIu32,
-                      photon.identifier);
+                      identifier);
         const particleCacheEntry &cacheEntry = it->second;
 
-        if (cacheEntry.frameListEntry >= photonsForFrameList_.size())
+        if ((cacheEntry.frameListEntry < frameCacheFirstEntry_) ||
+            (cacheEntry.frameListEntry-frameCacheFirstEntry_ >= frameCache_.size()))
             log_fatal("Internal error: particle cache entry uses invalid frame cache position");
         
-        //I3FramePtr &frame = frameList_[cacheEntry.frameListEntry];
-        I3PhotonSeriesMap &outputPhotonMap = *(photonsForFrameList_[cacheEntry.frameListEntry]);
+        frameCacheEntry &frameEntry = frameCache_[cacheEntry.frameListEntry-frameCacheFirstEntry_];
 
         // get the current photon id
-        int32_t &currentPhotonId = currentPhotonIdForFrame_[cacheEntry.frameListEntry];
-        
-#ifdef GRANULAR_GEOMETRY_SUPPORT
-        // generate the OMKey
-        const ModuleKey key = ModuleKeyFromOpenCLSimIDs(photon.stringID, photon.omID);
-#else
-        const OMKey key = OMKeyFromOpenCLSimIDs(photon.stringID, photon.omID);
-#endif
+        int32_t &currentPhotonId = frameEntry.currentPhotonId;
         
         // get the OMKey mask
 #ifdef GRANULAR_GEOMETRY_SUPPORT
-        const std::set<ModuleKey> &keyMask = maskedOMKeys_[cacheEntry.frameListEntry];
+        const std::set<ModuleKey> &keyMask = frameEntry.maskedOMKeys;
 #else
-        const std::set<OMKey> &keyMask = maskedOMKeys_[cacheEntry.frameListEntry];
+        const std::set<OMKey> &keyMask = frameEntry.maskedOMKeys;
 #endif
-        if (keyMask.count(key) > 0) continue; // ignore masked DOMs
         
-        // this either inserts a new vector or retrieves an existing one
-        I3PhotonSeries &outputPhotonSeries = outputPhotonMap.insert(std::make_pair(key, I3PhotonSeries())).first->second;
+        uint64_t numPhotonsFromParticle=0;
+        double weightSumFromParticle=0.;
         
-        // append a new I3Photon to the list
-        outputPhotonSeries.push_back(I3Photon());
-        
-        // get a reference to the new photon
-        I3Photon &outputPhoton = outputPhotonSeries.back();
-
-        // fill the photon data
-        outputPhoton.SetTime(photon.GetTime() + cacheEntry.timeShift);
-        outputPhoton.SetID(currentPhotonId); // per-frame ID for every photon
-        outputPhoton.SetWeight(photon.GetWeight());
-        outputPhoton.SetParticleMinorID(cacheEntry.particleMinorID);
-        outputPhoton.SetParticleMajorID(cacheEntry.particleMajorID);
-        outputPhoton.SetCherenkovDist(photon.GetCherenkovDist());
-        outputPhoton.SetWavelength(photon.GetWavelength());
-        outputPhoton.SetGroupVelocity(photon.GetGroupVelocity());
-        outputPhoton.SetNumScattered(photon.GetNumScatters());
-
-        outputPhoton.SetPos(I3Position(photon.GetPosX(), photon.GetPosY(), photon.GetPosZ()));
-        {
-            I3Direction outDir;
-            outDir.SetThetaPhi(photon.GetDirTheta(), photon.GetDirPhi());
-            outputPhoton.SetDir(outDir);
-        }
-
-        outputPhoton.SetStartTime(photon.GetStartTime() + cacheEntry.timeShift);
-
-        outputPhoton.SetStartPos(I3Position(photon.GetStartPosX(), photon.GetStartPosY(), photon.GetStartPosZ()));
+        std::size_t domRunStart=particleRunStart;
+        while (domRunStart < particleRunEnd)
         {
-            I3Direction outStartDir;
-            outStartDir.SetThetaPhi(photon.GetStartDirTheta(), photon.GetStartDirPhi());
-            outputPhoton.SetStartDir(outStartDir);
-        }
-
-        outputPhoton.SetDistanceInAbsorptionLengths(photon.GetDistInAbsLens());
-        
-        if (photonHistories) {
-            const I3CLSimPhotonHistory &photonHistory = (*photonHistories)[i];
+            const std::size_t domRunEnd = columns.FindOMKeyRunEnd(domRunStart);
+            
+#ifdef GRANULAR_GEOMETRY_SUPPORT
+            // generate the OMKey
+            const ModuleKey key = ModuleKeyFromOpenCLSimIDs(stringIDs[domRunStart], omIDs[domRunStart]);
+#else
+            const OMKey key = OMKeyFromOpenCLSimIDs(stringIDs[domRunStart], omIDs[domRunStart]);
+#endif
+            
+            if (keyMask.count(key) > 0) {
+                // ignore masked DOMs
+                domRunStart=domRunEnd;
+                continue;
+            }
+            
+            if (frameEntry.mcpes)
+            {
+                // the device already converted these photons to hits,
+                // their weight is the number of photo-electrons
+#ifdef GRANULAR_GEOMETRY_SUPPORT
+                const OMKey hitKey(key.GetString(), key.GetOM());
+#else
+                const OMKey &hitKey = key;
+#endif
+                I3MCPESeries &outputHits = frameEntry.mcpes->insert(std::make_pair(hitKey, I3MCPESeries())).first->second;
+                
+                for (std::size_t j=domRunStart;j<domRunEnd;++j)
+                {
+                    if (cacheEntry.particle)
+                        outputHits.push_back(I3MCPE(*cacheEntry.particle));
+                    else
+                        outputHits.push_back(I3MCPE());
+                    I3MCPE &hit = outputHits.back();
+                    
+                    hit.time = times[j] + cacheEntry.timeShift;
+                    hit.npe = static_cast<uint32_t>(weights[j]);
+                }
+                
+                // Photons that did not make a hit never leave the
+                // device and the weights are photo-electron counts,
+                // so there are no statistics for photons at the DOMs.
+                domRunStart=domRunEnd;
+                continue;
+            }
+            
+            // this either inserts a new vector or retrieves an existing one
+            I3PhotonSeries &outputPhotonSeries = frameEntry.photons->insert(std::make_pair(key, I3PhotonSeries())).first->second;
             
-            if (photonHistory.size() > photon.GetNumScatters())
-                log_fatal("Logic error: photonHistory.size() [==%zu] > photon.GetNumScatters() [==%zu]",
-                          photonHistory.size(), static_cast<std::size_t>(photon.GetNumScatters()));
+            // make room for the whole run at once (but keep
+            // the amortized growth for series filled by many runs)
+            const std::size_t requiredSize = outputPhotonSeries.size()+(domRunEnd-domRunStart);
+            if (requiredSize > outputPhotonSeries.capacity())
+                outputPhotonSeries.reserve(std::max(requiredSize, 2*outputPhotonSeries.capacity()));
             
-            for (std::size_t j=0;j<photonHistory.size();++j)
+            for (std::size_t j=domRunStart;j<domRunEnd;++j)
             {
-                outputPhoton.AppendToIntermediatePositionList(I3Position( photonHistory.GetX(j), photonHistory.GetY(j), photonHistory.GetZ(j) ),
-                                                              photonHistory.GetDistanceInAbsorptionLengths(j)
-                                                             );
+                const std::size_t i = indices[j]; // position in "photons"
+                const I3CLSimPhoton &photon = photons[i];
+                
+                // append a new I3Photon to the list
+                outputPhotonSeries.push_back(I3Photon());
+                
+                // get a reference to the new photon
+                I3Photon &outputPhoton = outputPhotonSeries.back();
+
+                // fill the photon data
+                outputPhoton.SetTime(times[j] + cacheEntry.timeShift);
+                outputPhoton.SetID(currentPhotonId); // per-frame ID for every photon
+                outputPhoton.SetWeight(weights[j]);
+                outputPhoton.SetParticleMinorID(cacheEntry.particleMinorID);
+                outputPhoton.SetParticleMajorID(cacheEntry.particleMajorID);
+                outputPhoton.SetCherenkovDist(photon.GetCherenkovDist());
+                outputPhoton.SetWavelength(wavelengths[j]);
+                outputPhoton.SetGroupVelocity(photon.GetGroupVelocity());
+                outputPhoton.SetNumScattered(photon.GetNumScatters());
+
+                outputPhoton.SetPos(I3Position(photon.GetPosX(), photon.GetPosY(), photon.GetPosZ()));
+                {
+                    I3Direction outDir;
+                    outDir.SetThetaPhi(photon.GetDirTheta(), photon.GetDirPhi());
+                    outputPhoton.SetDir(outDir);
+                }
+
+                outputPhoton.SetStartTime(photon.GetStartTime() + cacheEntry.timeShift);
+
+                outputPhoton.SetStartPos(I3Position(photon.GetStartPosX(), photon.GetStartPosY(), photon.GetStartPosZ()));
+                {
+                    I3Direction outStartDir;
+                    outStartDir.SetThetaPhi(photon.GetStartDirTheta(), photon.GetStartDirPhi());
+                    outputPhoton.SetStartDir(outStartDir);
+                }
+
+                outputPhoton.SetDistanceInAbsorptionLengths(photon.GetDistInAbsLens());
+                
+                if (photonHistories) {
+                    const I3CLSimPhotonHistory &photonHistory = (*photonHistories)[i];
+                    
+                    if (photonHistory.size() > photon.GetNumScatters())
+                        log_fatal("Logic error: photonHistory.size() [==%zu] > photon.GetNumScatters() [==%zu]",
+                                  photonHistory.size(), static_cast<std::size_t>(photon.GetNumScatters()));
+                    
+                    for (std::size_t k=0;k<photonHistory.size();++k)
+                    {
+                        outputPhoton.AppendToIntermediatePositionList(I3Position( photonHistory.GetX(k), photonHistory.GetY(k), photonHistory.GetZ(k) ),
+                                                                      photonHistory.GetDistanceInAbsorptionLengths(k)
+                                                                     );
+                    }
+                }
+                
+                ++numPhotonsFromParticle;
+                weightSumFromParticle+=weights[j];
+                
+                currentPhotonId++;
             }
+            
+            domRunStart=domRunEnd;
         }
         
-        if (collectStatistics_)
+        if ((collectStatistics_) && (numPhotonsFromParticle>0))
         {
             // collect statistics
-            (photonNumAtOMPerParticle.insert(std::make_pair(photon.identifier, 0)).first->second)++;
-            (photonWeightSumAtOMPerParticle.insert(std::make_pair(photon.identifier, 0.)).first->second)+=photon.GetWeight();
+            photonNumAtOMPerParticle.insert(std::make_pair(identifier, 0)).first->second += numPhotonsFromParticle;
+            photonWeightSumAtOMPerParticle.insert(std::make_pair(identifier, 0.)).first->second += weightSumFromParticle;
         }
         
-        currentPhotonId++;
+        particleRunStart=particleRunEnd;
     }
     
 }
 
-std::size_t I3CLSimModule::FlushFrameCache()
-{
-    log_debug("Flushing frame cache..");
-    
-    // start the connector thread if necessary
-    if (!threadObj_) {
-        log_trace("No thread found running during FlushFrameCache(), starting one.");
-        StartThread();
-    }
-
-    // tell the Geant4 converter to not accept any new data until it is finished 
-    // with its current work.
-    geant4ParticleToStepsConverter_->EnqueueBarrier();
+namespace {
+    // how long FlushFrameCache() waits for a result before
+    // checking for flush markers again
+    const double resultWaitTimeout = 10.*I3Units::millisecond;
 
-    // At this point the thread should keep on passing steps from Geant4 to OpenCL.
-    // As soon as the barrier for Geant4 is no longer active and all data has been
-    // sent to OpenCL, the thread will finish. We wait for that and then receive
-    // data from the infinite OpenCL queue.
-    if (!threadObj_->joinable())
-        log_fatal("Thread should be joinable at this point!");
-        
+    // true if bunch "a" comes before bunch "b" (identifiers wrap around)
+    inline bool BunchIdentifierBefore(uint32_t a, uint32_t b)
     {
-        // allow other threads to access python
-        ScopedGILRelease scopedGIL;
-
-        log_debug("Waiting for thread..");
-        threadObj_->join(); // wait for it indefinitely
-        StopThread(); // stop it completely
-        if (!threadFinishedOK_) log_fatal("Thread was aborted or failed.");
-        log_debug("thread finished.");
+        return static_cast<int32_t>(a-b) < 0;
     }
 
-    // swap all frame cache objects with local versions
-
-    std::map<uint32_t, uint64_t> photonNumGeneratedPerParticle_old;
-    std::map<uint32_t, double> photonWeightSumGeneratedPerParticle_old;
-    photonNumGeneratedPerParticle_old.swap(photonNumGeneratedPerParticle_);
-    photonWeightSumGeneratedPerParticle_old.swap(photonWeightSumGeneratedPerParticle_);
-
-    std::vector<I3PhotonSeriesMapPtr> photonsForFrameList_old;
-    std::vector<int32_t> currentPhotonIdForFrame_old;
-    std::vector<I3FramePtr> frameList_old;
-    std::map<uint32_t, particleCacheEntry> particleCache_old;
-#ifdef GRANULAR_GEOMETRY_SUPPORT
-    std::vector<std::set<ModuleKey> > maskedOMKeys_old;
-#else
-    std::vector<std::set<OMKey> > maskedOMKeys_old;
-#endif
-    std::vector<bool> frameIsBeingWorkedOn_old;
-
-    photonsForFrameList_old.swap(photonsForFrameList_);
-    currentPhotonIdForFrame_old.swap(currentPhotonIdForFrame_);
-    frameList_old.swap(frameList_);
-    particleCache_old.swap(particleCache_);
-    maskedOMKeys_old.swap(maskedOMKeys_);
-    frameIsBeingWorkedOn_old.swap(frameIsBeingWorkedOn_);
-
-    bool startThreadLater = false;
-
-    // at this point, if we have frames in the secondary cache, 
-    // immediately push them to Geant4 so it can start working on them
-    for (;;)
+    bool MCPETimeLess(const I3MCPE &elem1, const I3MCPE &elem2)
     {
-        if (frameList2_.empty()) break;
-        if (frameList_.size() >= maxNumParallelEvents_) break;
-
-        DigestOtherFrame(frameList2_.front(), false); // do not start the connector thread right now
-        startThreadLater=true;
-        frameList2_.pop_front();
+        return elem1.time < elem2.time;
     }
+}
 
-    // now wait for OpenCL to finish; retrieve results
-    std::map<uint32_t, uint64_t> photonNumAtOMPerParticle;
-    std::map<uint32_t, double> photonWeightSumAtOMPerParticle;
-
-    std::deque<I3CLSimStepToPhotonConverter::ConversionResult_t> res_list;
-    for (std::size_t deviceIndex=0;deviceIndex<numBunchesSentToOpenCL_.size();++deviceIndex)
-    {
-        log_debug("Geant4 finished, retrieving results from GPU %zu..", deviceIndex);
-
-        for (uint64_t i=0;i<numBunchesSentToOpenCL_[deviceIndex];++i)
+void I3CLSimModule::AddConversionResult(const I3CLSimStepToPhotonConverter::ConversionResult_t &res)
+{
+    if (!res.HasPhotons()) log_fatal("Internal error: received NULL photon series from OpenCL.");
+
+    // convert to I3Photons and add to their respective frames.
+    // The photons might live in a mapped device buffer, which is
+    // given back to the converter once "photons" goes out of scope.
+    const I3CLSimPhotonSeriesView photons = res.GetPhotonView();
+    AddPhotonsToFrames(photons, res.photonHistories,
+                       frameCache_,
+                       frameCacheFirstEntry_,
+                       particleCache_,
+                       collectStatistics_,
+                       photonNumAtOMPerParticle_,
+                       photonWeightSumAtOMPerParticle_
+                       );
+
+    // keep track of the bunches that are done
+    if (res.identifier == nextBunchToComplete_) {
+        ++nextBunchToComplete_;
+        
+        for (;;)
         {
-            I3CLSimStepToPhotonConverter::ConversionResult_t res =
-            openCLStepsToPhotonsConverters_[deviceIndex]->GetConversionResult();
-            if (!res.photons) log_fatal("Internal error: received NULL photon series from OpenCL.");
-
-            res_list.push_back(res);
+            std::set<uint32_t>::iterator it = bunchesCompletedOutOfOrder_.find(nextBunchToComplete_);
+            if (it == bunchesCompletedOutOfOrder_.end()) break;
+            bunchesCompletedOutOfOrder_.erase(it);
+            ++nextBunchToComplete_;
         }
+    } else {
+        if (!bunchesCompletedOutOfOrder_.insert(res.identifier).second)
+            log_fatal("Internal error: received results for bunch %" PRIu32 " twice.", res.identifier);
     }
     
-    log_debug("results fetched from OpenCL.");
-
-    // new frames were already sent to Geant4, we can re-start the thread right now
-    // since we are done with fetching results from OpenCL    
-    if (startThreadLater) {
-        // start the connector thread if necessary
-        if (!threadObj_) {
-            log_debug("Delayed start of Thread().");
-            StartThread();
-        }
-    }
-
-    log_debug("Adding photons to frame.");
-    std::size_t totalNumOutPhotons=0;
+    log_trace("Got %zu photons from bunch %" PRIu32 ".", photons.size(), res.identifier);
+}
 
-    while (!res_list.empty()) 
+void I3CLSimModule::CollectResultsAndMarkers()
+{
+    // flush markers reached by the thread
+    std::pair<uint32_t, uint32_t> markerAndNextBunch;
+    while (flushMarkersReached_->GetNonBlocking(markerAndNextBunch))
     {
-        const I3CLSimStepToPhotonConverter::ConversionResult_t &res =
-            res_list.front();
-
-        // convert to I3Photons and add to their respective frames
-        AddPhotonsToFrames(*(res.photons), res.photonHistories,
-                           photonsForFrameList_old,
-                           currentPhotonIdForFrame_old,
-                           frameList_old,
-                           particleCache_old,
-                           maskedOMKeys_old,
-                           collectStatistics_,
-                           photonNumAtOMPerParticle,
-                           photonWeightSumAtOMPerParticle
-                           );
-        
-        totalNumOutPhotons += res.photons->size();
-
-        res_list.pop_front();
-    }
-
-
-    log_debug("Got %zu photons in total during flush.", totalNumOutPhotons);
+        // markers are reached in order and a marker implies all earlier ones
+        std::deque<frameCacheEntry>::iterator it = frameCache_.begin();
+        for (;;)
+        {
+            if (it == frameCache_.end())
+                log_fatal("Internal error: flush marker %" PRIu32 " does not belong to any frame.",
+                          markerAndNextBunch.first);
 
-    if (collectStatistics_)
-    {
-        std::vector<I3CLSimEventStatisticsPtr> eventStatisticsForFrame;
-        for (std::size_t i=0;i<frameList_old.size();++i) {
-            if (frameIsBeingWorkedOn_old[i]) {
-                eventStatisticsForFrame.push_back(I3CLSimEventStatisticsPtr(new I3CLSimEventStatistics()));
-            } else {
-                eventStatisticsForFrame.push_back(I3CLSimEventStatisticsPtr()); // NULL pointer for non-physics(/DAQ)-frames
+            if ((it->flushMarker!=0) && (!it->stepsComplete))
+            {
+                it->stepsComplete=true;
+                it->bunchesNeeded=markerAndNextBunch.second;
+                if (it->flushMarker==markerAndNextBunch.first) break;
             }
+            ++it;
         }
+    }
 
-        
-        // generated photons (count)
-        for(std::map<uint32_t, uint64_t>::const_iterator it=photonNumGeneratedPerParticle_old.begin();
-            it!=photonNumGeneratedPerParticle_old.end();++it)
-        {
-            // find identifier in particle cache
-            std::map<uint32_t, particleCacheEntry>::iterator it_cache = particleCache_old.find(it->first);
-            if (it_cache == particleCache_old.end())
-                log_error("Internal error: unknown particle id from Geant4: %" PRIu32,
-                          it->first);
-            const particleCacheEntry &cacheEntry = it_cache->second;
-            
-            if (cacheEntry.frameListEntry >= eventStatisticsForFrame.size())
-                log_fatal("Internal error: particle cache entry uses invalid frame cache position");
-            
-            eventStatisticsForFrame[cacheEntry.frameListEntry]->AddNumPhotonsGeneratedWithWeights(it->second, 0.,
-                                                                                                  cacheEntry.particleMajorID,
-                                                                                                  cacheEntry.particleMinorID);
-        }
-
-        // generated photons (weight sum)
-        for(std::map<uint32_t, double>::const_iterator it=photonWeightSumGeneratedPerParticle_old.begin();
-            it!=photonWeightSumGeneratedPerParticle_old.end();++it)
+    // results that are available right now
+    I3CLSimStepToPhotonConverter::ConversionResult_t res;
+    try {
+        while (stepBunchScheduler_->GetConversionResult(res, 0.))
         {
-            // find identifier in particle cache
-            std::map<uint32_t, particleCacheEntry>::iterator it_cache = particleCache_old.find(it->first);
-            if (it_cache == particleCache_old.end())
-                log_fatal("Internal error: unknown particle id from Geant4: %" PRIu32,
-                          it->first);
-            const particleCacheEntry &cacheEntry = it_cache->second;
-            
-            if (cacheEntry.frameListEntry >= eventStatisticsForFrame.size())
-                log_fatal("Internal error: particle cache entry uses invalid frame cache position");
-
-            eventStatisticsForFrame[cacheEntry.frameListEntry]->AddNumPhotonsGeneratedWithWeights(0, it->second,
-                                                                                                  cacheEntry.particleMajorID,
-                                                                                                  cacheEntry.particleMinorID);
+            AddConversionResult(res);
         }
+    } catch(I3CLSimStepToPhotonConverter_exception &e) {
+        log_fatal("Photon propagation failed: %s", e.what());
+    }
+}
 
+std::size_t I3CLSimModule::PushFinishedFrames()
+{
+    std::size_t framesPushed=0;
+    
+    // frames are pushed in order, so stop at the first unfinished one
+    while (!frameCache_.empty())
+    {
+        frameCacheEntry &entry = frameCache_.front();
         
-        // photons @ DOMs(count)
-        for(std::map<uint32_t, uint64_t>::const_iterator it=photonNumAtOMPerParticle.begin();
-            it!=photonNumAtOMPerParticle.end();++it)
+        if (entry.isBeingWorkedOn)
         {
-            // find identifier in particle cache
-            std::map<uint32_t, particleCacheEntry>::iterator it_cache = particleCache_old.find(it->first);
-            if (it_cache == particleCache_old.end())
-                log_fatal("Internal error: unknown particle id from Geant4: %" PRIu32,
-                          it->first);
-            const particleCacheEntry &cacheEntry = it_cache->second;
+            if (!entry.stepsComplete) break;
+            if (BunchIdentifierBefore(nextBunchToComplete_, entry.bunchesNeeded)) break;
             
-            if (cacheEntry.frameListEntry >= eventStatisticsForFrame.size())
-                log_fatal("Internal error: particle cache entry uses invalid frame cache position");
+            I3CLSimEventStatisticsPtr eventStatistics;
+            if (collectStatistics_) eventStatistics = I3CLSimEventStatisticsPtr(new I3CLSimEventStatistics());
             
-            eventStatisticsForFrame[cacheEntry.frameListEntry]->AddNumPhotonsAtDOMsWithWeights(it->second, 0.,
-                                                                                               cacheEntry.particleMajorID,
-                                                                                               cacheEntry.particleMinorID);
-        }
-        
-        // photons @ DOMs (weight sum)
-        for(std::map<uint32_t, double>::const_iterator it=photonWeightSumAtOMPerParticle.begin();
-            it!=photonWeightSumAtOMPerParticle.end();++it)
-        {
-            // find identifier in particle cache
-            std::map<uint32_t, particleCacheEntry>::iterator it_cache = particleCache_old.find(it->first);
-            if (it_cache == particleCache_old.end())
-                log_fatal("Internal error: unknown particle id from Geant4: %" PRIu32,
-                          it->first);
-            const particleCacheEntry &cacheEntry = it_cache->second;
+            // this frame's particles are done, remove them from the cache
+            uint32_t particleCacheIndex = entry.firstParticleCacheIndex;
+            for (std::size_t i=0;i<entry.numParticles;++i)
+            {
+                std::map<uint32_t, particleCacheEntry>::iterator it_cache = particleCache_.find(particleCacheIndex);
+                if (it_cache == particleCache_.end())
+                    log_fatal("Internal error: particle id %" PRIu32 " is missing from the cache.",
+                              particleCacheIndex);
+                const particleCacheEntry &cacheEntry = it_cache->second;
+                
+                if (eventStatistics)
+                {
+                    {
+                        boost::unique_lock<boost::mutex> guard(photonsGeneratedPerParticle_mutex_);
+
+                        std::map<uint32_t, uint64_t>::iterator it_num = photonNumGeneratedPerParticle_.find(particleCacheIndex);
+                        if (it_num != photonNumGeneratedPerParticle_.end()) {
+                            eventStatistics->AddNumPhotonsGeneratedWithWeights(it_num->second, 0.,
+                                                                               cacheEntry.particleMajorID,
+                                                                               cacheEntry.particleMinorID);
+                            photonNumGeneratedPerParticle_.erase(it_num);
+                        }
+
+                        std::map<uint32_t, double>::iterator it_weight = photonWeightSumGeneratedPerParticle_.find(particleCacheIndex);
+                        if (it_weight != photonWeightSumGeneratedPerParticle_.end()) {
+                            eventStatistics->AddNumPhotonsGeneratedWithWeights(0, it_weight->second,
+                                                                               cacheEntry.particleMajorID,
+                                                                               cacheEntry.particleMinorID);
+                            photonWeightSumGeneratedPerParticle_.erase(it_weight);
+                        }
+                    }
+
+                    std::map<uint32_t, uint64_t>::iterator it_num = photonNumAtOMPerParticle_.find(particleCacheIndex);
+                    if (it_num != photonNumAtOMPerParticle_.end()) {
+                        eventStatistics->AddNumPhotonsAtDOMsWithWeights(it_num->second, 0.,
+                                                                        cacheEntry.particleMajorID,
+                                                                        cacheEntry.particleMinorID);
+                        photonNumAtOMPerParticle_.erase(it_num);
+                    }
+
+                    std::map<uint32_t, double>::iterator it_weight = photonWeightSumAtOMPerParticle_.find(particleCacheIndex);
+                    if (it_weight != photonWeightSumAtOMPerParticle_.end()) {
+                        eventStatistics->AddNumPhotonsAtDOMsWithWeights(0, it_weight->second,
+                                                                        cacheEntry.particleMajorID,
+                                                                        cacheEntry.particleMinorID);
+                        photonWeightSumAtOMPerParticle_.erase(it_weight);
+                    }
+                }
+                
+                particleCache_.erase(it_cache);
+                
+                if (entry.domMaskIndex != 0)
+                {
+                    boost::unique_lock<boost::mutex> guard(domMaskIndexPerParticle_mutex_);
+                    domMaskIndexPerParticle_.erase(particleCacheIndex);
+                }
+                
+                ++particleCacheIndex;
+                if (particleCacheIndex==0) ++particleCacheIndex; // index 0 is never used
+            }
             
-            if (cacheEntry.frameListEntry >= eventStatisticsForFrame.size())
-                log_fatal("Internal error: particle cache entry uses invalid frame cache position");
+            if (eventStatistics) entry.frame->Put(statisticsName_, eventStatistics);
             
-            eventStatisticsForFrame[cacheEntry.frameListEntry]->AddNumPhotonsAtDOMsWithWeights(0, it->second,
-                                                                                               cacheEntry.particleMajorID,
-                                                                                               cacheEntry.particleMinorID);
-        }
-
-        
-        // store statistics to frame
-        for (std::size_t i=0;i<frameList_old.size();++i)
-        {
-            if (frameIsBeingWorkedOn_old[i]) {
-                frameList_old[i]->Put(statisticsName_, eventStatisticsForFrame[i]);
+            if (entry.mcpes) {
+                // hits from different particles and bunches arrive in any order
+                for (I3MCPESeriesMap::iterator it = entry.mcpes->begin(); it != entry.mcpes->end(); ++it) {
+                    std::sort(it->second.begin(), it->second.end(), MCPETimeLess);
+                }
+                
+                log_debug("putting hits into frame %zu...", frameCacheFirstEntry_);
+                entry.frame->Put(MCPESeriesMapName_, entry.mcpes);
+            } else {
+                log_debug("putting photons into frame %zu...", frameCacheFirstEntry_);
+                entry.frame->Put(photonSeriesMapName_, entry.photons);
             }
         }
-    }    
-    
+        
+        log_debug("pushing frame number %zu...", frameCacheFirstEntry_);
+        PushFrame(entry.frame);
+        ++framesPushed;
+        
+        // this releases the photons
+        frameCache_.pop_front();
+        ++frameCacheFirstEntry_;
+    }
     
-    log_debug("finished.");
+    return framesPushed;
+}
+
+std::size_t I3CLSimModule::FlushFrameCache(std::size_t maxNumFramesToKeep)
+{
+    if (frameCache_.empty()) return 0;
+
+    log_debug("Flushing frame cache (keeping at most %zu frames)..", maxNumFramesToKeep);
     
     std::size_t framesPushed=0;
-    for (std::size_t identifier=0;identifier<frameList_old.size();++identifier)
+    
+    for (;;)
     {
-        if (frameIsBeingWorkedOn_old[identifier]) {
-            log_debug("putting photons into frame %zu...", identifier);
-            frameList_old[identifier]->Put(photonSeriesMapName_, photonsForFrameList_old[identifier]);
-        }
+        CollectResultsAndMarkers();
+        framesPushed += PushFinishedFrames();
         
-        log_debug("pushing frame number %zu...", identifier);
-        PushFrame(frameList_old[identifier]);
-        ++framesPushed;
+        if (frameCache_.size() <= maxNumFramesToKeep) break;
+        
+        if (!threadObj_)
+            log_fatal("Internal error: frames are waiting for results, but the thread is not running.");
+        
+        // wait for more results. Flush markers are checked
+        // after the timeout even if no new results arrive.
+        I3CLSimStepToPhotonConverter::ConversionResult_t res;
+        bool gotResult;
+        std::string propagationError;
+        {
+            // allow other threads to access python
+            ScopedGILRelease scopedGIL;
+            
+            try {
+                gotResult = stepBunchScheduler_->GetConversionResult(res, resultWaitTimeout);
+            } catch(I3CLSimStepToPhotonConverter_exception &e) {
+                gotResult = false;
+                propagationError = e.what();
+            }
+        }
+        // log_fatal needs the GIL
+        if (!propagationError.empty())
+            log_fatal("Photon propagation failed: %s", propagationError.c_str());
+        if (gotResult) AddConversionResult(res);
     }
     
     return framesPushed;
@@ -1305,62 +1766,37 @@ void I3CLSimModule::Process()
     if (frame->GetStop() == I3Frame::Geometry)
     {
         // special handling for Geometry frames
-        // these will trigger a full re-initialization of OpenCL
-        // (currently a second Geometry frame triggers a fatal error
-        // in DigestGeometry()..)
+        // the first one triggers a full initialization of OpenCL,
+        // later ones only replace the geometry buffers (this needs
+        // UseDOMGrid, otherwise DigestGeometry() fails)
 
         DigestGeometry(frame);
         PushFrame(frame);
         return;
     }
     
+    if ((frame->GetStop() == I3Frame::Calibration) && (MCPESeriesMapName_ != ""))
+    {
+        // the relative DOM efficiencies are applied on the devices
+        DigestCalibration(frame);
+    }
+    
     // if the cache is empty and the frame stop is not Physics/DAQ, we can immediately push it
     // (and not add it to the cache)
-    if ((frameList_.empty()) && (workOnTheseStops_set_.count(frame->GetStop()) == 0) )
+    if ((frameCache_.empty()) && (workOnTheseStops_set_.count(frame->GetStop()) == 0) )
     {
         PushFrame(frame);
         return;
     }
 
-    // it's either Physics or something else..
-    if (frameListPhysicsFrameCounter_ < maxNumParallelEvents_)
-    {
-        // we currently treat physics and other frames/empty Physics
-        // frames the same
-        //const bool isPhysicsFrame =
-        DigestOtherFrame(frame);
-        frameListPhysicsFrameCounter_++;
-    }
-    else if (frameListPhysicsFrameCounter_ < maxNumParallelEvents_*2) 
-    {
-        // keep a second buffer so we have it available once 
-        // the first buffer has finished processing
-        frameList2_.push_back(frame);
-        frameListPhysicsFrameCounter_++;
-    }
+    // we currently treat physics and other frames/empty Physics
+    // frames the same
+    //const bool isPhysicsFrame =
+    DigestOtherFrame(frame);
 
-    if (frameListPhysicsFrameCounter_ >= maxNumParallelEvents_*2) 
-    {
-        log_debug("Flushing results for a total energy of %fGeV for %" PRIu64 " particles",
-                 totalSimulatedEnergyForFlush_/I3Units::GeV, totalNumParticlesForFlush_);
-                 
-        totalSimulatedEnergyForFlush_=0.;
-        totalNumParticlesForFlush_=0;
-        
-        // this will finish processing the first buffer and
-        // push all its frames
-        const std::size_t framesPushed =
-            FlushFrameCache();
-        frameListPhysicsFrameCounter_ -= framesPushed;
-
-        // now immediately start processing frames from the second buffer
-        for (std::size_t i=0;i<frameList2_.size();++i) {
-            DigestOtherFrame(frameList2_[i]);
-        }
-        frameList2_.clear();
-        
-        log_debug("============== CACHE FLUSHED ================");
-    }
+    // push all frames that are done. If there are too many frames
+    // in flight, wait until enough of them have finished.
+    FlushFrameCache(maxNumParallelEvents_);
 }
 
 
@@ -1368,15 +1804,23 @@ bool I3CLSimModule::DigestOtherFrame(I3FramePtr frame, bool startThread)
 {
     log_trace("%s", __PRETTY_FUNCTION__);
     
-    frameList_.push_back(frame);
-    photonsForFrameList_.push_back(I3PhotonSeriesMapPtr(new I3PhotonSeriesMap()));
-    currentPhotonIdForFrame_.push_back(0);
-    std::size_t currentFrameListIndex = frameList_.size()-1;
-#ifdef GRANULAR_GEOMETRY_SUPPORT
-    maskedOMKeys_.push_back(std::set<ModuleKey>()); // insert an empty ModuleKey mask
-#else
-    maskedOMKeys_.push_back(std::set<OMKey>()); // insert an empty OMKey mask
-#endif
+    frameCache_.push_back(frameCacheEntry());
+    frameCacheEntry &entry = frameCache_.back();
+    entry.frame = frame;
+    entry.isBeingWorkedOn = false; // do not touch this frame by default, just push it later on
+    if (MCPESeriesMapName_ != "") {
+        entry.mcpes = I3MCPESeriesMapPtr(new I3MCPESeriesMap());
+    } else {
+        entry.photons = I3PhotonSeriesMapPtr(new I3PhotonSeriesMap());
+    }
+    entry.currentPhotonId = 0;
+    entry.domMaskIndex = 0;
+    entry.firstParticleCacheIndex = currentParticleCacheIndex_;
+    entry.numParticles = 0;
+    entry.flushMarker = 0;
+    entry.stepsComplete = false;
+    entry.bunchesNeeded = 0;
+    const std::size_t currentFrameListIndex = frameCacheFirstEntry_ + frameCache_.size()-1;
     
     // check if we got a geometry before starting to work
     if (!geometryIsConfigured_)
@@ -1396,7 +1840,6 @@ bool I3CLSimModule::DigestOtherFrame(I3FramePtr frame, bool startThread)
     //// not our designated Stop
     if (workOnTheseStops_set_.count(frame->GetStop()) == 0) {
         // nothing to do for this frame, it is chached, however
-        frameIsBeingWorkedOn_.push_back(false); // do not touch this frame, just push it later on
         return false;
     }
     
@@ -1405,7 +1848,6 @@ bool I3CLSimModule::DigestOtherFrame(I3FramePtr frame, bool startThread)
     I3ConditionalModule::ShouldDoProcess(frame);
     
     if (!shouldDoProcess_fromConditionalModule) {
-        frameIsBeingWorkedOn_.push_back(false); // do not touch this frame, just push it later on
         return false;
     }
     
@@ -1420,7 +1862,6 @@ bool I3CLSimModule::DigestOtherFrame(I3FramePtr frame, bool startThread)
 
     if ((!MCTree) && (!flasherPulses)) {
         // ignore frames without any MCTree and/or Flashers
-        frameIsBeingWorkedOn_.push_back(false); // do not touch this frame, just push it later on
         return false;
     }
 
@@ -1440,7 +1881,7 @@ bool I3CLSimModule::DigestOtherFrame(I3FramePtr frame, bool startThread)
 
     
     // work with this frame!
-    frameIsBeingWorkedOn_.push_back(true); // this frame will receive results (->Put() will be called later)
+    entry.isBeingWorkedOn = true; // this frame will receive results (->Put() will be called later)
     
     std::deque<I3CLSimLightSource> lightSources;
     std::deque<double> timeOffsets;
@@ -1453,14 +1894,14 @@ bool I3CLSimModule::DigestOtherFrame(I3FramePtr frame, bool startThread)
     if (omKeyMask) {
         // assign the current OMKey mask if there is one
         BOOST_FOREACH(const OMKey &key, *omKeyMask) {
-            maskedOMKeys_.back().insert(ModuleKey(key.GetString(), key.GetOM()));
+            entry.maskedOMKeys.insert(ModuleKey(key.GetString(), key.GetOM()));
         }
     }
     
     if (moduleKeyMask) {
         // assign the current ModuleKey mask if there is one
         BOOST_FOREACH(const ModuleKey &key, *moduleKeyMask) {
-            maskedOMKeys_.back().insert(key);
+            entry.maskedOMKeys.insert(key);
         }
     }
    
@@ -1468,11 +1909,25 @@ bool I3CLSimModule::DigestOtherFrame(I3FramePtr frame, bool startThread)
     if (omKeyMask) {
         // assign the current OMKey mask if there is one
         BOOST_FOREACH(const OMKey &key, *omKeyMask) {
-            maskedOMKeys_.back().insert(key);
+            entry.maskedOMKeys.insert(key);
         }
     }
 #endif
     
+    if ((useDOMGrid_) && (!entry.maskedOMKeys.empty()))
+    {
+        // let the devices skip masked DOMs
+        std::set<std::pair<int, unsigned int> > maskedDOMs;
+#ifdef GRANULAR_GEOMETRY_SUPPORT
+        BOOST_FOREACH(const ModuleKey &key, entry.maskedOMKeys) {
+#else
+        BOOST_FOREACH(const OMKey &key, entry.maskedOMKeys) {
+#endif
+            maskedDOMs.insert(std::make_pair(static_cast<int>(key.GetString()), static_cast<unsigned int>(key.GetOM())));
+        }
+        entry.domMaskIndex = GetDOMMaskIndex(maskedDOMs);
+    }
+    
     for (std::size_t i=0;i<lightSources.size();++i)
     {
         const I3CLSimLightSource &lightSource = lightSources[i];
@@ -1486,6 +1941,13 @@ bool I3CLSimModule::DigestOtherFrame(I3FramePtr frame, bool startThread)
             totalNumParticlesForFlush_++;
         }
         
+        if (entry.domMaskIndex != 0)
+        {
+            // (this has to be known before the first step arrives)
+            boost::unique_lock<boost::mutex> guard(domMaskIndexPerParticle_mutex_);
+            domMaskIndexPerParticle_.insert(std::make_pair(currentParticleCacheIndex_, entry.domMaskIndex));
+        }
+        
         geant4ParticleToStepsConverter_->EnqueueLightSource(lightSource, currentParticleCacheIndex_);
 
         if (particleCache_.find(currentParticleCacheIndex_) != particleCache_.end())
@@ -1499,11 +1961,16 @@ bool I3CLSimModule::DigestOtherFrame(I3FramePtr frame, bool startThread)
         if (lightSource.GetType() == I3CLSimLightSource::Particle) {
             cacheEntry.particleMajorID = lightSource.GetParticle().GetMajorID();
             cacheEntry.particleMinorID = lightSource.GetParticle().GetMinorID();
+            
+            // I3MCPEs can only take their IDs from a particle
+            if (entry.mcpes) cacheEntry.particle = I3ParticleConstPtr(new I3Particle(lightSource.GetParticle()));
         } else {
             cacheEntry.particleMajorID = 0; // flashers, etc. do get ID 0,0
             cacheEntry.particleMinorID = 0;
         }
         
+        ++entry.numParticles;
+        
         // make a new index. This will eventually overflow,
         // but at that time, index 0 should be unused again.
         ++currentParticleCacheIndex_;
@@ -1512,9 +1979,90 @@ bool I3CLSimModule::DigestOtherFrame(I3FramePtr frame, bool startThread)
     
     lightSources.clear();
 
+    // Geant4 tells us once it is done with all of these light sources
+    entry.flushMarker = currentFlushMarker_;
+    geant4ParticleToStepsConverter_->EnqueueFlushMarker(entry.flushMarker);
+
+    ++currentFlushMarker_;
+    if ((currentFlushMarker_==0) || (currentFlushMarker_==I3CLSimLightSourceToStepConverterGeant4::flushMarkerBarrier))
+        currentFlushMarker_=1; // these values are reserved
+
     return true;
 }
 
+void I3CLSimModule::DigestCalibration(I3FramePtr frame)
+{
+    I3CalibrationConstPtr calibration = frame->Get<I3CalibrationConstPtr>("I3Calibration");
+    if (!calibration)
+        log_fatal("Calibration frame does not have an I3Calibration entry");
+    
+    // all frames before this one have to be simulated
+    // with the previous efficiencies
+    FlushFrameCache(0);
+    
+    hitDOMEfficiencies_.clear();
+    for (std::map<OMKey, I3DOMCalibration>::const_iterator it = calibration->domCal.begin();
+         it != calibration->domCal.end(); ++it)
+    {
+        const double efficiency = it->second.GetRelativeDomEff();
+        if (isnan(efficiency)) continue; // use the default
+        
+        hitDOMEfficiencies_.insert(std::make_pair(std::make_pair(static_cast<int>(it->first.GetString()),
+                                                                 static_cast<unsigned int>(it->first.GetOM())),
+                                                  efficiency));
+    }
+    
+    log_debug("Using relative efficiencies of %zu DOMs from the Calibration frame.",
+              hitDOMEfficiencies_.size());
+    
+    // (converters are set up with the current efficiencies
+    // when the first Geometry frame arrives)
+#ifndef I3CLSIM_WITHOUT_OPENCL
+    BOOST_FOREACH(I3CLSimStepToPhotonConverterOpenCLPtr &converter, openCLStepsToPhotonsConverters_)
+    {
+        converter->SetHitDOMEfficiencies(hitDOMEfficiencies_, defaultRelativeDOMEfficiency_);
+    }
+#endif
+}
+
+uint16_t I3CLSimModule::GetDOMMaskIndex(const std::set<std::pair<int, unsigned int> > &maskedDOMs)
+{
+    // only OpenCL devices support DOM masks, Configure() makes
+    // sure no other converters are used together with them
+#ifdef I3CLSIM_WITHOUT_OPENCL
+    return 0;
+#else
+    if (openCLStepsToPhotonsConverters_.empty()) return 0;
+    if (saveAllPhotons_) return 0; // there is no collision detection at all
+    
+    std::map<std::set<std::pair<int, unsigned int> >, uint16_t>::const_iterator it =
+    domMaskIndices_.find(maskedDOMs);
+    if (it != domMaskIndices_.end()) return it->second;
+    
+    if (domMaskIndices_.size()+1 >= I3CLSimStepToPhotonConverterOpenCL::maxNumDOMMasks)
+    {
+        // All masks are used. They can only be replaced once
+        // no steps in flight refer to them anymore, so finish all
+        // frames before the current one (it has no particles yet).
+        log_debug("Too many different DOM masks, waiting for all pending frames..");
+        FlushFrameCache(1);
+        if (!particleCache_.empty())
+            log_fatal("Internal error: particles are still being worked on after flushing the frame cache.");
+        
+        domMaskIndices_.clear();
+    }
+    
+    const uint16_t maskIndex = static_cast<uint16_t>(domMaskIndices_.size()+1); // index 0 is "no mask"
+    BOOST_FOREACH(I3CLSimStepToPhotonConverterOpenCLPtr &converter, openCLStepsToPhotonsConverters_)
+    {
+        converter->SetDOMMask(maskIndex, maskedDOMs);
+    }
+    domMaskIndices_.insert(std::make_pair(maskedDOMs, maskIndex));
+    
+    return maskIndex;
+#endif
+}
+
 void I3CLSimModule::Finish()
 {
     log_trace("%s", __PRETTY_FUNCTION__);
@@ -1525,26 +2073,13 @@ void I3CLSimModule::Finish()
     totalSimulatedEnergyForFlush_=0.;
     totalNumParticlesForFlush_=0;
 
-    std::size_t framesPushed = FlushFrameCache();
-    frameListPhysicsFrameCounter_ -= framesPushed;
+    // wait for all remaining frames
+    FlushFrameCache(0);
+    StopThread();
 
     log_info("Flushing I3Tray..");
     Flush();
 
-    // finish frames in 2nd buffer if there are any
-    if (frameList2_.size()>0) {
-        for (std::size_t i=0;i<frameList2_.size();++i) {
-            DigestOtherFrame(frameList2_[i]);
-        }
-        frameList2_.clear();
-
-        std::size_t framesPushed = FlushFrameCache();
-        frameListPhysicsFrameCounter_ -= framesPushed;
-
-        log_info("Flushing I3Tray (again)..");
-        Flush();
-    }
-
     log_info("I3CLSimModule is done.");
 
     // add some summary information to a potential I3SummaryService
@@ -1552,6 +2087,7 @@ void I3CLSimModule::Finish()
     if (summary) {
         const std::string prefix = "I3CLSimModule_" + GetName() + "_";
         
+#ifndef I3CLSIM_WITHOUT_OPENCL
         for (std::size_t i=0; i<openCLStepsToPhotonsConverters_.size(); ++i)
         {
             const std::string postfix = (openCLStepsToPhotonsConverters_.size()==1)?"":"_"+boost::lexical_cast<std::string>(i);
@@ -1570,6 +2106,41 @@ void I3CLSimModule::Finish()
             (*summary)[prefix+"AverageHostTimePerPhoton"  +postfix] = totalHostTime/totalNumPhotonsGenerated;
             (*summary)[prefix+"DeviceUtilization"         +postfix] = totalDeviceTime/totalHostTime;
         }
+#endif
+        
+        if (nativeStepsToPhotonsConverter_)
+        {
+            const std::string postfix = "_Native";
+            
+            const double totalNumPhotonsGenerated = nativeStepsToPhotonsConverter_->GetTotalNumPhotonsGenerated();
+            const double totalDeviceTime = static_cast<double>(nativeStepsToPhotonsConverter_->GetTotalDeviceTime())*I3Units::ns;
+            
+            (*summary)[prefix+"TotalDeviceTime"           +postfix] = totalDeviceTime;
+            (*summary)[prefix+"NumKernelCalls"            +postfix] = nativeStepsToPhotonsConverter_->GetNumKernelCalls();
+            (*summary)[prefix+"TotalNumPhotonsGenerated"  +postfix] = totalNumPhotonsGenerated;
+            (*summary)[prefix+"TotalNumPhotonsAtDOMs"     +postfix] = nativeStepsToPhotonsConverter_->GetTotalNumPhotonsAtDOMs();
+            
+            (*summary)[prefix+"AverageDeviceTimePerPhoton"+postfix] = totalDeviceTime/totalNumPhotonsGenerated;
+        }
+        
+        if ((stepBunchScheduler_) && (stepBunchScheduler_->GetNumDevices()>1))
+        {
+            // indexed like stepsToPhotonsConverters_ (OpenCL devices, remote workers, native)
+            for (std::size_t i=0; i<stepBunchScheduler_->GetNumDevices(); ++i)
+            {
+                const std::string postfix = "_"+boost::lexical_cast<std::string>(i);
+                
+                (*summary)[prefix+"SchedulerPhotonsPerSecond" +postfix] = stepBunchScheduler_->GetThroughputEstimate(i);
+                (*summary)[prefix+"SchedulerNumBunchesStolen" +postfix] = stepBunchScheduler_->GetNumBunchesStolen(i);
+            }
+        }
+        
+        if (stepPreCuller_)
+        {
+            (*summary)[prefix+"PreCullerNumPhotonsIn"   ] = stepPreCuller_->GetTotalNumPhotonsIn();
+            (*summary)[prefix+"PreCullerNumPhotonsOut"  ] = stepPreCuller_->GetTotalNumPhotonsOut();
+            (*summary)[prefix+"PreCullerNumStepsRemoved"] = stepPreCuller_->GetTotalNumStepsRemoved();
+        }
         
     }
 
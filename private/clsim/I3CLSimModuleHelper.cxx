@@ -300,21 +300,39 @@ namespace I3CLSimModuleHelper {
     }
 
     
+#ifndef I3CLSIM_WITHOUT_OPENCL
+    OpenCLOptions::OpenCLOptions()
+    :
+    enableDoubleBuffering(false),
+    doublePrecision(false),
+    stopDetectedPhotons(true),
+    saveAllPhotons(false),
+    saveAllPhotonsPrescale(0.01),
+    fixedNumberOfAbsorptionLengths(NAN),
+    pancakeFactor(1.),
+    photonHistoryEntries(0),
+    limitWorkgroupSize(0),
+    numBuffers(0),
+    useMappedBuffers(false),
+    compactPhotonOutput(false),
+    mediumPropertiesLookupTableBins(0),
+    opticalDepthTableBins(0),
+    useDOMGrid(false),
+    distanceCullingMargin(NAN),
+    photonSplittingFactor(1),
+    photonSplittingDistance(10.*I3Units::m),
+    photonRouletteDistance(100.*I3Units::m),
+    hitOversizeFactor(1.)
+    {
+    }
+    
     I3CLSimStepToPhotonConverterOpenCLPtr initializeOpenCL(const I3CLSimOpenCLDevice &device,
                                                            I3RandomServicePtr rng,
                                                            I3CLSimSimpleGeometryFromI3GeometryPtr geometry,
                                                            I3CLSimMediumPropertiesConstPtr medium,
                                                            I3CLSimFunctionConstPtr wavelengthGenerationBias,
                                                            const std::vector<I3CLSimRandomValueConstPtr> &wavelengthGenerators,
-                                                           bool enableDoubleBuffering,
-                                                           bool doublePrecision,
-                                                           bool stopDetectedPhotons,
-                                                           bool saveAllPhotons,
-                                                           double saveAllPhotonsPrescale,
-                                                           double fixedNumberOfAbsorptionLengths,
-                                                           double pancakeFactor,
-                                                           uint32_t photonHistoryEntries,
-                                                           uint32_t limitWorkgroupSize)
+                                                           const OpenCLOptions &options)
     {
         I3CLSimStepToPhotonConverterOpenCLPtr conv(new I3CLSimStepToPhotonConverterOpenCL(rng, device.GetUseNativeMath()));
 
@@ -326,23 +344,40 @@ namespace I3CLSimModuleHelper {
         conv->SetMediumProperties(medium);
         conv->SetGeometry(geometry);
 
-        conv->SetEnableDoubleBuffering(enableDoubleBuffering);
-        conv->SetDoublePrecision(doublePrecision);
-        conv->SetStopDetectedPhotons(stopDetectedPhotons);
-        conv->SetSaveAllPhotons(saveAllPhotons);
-        conv->SetSaveAllPhotonsPrescale(saveAllPhotonsPrescale);
+        if (options.numBuffers>0) {
+            conv->SetNumBuffers(options.numBuffers);
+        } else {
+            conv->SetEnableDoubleBuffering(options.enableDoubleBuffering);
+        }
+        conv->SetUseMappedBuffers(options.useMappedBuffers);
+        conv->SetDoublePrecision(options.doublePrecision);
+        conv->SetStopDetectedPhotons(options.stopDetectedPhotons);
+        conv->SetCompactPhotonOutput(options.compactPhotonOutput);
+        conv->SetMediumPropertiesLookupTableBins(options.mediumPropertiesLookupTableBins);
+        conv->SetOpticalDepthTableBins(options.opticalDepthTableBins);
+        conv->SetUseDOMGrid(options.useDOMGrid);
+        conv->SetDistanceCullingMargin(options.distanceCullingMargin);
+        conv->SetPhotonSplittingFactor(options.photonSplittingFactor);
+        conv->SetPhotonSplittingDistance(options.photonSplittingDistance);
+        conv->SetPhotonRouletteDistance(options.photonRouletteDistance);
+        conv->SetSaveAllPhotons(options.saveAllPhotons);
+        conv->SetSaveAllPhotonsPrescale(options.saveAllPhotonsPrescale);
 
-        conv->SetFixedNumberOfAbsorptionLengths(fixedNumberOfAbsorptionLengths);
-        conv->SetDOMPancakeFactor(pancakeFactor);
+        conv->SetFixedNumberOfAbsorptionLengths(options.fixedNumberOfAbsorptionLengths);
+        conv->SetDOMPancakeFactor(options.pancakeFactor);
 
-        conv->SetPhotonHistoryEntries(photonHistoryEntries);
+        conv->SetPhotonHistoryEntries(options.photonHistoryEntries);
+
+        if (options.hitWavelengthAcceptance) {
+            conv->SetHitConversion(options.hitWavelengthAcceptance, options.hitAngularAcceptance, options.hitOversizeFactor);
+        }
 
         conv->Compile();
         //log_trace("%s", conv.GetFullSource().c_str());
         
         std::size_t maxWorkgroupSize = conv->GetMaxWorkgroupSize();
-        if (limitWorkgroupSize!=0) {
-            maxWorkgroupSize = std::min(static_cast<std::size_t>(limitWorkgroupSize), maxWorkgroupSize);
+        if (options.limitWorkgroupSize!=0) {
+            maxWorkgroupSize = std::min(static_cast<std::size_t>(options.limitWorkgroupSize), maxWorkgroupSize);
         }
         
         conv->SetWorkgroupSize(maxWorkgroupSize);
@@ -366,17 +401,54 @@ namespace I3CLSimModuleHelper {
         
         return conv;
     }
+#endif
 
-    I3CLSimLightSourceToStepConverterGeant4Ptr initializeGeant4(I3RandomServicePtr rng,
-                                                             I3CLSimMediumPropertiesConstPtr medium,
-                                                             I3CLSimFunctionConstPtr wavelengthGenerationBias,
-                                                             uint64_t bunchSizeGranularity,
-                                                             uint64_t maxBunchSize,
-                                                             const I3CLSimLightSourceParameterizationSeries &parameterizationList,
-                                                             const std::string &physicsListName,
-                                                             double maxBetaChangePerStep,
-                                                             uint32_t maxNumPhotonsPerStep,
-                                                             bool multiprocessor)
+    I3CLSimStepToPhotonConverterNativePtr initializeNative(I3RandomServicePtr rng,
+                                                           I3CLSimSimpleGeometryFromI3GeometryPtr geometry,
+                                                           I3CLSimMediumPropertiesConstPtr medium,
+                                                           I3CLSimFunctionConstPtr wavelengthGenerationBias,
+                                                           const std::vector<I3CLSimRandomValueConstPtr> &wavelengthGenerators,
+                                                           bool stopDetectedPhotons,
+                                                           bool saveAllPhotons,
+                                                           double saveAllPhotonsPrescale,
+                                                           double fixedNumberOfAbsorptionLengths,
+                                                           double pancakeFactor,
+                                                           uint32_t photonHistoryEntries,
+                                                           uint32_t numThreads)
+    {
+        I3CLSimStepToPhotonConverterNativePtr conv(new I3CLSimStepToPhotonConverterNative(rng, numThreads));
+
+        conv->SetWlenGenerators(wavelengthGenerators);
+        conv->SetWlenBias(wavelengthGenerationBias);
+
+        conv->SetMediumProperties(medium);
+        conv->SetGeometry(geometry);
+
+        conv->SetStopDetectedPhotons(stopDetectedPhotons);
+        conv->SetSaveAllPhotons(saveAllPhotons);
+        conv->SetSaveAllPhotonsPrescale(saveAllPhotonsPrescale);
+
+        conv->SetFixedNumberOfAbsorptionLengths(fixedNumberOfAbsorptionLengths);
+        conv->SetDOMPancakeFactor(pancakeFactor);
+
+        conv->SetPhotonHistoryEntries(photonHistoryEntries);
+
+        log_info("native propagator uses %zu threads", conv->GetNumThreads());
+        log_info("maximum number of work items is %zu", conv->GetMaxNumWorkitems());
+
+        conv->Initialize();
+        
+        return conv;
+    }
+
+    I3CLSimLightSourceToStepConverterGeant4Ptr createGeant4(I3RandomServicePtr rng,
+                                                         I3CLSimMediumPropertiesConstPtr medium,
+                                                         I3CLSimFunctionConstPtr wavelengthGenerationBias,
+                                                         const I3CLSimLightSourceParameterizationSeries &parameterizationList,
+                                                         const std::string &physicsListName,
+                                                         double maxBetaChangePerStep,
+                                                         uint32_t maxNumPhotonsPerStep,
+                                                         uint32_t numWorkerProcesses)
     {
         I3CLSimLightSourceToStepConverterGeant4Ptr conv
         (
@@ -391,10 +463,38 @@ namespace I3CLSimModuleHelper {
         conv->SetRandomService(rng);
         conv->SetWlenBias(wavelengthGenerationBias);
         conv->SetMediumProperties(medium);
-        conv->SetMaxBunchSize(maxBunchSize);
-        conv->SetBunchSizeGranularity(bunchSizeGranularity);
         
         conv->SetLightSourceParameterizationSeries(parameterizationList);
+        conv->SetNumWorkerProcesses(numWorkerProcesses);
+        
+        conv->ForkWorkerProcesses();
+        
+        return conv;
+    }
+    
+    I3CLSimLightSourceToStepConverterGeant4Ptr initializeGeant4(I3RandomServicePtr rng,
+                                                             I3CLSimMediumPropertiesConstPtr medium,
+                                                             I3CLSimFunctionConstPtr wavelengthGenerationBias,
+                                                             uint64_t bunchSizeGranularity,
+                                                             uint64_t maxBunchSize,
+                                                             const I3CLSimLightSourceParameterizationSeries &parameterizationList,
+                                                             const std::string &physicsListName,
+                                                             double maxBetaChangePerStep,
+                                                             uint32_t maxNumPhotonsPerStep,
+                                                             uint32_t numWorkerProcesses)
+    {
+        I3CLSimLightSourceToStepConverterGeant4Ptr conv =
+        createGeant4(rng,
+                     medium,
+                     wavelengthGenerationBias,
+                     parameterizationList,
+                     physicsListName,
+                     maxBetaChangePerStep,
+                     maxNumPhotonsPerStep,
+                     numWorkerProcesses);
+        
+        conv->SetMaxBunchSize(maxBunchSize);
+        conv->SetBunchSizeGranularity(bunchSizeGranularity);
         
         conv->Initialize();
         
@@ -0,0 +1,161 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimPhotonSeriesColumns.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#include "clsim/I3CLSimPhotonSeriesColumns.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+    // compares entries by (identifier, stringID, omID, original index)
+    class CompareByIdentifierAndOMKey
+    {
+    public:
+        CompareByIdentifierAndOMKey(const std::vector<uint32_t> &identifier,
+                                    const std::vector<int16_t> &stringID,
+                                    const std::vector<uint16_t> &omID)
+        : identifier_(identifier), stringID_(stringID), omID_(omID) {;}
+
+        inline bool operator()(uint32_t a, uint32_t b) const
+        {
+            if (identifier_[a] != identifier_[b]) return identifier_[a] < identifier_[b];
+            if (stringID_[a] != stringID_[b]) return stringID_[a] < stringID_[b];
+            if (omID_[a] != omID_[b]) return omID_[a] < omID_[b];
+            return a < b;
+        }
+
+    private:
+        const std::vector<uint32_t> &identifier_;
+        const std::vector<int16_t> &stringID_;
+        const std::vector<uint16_t> &omID_;
+    };
+
+    template <typename T>
+    void ApplyPermutation(std::vector<T> &column, const std::vector<uint32_t> &order)
+    {
+        std::vector<T> sorted(column.size());
+        for (std::size_t i=0;i<order.size();++i)
+        {
+            sorted[i] = column[order[i]];
+        }
+        column.swap(sorted);
+    }
+}
+
+I3CLSimPhotonSeriesColumns::I3CLSimPhotonSeriesColumns(const I3CLSimPhotonSeriesView &photons)
+{
+    Fill(photons);
+}
+
+void I3CLSimPhotonSeriesColumns::Fill(const I3CLSimPhotonSeriesView &photons)
+{
+    const std::size_t numPhotons = photons.size();
+    if (numPhotons > static_cast<std::size_t>(std::numeric_limits<uint32_t>::max()))
+        throw std::length_error("I3CLSimPhotonSeriesColumns cannot hold more than 2^32-1 photons");
+
+    time_.resize(numPhotons);
+    weight_.resize(numPhotons);
+    wavelength_.resize(numPhotons);
+    stringID_.resize(numPhotons);
+    omID_.resize(numPhotons);
+    identifier_.resize(numPhotons);
+    index_.resize(numPhotons);
+
+    for (std::size_t i=0;i<numPhotons;++i)
+    {
+        const I3CLSimPhoton &photon = photons[i];
+
+        time_[i] = photon.GetTime();
+        weight_[i] = photon.GetWeight();
+        wavelength_[i] = photon.GetWavelength();
+        stringID_[i] = photon.GetStringID();
+        omID_[i] = photon.GetOMID();
+        identifier_[i] = photon.GetID();
+        index_[i] = static_cast<uint32_t>(i);
+    }
+}
+
+void I3CLSimPhotonSeriesColumns::SortByIdentifierAndOMKey()
+{
+    if (size()<=1) return;
+
+    // sort a list of positions first and move
+    // all columns into place afterwards
+    std::vector<uint32_t> order(size());
+    for (std::size_t i=0;i<order.size();++i) order[i]=static_cast<uint32_t>(i);
+
+    std::sort(order.begin(), order.end(),
+              CompareByIdentifierAndOMKey(identifier_, stringID_, omID_));
+
+    ApplyPermutation(time_, order);
+    ApplyPermutation(weight_, order);
+    ApplyPermutation(wavelength_, order);
+    ApplyPermutation(stringID_, order);
+    ApplyPermutation(omID_, order);
+    ApplyPermutation(identifier_, order);
+    ApplyPermutation(index_, order);
+}
+
+void I3CLSimPhotonSeriesColumns::clear()
+{
+    time_.clear();
+    weight_.clear();
+    wavelength_.clear();
+    stringID_.clear();
+    omID_.clear();
+    identifier_.clear();
+    index_.clear();
+}
+
+std::size_t I3CLSimPhotonSeriesColumns::FindIdentifierRunEnd(std::size_t start) const
+{
+    const std::size_t numEntries = size();
+    if (start >= numEntries) return numEntries;
+
+    const uint32_t identifier = identifier_[start];
+
+    std::size_t end=start+1;
+    while ((end<numEntries) && (identifier_[end]==identifier)) ++end;
+    return end;
+}
+
+std::size_t I3CLSimPhotonSeriesColumns::FindOMKeyRunEnd(std::size_t start) const
+{
+    const std::size_t numEntries = size();
+    if (start >= numEntries) return numEntries;
+
+    const uint32_t identifier = identifier_[start];
+    const int16_t stringID = stringID_[start];
+    const uint16_t omID = omID_[start];
+
+    std::size_t end=start+1;
+    while ((end<numEntries) &&
+           (identifier_[end]==identifier) &&
+           (stringID_[end]==stringID) &&
+           (omID_[end]==omID)) ++end;
+    return end;
+}
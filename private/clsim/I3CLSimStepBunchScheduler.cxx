@@ -0,0 +1,433 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimStepBunchScheduler.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+#include <inttypes.h>
+
+#include "clsim/I3CLSimStepBunchScheduler.h"
+
+#include "icetray/I3Units.h"
+
+#include <cmath>
+#include <limits>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+
+const std::size_t I3CLSimStepBunchScheduler::default_maxQueuedPerDevice=2;
+const std::size_t I3CLSimStepBunchScheduler::default_maxPendingPerDevice=4;
+
+namespace {
+    // weight of a new measurement in the running throughput estimate
+    const double throughputSmoothing = 0.25;
+
+    // how long a feeder sleeps while its converter's queue is full
+    const long feederPollMicroseconds = 1000;
+
+    // re-evaluate stealing decisions at least this often while idle
+    const long feederIdleWaitMilliseconds = 10;
+}
+
+I3CLSimStepBunchScheduler::I3CLSimStepBunchScheduler(const std::vector<I3CLSimStepToPhotonConverterPtr> &converters,
+                                                     std::size_t maxQueuedPerDevice,
+                                                     std::size_t maxPendingPerDevice)
+:
+maxQueuedPerDevice_(maxQueuedPerDevice),
+maxPendingPerDevice_(maxPendingPerDevice),
+numPendingBunches_(0),
+numBunchesInHandover_(0),
+results_(new I3CLSimQueue<I3CLSimStepToPhotonConverter::ConversionResult_t>(0))
+{
+    if (converters.empty())
+        log_fatal("You need to supply at least one converter.");
+    if (maxQueuedPerDevice_==0)
+        log_fatal("maxQueuedPerDevice must not be 0.");
+    if (maxPendingPerDevice_==0)
+        log_fatal("maxPendingPerDevice must not be 0.");
+
+    devices_.resize(converters.size());
+    for (std::size_t i=0;i<converters.size();++i)
+    {
+        if (!converters[i])
+            log_fatal("Converter #%zu is (null).", i);
+        if (!converters[i]->IsInitialized())
+            log_fatal("Converter #%zu is not initialized.", i);
+
+        Device_t &device = devices_[i];
+        device.converter = converters[i];
+        device.pendingPhotons=0;
+        device.photonsPerSecond=NAN;
+        device.numBunchesStolen=0;
+        device.lastHandoverValid=false;
+    }
+
+    // start the threads only once the device list is complete
+    for (std::size_t i=0;i<devices_.size();++i)
+    {
+        devices_[i].feederThread = boost::shared_ptr<boost::thread>
+        (new boost::thread(boost::bind(&I3CLSimStepBunchScheduler::FeederThread, this, i)));
+        devices_[i].collectorThread = boost::shared_ptr<boost::thread>
+        (new boost::thread(boost::bind(&I3CLSimStepBunchScheduler::CollectorThread, this, i)));
+    }
+}
+
+I3CLSimStepBunchScheduler::~I3CLSimStepBunchScheduler()
+{
+    BOOST_FOREACH(Device_t &device, devices_)
+    {
+        if (device.feederThread) device.feederThread->interrupt();
+        if (device.collectorThread) device.collectorThread->interrupt();
+    }
+
+    BOOST_FOREACH(Device_t &device, devices_)
+    {
+        if ((device.feederThread) && (device.feederThread->joinable()))
+            device.feederThread->join(); // wait for it indefinitely
+        if ((device.collectorThread) && (device.collectorThread->joinable()))
+            device.collectorThread->join(); // wait for it indefinitely
+
+        device.feederThread.reset();
+        device.collectorThread.reset();
+    }
+}
+
+double I3CLSimStepBunchScheduler::EffectiveThroughput(std::size_t deviceIndex) const
+{
+    const double rate = devices_[deviceIndex].photonsPerSecond;
+    if (!std::isnan(rate)) return rate;
+
+    // nothing measured yet for this device: assume it
+    // performs like the average of the ones we know about
+    double sum=0.;
+    std::size_t num=0;
+    BOOST_FOREACH(const Device_t &device, devices_)
+    {
+        if (std::isnan(device.photonsPerSecond)) continue;
+        sum+=device.photonsPerSecond;
+        ++num;
+    }
+    if (num==0) return 1.; // all devices are equal
+    return sum/static_cast<double>(num);
+}
+
+void I3CLSimStepBunchScheduler::EnqueueSteps(I3CLSimStepSeriesConstPtr steps, uint32_t identifier)
+{
+    if (!steps) log_fatal("Received NULL steps.");
+
+    Bunch_t bunch;
+    bunch.steps = steps;
+    bunch.identifier = identifier;
+    bunch.numPhotons = 0;
+    BOOST_FOREACH(const I3CLSimStep &step, *steps)
+    {
+        bunch.numPhotons += step.numPhotons;
+    }
+    if (bunch.numPhotons==0) bunch.numPhotons=1; // still costs a kernel call
+
+    boost::unique_lock<boost::mutex> guard(mutex_);
+
+    // apply back-pressure towards the step generator
+    ThrowIfFailed();
+    while (numPendingBunches_ >= maxPendingPerDevice_*devices_.size())
+    {
+        cond_.wait(guard);
+        ThrowIfFailed();
+    }
+
+    // assign to the device with the earliest estimated completion time
+    std::size_t bestDevice=0;
+    double bestTime=std::numeric_limits<double>::infinity();
+    for (std::size_t i=0;i<devices_.size();++i)
+    {
+        const double finishTime =
+        static_cast<double>(devices_[i].pendingPhotons + bunch.numPhotons)/EffectiveThroughput(i);
+
+        if (finishTime < bestTime)
+        {
+            bestTime=finishTime;
+            bestDevice=i;
+        }
+    }
+
+    log_trace("bunch %" PRIu32 " (%" PRIu64 " photons) assigned to device %zu",
+              identifier, bunch.numPhotons, bestDevice);
+
+    devices_[bestDevice].pending.push_back(bunch);
+    devices_[bestDevice].pendingPhotons += bunch.numPhotons;
+    ++numPendingBunches_;
+
+    cond_.notify_all();
+}
+
+void I3CLSimStepBunchScheduler::WaitUntilDispatched()
+{
+    boost::unique_lock<boost::mutex> guard(mutex_);
+
+    ThrowIfFailed();
+    while ((numPendingBunches_>0) || (numBunchesInHandover_>0))
+    {
+        cond_.wait(guard);
+        ThrowIfFailed();
+    }
+}
+
+void I3CLSimStepBunchScheduler::ThrowIfFailed() const
+{
+    if (!error_.empty()) throw I3CLSimStepToPhotonConverter_exception(error_);
+}
+
+void I3CLSimStepBunchScheduler::SetError(std::size_t deviceIndex, const std::string &what)
+{
+    log_error("device %zu failed: %s", deviceIndex, what.c_str());
+
+    {
+        boost::unique_lock<boost::mutex> guard(mutex_);
+        if (error_.empty())
+            error_ = "Device " + boost::lexical_cast<std::string>(deviceIndex) + " failed: " + what;
+        cond_.notify_all();
+    }
+
+    // wake up anyone waiting for results. The queue
+    // otherwise never contains NULL photon series.
+    results_->Put(I3CLSimStepToPhotonConverter::ConversionResult_t());
+}
+
+I3CLSimStepToPhotonConverter::ConversionResult_t I3CLSimStepBunchScheduler::GetConversionResult()
+{
+    {
+        boost::unique_lock<boost::mutex> guard(mutex_);
+        ThrowIfFailed();
+    }
+
+    I3CLSimStepToPhotonConverter::ConversionResult_t result = results_->Get();
+    if (!result.HasPhotons())
+    {
+        boost::unique_lock<boost::mutex> guard(mutex_);
+        ThrowIfFailed();
+    }
+    return result;
+}
+
+bool I3CLSimStepBunchScheduler::GetConversionResult(I3CLSimStepToPhotonConverter::ConversionResult_t &result, double timeout)
+{
+    {
+        boost::unique_lock<boost::mutex> guard(mutex_);
+        ThrowIfFailed();
+    }
+
+    // NULL photon series are used for timeouts and errors
+    if (timeout<=0.) {
+        if (!results_->GetNonBlocking(result)) return false;
+    } else {
+        result = results_->Get(timeout/I3Units::second, I3CLSimStepToPhotonConverter::ConversionResult_t());
+    }
+
+    if (!result.HasPhotons())
+    {
+        boost::unique_lock<boost::mutex> guard(mutex_);
+        ThrowIfFailed();
+        return false;
+    }
+    return true;
+}
+
+double I3CLSimStepBunchScheduler::GetThroughputEstimate(std::size_t deviceIndex) const
+{
+    boost::unique_lock<boost::mutex> guard(mutex_);
+    if (deviceIndex>=devices_.size()) log_fatal("Invalid device index %zu", deviceIndex);
+    return devices_[deviceIndex].photonsPerSecond;
+}
+
+uint64_t I3CLSimStepBunchScheduler::GetNumBunchesStolen(std::size_t deviceIndex) const
+{
+    boost::unique_lock<boost::mutex> guard(mutex_);
+    if (deviceIndex>=devices_.size()) log_fatal("Invalid device index %zu", deviceIndex);
+    return devices_[deviceIndex].numBunchesStolen;
+}
+
+bool I3CLSimStepBunchScheduler::TakeBunch(std::size_t deviceIndex, Bunch_t &bunch)
+{
+    Device_t &self = devices_[deviceIndex];
+
+    if (!self.pending.empty())
+    {
+        bunch = self.pending.front();
+        self.pending.pop_front();
+        self.pendingPhotons -= bunch.numPhotons;
+        --numPendingBunches_;
+        return true;
+    }
+
+    // Nothing left for us. Look for the device with the longest
+    // estimated backlog and take the last bunch on its list, but only
+    // if we can finish it before that device would have worked off its
+    // backlog. This keeps slow devices from grabbing the last few
+    // bunches of a fast one and producing a long tail.
+    std::size_t victim=devices_.size();
+    double victimBacklogTime=0.;
+    for (std::size_t i=0;i<devices_.size();++i)
+    {
+        if (i==deviceIndex) continue;
+        if (devices_[i].pending.empty()) continue;
+
+        const double backlogTime = static_cast<double>(devices_[i].pendingPhotons)/EffectiveThroughput(i);
+        if (backlogTime > victimBacklogTime)
+        {
+            victimBacklogTime=backlogTime;
+            victim=i;
+        }
+    }
+    if (victim==devices_.size()) return false;
+
+    Device_t &other = devices_[victim];
+    const double ourTime = static_cast<double>(other.pending.back().numPhotons)/EffectiveThroughput(deviceIndex);
+    if (ourTime >= victimBacklogTime) return false;
+
+    bunch = other.pending.back();
+    other.pending.pop_back();
+    other.pendingPhotons -= bunch.numPhotons;
+    --numPendingBunches_;
+    ++self.numBunchesStolen;
+
+    log_trace("device %zu stole bunch %" PRIu32 " from device %zu", deviceIndex, bunch.identifier, victim);
+
+    return true;
+}
+
+void I3CLSimStepBunchScheduler::FeederThread(std::size_t deviceIndex)
+{
+    try {
+        FeederThread_impl(deviceIndex);
+    } catch(boost::thread_interrupted &i) {
+        log_trace("feeder thread for device %zu was interrupted. closing.", deviceIndex);
+    } catch(std::exception &e) {
+        // do not let this escape the thread, report it to the caller instead
+        SetError(deviceIndex, e.what());
+    }
+}
+
+void I3CLSimStepBunchScheduler::FeederThread_impl(std::size_t deviceIndex)
+{
+    I3CLSimStepToPhotonConverterPtr converter = devices_[deviceIndex].converter;
+
+    for (;;)
+    {
+        // wait until the converter can take another bunch. Bunches are
+        // only taken afterwards so they can be stolen in the meantime.
+        std::size_t queueSize;
+        for (;;)
+        {
+            queueSize = converter->QueueSize();
+            if (queueSize < maxQueuedPerDevice_) break;
+            boost::this_thread::sleep(boost::posix_time::microseconds(feederPollMicroseconds));
+        }
+        const boost::posix_time::ptime now(boost::posix_time::microsec_clock::universal_time());
+
+        Bunch_t bunch;
+        {
+            boost::unique_lock<boost::mutex> guard(mutex_);
+            Device_t &self = devices_[deviceIndex];
+
+            // everything that left the converter's queue since
+            // we last looked has been picked up by the device
+            uint64_t consumedPhotons=0;
+            while (self.queuedPhotons.size() > queueSize)
+            {
+                consumedPhotons += self.queuedPhotons.front();
+                self.queuedPhotons.pop_front();
+            }
+
+            // If the queue is still not empty, the bunch we handed over
+            // last is still on it and the device has been busy ever since.
+            if ((self.lastHandoverValid) && (queueSize>0) && (consumedPhotons>0))
+            {
+                const double seconds = static_cast<double>((now-self.lastHandover).total_microseconds())*1e-6;
+                if (seconds > 0.)
+                {
+                    const double rate = static_cast<double>(consumedPhotons)/seconds;
+                    if (std::isnan(self.photonsPerSecond)) {
+                        self.photonsPerSecond = rate;
+                    } else {
+                        self.photonsPerSecond += throughputSmoothing*(rate-self.photonsPerSecond);
+                    }
+                }
+            }
+
+            while (!TakeBunch(deviceIndex, bunch))
+            {
+                // we are about to idle, the next interval is not a measurement
+                self.lastHandoverValid=false;
+                cond_.timed_wait(guard, boost::posix_time::milliseconds(feederIdleWaitMilliseconds));
+            }
+
+            ++numBunchesInHandover_;
+
+            // let the producer know there is space again
+            cond_.notify_all();
+        }
+
+        // this should not block for long, we made sure there is room
+        converter->EnqueueSteps(bunch.steps, bunch.identifier);
+
+        {
+            boost::unique_lock<boost::mutex> guard(mutex_);
+            Device_t &self = devices_[deviceIndex];
+
+            --numBunchesInHandover_;
+
+            self.queuedPhotons.push_back(bunch.numPhotons);
+            self.lastHandover = boost::posix_time::microsec_clock::universal_time();
+            self.lastHandoverValid=true;
+
+            cond_.notify_all();
+        }
+    }
+}
+
+void I3CLSimStepBunchScheduler::CollectorThread(std::size_t deviceIndex)
+{
+    I3CLSimStepToPhotonConverterPtr converter = devices_[deviceIndex].converter;
+
+    try {
+        for (;;)
+        {
+            // blocks until the device has finished a bunch
+            I3CLSimStepToPhotonConverter::ConversionResult_t res =
+            converter->GetConversionResult();
+            if (!res.HasPhotons()) log_fatal("Internal error: received NULL photon series from device %zu.", deviceIndex);
+
+            results_->Put(res);
+        }
+    } catch(boost::thread_interrupted &i) {
+        log_trace("collector thread for device %zu was interrupted. closing.", deviceIndex);
+    } catch(std::exception &e) {
+        // do not let this escape the thread, report it to the caller instead
+        SetError(deviceIndex, e.what());
+    }
+}
@@ -0,0 +1,311 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimStepPreCuller.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#include "clsim/I3CLSimStepPreCuller.h"
+
+#include "clsim/function/I3CLSimScalarFieldConstant.h"
+
+#include "opencl/I3CLSimHelperDistanceCulling.h"
+
+#include "phys-services/I3GSLRandomService.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+I3CLSimStepPreCuller::I3CLSimStepPreCuller(I3CLSimSimpleGeometryConstPtr geometry,
+                                           I3CLSimMediumPropertiesConstPtr mediumProperties,
+                                           double minimumProbability,
+                                           uint64_t bunchSizeGranularity,
+                                           uint32_t rngSeed)
+:
+mediumProperties_(mediumProperties),
+minimumProbability_(minimumProbability),
+bunchSizeGranularity_(bunchSizeGranularity),
+rng_(new I3GSLRandomService(rngSeed)),
+totalNumPhotonsIn_(0),
+totalNumPhotonsOut_(0),
+totalNumStepsRemoved_(0)
+{
+    if (!mediumProperties_)
+        throw std::runtime_error("I3CLSimStepPreCuller: medium properties are (null)!");
+    if ((std::isnan(minimumProbability_)) || (minimumProbability_ <= 0.) || (minimumProbability_ > 1.))
+        throw std::runtime_error("I3CLSimStepPreCuller: the minimum probability has to be in (0,1]!");
+    if (bunchSizeGranularity_==0)
+        throw std::runtime_error("I3CLSimStepPreCuller: the bunch size granularity must not be 0!");
+
+    // used to fill up step series (see I3CLSimLightSourceToStepConverterGeant4)
+    noOpStep_.SetPos(I3Position(0.,0.,0.));
+    noOpStep_.SetDir(I3Direction(0.,0.,-1.));
+    noOpStep_.SetTime(0.);
+    noOpStep_.SetLength(0.);
+    noOpStep_.SetNumPhotons(0);
+    noOpStep_.SetWeight(0.);
+    noOpStep_.SetBeta(1.);
+
+    const std::vector<double> maxDistPerAbsLenPerLayer =
+        I3CLSimHelper::GetMaxDistancePerAbsorptionLengthPerLayer(*mediumProperties_);
+    if (maxDistPerAbsLenPerLayer.empty())
+        throw std::runtime_error("I3CLSimStepPreCuller: the medium does not have any layers!");
+    maxDistPerAbsLen_ = *std::max_element(maxDistPerAbsLenPerLayer.begin(), maxDistPerAbsLenPerLayer.end());
+    
+    // The layers can only be used for a constant tilt shift
+    // (i.e. no tilt at all). The photons could otherwise
+    // move between layers without changing their z coordinate.
+    iceTiltZShift_=0.;
+    I3CLSimScalarFieldConstant const *iceTiltZShiftConst =
+        dynamic_cast<I3CLSimScalarFieldConstant const *>(mediumProperties_->GetIceTiltZShift().get());
+    if (iceTiltZShiftConst) {
+        iceTiltZShift_ = iceTiltZShiftConst->GetValue(0.,0.,0.);
+        maxDistPerAbsLenPerLayer_ = maxDistPerAbsLenPerLayer;
+
+        const double layerHeight = mediumProperties_->GetLayersHeight();
+        verticalOpticalDepthAtLayerBottom_.resize(maxDistPerAbsLenPerLayer_.size()+1);
+        verticalOpticalDepthAtLayerBottom_[0]=0.;
+        for (std::size_t i=0;i<maxDistPerAbsLenPerLayer_.size();++i)
+        {
+            verticalOpticalDepthAtLayerBottom_[i+1] =
+                verticalOpticalDepthAtLayerBottom_[i] + layerHeight/maxDistPerAbsLenPerLayer_[i];
+        }
+    } else {
+        log_info("The ice is tilted, steps will only be culled using the largest absorption length of all layers.");
+    }
+    
+    UpdateGeometry(geometry);
+}
+
+I3CLSimStepPreCuller::~I3CLSimStepPreCuller()
+{
+    
+}
+
+void I3CLSimStepPreCuller::UpdateGeometry(I3CLSimSimpleGeometryConstPtr geometry)
+{
+    if (!geometry)
+        throw std::runtime_error("I3CLSimStepPreCuller: geometry is (null)!");
+    if (geometry->size()==0)
+        throw std::runtime_error("I3CLSimStepPreCuller: geometry does not contain any DOMs!");
+
+    I3CLSimHelper::DistanceFieldParameters_t fieldParameters;
+    std::vector<float> distanceField;
+    I3CLSimHelper::GenerateDOMDistanceField(*geometry, distanceField, fieldParameters);
+    
+    const std::vector<double> &posZ = geometry->GetPosZVector();
+    const double omRadius = geometry->GetOMRadius();
+
+    boost::mutex::scoped_lock guard(mutex_);
+
+    distanceField_.swap(distanceField);
+    for (unsigned int i=0;i<3;++i)
+    {
+        distanceFieldStart_[i] = fieldParameters.start[i];
+        distanceFieldNumCells_[i] = fieldParameters.numCells[i];
+    }
+    distanceFieldCellWidth_ = fieldParameters.cellWidth;
+
+    domZMin_ = *std::min_element(posZ.begin(), posZ.end()) - omRadius;
+    domZMax_ = *std::max_element(posZ.begin(), posZ.end()) + omRadius;
+}
+
+double I3CLSimStepPreCuller::GetMinDistanceToDOM(double x, double y, double z) const
+{
+    // this is the same as getMinDistanceToDOM() in the kernel
+    const double pos[3] = {x, y, z};
+    
+    double outsideSquared=0.;
+    uint32_t cell[3];
+    for (unsigned int i=0;i<3;++i)
+    {
+        const double fieldEnd = distanceFieldStart_[i] + static_cast<double>(distanceFieldNumCells_[i])*distanceFieldCellWidth_;
+        const double outside = std::max(std::max(distanceFieldStart_[i]-pos[i], pos[i]-fieldEnd), 0.);
+        outsideSquared += outside*outside;
+        
+        const double cellIndex = std::floor((pos[i]-distanceFieldStart_[i])/distanceFieldCellWidth_);
+        if (cellIndex <= 0.) {
+            cell[i] = 0;
+        } else if (cellIndex >= static_cast<double>(distanceFieldNumCells_[i]-1)) {
+            cell[i] = distanceFieldNumCells_[i]-1;
+        } else {
+            cell[i] = static_cast<uint32_t>(cellIndex);
+        }
+    }
+    
+    const double cellValue = distanceField_[(cell[2]*distanceFieldNumCells_[1]+cell[1])*distanceFieldNumCells_[0]+cell[0]];
+    
+    return std::sqrt(outsideSquared + cellValue*cellValue);
+}
+
+double I3CLSimStepPreCuller::GetVerticalOpticalDepth(double z) const
+{
+    const std::size_t numLayers = maxDistPerAbsLenPerLayer_.size();
+    const double layerHeight = mediumProperties_->GetLayersHeight();
+    const double relativeZ = z - mediumProperties_->GetLayersZStart();
+    
+    if (relativeZ < 0.) {
+        // extend the lowest layer downwards (this is negative)
+        return relativeZ/maxDistPerAbsLenPerLayer_[0];
+    }
+    
+    const double layerIndex = std::floor(relativeZ/layerHeight);
+    if (layerIndex >= static_cast<double>(numLayers)) {
+        // extend the highest layer upwards
+        return verticalOpticalDepthAtLayerBottom_[numLayers] +
+            (relativeZ - static_cast<double>(numLayers)*layerHeight)/maxDistPerAbsLenPerLayer_[numLayers-1];
+    }
+    
+    const std::size_t layer = static_cast<std::size_t>(layerIndex);
+    return verticalOpticalDepthAtLayerBottom_[layer] +
+        (relativeZ - layerIndex*layerHeight)/maxDistPerAbsLenPerLayer_[layer];
+}
+
+double I3CLSimStepPreCuller::GetMaxHitProbability(const I3CLSimStep &step) const
+{
+    // photons are emitted anywhere between the start and the end of the step
+    const double length = step.GetLength();
+    const double sinTheta = std::sin(step.GetDirTheta());
+    const double dirX = sinTheta*std::cos(step.GetDirPhi());
+    const double dirY = sinTheta*std::sin(step.GetDirPhi());
+    const double dirZ = std::cos(step.GetDirTheta());
+
+    const double startZ = step.GetPosZ();
+    const double endZ = startZ + length*dirZ;
+
+    // the distance from any point on the step to any DOM is at least
+    // the distance from the center of the step minus half its length
+    const double minDistance = std::max(
+        GetMinDistanceToDOM(step.GetPosX() + 0.5*length*dirX,
+                            step.GetPosY() + 0.5*length*dirY,
+                            0.5*(startZ + endZ)) - 0.5*length,
+        0.);
+    
+    double opticalDepth = minDistance/maxDistPerAbsLen_;
+
+    if (!maxDistPerAbsLenPerLayer_.empty())
+    {
+        // Photons also have to cross all layers between the step and the DOMs.
+        // The tilt shifts photons and DOMs alike, so it only moves the layers.
+        const double stepZMin = std::min(startZ, endZ);
+        const double stepZMax = std::max(startZ, endZ);
+        
+        double verticalOpticalDepth=0.;
+        if (stepZMin > domZMax_) {
+            verticalOpticalDepth = GetVerticalOpticalDepth(stepZMin-iceTiltZShift_) - GetVerticalOpticalDepth(domZMax_-iceTiltZShift_);
+        } else if (stepZMax < domZMin_) {
+            verticalOpticalDepth = GetVerticalOpticalDepth(domZMin_-iceTiltZShift_) - GetVerticalOpticalDepth(stepZMax-iceTiltZShift_);
+        }
+        
+        opticalDepth = std::max(opticalDepth, verticalOpticalDepth);
+    }
+    
+    return std::exp(-opticalDepth);
+}
+
+I3CLSimStepSeriesConstPtr I3CLSimStepPreCuller::Process(I3CLSimStepSeriesConstPtr steps)
+{
+    if (!steps) return steps;
+    
+    boost::mutex::scoped_lock guard(mutex_);
+
+    I3CLSimStepSeriesPtr output;
+    uint64_t numPhotonsIn=0;
+    uint64_t numPhotonsOut=0;
+    
+    for (std::size_t i=0;i<steps->size();++i)
+    {
+        const I3CLSimStep &step = (*steps)[i];
+        
+        // leave dummy steps alone
+        if ((step.GetNumPhotons()==0) || (step.GetWeight()<=0.))
+        {
+            if (output) output->push_back(step);
+            continue;
+        }
+        
+        numPhotonsIn += step.GetNumPhotons();
+        
+        const double probability = GetMaxHitProbability(step);
+        if (probability >= minimumProbability_)
+        {
+            if (output) output->push_back(step);
+            numPhotonsOut += step.GetNumPhotons();
+            continue;
+        }
+        
+        // Keep each photon with probability probability/minimumProbability
+        // and scale up the weight of the ones left by the inverse.
+        const double keepProbability = probability/minimumProbability_;
+        const uint32_t numPhotons = (keepProbability > 0.) ?
+            static_cast<uint32_t>(rng_->Binomial(static_cast<int>(step.GetNumPhotons()), keepProbability)) : 0;
+        
+        if (!output) {
+            // this is the first step to be changed. Copy all steps before it.
+            output = I3CLSimStepSeriesPtr(new I3CLSimStepSeries());
+            output->reserve(steps->size());
+            output->assign(steps->begin(), steps->begin()+i);
+        }
+        
+        if (numPhotons==0) {
+            ++totalNumStepsRemoved_;
+            continue;
+        }
+        
+        output->push_back(step);
+        output->back().SetNumPhotons(numPhotons);
+        output->back().SetWeight(step.GetWeight()/keepProbability);
+        numPhotonsOut += numPhotons;
+    }
+    
+    totalNumPhotonsIn_ += numPhotonsIn;
+    totalNumPhotonsOut_ += numPhotonsOut;
+    
+    if (!output) return steps;
+    
+    // the devices need a multiple of the granularity
+    // (an empty series is simply not sent to them)
+    if (output->size()%bunchSizeGranularity_ != 0)
+        output->resize(((output->size()+bunchSizeGranularity_-1)/bunchSizeGranularity_)*bunchSizeGranularity_, noOpStep_);
+    
+    return output;
+}
+
+uint64_t I3CLSimStepPreCuller::GetTotalNumPhotonsIn() const
+{
+    boost::mutex::scoped_lock guard(mutex_);
+    return totalNumPhotonsIn_;
+}
+
+uint64_t I3CLSimStepPreCuller::GetTotalNumPhotonsOut() const
+{
+    boost::mutex::scoped_lock guard(mutex_);
+    return totalNumPhotonsOut_;
+}
+
+uint64_t I3CLSimStepPreCuller::GetTotalNumStepsRemoved() const
+{
+    boost::mutex::scoped_lock guard(mutex_);
+    return totalNumStepsRemoved_;
+}
@@ -0,0 +1,1585 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimStepToPhotonConverterNative.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+#include <inttypes.h>
+
+#include "clsim/I3CLSimStepToPhotonConverterNative.h"
+
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+#include <stdlib.h>
+#include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "dataclasses/I3Constants.h"
+#include "phys-services/I3GSLRandomService.h"
+
+#include "clsim/function/I3CLSimVectorTransformConstant.h"
+#include "clsim/function/I3CLSimScalarFieldConstant.h"
+
+#include "clsim/I3CLSimHelperSIMD.h"
+
+const std::size_t I3CLSimStepToPhotonConverterNative::default_maxNumWorkitems=10240;
+
+
+I3CLSimStepToPhotonConverterNative::I3CLSimStepToPhotonConverterNative(I3RandomServicePtr randomService,
+                                                                       std::size_t numThreads)
+:
+randomService_(randomService),
+initialized_(false),
+numThreads_(numThreads),
+maxNumWorkitems_(default_maxNumWorkitems),
+stopDetectedPhotons_(false),
+saveAllPhotons_(false),
+saveAllPhotonsPrescale_(0.001), // only save .1% of all photons when in "AllPhotons" mode
+fixedNumberOfAbsorptionLengths_(NAN),
+pancakeFactor_(1.),
+photonHistoryEntries_(0),
+usePacketPropagation_(true),
+omRadius_(NAN),
+iceTiltZShiftIsConstant_(false),
+iceTiltZShiftConstant_(0.),
+directionalAbsLenCorrectionIsConstant_(false),
+directionalAbsLenCorrectionConstant_(1.),
+rngBaseSeed_(0),
+numBunchesEnqueued_(0),
+statistics_total_device_duration_in_nanoseconds_(0),
+statistics_total_host_duration_in_nanoseconds_(0),
+statistics_total_kernel_calls_(0),
+statistics_total_num_photons_generated_(0),
+statistics_total_num_photons_atDOMs_(0)
+{
+    if (!randomService_) log_fatal("You need to supply a I3RandomService.");
+}
+
+I3CLSimStepToPhotonConverterNative::~I3CLSimStepToPhotonConverterNative()
+{
+    if (!threadObjs_.empty())
+    {
+        log_debug("Stopping the native propagator worker threads..");
+
+        BOOST_FOREACH(boost::shared_ptr<boost::thread> &thread, threadObjs_)
+        {
+            if (thread->joinable()) thread->interrupt();
+        }
+
+        BOOST_FOREACH(boost::shared_ptr<boost::thread> &thread, threadObjs_)
+        {
+            if (thread->joinable()) thread->join(); // wait for it indefinitely
+        }
+
+        log_debug("Native propagator worker threads stopped.");
+
+        threadObjs_.clear();
+    }
+}
+
+void I3CLSimStepToPhotonConverterNative::SetNumThreads(std::size_t val)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    numThreads_=val;
+}
+
+std::size_t I3CLSimStepToPhotonConverterNative::GetNumThreads() const
+{
+    if (numThreads_>0) return numThreads_;
+
+    const std::size_t hardwareThreads = boost::thread::hardware_concurrency();
+    return (hardwareThreads>0)?hardwareThreads:1;
+}
+
+void I3CLSimStepToPhotonConverterNative::SetMaxNumWorkitems(std::size_t val)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    if (val==0)
+        throw I3CLSimStepToPhotonConverter_exception("Invalid maximum number of work items: 0");
+
+    maxNumWorkitems_=val;
+}
+
+std::size_t I3CLSimStepToPhotonConverterNative::GetMaxNumWorkitems() const
+{
+    return maxNumWorkitems_;
+}
+
+std::size_t I3CLSimStepToPhotonConverterNative::GetWorkgroupSize() const
+{
+    return 1;
+}
+
+void I3CLSimStepToPhotonConverterNative::SetUsePacketPropagation(bool value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    usePacketPropagation_=value;
+}
+
+bool I3CLSimStepToPhotonConverterNative::GetUsePacketPropagation() const
+{
+    return usePacketPropagation_;
+}
+
+std::size_t I3CLSimStepToPhotonConverterNative::GetPacketWidth()
+{
+    return I3CLSimHelper::FloatPacket::width;
+}
+
+std::string I3CLSimStepToPhotonConverterNative::GetPacketInstructionSet()
+{
+    return I3CLSimHelper::FloatPacket::name();
+}
+
+void I3CLSimStepToPhotonConverterNative::Initialize()
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    if (wlenGenerators_.empty())
+        throw I3CLSimStepToPhotonConverter_exception("WlenGenerators not set!");
+
+    if (!wlenBias_)
+        throw I3CLSimStepToPhotonConverter_exception("WlenBias not set!");
+
+    if (!mediumProperties_)
+        throw I3CLSimStepToPhotonConverter_exception("MediumProperties not set!");
+
+    if (!geometry_)
+        throw I3CLSimStepToPhotonConverter_exception("Geometry not set!");
+
+    // everything the propagator evaluates needs to be available as host code
+    if (!wlenBias_->HasNativeImplementation())
+        throw I3CLSimStepToPhotonConverter_exception("The wavelength bias function does not have a native implementation!");
+
+    for (uint32_t i=0;i<mediumProperties_->GetLayersNum();++i)
+    {
+        if ((!mediumProperties_->GetAbsorptionLength(i)) || (!mediumProperties_->GetAbsorptionLength(i)->HasNativeImplementation()))
+            throw I3CLSimStepToPhotonConverter_exception("Absorption length function for layer " + boost::lexical_cast<std::string>(i) + " is not set or does not have a native implementation!");
+        if ((!mediumProperties_->GetScatteringLength(i)) || (!mediumProperties_->GetScatteringLength(i)->HasNativeImplementation()))
+            throw I3CLSimStepToPhotonConverter_exception("Scattering length function for layer " + boost::lexical_cast<std::string>(i) + " is not set or does not have a native implementation!");
+        if ((!mediumProperties_->GetPhaseRefractiveIndex(i)) || (!mediumProperties_->GetPhaseRefractiveIndex(i)->HasNativeImplementation()))
+            throw I3CLSimStepToPhotonConverter_exception("Phase refractive index function for layer " + boost::lexical_cast<std::string>(i) + " is not set or does not have a native implementation!");
+    }
+
+    if (mediumProperties_->GetGroupRefractiveIndexOverride(0)) {
+        if (!mediumProperties_->GetGroupRefractiveIndexOverride(0)->HasNativeImplementation())
+            throw I3CLSimStepToPhotonConverter_exception("The group refractive index override does not have a native implementation!");
+    } else {
+        if (!mediumProperties_->GetPhaseRefractiveIndex(0)->HasDerivative())
+            throw I3CLSimStepToPhotonConverter_exception("The phase refractive index needs a derivative in order to calculate the group velocity!");
+    }
+
+    scatteringCosAngleDist_ = mediumProperties_->GetScatteringCosAngleDistribution();
+    directionalAbsLenCorrection_ = mediumProperties_->GetDirectionalAbsorptionLengthCorrection();
+    iceTiltZShift_ = mediumProperties_->GetIceTiltZShift();
+    preScatterDirectionTransform_ = mediumProperties_->GetPreScatterDirectionTransform();
+    postScatterDirectionTransform_ = mediumProperties_->GetPostScatterDirectionTransform();
+
+    if (!scatteringCosAngleDist_)
+        throw I3CLSimStepToPhotonConverter_exception("scattering angle function is (null).");
+    if ((!directionalAbsLenCorrection_) || (!directionalAbsLenCorrection_->HasNativeImplementation()))
+        throw I3CLSimStepToPhotonConverter_exception("directional absorption length correction function is (null) or does not have a native implementation.");
+    if ((!iceTiltZShift_) || (!iceTiltZShift_->HasNativeImplementation()))
+        throw I3CLSimStepToPhotonConverter_exception("ice tilt z-shift is (null) or does not have a native implementation.");
+
+    // the constant transform is the identity, skip it altogether
+    if (boost::dynamic_pointer_cast<const I3CLSimVectorTransformConstant>(preScatterDirectionTransform_))
+        preScatterDirectionTransform_.reset();
+    if (boost::dynamic_pointer_cast<const I3CLSimVectorTransformConstant>(postScatterDirectionTransform_))
+        postScatterDirectionTransform_.reset();
+
+    if ((preScatterDirectionTransform_) && (!preScatterDirectionTransform_->HasNativeImplementation()))
+        throw I3CLSimStepToPhotonConverter_exception("pre-scattering direction transformation does not have a native implementation.");
+    if ((postScatterDirectionTransform_) && (!postScatterDirectionTransform_->HasNativeImplementation()))
+        throw I3CLSimStepToPhotonConverter_exception("post-scattering direction transformation does not have a native implementation.");
+
+    iceTiltZShiftIsConstant_ = static_cast<bool>(boost::dynamic_pointer_cast<const I3CLSimScalarFieldConstant>(iceTiltZShift_));
+    iceTiltZShiftConstant_ = iceTiltZShiftIsConstant_?iceTiltZShift_->GetValue(0.,0.,0.):0.;
+    directionalAbsLenCorrectionIsConstant_ = static_cast<bool>(boost::dynamic_pointer_cast<const I3CLSimScalarFieldConstant>(directionalAbsLenCorrection_));
+    directionalAbsLenCorrectionConstant_ = directionalAbsLenCorrectionIsConstant_?directionalAbsLenCorrection_->GetValue(0.,0.,0.):1.;
+
+    BuildGeometryIndex();
+
+    if (usePacketPropagation_) {
+        // the instruction set is fixed at compile time (see CLSIM_NATIVE_SIMD),
+        // fail here instead of crashing with an illegal instruction later on
+        if (!I3CLSimHelper::FloatPacket::IsSupportedByCPU())
+            throw I3CLSimStepToPhotonConverter_exception("The native propagator was compiled for " + GetPacketInstructionSet() + ", which this CPU does not support. Rebuild with a different CLSIM_NATIVE_SIMD setting or use SetUsePacketPropagation(false).");
+
+        log_info("Native propagator uses packets of %zu photons (%s).",
+                 GetPacketWidth(), GetPacketInstructionSet().c_str());
+    } else {
+        log_info("Native propagator uses scalar double precision propagation.");
+    }
+
+    rngBaseSeed_ = static_cast<uint32_t>(randomService_->Integer(0xffffffff));
+    numBunchesEnqueued_ = 0;
+
+    const std::size_t numThreads = GetNumThreads();
+
+    // keep a few bunches per thread in the queue so that no worker starves
+    queueToWorkers_ = boost::shared_ptr<I3CLSimLockFreeQueue<WorkItem_t> >(new I3CLSimLockFreeQueue<WorkItem_t>(2*numThreads));
+    queueFromWorkers_ = boost::shared_ptr<I3CLSimQueue<I3CLSimStepToPhotonConverter::ConversionResult_t> >(new I3CLSimQueue<I3CLSimStepToPhotonConverter::ConversionResult_t>(0));
+
+    log_info("Starting %zu native propagator worker threads..", numThreads);
+
+    threadObjs_.clear();
+    for (std::size_t i=0;i<numThreads;++i)
+    {
+        threadObjs_.push_back(boost::shared_ptr<boost::thread>(new boost::thread(boost::bind(&I3CLSimStepToPhotonConverterNative::WorkerThread, this))));
+    }
+
+    initialized_=true;
+}
+
+void I3CLSimStepToPhotonConverterNative::BuildGeometryIndex()
+{
+    omRadius_ = geometry_->GetOMRadius();
+    strings_.clear();
+
+    const std::vector<int32_t> &stringIDs = geometry_->GetStringIDVector();
+    const std::vector<uint32_t> &domIDs = geometry_->GetDomIDVector();
+    const std::vector<double> &posX = geometry_->GetPosXVector();
+    const std::vector<double> &posY = geometry_->GetPosYVector();
+    const std::vector<double> &posZ = geometry_->GetPosZVector();
+
+    // group all DOMs by their string ID, sorted by z
+    std::map<int32_t, std::vector<std::pair<double, std::size_t> > > domsOnString;
+    for (std::size_t i=0;i<geometry_->size();++i)
+    {
+        if ((stringIDs[i] < std::numeric_limits<int16_t>::min()) ||
+            (stringIDs[i] > std::numeric_limits<int16_t>::max()))
+            log_fatal("Your detector I3Geometry uses a string ID \"%" PRIi32 "\". Large IDs like that are currently not supported by clsim.",
+                      stringIDs[i]);
+
+        if (domIDs[i] > std::numeric_limits<uint16_t>::max())
+            log_fatal("Your detector I3Geometry uses a OM ID \"%" PRIu32 "\". Large IDs like that are currently not supported by clsim.",
+                      domIDs[i]);
+
+        domsOnString[stringIDs[i]].push_back(std::make_pair(posZ[i], i));
+    }
+
+    typedef std::pair<const int32_t, std::vector<std::pair<double, std::size_t> > > domsOnStringPair_t;
+    BOOST_FOREACH(domsOnStringPair_t &it, domsOnString)
+    {
+        std::vector<std::pair<double, std::size_t> > &doms = it.second;
+        std::sort(doms.begin(), doms.end());
+
+        StringInfo_t info;
+        info.posX=0.; info.posY=0.;
+        for (std::size_t j=0;j<doms.size();++j)
+        {
+            const std::size_t i = doms[j].second;
+            info.posX += posX[i];
+            info.posY += posY[i];
+            info.domPosX.push_back(posX[i]);
+            info.domPosY.push_back(posY[i]);
+            info.domPosZ.push_back(posZ[i]);
+            info.stringIDs.push_back(static_cast<int16_t>(stringIDs[i]));
+            info.domIDs.push_back(static_cast<uint16_t>(domIDs[i]));
+        }
+        info.posX /= static_cast<double>(doms.size());
+        info.posY /= static_cast<double>(doms.size());
+        info.minZ = info.domPosZ.front();
+        info.maxZ = info.domPosZ.back();
+
+        double maxLateralDistSqr=0.;
+        for (std::size_t j=0;j<info.domPosX.size();++j)
+        {
+            const double dx = info.domPosX[j]-info.posX;
+            const double dy = info.domPosY[j]-info.posY;
+            maxLateralDistSqr = std::max(maxLateralDistSqr, dx*dx+dy*dy);
+        }
+        info.radius = std::sqrt(maxLateralDistSqr) + omRadius_;
+
+        strings_.push_back(info);
+    }
+
+    log_debug("Native propagator geometry: %zu DOMs on %zu strings", geometry_->size(), strings_.size());
+}
+
+void I3CLSimStepToPhotonConverterNative::WorkerThread()
+{
+    // do not interrupt this thread by default
+    boost::this_thread::disable_interruption di;
+
+    try {
+        WorkerThread_impl(di);
+    } catch(std::exception &e) {
+        SetWorkerError(e.what());
+    } catch(...) { // any other exceptions?
+        SetWorkerError("unknown exception");
+    }
+}
+
+void I3CLSimStepToPhotonConverterNative::SetWorkerError(const std::string &what)
+{
+    log_error("Native propagator worker thread died: %s", what.c_str());
+
+    {
+        boost::unique_lock<boost::mutex> guard(workerError_mutex_);
+        if (workerError_.empty())
+            workerError_ = "Native propagator worker thread died: " + what;
+    }
+
+    // wake up anyone waiting for results. The queue
+    // otherwise never contains NULL photon series.
+    queueFromWorkers_->Put(I3CLSimStepToPhotonConverter::ConversionResult_t());
+}
+
+void I3CLSimStepToPhotonConverterNative::ThrowIfWorkerFailed()
+{
+    boost::unique_lock<boost::mutex> guard(workerError_mutex_);
+    if (!workerError_.empty()) throw I3CLSimStepToPhotonConverter_exception(workerError_);
+}
+
+void I3CLSimStepToPhotonConverterNative::WorkerThread_impl(boost::this_thread::disable_interruption &di)
+{
+    for (;;)
+    {
+        WorkItem_t item;
+
+        {
+            boost::this_thread::restore_interruption ri(di);
+            try {
+                // this can block until there is something on the queue:
+                item = queueToWorkers_->Get();
+            } catch(boost::thread_interrupted &i) {
+                log_trace("Native propagator worker thread was interrupted. closing.");
+                break;
+            }
+        }
+
+        const boost::posix_time::ptime startTime = boost::posix_time::microsec_clock::universal_time();
+
+        I3RandomServicePtr rng(new I3GSLRandomService(item.rngSeed));
+
+        I3CLSimPhotonSeriesPtr photons(new I3CLSimPhotonSeries());
+        I3CLSimPhotonHistorySeriesPtr photonHistories;
+        if (photonHistoryEntries_>0) photonHistories = I3CLSimPhotonHistorySeriesPtr(new I3CLSimPhotonHistorySeries());
+
+        uint64_t totalNumberOfPhotons=0;
+        BOOST_FOREACH(const I3CLSimStep &step, *item.steps)
+        {
+            totalNumberOfPhotons += step.numPhotons;
+        }
+
+        if (usePacketPropagation_) {
+            PropagateStepsInPackets(*item.steps, rng, *photons, photonHistories.get());
+        } else {
+            BOOST_FOREACH(const I3CLSimStep &step, *item.steps)
+            {
+                PropagateStep(step, rng, *photons, photonHistories.get());
+            }
+        }
+
+        const boost::posix_time::ptime endTime = boost::posix_time::microsec_clock::universal_time();
+        const uint64_t duration_in_nanoseconds = static_cast<uint64_t>((endTime-startTime).total_microseconds())*1000;
+
+        {
+            boost::unique_lock<boost::mutex> guard(statistics_mutex_);
+            statistics_total_device_duration_in_nanoseconds_ += duration_in_nanoseconds;
+            statistics_total_host_duration_in_nanoseconds_ += duration_in_nanoseconds;
+            statistics_total_kernel_calls_++;
+            statistics_total_num_photons_generated_ += totalNumberOfPhotons;
+            statistics_total_num_photons_atDOMs_ += photons->size();
+        }
+
+        log_trace("Native propagator: bunch %" PRIu32 " done, %zu photons at DOMs.", item.identifier, photons->size());
+
+        queueFromWorkers_->Put(I3CLSimStepToPhotonConverter::ConversionResult_t(item.identifier, photons, photonHistories));
+    }
+}
+
+namespace {
+    const double EPSILON = 0.00001;
+    const std::vector<double> noParameters;
+
+    inline double sqr(double a) {return a*a;}
+
+    // same as in propagation_kernel.c.cl
+    inline void scatterDirectionByAngle(double cosa,
+                                        double sina,
+                                        double *direction,
+                                        double randomNumber)
+    {
+        // randomize direction of scattering (rotation around old direction axis)
+        const double b=2.0*I3Constants::pi*randomNumber;
+        const double cosb=std::cos(b);
+        const double sinb=std::sin(b);
+
+        // Rotate new direction into absolute frame of reference
+        const double sinth = std::sqrt(std::max(0., 1.-direction[2]*direction[2]));
+
+        if (sinth>0.) {  // Current direction not vertical, so rotate
+            const double oldDir[3] = {direction[0], direction[1], direction[2]};
+
+            direction[0]=oldDir[0]*cosa-((oldDir[1]*cosb+oldDir[2]*oldDir[0]*sinb)*sina/sinth);
+            direction[1]=oldDir[1]*cosa+((oldDir[0]*cosb-oldDir[2]*oldDir[1]*sinb)*sina/sinth);
+            direction[2]=oldDir[2]*cosa+sina*sinb*sinth;
+        } else {         // Current direction is vertical, so this is trivial
+            direction[0]=sina*cosb;
+            direction[1]=sina*sinb;
+            direction[2]=cosa*((direction[2]<0.)?-1.:1.);
+        }
+
+        const double recip_length = 1./std::sqrt(sqr(direction[0]) + sqr(direction[1]) + sqr(direction[2]));
+        direction[0] *= recip_length;
+        direction[1] *= recip_length;
+        direction[2] *= recip_length;
+    }
+
+    inline void sphDirFromCar(const double *carDir, float &theta_out, float &phi_out)
+    {
+        // Calculate Spherical coordinates from Cartesian
+        const double r_inv = 1./std::sqrt(carDir[0]*carDir[0]+carDir[1]*carDir[1]+carDir[2]*carDir[2]);
+
+        double theta = 0.;
+        if ((std::fabs(carDir[2]*r_inv))<=1.) {
+            theta=std::acos(carDir[2]*r_inv);
+        } else {
+            if (carDir[2]<0.) theta=I3Constants::pi;
+        }
+        if (theta<0.) theta+=2.*I3Constants::pi;
+
+        double phi=std::atan2(carDir[1],carDir[0]);
+        if (phi<0.) phi+=2.*I3Constants::pi;
+
+        theta_out = static_cast<float>(theta);
+        phi_out = static_cast<float>(phi);
+    }
+
+    inline void applyDirectionTransform(const I3CLSimVectorTransform &transform, double *direction)
+    {
+        std::vector<double> vec(direction, direction+3);
+        vec = transform.ApplyTransform(vec);
+        direction[0]=vec[0]; direction[1]=vec[1]; direction[2]=vec[2];
+    }
+
+    // the full state of a photon being tracked
+    struct PhotonState_t
+    {
+        double pos[3];
+        double time;
+        double dir[3];
+        double wlen;
+        double startPos[3];
+        double startTime;
+        double startDir[3];
+        double invGroupVel;
+        double totalPathLength;
+        uint32_t numScatters;
+    };
+
+    // Record a photon on a DOM (same as saveHit() in propagation_kernel.c.cl)
+    inline void saveHit(const PhotonState_t &photon,
+                        const float *history,
+                        double thisStepLength,
+                        double distanceTraveledInAbsorptionLengths,
+                        const I3CLSimStep &step,
+                        double wlenBias,
+                        int16_t hitOnString,
+                        uint16_t hitOnDom,
+                        uint32_t photonHistoryEntries,
+                        I3CLSimPhotonSeries &outputPhotons,
+                        I3CLSimPhotonHistorySeries *outputHistories)
+    {
+        outputPhotons.push_back(I3CLSimPhoton());
+        I3CLSimPhoton &outPhoton = outputPhotons.back();
+
+        outPhoton.SetPosX(photon.pos[0]+thisStepLength*photon.dir[0]);
+        outPhoton.SetPosY(photon.pos[1]+thisStepLength*photon.dir[1]);
+        outPhoton.SetPosZ(photon.pos[2]+thisStepLength*photon.dir[2]);
+        outPhoton.SetTime(photon.time+thisStepLength*photon.invGroupVel);
+
+        float theta, phi;
+        sphDirFromCar(photon.dir, theta, phi);
+        outPhoton.SetDirTheta(theta);
+        outPhoton.SetDirPhi(phi);
+        outPhoton.SetWavelength(photon.wlen);
+
+        outPhoton.SetCherenkovDist(photon.totalPathLength+thisStepLength);
+        outPhoton.SetNumScatters(photon.numScatters);
+        outPhoton.SetWeight(step.weight / wlenBias);
+        outPhoton.SetID(step.identifier);
+
+        outPhoton.SetStringID(hitOnString);
+        outPhoton.SetOMID(hitOnDom);
+
+        outPhoton.SetStartPosX(photon.startPos[0]);
+        outPhoton.SetStartPosY(photon.startPos[1]);
+        outPhoton.SetStartPosZ(photon.startPos[2]);
+        outPhoton.SetStartTime(photon.startTime);
+        sphDirFromCar(photon.startDir, theta, phi);
+        outPhoton.SetStartDirTheta(theta);
+        outPhoton.SetStartDirPhi(phi);
+
+        outPhoton.SetGroupVelocity(1./photon.invGroupVel);
+        outPhoton.SetDistInAbsLens(distanceTraveledInAbsorptionLengths);
+
+        if (!outputHistories) return;
+
+        outputHistories->push_back(I3CLSimPhotonHistory());
+        I3CLSimPhotonHistory &currentHistory = outputHistories->back();
+
+        if ((photon.numScatters==0) || (photonHistoryEntries==0)) return;
+
+        // store the most recent scatters in chronological order
+        const uint32_t numRecordedScatters = std::min(photon.numScatters, photonHistoryEntries);
+        uint32_t currentScatterIndex = (photon.numScatters<=photonHistoryEntries)?0:(photon.numScatters%photonHistoryEntries);
+        for (uint32_t j=0;j<numRecordedScatters;++j)
+        {
+            const float *entry = &(history[currentScatterIndex*4]);
+            currentHistory.push_back(entry[0], entry[1], entry[2], entry[3]);
+
+            ++currentScatterIndex;
+            if (currentScatterIndex>=photonHistoryEntries) currentScatterIndex=0;
+        }
+    }
+}
+
+double I3CLSimStepToPhotonConverterNative::GetGroupVelocity(double wlen) const
+{
+    // (the OpenCL kernel also assumes a group velocity that is constant w.r.t. layers)
+    const I3CLSimFunctionConstPtr &groupRefIndexOverride = mediumProperties_->GetGroupRefractiveIndicesOverride()[0];
+    if (groupRefIndexOverride) {
+        return I3Constants::c / groupRefIndexOverride->GetValue(wlen);
+    }
+
+    const I3CLSimFunctionConstPtr &phaseRefIndex = mediumProperties_->GetPhaseRefractiveIndices()[0];
+    const double n_inv = 1./phaseRefIndex->GetValue(wlen);
+    const double y = phaseRefIndex->GetDerivative(wlen);
+
+    return I3Constants::c * (1.0 + y*wlen*n_inv) * n_inv;
+}
+
+void I3CLSimStepToPhotonConverterNative::FindDOMIntersections(const double pos[3],
+                                                              const double dir[3],
+                                                              double stepLength,
+                                                              bool nearestOnly,
+                                                              std::vector<DOMHit_t> &hits) const
+{
+    hits.clear();
+
+    const double photonDirLenXYSqr = sqr(dir[0]) + sqr(dir[1]);
+    const double endZ = pos[2] + dir[2]*stepLength;
+    const double lowZ = std::min(pos[2], endZ) - omRadius_;
+    const double highZ = std::max(pos[2], endZ) + omRadius_;
+
+    double nearestDistance = stepLength;
+
+    BOOST_FOREACH(const StringInfo_t &string, strings_)
+    {
+        // check intersection with string cylinder
+        {
+            const double relX = pos[0] - string.posX;
+            const double relY = pos[1] - string.posY;
+            const double distSqr = (photonDirLenXYSqr > 0.) ?
+                sqr(relX*dir[1] - relY*dir[0])/photonDirLenXYSqr :
+                sqr(relX) + sqr(relY);
+            if (distSqr > sqr(string.radius)) continue;
+        }
+
+        // check if the segment is above or below the string
+        if (highZ < string.minZ - omRadius_) continue;
+        if (lowZ > string.maxZ + omRadius_) continue;
+
+        // this photon could potentially be hitting an om
+        // -> check all of them in the z range of this segment
+        const std::vector<double>::const_iterator first = std::lower_bound(string.domPosZ.begin(), string.domPosZ.end(), lowZ);
+        const std::vector<double>::const_iterator last = std::upper_bound(first, string.domPosZ.end(), highZ);
+
+        for (std::size_t i=first-string.domPosZ.begin(); i<static_cast<std::size_t>(last-string.domPosZ.begin()); ++i)
+        {
+            double urdot, discr;
+            {
+                const double drvec[3] = {string.domPosX[i] - pos[0],
+                                         string.domPosY[i] - pos[1],
+                                         string.domPosZ[i] - pos[2]};
+                const double dr2 = sqr(drvec[0]) + sqr(drvec[1]) + sqr(drvec[2]);
+
+                urdot = drvec[0]*dir[0] + drvec[1]*dir[1] + drvec[2]*dir[2];
+                discr = sqr(urdot) - dr2 + omRadius_*omRadius_;   // (discr)^2
+            }
+
+            if (discr < 0.) continue; // no intersection with this DOM
+
+            discr = std::sqrt(discr)/pancakeFactor_;
+
+            // distance from current point along the track to second intersection
+            if (urdot + discr < 0.) continue; // implies smin1 < 0, so no intersection
+
+            // distance from current point along the track to first intersection
+            const double smin1 = urdot - discr;
+
+            // smin2 > 0 && smin1 < 0 means that there *is* an intersection, but we are starting inside the DOM.
+            // This allows photons starting inside a DOM to leave (necessary for flashers):
+            if (smin1 < 0.) continue;
+
+            // check if distance to intersection <= thisStepLength; if not then no detection
+            if (smin1 >= ((nearestOnly)?nearestDistance:stepLength)) continue;
+
+            DOMHit_t hit;
+            hit.distance = smin1;
+            hit.stringID = string.stringIDs[i];
+            hit.domID = string.domIDs[i];
+
+            if (nearestOnly) {
+                // maybe we hit a closer OM later, in that case this one is replaced
+                nearestDistance = smin1;
+                hits.clear();
+            }
+            hits.push_back(hit);
+        }
+    }
+}
+
+double I3CLSimStepToPhotonConverterNative::PropagateThroughLayers(double effective_z,
+                                                                  int currentPhotonLayer,
+                                                                  double photon_dz,
+                                                                  double wlen,
+                                                                  double sca_step_left,
+                                                                  double &abs_lens_left) const
+{
+    // this is along the lines of the PPC kernel
+    const std::vector<I3CLSimFunctionConstPtr> &scatteringLengths = mediumProperties_->GetScatteringLengths();
+    const std::vector<I3CLSimFunctionConstPtr> &absorptionLengths = mediumProperties_->GetAbsorptionLengths();
+
+    const int numLayers = static_cast<int>(mediumProperties_->GetLayersNum());
+    const double layerBottomPos = mediumProperties_->GetLayersZStart();
+    const double layerThickness = mediumProperties_->GetLayersHeight();
+
+    // the "next" medium boundary (either top or bottom, depending on step direction)
+    const double currentLayerBoundary = static_cast<double>(currentPhotonLayer)*layerThickness + layerBottomPos;
+    double mediumBoundary = (photon_dz<0.)?(currentLayerBoundary):(currentLayerBoundary+layerThickness);
+
+    double currentScaLen = scatteringLengths[currentPhotonLayer]->GetValue(wlen);
+    double currentAbsLen = absorptionLengths[currentPhotonLayer]->GetValue(wlen);
+
+    double ais=( photon_dz*sca_step_left - (mediumBoundary-effective_z)/currentScaLen )*(1./layerThickness);
+    double aia=( photon_dz*abs_lens_left - (mediumBoundary-effective_z)/currentAbsLen )*(1./layerThickness);
+
+    // propagate through layers
+    int j=currentPhotonLayer;
+    if (photon_dz<0.) {
+        while ((j>0) && (ais<0.) && (aia<0.)) {
+            --j;
+            mediumBoundary-=layerThickness;
+            currentScaLen=scatteringLengths[j]->GetValue(wlen);
+            currentAbsLen=absorptionLengths[j]->GetValue(wlen);
+            ais+=1./currentScaLen;
+            aia+=1./currentAbsLen;
+        }
+    } else {
+        while ((j<numLayers-1) && (ais>0.) && (aia>0.)) {
+            ++j;
+            mediumBoundary+=layerThickness;
+            currentScaLen=scatteringLengths[j]->GetValue(wlen);
+            currentAbsLen=absorptionLengths[j]->GetValue(wlen);
+            ais-=1./currentScaLen;
+            aia-=1./currentAbsLen;
+        }
+    }
+
+    double distancePropagated;
+    double distanceToAbsorption;
+    if ((currentPhotonLayer==j) || ((std::fabs(photon_dz))<EPSILON)) {
+        distancePropagated=sca_step_left*currentScaLen;
+        distanceToAbsorption=abs_lens_left*currentAbsLen;
+    } else {
+        const double recip_photon_dz = 1./photon_dz;
+        distancePropagated=(ais*layerThickness*currentScaLen+mediumBoundary-effective_z)*recip_photon_dz;
+        distanceToAbsorption=(aia*layerThickness*currentAbsLen+mediumBoundary-effective_z)*recip_photon_dz;
+    }
+
+    // get overburden for distance
+    if (distanceToAbsorption<distancePropagated) {
+        distancePropagated=distanceToAbsorption;
+        abs_lens_left=0.;
+    } else {
+        abs_lens_left=(distanceToAbsorption-distancePropagated)/currentAbsLen;
+    }
+
+    return distancePropagated;
+}
+
+void I3CLSimStepToPhotonConverterNative::PropagateStep(const I3CLSimStep &step,
+                                                       const I3RandomServicePtr &rng,
+                                                       I3CLSimPhotonSeries &outputPhotons,
+                                                       I3CLSimPhotonHistorySeries *outputHistories) const
+{
+    const I3CLSimMediumProperties &medium = *mediumProperties_;
+    const std::vector<I3CLSimFunctionConstPtr> &phaseRefIndices = medium.GetPhaseRefractiveIndices();
+
+    const int numLayers = static_cast<int>(medium.GetLayersNum());
+    const double layerBottomPos = medium.GetLayersZStart();
+    const double layerThickness = medium.GetLayersHeight();
+
+    const bool noFlasher = (wlenGenerators_.size() <= 1);
+    const bool fixedAbsLens = !std::isnan(fixedNumberOfAbsorptionLengths_);
+
+    if ((!noFlasher) && (static_cast<std::size_t>(step.sourceType) >= wlenGenerators_.size()))
+        log_fatal("Step uses source type %u, but only %zu wavelength generators are configured.",
+                  static_cast<unsigned int>(step.sourceType), wlenGenerators_.size());
+
+    std::vector<DOMHit_t> hits;
+
+    double stepDir[3];
+    {
+        const double rho = std::sin(step.GetDirTheta()); // sin(theta)
+        stepDir[0] = rho*std::cos(step.GetDirPhi()); // rho*cos(phi)
+        stepDir[1] = rho*std::sin(step.GetDirPhi()); // rho*sin(phi)
+        stepDir[2] = std::cos(step.GetDirTheta());   // cos(theta)
+    }
+    const double inverseParticleSpeed = 1./(I3Constants::c*step.GetBeta());
+
+    uint32_t photonsLeftToPropagate=step.numPhotons;
+    double abs_lens_left=0.;
+    double abs_lens_initial=0.;
+
+    PhotonState_t photon;
+
+    // the last N scattering points (x,y,z,abs_lens) as a ring buffer
+    std::vector<float> history(4*photonHistoryEntries_);
+
+    while (photonsLeftToPropagate > 0)
+    {
+        if (abs_lens_left < EPSILON)
+        {
+            // create a new photon (createPhotonFromTrack())
+            const double shiftMultiplied = step.GetLength()*rng->Uniform(1.);
+
+            // move along the step direction
+            photon.pos[0] = step.GetPosX() + stepDir[0]*shiftMultiplied;
+            photon.pos[1] = step.GetPosY() + stepDir[1]*shiftMultiplied;
+            photon.pos[2] = step.GetPosZ() + stepDir[2]*shiftMultiplied;
+            photon.time = step.GetTime() + inverseParticleSpeed*shiftMultiplied;
+
+            // start with the track direction
+            for (unsigned int i=0;i<3;++i) photon.dir[i] = stepDir[i];
+
+            if ((noFlasher) || (step.sourceType == 0)) {
+                // sourceType==0 is always Cherenkov light with the correct angle w.r.t. the particle/step
+
+                // determine the photon layer (clamp if necessary)
+                const int layer = std::min(std::max(static_cast<int>((photon.pos[2]-layerBottomPos)/layerThickness), 0), numLayers-1);
+
+                photon.wlen = wlenGenerators_[0]->SampleFromDistribution(rng, noParameters);
+
+                const double cosCherenkov = std::min(1., 1./(step.GetBeta()*phaseRefIndices[layer]->GetValue(photon.wlen))); // cos theta = 1/(beta*n)
+                const double sinCherenkov = std::sqrt(1.-cosCherenkov*cosCherenkov);
+
+                // and now rotate to cherenkov emission direction
+                scatterDirectionByAngle(cosCherenkov, sinCherenkov, photon.dir, rng->Uniform(1.));
+            } else {
+                // steps >= 1 are flasher emissions, they do not need cherenkov rotation
+                photon.wlen = wlenGenerators_[step.sourceType]->SampleFromDistribution(rng, noParameters);
+            }
+
+            // save the start position and time
+            for (unsigned int i=0;i<3;++i) photon.startPos[i] = photon.pos[i];
+            for (unsigned int i=0;i<3;++i) photon.startDir[i] = photon.dir[i];
+            photon.startTime = photon.time;
+
+            photon.numScatters=0;
+            photon.totalPathLength=0.;
+
+            photon.invGroupVel = 1./GetGroupVelocity(photon.wlen);
+
+            // the photon needs a lifetime. determine distance to next scatter and absorption
+            // (this is in units of absorption/scattering lengths)
+            if (fixedAbsLens) {
+                // for table-making, use a fixed number of absorbption lengths
+                abs_lens_initial = fixedNumberOfAbsorptionLengths_;
+            } else {
+                abs_lens_initial = -std::log(1.-rng->Uniform(1.));
+            }
+            abs_lens_left = abs_lens_initial;
+        }
+
+        // this block is along the lines of the PPC kernel
+        double distancePropagated;
+        {
+            // apply ice tilt
+            const double effective_z = photon.pos[2] - iceTiltZShift_->GetValue(photon.pos[0], photon.pos[1], photon.pos[2]);
+            const int currentPhotonLayer = std::min(std::max(static_cast<int>((effective_z-layerBottomPos)/layerThickness), 0), numLayers-1);
+
+            const double photon_dz=photon.dir[2];
+
+            // add a correction factor to the number of absorption lengths abs_lens_left
+            // before the photon is absorbed. This factor will be taken out after this
+            // propagation step. Usually the factor is 1 and thus has no effect, but it
+            // is used in a direction-dependent way for our model of ice anisotropy.
+            const double abs_len_correction_factor = directionalAbsLenCorrection_->GetValue(photon.dir[0], photon.dir[1], photon.dir[2]);
+
+            abs_lens_left *= abs_len_correction_factor;
+
+            // track this thing to the next scattering point
+            const double sca_step_left = -std::log(1.-rng->Uniform(1.));
+
+            distancePropagated = PropagateThroughLayers(effective_z, currentPhotonLayer, photon_dz,
+                                                        photon.wlen, sca_step_left, abs_lens_left);
+
+            // hoist the correction factor back out of the absorption length
+            abs_lens_left=abs_lens_left/abs_len_correction_factor;
+        }
+
+        if (!saveAllPhotons_)
+        {
+            // no photon collission detection in case all photons should be saved
+
+            // the photon is now either being absorbed or scattered.
+            // Check for collisions in its way
+            FindDOMIntersections(photon.pos, photon.dir, distancePropagated, stopDetectedPhotons_, hits);
+
+            BOOST_FOREACH(const DOMHit_t &hit, hits)
+            {
+                saveHit(photon,
+                        history.empty()?NULL:&(history[0]),
+                        hit.distance,
+                        abs_lens_initial-abs_lens_left,
+                        step,
+                        wlenBias_->GetValue(photon.wlen),
+                        hit.stringID,
+                        hit.domID,
+                        photonHistoryEntries_,
+                        outputPhotons,
+                        outputHistories);
+            }
+
+            if ((stopDetectedPhotons_) && (!hits.empty())) {
+                // get rid of the photon if we detected it
+                distancePropagated = hits.front().distance;
+                abs_lens_left = 0.;
+            }
+        }
+
+        // update the track to its next position
+        for (unsigned int i=0;i<3;++i) photon.pos[i] += photon.dir[i]*distancePropagated;
+        photon.time += photon.invGroupVel*distancePropagated;
+        photon.totalPathLength += distancePropagated;
+
+        // absorb or scatter the photon
+        if (abs_lens_left < EPSILON)
+        {
+            // photon was absorbed.
+            // a new one will be generated at the begin of the loop.
+            --photonsLeftToPropagate;
+
+            if ((saveAllPhotons_) && (rng->Uniform(1.) < saveAllPhotonsPrescale_))
+            {
+                // save every. single. photon.
+                saveHit(photon,
+                        history.empty()?NULL:&(history[0]),
+                        0., // photon has already been propagated to the next position
+                        abs_lens_initial,
+                        step,
+                        wlenBias_->GetValue(photon.wlen),
+                        0, // string id (not used in this case)
+                        0, // dom id (not used in this case)
+                        photonHistoryEntries_,
+                        outputPhotons,
+                        outputHistories);
+            }
+        }
+        else
+        {
+            // photon was NOT absorbed. scatter it and re-start the loop
+
+            if (photonHistoryEntries_>0) {
+                // save the photon scatter point
+                float *entry = &(history[(photon.numScatters%photonHistoryEntries_)*4]);
+                entry[0] = photon.pos[0];
+                entry[1] = photon.pos[1];
+                entry[2] = photon.pos[2];
+                entry[3] = abs_lens_initial-abs_lens_left;
+            }
+
+            // optional direction transformation (for ice anisotropy)
+            if (preScatterDirectionTransform_) applyDirectionTransform(*preScatterDirectionTransform_, photon.dir);
+
+            // choose a scattering angle
+            const double cosScatAngle = scatteringCosAngleDist_->SampleFromDistribution(rng, noParameters);
+            const double sinScatAngle = std::sqrt(std::max(0., 1. - sqr(cosScatAngle)));
+
+            // change the current direction by that angle
+            scatterDirectionByAngle(cosScatAngle, sinScatAngle, photon.dir, rng->Uniform(1.));
+
+            // optional direction transformation (for ice anisotropy)
+            if (postScatterDirectionTransform_) applyDirectionTransform(*postScatterDirectionTransform_, photon.dir);
+
+            ++photon.numScatters;
+        }
+    }
+}
+
+namespace {
+    typedef I3CLSimHelper::FloatPacket Packet;
+
+    // structure-of-arrays state of a packet of photons
+    struct PhotonPacket_t
+    {
+        float posX[Packet::width], posY[Packet::width], posZ[Packet::width];
+        float time[Packet::width];
+        float dirX[Packet::width], dirY[Packet::width], dirZ[Packet::width];
+        float wlen[Packet::width];
+        float invGroupVel[Packet::width];
+        float totalPathLength[Packet::width];
+        float absLensLeft[Packet::width];
+        float absLensInitial[Packet::width];
+
+        float startPosX[Packet::width], startPosY[Packet::width], startPosZ[Packet::width];
+        float startTime[Packet::width];
+        float startDirX[Packet::width], startDirY[Packet::width], startDirZ[Packet::width];
+
+        uint32_t numScatters[Packet::width];
+        std::size_t stepIndex[Packet::width];
+        uint8_t alive[Packet::width];
+    };
+
+    inline void photonStateFromPacket(const PhotonPacket_t &packet, std::size_t lane, PhotonState_t &photon)
+    {
+        photon.pos[0] = packet.posX[lane];
+        photon.pos[1] = packet.posY[lane];
+        photon.pos[2] = packet.posZ[lane];
+        photon.time = packet.time[lane];
+        photon.dir[0] = packet.dirX[lane];
+        photon.dir[1] = packet.dirY[lane];
+        photon.dir[2] = packet.dirZ[lane];
+        photon.wlen = packet.wlen[lane];
+        photon.startPos[0] = packet.startPosX[lane];
+        photon.startPos[1] = packet.startPosY[lane];
+        photon.startPos[2] = packet.startPosZ[lane];
+        photon.startTime = packet.startTime[lane];
+        photon.startDir[0] = packet.startDirX[lane];
+        photon.startDir[1] = packet.startDirY[lane];
+        photon.startDir[2] = packet.startDirZ[lane];
+        photon.invGroupVel = packet.invGroupVel[lane];
+        photon.totalPathLength = packet.totalPathLength[lane];
+        photon.numScatters = packet.numScatters[lane];
+    }
+
+    // packet version of scatterDirectionByAngle(), only lanes in "active" are rotated
+    inline void scatterDirectionByAngle(Packet::vec_t cosa,
+                                        Packet::vec_t sina,
+                                        float *dirX, float *dirY, float *dirZ,
+                                        Packet::vec_t randomNumber,
+                                        Packet::mask_t active)
+    {
+        typedef Packet P;
+        const P::vec_t zero = P::set1(0.f);
+        const P::vec_t one = P::set1(1.f);
+
+        // randomize direction of scattering (rotation around old direction axis).
+        // packetSinCos() needs arguments in [-pi,pi], so use b-pi and flip the signs.
+        P::vec_t sinb, cosb;
+        I3CLSimHelper::packetSinCos<P>(P::fmadd(randomNumber, P::set1(static_cast<float>(2.*I3Constants::pi)), P::set1(static_cast<float>(-I3Constants::pi))), sinb, cosb);
+        sinb = P::sub(zero, sinb);
+        cosb = P::sub(zero, cosb);
+
+        const P::vec_t dx = P::load(dirX);
+        const P::vec_t dy = P::load(dirY);
+        const P::vec_t dz = P::load(dirZ);
+
+        // Rotate new direction into absolute frame of reference
+        const P::vec_t sinth = P::sqrt(P::max(zero, P::sub(one, P::mul(dz, dz))));
+        const P::mask_t notVertical = P::greater(sinth, zero);
+        const P::vec_t f = P::div(sina, P::select(notVertical, sinth, one));
+
+        // Current direction not vertical, so rotate
+        P::vec_t nx = P::sub(P::mul(dx, cosa), P::mul(P::fmadd(dy, cosb, P::mul(P::mul(dz, dx), sinb)), f));
+        P::vec_t ny = P::fmadd(P::sub(P::mul(dx, cosb), P::mul(P::mul(dz, dy), sinb)), f, P::mul(dy, cosa));
+        P::vec_t nz = P::fmadd(P::mul(sina, sinb), sinth, P::mul(dz, cosa));
+
+        // Current direction is vertical, so this is trivial
+        nx = P::select(notVertical, nx, P::mul(sina, cosb));
+        ny = P::select(notVertical, ny, P::mul(sina, sinb));
+        nz = P::select(notVertical, nz, P::select(P::less(dz, zero), P::sub(zero, cosa), cosa));
+
+        const P::vec_t recip_length = P::div(one, P::sqrt(P::fmadd(nx, nx, P::fmadd(ny, ny, P::mul(nz, nz)))));
+
+        P::store(dirX, P::select(active, P::mul(nx, recip_length), dx));
+        P::store(dirY, P::select(active, P::mul(ny, recip_length), dy));
+        P::store(dirZ, P::select(active, P::mul(nz, recip_length), dz));
+    }
+
+    // -log(u) for all lanes
+    inline void negativeLog(const float *u, float *out)
+    {
+        Packet::store(out, Packet::sub(Packet::set1(0.f), I3CLSimHelper::packetLog<Packet>(Packet::load(u))));
+    }
+}
+
+void I3CLSimStepToPhotonConverterNative::PropagateStepsInPackets(const I3CLSimStepSeries &steps,
+                                                                 const I3RandomServicePtr &rng,
+                                                                 I3CLSimPhotonSeries &outputPhotons,
+                                                                 I3CLSimPhotonHistorySeries *outputHistories) const
+{
+    typedef Packet P;
+    const std::size_t W = P::width;
+
+    const I3CLSimMediumProperties &medium = *mediumProperties_;
+    const std::vector<I3CLSimFunctionConstPtr> &phaseRefIndices = medium.GetPhaseRefractiveIndices();
+
+    const int numLayers = static_cast<int>(medium.GetLayersNum());
+    const double layerBottomPos = medium.GetLayersZStart();
+    const double layerThickness = medium.GetLayersHeight();
+
+    const bool noFlasher = (wlenGenerators_.size() <= 1);
+    const bool fixedAbsLens = !std::isnan(fixedNumberOfAbsorptionLengths_);
+
+    if (!noFlasher) {
+        BOOST_FOREACH(const I3CLSimStep &step, steps)
+        {
+            if (static_cast<std::size_t>(step.sourceType) >= wlenGenerators_.size())
+                log_fatal("Step uses source type %u, but only %zu wavelength generators are configured.",
+                          static_cast<unsigned int>(step.sourceType), wlenGenerators_.size());
+        }
+    }
+
+    std::vector<DOMHit_t> hits;
+
+    // the last N scattering points (x,y,z,abs_lens) of each lane as ring buffers
+    std::vector<float> histories(4*photonHistoryEntries_*W);
+
+    PhotonPacket_t packet;
+    for (std::size_t lane=0;lane<W;++lane)
+    {
+        // start with benign values in unused lanes
+        packet.posX[lane]=0.f; packet.posY[lane]=0.f; packet.posZ[lane]=0.f; packet.time[lane]=0.f;
+        packet.dirX[lane]=0.f; packet.dirY[lane]=0.f; packet.dirZ[lane]=1.f;
+        packet.wlen[lane]=0.f; packet.invGroupVel[lane]=0.f; packet.totalPathLength[lane]=0.f;
+        packet.absLensLeft[lane]=0.f; packet.absLensInitial[lane]=0.f;
+        packet.numScatters[lane]=0; packet.stepIndex[lane]=0; packet.alive[lane]=0;
+    }
+
+    // per-lane scratch space
+    float cosAngle[W], sinAngle[W], randomNumbers[W], randomNumbers2[W];
+    float effectiveZ[W], absLenCorrectionFactor[W], scaStepLeft[W], distancePropagated[W];
+    int32_t currentPhotonLayer[W];
+    uint8_t laneFlags[W], laneIsNew[W];
+
+    // the step new photons are currently taken from
+    std::size_t currentStep=0;
+    uint32_t photonsLeftInStep=0;
+    double stepDir[3] = {0., 0., 1.};
+    double inverseParticleSpeed=0.;
+    bool stepIsInitialized=false;
+
+    for (;;)
+    {
+        // (1) start new photons in all empty lanes
+        bool anyAlive=false;
+        bool anyNew=false;
+        for (std::size_t lane=0;lane<W;++lane)
+        {
+            cosAngle[lane]=1.f; sinAngle[lane]=0.f; randomNumbers[lane]=0.f; randomNumbers2[lane]=1.f;
+            laneFlags[lane]=0;
+            laneIsNew[lane]=0;
+
+            if (!packet.alive[lane])
+            {
+                while ((photonsLeftInStep==0) && (currentStep < steps.size()))
+                {
+                    if (stepIsInitialized) ++currentStep;
+                    stepIsInitialized=true;
+                    if (currentStep >= steps.size()) break;
+
+                    const I3CLSimStep &step = steps[currentStep];
+                    photonsLeftInStep = step.numPhotons;
+
+                    const double rho = std::sin(step.GetDirTheta()); // sin(theta)
+                    stepDir[0] = rho*std::cos(step.GetDirPhi()); // rho*cos(phi)
+                    stepDir[1] = rho*std::sin(step.GetDirPhi()); // rho*sin(phi)
+                    stepDir[2] = std::cos(step.GetDirTheta());   // cos(theta)
+                    inverseParticleSpeed = 1./(I3Constants::c*step.GetBeta());
+                }
+
+                if (photonsLeftInStep>0)
+                {
+                    --photonsLeftInStep;
+
+                    // create a new photon (createPhotonFromTrack())
+                    const I3CLSimStep &step = steps[currentStep];
+                    const double shiftMultiplied = step.GetLength()*rng->Uniform(1.);
+
+                    // move along the step direction
+                    packet.posX[lane] = step.GetPosX() + stepDir[0]*shiftMultiplied;
+                    packet.posY[lane] = step.GetPosY() + stepDir[1]*shiftMultiplied;
+                    packet.posZ[lane] = step.GetPosZ() + stepDir[2]*shiftMultiplied;
+                    packet.time[lane] = step.GetTime() + inverseParticleSpeed*shiftMultiplied;
+
+                    // start with the track direction
+                    packet.dirX[lane] = stepDir[0];
+                    packet.dirY[lane] = stepDir[1];
+                    packet.dirZ[lane] = stepDir[2];
+
+                    double wlen;
+                    if ((noFlasher) || (step.sourceType == 0)) {
+                        // sourceType==0 is always Cherenkov light with the correct angle w.r.t. the particle/step
+
+                        // determine the photon layer (clamp if necessary)
+                        const int layer = std::min(std::max(static_cast<int>((packet.posZ[lane]-layerBottomPos)/layerThickness), 0), numLayers-1);
+
+                        wlen = wlenGenerators_[0]->SampleFromDistribution(rng, noParameters);
+
+                        const double cosCherenkov = std::min(1., 1./(step.GetBeta()*phaseRefIndices[layer]->GetValue(wlen))); // cos theta = 1/(beta*n)
+
+                        // rotate to the cherenkov emission direction below
+                        cosAngle[lane] = cosCherenkov;
+                        sinAngle[lane] = std::sqrt(1.-cosCherenkov*cosCherenkov);
+                        randomNumbers[lane] = rng->Uniform(1.);
+                        laneFlags[lane] = 1;
+                    } else {
+                        // steps >= 1 are flasher emissions, they do not need cherenkov rotation
+                        wlen = wlenGenerators_[step.sourceType]->SampleFromDistribution(rng, noParameters);
+                    }
+
+                    packet.wlen[lane] = wlen;
+                    packet.invGroupVel[lane] = 1./GetGroupVelocity(wlen);
+                    packet.totalPathLength[lane] = 0.f;
+                    packet.numScatters[lane] = 0;
+                    packet.stepIndex[lane] = currentStep;
+                    packet.alive[lane] = 1;
+                    laneIsNew[lane] = 1;
+
+                    // the photon needs a lifetime (this is in units of absorption lengths)
+                    if (fixedAbsLens) {
+                        // for table-making, use a fixed number of absorbption lengths
+                        packet.absLensInitial[lane] = fixedNumberOfAbsorptionLengths_;
+                    } else {
+                        randomNumbers2[lane] = 1.-rng->Uniform(1.);
+                    }
+
+                    anyNew=true;
+                }
+            }
+
+            if (packet.alive[lane]) anyAlive=true;
+        }
+
+        // no photons left in this bunch?
+        if (!anyAlive) break;
+
+        if (anyNew)
+        {
+            scatterDirectionByAngle(P::load(cosAngle), P::load(sinAngle),
+                                    packet.dirX, packet.dirY, packet.dirZ,
+                                    P::load(randomNumbers),
+                                    P::maskFromLanes(laneFlags));
+
+            float absLens[W];
+            negativeLog(randomNumbers2, absLens);
+
+            for (std::size_t lane=0;lane<W;++lane)
+            {
+                if (!laneIsNew[lane]) continue;
+
+                // save the start position and time
+                packet.startPosX[lane] = packet.posX[lane];
+                packet.startPosY[lane] = packet.posY[lane];
+                packet.startPosZ[lane] = packet.posZ[lane];
+                packet.startTime[lane] = packet.time[lane];
+                packet.startDirX[lane] = packet.dirX[lane];
+                packet.startDirY[lane] = packet.dirY[lane];
+                packet.startDirZ[lane] = packet.dirZ[lane];
+
+                if (!fixedAbsLens) packet.absLensInitial[lane] = absLens[lane];
+                packet.absLensLeft[lane] = packet.absLensInitial[lane];
+            }
+        }
+
+        // (2) apply ice tilt and determine the current layers
+        if (iceTiltZShiftIsConstant_) {
+            P::store(effectiveZ, P::sub(P::load(packet.posZ), P::set1(static_cast<float>(iceTiltZShiftConstant_))));
+        } else {
+            for (std::size_t lane=0;lane<W;++lane)
+                effectiveZ[lane] = packet.posZ[lane] - iceTiltZShift_->GetValue(packet.posX[lane], packet.posY[lane], packet.posZ[lane]);
+        }
+
+        // findLayerForGivenZPos()
+        P::storeFloorInt(currentPhotonLayer,
+                         P::min(P::max(P::floor(P::mul(P::sub(P::load(effectiveZ), P::set1(static_cast<float>(layerBottomPos))), P::set1(static_cast<float>(1./layerThickness)))),
+                                       P::set1(0.f)),
+                                P::set1(static_cast<float>(numLayers-1))));
+
+        // add a correction factor to the number of absorption lengths left
+        // (see PropagateStep() for details)
+        if (directionalAbsLenCorrectionIsConstant_) {
+            for (std::size_t lane=0;lane<W;++lane) absLenCorrectionFactor[lane] = directionalAbsLenCorrectionConstant_;
+        } else {
+            for (std::size_t lane=0;lane<W;++lane)
+                absLenCorrectionFactor[lane] = directionalAbsLenCorrection_->GetValue(packet.dirX[lane], packet.dirY[lane], packet.dirZ[lane]);
+        }
+        P::store(packet.absLensLeft, P::mul(P::load(packet.absLensLeft), P::load(absLenCorrectionFactor)));
+
+        // track this thing to the next scattering point
+        for (std::size_t lane=0;lane<W;++lane) randomNumbers[lane] = packet.alive[lane]?(1.-rng->Uniform(1.)):1.f;
+        negativeLog(randomNumbers, scaStepLeft);
+
+        // (3) propagate through the layers, this diverges between lanes
+        for (std::size_t lane=0;lane<W;++lane)
+        {
+            if (!packet.alive[lane]) {
+                distancePropagated[lane]=0.f;
+                continue;
+            }
+
+            double abs_lens_left = packet.absLensLeft[lane];
+            distancePropagated[lane] = PropagateThroughLayers(effectiveZ[lane], currentPhotonLayer[lane], packet.dirZ[lane],
+                                                              packet.wlen[lane], scaStepLeft[lane], abs_lens_left);
+            packet.absLensLeft[lane] = abs_lens_left;
+        }
+
+        // hoist the correction factor back out of the absorption length
+        P::store(packet.absLensLeft, P::div(P::load(packet.absLensLeft), P::load(absLenCorrectionFactor)));
+
+        // (4) check for collisions
+        if (!saveAllPhotons_)
+        {
+            for (std::size_t lane=0;lane<W;++lane)
+            {
+                if (!packet.alive[lane]) continue;
+
+                const double pos[3] = {packet.posX[lane], packet.posY[lane], packet.posZ[lane]};
+                const double dir[3] = {packet.dirX[lane], packet.dirY[lane], packet.dirZ[lane]};
+                FindDOMIntersections(pos, dir, distancePropagated[lane], stopDetectedPhotons_, hits);
+                if (hits.empty()) continue;
+
+                PhotonState_t photon;
+                photonStateFromPacket(packet, lane, photon);
+                const I3CLSimStep &step = steps[packet.stepIndex[lane]];
+                const double wlenBias = wlenBias_->GetValue(photon.wlen);
+
+                BOOST_FOREACH(const DOMHit_t &hit, hits)
+                {
+                    saveHit(photon,
+                            histories.empty()?NULL:&(histories[4*photonHistoryEntries_*lane]),
+                            hit.distance,
+                            packet.absLensInitial[lane]-packet.absLensLeft[lane],
+                            step,
+                            wlenBias,
+                            hit.stringID,
+                            hit.domID,
+                            photonHistoryEntries_,
+                            outputPhotons,
+                            outputHistories);
+                }
+
+                if (stopDetectedPhotons_) {
+                    // get rid of the photon if we detected it
+                    distancePropagated[lane] = hits.front().distance;
+                    packet.absLensLeft[lane] = 0.f;
+                }
+            }
+        }
+
+        // (5) update the tracks to their next positions
+        {
+            const P::vec_t d = P::load(distancePropagated);
+            P::store(packet.posX, P::fmadd(P::load(packet.dirX), d, P::load(packet.posX)));
+            P::store(packet.posY, P::fmadd(P::load(packet.dirY), d, P::load(packet.posY)));
+            P::store(packet.posZ, P::fmadd(P::load(packet.dirZ), d, P::load(packet.posZ)));
+            P::store(packet.time, P::fmadd(P::load(packet.invGroupVel), d, P::load(packet.time)));
+            P::store(packet.totalPathLength, P::add(P::load(packet.totalPathLength), d));
+        }
+
+        // (6) absorb or scatter the photons
+        bool anyScattered=false;
+        for (std::size_t lane=0;lane<W;++lane)
+        {
+            cosAngle[lane]=1.f; sinAngle[lane]=0.f; randomNumbers[lane]=0.f;
+            laneFlags[lane]=0;
+
+            if (!packet.alive[lane]) continue;
+
+            if (packet.absLensLeft[lane] < EPSILON)
+            {
+                // photon was absorbed.
+                // a new one will be generated at the begin of the loop.
+                packet.alive[lane]=0;
+
+                if ((saveAllPhotons_) && (rng->Uniform(1.) < saveAllPhotonsPrescale_))
+                {
+                    PhotonState_t photon;
+                    photonStateFromPacket(packet, lane, photon);
+
+                    // save every. single. photon.
+                    saveHit(photon,
+                            histories.empty()?NULL:&(histories[4*photonHistoryEntries_*lane]),
+                            0., // photon has already been propagated to the next position
+                            packet.absLensInitial[lane],
+                            steps[packet.stepIndex[lane]],
+                            wlenBias_->GetValue(photon.wlen),
+                            0, // string id (not used in this case)
+                            0, // dom id (not used in this case)
+                            photonHistoryEntries_,
+                            outputPhotons,
+                            outputHistories);
+                }
+
+                continue;
+            }
+
+            // photon was NOT absorbed. scatter it and re-start the loop
+
+            if (photonHistoryEntries_>0) {
+                // save the photon scatter point
+                float *entry = &(histories[4*photonHistoryEntries_*lane + (packet.numScatters[lane]%photonHistoryEntries_)*4]);
+                entry[0] = packet.posX[lane];
+                entry[1] = packet.posY[lane];
+                entry[2] = packet.posZ[lane];
+                entry[3] = packet.absLensInitial[lane]-packet.absLensLeft[lane];
+            }
+
+            // optional direction transformation (for ice anisotropy)
+            if (preScatterDirectionTransform_) {
+                double dir[3] = {packet.dirX[lane], packet.dirY[lane], packet.dirZ[lane]};
+                applyDirectionTransform(*preScatterDirectionTransform_, dir);
+                packet.dirX[lane] = dir[0]; packet.dirY[lane] = dir[1]; packet.dirZ[lane] = dir[2];
+            }
+
+            // choose a scattering angle
+            const double cosScatAngle = scatteringCosAngleDist_->SampleFromDistribution(rng, noParameters);
+            cosAngle[lane] = cosScatAngle;
+            sinAngle[lane] = std::sqrt(std::max(0., 1. - sqr(cosScatAngle)));
+            randomNumbers[lane] = rng->Uniform(1.);
+            laneFlags[lane] = 1;
+
+            ++packet.numScatters[lane];
+            anyScattered=true;
+        }
+
+        if (!anyScattered) continue;
+
+        // change the current directions by the scattering angles
+        scatterDirectionByAngle(P::load(cosAngle), P::load(sinAngle),
+                                packet.dirX, packet.dirY, packet.dirZ,
+                                P::load(randomNumbers),
+                                P::maskFromLanes(laneFlags));
+
+        // optional direction transformation (for ice anisotropy)
+        if (postScatterDirectionTransform_) {
+            for (std::size_t lane=0;lane<W;++lane)
+            {
+                if (!laneFlags[lane]) continue;
+
+                double dir[3] = {packet.dirX[lane], packet.dirY[lane], packet.dirZ[lane]};
+                applyDirectionTransform(*postScatterDirectionTransform_, dir);
+                packet.dirX[lane] = dir[0]; packet.dirY[lane] = dir[1]; packet.dirZ[lane] = dir[2];
+            }
+        }
+    }
+}
+
+bool I3CLSimStepToPhotonConverterNative::IsInitialized() const
+{
+    return initialized_;
+}
+
+void I3CLSimStepToPhotonConverterNative::SetStopDetectedPhotons(bool value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    if ((value) && (saveAllPhotons_))
+        throw I3CLSimStepToPhotonConverter_exception("You cannot set stopDetectedPhotons, because saveAllPhotons is set. The options are mutually exclusive.");
+
+    stopDetectedPhotons_=value;
+}
+
+bool I3CLSimStepToPhotonConverterNative::GetStopDetectedPhotons() const
+{
+    return stopDetectedPhotons_;
+}
+
+void I3CLSimStepToPhotonConverterNative::SetSaveAllPhotons(bool value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    if ((value) && (stopDetectedPhotons_))
+        throw I3CLSimStepToPhotonConverter_exception("You cannot set saveAllPhotons, because stopDetectedPhotons is set. The options are mutually exclusive.");
+
+    saveAllPhotons_=value;
+}
+
+bool I3CLSimStepToPhotonConverterNative::GetSaveAllPhotons() const
+{
+    return saveAllPhotons_;
+}
+
+void I3CLSimStepToPhotonConverterNative::SetSaveAllPhotonsPrescale(double value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    saveAllPhotonsPrescale_=value;
+}
+
+double I3CLSimStepToPhotonConverterNative::GetSaveAllPhotonsPrescale() const
+{
+    return saveAllPhotonsPrescale_;
+}
+
+void I3CLSimStepToPhotonConverterNative::SetPhotonHistoryEntries(uint32_t value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    photonHistoryEntries_=value;
+}
+
+uint32_t I3CLSimStepToPhotonConverterNative::GetPhotonHistoryEntries() const
+{
+    return photonHistoryEntries_;
+}
+
+void I3CLSimStepToPhotonConverterNative::SetFixedNumberOfAbsorptionLengths(double value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    fixedNumberOfAbsorptionLengths_=value;
+}
+
+double I3CLSimStepToPhotonConverterNative::GetFixedNumberOfAbsorptionLengths() const
+{
+    return fixedNumberOfAbsorptionLengths_;
+}
+
+void I3CLSimStepToPhotonConverterNative::SetDOMPancakeFactor(double value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    pancakeFactor_=value;
+}
+
+double I3CLSimStepToPhotonConverterNative::GetDOMPancakeFactor() const
+{
+    return pancakeFactor_;
+}
+
+void I3CLSimStepToPhotonConverterNative::SetWlenGenerators(const std::vector<I3CLSimRandomValueConstPtr> &wlenGenerators)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    wlenGenerators_=wlenGenerators;
+}
+
+void I3CLSimStepToPhotonConverterNative::SetWlenBias(I3CLSimFunctionConstPtr wlenBias)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    wlenBias_=wlenBias;
+}
+
+void I3CLSimStepToPhotonConverterNative::SetMediumProperties(I3CLSimMediumPropertiesConstPtr mediumProperties)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    mediumProperties_=mediumProperties;
+}
+
+void I3CLSimStepToPhotonConverterNative::SetGeometry(I3CLSimSimpleGeometryConstPtr geometry)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative already initialized!");
+
+    geometry_=geometry;
+}
+
+void I3CLSimStepToPhotonConverterNative::EnqueueSteps(I3CLSimStepSeriesConstPtr steps, uint32_t identifier)
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative is not initialized!");
+
+    if (!steps)
+        throw I3CLSimStepToPhotonConverter_exception("Steps pointer is (null)!");
+
+    if (steps->empty())
+        throw I3CLSimStepToPhotonConverter_exception("Steps are empty!");
+
+    if (steps->size() > maxNumWorkitems_)
+        throw I3CLSimStepToPhotonConverter_exception("Number of steps is greater than maximum number of work items!");
+
+    ThrowIfWorkerFailed();
+
+    uint32_t rngSeed;
+    {
+        boost::unique_lock<boost::mutex> guard(enqueue_mutex_);
+
+        // spread the seeds of consecutive bunches over the full 32bit range
+        rngSeed = rngBaseSeed_ + numBunchesEnqueued_*0x9e3779b9u;
+        ++numBunchesEnqueued_;
+    }
+
+    queueToWorkers_->Put(WorkItem_t(identifier, steps, rngSeed));
+}
+
+std::size_t I3CLSimStepToPhotonConverterNative::QueueSize() const
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative is not initialized!");
+
+    return queueToWorkers_->size();
+}
+
+bool I3CLSimStepToPhotonConverterNative::MorePhotonsAvailable() const
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative is not initialized!");
+
+    return (!queueFromWorkers_->empty());
+}
+
+I3CLSimStepToPhotonConverter::ConversionResult_t I3CLSimStepToPhotonConverterNative::GetConversionResult()
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterNative is not initialized!");
+
+    ThrowIfWorkerFailed();
+
+    I3CLSimStepToPhotonConverter::ConversionResult_t result = queueFromWorkers_->Get();
+    if (!result.HasPhotons()) ThrowIfWorkerFailed();
+    return result;
+}
@@ -0,0 +1,353 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimStepToPhotonConverterRemote.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+#include <inttypes.h>
+
+#include "clsim/I3CLSimStepToPhotonConverterRemote.h"
+
+#include <string>
+#include <iostream>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "clsim/I3CLSimHelperRemote.h"
+
+const std::size_t I3CLSimStepToPhotonConverterRemote::default_maxBunchesInFlight=2;
+
+
+I3CLSimStepToPhotonConverterRemote::I3CLSimStepToPhotonConverterRemote(const std::string &address)
+:
+address_(address),
+socket_(-1),
+initialized_(false),
+maxBunchesInFlight_(default_maxBunchesInFlight),
+workgroupSize_(0),
+maxNumWorkitems_(0),
+numBunchesInFlight_(0),
+statistics_total_bunches_sent_(0),
+shuttingDown_(false)
+{
+    if (address_.empty()) log_fatal("You need to supply the address of a worker.");
+}
+
+I3CLSimStepToPhotonConverterRemote::~I3CLSimStepToPhotonConverterRemote()
+{
+    {
+        boost::unique_lock<boost::mutex> guard(error_mutex_);
+        shuttingDown_=true;
+    }
+
+    // unblocks the receiver thread (and the sender if it is stuck in send())
+    I3CLSimHelper::Remote::Shutdown(socket_);
+
+    if (senderThread_)
+    {
+        if (senderThread_->joinable()) senderThread_->interrupt();
+        if (senderThread_->joinable()) senderThread_->join();
+        senderThread_.reset();
+    }
+
+    if (receiverThread_)
+    {
+        if (receiverThread_->joinable()) receiverThread_->interrupt();
+        if (receiverThread_->joinable()) receiverThread_->join();
+        receiverThread_.reset();
+    }
+
+    I3CLSimHelper::Remote::Close(socket_);
+    socket_=-1;
+}
+
+const std::string &I3CLSimStepToPhotonConverterRemote::GetAddress() const
+{
+    return address_;
+}
+
+void I3CLSimStepToPhotonConverterRemote::SetMaxBunchesInFlight(std::size_t val)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterRemote already initialized!");
+
+    if (val==0)
+        throw I3CLSimStepToPhotonConverter_exception("The maximum number of bunches in flight has to be at least one!");
+
+    maxBunchesInFlight_=val;
+}
+
+std::size_t I3CLSimStepToPhotonConverterRemote::GetMaxBunchesInFlight() const
+{
+    return maxBunchesInFlight_;
+}
+
+std::size_t I3CLSimStepToPhotonConverterRemote::GetWorkgroupSize() const
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterRemote is not initialized!");
+
+    return workgroupSize_;
+}
+
+std::size_t I3CLSimStepToPhotonConverterRemote::GetMaxNumWorkitems() const
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterRemote is not initialized!");
+
+    return maxNumWorkitems_;
+}
+
+void I3CLSimStepToPhotonConverterRemote::SetWlenGenerators(const std::vector<I3CLSimRandomValueConstPtr> &wlenGenerators)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterRemote already initialized!");
+
+    wlenGenerators_=wlenGenerators;
+}
+
+void I3CLSimStepToPhotonConverterRemote::SetWlenBias(I3CLSimFunctionConstPtr wlenBias)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterRemote already initialized!");
+
+    wlenBias_=wlenBias;
+}
+
+void I3CLSimStepToPhotonConverterRemote::SetMediumProperties(I3CLSimMediumPropertiesConstPtr mediumProperties)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterRemote already initialized!");
+
+    mediumProperties_=mediumProperties;
+}
+
+void I3CLSimStepToPhotonConverterRemote::SetGeometry(I3CLSimSimpleGeometryConstPtr geometry)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterRemote already initialized!");
+
+    geometry_=geometry;
+}
+
+void I3CLSimStepToPhotonConverterRemote::Initialize()
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterRemote already initialized!");
+
+    if (wlenGenerators_.size()==0)
+        throw I3CLSimStepToPhotonConverter_exception("WlenGenerators not set!");
+
+    if (!wlenBias_)
+        throw I3CLSimStepToPhotonConverter_exception("WlenBias not set!");
+
+    if (!mediumProperties_)
+        throw I3CLSimStepToPhotonConverter_exception("MediumProperties not set!");
+
+    if (!geometry_)
+        throw I3CLSimStepToPhotonConverter_exception("Geometry not set!");
+
+    const uint64_t configurationHash =
+    I3CLSimHelper::Remote::ConfigurationHash(wlenGenerators_, wlenBias_, mediumProperties_, geometry_);
+
+    log_debug("Connecting to worker at \"%s\"..", address_.c_str());
+
+    try {
+        socket_ = I3CLSimHelper::Remote::Connect(address_);
+
+        I3CLSimHelper::Remote::SendHello(socket_, 0, 0, configurationHash);
+        const I3CLSimHelper::Remote::Hello_t hello = I3CLSimHelper::Remote::ReceiveHello(socket_);
+
+        if (hello.configurationHash != configurationHash)
+            throw std::runtime_error("The worker uses different wavelength generators, wavelength bias, medium properties or geometry.");
+
+        workgroupSize_ = hello.workgroupSize;
+        maxNumWorkitems_ = hello.maxNumWorkitems;
+    } catch (std::runtime_error &e) {
+        I3CLSimHelper::Remote::Close(socket_);
+        socket_=-1;
+        throw I3CLSimStepToPhotonConverter_exception("Worker at \"" + address_ + "\": " + e.what());
+    }
+
+    if ((workgroupSize_==0) || (maxNumWorkitems_==0) || (maxNumWorkitems_%workgroupSize_!=0))
+        throw I3CLSimStepToPhotonConverter_exception("Worker at \"" + address_ + "\" reported an invalid workgroup size or maximum number of work items.");
+
+    log_info("Connected to worker at \"%s\": workgroup size %zu, max. %zu work items",
+             address_.c_str(), workgroupSize_, maxNumWorkitems_);
+
+    queueToSender_ = boost::shared_ptr<I3CLSimQueue<WorkItem_t> >(new I3CLSimQueue<WorkItem_t>(0));
+    queueFromReceiver_ = boost::shared_ptr<I3CLSimQueue<I3CLSimStepToPhotonConverter::ConversionResult_t> >(new I3CLSimQueue<I3CLSimStepToPhotonConverter::ConversionResult_t>(0));
+
+    senderThread_ = boost::shared_ptr<boost::thread>(new boost::thread(boost::bind(&I3CLSimStepToPhotonConverterRemote::SenderThread, this)));
+    receiverThread_ = boost::shared_ptr<boost::thread>(new boost::thread(boost::bind(&I3CLSimStepToPhotonConverterRemote::ReceiverThread, this)));
+
+    initialized_=true;
+}
+
+bool I3CLSimStepToPhotonConverterRemote::IsInitialized() const
+{
+    return initialized_;
+}
+
+void I3CLSimStepToPhotonConverterRemote::SetError(const std::string &message)
+{
+    {
+        boost::unique_lock<boost::mutex> guard(error_mutex_);
+        if (shuttingDown_) return;
+        if (!errorMessage_.empty()) return; // only keep the first one
+        errorMessage_ = message;
+    }
+
+    log_error("Worker at \"%s\": %s", address_.c_str(), message.c_str());
+
+    // wake up GetConversionResult()
+    queueFromReceiver_->Put(I3CLSimStepToPhotonConverter::ConversionResult_t());
+}
+
+void I3CLSimStepToPhotonConverterRemote::SenderThread()
+{
+    try {
+        for (;;)
+        {
+            // this can block until there is something on the queue:
+            const WorkItem_t item = queueToSender_->Get();
+
+            {
+                boost::unique_lock<boost::mutex> guard(inFlight_mutex_);
+                while (numBunchesInFlight_ >= maxBunchesInFlight_)
+                {
+                    inFlight_cond_.wait(guard);
+                }
+                ++numBunchesInFlight_;
+                ++statistics_total_bunches_sent_;
+            }
+
+            log_trace("Sending bunch %" PRIu32 " (%zu steps) to \"%s\"", item.first, item.second->size(), address_.c_str());
+
+            I3CLSimHelper::Remote::SendSteps(socket_, item.first, *(item.second));
+        }
+    } catch (boost::thread_interrupted &i) {
+        log_trace("Remote converter sender thread was interrupted. closing.");
+    } catch (std::runtime_error &e) {
+        SetError(e.what());
+    }
+}
+
+void I3CLSimStepToPhotonConverterRemote::ReceiverThread()
+{
+    try {
+        for (;;)
+        {
+            I3CLSimHelper::Remote::MessageHeader_t header;
+            if (!I3CLSimHelper::Remote::ReceiveHeader(socket_, header)) {
+                SetError("The worker closed the connection.");
+                break;
+            }
+
+            if (header.type == I3CLSimHelper::Remote::messageError) {
+                SetError("The worker reported an error: " + I3CLSimHelper::Remote::ReceiveError(socket_, header));
+                break;
+            }
+
+            I3CLSimStepToPhotonConverter::ConversionResult_t result =
+            I3CLSimHelper::Remote::ReceiveResult(socket_, header);
+
+            log_trace("Received bunch %" PRIu32 " (%zu photons) from \"%s\"", result.identifier, result.photons->size(), address_.c_str());
+
+            {
+                boost::unique_lock<boost::mutex> guard(inFlight_mutex_);
+                if (numBunchesInFlight_>0) --numBunchesInFlight_;
+            }
+            inFlight_cond_.notify_all();
+
+            queueFromReceiver_->Put(result);
+        }
+    } catch (std::runtime_error &e) {
+        SetError(e.what());
+    }
+}
+
+void I3CLSimStepToPhotonConverterRemote::EnqueueSteps(I3CLSimStepSeriesConstPtr steps, uint32_t identifier)
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterRemote is not initialized!");
+
+    if (!steps)
+        throw I3CLSimStepToPhotonConverter_exception("Steps pointer is (null)!");
+
+    if (steps->empty())
+        throw I3CLSimStepToPhotonConverter_exception("Steps are empty!");
+
+    if (steps->size() > maxNumWorkitems_)
+        throw I3CLSimStepToPhotonConverter_exception("Number of steps is greater than maximum number of work items!");
+
+    if (steps->size() % workgroupSize_ != 0)
+        throw I3CLSimStepToPhotonConverter_exception("The number of steps is not a multiple of the workgroup size!");
+
+    {
+        boost::unique_lock<boost::mutex> guard(error_mutex_);
+        if (!errorMessage_.empty())
+            throw I3CLSimStepToPhotonConverter_exception("Worker at \"" + address_ + "\" failed: " + errorMessage_);
+    }
+
+    queueToSender_->Put(std::make_pair(identifier, steps));
+}
+
+std::size_t I3CLSimStepToPhotonConverterRemote::QueueSize() const
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterRemote is not initialized!");
+
+    return queueToSender_->size();
+}
+
+bool I3CLSimStepToPhotonConverterRemote::MorePhotonsAvailable() const
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterRemote is not initialized!");
+
+    return (!queueFromReceiver_->empty());
+}
+
+I3CLSimStepToPhotonConverter::ConversionResult_t I3CLSimStepToPhotonConverterRemote::GetConversionResult()
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterRemote is not initialized!");
+
+    I3CLSimStepToPhotonConverter::ConversionResult_t result = queueFromReceiver_->Get();
+
+    if (!result.HasPhotons()) {
+        // only SetError() puts empty results on the queue. Put it back
+        // so that any other thread waiting for results wakes up, too.
+        queueFromReceiver_->Put(result);
+
+        boost::unique_lock<boost::mutex> guard(error_mutex_);
+        throw I3CLSimStepToPhotonConverter_exception("Worker at \"" + address_ + "\" failed: " + errorMessage_);
+    }
+
+    return result;
+}
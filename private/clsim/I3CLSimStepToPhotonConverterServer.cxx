@@ -0,0 +1,312 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimStepToPhotonConverterServer.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+#include <inttypes.h>
+
+#include "clsim/I3CLSimStepToPhotonConverterServer.h"
+
+#include <string>
+#include <stdexcept>
+
+#include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+
+#include "clsim/I3CLSimHelperRemote.h"
+
+I3CLSimStepToPhotonConverterServer::I3CLSimStepToPhotonConverterServer(const std::string &address,
+                                                                       I3CLSimStepToPhotonConverterPtr converter,
+                                                                       std::size_t workgroupSize,
+                                                                       std::size_t maxNumWorkitems,
+                                                                       const std::vector<I3CLSimRandomValueConstPtr> &wlenGenerators,
+                                                                       I3CLSimFunctionConstPtr wlenBias,
+                                                                       I3CLSimMediumPropertiesConstPtr mediumProperties,
+                                                                       I3CLSimSimpleGeometryConstPtr geometry)
+:
+address_(address),
+converter_(converter),
+workgroupSize_(workgroupSize),
+maxNumWorkitems_(maxNumWorkitems),
+configurationHash_(0),
+listenSocket_(-1),
+clientSocket_(-1),
+numPending_(0),
+readerDone_(false),
+stopping_(false),
+statistics_total_clients_(0),
+statistics_total_bunches_(0)
+{
+    if (!converter_) log_fatal("You need to supply a converter.");
+    if (workgroupSize_==0) log_fatal("The workgroup size must not be 0.");
+    if ((maxNumWorkitems_==0) || (maxNumWorkitems_%workgroupSize_!=0))
+        log_fatal("The maximum number of work items has to be a non-zero multiple of the workgroup size.");
+    if (wlenGenerators.size()==0) log_fatal("You need to supply the wavelength generators.");
+    if (!wlenBias) log_fatal("You need to supply the wavelength bias.");
+    if (!mediumProperties) log_fatal("You need to supply the medium properties.");
+    if (!geometry) log_fatal("You need to supply the geometry.");
+
+    configurationHash_ = I3CLSimHelper::Remote::ConfigurationHash(wlenGenerators, wlenBias, mediumProperties, geometry);
+}
+
+I3CLSimStepToPhotonConverterServer::~I3CLSimStepToPhotonConverterServer()
+{
+    Stop();
+}
+
+void I3CLSimStepToPhotonConverterServer::Start()
+{
+    if (listenerThread_)
+        throw std::runtime_error("I3CLSimStepToPhotonConverterServer is already running!");
+
+    if (!converter_->IsInitialized())
+        throw std::runtime_error("The converter has to be initialized before starting the server!");
+
+    listenSocket_ = I3CLSimHelper::Remote::Listen(address_);
+
+    {
+        boost::unique_lock<boost::mutex> guard(client_mutex_);
+        stopping_=false;
+    }
+
+    log_info("Listening for clients on \"%s\"", address_.c_str());
+
+    listenerThread_ = boost::shared_ptr<boost::thread>(new boost::thread(boost::bind(&I3CLSimStepToPhotonConverterServer::ListenerThread, this)));
+}
+
+void I3CLSimStepToPhotonConverterServer::Stop()
+{
+    if (!listenerThread_) return;
+
+    {
+        boost::unique_lock<boost::mutex> guard(client_mutex_);
+        stopping_=true;
+
+        // unblocks the reader, the writer drains the remaining results
+        I3CLSimHelper::Remote::Shutdown(clientSocket_);
+    }
+
+    if (listenerThread_->joinable()) listenerThread_->interrupt();
+    if (listenerThread_->joinable()) listenerThread_->join();
+    listenerThread_.reset();
+
+    I3CLSimHelper::Remote::Close(listenSocket_);
+    listenSocket_=-1;
+    I3CLSimHelper::Remote::RemoveSocketFile(address_);
+
+    log_info("Stopped listening on \"%s\"", address_.c_str());
+}
+
+bool I3CLSimStepToPhotonConverterServer::IsRunning() const
+{
+    return static_cast<bool>(listenerThread_);
+}
+
+const std::string &I3CLSimStepToPhotonConverterServer::GetAddress() const
+{
+    return address_;
+}
+
+void I3CLSimStepToPhotonConverterServer::ListenerThread()
+{
+    try {
+        for (;;)
+        {
+            boost::this_thread::interruption_point();
+
+            // wake up regularly to check for interruption
+            const int clientSocket = I3CLSimHelper::Remote::Accept(listenSocket_, 0.2);
+            if (clientSocket<0) continue;
+
+            ServeClient(clientSocket);
+        }
+    } catch (boost::thread_interrupted &i) {
+        log_trace("Server listener thread was interrupted. closing.");
+    } catch (std::runtime_error &e) {
+        log_error("Server on \"%s\" failed: %s", address_.c_str(), e.what());
+    }
+}
+
+void I3CLSimStepToPhotonConverterServer::ServeClient(int clientSocket)
+{
+    // the writer has to be joined before returning
+    boost::this_thread::disable_interruption di;
+
+    {
+        boost::unique_lock<boost::mutex> guard(client_mutex_);
+        if (stopping_) {
+            I3CLSimHelper::Remote::Close(clientSocket);
+            return;
+        }
+        clientSocket_=clientSocket;
+        numPending_=0;
+        readerDone_=false;
+    }
+
+    try {
+        const I3CLSimHelper::Remote::Hello_t hello = I3CLSimHelper::Remote::ReceiveHello(clientSocket);
+
+        // the client compares the hash, too, and reports the mismatch on its side
+        I3CLSimHelper::Remote::SendHello(clientSocket, workgroupSize_, maxNumWorkitems_, configurationHash_);
+
+        if (hello.configurationHash != configurationHash_)
+            throw std::runtime_error("The client uses different wavelength generators, wavelength bias, medium properties or geometry.");
+    } catch (std::runtime_error &e) {
+        log_warn("Rejected client on \"%s\": %s", address_.c_str(), e.what());
+
+        boost::unique_lock<boost::mutex> guard(client_mutex_);
+        I3CLSimHelper::Remote::Close(clientSocket);
+        clientSocket_=-1;
+        return;
+    }
+
+    log_info("Client connected on \"%s\"", address_.c_str());
+
+    {
+        boost::unique_lock<boost::mutex> guard(statistics_mutex_);
+        ++statistics_total_clients_;
+    }
+
+    boost::thread writerThread(boost::bind(&I3CLSimStepToPhotonConverterServer::WriterThread, this, clientSocket));
+
+    try {
+        for (;;)
+        {
+            I3CLSimHelper::Remote::MessageHeader_t header;
+            if (!I3CLSimHelper::Remote::ReceiveHeader(clientSocket, header)) break; // client disconnected
+
+            I3CLSimStepSeriesPtr steps = I3CLSimHelper::Remote::ReceiveSteps(clientSocket, header);
+
+            // DOM masks are set up by the client's module and not
+            // known here. Remove the mask index, the client removes
+            // hits on masked DOMs itself.
+            BOOST_FOREACH(I3CLSimStep &step, *steps)
+            {
+                step.SetDummy2(0);
+            }
+
+            {
+                boost::unique_lock<boost::mutex> guard(client_mutex_);
+                ++numPending_;
+            }
+
+            try {
+                converter_->EnqueueSteps(steps, header.identifier);
+            } catch (...) {
+                boost::unique_lock<boost::mutex> guard(client_mutex_);
+                --numPending_;
+                throw;
+            }
+
+            client_cond_.notify_all();
+
+            {
+                boost::unique_lock<boost::mutex> guard(statistics_mutex_);
+                ++statistics_total_bunches_;
+            }
+        }
+    } catch (std::runtime_error &e) {
+        log_warn("Error while serving client on \"%s\": %s", address_.c_str(), e.what());
+
+        try {
+            boost::unique_lock<boost::mutex> guard(send_mutex_);
+            I3CLSimHelper::Remote::SendError(clientSocket, e.what());
+        } catch (std::runtime_error &) {
+            // the client is gone already
+        }
+    }
+
+    {
+        boost::unique_lock<boost::mutex> guard(client_mutex_);
+        readerDone_=true;
+    }
+    client_cond_.notify_all();
+
+    writerThread.join();
+
+    {
+        boost::unique_lock<boost::mutex> guard(client_mutex_);
+        I3CLSimHelper::Remote::Close(clientSocket);
+        clientSocket_=-1;
+    }
+
+    log_info("Client disconnected from \"%s\"", address_.c_str());
+}
+
+void I3CLSimStepToPhotonConverterServer::WriterThread(int clientSocket)
+{
+    bool clientGone=false;
+
+    for (;;)
+    {
+        {
+            boost::unique_lock<boost::mutex> guard(client_mutex_);
+            while ((numPending_==0) && (!readerDone_))
+            {
+                client_cond_.wait(guard);
+            }
+            if (numPending_==0) break; // the reader is done and everything has been sent
+        }
+
+        // Results have to be fetched even if the client is gone,
+        // otherwise they would end up at the next client.
+        I3CLSimStepToPhotonConverter::ConversionResult_t result;
+        try {
+            result = converter_->GetConversionResult();
+        } catch (std::runtime_error &e) {
+            log_error("Converter failed on \"%s\": %s", address_.c_str(), e.what());
+
+            try {
+                boost::unique_lock<boost::mutex> guard(send_mutex_);
+                I3CLSimHelper::Remote::SendError(clientSocket, e.what());
+            } catch (std::runtime_error &) {
+            }
+
+            // nothing more will come from the converter
+            I3CLSimHelper::Remote::Shutdown(clientSocket);
+            break;
+        }
+
+        {
+            boost::unique_lock<boost::mutex> guard(client_mutex_);
+            --numPending_;
+        }
+
+        if (clientGone) continue;
+
+        try {
+            boost::unique_lock<boost::mutex> guard(send_mutex_);
+            I3CLSimHelper::Remote::SendResult(clientSocket, result);
+        } catch (std::runtime_error &e) {
+            log_warn("Could not send results to client on \"%s\": %s", address_.c_str(), e.what());
+            clientGone=true;
+
+            // make sure the reader stops, too
+            I3CLSimHelper::Remote::Shutdown(clientSocket);
+        }
+    }
+}
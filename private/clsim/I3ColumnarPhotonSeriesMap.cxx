@@ -0,0 +1,522 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3ColumnarPhotonSeriesMap.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#include <icetray/serialization.h>
+#include <clsim/I3ColumnarPhotonSeriesMap.h>
+
+#ifdef HAS_PBA_IN_ICETRAY
+#include <icetray/portable_binary_archive.hpp>
+#else
+#include <boost/archive/portable_binary_iarchive.hpp>
+#include <boost/archive/portable_binary_oarchive.hpp>
+#endif
+
+#include <boost/serialization/binary_object.hpp>
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+using namespace boost::archive;
+
+namespace {
+    // 16-bit fixed point steps for directions
+    const double zenithStep = M_PI/65535.;
+    const double azimuthStep = 2.*M_PI/65536.;
+
+    // largest magnitude of a quantized position offset
+    const double maxQuantizedOffset = 32767.;
+
+    // sorts indices into a photon series by photon time
+    struct PhotonTimeLess
+    {
+        PhotonTimeLess(const I3PhotonSeries &photons) : photons_(photons) {;}
+        bool operator()(uint32_t a, uint32_t b) const
+        {
+            return photons_[a].GetTime() < photons_[b].GetTime();
+        }
+        const I3PhotonSeries &photons_;
+    };
+
+    template <typename T>
+    T RoundToFixedPoint(double value, double minValue, double maxValue)
+    {
+        return static_cast<T>(std::floor(std::max(minValue, std::min(maxValue, value)) + 0.5));
+    }
+
+    // columns are written element by element for text archives..
+    template <class Archive, typename T>
+    void SaveColumn(Archive &ar, const char *name, const std::vector<T> &column)
+    {
+        ar << make_nvp(name, column);
+    }
+
+    template <class Archive, typename T>
+    void LoadColumn(Archive &ar, const char *name, std::vector<T> &column)
+    {
+        ar >> make_nvp(name, column);
+    }
+
+    // ..and as a single binary blob for binary archives. Like
+    // I3CLSimPhoton, this assumes a little-endian host.
+    template <typename T>
+    void SaveColumn(portable_binary_oarchive &ar, const char *name, const std::vector<T> &column)
+    {
+        uint64_t size = column.size();
+        ar << make_nvp("num", size);
+        if (size==0) return;
+        ar << make_nvp(name, boost::serialization::make_binary_object((void *)&(column[0]), sizeof(T)*size));
+    }
+
+    template <typename T>
+    void LoadColumn(portable_binary_iarchive &ar, const char *name, std::vector<T> &column)
+    {
+        uint64_t size;
+        ar >> make_nvp("num", size);
+        column.resize(size);
+        if (size==0) return;
+        ar >> make_nvp(name, boost::serialization::make_binary_object(&(column[0]), sizeof(T)*size));
+    }
+}
+
+I3ColumnarPhotonSeriesMap::I3ColumnarPhotonSeriesMap()
+:
+deltaEncodeTimes_(false),
+quantizeDirections_(false),
+positionResolution_(0.)
+{ }
+
+I3ColumnarPhotonSeriesMap::I3ColumnarPhotonSeriesMap(const I3PhotonSeriesMap &photons,
+                                                     bool deltaEncodeTimes,
+                                                     bool quantizeDirections,
+                                                     double positionResolution)
+:
+deltaEncodeTimes_(deltaEncodeTimes),
+quantizeDirections_(quantizeDirections),
+positionResolution_(positionResolution)
+{
+    if (std::isnan(positionResolution_) || (positionResolution_ < 0.))
+        log_fatal("The position resolution must be positive (or 0 to store positions without quantization).");
+
+    Fill(photons);
+}
+
+I3ColumnarPhotonSeriesMap::~I3ColumnarPhotonSeriesMap() { }
+
+void I3ColumnarPhotonSeriesMap::clear()
+{
+    blockKeys_.clear();
+    blockSizes_.clear();
+    blockTimeOrigins_.clear();
+    blockCenterX_.clear();
+    blockCenterY_.clear();
+    blockCenterZ_.clear();
+    blockPositionSteps_.clear();
+    blockOffsets_.clear();
+
+    particleMajorIDs_.clear();
+    particleMinorIDs_.clear();
+    particleIndexLookup_.clear();
+
+    times_.clear();
+    timeDeltas_.clear();
+    weights_.clear();
+    wavelengths_.clear();
+    groupVelocities_.clear();
+    zeniths_.clear();
+    azimuths_.clear();
+    quantizedZeniths_.clear();
+    quantizedAzimuths_.clear();
+    offsetX_.clear();
+    offsetY_.clear();
+    offsetZ_.clear();
+    quantizedOffsetX_.clear();
+    quantizedOffsetY_.clear();
+    quantizedOffsetZ_.clear();
+    particleIndices_.clear();
+    scatteredFlags_.clear();
+}
+
+void I3ColumnarPhotonSeriesMap::Fill(const I3PhotonSeriesMap &photons)
+{
+    clear();
+
+    std::size_t numPhotons=0;
+    for (I3PhotonSeriesMap::const_iterator it=photons.begin(); it!=photons.end(); ++it)
+        numPhotons += it->second.size();
+
+    if (deltaEncodeTimes_) timeDeltas_.reserve(numPhotons);
+    else times_.reserve(numPhotons);
+    weights_.reserve(numPhotons);
+    wavelengths_.reserve(numPhotons);
+    groupVelocities_.reserve(numPhotons);
+    if (quantizeDirections_) {
+        quantizedZeniths_.reserve(numPhotons);
+        quantizedAzimuths_.reserve(numPhotons);
+    } else {
+        zeniths_.reserve(numPhotons);
+        azimuths_.reserve(numPhotons);
+    }
+    if (GetQuantizePositions()) {
+        quantizedOffsetX_.reserve(numPhotons);
+        quantizedOffsetY_.reserve(numPhotons);
+        quantizedOffsetZ_.reserve(numPhotons);
+    } else {
+        offsetX_.reserve(numPhotons);
+        offsetY_.reserve(numPhotons);
+        offsetZ_.reserve(numPhotons);
+    }
+    particleIndices_.reserve(numPhotons);
+    scatteredFlags_.reserve((numPhotons+7)/8);
+
+    for (I3PhotonSeriesMap::const_iterator it=photons.begin(); it!=photons.end(); ++it)
+        AppendBlock(it->first, it->second);
+
+    // the lookup is only needed while filling
+    particleIndexLookup_.clear();
+}
+
+uint32_t I3ColumnarPhotonSeriesMap::GetParticleIndex(uint64_t majorID, int32_t minorID)
+{
+    const std::pair<uint64_t, int32_t> id(majorID, minorID);
+
+    std::map<std::pair<uint64_t, int32_t>, uint32_t>::const_iterator it =
+    particleIndexLookup_.find(id);
+    if (it != particleIndexLookup_.end()) return it->second;
+
+    const uint32_t index = static_cast<uint32_t>(particleMajorIDs_.size());
+    particleMajorIDs_.push_back(majorID);
+    particleMinorIDs_.push_back(minorID);
+    particleIndexLookup_.insert(std::make_pair(id, index));
+    return index;
+}
+
+bool I3ColumnarPhotonSeriesMap::GetScattered(std::size_t photon) const
+{
+    // version 0 did not record scattering, assume the worst
+    if (scatteredFlags_.empty()) return true;
+
+    return (scatteredFlags_[photon/8] >> (photon%8)) & 1;
+}
+
+void I3ColumnarPhotonSeriesMap::AppendBlock(const key_type &key, const I3PhotonSeries &photons)
+{
+    if (photons.size() > std::numeric_limits<uint32_t>::max())
+        log_fatal("Too many photons on a single OM.");
+
+    // the order in which photons are stored
+    std::vector<uint32_t> order(photons.size());
+    for (std::size_t i=0;i<order.size();++i) order[i]=static_cast<uint32_t>(i);
+    if (deltaEncodeTimes_)
+        std::stable_sort(order.begin(), order.end(), PhotonTimeLess(photons));
+
+    // the block center is the center of the bounding box of all positions
+    double minX=0., minY=0., minZ=0.;
+    double maxX=0., maxY=0., maxZ=0.;
+    for (std::size_t i=0;i<photons.size();++i)
+    {
+        const I3Position &pos = photons[i].GetPos();
+        if (i==0) {
+            minX=maxX=pos.GetX();
+            minY=maxY=pos.GetY();
+            minZ=maxZ=pos.GetZ();
+            continue;
+        }
+        minX=std::min(minX, pos.GetX()); maxX=std::max(maxX, pos.GetX());
+        minY=std::min(minY, pos.GetY()); maxY=std::max(maxY, pos.GetY());
+        minZ=std::min(minZ, pos.GetZ()); maxZ=std::max(maxZ, pos.GetZ());
+    }
+    const double centerX = (minX+maxX)/2.;
+    const double centerY = (minY+maxY)/2.;
+    const double centerZ = (minZ+maxZ)/2.;
+
+    // coarsen the quantization step if the block does
+    // not fit into 16 bits at the requested resolution
+    double positionStep = positionResolution_;
+    if (GetQuantizePositions()) {
+        const double halfExtent = std::max(maxX-minX, std::max(maxY-minY, maxZ-minZ))/2.;
+        positionStep = std::max(positionStep, halfExtent/maxQuantizedOffset);
+    }
+
+    const double timeOrigin = photons.empty() ? 0. : photons[order[0]].GetTime();
+
+    blockOffsets_.push_back(particleIndices_.size());
+    blockKeys_.push_back(key);
+    blockSizes_.push_back(static_cast<uint32_t>(photons.size()));
+    blockTimeOrigins_.push_back(timeOrigin);
+    blockCenterX_.push_back(centerX);
+    blockCenterY_.push_back(centerY);
+    blockCenterZ_.push_back(centerZ);
+    blockPositionSteps_.push_back(positionStep);
+
+    // keep track of the decoded time so rounding
+    // errors in the deltas do not accumulate
+    double decodedTime = timeOrigin;
+
+    for (std::size_t i=0;i<order.size();++i)
+    {
+        const I3Photon &photon = photons[order[i]];
+
+        if (deltaEncodeTimes_) {
+            const float delta = static_cast<float>(photon.GetTime()-decodedTime);
+            timeDeltas_.push_back(delta);
+            decodedTime += static_cast<double>(delta);
+        } else {
+            times_.push_back(photon.GetTime());
+        }
+
+        weights_.push_back(static_cast<float>(photon.GetWeight()));
+        wavelengths_.push_back(static_cast<float>(photon.GetWavelength()));
+        groupVelocities_.push_back(static_cast<float>(photon.GetGroupVelocity()));
+
+        const double zenith = photon.GetDir().GetZenith();
+        const double azimuth = photon.GetDir().GetAzimuth();
+        if (quantizeDirections_) {
+            quantizedZeniths_.push_back(RoundToFixedPoint<uint16_t>(zenith/zenithStep, 0., 65535.));
+
+            // the azimuth is periodic, so 2pi wraps around to 0
+            double azimuthInSteps = std::floor(azimuth/azimuthStep + 0.5);
+            azimuthInSteps -= 65536.*std::floor(azimuthInSteps/65536.);
+            quantizedAzimuths_.push_back(static_cast<uint16_t>(azimuthInSteps));
+        } else {
+            zeniths_.push_back(static_cast<float>(zenith));
+            azimuths_.push_back(static_cast<float>(azimuth));
+        }
+
+        const I3Position &pos = photon.GetPos();
+        if (GetQuantizePositions()) {
+            quantizedOffsetX_.push_back(RoundToFixedPoint<int16_t>((pos.GetX()-centerX)/positionStep, -maxQuantizedOffset, maxQuantizedOffset));
+            quantizedOffsetY_.push_back(RoundToFixedPoint<int16_t>((pos.GetY()-centerY)/positionStep, -maxQuantizedOffset, maxQuantizedOffset));
+            quantizedOffsetZ_.push_back(RoundToFixedPoint<int16_t>((pos.GetZ()-centerZ)/positionStep, -maxQuantizedOffset, maxQuantizedOffset));
+        } else {
+            offsetX_.push_back(static_cast<float>(pos.GetX()-centerX));
+            offsetY_.push_back(static_cast<float>(pos.GetY()-centerY));
+            offsetZ_.push_back(static_cast<float>(pos.GetZ()-centerZ));
+        }
+
+        const std::size_t photonIndex = particleIndices_.size();
+        if (photonIndex%8 == 0) scatteredFlags_.push_back(0);
+        if (photon.GetNumScattered() > 0)
+            scatteredFlags_.back() |= static_cast<uint8_t>(1 << (photonIndex%8));
+
+        particleIndices_.push_back(GetParticleIndex(photon.GetParticleMajorID(), photon.GetParticleMinorID()));
+    }
+}
+
+void I3ColumnarPhotonSeriesMap::DecodeBlock(std::size_t block, I3PhotonSeries &photons) const
+{
+    if (block >= blockKeys_.size())
+        log_fatal("Block index %zu out of range (there are %zu blocks).", block, blockKeys_.size());
+
+    const std::size_t offset = blockOffsets_[block];
+    const std::size_t size = blockSizes_[block];
+
+    const double centerX = blockCenterX_[block];
+    const double centerY = blockCenterY_[block];
+    const double centerZ = blockCenterZ_[block];
+    const double positionStep = blockPositionSteps_[block];
+
+    double time = blockTimeOrigins_[block];
+
+    photons.reserve(photons.size()+size);
+    for (std::size_t i=offset;i<offset+size;++i)
+    {
+        const uint32_t particleIndex = particleIndices_[i];
+        photons.push_back(I3Photon(particleMajorIDs_[particleIndex], particleMinorIDs_[particleIndex]));
+        I3Photon &photon = photons.back();
+
+        if (deltaEncodeTimes_) {
+            time += static_cast<double>(timeDeltas_[i]);
+            photon.SetTime(time);
+        } else {
+            photon.SetTime(times_[i]);
+        }
+
+        photon.SetWeight(weights_[i]);
+        photon.SetWavelength(wavelengths_[i]);
+        photon.SetGroupVelocity(groupVelocities_[i]);
+
+        if (quantizeDirections_) {
+            photon.SetDir(I3Direction(static_cast<double>(quantizedZeniths_[i])*zenithStep,
+                                      static_cast<double>(quantizedAzimuths_[i])*azimuthStep));
+        } else {
+            photon.SetDir(I3Direction(zeniths_[i], azimuths_[i]));
+        }
+
+        if (GetQuantizePositions()) {
+            photon.SetPos(I3Position(centerX + static_cast<double>(quantizedOffsetX_[i])*positionStep,
+                                     centerY + static_cast<double>(quantizedOffsetY_[i])*positionStep,
+                                     centerZ + static_cast<double>(quantizedOffsetZ_[i])*positionStep));
+        } else {
+            photon.SetPos(I3Position(centerX + static_cast<double>(offsetX_[i]),
+                                     centerY + static_cast<double>(offsetY_[i]),
+                                     centerZ + static_cast<double>(offsetZ_[i])));
+        }
+
+        // the number of scatters is not stored, only whether there were any
+        if (GetScattered(i)) photon.SetNumScattered(1);
+    }
+}
+
+I3PhotonSeriesMapPtr I3ColumnarPhotonSeriesMap::GetPhotonSeriesMap() const
+{
+    I3PhotonSeriesMapPtr photons(new I3PhotonSeriesMap());
+
+    for (std::size_t block=0;block<blockKeys_.size();++block)
+    {
+        I3PhotonSeries &series = (*photons)[blockKeys_[block]];
+        DecodeBlock(block, series);
+    }
+
+    return photons;
+}
+
+template <class Archive>
+void I3ColumnarPhotonSeriesMap::save(Archive &ar, unsigned version) const
+{
+    ar << make_nvp("I3FrameObject", base_object<I3FrameObject>(*this));
+
+    ar << make_nvp("deltaEncodeTimes", deltaEncodeTimes_);
+    ar << make_nvp("quantizeDirections", quantizeDirections_);
+    ar << make_nvp("positionResolution", positionResolution_);
+
+    ar << make_nvp("blockKeys", blockKeys_);
+    SaveColumn(ar, "blockSizes", blockSizes_);
+    SaveColumn(ar, "blockTimeOrigins", blockTimeOrigins_);
+    SaveColumn(ar, "blockCenterX", blockCenterX_);
+    SaveColumn(ar, "blockCenterY", blockCenterY_);
+    SaveColumn(ar, "blockCenterZ", blockCenterZ_);
+    SaveColumn(ar, "blockPositionSteps", blockPositionSteps_);
+
+    SaveColumn(ar, "particleMajorIDs", particleMajorIDs_);
+    SaveColumn(ar, "particleMinorIDs", particleMinorIDs_);
+
+    // only the columns for the configured encoding are non-empty
+    SaveColumn(ar, "times", times_);
+    SaveColumn(ar, "timeDeltas", timeDeltas_);
+    SaveColumn(ar, "weights", weights_);
+    SaveColumn(ar, "wavelengths", wavelengths_);
+    SaveColumn(ar, "groupVelocities", groupVelocities_);
+    SaveColumn(ar, "zeniths", zeniths_);
+    SaveColumn(ar, "azimuths", azimuths_);
+    SaveColumn(ar, "quantizedZeniths", quantizedZeniths_);
+    SaveColumn(ar, "quantizedAzimuths", quantizedAzimuths_);
+    SaveColumn(ar, "offsetX", offsetX_);
+    SaveColumn(ar, "offsetY", offsetY_);
+    SaveColumn(ar, "offsetZ", offsetZ_);
+    SaveColumn(ar, "quantizedOffsetX", quantizedOffsetX_);
+    SaveColumn(ar, "quantizedOffsetY", quantizedOffsetY_);
+    SaveColumn(ar, "quantizedOffsetZ", quantizedOffsetZ_);
+    SaveColumn(ar, "particleIndices", particleIndices_);
+    SaveColumn(ar, "scatteredFlags", scatteredFlags_);
+}
+
+template <class Archive>
+void I3ColumnarPhotonSeriesMap::load(Archive &ar, unsigned version)
+{
+    if (version > i3columnarphotonseriesmap_version_)
+        log_fatal("Attempting to read version %u from file but running version %u of I3ColumnarPhotonSeriesMap class.",version,i3columnarphotonseriesmap_version_);
+
+    clear();
+
+    ar >> make_nvp("I3FrameObject", base_object<I3FrameObject>(*this));
+
+    ar >> make_nvp("deltaEncodeTimes", deltaEncodeTimes_);
+    ar >> make_nvp("quantizeDirections", quantizeDirections_);
+    ar >> make_nvp("positionResolution", positionResolution_);
+
+    ar >> make_nvp("blockKeys", blockKeys_);
+    LoadColumn(ar, "blockSizes", blockSizes_);
+    LoadColumn(ar, "blockTimeOrigins", blockTimeOrigins_);
+    LoadColumn(ar, "blockCenterX", blockCenterX_);
+    LoadColumn(ar, "blockCenterY", blockCenterY_);
+    LoadColumn(ar, "blockCenterZ", blockCenterZ_);
+    LoadColumn(ar, "blockPositionSteps", blockPositionSteps_);
+
+    LoadColumn(ar, "particleMajorIDs", particleMajorIDs_);
+    LoadColumn(ar, "particleMinorIDs", particleMinorIDs_);
+
+    LoadColumn(ar, "times", times_);
+    LoadColumn(ar, "timeDeltas", timeDeltas_);
+    LoadColumn(ar, "weights", weights_);
+    LoadColumn(ar, "wavelengths", wavelengths_);
+    LoadColumn(ar, "groupVelocities", groupVelocities_);
+    LoadColumn(ar, "zeniths", zeniths_);
+    LoadColumn(ar, "azimuths", azimuths_);
+    LoadColumn(ar, "quantizedZeniths", quantizedZeniths_);
+    LoadColumn(ar, "quantizedAzimuths", quantizedAzimuths_);
+    LoadColumn(ar, "offsetX", offsetX_);
+    LoadColumn(ar, "offsetY", offsetY_);
+    LoadColumn(ar, "offsetZ", offsetZ_);
+    LoadColumn(ar, "quantizedOffsetX", quantizedOffsetX_);
+    LoadColumn(ar, "quantizedOffsetY", quantizedOffsetY_);
+    LoadColumn(ar, "quantizedOffsetZ", quantizedOffsetZ_);
+    LoadColumn(ar, "particleIndices", particleIndices_);
+    if (version >= 1)
+        LoadColumn(ar, "scatteredFlags", scatteredFlags_);
+
+    // sanity checks, so that decoding cannot read out of bounds
+    const std::size_t numBlocks = blockKeys_.size();
+    if ((blockSizes_.size() != numBlocks) ||
+        (blockTimeOrigins_.size() != numBlocks) ||
+        (blockCenterX_.size() != numBlocks) ||
+        (blockCenterY_.size() != numBlocks) ||
+        (blockCenterZ_.size() != numBlocks) ||
+        (blockPositionSteps_.size() != numBlocks))
+        log_fatal("Inconsistent number of blocks in I3ColumnarPhotonSeriesMap.");
+
+    if (particleMajorIDs_.size() != particleMinorIDs_.size())
+        log_fatal("Inconsistent particle table in I3ColumnarPhotonSeriesMap.");
+
+    std::size_t numPhotons=0;
+    blockOffsets_.reserve(numBlocks);
+    for (std::size_t block=0;block<numBlocks;++block)
+    {
+        blockOffsets_.push_back(numPhotons);
+        numPhotons += blockSizes_[block];
+    }
+
+    if ((particleIndices_.size() != numPhotons) ||
+        ((deltaEncodeTimes_ ? timeDeltas_.size() : times_.size()) != numPhotons) ||
+        (weights_.size() != numPhotons) ||
+        (wavelengths_.size() != numPhotons) ||
+        (groupVelocities_.size() != numPhotons) ||
+        ((quantizeDirections_ ? quantizedZeniths_.size() : zeniths_.size()) != numPhotons) ||
+        ((quantizeDirections_ ? quantizedAzimuths_.size() : azimuths_.size()) != numPhotons) ||
+        ((GetQuantizePositions() ? quantizedOffsetX_.size() : offsetX_.size()) != numPhotons) ||
+        ((GetQuantizePositions() ? quantizedOffsetY_.size() : offsetY_.size()) != numPhotons) ||
+        ((GetQuantizePositions() ? quantizedOffsetZ_.size() : offsetZ_.size()) != numPhotons) ||
+        ((version >= 1) && (scatteredFlags_.size() != (numPhotons+7)/8)))
+        log_fatal("Inconsistent column lengths in I3ColumnarPhotonSeriesMap.");
+
+    for (std::size_t i=0;i<particleIndices_.size();++i)
+    {
+        if (particleIndices_[i] >= particleMajorIDs_.size())
+            log_fatal("Invalid particle index in I3ColumnarPhotonSeriesMap.");
+    }
+}
+
+I3_SERIALIZABLE(I3ColumnarPhotonSeriesMap);
@@ -36,6 +36,7 @@
 #include <boost/foreach.hpp>
 
 #include "clsim/I3Photon.h"
+#include "clsim/I3ColumnarPhotonSeriesMap.h"
 
 #include "phys-services/I3SummaryService.h"
 
@@ -63,7 +64,7 @@ I3PhotonToMCPEConverter::I3PhotonToMCPEConverter(const I3Context& context)
 
     inputPhotonSeriesMapName_="PropagatedPhotons";
     AddParameter("InputPhotonSeriesMapName",
-                 "Name of the input I3PhotonSeriesMap frame object.",
+                 "Name of the input I3PhotonSeriesMap (or I3ColumnarPhotonSeriesMap) frame object.",
                  inputPhotonSeriesMapName_);
 
     outputMCPESeriesMapName_="MCPESeriesMap";
@@ -124,6 +125,13 @@ I3PhotonToMCPEConverter::I3PhotonToMCPEConverter(const I3Context& context)
                  "Make photon position/radius check a warning only (instead of a fatal condition)",
                  onlyWarnAboutInvalidPhotonPositions_);
 
+    allowPhotonWeightsAboveOne_=false;
+    AddParameter("AllowPhotonWeightsAboveOne",
+                 "Accept photons with hit probabilities above one and convert them into hits\n"
+                 "with more than one photo-electron. Photon splitting and step pre-culling in\n"
+                 "I3CLSimModule produce such photons. If this is not set, they are a fatal error.",
+                 allowPhotonWeightsAboveOne_);
+
     // add an outbox
     AddOutBox("OutBox");
     
@@ -160,6 +168,7 @@ void I3PhotonToMCPEConverter::Configure()
     GetParameter("IgnoreDOMsWithoutDetectorStatusEntry", ignoreDOMsWithoutDetectorStatusEntry_);
 
     GetParameter("OnlyWarnAboutInvalidPhotonPositions", onlyWarnAboutInvalidPhotonPositions_);
+    GetParameter("AllowPhotonWeightsAboveOne", allowPhotonWeightsAboveOne_);
 
     if (DOMOversizeFactor_ != DOMPancakeFactor_)
         log_warn("You chose \"DOMOversizeFactor\" and \"DOMPancakeFactor\" to be different. Be sure you know whot you are doing! You probably don't want this.");
@@ -263,6 +272,11 @@ void I3PhotonToMCPEConverter::Physics(I3FramePtr frame)
         log_fatal("no DetectorStatus frame yet, but received a Physics frame.");
     
     I3PhotonSeriesMapConstPtr inputPhotonSeriesMap = frame->Get<I3PhotonSeriesMapConstPtr>(inputPhotonSeriesMapName_);
+    if (!inputPhotonSeriesMap) {
+        // photons may also have been stored in columnar form
+        I3ColumnarPhotonSeriesMapConstPtr columnarPhotons = frame->Get<I3ColumnarPhotonSeriesMapConstPtr>(inputPhotonSeriesMapName_);
+        if (columnarPhotons) inputPhotonSeriesMap = columnarPhotons->GetPhotonSeriesMap();
+    }
     if (!inputPhotonSeriesMap) {
         log_debug("Frame does not contain an I3PhotonSeriesMap named \"%s\".",
                   inputPhotonSeriesMapName_.c_str());
@@ -492,8 +506,10 @@ void I3PhotonToMCPEConverter::Physics(I3FramePtr frame)
             }
             
             // sanity check for unscattered photons: is their direction ok
-            // w.r.t. the vector from emission to detection?
-            if (photon.GetNumScattered()==0)
+            // w.r.t. the vector from emission to detection? (photons
+            // decoded from an I3ColumnarPhotonSeriesMap have no start
+            // position, the check is skipped for them)
+            if ((photon.GetNumScattered()==0) && (!std::isnan(photon.GetStartPos().GetX())))
             {
                 double ppx = photon.GetPos().GetX()-photon.GetStartPos().GetX();
                 double ppy = photon.GetPos().GetY()-photon.GetStartPos().GetY();
@@ -533,7 +549,7 @@ void I3PhotonToMCPEConverter::Physics(I3FramePtr frame)
             log_trace("After efficiency from calibration: prob=%g (efficiency_from_calibration=%f)",
                       hitProbability, efficiency_from_calibration);
 
-            if (hitProbability > 1.) {
+            if ((hitProbability > 1.) && (!allowPhotonWeightsAboveOne_)) {
                 log_warn("hitProbability==%f > 1: your hit weights are too high. (hitProbability-1=%f)", hitProbability, hitProbability-1.);
 
                 double hitProbability = photon.GetWeight();
@@ -561,8 +577,12 @@ void I3PhotonToMCPEConverter::Physics(I3FramePtr frame)
                 log_fatal("cannot continue.");
             }
             
-            // does it survive?
-            if (hitProbability <= randomService_->Uniform()) continue;
+            // does it survive? If allowed, photons can have weights > 1 (e.g. from
+            // photon splitting or step pre-culling), these are converted
+            // into hits with more than one photo-electron.
+            uint32_t numPE = static_cast<uint32_t>(hitProbability);
+            if (hitProbability-static_cast<double>(numPE) > randomService_->Uniform()) ++numPE;
+            if (numPE==0) continue;
 
             // find the particle
             const I3Particle *particle = NULL;
@@ -598,7 +618,7 @@ void I3PhotonToMCPEConverter::Physics(I3FramePtr frame)
             
             // fill in all information
             hit.time=correctedTime;
-            hit.npe=1;
+            hit.npe=numPE;
         }
         
         if (hits) {
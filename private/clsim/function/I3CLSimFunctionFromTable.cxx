@@ -24,8 +24,10 @@
  * @author Claudio Kopper
  */
 
+#ifndef I3CLSIM_WITHOUT_OPENCL
 #define __CL_ENABLE_EXCEPTIONS
 #include "clsim/cl.hpp"
+#endif
 
 #include <icetray/serialization.h>
 #include <clsim/function/I3CLSimFunctionFromTable.h>
@@ -0,0 +1,421 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimSparsePhotonTable.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+#include <inttypes.h>
+
+#include "clsim/tabulator/I3CLSimSparsePhotonTable.h"
+
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+
+#include <cstring>
+#include <algorithm>
+
+const uint32_t I3CLSimSparsePhotonTable::formatVersion = 1;
+const uint64_t I3CLSimSparsePhotonTable::defaultChunkSize = 65536;
+
+namespace {
+    const char fileMagic[8] = {'C','L','S','I','M','S','P','T'};
+}
+
+I3CLSimSparsePhotonTable::I3CLSimSparsePhotonTable(const std::string &filename)
+:
+filename_(filename),
+numBins_(0),
+chunkSize_(0)
+{
+    try {
+        file_.open(filename);
+    } catch (std::exception &e) {
+        log_fatal("Could not map table file \"%s\": %s", filename.c_str(), e.what());
+    }
+
+    std::size_t position=0;
+
+    char magic[sizeof(fileMagic)];
+    Read(magic, sizeof(magic), position);
+    if (std::memcmp(magic, fileMagic, sizeof(fileMagic)) != 0)
+        log_fatal("\"%s\" is not a sparse photon table.", filename.c_str());
+
+    uint32_t version;
+    Read(&version, sizeof(version), position);
+    if (version != formatVersion)
+        log_fatal("\"%s\" has format version %" PRIu32 ", expected %" PRIu32 ".",
+                  filename.c_str(), version, formatVersion);
+
+    uint32_t numDimensions;
+    Read(&numDimensions, sizeof(numDimensions), position);
+    if (numDimensions == 0)
+        log_fatal("\"%s\" has no dimensions.", filename.c_str());
+
+    shape_.resize(numDimensions);
+    numBins_ = 1;
+    for (uint32_t i=0;i<numDimensions;++i)
+    {
+        Read(&(shape_[i]), sizeof(uint64_t), position);
+        numBins_ *= shape_[i];
+    }
+
+    binEdges_.resize(numDimensions);
+    for (uint32_t i=0;i<numDimensions;++i)
+    {
+        binEdges_[i].resize(shape_[i]+1);
+        Read(&(binEdges_[i][0]), binEdges_[i].size()*sizeof(double), position);
+    }
+
+    uint32_t numHeaderEntries;
+    Read(&numHeaderEntries, sizeof(numHeaderEntries), position);
+    for (uint32_t i=0;i<numHeaderEntries;++i)
+    {
+        uint32_t keyLength;
+        Read(&keyLength, sizeof(keyLength), position);
+        std::string key(keyLength, ' ');
+        if (keyLength > 0) Read(&(key[0]), keyLength, position);
+
+        uint8_t isInteger;
+        double value;
+        Read(&isInteger, sizeof(isInteger), position);
+        Read(&value, sizeof(value), position);
+
+        header_[key] = HeaderEntry(value, isInteger!=0);
+    }
+
+    uint64_t numChunks, indexOffset;
+    Read(&chunkSize_, sizeof(chunkSize_), position);
+    Read(&numChunks, sizeof(numChunks), position);
+    Read(&indexOffset, sizeof(indexOffset), position);
+
+    if ((chunkSize_ == 0) || (numChunks != (numBins_+chunkSize_-1)/chunkSize_))
+        log_fatal("\"%s\" has an inconsistent chunk layout.", filename.c_str());
+
+    position = indexOffset;
+    chunkIndex_.resize(numChunks);
+    BOOST_FOREACH(ChunkIndexEntry &entry, chunkIndex_)
+    {
+        Read(&(entry.offset), sizeof(uint64_t), position);
+        Read(&(entry.compressedSize), sizeof(uint64_t), position);
+
+        if (entry.offset+entry.compressedSize > file_.size())
+            log_fatal("\"%s\" is truncated.", filename.c_str());
+    }
+}
+
+I3CLSimSparsePhotonTable::~I3CLSimSparsePhotonTable()
+{
+    file_.close();
+}
+
+void I3CLSimSparsePhotonTable::Read(void *buffer, std::size_t size, std::size_t &position) const
+{
+    if (position+size > file_.size())
+        log_fatal("\"%s\" is truncated.", filename_.c_str());
+
+    std::memcpy(buffer, file_.data()+position, size);
+    position += size;
+}
+
+uint64_t I3CLSimSparsePhotonTable::GetNumBinsInChunk(uint64_t chunk) const
+{
+    if (chunk >= chunkIndex_.size())
+        log_fatal("Chunk %" PRIu64 " out of range (the table has %zu chunks).", chunk, chunkIndex_.size());
+
+    return std::min(chunkSize_, numBins_-chunk*chunkSize_);
+}
+
+bool I3CLSimSparsePhotonTable::IsChunkEmpty(uint64_t chunk) const
+{
+    if (chunk >= chunkIndex_.size())
+        log_fatal("Chunk %" PRIu64 " out of range (the table has %zu chunks).", chunk, chunkIndex_.size());
+
+    return (chunkIndex_[chunk].compressedSize == 0);
+}
+
+void I3CLSimSparsePhotonTable::ReadChunk(uint64_t chunk,
+                                         std::vector<float> &values,
+                                         std::vector<float> &weights) const
+{
+    const uint64_t numBins = GetNumBinsInChunk(chunk);
+
+    values.assign(numBins, 0.f);
+    weights.assign(numBins, 0.f);
+
+    AddChunk(chunk, &(values[0]), &(weights[0]));
+}
+
+void I3CLSimSparsePhotonTable::AddChunk(uint64_t chunk,
+                                        float *values,
+                                        float *weights) const
+{
+    const uint64_t numBins = GetNumBinsInChunk(chunk);
+    const ChunkIndexEntry &entry = chunkIndex_[chunk];
+
+    if (entry.compressedSize == 0) return; // nothing to add
+
+    // decompress straight from the mapped file
+    std::vector<float> buffer(2*numBins);
+    try {
+        boost::iostreams::filtering_istream decompressor;
+        decompressor.push(boost::iostreams::zlib_decompressor());
+        decompressor.push(boost::iostreams::array_source(file_.data()+entry.offset, entry.compressedSize));
+        decompressor.read(reinterpret_cast<char *>(&(buffer[0])), buffer.size()*sizeof(float));
+
+        if (static_cast<std::size_t>(decompressor.gcount()) != buffer.size()*sizeof(float))
+            log_fatal("Chunk %" PRIu64 " of \"%s\" is too short.", chunk, filename_.c_str());
+    } catch (boost::iostreams::zlib_error &e) {
+        log_fatal("Could not decompress chunk %" PRIu64 " of \"%s\": %s", chunk, filename_.c_str(), e.what());
+    }
+
+    for (uint64_t i=0;i<numBins;++i)
+    {
+        values[i] += buffer[i];
+        weights[i] += buffer[numBins+i];
+    }
+}
+
+void I3CLSimSparsePhotonTable::Merge(const std::vector<std::string> &inputFiles,
+                                     const std::string &outputFile)
+{
+    if (inputFiles.empty())
+        log_fatal("No input tables to merge.");
+
+    // only the chunk index and the header of each table are read here
+    std::vector<boost::shared_ptr<I3CLSimSparsePhotonTable> > tables;
+    BOOST_FOREACH(const std::string &filename, inputFiles)
+    {
+        tables.push_back(boost::shared_ptr<I3CLSimSparsePhotonTable>(new I3CLSimSparsePhotonTable(filename)));
+    }
+
+    const I3CLSimSparsePhotonTable &first = *(tables[0]);
+    Header_t header = first.GetHeader();
+
+    for (std::size_t i=1;i<tables.size();++i)
+    {
+        const I3CLSimSparsePhotonTable &table = *(tables[i]);
+
+        if (table.GetBinEdges() != first.GetBinEdges())
+            log_fatal("\"%s\" and \"%s\" have different bin edges.", inputFiles[0].c_str(), inputFiles[i].c_str());
+        if (table.GetChunkSize() != first.GetChunkSize())
+            log_fatal("\"%s\" and \"%s\" have different chunk sizes.", inputFiles[0].c_str(), inputFiles[i].c_str());
+
+        BOOST_FOREACH(const Header_t::value_type &entry, table.GetHeader())
+        {
+            Header_t::iterator it = header.find(entry.first);
+
+            if (entry.first == "n_photons") {
+                if (it == header.end())
+                    header[entry.first] = entry.second;
+                else
+                    it->second.value += entry.second.value;
+            } else if ((it == header.end()) || (it->second.value != entry.second.value)) {
+                log_fatal("Can't combine tables with different values of header entry \"%s\" (\"%s\" and \"%s\").",
+                          entry.first.c_str(), inputFiles[0].c_str(), inputFiles[i].c_str());
+            }
+        }
+        if (table.GetHeader().size() != header.size())
+            log_fatal("\"%s\" and \"%s\" have different header entries.", inputFiles[0].c_str(), inputFiles[i].c_str());
+    }
+
+    I3CLSimSparsePhotonTableWriter writer(outputFile, first.GetBinEdges(), header, first.GetChunkSize());
+
+    std::vector<float> values(first.GetChunkSize());
+    std::vector<float> weights(first.GetChunkSize());
+
+    for (uint64_t chunk=0;chunk<first.GetNumChunks();++chunk)
+    {
+        const uint64_t numBins = first.GetNumBinsInChunk(chunk);
+        std::fill(values.begin(), values.begin()+numBins, 0.f);
+        std::fill(weights.begin(), weights.begin()+numBins, 0.f);
+
+        BOOST_FOREACH(const boost::shared_ptr<I3CLSimSparsePhotonTable> &table, tables)
+        {
+            table->AddChunk(chunk, &(values[0]), &(weights[0]));
+        }
+
+        writer.AppendChunk(&(values[0]), &(weights[0]), numBins);
+    }
+
+    writer.Close();
+}
+
+
+I3CLSimSparsePhotonTableWriter::I3CLSimSparsePhotonTableWriter(const std::string &filename,
+                                                               const std::vector<std::vector<double> > &binEdges,
+                                                               const I3CLSimSparsePhotonTable::Header_t &header,
+                                                               uint64_t chunkSize)
+:
+filename_(filename),
+closed_(false),
+numBins_(1),
+chunkSize_(chunkSize),
+numChunks_(0)
+{
+    if (binEdges.empty())
+        log_fatal("A table needs at least one dimension.");
+    if (chunkSize_ == 0)
+        log_fatal("The chunk size must not be 0.");
+
+    BOOST_FOREACH(const std::vector<double> &edges, binEdges)
+    {
+        if (edges.size() < 2)
+            log_fatal("Each dimension needs at least 2 bin edges.");
+        numBins_ *= (edges.size()-1);
+    }
+
+    file_.open(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file_.good())
+        log_fatal("Could not open \"%s\" for writing.", filename.c_str());
+
+    file_.write(fileMagic, sizeof(fileMagic));
+    Write(I3CLSimSparsePhotonTable::formatVersion);
+    Write(static_cast<uint32_t>(binEdges.size()));
+    BOOST_FOREACH(const std::vector<double> &edges, binEdges)
+    {
+        Write(static_cast<uint64_t>(edges.size()-1));
+    }
+    BOOST_FOREACH(const std::vector<double> &edges, binEdges)
+    {
+        file_.write(reinterpret_cast<const char *>(&(edges[0])), edges.size()*sizeof(double));
+    }
+
+    Write(static_cast<uint32_t>(header.size()));
+    BOOST_FOREACH(const I3CLSimSparsePhotonTable::Header_t::value_type &entry, header)
+    {
+        Write(static_cast<uint32_t>(entry.first.size()));
+        file_.write(entry.first.data(), entry.first.size());
+        Write(static_cast<uint8_t>(entry.second.isInteger?1:0));
+        Write(entry.second.value);
+    }
+
+    Write(chunkSize_);
+    Write(static_cast<uint64_t>((numBins_+chunkSize_-1)/chunkSize_));
+
+    // the index offset is only known at the end, Close() fills it in
+    indexOffsetPosition_ = file_.tellp();
+    Write(static_cast<uint64_t>(0));
+
+    if (!file_.good())
+        log_fatal("Could not write to \"%s\".", filename.c_str());
+}
+
+I3CLSimSparsePhotonTableWriter::~I3CLSimSparsePhotonTableWriter()
+{
+    if (closed_) return;
+
+    // do not throw from the destructor, an incomplete file
+    // is detected when reading it
+    if (numChunks_*chunkSize_ < numBins_) {
+        log_error("Table \"%s\" is incomplete, only %" PRIu64 " chunks were written.",
+                  filename_.c_str(), numChunks_);
+        file_.close();
+        return;
+    }
+
+    if (!WriteIndexAndClose())
+        log_error("Could not write to \"%s\".", filename_.c_str());
+}
+
+void I3CLSimSparsePhotonTableWriter::AppendChunk(const float *values,
+                                                 const float *weights,
+                                                 uint64_t numBins)
+{
+    if (closed_)
+        log_fatal("Table \"%s\" is already closed.", filename_.c_str());
+
+    const uint64_t chunkStart = numChunks_*chunkSize_;
+    if (chunkStart >= numBins_)
+        log_fatal("Table \"%s\" already has all its chunks.", filename_.c_str());
+    if (numBins != std::min(chunkSize_, numBins_-chunkStart))
+        log_fatal("Chunk %" PRIu64 " of \"%s\" has %" PRIu64 " bins, expected %" PRIu64 ".",
+                  numChunks_, filename_.c_str(), numBins, std::min(chunkSize_, numBins_-chunkStart));
+
+    bool isEmpty = true;
+    for (uint64_t i=0;i<numBins;++i)
+    {
+        if ((values[i] != 0.f) || (weights[i] != 0.f)) {
+            isEmpty=false;
+            break;
+        }
+    }
+
+    const uint64_t offset = static_cast<uint64_t>(file_.tellp());
+    uint64_t compressedSize = 0;
+
+    if (!isEmpty) {
+        compressionBuffer_.clear();
+        {
+            boost::iostreams::filtering_ostream compressor;
+            compressor.push(boost::iostreams::zlib_compressor());
+            compressor.push(boost::iostreams::back_inserter(compressionBuffer_));
+            compressor.write(reinterpret_cast<const char *>(values), numBins*sizeof(float));
+            compressor.write(reinterpret_cast<const char *>(weights), numBins*sizeof(float));
+        } // flushes the compressor
+
+        file_.write(&(compressionBuffer_[0]), compressionBuffer_.size());
+        compressedSize = compressionBuffer_.size();
+    }
+
+    if (!file_.good())
+        log_fatal("Could not write to \"%s\".", filename_.c_str());
+
+    chunkIndex_.push_back(offset);
+    chunkIndex_.push_back(compressedSize);
+    ++numChunks_;
+}
+
+void I3CLSimSparsePhotonTableWriter::Close()
+{
+    if (closed_) return;
+
+    if (numChunks_*chunkSize_ < numBins_)
+        log_fatal("Table \"%s\" is incomplete, only %" PRIu64 " chunks were written.",
+                  filename_.c_str(), numChunks_);
+
+    if (!WriteIndexAndClose())
+        log_fatal("Could not write to \"%s\".", filename_.c_str());
+}
+
+bool I3CLSimSparsePhotonTableWriter::WriteIndexAndClose()
+{
+    // the file is closed even if writing fails, so
+    // the destructor does not try again
+    closed_ = true;
+
+    const uint64_t indexOffset = static_cast<uint64_t>(file_.tellp());
+    file_.write(reinterpret_cast<const char *>(&(chunkIndex_[0])), chunkIndex_.size()*sizeof(uint64_t));
+
+    file_.seekp(indexOffsetPosition_);
+    Write(indexOffset);
+    file_.close();
+
+    return !file_.fail();
+}
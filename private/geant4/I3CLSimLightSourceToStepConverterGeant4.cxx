@@ -24,17 +24,31 @@
  * @author Claudio Kopper
  */
 
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+#include <inttypes.h>
+
 #include "clsim/I3CLSimLightSourceToStepConverterGeant4.h"
 
 #include "clsim/I3CLSimQueue.h"
+#include "clsim/I3CLSimLockFreeQueue.h"
 
 #include <boost/thread/locks.hpp>
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include <limits>
 #include <deque>
+#include <algorithm>
+#include <iostream>
 #include <boost/tuple/tuple.hpp>
 
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #ifdef HAS_GEANT4
 // geant4 stuff
 #include "G4RunManager.hh"
@@ -61,6 +75,9 @@
 #endif
 
 #include "clsim/I3CLSimStepStore.h"
+#include "clsim/I3CLSimHelperRemote.h"
+
+#include "phys-services/I3GSLRandomService.h"
 
 #ifdef HAS_GEANT4
 #include "Randomize.hh"
@@ -70,6 +87,47 @@
 #include <stdlib.h>
 
 
+namespace {
+    // Sends all steps from the store, the last bunch padded to a multiple
+    // of bunchSizeGranularity with copies of fillStep. That last bunch
+    // (an empty one if there are no steps) is tagged with flushMarker.
+    // Returns false if the thread has been interrupted.
+    bool FlushStepStore(I3CLSimStepStore &stepStore,
+                        I3CLSimLockFreeQueue<I3CLSimLightSourceToStepConverterGeant4::FromGeant4Pair_t> &queueFromGeant4,
+                        uint64_t maxBunchSize,
+                        uint64_t bunchSizeGranularity,
+                        const I3CLSimStep &fillStep,
+                        uint32_t flushMarker,
+                        boost::this_thread::disable_interruption &di)
+    {
+        boost::this_thread::restore_interruption ri(di);
+
+        try {
+            // send fully-sized bunches first
+            // (keep at least one step for the tagged bunch)
+            while (stepStore.size() > maxBunchSize)
+            {
+                I3CLSimStepSeriesPtr steps(new I3CLSimStepSeries());
+                stepStore.pop_bunch_to_vector(maxBunchSize, *steps);
+                queueFromGeant4.Put(std::make_pair(steps, static_cast<uint32_t>(0)));
+            }
+            
+            // flush the rest (size <= full bunch size)
+            I3CLSimStepSeriesPtr steps(new I3CLSimStepSeries());
+            if (!stepStore.empty()) {
+                const std::size_t numStepsWithDummyFill = bunchSizeGranularity>1?(((stepStore.size()+bunchSizeGranularity-1)/bunchSizeGranularity)*bunchSizeGranularity):stepStore.size();
+                stepStore.pop_bunch_to_vector(numStepsWithDummyFill, *steps, fillStep);
+            }
+            
+            queueFromGeant4.Put(std::make_pair(steps, flushMarker));
+        } catch(boost::thread_interrupted &i) {
+            return false;
+        }
+        
+        return true;
+    }
+}
+
 // static definitions
 
 boost::mutex I3CLSimLightSourceToStepConverterGeant4::thereCanBeOnlyOneGeant4_mutex;
@@ -79,6 +137,7 @@ const uint32_t I3CLSimLightSourceToStepConverterGeant4::default_maxQueueItems=5;
 const std::string I3CLSimLightSourceToStepConverterGeant4::default_physicsListName="QGSP_BERT_EMV";
 const double I3CLSimLightSourceToStepConverterGeant4::default_maxBetaChangePerStep=10.*I3Units::perCent;
 const uint32_t I3CLSimLightSourceToStepConverterGeant4::default_maxNumPhotonsPerStep=200;
+const uint32_t I3CLSimLightSourceToStepConverterGeant4::flushMarkerBarrier=std::numeric_limits<uint32_t>::max();
 #ifdef HAS_GEANT4
 const bool I3CLSimLightSourceToStepConverterGeant4::canUseGeant4=true;
 #else
@@ -91,8 +150,13 @@ I3CLSimLightSourceToStepConverterGeant4::I3CLSimLightSourceToStepConverterGeant4
                                                                            uint32_t maxNumPhotonsPerStep,
                                                                            uint32_t maxQueueItems)
 :
+numWorkerProcesses_(0),
+nextWorker_(0),
+nextMarkerSequenceNumber_(1),
+lastReportedMarkerSequenceNumber_(0),
+workersShuttingDown_(false),
 queueToGeant4_(new I3CLSimQueue<ToGeant4Pair_t>(0)),
-queueFromGeant4_(new I3CLSimQueue<FromGeant4Pair_t>(maxQueueItems)),
+queueFromGeant4_(new I3CLSimLockFreeQueue<FromGeant4Pair_t>(maxQueueItems)),
 queueFromGeant4Messages_(new I3CLSimQueue<boost::shared_ptr<std::pair<const std::string, bool> > >(0)), // no maximum size
 physicsListName_(physicsListName),
 maxBetaChangePerStep_(maxBetaChangePerStep),
@@ -147,6 +211,8 @@ I3CLSimLightSourceToStepConverterGeant4::~I3CLSimLightSourceToStepConverterGeant
 {
     LogGeant4Messages();
 
+    StopWorkerProcesses();
+
     if (geant4ThreadObj_)
     {
         if (geant4ThreadObj_->joinable())
@@ -209,6 +275,19 @@ void I3CLSimLightSourceToStepConverterGeant4::Initialize()
             log_fatal("A parameterization converter is already initialized. Do not call their Initialize() method yourself!");
     }
 
+    if (numWorkerProcesses_>0)
+    {
+        // the workers initialize Geant4 and their
+        // copies of the parameterizations themselves
+        if (workerSockets_.empty()) ForkWorkerProcesses();
+        StartWorkerProcesses();
+
+        LogGeant4Messages();
+
+        initialized_=true;
+        return;
+    }
+
     // now initialize them and set the medium properties and bias factors
     for (I3CLSimLightSourceParameterizationSeries::const_iterator it=parameterizations.begin();
          it!=parameterizations.end(); ++it)
@@ -422,6 +501,9 @@ void I3CLSimLightSourceToStepConverterGeant4::Geant4Thread_impl(boost::this_thre
     // make a copy of the list of available parameterizations
     const I3CLSimLightSourceParameterizationSeries parameterizations = this->GetLightSourceParameterizationSeries();
 
+    // the last flush marker that has not been reported yet (0 if there is none)
+    uint32_t pendingFlushMarker=0;
+
     // start the main loop
     for (;;)
     {
@@ -429,6 +511,22 @@ void I3CLSimLightSourceToStepConverterGeant4::Geant4Thread_impl(boost::this_thre
         I3CLSimLightSourceConstPtr lightSource;
         uint32_t lightSourceIdentifier;
 
+        if ((pendingFlushMarker!=0) && (queueToGeant4_->empty()))
+        {
+            // we are about to wait for new work, so do not hold
+            // back the steps for a deferred flush marker any longer
+            if (!FlushStepStore(*stepStore, *queueFromGeant4_,
+                                maxBunchSize_, bunchSizeGranularity_,
+                                NoOpStepTemplate,
+                                pendingFlushMarker,
+                                di))
+            {
+                log_debug("G4 thread was interrupted. closing.");
+                break;
+            }
+            pendingFlushMarker=0;
+        }
+
         {
             boost::this_thread::restore_interruption ri(di);
             try {
@@ -454,7 +552,7 @@ void I3CLSimLightSourceToStepConverterGeant4::Geant4Thread_impl(boost::this_thre
                 {
                     boost::this_thread::restore_interruption ri(di);
                     try {
-                        queueFromGeant4_->Put(std::make_pair(steps, false));
+                        queueFromGeant4_->Put(std::make_pair(steps, static_cast<uint32_t>(0)));
                     } catch(boost::thread_interrupted &i) {
                         log_debug("G4 thread was interrupted. shutting down Geant4!");
                         
@@ -468,82 +566,32 @@ void I3CLSimLightSourceToStepConverterGeant4::Geant4Thread_impl(boost::this_thre
         
         
         if (!lightSource) {
-            //G4cout << "G4 thread got NULL! flushing " << stepStore->size() << " steps." << G4endl;
-
-            if (stepStore->empty()) {
-                // nothing to send. send an empty step vector along with
-                // the command to disable the barrier
-                
-                I3CLSimStepSeriesPtr steps(new I3CLSimStepSeries());
-
-                {
-                    boost::this_thread::restore_interruption ri(di);
-                    try {
-                        queueFromGeant4_->Put(std::make_pair(steps, true /* this is the LAST reply before the barrier is reached! */));
-                    } catch(boost::thread_interrupted &i) {
-                        log_debug("G4 thread was interrupted. closing.");
-                        break;
-                    }
-
-                    
-                    //boost::unique_lock<boost::mutex> guard(barrier_is_enqueued_mutex_);
-                    //barrier_is_enqueued_=false;
-                }
-                
-                continue; // nothing to send
-            }
-            
+            // this is either a barrier or a flush marker
+            const bool isBarrier = (lightSourceIdentifier == flushMarkerBarrier);
             
-            // send fully-sized bunches first
-            
-            bool interruptionOccured=false;
-            while (stepStore->size() >= maxBunchSize_)
-            {
-                I3CLSimStepSeriesPtr steps(new I3CLSimStepSeries());
-                stepStore->pop_bunch_to_vector(maxBunchSize_, *steps);
+            if (!isBarrier) {
+                // a newer marker implies all older ones
+                pendingFlushMarker = lightSourceIdentifier;
                 
-                {
-                    boost::this_thread::restore_interruption ri(di);
-                    try {
-                        queueFromGeant4_->Put(std::make_pair(steps, false));
-                    } catch(boost::thread_interrupted &i) {
-                        log_debug("G4 thread was interrupted. shutting down Geant4!");
-                        
-                        interruptionOccured = true;
-                        break;
-                    }
-                }
-                
-                //G4cout << " -> flushed " << maxBunchSize_ << " steps, " << stepStore->size() << " steps left" << G4endl;
-            }            
-            
-            if (interruptionOccured) break;
-            
-            
-            // flush the rest (size < full bunch size)
-            
-            I3CLSimStepSeriesPtr steps(new I3CLSimStepSeries());
-            const std::size_t numStepsWithDummyFill = bunchSizeGranularity_>1?(((stepStore->size()/bunchSizeGranularity_)+1)*bunchSizeGranularity_):stepStore->size();
-
-            //G4cout << " -> " << stepStore->size() << " steps left, padding to " << numStepsWithDummyFill << G4endl;
-            
-            stepStore->pop_bunch_to_vector(numStepsWithDummyFill, *steps, NoOpStepTemplate);
-            
-            if (!stepStore->empty())
-                log_fatal("Internal logic error. step store should be empty.");
+                // Do not send a small bunch if there is more work waiting.
+                // The steps are kept and the marker is reported with the next flush.
+                if ((!stepStore->empty()) &&
+                    (stepStore->size() < maxBunchSize_/2) &&
+                    (!queueToGeant4_->empty()))
+                    continue;
+            }
             
+            if (!FlushStepStore(*stepStore, *queueFromGeant4_,
+                                maxBunchSize_, bunchSizeGranularity_,
+                                NoOpStepTemplate,
+                                isBarrier?flushMarkerBarrier:pendingFlushMarker,
+                                di))
             {
-                boost::this_thread::restore_interruption ri(di);
-                try {
-                    queueFromGeant4_->Put(std::make_pair(steps, true /* this is the LAST reply before the barrier is reached! */));
-                } catch(boost::thread_interrupted &i) {
-                    log_debug("G4 thread was interrupted. closing.");
-                    break;
-                }
+                log_debug("G4 thread was interrupted. closing.");
+                break;
             }
+            pendingFlushMarker=0; // a barrier implies all pending markers
             
-            //G4cout << " -> flush complete." << G4endl;
-
             // nothing to send to Geant4, so start from the beginning
             continue;
         }
@@ -701,7 +749,7 @@ void I3CLSimLightSourceToStepConverterGeant4::Geant4Thread_impl(boost::this_thre
                         try {
                             // this blocks if the queue from Geant4 to
                             // OpenCL is full.
-                            queueFromGeant4_->Put(std::make_pair(steps, false));
+                            queueFromGeant4_->Put(std::make_pair(steps, static_cast<uint32_t>(0)));
                         } catch(boost::thread_interrupted &i) {
                             log_debug("G4 thread was interrupted. shutting down Geant4!");
                             interruptionOccured = true;
@@ -782,6 +830,22 @@ void I3CLSimLightSourceToStepConverterGeant4::SetRandomService(I3RandomServicePt
     randomSeed_ = randomService_->Integer(900000000);
 }
 
+void I3CLSimLightSourceToStepConverterGeant4::SetNumWorkerProcesses(uint32_t num)
+{
+    if (initialized_)
+        throw I3CLSimLightSourceToStepConverter_exception("I3CLSimLightSourceToStepConverterGeant4 already initialized!");
+
+    if (!workerSockets_.empty())
+        throw I3CLSimLightSourceToStepConverter_exception("The Geant4 worker processes have already been forked!");
+
+    numWorkerProcesses_=num;
+}
+
+uint32_t I3CLSimLightSourceToStepConverterGeant4::GetNumWorkerProcesses() const
+{
+    return numWorkerProcesses_;
+}
+
 void I3CLSimLightSourceToStepConverterGeant4::SetWlenBias(I3CLSimFunctionConstPtr wlenBias)
 {
     LogGeant4Messages();
@@ -815,6 +879,28 @@ void I3CLSimLightSourceToStepConverterGeant4::EnqueueLightSource(const I3CLSimLi
             throw I3CLSimLightSourceToStepConverter_exception("A barrier is enqueued! You must receive all steps before enqueuing a new particle.");
     }
     
+    if (numWorkerProcesses_>0)
+    {
+        if (lightSource.GetType() == I3CLSimLightSource::Unknown)
+        {
+            log_warn("Ignoring a light source with type \"Unknown\".");
+            return;
+        }
+
+        boost::unique_lock<boost::mutex> guard(workerSend_mutex_);
+
+        // round-robin
+        const std::size_t workerIndex = nextWorker_;
+        nextWorker_ = (nextWorker_+1)%workerSockets_.size();
+
+        try {
+            I3CLSimHelper::Remote::SendLightSource(workerSockets_[workerIndex], identifier, lightSource);
+        } catch (std::runtime_error &e) {
+            throw I3CLSimLightSourceToStepConverter_exception(std::string("Could not send a light source to a Geant4 worker process: ") + e.what());
+        }
+        return;
+    }
+
     I3CLSimLightSourceConstPtr lightSourceCopy(new I3CLSimLightSource(lightSource));
     queueToGeant4_->Put(std::make_pair(identifier, lightSourceCopy));
     
@@ -835,8 +921,38 @@ void I3CLSimLightSourceToStepConverterGeant4::EnqueueBarrier()
         
         barrier_is_enqueued_=true;
 
-        // we use a NULL pointer as the barrier
-        queueToGeant4_->Put(std::make_pair(0, I3CLSimLightSourceConstPtr()));
+        if (numWorkerProcesses_>0) {
+            SendMarkerToWorkers(flushMarkerBarrier);
+        } else {
+            // we use a NULL pointer as the barrier
+            queueToGeant4_->Put(std::make_pair(flushMarkerBarrier, I3CLSimLightSourceConstPtr()));
+        }
+    }
+    
+    LogGeant4Messages();
+}
+
+void I3CLSimLightSourceToStepConverterGeant4::EnqueueFlushMarker(uint32_t marker)
+{
+    LogGeant4Messages();
+
+    if (!initialized_)
+        throw I3CLSimLightSourceToStepConverter_exception("I3CLSimLightSourceToStepConverterGeant4 is not initialized!");
+
+    if ((marker==0) || (marker==flushMarkerBarrier))
+        throw I3CLSimLightSourceToStepConverter_exception("Invalid flush marker value!");
+
+    {
+        boost::unique_lock<boost::mutex> guard(barrier_is_enqueued_mutex_);
+        if (barrier_is_enqueued_)
+            throw I3CLSimLightSourceToStepConverter_exception("A barrier is enqueued! You must receive all steps before enqueuing a flush marker.");
+    }
+
+    if (numWorkerProcesses_>0) {
+        SendMarkerToWorkers(marker);
+    } else {
+        // a NULL pointer with a non-barrier identifier is a flush marker
+        queueToGeant4_->Put(std::make_pair(marker, I3CLSimLightSourceConstPtr()));
     }
     
     LogGeant4Messages();
@@ -867,6 +983,12 @@ bool I3CLSimLightSourceToStepConverterGeant4::MoreStepsAvailable() const
 }
 
 I3CLSimStepSeriesConstPtr I3CLSimLightSourceToStepConverterGeant4::GetConversionResultWithBarrierInfo(bool &barrierWasReset, double timeout)
+{
+    uint32_t flushMarker;
+    return GetConversionResultWithMarkerInfo(flushMarker, barrierWasReset, timeout);
+}
+
+I3CLSimStepSeriesConstPtr I3CLSimLightSourceToStepConverterGeant4::GetConversionResultWithMarkerInfo(uint32_t &flushMarker, bool &barrierWasReset, double timeout)
 {
     LogGeant4Messages();
 
@@ -874,14 +996,29 @@ I3CLSimStepSeriesConstPtr I3CLSimLightSourceToStepConverterGeant4::GetConversion
         throw I3CLSimLightSourceToStepConverter_exception("I3CLSimLightSourceToStepConverterGeant4 is not initialized!");
 
     barrierWasReset=false;
+    flushMarker=0;
+    
+    {
+        boost::unique_lock<boost::mutex> guard(workerMarkers_mutex_);
+        if (!workerError_.empty())
+            throw I3CLSimLightSourceToStepConverter_exception(workerError_);
+    }
     
     FromGeant4Pair_t ret;
     if (!isnan(timeout))
-        ret = queueFromGeant4_->Get(timeout/I3Units::second, FromGeant4Pair_t(I3CLSimStepSeriesConstPtr(), false));
+        ret = queueFromGeant4_->Get(timeout/I3Units::second, FromGeant4Pair_t(I3CLSimStepSeriesConstPtr(), 0));
     else
         ret = queueFromGeant4_->Get(); // no timeout
     
-    if (ret.second)
+    if (!ret.first)
+    {
+        // a receiver thread wakes us up this way if its worker died
+        boost::unique_lock<boost::mutex> guard(workerMarkers_mutex_);
+        if (!workerError_.empty())
+            throw I3CLSimLightSourceToStepConverter_exception(workerError_);
+    }
+    
+    if (ret.second == flushMarkerBarrier)
     {
         {
             boost::unique_lock<boost::mutex> guard(barrier_is_enqueued_mutex_);
@@ -891,12 +1028,306 @@ I3CLSimStepSeriesConstPtr I3CLSimLightSourceToStepConverterGeant4::GetConversion
             barrier_is_enqueued_=false;
         }
     }
+    else
+    {
+        flushMarker = ret.second;
+    }
     
     LogGeant4Messages();
     
     return ret.first;
 }
 
+void I3CLSimLightSourceToStepConverterGeant4::ForkWorkerProcesses()
+{
+    if (initialized_)
+        throw I3CLSimLightSourceToStepConverter_exception("I3CLSimLightSourceToStepConverterGeant4 already initialized!");
+
+    if (!workerSockets_.empty())
+        throw I3CLSimLightSourceToStepConverter_exception("The Geant4 worker processes have already been forked!");
+
+    if (numWorkerProcesses_==0) return;
+
+    if (!randomService_)
+        throw I3CLSimLightSourceToStepConverter_exception("RandomService not set!");
+
+    log_info("Forking %" PRIu32 " Geant4 worker processes..", numWorkerProcesses_);
+
+    // draw all seeds here, the workers would otherwise
+    // inherit the same state of the random service
+    std::vector<uint32_t> seeds;
+    for (uint32_t i=0;i<numWorkerProcesses_;++i)
+    {
+        seeds.push_back(static_cast<uint32_t>(randomService_->Integer(0xffffffff)));
+    }
+
+    for (uint32_t i=0;i<numWorkerProcesses_;++i)
+    {
+        int parentSocket, workerSocket;
+        I3CLSimHelper::Remote::SocketPair(parentSocket, workerSocket);
+
+        const pid_t pid = fork();
+        if (pid<0)
+            throw I3CLSimLightSourceToStepConverter_exception("Could not fork a Geant4 worker process!");
+
+        if (pid==0)
+        {
+            // this is the worker. Close the sockets of all other workers.
+            BOOST_FOREACH(int socket, workerSockets_)
+            {
+                I3CLSimHelper::Remote::Close(socket);
+            }
+            workerSockets_.clear();
+            workerPIDs_.clear();
+            I3CLSimHelper::Remote::Close(parentSocket);
+
+            WorkerProcessMain(workerSocket, seeds[i]); // never returns
+        }
+
+        I3CLSimHelper::Remote::Close(workerSocket);
+
+        workerPIDs_.push_back(pid);
+        workerSockets_.push_back(parentSocket);
+        workerLastMarkerSequenceNumber_.push_back(0);
+    }
+}
+
+void I3CLSimLightSourceToStepConverterGeant4::StartWorkerProcesses()
+{
+    // the workers wait for their bunch sizes before initializing Geant4
+    try {
+        BOOST_FOREACH(int socket, workerSockets_)
+        {
+            I3CLSimHelper::Remote::SendHello(socket, bunchSizeGranularity_, maxBunchSize_, 0);
+        }
+    } catch (std::runtime_error &e) {
+        throw I3CLSimLightSourceToStepConverter_exception(std::string("Could not configure a Geant4 worker process: ") + e.what());
+    }
+
+    for (std::size_t i=0;i<workerSockets_.size();++i)
+    {
+        workerReceiverThreads_.push_back(boost::shared_ptr<boost::thread>(new boost::thread(boost::bind(&I3CLSimLightSourceToStepConverterGeant4::WorkerReceiverThread, this, i))));
+    }
+
+    log_info("Geant4 worker processes started.");
+}
+
+void I3CLSimLightSourceToStepConverterGeant4::StopWorkerProcesses()
+{
+    if (workerSockets_.empty()) return;
+
+    log_debug("Stopping the Geant4 worker processes..");
+
+    {
+        boost::unique_lock<boost::mutex> guard(workerMarkers_mutex_);
+        workersShuttingDown_=true;
+    }
+
+    // the workers exit once their connection is closed
+    BOOST_FOREACH(int socket, workerSockets_)
+    {
+        I3CLSimHelper::Remote::Shutdown(socket);
+    }
+
+    BOOST_FOREACH(boost::shared_ptr<boost::thread> &thread, workerReceiverThreads_)
+    {
+        if (thread->joinable()) thread->interrupt();
+        if (thread->joinable()) thread->join();
+    }
+    workerReceiverThreads_.clear();
+
+    BOOST_FOREACH(int socket, workerSockets_)
+    {
+        I3CLSimHelper::Remote::Close(socket);
+    }
+    workerSockets_.clear();
+
+    BOOST_FOREACH(pid_t pid, workerPIDs_)
+    {
+        waitpid(pid, NULL, 0);
+    }
+    workerPIDs_.clear();
+
+    log_debug("Geant4 worker processes stopped.");
+}
+
+void I3CLSimLightSourceToStepConverterGeant4::WorkerProcessMain(int socket, uint32_t seed)
+{
+    // Only the forking thread exists in here. Do not log through
+    // whatever logger the parent process uses (it might need locks
+    // held by threads that do not exist anymore).
+#ifndef I3_LOG4CPLUS_LOGGING
+    SetIcetrayLogger(I3LoggerPtr(new I3PrintfLogger()));
+#endif
+
+    try {
+        // the bunch sizes may have been set after forking
+        const I3CLSimHelper::Remote::Hello_t hello = I3CLSimHelper::Remote::ReceiveHello(socket);
+        bunchSizeGranularity_ = hello.workgroupSize;
+        maxBunchSize_ = hello.maxNumWorkitems;
+
+        // run Geant4 in a thread of this process, just like a single instance would
+        numWorkerProcesses_=0;
+        SetRandomService(I3RandomServicePtr(new I3GSLRandomService(seed)));
+        Initialize();
+
+        boost::thread readerThread(boost::bind(&I3CLSimLightSourceToStepConverterGeant4::WorkerProcessReaderThread, this, socket));
+
+        for (;;)
+        {
+            uint32_t flushMarker;
+            bool barrierWasReset;
+            I3CLSimStepSeriesConstPtr steps = GetConversionResultWithMarkerInfo(flushMarker, barrierWasReset);
+            if (barrierWasReset) flushMarker=flushMarkerBarrier;
+
+            if (!steps) {
+                if (flushMarker==0) continue;
+                steps = I3CLSimStepSeriesConstPtr(new I3CLSimStepSeries());
+            }
+
+            // the marker is sent as the identifier of the bunch
+            I3CLSimHelper::Remote::SendSteps(socket, flushMarker, *steps);
+        }
+    } catch (std::exception &e) {
+        // the parent process has probably gone away
+        std::cerr << "Geant4 worker process exiting: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Geant4 worker process died unexpectedly.." << std::endl;
+    }
+
+    // do not run any destructors, they belong to the parent process
+    _exit(0);
+}
+
+void I3CLSimLightSourceToStepConverterGeant4::WorkerProcessReaderThread(int socket)
+{
+    try {
+        for (;;)
+        {
+            I3CLSimHelper::Remote::MessageHeader_t header;
+            if (!I3CLSimHelper::Remote::ReceiveHeader(socket, header)) break; // the parent closed the connection
+
+            if (header.type == I3CLSimHelper::Remote::messageMarker) {
+                if (header.identifier == flushMarkerBarrier) {
+                    EnqueueBarrier();
+                } else {
+                    EnqueueFlushMarker(header.identifier);
+                }
+            } else {
+                I3CLSimLightSourcePtr lightSource = I3CLSimHelper::Remote::ReceiveLightSource(socket, header);
+                EnqueueLightSource(*lightSource, header.identifier);
+            }
+        }
+    } catch (std::exception &e) {
+        std::cerr << "Geant4 worker process exiting: " << e.what() << std::endl;
+    }
+
+    _exit(0);
+}
+
+void I3CLSimLightSourceToStepConverterGeant4::SendMarkerToWorkers(uint32_t marker)
+{
+    boost::unique_lock<boost::mutex> guard(workerSend_mutex_);
+
+    {
+        boost::unique_lock<boost::mutex> markerGuard(workerMarkers_mutex_);
+        workerMarkerSequence_.push_back(std::make_pair(nextMarkerSequenceNumber_, marker));
+        ++nextMarkerSequenceNumber_;
+    }
+
+    try {
+        BOOST_FOREACH(int socket, workerSockets_)
+        {
+            I3CLSimHelper::Remote::SendMarker(socket, marker);
+        }
+    } catch (std::runtime_error &e) {
+        throw I3CLSimLightSourceToStepConverter_exception(std::string("Could not send a flush marker to a Geant4 worker process: ") + e.what());
+    }
+}
+
+void I3CLSimLightSourceToStepConverterGeant4::WorkerReceiverThread(std::size_t workerIndex)
+{
+    const int socket = workerSockets_[workerIndex];
+
+    try {
+        for (;;)
+        {
+            I3CLSimHelper::Remote::MessageHeader_t header;
+            if (!I3CLSimHelper::Remote::ReceiveHeader(socket, header)) {
+                throw std::runtime_error("connection closed");
+            }
+
+            I3CLSimStepSeriesPtr steps = I3CLSimHelper::Remote::ReceiveSteps(socket, header);
+
+            // Bunches of all workers go through here one at a time, so by
+            // the time a marker is reported, the steps of all light sources
+            // before it are on the queue. This is a separate mutex from
+            // workerMarkers_mutex_, which must not be held while Put()
+            // blocks on a full queue (StopWorkerProcesses() needs it).
+            boost::unique_lock<boost::mutex> queueGuard(workerQueue_mutex_);
+
+            uint32_t completedMarker=0;
+            if (header.identifier != 0)
+            {
+                boost::unique_lock<boost::mutex> guard(workerMarkers_mutex_);
+
+                // workers report markers in order (possibly skipping some,
+                // a newer marker implies all older ones)
+                uint64_t &lastSequenceNumber = workerLastMarkerSequenceNumber_[workerIndex];
+
+                bool found=false;
+                for (std::deque<std::pair<uint64_t, uint32_t> >::const_iterator it=workerMarkerSequence_.begin();
+                     it!=workerMarkerSequence_.end(); ++it)
+                {
+                    if ((it->first > lastSequenceNumber) && (it->second == header.identifier)) {
+                        lastSequenceNumber = it->first;
+                        found=true;
+                        break;
+                    }
+                }
+                if (!found)
+                    log_error("Internal error: Geant4 worker process %zu reported an unknown flush marker %" PRIu32, workerIndex, header.identifier);
+
+                // the newest marker all workers are done with
+                const uint64_t completedSequenceNumber = *std::min_element(workerLastMarkerSequenceNumber_.begin(), workerLastMarkerSequenceNumber_.end());
+
+                while ((!workerMarkerSequence_.empty()) && (workerMarkerSequence_.front().first <= completedSequenceNumber))
+                {
+                    if ((workerMarkerSequence_.front().first == completedSequenceNumber) &&
+                        (completedSequenceNumber > lastReportedMarkerSequenceNumber_))
+                        completedMarker = workerMarkerSequence_.front().second;
+                    workerMarkerSequence_.pop_front();
+                }
+                lastReportedMarkerSequenceNumber_ = std::max(lastReportedMarkerSequenceNumber_, completedSequenceNumber);
+            }
+
+            if ((steps->empty()) && (completedMarker==0)) continue;
+
+            // this blocks if the queue is full
+            queueFromGeant4_->Put(std::make_pair(I3CLSimStepSeriesConstPtr(steps), completedMarker));
+        }
+    } catch (boost::thread_interrupted &i) {
+        log_debug("Geant4 worker receiver thread was interrupted. closing.");
+    } catch (std::exception &e) {
+        // this includes archive exceptions from corrupt payloads
+        {
+            boost::unique_lock<boost::mutex> guard(workerMarkers_mutex_);
+            if (workersShuttingDown_) return;
+            if (workerError_.empty())
+                workerError_ = "Lost the connection to Geant4 worker process " + boost::lexical_cast<std::string>(workerIndex) + ": " + e.what();
+        }
+
+        log_error("Lost the connection to Geant4 worker process %zu: %s", workerIndex, e.what());
+
+        // wake up GetConversionResult(), it throws once it sees the error
+        try {
+            queueFromGeant4_->Put(std::make_pair(I3CLSimStepSeriesConstPtr(), static_cast<uint32_t>(0)));
+        } catch (boost::thread_interrupted &i) {
+            log_debug("Geant4 worker receiver thread was interrupted. closing.");
+        }
+    }
+}
+
 void I3CLSimLightSourceToStepConverterGeant4::LogGeant4Messages(bool allAsWarn) const
 {
     if (!queueFromGeant4Messages_) return;
@@ -229,7 +229,7 @@ TrkCerenkov::PostStepDoIt(const G4Track& aTrack, const G4Step& aStep)
         {
             boost::this_thread::restore_interruption ri(eventInformation->threadDisabledInterruptionState);
             try {
-                eventInformation->queueFromGeant4->Put(std::make_pair(steps, false));
+                eventInformation->queueFromGeant4->Put(std::make_pair(steps, static_cast<uint32_t>(0)));
             } catch(boost::thread_interrupted &i) {
                 G4cout << "G4 thread was interrupted. shutting down Geant4!" << G4endl;
                 
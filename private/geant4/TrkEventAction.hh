@@ -33,7 +33,7 @@
 
 #include "clsim/I3CLSimStepStore.h"
 #include "clsim/I3CLSimStep.h"
-#include "clsim/I3CLSimQueue.h"
+#include "clsim/I3CLSimLockFreeQueue.h"
 #include "clsim/I3CLSimLightSourceToStepConverterGeant4.h"
 
 #include "clsim/I3CLSimLightSource.h"
@@ -53,7 +53,7 @@ public:
                    I3CLSimStepStorePtr stepStore,
                    shared_ptr<std::deque<boost::tuple<I3CLSimLightSourceConstPtr, uint32_t, const I3CLSimLightSourceParameterization> > > sendToParameterizationQueue,
                    const I3CLSimLightSourceParameterizationSeries &parameterizationAvailable,
-                   boost::shared_ptr<I3CLSimQueue<I3CLSimLightSourceToStepConverterGeant4::FromGeant4Pair_t> > queueFromGeant4,
+                   boost::shared_ptr<I3CLSimLockFreeQueue<I3CLSimLightSourceToStepConverterGeant4::FromGeant4Pair_t> > queueFromGeant4,
                    boost::this_thread::disable_interruption &threadDisabledInterruptionState,
                    double maxRefractiveIndex);
     virtual ~TrkEventAction();
@@ -74,7 +74,7 @@ private:
     
     I3CLSimLightSourceParameterizationSeries parameterizationAvailable_;
     
-    boost::shared_ptr<I3CLSimQueue<I3CLSimLightSourceToStepConverterGeant4::FromGeant4Pair_t> > queueFromGeant4_;
+    boost::shared_ptr<I3CLSimLockFreeQueue<I3CLSimLightSourceToStepConverterGeant4::FromGeant4Pair_t> > queueFromGeant4_;
     boost::this_thread::disable_interruption &threadDisabledInterruptionState_;
     
     double maxRefractiveIndex_;
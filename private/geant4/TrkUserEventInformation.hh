@@ -32,7 +32,7 @@
 
 #include "clsim/I3CLSimStepStore.h"
 #include "clsim/I3CLSimStep.h"
-#include "clsim/I3CLSimQueue.h"
+#include "clsim/I3CLSimLockFreeQueue.h"
 #include "clsim/I3CLSimLightSourceToStepConverterGeant4.h"
 
 #include "clsim/I3CLSimLightSource.h"
@@ -56,7 +56,7 @@ public:
                             I3CLSimStepStorePtr stepStore_,
                             shared_ptr<std::deque<boost::tuple<I3CLSimLightSourceConstPtr, uint32_t, const I3CLSimLightSourceParameterization> > > sendToParameterizationQueue_,
                             const I3CLSimLightSourceParameterizationSeries &parameterizationAvailable_,
-                            boost::shared_ptr<I3CLSimQueue<I3CLSimLightSourceToStepConverterGeant4::FromGeant4Pair_t> > queueFromGeant4_,
+                            boost::shared_ptr<I3CLSimLockFreeQueue<I3CLSimLightSourceToStepConverterGeant4::FromGeant4Pair_t> > queueFromGeant4_,
                             boost::this_thread::disable_interruption &threadDisabledInterruptionState_,
                             uint32_t currentExternalParticleID_,
                             double maxRefractiveIndex_);
@@ -71,7 +71,7 @@ public:
 
     const I3CLSimLightSourceParameterizationSeries &parameterizationAvailable;
     
-    boost::shared_ptr<I3CLSimQueue<I3CLSimLightSourceToStepConverterGeant4::FromGeant4Pair_t> > queueFromGeant4;
+    boost::shared_ptr<I3CLSimLockFreeQueue<I3CLSimLightSourceToStepConverterGeant4::FromGeant4Pair_t> > queueFromGeant4;
     boost::this_thread::disable_interruption &threadDisabledInterruptionState;
     
     uint32_t currentExternalParticleID;
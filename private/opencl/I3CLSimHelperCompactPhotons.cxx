@@ -0,0 +1,126 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimHelperCompactPhotons.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#include "opencl/I3CLSimHelperCompactPhotons.h"
+
+#include <cmath>
+
+#include "icetray/I3Logging.h"
+#include "icetray/I3Units.h"
+
+#include "opencl/ieeehalfprecision.h"
+
+namespace I3CLSimHelper
+{
+    void DecodeCompactPhotons(const CompactPhoton_t *input,
+                              std::size_t numPhotons,
+                              const std::vector<std::vector<float> > &domIndexToDomPosBuffer_perStringIndex,
+                              I3CLSimPhoton *output)
+    {
+        for (std::size_t i=0;i<numPhotons;++i)
+        {
+            const CompactPhoton_t &compact = input[i];
+            I3CLSimPhoton &photon = output[i];
+
+            // all 16bit values from relPos[0] to distInAbsLens are halfs
+            float values[8];
+            halfp2singles(values, compact.relPos, 8);
+
+            const std::size_t stringIndex = static_cast<std::size_t>(compact.stringID);
+            const std::size_t domIndex = static_cast<std::size_t>(compact.omID);
+            if (stringIndex >= domIndexToDomPosBuffer_perStringIndex.size())
+                log_fatal("Internal error: string index %zu is out of range.", stringIndex);
+            const std::vector<float> &domPosOnString = domIndexToDomPosBuffer_perStringIndex[stringIndex];
+            if (domIndex*3 >= domPosOnString.size())
+                log_fatal("Internal error: DOM index %zu on string index %zu is out of range.", domIndex, stringIndex);
+
+            photon.SetPosX(domPosOnString[domIndex*3+0] + values[0]);
+            photon.SetPosY(domPosOnString[domIndex*3+1] + values[1]);
+            photon.SetPosZ(domPosOnString[domIndex*3+2] + values[2]);
+            photon.SetTime(compact.time);
+            photon.SetDirTheta(values[3]);
+            photon.SetDirPhi(values[4]);
+            photon.SetWavelength(values[5]*I3Units::nanometer);
+            photon.SetCherenkovDist(compact.cherenkovDist);
+            photon.SetNumScatters(compact.numScatters);
+            photon.SetWeight(compact.weight);
+            photon.SetID(compact.identifier);
+            photon.SetStringID(compact.stringID);
+            photon.SetOMID(compact.omID);
+            photon.SetStartPosX(NAN);
+            photon.SetStartPosY(NAN);
+            photon.SetStartPosZ(NAN);
+            photon.SetStartTime(NAN);
+            photon.SetStartDirTheta(NAN);
+            photon.SetStartDirPhi(NAN);
+            photon.SetGroupVelocity(values[6]);
+            photon.SetDistInAbsLens(values[7]);
+        }
+    }
+    
+    void DecodeHitRecords(const HitRecord_t *input,
+                          std::size_t numHits,
+                          const std::vector<std::vector<float> > &domIndexToDomPosBuffer_perStringIndex,
+                          I3CLSimPhoton *output)
+    {
+        for (std::size_t i=0;i<numHits;++i)
+        {
+            const HitRecord_t &hit = input[i];
+            I3CLSimPhoton &photon = output[i];
+
+            const std::size_t stringIndex = static_cast<std::size_t>(hit.stringID);
+            const std::size_t domIndex = static_cast<std::size_t>(hit.omID);
+            if (stringIndex >= domIndexToDomPosBuffer_perStringIndex.size())
+                log_fatal("Internal error: string index %zu is out of range.", stringIndex);
+            const std::vector<float> &domPosOnString = domIndexToDomPosBuffer_perStringIndex[stringIndex];
+            if (domIndex*3 >= domPosOnString.size())
+                log_fatal("Internal error: DOM index %zu on string index %zu is out of range.", domIndex, stringIndex);
+
+            photon.SetPosX(domPosOnString[domIndex*3+0]);
+            photon.SetPosY(domPosOnString[domIndex*3+1]);
+            photon.SetPosZ(domPosOnString[domIndex*3+2]);
+            photon.SetTime(hit.time);
+            photon.SetDirTheta(NAN);
+            photon.SetDirPhi(NAN);
+            photon.SetWavelength(NAN);
+            photon.SetCherenkovDist(NAN);
+            photon.SetNumScatters(0);
+            photon.SetWeight(static_cast<float>(hit.numPE));
+            photon.SetID(hit.identifier);
+            photon.SetStringID(hit.stringID);
+            photon.SetOMID(hit.omID);
+            photon.SetStartPosX(NAN);
+            photon.SetStartPosY(NAN);
+            photon.SetStartPosZ(NAN);
+            photon.SetStartTime(NAN);
+            photon.SetStartDirTheta(NAN);
+            photon.SetStartDirPhi(NAN);
+            photon.SetGroupVelocity(NAN);
+            photon.SetDistInAbsLens(NAN);
+        }
+    }
+    
+};
@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimHelperCompactPhotons.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMHELPERCOMPACTPHOTONS_H_INCLUDED
+#define I3CLSIMHELPERCOMPACTPHOTONS_H_INCLUDED
+
+#include <vector>
+
+#include "clsim/I3CLSimPhoton.h"
+
+namespace I3CLSimHelper
+{
+    /**
+     * The photon record written by the propagation kernel
+     * if it is compiled with COMPACT_PHOTON_OUTPUT. This has to
+     * match "struct I3CLSimPhoton" in propagation_kernel.h.cl.
+     * The entries commented with "half" are IEEE half precision
+     * floats.
+     */
+    struct CompactPhoton_t
+    {
+        cl_float time;
+        cl_float weight;
+        cl_uint identifier;
+        cl_float cherenkovDist;
+        cl_short stringID; // string index, not the ID
+        cl_ushort omID;    // DOM index, not the ID
+        cl_ushort relPos[3]; // half: x,y,z relative to the DOM
+        cl_ushort dir[2]; // half: theta,phi
+        cl_ushort wavelength; // half: in nm
+        cl_ushort groupVelocity; // half
+        cl_ushort distInAbsLens; // half
+        cl_ushort numScatters; // saturates at 0xFFFF
+        cl_ushort dummy;
+    } __attribute__ ((packed));
+
+    /**
+     * Expands compact photon records to I3CLSimPhotons.
+     * "domIndexToDomPosBuffer_perStringIndex" is the DOM position
+     * table filled by GenerateGeometrySource() for the same geometry.
+     * The string and DOM indices are copied as they are, i.e.
+     * they still have to be replaced by IDs afterwards.
+     * The compact record does not have the start position, start time
+     * and start direction, these are set to NaN.
+     */
+    void DecodeCompactPhotons(const CompactPhoton_t *input,
+                              std::size_t numPhotons,
+                              const std::vector<std::vector<float> > &domIndexToDomPosBuffer_perStringIndex,
+                              I3CLSimPhoton *output);
+
+    /**
+     * The hit record written by the propagation kernel if it is
+     * compiled with HIT_CONVERSION. This has to match
+     * "struct I3CLSimPhoton" in propagation_kernel.h.cl.
+     */
+    struct HitRecord_t
+    {
+        cl_float time;
+        cl_uint identifier;
+        cl_short stringID; // string index, not the ID
+        cl_ushort omID;    // DOM index, not the ID
+        cl_uint numPE;
+    } __attribute__ ((packed));
+
+    /**
+     * Expands hit records to I3CLSimPhotons with the number of
+     * photo-electrons as their weight and the DOM center as their
+     * position. As for DecodeCompactPhotons(), the string and
+     * DOM indices still have to be replaced by IDs afterwards.
+     * There is no direction, wavelength or any other photon
+     * information, these are set to NaN (or zero).
+     */
+    void DecodeHitRecords(const HitRecord_t *input,
+                          std::size_t numHits,
+                          const std::vector<std::vector<float> > &domIndexToDomPosBuffer_perStringIndex,
+                          I3CLSimPhoton *output);
+
+};
+
+#endif //I3CLSIMHELPERCOMPACTPHOTONS_H_INCLUDED
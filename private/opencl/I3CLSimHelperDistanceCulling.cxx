@@ -0,0 +1,283 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimHelperDistanceCulling.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#include <inttypes.h>
+
+#include "opencl/I3CLSimHelperDistanceCulling.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+namespace I3CLSimHelper
+{
+    namespace {
+        // never use more cells than this (the field
+        // needs 4 bytes for each cell)
+        const double maxNumCells = 64.*64.*64.;
+        
+        // there is no point in making the cells a lot smaller than the DOMs
+        const double minCellWidth = 5.*I3Units::m;
+        
+        // number of samples used to find the largest absorption length
+        const unsigned int numWavelengthSamples = 1000;
+        const unsigned int numCosThetaSamples = 100;
+        const unsigned int numPhiSamples = 200;
+    }
+    
+    void GenerateDOMDistanceField(const I3CLSimSimpleGeometry &geometry,
+                                  std::vector<float> &distanceFieldBuffer,
+                                  DistanceFieldParameters_t &fieldParameters)
+    {
+        distanceFieldBuffer.clear();
+        
+        const std::size_t numEntries = geometry.size();
+        const double omRadius = geometry.GetOMRadius();
+        
+        if (numEntries==0)
+            throw std::runtime_error("Empty geometry provided.");
+        if (omRadius < 0.)
+            throw std::runtime_error("Negative OM radius.");
+        
+        // the volume covered by all DOM spheres
+        double low[3], high[3];
+        for (unsigned int axis=0;axis<3;++axis)
+        {
+            low[axis]  = std::numeric_limits<double>::infinity();
+            high[axis] = -std::numeric_limits<double>::infinity();
+        }
+        for (std::size_t i=0;i<numEntries;++i)
+        {
+            const double pos[3] = {geometry.GetPosX(i), geometry.GetPosY(i), geometry.GetPosZ(i)};
+            for (unsigned int axis=0;axis<3;++axis)
+            {
+                low[axis]  = std::min(low[axis],  pos[axis]-omRadius);
+                high[axis] = std::max(high[axis], pos[axis]+omRadius);
+            }
+        }
+        
+        // choose a cell size
+        double volume=1.;
+        for (unsigned int axis=0;axis<3;++axis)
+        {
+            volume *= std::max(high[axis]-low[axis], minCellWidth);
+        }
+        double cellWidth = std::max(std::pow(volume/maxNumCells, 1./3.), minCellWidth);
+        
+        // leave some room for rounding to single precision, the
+        // kernel sees the field boundaries as floats
+        for (unsigned int axis=0;axis<3;++axis)
+        {
+            low[axis]  -= 1e-3*cellWidth;
+            high[axis] += 1e-3*cellWidth;
+        }
+        
+        uint32_t numCells[3];
+        for (;;)
+        {
+            double totalCells=1.;
+            for (unsigned int axis=0;axis<3;++axis)
+            {
+                const double num = std::max(std::ceil((high[axis]-low[axis])/cellWidth), 1.);
+                numCells[axis] = static_cast<uint32_t>(std::min(num, maxNumCells));
+                totalCells *= num;
+            }
+            if (totalCells <= maxNumCells) break;
+            cellWidth *= 1.01*std::pow(totalCells/maxNumCells, 1./3.);
+        }
+        const std::size_t totalNumCells = static_cast<std::size_t>(numCells[0])*numCells[1]*numCells[2];
+        
+        // the kernel only sees single precision values
+        cellWidth = static_cast<float>(cellWidth);
+        for (unsigned int axis=0;axis<3;++axis) low[axis] = static_cast<float>(low[axis]);
+        
+        // sort the DOMs into the cells (by their center)
+        std::vector<uint32_t> cellOfDom(numEntries);
+        std::vector<uint32_t> cellStart(totalNumCells+1, 0);
+        for (std::size_t i=0;i<numEntries;++i)
+        {
+            const double pos[3] = {geometry.GetPosX(i), geometry.GetPosY(i), geometry.GetPosZ(i)};
+            uint32_t index[3];
+            for (unsigned int axis=0;axis<3;++axis)
+            {
+                const double cell = std::floor((pos[axis]-low[axis])/cellWidth);
+                index[axis] = static_cast<uint32_t>(std::min(std::max(cell, 0.), static_cast<double>(numCells[axis]-1)));
+            }
+            cellOfDom[i] = (index[2]*numCells[1]+index[1])*numCells[0]+index[0];
+            ++cellStart[cellOfDom[i]+1];
+        }
+        for (std::size_t i=0;i<totalNumCells;++i)
+        {
+            cellStart[i+1] += cellStart[i];
+        }
+        std::vector<float> domPosInCell(3*numEntries);
+        {
+            std::vector<uint32_t> nextEntryInCell(cellStart.begin(), cellStart.end()-1);
+            for (std::size_t i=0;i<numEntries;++i)
+            {
+                const uint32_t entry = nextEntryInCell[cellOfDom[i]]++;
+                domPosInCell[3*entry+0] = static_cast<float>(geometry.GetPosX(i));
+                domPosInCell[3*entry+1] = static_cast<float>(geometry.GetPosY(i));
+                domPosInCell[3*entry+2] = static_cast<float>(geometry.GetPosZ(i));
+            }
+        }
+        
+        // Find the closest DOM center for each cell center by searching
+        // shells of cells (all cells with a Chebyshev distance of "r"
+        // cells) around it. A DOM in shell r is at least (r-1/2) cells
+        // away from the center, so we can stop as soon as we found one
+        // that is closer than that.
+        const double halfDiagonal = std::sqrt(3.)*cellWidth/2.;
+        const int maxShell = static_cast<int>(std::max(numCells[0], std::max(numCells[1], numCells[2])));
+        
+        distanceFieldBuffer.resize(totalNumCells);
+        for (uint32_t z=0;z<numCells[2];++z)
+        for (uint32_t y=0;y<numCells[1];++y)
+        for (uint32_t x=0;x<numCells[0];++x)
+        {
+            const double center[3] = {low[0]+(static_cast<double>(x)+0.5)*cellWidth,
+                                      low[1]+(static_cast<double>(y)+0.5)*cellWidth,
+                                      low[2]+(static_cast<double>(z)+0.5)*cellWidth};
+            double closestDistSq = std::numeric_limits<double>::infinity();
+            
+            for (int r=0;r<=maxShell;++r)
+            {
+                const double shellDist = (static_cast<double>(r)-0.5)*cellWidth;
+                if ((shellDist > 0.) && (closestDistSq <= shellDist*shellDist)) break;
+                
+                for (int dz=-r;dz<=r;++dz)
+                {
+                    const int cz = static_cast<int>(z)+dz;
+                    if ((cz < 0) || (cz >= static_cast<int>(numCells[2]))) continue;
+                    
+                    for (int dy=-r;dy<=r;++dy)
+                    {
+                        const int cy = static_cast<int>(y)+dy;
+                        if ((cy < 0) || (cy >= static_cast<int>(numCells[1]))) continue;
+                        
+                        // only the two outermost cells of each row are
+                        // on the shell, unless the whole row is
+                        const bool fullRow = (std::abs(dz)==r) || (std::abs(dy)==r);
+                        const int dxStep = (fullRow || (r==0))?1:2*r;
+                        
+                        for (int dx=-r;dx<=r;dx+=dxStep)
+                        {
+                            const int cx = static_cast<int>(x)+dx;
+                            if ((cx < 0) || (cx >= static_cast<int>(numCells[0]))) continue;
+                            
+                            const std::size_t cell = (static_cast<std::size_t>(cz)*numCells[1]+cy)*numCells[0]+cx;
+                            for (uint32_t entry=cellStart[cell];entry<cellStart[cell+1];++entry)
+                            {
+                                const double dX = domPosInCell[3*entry+0]-center[0];
+                                const double dY = domPosInCell[3*entry+1]-center[1];
+                                const double dZ = domPosInCell[3*entry+2]-center[2];
+                                closestDistSq = std::min(closestDistSq, dX*dX+dY*dY+dZ*dZ);
+                            }
+                        }
+                    }
+                }
+            }
+            
+            // any point in the cell is at most halfDiagonal away from its center.
+            // (subtract a bit more to be safe from rounding in the kernel)
+            const double lowerBound = std::sqrt(closestDistSq) - halfDiagonal - omRadius - 1e-3*cellWidth;
+            distanceFieldBuffer[(static_cast<std::size_t>(z)*numCells[1]+y)*numCells[0]+x] =
+            static_cast<float>(std::max(lowerBound, 0.));
+        }
+        
+        log_info("DOM distance field: %" PRIu32 "x%" PRIu32 "x%" PRIu32 " cells of %fm",
+                 numCells[0], numCells[1], numCells[2], cellWidth/I3Units::m);
+        
+        for (unsigned int axis=0;axis<3;++axis)
+        {
+            fieldParameters.start[axis] = static_cast<float>(low[axis]);
+            fieldParameters.numCells[axis] = numCells[axis];
+        }
+        fieldParameters.cellWidth = static_cast<float>(cellWidth);
+    }
+    
+    std::vector<double> GetMaxDistancePerAbsorptionLengthPerLayer(const I3CLSimMediumProperties &mediumProperties)
+    {
+        const double minWlen = mediumProperties.GetMinWavelength();
+        const double maxWlen = mediumProperties.GetMaxWavelength();
+        if ((!std::isfinite(minWlen)) || (!std::isfinite(maxWlen)) || (minWlen > maxWlen))
+            throw std::runtime_error("The medium properties do not have a valid wavelength range.");
+        
+        I3CLSimScalarFieldConstPtr dirAbsLenCorr = mediumProperties.GetDirectionalAbsorptionLengthCorrection();
+        if (!dirAbsLenCorr)
+            throw std::runtime_error("Directional absorption length correction function is (null).");
+        if (!dirAbsLenCorr->HasNativeImplementation())
+            throw std::runtime_error("Directional absorption length correction function does not have a native implementation.");
+        
+        double maxCorrection = 0.;
+        for (unsigned int i=0;i<=numCosThetaSamples;++i)
+        {
+            const double cosTheta = -1. + 2.*static_cast<double>(i)/static_cast<double>(numCosThetaSamples);
+            const double sinTheta = std::sqrt(std::max(1.-cosTheta*cosTheta, 0.));
+            
+            for (unsigned int j=0;j<numPhiSamples;++j)
+            {
+                const double phi = 2.*M_PI*static_cast<double>(j)/static_cast<double>(numPhiSamples);
+                maxCorrection = std::max(maxCorrection,
+                                         dirAbsLenCorr->GetValue(sinTheta*std::cos(phi), sinTheta*std::sin(phi), cosTheta));
+            }
+        }
+        
+        std::vector<double> maxDistances(mediumProperties.GetLayersNum(), 0.);
+        for (uint32_t layer=0;layer<mediumProperties.GetLayersNum();++layer)
+        {
+            I3CLSimFunctionConstPtr absLen = mediumProperties.GetAbsorptionLength(layer);
+            if (!absLen)
+                throw std::runtime_error("Absorption length function is (null).");
+            if (!absLen->HasNativeImplementation())
+                throw std::runtime_error("Absorption length function does not have a native implementation.");
+            
+            double maxAbsLen = 0.;
+            for (unsigned int i=0;i<=numWavelengthSamples;++i)
+            {
+                const double wlen = minWlen + (maxWlen-minWlen)*static_cast<double>(i)/static_cast<double>(numWavelengthSamples);
+                maxAbsLen = std::max(maxAbsLen, absLen->GetValue(wlen));
+            }
+            
+            maxDistances[layer] = maxAbsLen*maxCorrection;
+            if ((!std::isfinite(maxDistances[layer])) || (maxDistances[layer] <= 0.))
+                throw std::runtime_error("Could not find a valid maximum absorption length.");
+        }
+        
+        return maxDistances;
+    }
+    
+    double GetMaxDistancePerAbsorptionLength(const I3CLSimMediumProperties &mediumProperties)
+    {
+        const std::vector<double> maxDistances = GetMaxDistancePerAbsorptionLengthPerLayer(mediumProperties);
+        if (maxDistances.empty())
+            throw std::runtime_error("The medium properties do not have any layers.");
+        
+        return *std::max_element(maxDistances.begin(), maxDistances.end());
+    }
+    
+};
@@ -0,0 +1,81 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimHelperDistanceCulling.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMHELPERDISTANCECULLING_H_INCLUDED
+#define I3CLSIMHELPERDISTANCECULLING_H_INCLUDED
+
+#include <vector>
+#include <stdint.h>
+
+#include "clsim/I3CLSimSimpleGeometry.h"
+#include "clsim/I3CLSimMediumProperties.h"
+
+namespace I3CLSimHelper
+{
+    /**
+     * The dimensions of a DOM distance field. These are passed
+     * to the kernel as arguments (and not compiled into it).
+     */
+    struct DistanceFieldParameters_t
+    {
+        float start[3];         // lower corner of the field
+        float cellWidth;
+        uint32_t numCells[3];
+    };
+
+    /**
+     * Builds a coarse 3D field of cubic cells covering all DOMs of
+     * a geometry. Each cell holds a lower bound on the distance from
+     * any point inside the cell to the surface of the closest DOM.
+     * For a point outside of the field, sqrt(d^2+v^2) is still
+     * a lower bound, where d is the distance to the field and v is
+     * the value of the closest cell.
+     *
+     * The cells are stored in distanceFieldBuffer with x running
+     * fastest, the dimensions are returned in fieldParameters.
+     */
+    void GenerateDOMDistanceField(const I3CLSimSimpleGeometry &geometry,
+                                  std::vector<float> &distanceFieldBuffer,
+                                  DistanceFieldParameters_t &fieldParameters);
+
+    /**
+     * Returns an upper limit on the distance a photon can travel
+     * per absorption length, i.e. the largest absorption length
+     * in any layer and at any wavelength times the largest directional
+     * absorption length correction. The functions are sampled on
+     * the host, so they need a native implementation.
+     */
+    double GetMaxDistancePerAbsorptionLength(const I3CLSimMediumProperties &mediumProperties);
+
+    /**
+     * The same as GetMaxDistancePerAbsorptionLength(),
+     * but for each layer of the medium separately.
+     */
+    std::vector<double> GetMaxDistancePerAbsorptionLengthPerLayer(const I3CLSimMediumProperties &mediumProperties);
+
+};
+
+#endif //I3CLSIMHELPERDISTANCECULLING_H_INCLUDED
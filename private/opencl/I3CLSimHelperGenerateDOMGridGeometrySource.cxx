@@ -0,0 +1,264 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimStepToPhotonConverterOpenCL.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#include <inttypes.h>
+
+#include "opencl/I3CLSimHelperGenerateDOMGridGeometrySource.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+namespace I3CLSimHelper
+{
+    namespace {
+        // aim for this many cells per DOM on average
+        const double targetCellsPerDOM = 8.;
+        
+        // never use more cells than this (the cell start buffer
+        // needs 4 bytes for each cell)
+        const double maxNumCells = 16.*1024.*1024.;
+        
+        typedef std::pair<int, std::string> stringKey_t;
+    }
+    
+    std::string GenerateDOMGridGeometrySource(const I3CLSimSimpleGeometry &geometry,
+                                              std::vector<uint32_t> &geoGridCellStartBuffer,
+                                              std::vector<uint32_t> &geoGridCellDomsBuffer,
+                                              std::vector<float> &geoGridDomPosBuffer,
+                                              std::vector<uint32_t> &geoGridDomIndexBuffer,
+                                              DOMGridParameters_t &gridParameters,
+                                              std::vector<int> &stringIndexToStringIDBuffer,
+                                              std::vector<std::vector<unsigned int> > &domIndexToDomIDBuffer_perStringIndex,
+                                              std::vector<std::vector<float> > &domIndexToDomPosBuffer_perStringIndex)
+    {
+        geoGridCellStartBuffer.clear();
+        geoGridCellDomsBuffer.clear();
+        geoGridDomPosBuffer.clear();
+        geoGridDomIndexBuffer.clear();
+        stringIndexToStringIDBuffer.clear();
+        domIndexToDomIDBuffer_perStringIndex.clear();
+        domIndexToDomPosBuffer_perStringIndex.clear();
+
+        const std::size_t numEntries = geometry.size();
+        const double omRadius = geometry.GetOMRadius();
+        
+        if (numEntries==0)
+            throw std::runtime_error("Empty geometry provided.");
+        if (omRadius < 0.)
+            throw std::runtime_error("Negative OM radius.");
+        
+        // assign string indices in the same way as the string
+        // cell code does: a string is identified by its ID and subdetector
+        std::map<stringKey_t, std::size_t> stringIndexForKey;
+        for (std::size_t i=0;i<numEntries;++i)
+        {
+            stringIndexForKey.insert(std::make_pair(stringKey_t(geometry.GetStringID(i), geometry.GetSubdetector(i)), 0));
+        }
+        
+        if (stringIndexForKey.size() >= 0xFFFF)
+            throw std::runtime_error("More than 65534 strings are not supported.");
+        
+        {
+            std::size_t currentIndex=0;
+            for (std::map<stringKey_t, std::size_t>::iterator it=stringIndexForKey.begin();
+                 it!=stringIndexForKey.end(); ++it)
+            {
+                it->second = currentIndex++;
+                stringIndexToStringIDBuffer.push_back(it->first.first);
+            }
+        }
+        domIndexToDomIDBuffer_perStringIndex.resize(stringIndexForKey.size());
+        domIndexToDomPosBuffer_perStringIndex.resize(stringIndexForKey.size());
+        
+        // (string index, DOM index) for each geometry entry
+        std::vector<std::pair<std::size_t, std::size_t> > domIndices(numEntries);
+        for (std::size_t i=0;i<numEntries;++i)
+        {
+            const std::size_t stringIndex = stringIndexForKey[stringKey_t(geometry.GetStringID(i), geometry.GetSubdetector(i))];
+            const std::size_t domIndex = domIndexToDomIDBuffer_perStringIndex[stringIndex].size();
+            if (domIndex >= 0xFFFF)
+                throw std::runtime_error("More than 65534 DOMs per string are not supported.");
+            
+            domIndexToDomIDBuffer_perStringIndex[stringIndex].push_back(geometry.GetDomID(i));
+            domIndices[i] = std::make_pair(stringIndex, domIndex);
+        }
+        
+        // store the DOMs sorted by string and DOM index
+        std::vector<std::size_t> flatIndexOffsetForString(stringIndexForKey.size(), 0);
+        for (std::size_t i=1;i<flatIndexOffsetForString.size();++i)
+        {
+            flatIndexOffsetForString[i] = flatIndexOffsetForString[i-1] + domIndexToDomIDBuffer_perStringIndex[i-1].size();
+        }
+
+        geoGridDomPosBuffer.resize(4*numEntries);
+        geoGridDomIndexBuffer.resize(numEntries);
+        for (std::size_t i=0;i<numEntries;++i)
+        {
+            const std::size_t stringIndex = domIndices[i].first;
+            const std::size_t domIndex = domIndices[i].second;
+            const std::size_t flatIndex = flatIndexOffsetForString[stringIndex]+domIndex;
+            
+            const float pos[3] = {static_cast<float>(geometry.GetPosX(i)),
+                                  static_cast<float>(geometry.GetPosY(i)),
+                                  static_cast<float>(geometry.GetPosZ(i))};
+            
+            geoGridDomPosBuffer[4*flatIndex+0] = pos[0];
+            geoGridDomPosBuffer[4*flatIndex+1] = pos[1];
+            geoGridDomPosBuffer[4*flatIndex+2] = pos[2];
+            geoGridDomPosBuffer[4*flatIndex+3] = 0.f;
+            geoGridDomIndexBuffer[flatIndex] = static_cast<uint32_t>((stringIndex << 16) | domIndex);
+            
+            // the kernel uses exactly these positions
+            std::vector<float> &domPosOnString = domIndexToDomPosBuffer_perStringIndex[stringIndex];
+            domPosOnString.insert(domPosOnString.end(), pos, pos+3);
+        }
+        
+        // the volume covered by all DOM spheres (from here on,
+        // DOMs are identified by their index in the DOM buffers)
+        double low[3], high[3];
+        for (unsigned int axis=0;axis<3;++axis)
+        {
+            low[axis]  = std::numeric_limits<double>::infinity();
+            high[axis] = -std::numeric_limits<double>::infinity();
+        }
+        for (std::size_t i=0;i<numEntries;++i)
+        {
+            for (unsigned int axis=0;axis<3;++axis)
+            {
+                const double value = geoGridDomPosBuffer[4*i+axis];
+                low[axis]  = std::min(low[axis],  value-omRadius);
+                high[axis] = std::max(high[axis], value+omRadius);
+            }
+        }
+
+        // choose a cell size
+        double volume=1.;
+        for (unsigned int axis=0;axis<3;++axis)
+        {
+            volume *= std::max(high[axis]-low[axis], omRadius);
+        }
+        double cellWidth = std::pow(volume/(targetCellsPerDOM*static_cast<double>(numEntries)), 1./3.);
+        cellWidth = std::max(cellWidth, 2.*omRadius);   // a DOM should not overlap with too many cells
+        if (!(cellWidth > 0.)) cellWidth = 1.*I3Units::m; // OM radius is zero and all DOMs are at the same position
+
+        uint32_t numCells[3];
+        for (;;)
+        {
+            double totalCells=1.;
+            for (unsigned int axis=0;axis<3;++axis)
+            {
+                // (leave some room for rounding to single precision)
+                const double num = std::max(std::ceil((high[axis]-low[axis])/cellWidth + 1e-3), 1.);
+                numCells[axis] = static_cast<uint32_t>(std::min(num, maxNumCells));
+                totalCells *= num;
+            }
+            if (totalCells <= maxNumCells) break;
+            cellWidth *= 1.1*std::pow(totalCells/maxNumCells, 1./3.);
+        }
+        const std::size_t totalNumCells = static_cast<std::size_t>(numCells[0])*numCells[1]*numCells[2];
+        
+        // the kernel only sees single precision values
+        cellWidth = static_cast<float>(cellWidth);
+        for (unsigned int axis=0;axis<3;++axis) low[axis] = static_cast<float>(low[axis]);
+        
+        // find the range of cells overlapping with each DOM (with a bit of
+        // margin, the kernel might round cell boundaries differently)
+        const double cellMargin = 1e-4*cellWidth;
+        std::vector<uint32_t> cellRange(6*numEntries);
+        for (std::size_t i=0;i<numEntries;++i)
+        {
+            for (unsigned int axis=0;axis<3;++axis)
+            {
+                const double value = geoGridDomPosBuffer[4*i+axis];
+                const double first = std::floor((value-omRadius-cellMargin-low[axis])/cellWidth);
+                const double last  = std::floor((value+omRadius+cellMargin-low[axis])/cellWidth);
+                cellRange[6*i+2*axis+0] = static_cast<uint32_t>(std::min(std::max(first, 0.), static_cast<double>(numCells[axis]-1)));
+                cellRange[6*i+2*axis+1] = static_cast<uint32_t>(std::min(std::max(last,  0.), static_cast<double>(numCells[axis]-1)));
+            }
+        }
+        
+        // count the entries for each cell first..
+        std::vector<uint32_t> numDomsInCell(totalNumCells, 0);
+        for (std::size_t i=0;i<numEntries;++i)
+        {
+            for (uint32_t z=cellRange[6*i+4];z<=cellRange[6*i+5];++z)
+                for (uint32_t y=cellRange[6*i+2];y<=cellRange[6*i+3];++y)
+                    for (uint32_t x=cellRange[6*i+0];x<=cellRange[6*i+1];++x)
+                        ++numDomsInCell[(static_cast<std::size_t>(z)*numCells[1]+y)*numCells[0]+x];
+        }
+        
+        geoGridCellStartBuffer.resize(totalNumCells+1);
+        geoGridCellStartBuffer[0]=0;
+        for (std::size_t i=0;i<totalNumCells;++i)
+        {
+            geoGridCellStartBuffer[i+1] = geoGridCellStartBuffer[i] + numDomsInCell[i];
+        }
+
+        // ..and fill them
+        geoGridCellDomsBuffer.resize(geoGridCellStartBuffer[totalNumCells]);
+        std::vector<uint32_t> nextEntryInCell(geoGridCellStartBuffer.begin(), geoGridCellStartBuffer.end()-1);
+        for (std::size_t i=0;i<numEntries;++i)
+        {
+            for (uint32_t z=cellRange[6*i+4];z<=cellRange[6*i+5];++z)
+                for (uint32_t y=cellRange[6*i+2];y<=cellRange[6*i+3];++y)
+                    for (uint32_t x=cellRange[6*i+0];x<=cellRange[6*i+1];++x)
+                        geoGridCellDomsBuffer[nextEntryInCell[(static_cast<std::size_t>(z)*numCells[1]+y)*numCells[0]+x]++] = static_cast<uint32_t>(i);
+        }
+        
+        log_info("DOM grid: %" PRIu32 "x%" PRIu32 "x%" PRIu32 " cells of %fm, %zu DOMs in %zu cell entries",
+                 numCells[0], numCells[1], numCells[2], cellWidth/I3Units::m,
+                 numEntries, geoGridCellDomsBuffer.size());
+        
+        for (unsigned int axis=0;axis<3;++axis)
+        {
+            gridParameters.start[axis] = static_cast<float>(low[axis]);
+            gridParameters.numCells[axis] = numCells[axis];
+        }
+        gridParameters.cellWidth = static_cast<float>(cellWidth);
+        gridParameters.numDoms = static_cast<uint32_t>(numEntries);
+        gridParameters.omRadius = static_cast<float>(omRadius);
+        
+        std::ostringstream code;
+        
+        code << "\n";
+        code << "///////////////// BEGIN DOM grid geometry ////////////\n";
+        code << "\n";
+        code << "// auto-generated by I3CLSimHelper::GenerateDOMGridGeometrySource()\n";
+        code << "// (the DOMs, cells and grid dimensions are passed to the kernel as arguments)\n";
+        code << "\n";
+        code << "#define DOM_GRID_COLLISION\n";
+        code << "\n";
+        code << "///////////////// END DOM grid geometry ////////////\n";
+        code << "\n";
+        
+        return code.str();
+    }
+    
+};
@@ -0,0 +1,85 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimHelperGenerateDOMGridGeometrySource.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMHELPERGENERATEDOMGRIDGEOMETRYSOURCE_H_INCLUDED
+#define I3CLSIMHELPERGENERATEDOMGRIDGEOMETRYSOURCE_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "clsim/I3CLSimSimpleGeometry.h"
+
+namespace I3CLSimHelper
+{
+    /**
+     * The dimensions of a DOM grid. These are passed
+     * to the kernel as arguments (and not compiled into it).
+     */
+    struct DOMGridParameters_t
+    {
+        float start[3];         // lower corner of the grid
+        float cellWidth;
+        uint32_t numCells[3];
+        uint32_t numDoms;
+        float omRadius;
+    };
+
+    /**
+     * Sorts all DOMs of a geometry into a uniform 3D grid of cubic cells.
+     * Unlike GenerateGeometrySource(), this makes no assumptions about
+     * the layout of the detector (strings do not need to be vertical and
+     * there can be any number of DOMs close to each other).
+     *
+     * Each DOM is listed in all cells its sphere overlaps with. The
+     * grid is written to buffers that are meant to be uploaded
+     * to the device as kernel arguments:
+     *  - geoGridCellStartBuffer: the DOMs of cell i are entries
+     *    [geoGridCellStartBuffer[i];geoGridCellStartBuffer[i+1]) of
+     *    geoGridCellDomsBuffer (size: number of cells+1)
+     *  - geoGridCellDomsBuffer: indices into the two DOM buffers
+     *  - geoGridDomPosBuffer: (x,y,z,0) for each DOM
+     *  - geoGridDomIndexBuffer: (stringIndex<<16)|domIndex for each DOM
+     *
+     * The grid dimensions are returned in gridParameters. The returned
+     * source does not depend on the geometry at all, so a program
+     * compiled once can be used with any geometry by just uploading
+     * new buffers. The string and DOM index buffers are filled
+     * in the same way as GenerateGeometrySource() does.
+     */
+    std::string GenerateDOMGridGeometrySource(const I3CLSimSimpleGeometry &geometry,
+                                              std::vector<uint32_t> &geoGridCellStartBuffer,
+                                              std::vector<uint32_t> &geoGridCellDomsBuffer,
+                                              std::vector<float> &geoGridDomPosBuffer,
+                                              std::vector<uint32_t> &geoGridDomIndexBuffer,
+                                              DOMGridParameters_t &gridParameters,
+                                              std::vector<int> &stringIndexToStringIDBuffer,
+                                              std::vector<std::vector<unsigned int> > &domIndexToDomIDBuffer_perStringIndex,
+                                              std::vector<std::vector<float> > &domIndexToDomPosBuffer_perStringIndex);
+
+};
+
+#endif //I3CLSIMHELPERGENERATEDOMGRIDGEOMETRYSOURCE_H_INCLUDED
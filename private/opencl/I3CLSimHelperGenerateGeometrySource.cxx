@@ -58,18 +58,21 @@ namespace I3CLSimHelper
                                              const double omRadius,
                                              std::vector<cl_ushort> &geoLayerToOMNumIndexPerStringSetBuffer,
                                              std::vector<int> &stringIndexToStringIDBuffer,
-                                             std::vector<std::vector<unsigned int> > &domIndexToDomIDBuffer_perStringIndex
+                                             std::vector<std::vector<unsigned int> > &domIndexToDomIDBuffer_perStringIndex,
+                                             std::vector<std::vector<float> > &domIndexToDomPosBuffer_perStringIndex
                                              );
     
     // the main converter
     std::string GenerateGeometrySource(const I3CLSimSimpleGeometry &geometry,
                                        std::vector<unsigned short> &geoLayerToOMNumIndexPerStringSetBuffer,
                                        std::vector<int> &stringIndexToStringIDBuffer,
-                                       std::vector<std::vector<unsigned int> > &domIndexToDomIDBuffer_perStringIndex)
+                                       std::vector<std::vector<unsigned int> > &domIndexToDomIDBuffer_perStringIndex,
+                                       std::vector<std::vector<float> > &domIndexToDomPosBuffer_perStringIndex)
     {
         geoLayerToOMNumIndexPerStringSetBuffer.clear();
         stringIndexToStringIDBuffer.clear();
         domIndexToDomIDBuffer_perStringIndex.clear();
+        domIndexToDomPosBuffer_perStringIndex.clear();
         
         std::ostringstream code;
         
@@ -94,7 +97,8 @@ namespace I3CLSimHelper
                                                 geometry.GetOMRadius(),
                                                 geoLayerToOMNumIndexPerStringSetBuffer,
                                                 stringIndexToStringIDBuffer,
-                                                domIndexToDomIDBuffer_perStringIndex
+                                                domIndexToDomIDBuffer_perStringIndex,
+                                                domIndexToDomPosBuffer_perStringIndex
                                                 );
             
             if (!ret)
@@ -495,7 +499,8 @@ namespace I3CLSimHelper
         
     }
     
-    std::string generate_get_dom_position_code(const std::vector<stringStruct> &strings)
+    std::string generate_get_dom_position_code(const std::vector<stringStruct> &strings,
+                                               std::vector<std::vector<float> > &domIndexToDomPosBuffer_perStringIndex)
     {
         std::vector<double> stringMeanPosX(strings.size(), 0.);
         std::vector<double> stringMeanPosY(strings.size(), 0.);
@@ -632,6 +637,33 @@ namespace I3CLSimHelper
         }
 
         const std::string typeString = useShortsInsteadOfFloats?"short":"float";
+
+        // the positions as seen by the kernel (including the rounding
+        // of the template positions) for host-side code that has to undo
+        // DOM-relative positions
+        domIndexToDomPosBuffer_perStringIndex.resize(strings.size());
+        for (std::size_t i=0;i<strings.size();++i)
+        {
+            std::vector<float> &domPosOnString = domIndexToDomPosBuffer_perStringIndex[i];
+            domPosOnString.resize(strings[i].doms.size()*3);
+
+            const std::size_t startIndex = templateIndexIntoFlatList[stringInTemplate[i]];
+            for (std::size_t j=0;j<strings[i].doms.size();++j)
+            {
+                float relX, relY;
+                if (useShortsInsteadOfFloats) {
+                    relX = static_cast<float>(static_cast<short>(templatePositionsX_flat[startIndex+j]/(geoDomPosMaxAbsX_inTemplate/32767.)))*static_cast<float>(geoDomPosMaxAbsX_inTemplate/32767.);
+                    relY = static_cast<float>(static_cast<short>(templatePositionsY_flat[startIndex+j]/(geoDomPosMaxAbsY_inTemplate/32767.)))*static_cast<float>(geoDomPosMaxAbsY_inTemplate/32767.);
+                } else {
+                    relX = static_cast<float>(templatePositionsX_flat[startIndex+j]);
+                    relY = static_cast<float>(templatePositionsY_flat[startIndex+j]);
+                }
+
+                domPosOnString[j*3+0] = relX + static_cast<float>(stringMeanPosX[i]);
+                domPosOnString[j*3+1] = relY + static_cast<float>(stringMeanPosY[i]);
+                domPosOnString[j*3+2] = static_cast<float>(templatePositionsZ_flat[startIndex+j]);
+            }
+        }
         
         output << "#define GEO_DOM_POS_NUM_FLAT_LIST_ENTRIES " << templatePositionsX_flat.size() << std::endl;
         output << "__constant " << typeString << " geoDomPosTemplatePositionsX_flat[GEO_DOM_POS_NUM_FLAT_LIST_ENTRIES] = {" << std::endl;
@@ -718,7 +750,8 @@ namespace I3CLSimHelper
                                              const double omRadius,
                                              std::vector<cl_ushort> &geoLayerToOMNumIndexPerStringSetBuffer,
                                              std::vector<int> &stringIndexToStringIDBuffer,
-                                             std::vector<std::vector<unsigned int> > &domIndexToDomIDBuffer_perStringIndex
+                                             std::vector<std::vector<unsigned int> > &domIndexToDomIDBuffer_perStringIndex,
+                                             std::vector<std::vector<float> > &domIndexToDomPosBuffer_perStringIndex
                                              )
     {
         typedef std::vector<int>::size_type sizeType;
@@ -1145,7 +1178,7 @@ namespace I3CLSimHelper
         
 
         // the dom position lookup code (i.e. (stringNum,domNum)->(posX, posY, posZ) )
-        output << generate_get_dom_position_code(strings);
+        output << generate_get_dom_position_code(strings, domIndexToDomPosBuffer_perStringIndex);
         
         
         // all the other data
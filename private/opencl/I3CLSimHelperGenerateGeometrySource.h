@@ -36,11 +36,16 @@ namespace I3CLSimHelper
 {
     /**
      * generates the OpenCL source code for a given I3CLSimSimpleGeometry object.
+     *
+     * domIndexToDomPosBuffer_perStringIndex receives (x,y,z) for each DOM
+     * index on each string index (3 entries per DOM) exactly as the
+     * generated geometryGetDomPosition() function returns them.
      */
     std::string GenerateGeometrySource(const I3CLSimSimpleGeometry &geometry,
                                        std::vector<unsigned short> &geoLayerToOMNumIndexPerStringSetBuffer,
                                        std::vector<int> &stringIndexToStringIDBuffer,
-                                       std::vector<std::vector<unsigned int> > &domIndexToDomIDBuffer_perStringIndex);
+                                       std::vector<std::vector<unsigned int> > &domIndexToDomIDBuffer_perStringIndex,
+                                       std::vector<std::vector<float> > &domIndexToDomPosBuffer_perStringIndex);
 
 };
 
@@ -34,6 +34,7 @@
 #include <string>
 #include <sstream>
 #include <stdexcept>
+#include <cmath>
 
 #include "dataclasses/I3Constants.h"
 
@@ -125,11 +126,253 @@ namespace I3CLSimHelper
     }
                                                                         
     
+    namespace {
+        // tables larger than this might not fit into constant memory
+        // together with everything else
+        const std::size_t lookupTableWarnBytes = 16384;
+
+        // samples a function (or its derivative) at "numBins" equally
+        // spaced wavelengths in [minWlen;maxWlen]. Returns false if
+        // any of the values is not finite.
+        bool SampleWlenDependentFunction(const I3CLSimFunction &function,
+                                         bool derivative,
+                                         double minWlen,
+                                         double maxWlen,
+                                         uint32_t numBins,
+                                         std::vector<double> &values)
+        {
+            values.resize(numBins);
+            
+            for (uint32_t i=0;i<numBins;++i)
+            {
+                double wlen = minWlen + (maxWlen-minWlen)*static_cast<double>(i)/static_cast<double>(numBins-1);
+                
+                // do not evaluate the function outside of its valid range
+                if (wlen < function.GetMinWlen()) wlen = function.GetMinWlen();
+                if (wlen > function.GetMaxWlen()) wlen = function.GetMaxWlen();
+
+                values[i] = derivative ? function.GetDerivative(wlen) : function.GetValue(wlen);
+                if (!std::isfinite(values[i])) return false;
+            }
+            
+            return true;
+        }
+        
+        // writes "functionName(layer, wavelength)" as a linear interpolation
+        // in a table with one row for each distinct function.
+        // Returns an empty string if any of the functions cannot be sampled.
+        std::string GenerateLayeredWlenDependentLookupTable(const std::vector<I3CLSimFunctionConstPtr> &layeredFunction,
+                                                            bool derivative,
+                                                            const std::string &fullName,
+                                                            const std::string &functionName,
+                                                            double minWlen,
+                                                            double maxWlen,
+                                                            uint32_t numBins)
+        {
+            // sample all layers, layers with identical values share a row
+            std::vector<std::vector<double> > rows;
+            std::vector<std::size_t> rowForLayer;
+            
+            for (std::size_t i=0;i<layeredFunction.size();++i)
+            {
+                if (!layeredFunction[i]) log_fatal("%s function for layer %zu is (null)", fullName.c_str(), i);
+
+                std::vector<double> values;
+                if (!SampleWlenDependentFunction(*(layeredFunction[i]), derivative, minWlen, maxWlen, numBins, values))
+                {
+                    log_warn("%s for layer %zu cannot be tabulated (non-finite values). Not using a lookup table for it.",
+                             fullName.c_str(), i);
+                    return std::string();
+                }
+                
+                std::size_t pos;
+                if (is_in_vector(values, rows, pos)) {
+                    rowForLayer.push_back(pos);
+                } else {
+                    rows.push_back(values);
+                    rowForLayer.push_back(rows.size()-1);
+                }
+            }
+
+            const std::size_t tableBytes = rows.size()*static_cast<std::size_t>(numBins)*sizeof(float);
+            if (tableBytes > lookupTableWarnBytes) {
+                log_warn("The lookup table for %s needs %zu bytes of constant memory (%zu rows with %u bins each). "
+                         "This might be more than your device supports. Use fewer bins if the kernel fails to build.",
+                         fullName.c_str(), tableBytes, rows.size(), static_cast<unsigned int>(numBins));
+            }
+            
+            std::ostringstream code;
+
+            code << "///////////////// START " << fullName << " (lookup table) ////////////////\n";
+            code << "\n";
+
+            if (rows.size()==1)
+            {
+                code << "#define FUNCTION_" << functionName << "_DOES_NOT_DEPEND_ON_LAYER" << std::endl;
+            }
+
+            code << "#define " << functionName << "_TABLE_BINS " << numBins << "\n";
+            code << "__constant float " << functionName << "_table[" << rows.size()*numBins << "] = {\n";
+            for (std::size_t i=0;i<rows.size();++i)
+            {
+                code << "    ";
+                for (uint32_t j=0;j<numBins;++j)
+                {
+                    code << ToFloatString(rows[i][j]) << ", ";
+                }
+                code << "\n";
+            }
+            code << "};\n";
+
+            if (rows.size()>1) {
+                code << "__constant unsigned short " << functionName << "_tableRowForLayer[" << rowForLayer.size() << "] = {\n";
+                for (std::size_t i=0;i<rowForLayer.size();++i)
+                {
+                    code << "    " << rowForLayer[i] << ",\n";
+                }
+                code << "};\n";
+            }
+            code << "\n";
+
+            code << "inline float " << functionName << "(unsigned int layer, float wavelength);\n\n";
+            code << "inline float " << functionName << "(unsigned int layer, float wavelength)\n";
+            code << "{\n";
+            if (rows.size()==1) {
+                code << "    // " << fullName << " does not have a layer structure\n";
+                code << "    __constant const float *row = " << functionName << "_table;\n";
+            } else {
+                code << "    if (layer >= " << rowForLayer.size() << ") return 0.f;\n";
+                code << "    __constant const float *row = &(" << functionName << "_table[" << functionName << "_tableRowForLayer[layer]*" << functionName << "_TABLE_BINS]);\n";
+            }
+            code << "\n";
+            code << "    const float binPos = clamp((wavelength-" << ToFloatString(minWlen) << ")*" << ToFloatString(static_cast<double>(numBins-1)/(maxWlen-minWlen)) << ", 0.f, " << ToFloatString(static_cast<double>(numBins-1)) << ");\n";
+            code << "    const unsigned int bin = min(convert_uint(binPos), (unsigned int)(" << functionName << "_TABLE_BINS-2));\n";
+            code << "    return mix(row[bin], row[bin+1], binPos-convert_float(bin));\n";
+            code << "}\n";
+            code << "\n";
+
+            code << "///////////////// END " << fullName << " (lookup table) ////////////////\n";
+            code << "\n";
+
+            return code.str();
+        }
+
+        // writes the sum of 1/length over all layers below each layer boundary
+        // (row "bin" holds the values for the bin'th wavelength) for
+        // the scattering and absorption lengths. Returns an empty string
+        // if any of the lengths cannot be sampled or is not positive.
+        std::string GenerateOpticalDepthTables(const I3CLSimMediumProperties &mediumProperties,
+                                               double minWlen,
+                                               double maxWlen,
+                                               uint32_t numBins)
+        {
+            const std::size_t numLayers = mediumProperties.GetLayersNum();
+            
+            std::vector<double> scatteringDepth(numBins*(numLayers+1), 0.);
+            std::vector<double> absorptionDepth(numBins*(numLayers+1), 0.);
+            
+            for (std::size_t layer=0;layer<numLayers;++layer)
+            {
+                I3CLSimFunctionConstPtr scatteringLength = mediumProperties.GetScatteringLength(layer);
+                I3CLSimFunctionConstPtr absorptionLength = mediumProperties.GetAbsorptionLength(layer);
+                if ((!scatteringLength) || (!absorptionLength))
+                    log_fatal("scattering or absorption length for layer %zu is (null)", layer);
+
+                std::vector<double> scatteringValues, absorptionValues;
+                if ((!SampleWlenDependentFunction(*scatteringLength, false, minWlen, maxWlen, numBins, scatteringValues)) ||
+                    (!SampleWlenDependentFunction(*absorptionLength, false, minWlen, maxWlen, numBins, absorptionValues)))
+                {
+                    log_warn("The scattering or absorption length for layer %zu cannot be tabulated (non-finite values). "
+                             "Not using optical depth tables.", layer);
+                    return std::string();
+                }
+
+                for (uint32_t bin=0;bin<numBins;++bin)
+                {
+                    if ((scatteringValues[bin] <= 0.) || (absorptionValues[bin] <= 0.))
+                    {
+                        log_warn("The scattering or absorption length for layer %zu is not positive. "
+                                 "Not using optical depth tables.", layer);
+                        return std::string();
+                    }
+                    
+                    const std::size_t idx = bin*(numLayers+1)+layer;
+                    scatteringDepth[idx+1] = scatteringDepth[idx] + 1./scatteringValues[bin];
+                    absorptionDepth[idx+1] = absorptionDepth[idx] + 1./absorptionValues[bin];
+                }
+            }
+
+            const std::size_t tableBytes = 2*scatteringDepth.size()*sizeof(float);
+            if (tableBytes > lookupTableWarnBytes) {
+                log_warn("The optical depth tables need %zu bytes of constant memory (%zu layers with %u bins each). "
+                         "This might be more than your device supports. Use fewer bins if the kernel fails to build.",
+                         tableBytes, numLayers, static_cast<unsigned int>(numBins));
+            }
+
+            std::ostringstream code;
+            
+            code << "///////////////// START optical depth tables ////////////////\n";
+            code << "\n";
+            code << "// entry [bin*(MEDIUM_LAYERS+1)+layer] is the sum of 1/length over\n";
+            code << "// all layers below \"layer\" at the bin'th wavelength\n";
+            code << "#define MEDIUM_OPTICAL_DEPTH_TABLES\n";
+            code << "#define MEDIUM_OPTICAL_DEPTH_TABLE_BINS " << numBins << "\n";
+            code << "#define MEDIUM_OPTICAL_DEPTH_TABLE_MIN_WLEN " << ToFloatString(minWlen) << "\n";
+            code << "#define MEDIUM_OPTICAL_DEPTH_TABLE_INV_BIN_WIDTH " << ToFloatString(static_cast<double>(numBins-1)/(maxWlen-minWlen)) << "\n";
+            code << "\n";
+
+            for (unsigned int t=0;t<2;++t)
+            {
+                const std::vector<double> &depth = (t==0)?scatteringDepth:absorptionDepth;
+                
+                code << "__constant float " << ((t==0)?"mediumScatteringDepthTable":"mediumAbsorptionDepthTable") << "[" << depth.size() << "] = {\n";
+                for (uint32_t bin=0;bin<numBins;++bin)
+                {
+                    code << "    ";
+                    for (std::size_t layer=0;layer<=numLayers;++layer)
+                    {
+                        code << ToFloatString(depth[bin*(numLayers+1)+layer]) << ", ";
+                    }
+                    code << "\n";
+                }
+                code << "};\n";
+                code << "\n";
+            }
+            
+            code << "///////////////// END optical depth tables ////////////////\n";
+            code << "\n";
+
+            return code.str();
+        }
+    }
+    
     std::string GenerateLayeredWlenDependentFunctions(const std::vector<I3CLSimFunctionConstPtr> &layeredFunction,
                                                       const std::string &fullName,
                                                       const std::string &functionName,
-                                                      std::string derivativeFunctionName="")
+                                                      std::string derivativeFunctionName,
+                                                      double minWlen,
+                                                      double maxWlen,
+                                                      uint32_t lookupTableBins)
     {
+        // replace everything by lookup tables if requested
+        if (lookupTableBins>0)
+        {
+            std::string tableCode = GenerateLayeredWlenDependentLookupTable(layeredFunction, false,
+                                                                            fullName, functionName,
+                                                                            minWlen, maxWlen, lookupTableBins);
+            std::string derivativeTableCode;
+            if ((!tableCode.empty()) && (derivativeFunctionName != "")) {
+                derivativeTableCode = GenerateLayeredWlenDependentLookupTable(layeredFunction, true,
+                                                                              fullName + " derivative", derivativeFunctionName,
+                                                                              minWlen, maxWlen, lookupTableBins);
+            }
+            
+            if ((!tableCode.empty()) && ((derivativeFunctionName == "") || (!derivativeTableCode.empty())))
+                return tableCode + derivativeTableCode;
+
+            // fall back to generated code below
+        }
+        
         // first, check if one of the optimizers work
         if (derivativeFunctionName=="")
         {
@@ -204,8 +447,27 @@ namespace I3CLSimHelper
     }
     
     
-    std::string GenerateMediumPropertiesSource(const I3CLSimMediumProperties &mediumProperties)
+    std::string GenerateMediumPropertiesSource(const I3CLSimMediumProperties &mediumProperties,
+                                               uint32_t lookupTableBins,
+                                               uint32_t opticalDepthTableBins)
     {
+        if (lookupTableBins==1)
+            log_fatal("Medium property lookup tables need at least 2 bins.");
+        if (opticalDepthTableBins==1)
+            log_fatal("Optical depth tables need at least 2 bins.");
+        
+        const double minWlen = mediumProperties.GetMinWavelength();
+        const double maxWlen = mediumProperties.GetMaxWavelength();
+        
+        if ((lookupTableBins>0) && ((!std::isfinite(minWlen)) || (!std::isfinite(maxWlen)))) {
+            log_warn("The medium properties do not have a finite wavelength range. Not using lookup tables.");
+            lookupTableBins=0;
+        }
+        if ((opticalDepthTableBins>0) && ((!std::isfinite(minWlen)) || (!std::isfinite(maxWlen)))) {
+            log_warn("The medium properties do not have a finite wavelength range. Not using optical depth tables.");
+            opticalDepthTableBins=0;
+        }
+
         std::ostringstream code;
         
         code << "// ice/water properties, auto-generated by\n";
@@ -232,12 +494,14 @@ namespace I3CLSimHelper
             code << GenerateLayeredWlenDependentFunctions(mediumProperties.GetPhaseRefractiveIndices(),
                                                           "phase refractive index",
                                                           "getPhaseRefIndex",
-                                                          "getDispersion");
+                                                          "getDispersion",
+                                                          minWlen, maxWlen, lookupTableBins);
         } else {
             code << GenerateLayeredWlenDependentFunctions(mediumProperties.GetPhaseRefractiveIndices(),
                                                           "phase refractive index",
                                                           "getPhaseRefIndex",
-                                                          "");
+                                                          "",
+                                                          minWlen, maxWlen, lookupTableBins);
         }
         
         if (mediumProperties.GetGroupRefractiveIndexOverride(0))
@@ -255,7 +519,9 @@ namespace I3CLSimHelper
             // phase refractive index
             code << GenerateLayeredWlenDependentFunctions(mediumProperties.GetGroupRefractiveIndicesOverride(),
                                                           "group refractive index",
-                                                          "getGroupRefIndex");
+                                                          "getGroupRefIndex",
+                                                          "",
+                                                          minWlen, maxWlen, lookupTableBins);
 
             code << "#ifdef FUNCTION_getGroupRefIndex_DOES_NOT_DEPEND_ON_LAYER" << std::endl;
             code << "#define FUNCTION_getGroupVelocity_DOES_NOT_DEPEND_ON_LAYER" << std::endl;
@@ -310,12 +576,20 @@ namespace I3CLSimHelper
         // scattering length
         code << GenerateLayeredWlenDependentFunctions(mediumProperties.GetScatteringLengths(),
                                                       "scattering length",
-                                                      "getScatteringLength");
+                                                      "getScatteringLength",
+                                                      "",
+                                                      minWlen, maxWlen, lookupTableBins);
         
         // absorption length
         code << GenerateLayeredWlenDependentFunctions(mediumProperties.GetAbsorptionLengths(),
                                                       "absorption length",
-                                                      "getAbsorptionLength");
+                                                      "getAbsorptionLength",
+                                                      "",
+                                                      minWlen, maxWlen, lookupTableBins);
+        
+        // cumulative optical depths for propagating through many layers at once
+        if (opticalDepthTableBins>0)
+            code << GenerateOpticalDepthTables(mediumProperties, minWlen, maxWlen, opticalDepthTableBins);
         
         
         // scattering angle distribution
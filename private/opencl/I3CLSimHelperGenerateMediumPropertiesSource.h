@@ -28,6 +28,7 @@
 #define I3CLSIMHELPERGENERATEMEDIUMPROPERTIESSOURCE_H_INCLUDED
 
 #include <string>
+#include <stdint.h>
 
 #include "clsim/I3CLSimMediumProperties.h"
 
@@ -35,8 +36,22 @@ namespace I3CLSimHelper
 {
     /**
      * generates the OpenCL source code for a given mediumProperties object.
+     *
+     * If lookupTableBins is > 0, all wavelength-dependent layered functions
+     * (refractive indices, scattering and absorption lengths) are sampled
+     * at this many wavelengths and evaluated by linear interpolation in a
+     * table in constant memory instead of generating code for each function.
+     * Functions that cannot be sampled fall back to generated code.
+     *
+     * If opticalDepthTableBins is > 0, the cumulative sums of the inverse
+     * scattering and absorption lengths over all layers are tabulated
+     * at this many wavelengths (MEDIUM_OPTICAL_DEPTH_TABLES is defined
+     * in that case). The propagation kernel uses these to find the layer
+     * of the next interaction with a binary search.
      */
-    std::string GenerateMediumPropertiesSource(const I3CLSimMediumProperties &mediumProperties);
+    std::string GenerateMediumPropertiesSource(const I3CLSimMediumProperties &mediumProperties,
+                                               uint32_t lookupTableBins=0,
+                                               uint32_t opticalDepthTableBins=0);
 
 };
 
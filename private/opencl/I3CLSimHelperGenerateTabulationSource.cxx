@@ -0,0 +1,164 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimHelperGenerateTabulationSource.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#include "opencl/I3CLSimHelperGenerateTabulationSource.h"
+
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <cmath>
+
+#include "dataclasses/I3Constants.h"
+
+#include <boost/lexical_cast.hpp>
+
+#include "clsim/I3CLSimHelperToFloatString.h"
+
+
+namespace I3CLSimHelper
+{
+    
+    std::size_t GetTabulationNumBins(const std::vector<std::vector<double> > &binEdges)
+    {
+        if (binEdges.empty()) return 0;
+        
+        std::size_t numBins=1;
+        for (std::size_t dim=0;dim<binEdges.size();++dim)
+        {
+            if (binEdges[dim].size() < 2) return 0;
+            numBins *= binEdges[dim].size()-1;
+        }
+        return numBins;
+    }
+    
+    std::string GenerateTabulationSource(const std::vector<std::vector<double> > &binEdges,
+                                         double stepLength,
+                                         const I3Particle &source,
+                                         const I3CLSimFunction &wavelengthAcceptance,
+                                         const I3CLSimFunction &angularAcceptance,
+                                         double domRadius)
+    {
+        if (binEdges.size() != 4)
+            throw std::runtime_error("Photon tables need bin edges in exactly 4 dimensions (r, azimuth, cos(zenith), time residual).");
+        for (std::size_t dim=0;dim<binEdges.size();++dim)
+        {
+            if (binEdges[dim].size() < 2)
+                throw std::runtime_error("Each table dimension needs at least 2 bin edges.");
+            for (std::size_t i=1;i<binEdges[dim].size();++i)
+            {
+                if (!(binEdges[dim][i] > binEdges[dim][i-1]))
+                    throw std::runtime_error("Table bin edges have to be in ascending order.");
+            }
+        }
+        if (!(stepLength > 0.))
+            throw std::runtime_error("The tabulation step length has to be positive.");
+        
+        // the azimuth is measured from this direction (perpendicular
+        // to the source direction), see I3CLSimTabulator
+        const double dirX = source.GetDir().GetX();
+        const double dirY = source.GetDir().GetY();
+        const double dirZ = source.GetDir().GetZ();
+        double perpDirX, perpDirY, perpDirZ;
+        {
+            const double perpZ = std::sqrt(dirX*dirX + dirY*dirY);
+            if (perpZ > 0.) {
+                perpDirX = -dirX*dirZ/perpZ;
+                perpDirY = -dirY*dirZ/perpZ;
+                perpDirZ = perpZ;
+            } else {
+                perpDirX = 1.;
+                perpDirY = 0.;
+                perpDirZ = 0.;
+            }
+        }
+        
+        std::ostringstream code;
+        
+        code << "\n";
+        code << "///////////////// BEGIN photon table ////////////\n";
+        code << "\n";
+        
+        code << "// photon table definition, auto-generated by\n";
+        code << "// I3CLSimHelper::GenerateTabulationSource()\n";
+        code << "\n";
+        
+        std::size_t offset=0;
+        for (std::size_t dim=0;dim<binEdges.size();++dim)
+        {
+            const std::string dimStr = boost::lexical_cast<std::string>(dim);
+            code << "#define TABULATION_NUM_BINS_" << dimStr << " " << (binEdges[dim].size()-1) << "u\n";
+            code << "#define TABULATION_EDGES_OFFSET_" << dimStr << " " << offset << "u\n";
+            offset += binEdges[dim].size();
+        }
+        code << "\n";
+        
+        code << "__constant float tabulationBinEdges[" << offset << "] = {\n";
+        for (std::size_t dim=0;dim<binEdges.size();++dim)
+        {
+            code << "    ";
+            for (std::size_t i=0;i<binEdges[dim].size();++i)
+            {
+                code << ToFloatString(binEdges[dim][i]);
+                if ((dim<binEdges.size()-1) || (i<binEdges[dim].size()-1)) code << ", ";
+            }
+            code << "\n";
+        }
+        code << "};\n";
+        code << "\n";
+        
+        // photons later than this are not recorded anymore
+        code << "#define TABULATION_MAX_TIME_RESIDUAL " << ToFloatString(binEdges[3].back()) << "\n";
+        code << "#define TABULATION_STEP_LENGTH " << ToFloatString(stepLength) << "\n";
+        code << "#define TABULATION_RECIP_STEP_LENGTH " << ToFloatString(1./stepLength) << "\n";
+        code << "#define TABULATION_DOM_AREA " << ToFloatString(I3Constants::pi*domRadius*domRadius) << "\n";
+        code << "#define TABULATION_RECIP_GROUP_SPEED " << ToFloatString(I3Constants::n_ice_group/I3Constants::c) << "\n";
+        code << "\n";
+        
+        code << "#define TABULATION_SOURCE_POS_X " << ToFloatString(source.GetPos().GetX()) << "\n";
+        code << "#define TABULATION_SOURCE_POS_Y " << ToFloatString(source.GetPos().GetY()) << "\n";
+        code << "#define TABULATION_SOURCE_POS_Z " << ToFloatString(source.GetPos().GetZ()) << "\n";
+        code << "#define TABULATION_SOURCE_TIME " << ToFloatString(source.GetTime()) << "\n";
+        code << "#define TABULATION_SOURCE_DIR_X " << ToFloatString(dirX) << "\n";
+        code << "#define TABULATION_SOURCE_DIR_Y " << ToFloatString(dirY) << "\n";
+        code << "#define TABULATION_SOURCE_DIR_Z " << ToFloatString(dirZ) << "\n";
+        code << "#define TABULATION_SOURCE_PERP_DIR_X " << ToFloatString(perpDirX) << "\n";
+        code << "#define TABULATION_SOURCE_PERP_DIR_Y " << ToFloatString(perpDirY) << "\n";
+        code << "#define TABULATION_SOURCE_PERP_DIR_Z " << ToFloatString(perpDirZ) << "\n";
+        code << "\n";
+        
+        code << wavelengthAcceptance.GetOpenCLFunction("getTabulationWavelengthAcceptance");
+        code << "\n";
+        code << angularAcceptance.GetOpenCLFunction("getTabulationAngularAcceptance");
+        code << "\n";
+        
+        code << "\n";
+        code << "///////////////// END photon table ////////////\n";
+        code << "\n";
+        
+        return code.str();
+    }
+    
+};
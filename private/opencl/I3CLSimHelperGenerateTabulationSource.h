@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimHelperGenerateTabulationSource.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMHELPERGENERATETABULATIONSOURCE_H_INCLUDED
+#define I3CLSIMHELPERGENERATETABULATIONSOURCE_H_INCLUDED
+
+#include <vector>
+#include <string>
+
+#include "dataclasses/physics/I3Particle.h"
+#include "clsim/function/I3CLSimFunction.h"
+
+namespace I3CLSimHelper
+{
+    /**
+     * Generates the OpenCL code needed to fill a photon table
+     * in the propagation kernel. The table is binned in
+     * source-centered coordinates: distance from the source,
+     * azimuth (in degrees, 0-180), cosine of the polar angle
+     * w.r.t. the source direction and time residual (w.r.t.
+     * direct light from a point source at the group velocity
+     * given by I3Constants::n_ice_group).
+     *
+     * The bin edges and the source are compiled into the kernel,
+     * so are the DOM acceptances (they are sampled in the
+     * same way as the CPU tabulator does it).
+     */
+    std::string GenerateTabulationSource(const std::vector<std::vector<double> > &binEdges,
+                                         double stepLength,
+                                         const I3Particle &source,
+                                         const I3CLSimFunction &wavelengthAcceptance,
+                                         const I3CLSimFunction &angularAcceptance,
+                                         double domRadius);
+
+    /**
+     * Returns the total number of bins of a table with
+     * these bin edges.
+     */
+    std::size_t GetTabulationNumBins(const std::vector<std::vector<double> > &binEdges);
+
+};
+
+#endif //I3CLSIMHELPERGENERATETABULATIONSOURCE_H_INCLUDED
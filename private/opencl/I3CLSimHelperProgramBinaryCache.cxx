@@ -0,0 +1,202 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimHelperProgramBinaryCache.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+#ifndef __STDC_CONSTANT_MACROS
+#define __STDC_CONSTANT_MACROS
+#endif
+#include <inttypes.h>
+
+#include "opencl/I3CLSimHelperProgramBinaryCache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem.hpp>
+
+namespace I3CLSimHelper
+{
+    namespace {
+        // bump this whenever the on-disk layout changes
+        const uint32_t cacheFormatVersion = 1;
+        const char cacheMagic[8] = {'C','L','S','I','M','B','I','N'};
+
+        // 64bit FNV-1a, continued from "hash"
+        inline uint64_t fnv1a(uint64_t hash, const std::string &data)
+        {
+            for (std::size_t i=0;i<data.size();++i)
+            {
+                hash ^= static_cast<unsigned char>(data[i]);
+                hash *= UINT64_C(1099511628211);
+            }
+            // terminate each field so that "ab"+"c" and "a"+"bc" differ
+            hash ^= 0xff;
+            hash *= UINT64_C(1099511628211);
+            return hash;
+        }
+
+        std::string cacheFileName(const std::string &cacheDirectory,
+                                  const std::string &key)
+        {
+            return cacheDirectory + "/" + key + ".clbin";
+        }
+
+        template <typename T>
+        inline bool readValue(FILE *file, T &value)
+        {
+            return (fread(&value, sizeof(T), 1, file) == 1);
+        }
+
+        template <typename T>
+        inline bool writeValue(FILE *file, const T &value)
+        {
+            return (fwrite(&value, sizeof(T), 1, file) == 1);
+        }
+    }
+
+    std::string GetDefaultProgramBinaryCacheDirectory()
+    {
+        const char *cacheDir = getenv("CLSIM_KERNEL_CACHE");
+        if (cacheDir) return std::string(cacheDir);
+
+        const char *homeDir = getenv("HOME");
+        if ((!homeDir) || (homeDir[0]=='\0')) return std::string();
+
+        return std::string(homeDir) + "/.cache/clsim/kernels";
+    }
+
+    std::string GetProgramBinaryCacheKey(const std::string &source,
+                                         const std::string &buildOptions,
+                                         const std::string &deviceDescription)
+    {
+        // two independent FNV-1a streams give us a 128bit digest,
+        // which is plenty for a cache key
+        const uint64_t offsets[2] = {UINT64_C(14695981039346656037), UINT64_C(0x6c62272e07bb0142)};
+
+        std::string key;
+        for (unsigned int i=0;i<2;++i)
+        {
+            uint64_t hash = offsets[i];
+            hash = fnv1a(hash, source);
+            hash = fnv1a(hash, buildOptions);
+            hash = fnv1a(hash, deviceDescription);
+            hash = fnv1a(hash, boost::lexical_cast<std::string>(source.size()));
+
+            char buffer[17];
+            snprintf(buffer, sizeof(buffer), "%016" PRIx64, hash);
+            key += buffer;
+        }
+
+        return key;
+    }
+
+    bool LoadProgramBinary(const std::string &cacheDirectory,
+                           const std::string &key,
+                           const std::string &deviceDescription,
+                           std::vector<unsigned char> &binary)
+    {
+        if (cacheDirectory.empty()) return false;
+
+        FILE *file = fopen(cacheFileName(cacheDirectory, key).c_str(), "rb");
+        if (!file) return false;
+
+        bool ok = true;
+
+        char magic[8];
+        ok = ok && (fread(magic, sizeof(magic), 1, file) == 1);
+        ok = ok && (memcmp(magic, cacheMagic, sizeof(magic)) == 0);
+
+        uint32_t version=0;
+        ok = ok && readValue(file, version);
+        ok = ok && (version == cacheFormatVersion);
+
+        uint64_t descriptionSize=0;
+        ok = ok && readValue(file, descriptionSize);
+        ok = ok && (descriptionSize == deviceDescription.size());
+        if (ok) {
+            std::string storedDescription(descriptionSize, '\0');
+            if (descriptionSize > 0)
+                ok = (fread(&(storedDescription[0]), descriptionSize, 1, file) == 1);
+            ok = ok && (storedDescription == deviceDescription);
+        }
+
+        uint64_t binarySize=0;
+        ok = ok && readValue(file, binarySize);
+        ok = ok && (binarySize > 0);
+        if (ok) {
+            binary.resize(binarySize);
+            ok = (fread(&(binary[0]), binarySize, 1, file) == 1);
+        }
+
+        fclose(file);
+
+        if (!ok) binary.clear();
+        return ok;
+    }
+
+    bool SaveProgramBinary(const std::string &cacheDirectory,
+                           const std::string &key,
+                           const std::string &deviceDescription,
+                           const std::vector<unsigned char> &binary)
+    {
+        if (cacheDirectory.empty()) return false;
+        if (binary.empty()) return false;
+
+        boost::system::error_code ec;
+        boost::filesystem::create_directories(cacheDirectory, ec);
+        if (!boost::filesystem::is_directory(cacheDirectory, ec)) return false;
+
+        const std::string fileName = cacheFileName(cacheDirectory, key);
+        const std::string tempFileName = fileName + ".tmp" + boost::lexical_cast<std::string>(getpid());
+
+        FILE *file = fopen(tempFileName.c_str(), "wb");
+        if (!file) return false;
+
+        bool ok = true;
+        ok = ok && (fwrite(cacheMagic, sizeof(cacheMagic), 1, file) == 1);
+        ok = ok && writeValue(file, cacheFormatVersion);
+        ok = ok && writeValue(file, static_cast<uint64_t>(deviceDescription.size()));
+        if (!deviceDescription.empty())
+            ok = ok && (fwrite(deviceDescription.data(), deviceDescription.size(), 1, file) == 1);
+        ok = ok && writeValue(file, static_cast<uint64_t>(binary.size()));
+        ok = ok && (fwrite(&(binary[0]), binary.size(), 1, file) == 1);
+
+        if (fclose(file) != 0) ok = false;
+
+        // atomically replace any existing entry
+        if (ok) ok = (rename(tempFileName.c_str(), fileName.c_str()) == 0);
+
+        if (!ok) remove(tempFileName.c_str());
+        return ok;
+    }
+
+};
@@ -0,0 +1,78 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimHelperProgramBinaryCache.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMHELPERPROGRAMBINARYCACHE_H_INCLUDED
+#define I3CLSIMHELPERPROGRAMBINARYCACHE_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+namespace I3CLSimHelper
+{
+    /**
+     * Returns the default directory for cached OpenCL
+     * program binaries. This is $CLSIM_KERNEL_CACHE if set
+     * (an empty value disables caching), otherwise
+     * $HOME/.cache/clsim/kernels. Returns an empty string
+     * if neither variable is available.
+     */
+    std::string GetDefaultProgramBinaryCacheDirectory();
+
+    /**
+     * Builds the cache key for a program. The key is a hex digest
+     * of the full program source, the build options and the
+     * device description string (which should include the device name,
+     * vendor, device version and driver version).
+     */
+    std::string GetProgramBinaryCacheKey(const std::string &source,
+                                         const std::string &buildOptions,
+                                         const std::string &deviceDescription);
+
+    /**
+     * Tries to load a cached program binary for the given key.
+     * The stored device description has to match exactly,
+     * otherwise the entry is treated as a miss.
+     * Returns false on a cache miss or on any read error.
+     */
+    bool LoadProgramBinary(const std::string &cacheDirectory,
+                           const std::string &key,
+                           const std::string &deviceDescription,
+                           std::vector<unsigned char> &binary);
+
+    /**
+     * Stores a program binary in the cache. The file is written
+     * to a temporary name first and then renamed, so concurrent
+     * jobs sharing a cache directory never see partial entries.
+     * Returns false if the entry could not be written.
+     */
+    bool SaveProgramBinary(const std::string &cacheDirectory,
+                           const std::string &key,
+                           const std::string &deviceDescription,
+                           const std::vector<unsigned char> &binary);
+
+};
+
+#endif //I3CLSIMHELPERPROGRAMBINARYCACHE_H_INCLUDED
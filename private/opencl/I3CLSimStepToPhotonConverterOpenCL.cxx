@@ -39,9 +39,12 @@
 #include <sstream>
 #include <algorithm>
 #include <limits>
+#include <deque>
+#include <cstring>
 
 #include <stdlib.h>
 #include <boost/foreach.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
@@ -52,6 +55,11 @@
 #include "opencl/I3CLSimHelperLoadProgramSource.h"
 #include "opencl/I3CLSimHelperGenerateMediumPropertiesSource.h"
 #include "opencl/I3CLSimHelperGenerateGeometrySource.h"
+#include "opencl/I3CLSimHelperGenerateDOMGridGeometrySource.h"
+#include "opencl/I3CLSimHelperDistanceCulling.h"
+#include "opencl/I3CLSimHelperGenerateTabulationSource.h"
+#include "opencl/I3CLSimHelperCompactPhotons.h"
+#include "opencl/I3CLSimHelperProgramBinaryCache.h"
 
 #include "opencl/mwcrng_init.h"
 
@@ -61,6 +69,126 @@
 using namespace I3CLSimHelper;
 
 const bool I3CLSimStepToPhotonConverterOpenCL::default_useNativeMath=true;
+const uint16_t I3CLSimStepToPhotonConverterOpenCL::maxNumDOMMasks=256;
+
+// Pinned host memory for each buffer set. All buffers are mapped once
+// on construction and stay mapped until this object is destroyed (they
+// are never used as kernel arguments, so this is legal). Photon buffers
+// are lent out as I3CLSimPhotonSeriesViews, which keep a reference
+// to this object until they are released.
+struct I3CLSimStepToPhotonConverterOpenCL::MappedHostBuffers_t
+: private boost::noncopyable, public boost::enable_shared_from_this<MappedHostBuffers_t>
+{
+    struct Slot_t
+    {
+        Slot_t() :
+        mappedInputSteps(NULL), mappedOutputPhotons(NULL),
+        mappedNumOutputPhotons(NULL), mappedPhotonHistory(NULL),
+        photonsLent(false) {;}
+
+        cl::Buffer inputSteps;
+        cl::Buffer outputPhotons;
+        cl::Buffer numOutputPhotons;
+        cl::Buffer photonHistory;
+
+        I3CLSimStep *mappedInputSteps;
+        I3CLSimPhoton *mappedOutputPhotons;
+        uint32_t *mappedNumOutputPhotons;
+        cl_float4 *mappedPhotonHistory;
+
+        // true while a view of mappedOutputPhotons exists
+        bool photonsLent;
+    };
+
+    MappedHostBuffers_t(const cl::Context &context,
+                        const cl::CommandQueue &commandQueue,
+                        unsigned int numBuffers,
+                        std::size_t maxNumWorkitems,
+                        uint32_t maxNumOutputPhotons,
+                        uint32_t photonHistoryEntries)
+    :
+    queue(commandQueue),
+    slots(numBuffers)
+    {
+        const std::size_t photonHistorySize =
+        static_cast<std::size_t>(maxNumOutputPhotons)*static_cast<std::size_t>(photonHistoryEntries)*sizeof(cl_float4);
+
+        BOOST_FOREACH(Slot_t &slot, slots)
+        {
+            slot.inputSteps = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, maxNumWorkitems*sizeof(I3CLSimStep), NULL);
+            slot.outputPhotons = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, maxNumOutputPhotons*sizeof(I3CLSimPhoton), NULL);
+            slot.numOutputPhotons = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizeof(uint32_t), NULL);
+
+            slot.mappedInputSteps = static_cast<I3CLSimStep *>
+            (queue.enqueueMapBuffer(slot.inputSteps, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, maxNumWorkitems*sizeof(I3CLSimStep)));
+            slot.mappedOutputPhotons = static_cast<I3CLSimPhoton *>
+            (queue.enqueueMapBuffer(slot.outputPhotons, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, maxNumOutputPhotons*sizeof(I3CLSimPhoton)));
+            slot.mappedNumOutputPhotons = static_cast<uint32_t *>
+            (queue.enqueueMapBuffer(slot.numOutputPhotons, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, sizeof(uint32_t)));
+
+            if (photonHistorySize>0) {
+                slot.photonHistory = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, photonHistorySize, NULL);
+                slot.mappedPhotonHistory = static_cast<cl_float4 *>
+                (queue.enqueueMapBuffer(slot.photonHistory, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, photonHistorySize));
+            }
+        }
+    }
+
+    ~MappedHostBuffers_t()
+    {
+        try {
+            BOOST_FOREACH(Slot_t &slot, slots)
+            {
+                if (slot.mappedInputSteps) queue.enqueueUnmapMemObject(slot.inputSteps, slot.mappedInputSteps);
+                if (slot.mappedOutputPhotons) queue.enqueueUnmapMemObject(slot.outputPhotons, slot.mappedOutputPhotons);
+                if (slot.mappedNumOutputPhotons) queue.enqueueUnmapMemObject(slot.numOutputPhotons, slot.mappedNumOutputPhotons);
+                if (slot.mappedPhotonHistory) queue.enqueueUnmapMemObject(slot.photonHistory, slot.mappedPhotonHistory);
+            }
+            queue.finish();
+        } catch (cl::Error &err) {
+            log_warn("OpenCL ERROR (unmapping host buffers): %s (%i)", err.what(), err.err());
+        }
+    }
+
+    // marks the photon buffer of a slot as lent out,
+    // returns false if it is still in use
+    bool TryLendPhotons(unsigned int bufferIndex)
+    {
+        boost::unique_lock<boost::mutex> guard(mutex);
+        if (slots[bufferIndex].photonsLent) return false;
+        slots[bufferIndex].photonsLent=true;
+        return true;
+    }
+
+    // returns the photon buffer of a slot once the last copy of the view is gone
+    struct ReturnPhotons
+    {
+        ReturnPhotons(shared_ptr<MappedHostBuffers_t> owner_, unsigned int bufferIndex_)
+        : owner(owner_), bufferIndex(bufferIndex_) {;}
+
+        void operator()(const void *)
+        {
+            boost::unique_lock<boost::mutex> guard(owner->mutex);
+            owner->slots[bufferIndex].photonsLent=false;
+        }
+
+        shared_ptr<MappedHostBuffers_t> owner;
+        unsigned int bufferIndex;
+    };
+
+    // the photon buffer needs to be lent using TryLendPhotons() first
+    I3CLSimPhotonSeriesView MakePhotonView(unsigned int bufferIndex, std::size_t numPhotons)
+    {
+        const I3CLSimPhoton *data = slots[bufferIndex].mappedOutputPhotons;
+        return I3CLSimPhotonSeriesView(data, numPhotons,
+                                       shared_ptr<const void>(static_cast<const void *>(data),
+                                                              ReturnPhotons(shared_from_this(), bufferIndex)));
+    }
+
+    cl::CommandQueue queue; // used for mapping and unmapping only
+    std::vector<Slot_t> slots;
+    boost::mutex mutex;
+};
 
 
 I3CLSimStepToPhotonConverterOpenCL::I3CLSimStepToPhotonConverterOpenCL(I3RandomServicePtr randomService,
@@ -72,7 +200,7 @@ statistics_total_kernel_calls_(0),
 statistics_total_num_photons_generated_(0),
 statistics_total_num_photons_atDOMs_(0),
 openCLStarted_(false),
-queueToOpenCL_(new I3CLSimQueue<ToOpenCLPair_t>(5)),
+queueToOpenCL_(new I3CLSimLockFreeQueue<ToOpenCLPair_t>(5)),
 queueFromOpenCL_(new I3CLSimQueue<I3CLSimStepToPhotonConverter::ConversionResult_t>(0)),
 randomService_(randomService),
 initialized_(false),
@@ -80,17 +208,40 @@ compiled_(false),
 useNativeMath_(useNativeMath),
 selectedDeviceIndex_(0),
 deviceIsSelected_(false),
-disableDoubleBuffering_(true),
+numBuffers_(1),
+useMappedBuffers_(false),
 doublePrecision_(false),
 stopDetectedPhotons_(false),
+compactPhotonOutput_(false),
+mediumPropertiesLookupTableBins_(0),
+opticalDepthTableBins_(0),
+useDOMGrid_(false),
+distanceCullingMargin_(NAN),
+photonSplittingFactor_(1),
+photonSplittingDistance_(10.*I3Units::m),
+photonRouletteDistance_(100.*I3Units::m),
 saveAllPhotons_(false),
 saveAllPhotonsPrescale_(0.001), // only save .1% of all photons when in "AllPhotons" mode
 fixedNumberOfAbsorptionLengths_(NAN),
 pancakeFactor_(1.),
 photonHistoryEntries_(0),
+tabulationStepLength_(1.*I3Units::m),
+tabulationDOMRadius_(NAN),
+tabulationSumOfPhotonWeights_(0.),
+hitOversizeFactor_(1.),
+hitDefaultDOMEfficiency_(1.),
+hitDOMEfficiencyGeneration_(0),
+hitDOMEfficiencyDeviceGeneration_(0),
+hitDOMEfficiencyKernelArg_(0),
+geoGridOMRadius_(0.f),
+domMaskGeneration_(0),
+domMaskDeviceGeneration_(0),
+domMaskKernelArg_(0),
+distanceCullingMaxDistPerAbsLen_(0.f),
 maxWorkgroupSize_(0),
 workgroupSize_(0),
-maxNumWorkitems_(10240)
+maxNumWorkitems_(10240),
+programBinaryCacheDirectory_(I3CLSimHelper::GetDefaultProgramBinaryCacheDirectory())
 {
     if (!randomService_) log_fatal("You need to supply a I3RandomService.");
     
@@ -108,21 +259,7 @@ maxNumWorkitems_(10240)
 
 I3CLSimStepToPhotonConverterOpenCL::~I3CLSimStepToPhotonConverterOpenCL()
 {
-    if (openCLThreadObj_)
-    {
-        if (openCLThreadObj_->joinable())
-        {
-            log_debug("Stopping the OpenCL worker thread..");
-            
-            openCLThreadObj_->interrupt();
-            
-            openCLThreadObj_->join(); // wait for it indefinitely
-            
-            log_debug("OpenCL worker thread stopped.");
-        }
-        
-        openCLThreadObj_.reset();
-    }
+    StopOpenCLThread();
     
     // reset buffers
     deviceBuffer_MWC_RNG_x.reset();
@@ -134,6 +271,20 @@ I3CLSimStepToPhotonConverterOpenCL::~I3CLSimStepToPhotonConverterOpenCL()
     deviceBuffer_PhotonHistory.clear();
 
     deviceBuffer_GeoLayerToOMNumIndexPerStringSet.reset();
+    deviceBuffer_GeoGridCellStart.reset();
+    deviceBuffer_GeoGridCellDoms.reset();
+    deviceBuffer_GeoGridDomPos.reset();
+    deviceBuffer_GeoGridDomIndex.reset();
+    deviceBuffer_DOMMask.reset();
+    deviceBuffer_DistanceField.reset();
+    deviceBuffer_TabulationValues.reset();
+    deviceBuffer_TabulationWeights.reset();
+    deviceBuffer_TabulationPhotonWeights.clear();
+    deviceBuffer_HitDOMEfficiencyOffsets.reset();
+    deviceBuffer_HitDOMEfficiencies.reset();
+    
+    // photon views that are still around keep their own reference
+    mappedHostBuffers_.reset();
     
     // reset pointers
     compiled_=false;
@@ -233,7 +384,11 @@ void I3CLSimStepToPhotonConverterOpenCL::Initialize()
     
     log_debug("basic OpenCL setup done.");
     
-    if (!saveAllPhotons_) {
+    if (!tabulationBinEdges_.empty()) {
+        // photons are never written in tabulation mode, keep a
+        // minimal output buffer (the kernel still expects one)
+        maxNumOutputPhotons_ = 1;
+    } else if (!saveAllPhotons_) {
         // start with a maximum number of output photons of the same size as the number of
         // input steps. Should be plenty..
         maxNumOutputPhotons_ = static_cast<uint32_t>(std::min(maxNumWorkitems_*10, static_cast<std::size_t>(std::numeric_limits<uint32_t>::max())));
@@ -267,6 +422,18 @@ void I3CLSimStepToPhotonConverterOpenCL::Initialize()
     deviceBuffer_PhotonHistory.clear();
     deviceBuffer_CurrentNumOutputPhotons.clear();
     deviceBuffer_GeoLayerToOMNumIndexPerStringSet.reset();
+    deviceBuffer_GeoGridCellStart.reset();
+    deviceBuffer_GeoGridCellDoms.reset();
+    deviceBuffer_GeoGridDomPos.reset();
+    deviceBuffer_GeoGridDomIndex.reset();
+    deviceBuffer_DOMMask.reset();
+    deviceBuffer_DistanceField.reset();
+    deviceBuffer_TabulationValues.reset();
+    deviceBuffer_TabulationWeights.reset();
+    deviceBuffer_TabulationPhotonWeights.clear();
+    deviceBuffer_HitDOMEfficiencyOffsets.reset();
+    deviceBuffer_HitDOMEfficiencies.reset();
+    mappedHostBuffers_.reset();
     
     
     // set up device buffers from existing host buffers
@@ -276,23 +443,35 @@ void I3CLSimStepToPhotonConverterOpenCL::Initialize()
     deviceBuffer_MWC_RNG_a = shared_ptr<cl::Buffer>
     (new cl::Buffer(*context_, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, MWC_RNG_a.size() * sizeof(uint32_t), &(MWC_RNG_a[0])));
     
-    if (!saveAllPhotons_) {
+    if ((UsesGeometry()) && (useDOMGrid_)) {
+        SetupDOMGridBuffers();
+    } else if (UsesGeometry()) {
         // no need for a geometry buffer if all photons are saved and no
         // geometry is necessary.
         deviceBuffer_GeoLayerToOMNumIndexPerStringSet = shared_ptr<cl::Buffer>
         (new cl::Buffer(*context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, geoLayerToOMNumIndexPerStringSetInfo_.size() * sizeof(unsigned short), &(geoLayerToOMNumIndexPerStringSetInfo_[0])));
     }
     
-    const unsigned int numBuffers = disableDoubleBuffering_?1:2;
+    if (UsesDistanceField()) {
+        SetupDistanceFieldBuffer();
+    }
+    
+    if (!tabulationBinEdges_.empty()) {
+        SetupTabulationBuffers();
+    }
+    
+    if (hitWavelengthAcceptance_) {
+        SetupHitConversionBuffers();
+    }
     
     // allocate empty buffers on the device
-    for (unsigned int i=0;i<numBuffers;++i)
+    for (unsigned int i=0;i<numBuffers_;++i)
     {
         deviceBuffer_InputSteps.push_back(shared_ptr<cl::Buffer>
         (new cl::Buffer(*context_, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, maxNumWorkitems_*sizeof(I3CLSimStep), NULL)));
         
         deviceBuffer_OutputPhotons.push_back(shared_ptr<cl::Buffer>
-        (new cl::Buffer(*context_, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, maxNumOutputPhotons_*sizeof(I3CLSimPhoton), NULL)));
+        (new cl::Buffer(*context_, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, maxNumOutputPhotons_*GetOutputPhotonRecordSize(), NULL)));
         
         deviceBuffer_CurrentNumOutputPhotons.push_back(shared_ptr<cl::Buffer>
         (new cl::Buffer(*context_, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizeof(uint32_t), NULL)));
@@ -310,20 +489,43 @@ void I3CLSimStepToPhotonConverterOpenCL::Initialize()
         }
     }
     
+    if (useMappedBuffers_) {
+        log_debug("Setting up mapped host buffers..");
+        
+        try {
+            mappedHostBuffers_ = shared_ptr<MappedHostBuffers_t>
+            (new MappedHostBuffers_t(*context_, *(queue_[uploadQueueIndex]),
+                                     numBuffers_, maxNumWorkitems_, maxNumOutputPhotons_,
+                                     photonHistoryEntries_));
+        } catch (cl::Error &err) {
+            log_fatal("OpenCL ERROR (mapping host buffers): %s (%i)", err.what(), err.err());
+        }
+    }
+    
     log_debug("Device buffers are set up.");
     
     log_debug("Configuring kernel.");
-    for (unsigned int i=0;i<numBuffers;++i)
+    for (unsigned int i=0;i<numBuffers_;++i)
     {
         unsigned argN=0;
         
         kernel_[i]->setArg(argN++, *(deviceBuffer_CurrentNumOutputPhotons[i]));     // hit counter
         kernel_[i]->setArg(argN++, maxNumOutputPhotons_);                           // maximum number of possible hits
         
-        if (!saveAllPhotons_) {
+        if ((UsesGeometry()) && (useDOMGrid_)) {
+            argN = SetDOMGridKernelArgs(*(kernel_[i]), argN);               // DOM grid buffers and dimensions
+        } else if (UsesGeometry()) {
             kernel_[i]->setArg(argN++, *deviceBuffer_GeoLayerToOMNumIndexPerStringSet); // additional geometry information (did not fit into constant memory)
         }
         
+        if (UsesDistanceField()) {
+            argN = SetDistanceFieldKernelArgs(*(kernel_[i]), argN);         // distance field and culling parameters
+        }
+        
+        if (hitWavelengthAcceptance_) {
+            argN = SetHitConversionKernelArgs(*(kernel_[i]), argN);         // relative DOM efficiencies
+        }
+        
         kernel_[i]->setArg(argN++, *(deviceBuffer_InputSteps[i]));                  // the input steps
         kernel_[i]->setArg(argN++, *(deviceBuffer_OutputPhotons[i]));               // the output photons
 
@@ -331,12 +533,25 @@ void I3CLSimStepToPhotonConverterOpenCL::Initialize()
             kernel_[i]->setArg(argN++, *(deviceBuffer_PhotonHistory[i]));           // the photon history (the last N points where the photon scattered)
         }
 
+        if (!tabulationBinEdges_.empty()) {
+            argN = SetTabulationKernelArgs(*(kernel_[i]), argN, i);             // the photon table and the photon weights
+        }
+
         kernel_[i]->setArg(argN++, *deviceBuffer_MWC_RNG_x);                    // rng state
         kernel_[i]->setArg(argN++, *deviceBuffer_MWC_RNG_a);                    // rng state
 
     }
     log_debug("Kernel configured.");
     
+    StartOpenCLThread();
+    
+    log_debug("OpenCL setup complete.");
+    
+    initialized_=true;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::StartOpenCLThread()
+{
     log_debug("Starting the OpenCL worker thread..");
     openCLStarted_=false;
     
@@ -353,10 +568,459 @@ void I3CLSimStepToPhotonConverterOpenCL::Initialize()
     }        
     
     log_debug("OpenCL worker thread started.");
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::StopOpenCLThread()
+{
+    if (openCLThreadObj_)
+    {
+        if (openCLThreadObj_->joinable())
+        {
+            log_debug("Stopping the OpenCL worker thread..");
+            
+            openCLThreadObj_->interrupt();
+            
+            openCLThreadObj_->join(); // wait for it indefinitely
+            
+            log_debug("OpenCL worker thread stopped.");
+        }
+        
+        openCLThreadObj_.reset();
+    }
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetupDOMGridBuffers()
+{
+    deviceBuffer_GeoGridCellStart = shared_ptr<cl::Buffer>
+    (new cl::Buffer(*context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, geoGridCellStartBuffer_.size() * sizeof(uint32_t), &(geoGridCellStartBuffer_[0])));
+    deviceBuffer_GeoGridCellDoms = shared_ptr<cl::Buffer>
+    (new cl::Buffer(*context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, geoGridCellDomsBuffer_.size() * sizeof(uint32_t), &(geoGridCellDomsBuffer_[0])));
+    deviceBuffer_GeoGridDomPos = shared_ptr<cl::Buffer>
+    (new cl::Buffer(*context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, geoGridDomPosBuffer_.size() * sizeof(float), &(geoGridDomPosBuffer_[0])));
+    deviceBuffer_GeoGridDomIndex = shared_ptr<cl::Buffer>
+    (new cl::Buffer(*context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, geoGridDomIndexBuffer_.size() * sizeof(uint32_t), &(geoGridDomIndexBuffer_[0])));
+    
+    // start without any masks
+    {
+        boost::unique_lock<boost::mutex> guard(domMask_mutex_);
+        
+        const std::size_t wordsPerMask = (static_cast<std::size_t>(geoGridNumCellsAndDoms_[3])+31)/32;
+        domMaskBuffer_.assign(static_cast<std::size_t>(maxNumDOMMasks)*wordsPerMask, 0);
+        
+        deviceBuffer_DOMMask = shared_ptr<cl::Buffer>
+        (new cl::Buffer(*context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, domMaskBuffer_.size() * sizeof(uint32_t), &(domMaskBuffer_[0])));
+        
+        domMaskGeneration_=0;
+        domMaskDeviceGeneration_=0;
+        domMaskKernelGeneration_.assign(numBuffers_, 0);
+    }
+}
+
+unsigned int I3CLSimStepToPhotonConverterOpenCL::SetDOMGridKernelArgs(cl::Kernel &kernel, unsigned int argN)
+{
+    cl_float4 startAndCellWidth;
+    cl_uint4 numCells;
+    for (unsigned int i=0;i<4;++i)
+    {
+        startAndCellWidth.s[i] = geoGridStartAndCellWidth_[i];
+        numCells.s[i] = geoGridNumCellsAndDoms_[i];
+    }
+    const cl_float omRadius = geoGridOMRadius_;
     
-    log_debug("OpenCL setup complete.");
+    kernel.setArg(argN++, *deviceBuffer_GeoGridCellStart);     // DOM grid: first entry for each cell
+    kernel.setArg(argN++, *deviceBuffer_GeoGridCellDoms);      // DOM grid: DOMs in each cell
+    kernel.setArg(argN++, *deviceBuffer_GeoGridDomPos);        // DOM grid: DOM positions
+    kernel.setArg(argN++, *deviceBuffer_GeoGridDomIndex);      // DOM grid: string and DOM index for each DOM
+    kernel.setArg(argN++, startAndCellWidth);                  // DOM grid: lower corner and cell width
+    kernel.setArg(argN++, numCells);                           // DOM grid: number of cells along each axis (and number of DOMs)
+    kernel.setArg(argN++, omRadius);                           // DOM grid: OM radius
     
-    initialized_=true;
+    domMaskKernelArg_=argN;
+    kernel.setArg(argN++, *deviceBuffer_DOMMask);              // DOM masks (replaced by OpenCLThread_impl_updateDOMMask())
+    
+    return argN;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::GenerateDistanceField()
+{
+    I3CLSimHelper::DistanceFieldParameters_t fieldParameters;
+    I3CLSimHelper::GenerateDOMDistanceField(*geometry_,
+                                            distanceFieldBuffer_,
+                                            fieldParameters);
+    
+    for (unsigned int i=0;i<3;++i)
+    {
+        distanceFieldStartAndCellWidth_[i] = fieldParameters.start[i];
+        distanceFieldNumCells_[i] = fieldParameters.numCells[i];
+    }
+    distanceFieldStartAndCellWidth_[3] = fieldParameters.cellWidth;
+    distanceFieldNumCells_[3] = 0;
+    
+    // photon splitting only needs the field itself
+    if (isnan(distanceCullingMargin_)) {
+        distanceCullingMaxDistPerAbsLen_ = 0.f;
+        return;
+    }
+    
+    distanceCullingMaxDistPerAbsLen_ = static_cast<float>(I3CLSimHelper::GetMaxDistancePerAbsorptionLength(*mediumProperties_));
+    
+    log_debug("distance culling: photons travel at most %fm per absorption length",
+              distanceCullingMaxDistPerAbsLen_/I3Units::m);
+}
+
+bool I3CLSimStepToPhotonConverterOpenCL::UsesDistanceField() const
+{
+    if (!UsesGeometry()) return false;
+    return ((!isnan(distanceCullingMargin_)) || (photonSplittingFactor_ > 1));
+}
+
+bool I3CLSimStepToPhotonConverterOpenCL::UsesGeometry() const
+{
+    return ((!saveAllPhotons_) && (tabulationBinEdges_.empty()));
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetupTabulationBuffers()
+{
+    const std::size_t numBins = I3CLSimHelper::GetTabulationNumBins(tabulationBinEdges_);
+    
+    deviceBuffer_TabulationValues = shared_ptr<cl::Buffer>
+    (new cl::Buffer(*context_, CL_MEM_READ_WRITE, numBins*sizeof(float), NULL));
+    deviceBuffer_TabulationWeights = shared_ptr<cl::Buffer>
+    (new cl::Buffer(*context_, CL_MEM_READ_WRITE, numBins*sizeof(float), NULL));
+    
+    for (unsigned int i=0;i<numBuffers_;++i)
+    {
+        deviceBuffer_TabulationPhotonWeights.push_back(shared_ptr<cl::Buffer>
+        (new cl::Buffer(*context_, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, maxNumWorkitems_*sizeof(float), NULL)));
+    }
+    
+    // Tables can be large, so zero them in chunks instead of
+    // copying a full-size host buffer.
+    const std::size_t chunkSize = std::min(numBins, static_cast<std::size_t>(1024*1024));
+    const std::vector<float> zeros(chunkSize, 0.f);
+    for (std::size_t offset=0;offset<numBins;offset+=chunkSize)
+    {
+        const std::size_t thisChunkSize = std::min(chunkSize, numBins-offset);
+        queue_[uploadQueueIndex]->enqueueWriteBuffer(*deviceBuffer_TabulationValues, CL_TRUE, offset*sizeof(float), thisChunkSize*sizeof(float), &(zeros[0]));
+        queue_[uploadQueueIndex]->enqueueWriteBuffer(*deviceBuffer_TabulationWeights, CL_TRUE, offset*sizeof(float), thisChunkSize*sizeof(float), &(zeros[0]));
+    }
+    
+    {
+        boost::unique_lock<boost::mutex> guard(tabulation_mutex_);
+        tabulationSumOfPhotonWeights_=0.;
+    }
+}
+
+unsigned int I3CLSimStepToPhotonConverterOpenCL::SetTabulationKernelArgs(cl::Kernel &kernel, unsigned int argN, unsigned int bufferIndex)
+{
+    kernel.setArg(argN++, *deviceBuffer_TabulationValues);                      // table: sum of weights
+    kernel.setArg(argN++, *deviceBuffer_TabulationWeights);                     // table: sum of squared weights
+    kernel.setArg(argN++, *(deviceBuffer_TabulationPhotonWeights[bufferIndex])); // sum of photon weights per work item
+    
+    return argN;
+}
+
+std::vector<float> I3CLSimStepToPhotonConverterOpenCL::DownloadTabulationBuffer(cl::Buffer &buffer)
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL is not initialized!");
+    
+    if (tabulationBinEdges_.empty())
+        throw I3CLSimStepToPhotonConverter_exception("Tabulation is not enabled (see SetTabulationBins()).");
+    
+    std::vector<float> table(I3CLSimHelper::GetTabulationNumBins(tabulationBinEdges_));
+    
+    try {
+        // all kernels writing to the table have to be finished
+        queue_[computeQueueIndex]->finish();
+        queue_[downloadQueueIndex]->enqueueReadBuffer(buffer, CL_TRUE, 0, table.size()*sizeof(float), &(table[0]));
+    } catch (cl::Error &err) {
+        log_fatal("OpenCL ERROR (downloading the photon table): %s (%i)", err.what(), err.err());
+    }
+    
+    return table;
+}
+
+std::vector<float> I3CLSimStepToPhotonConverterOpenCL::GetTabulatedValues()
+{
+    if (!deviceBuffer_TabulationValues)
+        throw I3CLSimStepToPhotonConverter_exception("Tabulation is not enabled or the converter is not initialized.");
+    
+    return DownloadTabulationBuffer(*deviceBuffer_TabulationValues);
+}
+
+std::vector<float> I3CLSimStepToPhotonConverterOpenCL::GetTabulatedWeights()
+{
+    if (!deviceBuffer_TabulationWeights)
+        throw I3CLSimStepToPhotonConverter_exception("Tabulation is not enabled or the converter is not initialized.");
+    
+    return DownloadTabulationBuffer(*deviceBuffer_TabulationWeights);
+}
+
+double I3CLSimStepToPhotonConverterOpenCL::GetTabulatedSumOfPhotonWeights()
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL is not initialized!");
+    
+    if (tabulationBinEdges_.empty())
+        throw I3CLSimStepToPhotonConverter_exception("Tabulation is not enabled (see SetTabulationBins()).");
+    
+    boost::unique_lock<boost::mutex> guard(tabulation_mutex_);
+    return tabulationSumOfPhotonWeights_;
+}
+
+namespace {
+    // the relative DOM efficiencies in the order of the string and
+    // DOM indices used by the kernel (DOMs without an entry get the default)
+    std::vector<float> MakeHitDOMEfficiencyBuffer(const std::vector<int> &stringIndexToStringID,
+                                                  const std::vector<std::vector<unsigned int> > &domIndexToDomID_perStringIndex,
+                                                  const std::map<std::pair<int, unsigned int>, double> &efficiencies,
+                                                  double defaultEfficiency)
+    {
+        std::vector<float> buffer;
+        for (std::size_t stringIndex=0;stringIndex<stringIndexToStringID.size();++stringIndex)
+        {
+            const int stringID = stringIndexToStringID[stringIndex];
+            BOOST_FOREACH(const unsigned int domID, domIndexToDomID_perStringIndex[stringIndex])
+            {
+                std::map<std::pair<int, unsigned int>, double>::const_iterator it =
+                efficiencies.find(std::make_pair(stringID, domID));
+                buffer.push_back(static_cast<float>((it==efficiencies.end())?defaultEfficiency:it->second));
+            }
+        }
+        return buffer;
+    }
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetupHitConversionBuffers()
+{
+    // the offsets only change with the geometry
+    std::vector<uint32_t> offsets;
+    uint32_t numDOMs=0;
+    BOOST_FOREACH(const std::vector<unsigned int> &domIDs, domIndexToDomIDBuffer_perStringIndex_)
+    {
+        offsets.push_back(numDOMs);
+        numDOMs += static_cast<uint32_t>(domIDs.size());
+    }
+    
+    deviceBuffer_HitDOMEfficiencyOffsets = shared_ptr<cl::Buffer>
+    (new cl::Buffer(*context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, offsets.size() * sizeof(uint32_t), &(offsets[0])));
+    
+    boost::unique_lock<boost::mutex> guard(hitDOMEfficiency_mutex_);
+    
+    std::vector<float> efficiencies =
+    MakeHitDOMEfficiencyBuffer(stringIndexToStringIDBuffer_, domIndexToDomIDBuffer_perStringIndex_,
+                               hitDOMEfficiencies_, hitDefaultDOMEfficiency_);
+    
+    deviceBuffer_HitDOMEfficiencies = shared_ptr<cl::Buffer>
+    (new cl::Buffer(*context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, efficiencies.size() * sizeof(float), &(efficiencies[0])));
+    
+    hitDOMEfficiencyDeviceGeneration_=hitDOMEfficiencyGeneration_;
+    hitDOMEfficiencyKernelGeneration_.assign(numBuffers_, hitDOMEfficiencyGeneration_);
+}
+
+unsigned int I3CLSimStepToPhotonConverterOpenCL::SetHitConversionKernelArgs(cl::Kernel &kernel, unsigned int argN)
+{
+    kernel.setArg(argN++, *deviceBuffer_HitDOMEfficiencyOffsets); // hit conversion: first DOM efficiency for each string index
+    
+    hitDOMEfficiencyKernelArg_=argN;
+    kernel.setArg(argN++, *deviceBuffer_HitDOMEfficiencies);      // hit conversion: DOM efficiencies (replaced by OpenCLThread_impl_updateHitDOMEfficiencies())
+    
+    return argN;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_updateHitDOMEfficiencies(unsigned int bufferIndex)
+{
+    boost::unique_lock<boost::mutex> guard(hitDOMEfficiency_mutex_);
+    
+    if (hitDOMEfficiencyKernelGeneration_[bufferIndex]==hitDOMEfficiencyGeneration_) return;
+    
+    try {
+        if (hitDOMEfficiencyDeviceGeneration_!=hitDOMEfficiencyGeneration_) {
+            // Upload a new buffer instead of writing to the old one,
+            // kernels enqueued before keep using the previous efficiencies.
+            std::vector<float> efficiencies =
+            MakeHitDOMEfficiencyBuffer(stringIndexToStringIDBuffer_, domIndexToDomIDBuffer_perStringIndex_,
+                                       hitDOMEfficiencies_, hitDefaultDOMEfficiency_);
+            
+            deviceBuffer_HitDOMEfficiencies = shared_ptr<cl::Buffer>
+            (new cl::Buffer(*context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, efficiencies.size() * sizeof(float), &(efficiencies[0])));
+            hitDOMEfficiencyDeviceGeneration_=hitDOMEfficiencyGeneration_;
+            
+            log_debug("[%u] uploaded new DOM efficiencies", bufferIndex);
+        }
+        
+        kernel_[bufferIndex]->setArg(hitDOMEfficiencyKernelArg_, *deviceBuffer_HitDOMEfficiencies);
+    } catch (cl::Error &err) {
+        log_fatal("OpenCL ERROR (uploading DOM efficiencies): %s (%i)", err.what(), err.err());
+    }
+    
+    hitDOMEfficiencyKernelGeneration_[bufferIndex]=hitDOMEfficiencyDeviceGeneration_;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetupDistanceFieldBuffer()
+{
+    deviceBuffer_DistanceField = shared_ptr<cl::Buffer>
+    (new cl::Buffer(*context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, distanceFieldBuffer_.size() * sizeof(float), &(distanceFieldBuffer_[0])));
+}
+
+unsigned int I3CLSimStepToPhotonConverterOpenCL::SetDistanceFieldKernelArgs(cl::Kernel &kernel, unsigned int argN)
+{
+    cl_float4 startAndCellWidth;
+    cl_uint4 numCells;
+    for (unsigned int i=0;i<4;++i)
+    {
+        startAndCellWidth.s[i] = distanceFieldStartAndCellWidth_[i];
+        numCells.s[i] = distanceFieldNumCells_[i];
+    }
+    const cl_float maxDistPerAbsLen = distanceCullingMaxDistPerAbsLen_;
+    const cl_float margin = static_cast<float>(distanceCullingMargin_);
+    
+    kernel.setArg(argN++, *deviceBuffer_DistanceField);        // distance field: lower bound on the distance to the closest DOM for each cell
+    kernel.setArg(argN++, startAndCellWidth);                  // distance field: lower corner and cell width
+    kernel.setArg(argN++, numCells);                           // distance field: number of cells along each axis
+    kernel.setArg(argN++, maxDistPerAbsLen);                   // the largest distance a photon can travel per absorption length
+    kernel.setArg(argN++, margin);                             // the culling margin in absorption lengths
+    
+    return argN;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetDOMMask(uint16_t maskIndex, const std::set<std::pair<int, unsigned int> > &maskedDOMs)
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL is not initialized!");
+    
+    if ((!UsesGeometry()) || (!useDOMGrid_))
+        throw I3CLSimStepToPhotonConverter_exception("DOM masks can only be used with the DOM grid (see SetUseDOMGrid()).");
+    
+    if ((maskIndex==0) || (maskIndex>=maxNumDOMMasks))
+        throw I3CLSimStepToPhotonConverter_exception("Invalid DOM mask index " + boost::lexical_cast<std::string>(maskIndex) + ".");
+    
+    // the DOMs are stored ordered by string index and DOM index
+    // in the grid buffers, see GenerateDOMGridGeometrySource()
+    const std::size_t wordsPerMask = (static_cast<std::size_t>(geoGridNumCellsAndDoms_[3])+31)/32;
+    std::vector<uint32_t> mask(wordsPerMask, 0);
+    
+    std::size_t flatIndex=0;
+    for (std::size_t stringIndex=0;stringIndex<stringIndexToStringIDBuffer_.size();++stringIndex)
+    {
+        const int stringID = stringIndexToStringIDBuffer_[stringIndex];
+        const std::vector<unsigned int> &domIDs = domIndexToDomIDBuffer_perStringIndex_[stringIndex];
+        
+        for (std::size_t domIndex=0;domIndex<domIDs.size();++domIndex,++flatIndex)
+        {
+            if (maskedDOMs.count(std::make_pair(stringID, domIDs[domIndex]))==0) continue;
+            mask[flatIndex/32] |= (static_cast<uint32_t>(1) << (flatIndex%32));
+        }
+    }
+    
+    boost::unique_lock<boost::mutex> guard(domMask_mutex_);
+    
+    std::vector<uint32_t>::iterator maskStart = domMaskBuffer_.begin() + static_cast<std::size_t>(maskIndex)*wordsPerMask;
+    if (std::equal(mask.begin(), mask.end(), maskStart)) return; // nothing changed
+    
+    std::copy(mask.begin(), mask.end(), maskStart);
+    ++domMaskGeneration_;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_updateDOMMask(unsigned int bufferIndex)
+{
+    boost::unique_lock<boost::mutex> guard(domMask_mutex_);
+    
+    if (domMaskKernelGeneration_[bufferIndex]==domMaskGeneration_) return;
+    
+    try {
+        if (domMaskDeviceGeneration_!=domMaskGeneration_) {
+            // Upload a new buffer instead of writing to the old one,
+            // kernels enqueued before keep using the previous masks.
+            deviceBuffer_DOMMask = shared_ptr<cl::Buffer>
+            (new cl::Buffer(*context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, domMaskBuffer_.size() * sizeof(uint32_t), &(domMaskBuffer_[0])));
+            domMaskDeviceGeneration_=domMaskGeneration_;
+            
+            log_debug("[%u] uploaded new DOM masks", bufferIndex);
+        }
+        
+        kernel_[bufferIndex]->setArg(domMaskKernelArg_, *deviceBuffer_DOMMask);
+    } catch (cl::Error &err) {
+        log_fatal("OpenCL ERROR (uploading DOM masks): %s (%i)", err.what(), err.err());
+    }
+    
+    domMaskKernelGeneration_[bufferIndex]=domMaskDeviceGeneration_;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::UpdateGeometry(I3CLSimSimpleGeometryConstPtr geometry)
+{
+    if (!initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL is not initialized!");
+
+    if (!geometry)
+        throw I3CLSimStepToPhotonConverter_exception("Geometry is (null)!");
+    
+    if (!UsesGeometry()) {
+        // the kernel does not know about the geometry
+        geometry_=geometry;
+        return;
+    }
+    
+    if (!useDOMGrid_)
+        throw I3CLSimStepToPhotonConverter_exception("The geometry can only be replaced after initialization if the DOM grid is used (see SetUseDOMGrid()).");
+    
+    if ((!queueToOpenCL_->empty()) || (!queueFromOpenCL_->empty()))
+        throw I3CLSimStepToPhotonConverter_exception("The geometry cannot be replaced while steps are being processed. Retrieve all results first.");
+
+    // The worker thread owns the kernels and uses the index
+    // buffers when receiving photons. It is idle at this point
+    // (all results have been retrieved), so just stop it while
+    // swapping the geometry.
+    StopOpenCLThread();
+    
+    log_debug("Replacing the geometry..");
+
+    geometry_=geometry;
+    
+    // the generated source does not change, so there is no need to re-compile
+    const std::string newGeometrySource = this->GetGeometrySource();
+    if (newGeometrySource != geometrySource_)
+        log_fatal("Internal error: the DOM grid geometry source depends on the geometry.");
+    
+    if (UsesDistanceField()) {
+        GenerateDistanceField();
+    }
+    
+    try {
+        BOOST_FOREACH(shared_ptr<cl::CommandQueue> &queue, queue_) {
+            queue->finish();
+        }
+        
+        SetupDOMGridBuffers();
+        if (UsesDistanceField()) {
+            SetupDistanceFieldBuffer();
+        }
+        if (hitWavelengthAcceptance_) {
+            // the efficiencies are stored by string and DOM index
+            SetupHitConversionBuffers();
+        }
+
+        for (unsigned int i=0;i<numBuffers_;++i)
+        {
+            // the grid arguments follow the hit counter and the maximum number of hits
+            unsigned int argN = SetDOMGridKernelArgs(*(kernel_[i]), 2);
+            
+            if (UsesDistanceField()) {
+                argN = SetDistanceFieldKernelArgs(*(kernel_[i]), argN);
+            }
+            
+            if (hitWavelengthAcceptance_) {
+                SetHitConversionKernelArgs(*(kernel_[i]), argN);
+            }
+        }
+    } catch (cl::Error &err) {
+        log_fatal("OpenCL ERROR (replacing the geometry): %s (%i)", err.what(), err.err());
+    }
+    
+    log_debug("Geometry replaced.");
+    
+    StartOpenCLThread();
 }
 
 namespace {
@@ -434,6 +1098,40 @@ std::string I3CLSimStepToPhotonConverterOpenCL::GetPreambleSource()
     }
     
     
+    // Fill a photon table instead of saving photons. There is
+    // no collision detection in this mode either.
+    if (!tabulationBinEdges_.empty()) {
+        preamble = preamble + "#define TABULATE\n";
+    }
+    
+    // stop photons that cannot reach any DOM anymore
+    if ((UsesGeometry()) && (!isnan(distanceCullingMargin_))) {
+        preamble = preamble + "#define DISTANCE_CULLING\n";
+    }
+    
+    // split photons close to DOMs, Russian roulette far away from them
+    if ((UsesGeometry()) && (photonSplittingFactor_ > 1)) {
+        preamble = preamble + "#define PHOTON_SPLITTING\n";
+        preamble = preamble + "#define PHOTON_SPLITTING_FACTOR " + boost::lexical_cast<std::string>(photonSplittingFactor_) + "u\n";
+        if (doublePrecision_) {
+            preamble = preamble + "#define PHOTON_SPLITTING_DISTANCE " + ToDoubleString(photonSplittingDistance_) + "\n";
+            preamble = preamble + "#define PHOTON_ROULETTE_DISTANCE " + ToDoubleString(photonRouletteDistance_) + "\n";
+        } else {
+            preamble = preamble + "#define PHOTON_SPLITTING_DISTANCE " + ToFloatString(photonSplittingDistance_) + "\n";
+            preamble = preamble + "#define PHOTON_ROULETTE_DISTANCE " + ToFloatString(photonRouletteDistance_) + "\n";
+        }
+    }
+    
+    // write the compact photon record (expanded on the host)
+    if (compactPhotonOutput_) {
+        preamble = preamble + "#define COMPACT_PHOTON_OUTPUT\n";
+    }
+    
+    // apply the DOM acceptance on the device and only write hits
+    if (hitWavelengthAcceptance_) {
+        preamble = preamble + "#define HIT_CONVERSION\n";
+    }
+    
     // should the photon history be saved?
     if (photonHistoryEntries_>0) {
         preamble = preamble + "#define SAVE_PHOTON_HISTORY\n";
@@ -527,21 +1225,86 @@ std::string I3CLSimStepToPhotonConverterOpenCL::GetWlenBiasSource()
 
 std::string I3CLSimStepToPhotonConverterOpenCL::GetMediumPropertiesSource()
 {
-    return I3CLSimHelper::GenerateMediumPropertiesSource(*mediumProperties_);
+    return I3CLSimHelper::GenerateMediumPropertiesSource(*mediumProperties_,
+                                                         mediumPropertiesLookupTableBins_,
+                                                         opticalDepthTableBins_);
 }
 
 std::string I3CLSimStepToPhotonConverterOpenCL::GetGeometrySource()
 {
-    if (!saveAllPhotons_) {
+    if ((UsesGeometry()) && (useDOMGrid_)) {
+        I3CLSimHelper::DOMGridParameters_t gridParameters;
+        const std::string source =
+        I3CLSimHelper::GenerateDOMGridGeometrySource(*geometry_,
+                                                     geoGridCellStartBuffer_,
+                                                     geoGridCellDomsBuffer_,
+                                                     geoGridDomPosBuffer_,
+                                                     geoGridDomIndexBuffer_,
+                                                     gridParameters,
+                                                     stringIndexToStringIDBuffer_,
+                                                     domIndexToDomIDBuffer_perStringIndex_,
+                                                     domIndexToDomPosBuffer_perStringIndex_);
+        
+        for (unsigned int i=0;i<3;++i)
+        {
+            geoGridStartAndCellWidth_[i] = gridParameters.start[i];
+            geoGridNumCellsAndDoms_[i] = gridParameters.numCells[i];
+        }
+        geoGridStartAndCellWidth_[3] = gridParameters.cellWidth;
+        geoGridNumCellsAndDoms_[3] = gridParameters.numDoms;
+        geoGridOMRadius_ = gridParameters.omRadius;
+        
+        return source;
+    } else if (UsesGeometry()) {
         return I3CLSimHelper::GenerateGeometrySource(*geometry_,
                                                       geoLayerToOMNumIndexPerStringSetInfo_,
                                                       stringIndexToStringIDBuffer_,
-                                                      domIndexToDomIDBuffer_perStringIndex_);
+                                                      domIndexToDomIDBuffer_perStringIndex_,
+                                                      domIndexToDomPosBuffer_perStringIndex_);
     } else {
         return std::string("");
     }
 }
 
+std::string I3CLSimStepToPhotonConverterOpenCL::GetTabulationSource()
+{
+    if (tabulationBinEdges_.empty()) return std::string("");
+    
+    return I3CLSimHelper::GenerateTabulationSource(tabulationBinEdges_,
+                                                   tabulationStepLength_,
+                                                   tabulationParticle_,
+                                                   *tabulationWavelengthAcceptance_,
+                                                   *tabulationAngularAcceptance_,
+                                                   tabulationDOMRadius_);
+}
+
+std::string I3CLSimStepToPhotonConverterOpenCL::GetHitConversionSource()
+{
+    if (!hitWavelengthAcceptance_) return std::string("");
+    
+    std::ostringstream code;
+    
+    code << "\n";
+    code << "///////////////// BEGIN hit conversion ////////////\n";
+    code << "\n";
+    
+    // hits are moved forward along the photon direction by this
+    // fraction of their distance to the DOM center (see saveHit())
+    code << "#define HIT_TIME_CORRECTION_FACTOR " << ToFloatString(1.-pancakeFactor_/hitOversizeFactor_) << "\n";
+    code << "\n";
+    
+    code << hitWavelengthAcceptance_->GetOpenCLFunction("getHitWavelengthAcceptance");
+    code << "\n";
+    code << hitAngularAcceptance_->GetOpenCLFunction("getHitAngularAcceptance");
+    code << "\n";
+    
+    code << "\n";
+    code << "///////////////// END hit conversion ////////////\n";
+    code << "\n";
+    
+    return code.str();
+}
+
 static std::string 
 loadKernel(const std::string& name, bool header)
 {
@@ -553,7 +1316,11 @@ loadKernel(const std::string& name, bool header)
 
 std::string I3CLSimStepToPhotonConverterOpenCL::GetCollisionDetectionSource(bool header)
 {
-    return loadKernel("sparse_collision_kernel", header);
+    if (useDOMGrid_) {
+        return loadKernel("grid_collision_kernel", header);
+    } else {
+        return loadKernel("sparse_collision_kernel", header);
+    }
 }
 
 void I3CLSimStepToPhotonConverterOpenCL::Compile()
@@ -572,7 +1339,7 @@ void I3CLSimStepToPhotonConverterOpenCL::Compile()
     if (!mediumProperties_)
         throw I3CLSimStepToPhotonConverter_exception("MediumProperties not set!");
     
-    if (!geometry_)
+    if ((!geometry_) && (tabulationBinEdges_.empty()))
         throw I3CLSimStepToPhotonConverter_exception("Geometry not set!");
     
     if (!deviceIsSelected_)
@@ -581,20 +1348,73 @@ void I3CLSimStepToPhotonConverterOpenCL::Compile()
     if ((saveAllPhotons_) && (stopDetectedPhotons_))
         throw I3CLSimStepToPhotonConverter_exception("Internal error: both the saveAllPhotons and stopDetectedPhotons options are set at the same time.");
     
+    if ((compactPhotonOutput_) && (saveAllPhotons_))
+        throw I3CLSimStepToPhotonConverter_exception("The compactPhotonOutput option cannot be used together with saveAllPhotons.");
+    
+    if ((compactPhotonOutput_) && (photonHistoryEntries_>0))
+        throw I3CLSimStepToPhotonConverter_exception("The compactPhotonOutput option cannot be used together with photon histories.");
+
+    if ((photonSplittingFactor_ > 1) && (saveAllPhotons_))
+        throw I3CLSimStepToPhotonConverter_exception("Photon splitting cannot be used together with saveAllPhotons.");
+
+    if ((photonSplittingFactor_ > 1) && (photonHistoryEntries_ > 0))
+        throw I3CLSimStepToPhotonConverter_exception("Photon splitting cannot be used together with photon histories.");
+
+    if ((photonSplittingFactor_ > 1) && (photonSplittingDistance_ >= photonRouletteDistance_))
+        throw I3CLSimStepToPhotonConverter_exception("The photon splitting distance has to be smaller than the roulette distance.");
+    
+    if (!tabulationBinEdges_.empty()) {
+        if (saveAllPhotons_)
+            throw I3CLSimStepToPhotonConverter_exception("Tabulation cannot be used together with saveAllPhotons.");
+        
+        if (photonHistoryEntries_ > 0)
+            throw I3CLSimStepToPhotonConverter_exception("Tabulation cannot be used together with photon histories.");
+        
+        if (photonSplittingFactor_ > 1)
+            throw I3CLSimStepToPhotonConverter_exception("Tabulation cannot be used together with photon splitting.");
+        
+        if ((!tabulationWavelengthAcceptance_) || (!tabulationAngularAcceptance_) || (isnan(tabulationDOMRadius_)))
+            throw I3CLSimStepToPhotonConverter_exception("Tabulation efficiencies not set!");
+    }
+    
+    if (hitWavelengthAcceptance_) {
+        if (!stopDetectedPhotons_)
+            throw I3CLSimStepToPhotonConverter_exception("The hit conversion needs stopDetectedPhotons.");
+        
+        if (saveAllPhotons_)
+            throw I3CLSimStepToPhotonConverter_exception("The hit conversion cannot be used together with saveAllPhotons.");
+        
+        if (compactPhotonOutput_)
+            throw I3CLSimStepToPhotonConverter_exception("The hit conversion cannot be used together with compactPhotonOutput.");
+        
+        if (photonHistoryEntries_ > 0)
+            throw I3CLSimStepToPhotonConverter_exception("The hit conversion cannot be used together with photon histories.");
+        
+        if (!tabulationBinEdges_.empty())
+            throw I3CLSimStepToPhotonConverter_exception("The hit conversion cannot be used together with tabulation.");
+    }
+    
     prependSource_ = this->GetPreambleSource();
     wlenGeneratorSource_ = this->GetWlenGeneratorSource();
     wlenBiasSource_ = this->GetWlenBiasSource();
     
     mediumPropertiesSource_ = this->GetMediumPropertiesSource();
     
-    if (!saveAllPhotons_) {
+    if (UsesGeometry()) {
         geometrySource_ = this->GetGeometrySource();
+        
+        if (UsesDistanceField()) {
+            GenerateDistanceField();
+        }
     } else {
         geometrySource_ = "";
     }
     
+    tabulationSource_ = this->GetTabulationSource();
+    hitConversionSource_ = this->GetHitConversionSource();
+    
     propagationKernelSource_  = loadKernel("propagation_kernel", true);
-    if (!saveAllPhotons_) {
+    if (UsesGeometry()) {
         propagationKernelSource_ += this->GetCollisionDetectionSource(true);
         propagationKernelSource_ += this->GetCollisionDetectionSource(false);
     }
@@ -616,6 +1436,8 @@ std::string I3CLSimStepToPhotonConverterOpenCL::GetFullSource()
     code << wlenBiasSource_;
     code << mediumPropertiesSource_;
     code << geometrySource_;
+    code << tabulationSource_;
+    code << hitConversionSource_;
     code << propagationKernelSource_;
     
     return code.str();
@@ -723,66 +1545,131 @@ void I3CLSimStepToPhotonConverterOpenCL::SetupQueueAndKernel(const cl::Platform
         BuildOptions += "-DNO_FLASHER ";
     }
 
-    cl::Program program;
-    try {
-        // build the program
-        cl::Program::Sources source;
+    // Describe the device and driver for the program binary cache.
+    // A driver update or a different device will invalidate the cached binaries.
+    std::string programCacheKey;
+    std::string deviceDescription;
+    if (!programBinaryCacheDirectory_.empty()) {
+        deviceDescription  = platform.getInfo<CL_PLATFORM_NAME>() + "\n";
+        deviceDescription += platform.getInfo<CL_PLATFORM_VERSION>() + "\n";
+        deviceDescription += device.getInfo<CL_DEVICE_NAME>() + "\n";
+        deviceDescription += device.getInfo<CL_DEVICE_VENDOR>() + "\n";
+        deviceDescription += device.getInfo<CL_DEVICE_VERSION>() + "\n";
+        deviceDescription += device.getInfo<CL_DRIVER_VERSION>() + "\n";
         
-        source.push_back(std::make_pair(prependSource_.c_str(),prependSource_.size()));
-        source.push_back(std::make_pair(mwcrngKernelSource_.c_str(),mwcrngKernelSource_.size()));
-        source.push_back(std::make_pair(wlenGeneratorSource_.c_str(),wlenGeneratorSource_.size()));
-        source.push_back(std::make_pair(wlenBiasSource_.c_str(),wlenBiasSource_.size()));
-        source.push_back(std::make_pair(mediumPropertiesSource_.c_str(),mediumPropertiesSource_.size()));
-        if (!saveAllPhotons_) {
-            source.push_back(std::make_pair(geometrySource_.c_str(),geometrySource_.size()));
+        programCacheKey = I3CLSimHelper::GetProgramBinaryCacheKey(this->GetFullSource(), BuildOptions, deviceDescription);
+    }
+    
+    cl::Program program;
+    bool programFromCache=false;
+    
+    if (!programCacheKey.empty()) {
+        std::vector<unsigned char> binary;
+        if (I3CLSimHelper::LoadProgramBinary(programBinaryCacheDirectory_, programCacheKey, deviceDescription, binary)) {
+            try {
+                cl::Program::Binaries binaries(1, std::make_pair(static_cast<const void *>(&(binary[0])), binary.size()));
+                
+                program = cl::Program(*context_, devices, binaries);
+                log_debug("building from cached binary...");
+                program.build(devices, BuildOptions.c_str());
+                log_debug("...building finished.");
+                
+                programFromCache=true;
+                log_info("Loaded cached OpenCL program binary %s from \"%s\"", programCacheKey.c_str(), programBinaryCacheDirectory_.c_str());
+            } catch (cl::Error &err) {
+                log_warn("Could not use cached OpenCL program binary %s: %s (%i). Re-compiling from source.", programCacheKey.c_str(), err.what(), err.err());
+                program = cl::Program();
+            }
         }
-        source.push_back(std::make_pair(propagationKernelSource_.c_str(),propagationKernelSource_.size()));
-        
-        program = cl::Program(*context_, source);
-        log_debug("building...");
-        program.build(devices, BuildOptions.c_str());
-        log_debug("...building finished.");
-        
-        if (nvidiaVerboseCompile) {
-            std::string deviceName = device.getInfo<CL_DEVICE_NAME>();
+    }
+    
+    if (!programFromCache) {
+        try {
+            // build the program
+            cl::Program::Sources source;
+            
+            source.push_back(std::make_pair(prependSource_.c_str(),prependSource_.size()));
+            source.push_back(std::make_pair(mwcrngKernelSource_.c_str(),mwcrngKernelSource_.size()));
+            source.push_back(std::make_pair(wlenGeneratorSource_.c_str(),wlenGeneratorSource_.size()));
+            source.push_back(std::make_pair(wlenBiasSource_.c_str(),wlenBiasSource_.size()));
+            source.push_back(std::make_pair(mediumPropertiesSource_.c_str(),mediumPropertiesSource_.size()));
+            if (UsesGeometry()) {
+                source.push_back(std::make_pair(geometrySource_.c_str(),geometrySource_.size()));
+            }
+            if (!tabulationSource_.empty()) {
+                source.push_back(std::make_pair(tabulationSource_.c_str(),tabulationSource_.size()));
+            }
+            if (!hitConversionSource_.empty()) {
+                source.push_back(std::make_pair(hitConversionSource_.c_str(),hitConversionSource_.size()));
+            }
+            source.push_back(std::make_pair(propagationKernelSource_.c_str(),propagationKernelSource_.size()));
+            
+            program = cl::Program(*context_, source);
+            log_debug("building...");
+            program.build(devices, BuildOptions.c_str());
+            log_debug("...building finished.");
+            
+            if (nvidiaVerboseCompile) {
+                std::string deviceName = device.getInfo<CL_DEVICE_NAME>();
 #ifdef I3_LOG4CPLUS_LOGGING
-            // using LOG_IMPL will make this work even in Release build mode:
-            LOG_IMPL(INFO, "  * build status on %s\"", deviceName.c_str());
-            LOG_IMPL(INFO, "==============================");
-            LOG_IMPL(INFO, "Build Status: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device)).c_str());
-            LOG_IMPL(INFO, "Build Options: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device)).c_str());
-            LOG_IMPL(INFO, "Build Log: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device)).c_str());
-            LOG_IMPL(INFO, "==============================");
+                // using LOG_IMPL will make this work even in Release build mode:
+                LOG_IMPL(INFO, "  * build status on %s\"", deviceName.c_str());
+                LOG_IMPL(INFO, "==============================");
+                LOG_IMPL(INFO, "Build Status: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device)).c_str());
+                LOG_IMPL(INFO, "Build Options: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device)).c_str());
+                LOG_IMPL(INFO, "Build Log: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device)).c_str());
+                LOG_IMPL(INFO, "==============================");
 #else
-            log_info("  * build status on %s\"", deviceName.c_str());
-            log_info("==============================");
-            log_info("Build Status: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device)).c_str());
-            log_info("Build Options: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device)).c_str());
-            log_info("Build Log: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device)).c_str());
-            log_info("==============================");
+                log_info("  * build status on %s\"", deviceName.c_str());
+                log_info("==============================");
+                log_info("Build Status: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device)).c_str());
+                log_info("Build Options: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device)).c_str());
+                log_info("Build Log: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device)).c_str());
+                log_info("==============================");
 #endif
+            }
+        } catch (cl::Error &err) {
+            log_error("OpenCL ERROR (compile): %s (%i)", err.what(), err.err());
+            
+            std::string deviceName = device.getInfo<CL_DEVICE_NAME>();
+            log_error("  * build status on %s\"", deviceName.c_str());
+            log_error("==============================");
+            log_error("Build Status: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device)).c_str());
+            log_error("Build Options: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device)).c_str());
+            log_error("Build Log: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device)).c_str());
+            log_error("==============================");
+            
+            throw I3CLSimStepToPhotonConverter_exception("OpenCL error: could build the OpenCL program!");;
         }
-    } catch (cl::Error &err) {
-        log_error("OpenCL ERROR (compile): %s (%i)", err.what(), err.err());
-        
-        std::string deviceName = device.getInfo<CL_DEVICE_NAME>();
-        log_error("  * build status on %s\"", deviceName.c_str());
-        log_error("==============================");
-        log_error("Build Status: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device)).c_str());
-        log_error("Build Options: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device)).c_str());
-        log_error("Build Log: %s", boost::lexical_cast<std::string>(program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device)).c_str());
-        log_error("==============================");
-        
-        throw I3CLSimStepToPhotonConverter_exception("OpenCL error: could build the OpenCL program!");;
     }
     log_debug("code compiled.");
     
-    const unsigned int numBuffers = disableDoubleBuffering_?1:2;
-
-    // instantiate the command queue
+    // store the freshly built program in the binary cache
+    if ((!programFromCache) && (!programCacheKey.empty())) {
+        try {
+            VECTOR_CLASS< ::size_t> binarySizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+            VECTOR_CLASS<char *> binaryData = program.getInfo<CL_PROGRAM_BINARIES>();
+            
+            std::vector<unsigned char> binary;
+            if ((binarySizes.size()==1) && (binaryData.size()==1) && (binaryData[0]))
+                binary.assign(binaryData[0], binaryData[0]+binarySizes[0]);
+            
+            BOOST_FOREACH(char *ptr, binaryData) {delete [] ptr;}
+            
+            if (I3CLSimHelper::SaveProgramBinary(programBinaryCacheDirectory_, programCacheKey, deviceDescription, binary)) {
+                log_debug("Stored OpenCL program binary %s in \"%s\"", programCacheKey.c_str(), programBinaryCacheDirectory_.c_str());
+            } else {
+                log_warn("Could not store OpenCL program binary in cache directory \"%s\".", programBinaryCacheDirectory_.c_str());
+            }
+        } catch (cl::Error &err) {
+            log_warn("Could not retrieve the OpenCL program binary for caching: %s (%i)", err.what(), err.err());
+        }
+    }
+    
+    // instantiate the command queues
     log_debug("Initializing..");
     try {
-        for (unsigned int i=0;i<numBuffers;++i)
+        for (unsigned int i=0;i<numQueues;++i)
         {
 #ifdef DUMP_STATISTICS
             queue_.push_back(shared_ptr<cl::CommandQueue>(new cl::CommandQueue(*context_, device, CL_QUEUE_PROFILING_ENABLE)));
@@ -801,16 +1688,17 @@ void I3CLSimStepToPhotonConverterOpenCL::SetupQueueAndKernel(const cl::Platform
     log_debug("Creating kernel..");
     try {
         // instantiate the kernel object
-        for (unsigned int i=0;i<numBuffers;++i)
+        for (unsigned int i=0;i<numBuffers_;++i)
         {
             kernel_.push_back(shared_ptr<cl::Kernel>(new cl::Kernel(program, "propKernel")));
         }
 
         maxWorkgroupSize_ = kernel_[0]->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
         
-        if (!disableDoubleBuffering_) {
-            if (kernel_[1]->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device) != maxWorkgroupSize_) {
-                log_fatal("created two identical kernels and got different maximum work group sizes.");
+        for (unsigned int i=1;i<numBuffers_;++i)
+        {
+            if (kernel_[i]->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device) != maxWorkgroupSize_) {
+                log_fatal("created %u identical kernels and got different maximum work group sizes.", numBuffers_);
             }
         }
         
@@ -896,6 +1784,8 @@ bool I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_uploadSteps(boost::th
                                                                        uint32_t &out_stepsIdentifier,
                                                                        uint64_t &out_totalNumberOfPhotons,
                                                                        std::size_t &out_numberOfInputSteps,
+                                                                       I3CLSimStepSeriesConstPtr &out_steps,
+                                                                       VECTOR_CLASS<cl::Event> &out_uploadEvents,
                                                                        bool blocking
                                                                        )
 {
@@ -904,8 +1794,8 @@ bool I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_uploadSteps(boost::th
     uint32_t stepsIdentifier=0;
     I3CLSimStepSeriesConstPtr steps;
     
-    const uint32_t zeroCounterBufferSource=0;
-    VECTOR_CLASS<cl::Event> bufferWriteEvents(2);
+    // the copies are asynchronous, so the source has to outlive this function
+    static const uint32_t zeroCounterBufferSource=0;
 
     while (!steps)
     {
@@ -961,19 +1851,31 @@ bool I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_uploadSteps(boost::th
 #endif //DUMP_STATISTICS
     
     log_trace("[%u] copy steps to device", bufferIndex);
-    // copy steps to device
+    // copy steps to device. We do not wait for the copy to finish,
+    // the kernel will be enqueued with the upload events in its wait list.
+    out_uploadEvents.resize(2);
+    
+    // the steps are uploaded from pinned memory in mapped mode. The slot is
+    // only re-used once the kernel (which waits for this upload) is finished.
+    const I3CLSimStep *uploadSource = &((*steps)[0]);
+    if (mappedHostBuffers_) {
+        I3CLSimStep *mappedSteps = mappedHostBuffers_->slots[bufferIndex].mappedInputSteps;
+        std::memcpy(mappedSteps, uploadSource, steps->size()*sizeof(I3CLSimStep));
+        uploadSource = mappedSteps;
+    }
+    
     try {
-        queue_[bufferIndex]->enqueueWriteBuffer(*deviceBuffer_CurrentNumOutputPhotons[bufferIndex], CL_FALSE, 0, sizeof(uint32_t), &zeroCounterBufferSource, NULL, &(bufferWriteEvents[0]));
-        queue_[bufferIndex]->enqueueWriteBuffer(*deviceBuffer_InputSteps[bufferIndex], CL_FALSE, 0, steps->size()*sizeof(I3CLSimStep), &((*steps)[0]), NULL, &(bufferWriteEvents[1]));
-        queue_[bufferIndex]->flush(); // make sure it starts executing on the device
-        
-        log_trace("[%u] waiting for copy to finish", bufferIndex);
-        waitForOpenCLEventsYield(bufferWriteEvents);
+        queue_[uploadQueueIndex]->enqueueWriteBuffer(*deviceBuffer_CurrentNumOutputPhotons[bufferIndex], CL_FALSE, 0, sizeof(uint32_t), &zeroCounterBufferSource, NULL, &(out_uploadEvents[0]));
+        queue_[uploadQueueIndex]->enqueueWriteBuffer(*deviceBuffer_InputSteps[bufferIndex], CL_FALSE, 0, steps->size()*sizeof(I3CLSimStep), uploadSource, NULL, &(out_uploadEvents[1]));
+        queue_[uploadQueueIndex]->flush(); // make sure it starts executing on the device
     } catch (cl::Error &err) {
         log_fatal("[%u] OpenCL ERROR (memcpy to device): %s (%i)", bufferIndex, err.what(), err.err());
     }
-    log_trace("[%u] copied steps to device", bufferIndex);
+    log_trace("[%u] copy of steps to device enqueued", bufferIndex);
     
+    // keep the host copy alive until the upload is finished
+    // (not necessary if it has been copied to pinned memory)
+    if (!mappedHostBuffers_) out_steps = steps;
     out_numberOfInputSteps = steps->size();
     
     return true;
@@ -981,20 +1883,31 @@ bool I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_uploadSteps(boost::th
 
 void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_runKernel(unsigned int bufferIndex,
                                                                      cl::Event &kernelFinishEvent,
-                                                                     std::size_t numberOfInputSteps)
+                                                                     std::size_t numberOfInputSteps,
+                                                                     const VECTOR_CLASS<cl::Event> &uploadEvents)
 {
+    // masks for the steps in this buffer are set by now
+    if ((UsesGeometry()) && (useDOMGrid_)) {
+        OpenCLThread_impl_updateDOMMask(bufferIndex);
+    }
+    
+    // the same goes for the DOM efficiencies
+    if (hitWavelengthAcceptance_) {
+        OpenCLThread_impl_updateHitDOMEfficiencies(bufferIndex);
+    }
+    
     // run the kernel
     log_trace("[%u] enqueuing kernel..", bufferIndex);
 
     try {
         // configure which input buffers to use
-        queue_[bufferIndex]->enqueueNDRangeKernel(*(kernel_[bufferIndex]), 
-                                                  cl::NullRange,    // current implementations force this to be NULL
-                                                  cl::NDRange(numberOfInputSteps),  // number of work items
-                                                  cl::NDRange(workgroupSize_),
-                                                  NULL, //&(bufferWriteEvents),  // wait for buffers to be filled
-                                                  &kernelFinishEvent); // signal when finished
-        queue_[bufferIndex]->flush(); // make sure it begins executing on the device
+        queue_[computeQueueIndex]->enqueueNDRangeKernel(*(kernel_[bufferIndex]), 
+                                                        cl::NullRange,    // current implementations force this to be NULL
+                                                        cl::NDRange(numberOfInputSteps),  // number of work items
+                                                        cl::NDRange(workgroupSize_),
+                                                        &uploadEvents,    // wait for buffers to be filled
+                                                        &kernelFinishEvent); // signal when finished
+        queue_[computeQueueIndex]->flush(); // make sure it begins executing on the device
     } catch (cl::Error &err) {
         log_fatal("OpenCL ERROR (running kernel): %s (%i)", err.what(), err.err());
     }
@@ -1006,21 +1919,14 @@ namespace {
     // converts from the internal photon history fromat (flat array of float4)
     // to a vector of I3CLSimPhotonHistory objects. The output stores photons
     // in forward order (i.e. the most recent scatter listed last)
-    I3CLSimPhotonHistorySeriesPtr ConvertPhotonHistories(const std::vector<cl_float4> &rawData,
-                                                         const I3CLSimPhotonSeries &photons,
+    // "rawData" holds photonHistoryEntries entries for each photon.
+    I3CLSimPhotonHistorySeriesPtr ConvertPhotonHistories(const cl_float4 *rawData,
+                                                         const I3CLSimPhotonSeriesView &photons,
                                                          std::size_t photonHistoryEntries)
     {
-        if (rawData.size() % photonHistoryEntries != 0)
-            log_fatal("Internal logic error: rawData.size() (==%zu) is not a multiple of photonHistoryEntries (==%zu)",
-                     rawData.size(), photonHistoryEntries);
-        
-        if (rawData.size()/photonHistoryEntries != photons.size())
-            log_fatal("internal logic error: rawData.size()/photonHistoryEntries [==%zu/%zu] != photons.size() [==%zu]",
-                      rawData.size(),photonHistoryEntries,photons.size());
-        
         I3CLSimPhotonHistorySeriesPtr output(new I3CLSimPhotonHistorySeries());
         
-        for (std::size_t i=0;i<rawData.size()/photonHistoryEntries;++i)
+        for (std::size_t i=0;i<photons.size();++i)
         {
             // insert a new history for the current photon
             output->push_back(I3CLSimPhotonHistory());
@@ -1069,17 +1975,22 @@ void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_downloadPhotons(boost
     shouldBreak=false;
    
     I3CLSimPhotonSeriesPtr photons;
+    I3CLSimPhotonSeriesView photonView;
     I3CLSimPhotonHistorySeriesPtr photonHistories;
     shared_ptr<std::vector<cl_float4> > photonHistoriesRaw;
     
     try {
+        // in mapped mode, the counter is read into pinned memory
         uint32_t numberOfGeneratedPhotons;
+        uint32_t *numberOfGeneratedPhotonsTarget = &numberOfGeneratedPhotons;
+        if (mappedHostBuffers_) numberOfGeneratedPhotonsTarget = mappedHostBuffers_->slots[bufferIndex].mappedNumOutputPhotons;
         {
             cl::Event copyComplete;
-            queue_[bufferIndex]->enqueueReadBuffer(*deviceBuffer_CurrentNumOutputPhotons[bufferIndex], CL_FALSE, 0, sizeof(uint32_t), &numberOfGeneratedPhotons, NULL, &copyComplete);
-            queue_[bufferIndex]->flush(); // make sure it starts executing on the device
+            queue_[downloadQueueIndex]->enqueueReadBuffer(*deviceBuffer_CurrentNumOutputPhotons[bufferIndex], CL_FALSE, 0, sizeof(uint32_t), numberOfGeneratedPhotonsTarget, NULL, &copyComplete);
+            queue_[downloadQueueIndex]->flush(); // make sure it starts executing on the device
             waitForOpenCLEventYield(copyComplete);
         }
+        numberOfGeneratedPhotons = *numberOfGeneratedPhotonsTarget;
         
 #ifdef I3_LOG4CPLUS_LOGGING
         LOG_IMPL(INFO, "Num photons to copy (buffer %u): %" PRIu32, bufferIndex, numberOfGeneratedPhotons);
@@ -1101,7 +2012,92 @@ void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_downloadPhotons(boost
             numberOfGeneratedPhotons = maxNumOutputPhotons_;
         }
         
-        if (numberOfGeneratedPhotons>0)
+        // the pinned photon buffer can only be used if nobody
+        // is looking at the results of the previous kernel call anymore.
+        // (Compact photons and hits have to be expanded anyway, so they are never lent.)
+        bool useMappedPhotons=false;
+        if ((mappedHostBuffers_) && (numberOfGeneratedPhotons>0) && (!compactPhotonOutput_) && (!hitWavelengthAcceptance_)) {
+            useMappedPhotons = mappedHostBuffers_->TryLendPhotons(bufferIndex);
+            if (!useMappedPhotons)
+                log_debug("[%u] mapped photon buffer is still in use, copying results.", bufferIndex);
+        }
+        
+        if (useMappedPhotons)
+        {
+            MappedHostBuffers_t::Slot_t &slot = mappedHostBuffers_->slots[bufferIndex];
+            
+            VECTOR_CLASS<cl::Event> copyComplete((photonHistoryEntries_>0)?2:1);
+            
+            queue_[downloadQueueIndex]->enqueueReadBuffer(*deviceBuffer_OutputPhotons[bufferIndex], CL_FALSE, 0, numberOfGeneratedPhotons*sizeof(I3CLSimPhoton), slot.mappedOutputPhotons, NULL, &copyComplete[0]);
+            
+            if (photonHistoryEntries_>0) {
+                queue_[downloadQueueIndex]->enqueueReadBuffer(*deviceBuffer_PhotonHistory[bufferIndex], CL_FALSE, 0, numberOfGeneratedPhotons*static_cast<std::size_t>(photonHistoryEntries_)*sizeof(cl_float4), slot.mappedPhotonHistory, NULL, &copyComplete[1]);
+            }
+            
+            queue_[downloadQueueIndex]->flush(); // make sure it starts executing on the device
+            waitForOpenCLEventsYield(copyComplete); // wait for the buffer(s) to be copied
+            
+            // the buffer is given back once the last copy of the view is gone
+            photonView = mappedHostBuffers_->MakePhotonView(bufferIndex, numberOfGeneratedPhotons);
+            
+            if (photonHistoryEntries_>0) {
+                photonHistories = ConvertPhotonHistories(slot.mappedPhotonHistory, photonView, photonHistoryEntries_);
+            }
+        }
+        else if ((numberOfGeneratedPhotons>0) && (compactPhotonOutput_))
+        {
+            // read the compact records into pinned memory (if there is any)
+            // or into a temporary buffer and expand them
+            std::vector<I3CLSimHelper::CompactPhoton_t> compactPhotonsBuffer;
+            I3CLSimHelper::CompactPhoton_t *compactPhotons;
+            if (mappedHostBuffers_) {
+                compactPhotons = reinterpret_cast<I3CLSimHelper::CompactPhoton_t *>(mappedHostBuffers_->slots[bufferIndex].mappedOutputPhotons);
+            } else {
+                compactPhotonsBuffer.resize(numberOfGeneratedPhotons);
+                compactPhotons = &(compactPhotonsBuffer[0]);
+            }
+            
+            cl::Event copyComplete;
+            queue_[downloadQueueIndex]->enqueueReadBuffer(*deviceBuffer_OutputPhotons[bufferIndex], CL_FALSE, 0, numberOfGeneratedPhotons*sizeof(I3CLSimHelper::CompactPhoton_t), compactPhotons, NULL, &copyComplete);
+            queue_[downloadQueueIndex]->flush(); // make sure it starts executing on the device
+            
+            // allocate the result vector while waiting for the copy to complete
+            photons = I3CLSimPhotonSeriesPtr(new I3CLSimPhotonSeries(numberOfGeneratedPhotons));
+            
+            waitForOpenCLEventYield(copyComplete);
+            
+            I3CLSimHelper::DecodeCompactPhotons(compactPhotons,
+                                                numberOfGeneratedPhotons,
+                                                domIndexToDomPosBuffer_perStringIndex_,
+                                                &((*photons)[0]));
+        }
+        else if ((numberOfGeneratedPhotons>0) && (hitWavelengthAcceptance_))
+        {
+            // same as above for hit records
+            std::vector<I3CLSimHelper::HitRecord_t> hitsBuffer;
+            I3CLSimHelper::HitRecord_t *hits;
+            if (mappedHostBuffers_) {
+                hits = reinterpret_cast<I3CLSimHelper::HitRecord_t *>(mappedHostBuffers_->slots[bufferIndex].mappedOutputPhotons);
+            } else {
+                hitsBuffer.resize(numberOfGeneratedPhotons);
+                hits = &(hitsBuffer[0]);
+            }
+            
+            cl::Event copyComplete;
+            queue_[downloadQueueIndex]->enqueueReadBuffer(*deviceBuffer_OutputPhotons[bufferIndex], CL_FALSE, 0, numberOfGeneratedPhotons*sizeof(I3CLSimHelper::HitRecord_t), hits, NULL, &copyComplete);
+            queue_[downloadQueueIndex]->flush(); // make sure it starts executing on the device
+            
+            // allocate the result vector while waiting for the copy to complete
+            photons = I3CLSimPhotonSeriesPtr(new I3CLSimPhotonSeries(numberOfGeneratedPhotons));
+            
+            waitForOpenCLEventYield(copyComplete);
+            
+            I3CLSimHelper::DecodeHitRecords(hits,
+                                            numberOfGeneratedPhotons,
+                                            domIndexToDomPosBuffer_perStringIndex_,
+                                            &((*photons)[0]));
+        }
+        else if (numberOfGeneratedPhotons>0)
         {
             VECTOR_CLASS<cl::Event> copyComplete((photonHistoryEntries_>0)?2:1);
             
@@ -1111,18 +2107,18 @@ void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_downloadPhotons(boost
                 photonHistoriesRaw = shared_ptr<std::vector<cl_float4> >(new std::vector<cl_float4>(numberOfGeneratedPhotons*static_cast<std::size_t>(photonHistoryEntries_)));
             }
             
-            queue_[bufferIndex]->enqueueReadBuffer(*deviceBuffer_OutputPhotons[bufferIndex], CL_FALSE, 0, numberOfGeneratedPhotons*sizeof(I3CLSimPhoton), &((*photons)[0]), NULL, &copyComplete[0]);
+            queue_[downloadQueueIndex]->enqueueReadBuffer(*deviceBuffer_OutputPhotons[bufferIndex], CL_FALSE, 0, numberOfGeneratedPhotons*sizeof(I3CLSimPhoton), &((*photons)[0]), NULL, &copyComplete[0]);
             
             if (photonHistoryEntries_>0) {
-                queue_[bufferIndex]->enqueueReadBuffer(*deviceBuffer_PhotonHistory[bufferIndex], CL_FALSE, 0, numberOfGeneratedPhotons*static_cast<std::size_t>(photonHistoryEntries_)*sizeof(cl_float4), &((*photonHistoriesRaw)[0]), NULL, &copyComplete[1]);
+                queue_[downloadQueueIndex]->enqueueReadBuffer(*deviceBuffer_PhotonHistory[bufferIndex], CL_FALSE, 0, numberOfGeneratedPhotons*static_cast<std::size_t>(photonHistoryEntries_)*sizeof(cl_float4), &((*photonHistoriesRaw)[0]), NULL, &copyComplete[1]);
             }
             
-            queue_[bufferIndex]->flush(); // make sure it starts executing on the device
+            queue_[downloadQueueIndex]->flush(); // make sure it starts executing on the device
             waitForOpenCLEventsYield(copyComplete); // wait for the buffer(s) to be copied
 
             // convert the histories to the external representation
             if (photonHistoriesRaw) {
-                photonHistories = ConvertPhotonHistories(*photonHistoriesRaw, *photons, photonHistoryEntries_);
+                photonHistories = ConvertPhotonHistories(&((*photonHistoriesRaw)[0]), I3CLSimPhotonSeriesView(photons), photonHistoryEntries_);
             }
         }
         else
@@ -1144,7 +2140,11 @@ void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_downloadPhotons(boost
     {
         boost::this_thread::restore_interruption ri(di);
         try {
-            queueFromOpenCL_->Put(ConversionResult_t(stepsIdentifier, photons, photonHistories));
+            if (photonView.valid()) {
+                queueFromOpenCL_->Put(ConversionResult_t(stepsIdentifier, photonView, photonHistories));
+            } else {
+                queueFromOpenCL_->Put(ConversionResult_t(stepsIdentifier, photons, photonHistories));
+            }
         } catch(boost::thread_interrupted &i) {
             log_debug("OpenCL thread was interrupted. closing.");
             shouldBreak=true;
@@ -1155,6 +2155,31 @@ void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_downloadPhotons(boost
     
 }
 
+void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl_downloadTabulationPhotonWeights(unsigned int bufferIndex,
+                                                                                          std::size_t numberOfInputSteps)
+{
+    std::vector<float> photonWeights(numberOfInputSteps);
+    
+    try {
+        cl::Event copyComplete;
+        queue_[downloadQueueIndex]->enqueueReadBuffer(*deviceBuffer_TabulationPhotonWeights[bufferIndex], CL_FALSE, 0, numberOfInputSteps*sizeof(float), &(photonWeights[0]), NULL, &copyComplete);
+        queue_[downloadQueueIndex]->flush(); // make sure it starts executing on the device
+        waitForOpenCLEventYield(copyComplete);
+    } catch (cl::Error &err) {
+        log_fatal("[%u] OpenCL ERROR (memcpy from device): %s (%i)", bufferIndex, err.what(), err.err());
+    }
+    
+    // sum up in double precision, there are a lot of photons in a table
+    double sumOfWeights=0.;
+    BOOST_FOREACH(const float weight, photonWeights)
+    {
+        sumOfWeights += static_cast<double>(weight);
+    }
+    
+    boost::unique_lock<boost::mutex> guard(tabulation_mutex_);
+    tabulationSumOfPhotonWeights_ += sumOfWeights;
+}
+
 boost::posix_time::ptime 
 I3CLSimStepToPhotonConverterOpenCL::DumpStatistics(const cl::Event &kernelFinishEvent,
                                                    const boost::posix_time::ptime &last_timestamp,
@@ -1214,10 +2239,10 @@ void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl(boost::this_thread::d
     // set things up here
     if (!context_) log_fatal("Internal error: context is (null)");
 
-    const std::size_t numBuffers = disableDoubleBuffering_?1:2;
+    const std::size_t numBuffers = numBuffers_;
     
-    if (queue_.size() != numBuffers) log_fatal("Internal error: queue_.size() != 2!");
-    if (kernel_.size() != numBuffers) log_fatal("Internal error: kernel_.size() != 2!");
+    if (queue_.size() != numQueues) log_fatal("Internal error: queue_.size() != %u!", static_cast<unsigned int>(numQueues));
+    if (kernel_.size() != numBuffers) log_fatal("Internal error: kernel_.size() != %zu!", numBuffers);
 
     BOOST_FOREACH(shared_ptr<cl::CommandQueue> &ptr, queue_) {
         if (!ptr) log_fatal("Internal error: queue_[] is (null)");
@@ -1226,11 +2251,11 @@ void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl(boost::this_thread::d
         if (!ptr) log_fatal("Internal error: kernel_[] is (null)");
     }
 
-    if (deviceBuffer_InputSteps.size() != numBuffers) log_fatal("Internal error: deviceBuffer_InputSteps.size() != 2!");
-    if (deviceBuffer_OutputPhotons.size() != numBuffers) log_fatal("Internal error: deviceBuffer_OutputPhotons.size() != 2!");
-    if (deviceBuffer_CurrentNumOutputPhotons.size() != numBuffers) log_fatal("Internal error: deviceBuffer_CurrentNumOutputPhotons.size() != 2!");
+    if (deviceBuffer_InputSteps.size() != numBuffers) log_fatal("Internal error: deviceBuffer_InputSteps.size() != %zu!", numBuffers);
+    if (deviceBuffer_OutputPhotons.size() != numBuffers) log_fatal("Internal error: deviceBuffer_OutputPhotons.size() != %zu!", numBuffers);
+    if (deviceBuffer_CurrentNumOutputPhotons.size() != numBuffers) log_fatal("Internal error: deviceBuffer_CurrentNumOutputPhotons.size() != %zu!", numBuffers);
     if (photonHistoryEntries_ > 0) {
-        if (deviceBuffer_PhotonHistory.size() != numBuffers) log_fatal("Internal error: deviceBuffer_PhotonHistory.size() != 2!");
+        if (deviceBuffer_PhotonHistory.size() != numBuffers) log_fatal("Internal error: deviceBuffer_PhotonHistory.size() != %zu!", numBuffers);
     }
     
     BOOST_FOREACH(shared_ptr<cl::Buffer> &ptr, deviceBuffer_InputSteps) {
@@ -1249,9 +2274,18 @@ void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl(boost::this_thread::d
         }
     }
 
-    if (!saveAllPhotons_) {
+    if ((UsesGeometry()) && (useDOMGrid_)) {
+        if ((!deviceBuffer_GeoGridCellStart) || (!deviceBuffer_GeoGridCellDoms) ||
+            (!deviceBuffer_GeoGridDomPos) || (!deviceBuffer_GeoGridDomIndex) ||
+            (!deviceBuffer_DOMMask))
+            log_fatal("Internal error: deviceBuffer_GeoGrid* is (null)");
+    } else if (UsesGeometry()) {
         if (!deviceBuffer_GeoLayerToOMNumIndexPerStringSet) log_fatal("Internal error: deviceBuffer_GeoLayerToOMNumIndexPerStringSet is (null)");
     }
+    if (!tabulationBinEdges_.empty()) {
+        if ((!deviceBuffer_TabulationValues) || (!deviceBuffer_TabulationWeights)) log_fatal("Internal error: deviceBuffer_Tabulation* is (null)");
+        if (deviceBuffer_TabulationPhotonWeights.size() != numBuffers) log_fatal("Internal error: deviceBuffer_TabulationPhotonWeights.size() != %zu!", numBuffers);
+    }
     if (!deviceBuffer_MWC_RNG_x) log_fatal("Internal error: deviceBuffer_MWC_RNG_x is (null)");
     if (!deviceBuffer_MWC_RNG_a) log_fatal("Internal error: deviceBuffer_MWC_RNG_a is (null)");
     
@@ -1265,116 +2299,108 @@ void I3CLSimStepToPhotonConverterOpenCL::OpenCLThread_impl(boost::this_thread::d
     std::vector<uint32_t> stepsIdentifier(numBuffers, 0);
     std::vector<uint64_t> totalNumberOfPhotons(numBuffers, 0);
     std::vector<std::size_t> numberOfSteps(numBuffers, 0);
+    std::vector<I3CLSimStepSeriesConstPtr> stepsInFlight(numBuffers);
+    std::vector<VECTOR_CLASS<cl::Event> > uploadEvents(numBuffers);
+    std::vector<cl::Event> kernelFinishEvents(numBuffers);
+    std::vector<bool> starving(numBuffers, false);
     
 #ifdef DUMP_STATISTICS
     boost::posix_time::ptime last_timestamp(boost::posix_time::microsec_clock::universal_time());
 #endif
     
-    unsigned int thisBuffer=0;
-    unsigned int otherBuffer=1;
-    bool otherBufferHasBeenCopied=false;
-    
-    if (!disableDoubleBuffering_) {
-        // swap buffers once to swap them back just a few lines later
-        std::swap(thisBuffer, otherBuffer);
-    }
+    // Buffers cycle through a ring: a free buffer gets new steps
+    // uploaded and its kernel enqueued right away (the kernel waits
+    // for the upload on the device). Buffers are retired in the order
+    // they were started, so results leave in the order steps arrived.
+    std::deque<unsigned int> buffersInFlight;
+    std::vector<unsigned int> freeBuffers;
+    for (unsigned int i=numBuffers;i>0;--i) freeBuffers.push_back(i-1);
     
     // start the main loop
+    bool shouldBreak=false; // shouldBreak is true if this thread has been signalled to terminate
     for (;;)
     {
-        if (!disableDoubleBuffering_) {
-            // swap buffers
-            std::swap(thisBuffer, otherBuffer);
-        }
-        
-        log_trace("buffers indices now: this==%u, other==%u", thisBuffer, otherBuffer);
-        
-        bool starving=false;
-        if ((!otherBufferHasBeenCopied) || (disableDoubleBuffering_)) {
-            if (!disableDoubleBuffering_) starving=true;
-            log_trace("[%u] starting \"this\" buffer copy (need to block)..", thisBuffer);
-            {
-                bool shouldBreak=false; // shouldBreak is true if this thread has been signalled to terminate
-                OpenCLThread_impl_uploadSteps(di, shouldBreak, thisBuffer, stepsIdentifier[thisBuffer], totalNumberOfPhotons[thisBuffer], numberOfSteps[thisBuffer]);
-                if (shouldBreak) break; // is thread termination being requested?
-            }
-            log_trace("[%u] this buffer has been copied..", thisBuffer);
-        } else {
-            // else: this buffer is already there!
-            log_trace("[%u] buffer is already there!", thisBuffer);
-        }
-        
-        // reset the "has-been-copied" flag
-        otherBufferHasBeenCopied=false;
-        
-        
-        // start the kernel
-        cl::Event kernelFinishEvent;
-        OpenCLThread_impl_runKernel(thisBuffer, kernelFinishEvent, numberOfSteps[thisBuffer]);
-
-        if (!disableDoubleBuffering_)
+        // keep the device busy: fill all free buffers from the input queue.
+        // Only block if there is nothing at all left to work on.
+        while (!freeBuffers.empty())
         {
-            // if there already is a new buffer available, copy it now, while the kernel is running
-            log_trace("[%u] Starting copy (other buffer)..", otherBuffer);
-
-            bool shouldBreak=false; // shouldBreak is true if this thread has been signalled to terminate
-            bool gotSomething = OpenCLThread_impl_uploadSteps(di, shouldBreak, otherBuffer, stepsIdentifier[otherBuffer], totalNumberOfPhotons[otherBuffer], numberOfSteps[otherBuffer], false);
-            if (shouldBreak) break;
+            const unsigned int thisBuffer = freeBuffers.back();
+            const bool blocking = buffersInFlight.empty();
+            
+            log_trace("[%u] starting buffer copy (%s)..", thisBuffer, blocking?"blocking":"non-blocking");
+            const bool gotSomething =
+            OpenCLThread_impl_uploadSteps(di, shouldBreak, thisBuffer,
+                                          stepsIdentifier[thisBuffer],
+                                          totalNumberOfPhotons[thisBuffer],
+                                          numberOfSteps[thisBuffer],
+                                          stepsInFlight[thisBuffer],
+                                          uploadEvents[thisBuffer],
+                                          blocking);
+            if (shouldBreak) break; // is thread termination being requested?
             
             if (!gotSomething) {
-                log_trace("[%u] copy (other buffer): queue empty!", otherBuffer);
-                // nothing on the queue
-                otherBufferHasBeenCopied=false;
-            } else {
-                log_trace("[%u] copy (other buffer):  done!", otherBuffer);
-                otherBufferHasBeenCopied=true;
+                log_trace("[%u] copy: queue empty!", thisBuffer);
+                break;
             }
+            freeBuffers.pop_back();
+            
+            // the device is idle if there is no other kernel in front of this one
+            starving[thisBuffer] = ((numBuffers>1) && (buffersInFlight.empty()));
+            
+            // start the kernel
+            OpenCLThread_impl_runKernel(thisBuffer, kernelFinishEvents[thisBuffer], numberOfSteps[thisBuffer], uploadEvents[thisBuffer]);
+            buffersInFlight.push_back(thisBuffer);
+            
+            log_trace("[%u] kernel enqueued, %zu buffer(s) in flight", thisBuffer, buffersInFlight.size());
         }
+        if (shouldBreak) break;
         
+        if (buffersInFlight.empty())
+            log_fatal("Internal error: no buffers in flight after a blocking upload.");
+        
+        // retire the oldest buffer
+        const unsigned int thisBuffer = buffersInFlight.front();
+        buffersInFlight.pop_front();
         
         log_trace("[%u] waiting for kernel..", thisBuffer);
 
         try {
             // wait for the kernel to finish
-            waitForOpenCLEventYield(kernelFinishEvent);
+            waitForOpenCLEventYield(kernelFinishEvents[thisBuffer]);
         } catch (cl::Error &err) {
             log_fatal("[%u] OpenCL ERROR (running kernel): %s (%i)", thisBuffer, err.what(), err.err());
         }
 
         log_trace("[%u] kernel finished..", thisBuffer);
+        
+        // the kernel waited for the upload, so the host steps are not needed anymore
+        stepsInFlight[thisBuffer].reset();
+        uploadEvents[thisBuffer].clear();
 
 #ifdef DUMP_STATISTICS
         log_trace("[%u] dumping statistics..", thisBuffer);
 
-        last_timestamp = DumpStatistics(kernelFinishEvent,
+        last_timestamp = DumpStatistics(kernelFinishEvents[thisBuffer],
                                         last_timestamp,
                                         totalNumberOfPhotons[thisBuffer],
-                                        starving,
+                                        starving[thisBuffer],
                                         device_->GetPlatformName(),
                                         device_->GetDeviceName(),
                                         (device_->GetDeviceHandle())->getInfo<CL_DEVICE_PROFILING_TIMER_RESOLUTION>() );
 #endif
 
-        log_trace("[%u] waiting for queue..", thisBuffer);
-
-        try {
-            // wait for the queue to really finish (just to make sure)
-            queue_[thisBuffer]->finish();
-        } catch (cl::Error &err) {
-            log_fatal("[%u] OpenCL ERROR (running kernel): %s (%i)", thisBuffer, err.what(), err.err());
-        }
-        
-        log_trace("[%u] queue finished!", thisBuffer);
-        
-        // receive results
+        // receive results. Kernels for the other buffers keep
+        // running on the compute queue in the meantime.
         log_trace("[%u] receiving results..!", thisBuffer);
-        {
-            bool shouldBreak;
-            OpenCLThread_impl_downloadPhotons(di, shouldBreak, thisBuffer, stepsIdentifier[thisBuffer]);
-            if (shouldBreak) break; // is thread termination being requested?
+        if (!tabulationBinEdges_.empty()) {
+            // the table itself stays on the device
+            OpenCLThread_impl_downloadTabulationPhotonWeights(thisBuffer, numberOfSteps[thisBuffer]);
         }
+        OpenCLThread_impl_downloadPhotons(di, shouldBreak, thisBuffer, stepsIdentifier[thisBuffer]);
+        if (shouldBreak) break; // is thread termination being requested?
         log_trace("[%u] results received.", thisBuffer);
-
+        
+        freeBuffers.push_back(thisBuffer);
     }
     
     log_debug("OpenCL thread terminating...");
@@ -1394,16 +2420,45 @@ void I3CLSimStepToPhotonConverterOpenCL::SetEnableDoubleBuffering(bool value)
     if (initialized_)
         throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
 
+    SetNumBuffers(value?2:1);
+}
+
+bool I3CLSimStepToPhotonConverterOpenCL::GetEnableDoubleBuffering() const
+{
+    return (numBuffers_>1);
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetNumBuffers(unsigned int value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    if (value==0)
+        throw I3CLSimStepToPhotonConverter_exception("At least one buffer is needed!");
+    
     compiled_=false;
     kernel_.clear();
     queue_.clear();
     
-    disableDoubleBuffering_=(!value);
+    numBuffers_=value;
 }
 
-bool I3CLSimStepToPhotonConverterOpenCL::GetEnableDoubleBuffering() const
+unsigned int I3CLSimStepToPhotonConverterOpenCL::GetNumBuffers() const
+{
+    return numBuffers_;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetUseMappedBuffers(bool value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    useMappedBuffers_=value;
+}
+
+bool I3CLSimStepToPhotonConverterOpenCL::GetUseMappedBuffers() const
 {
-    return (!disableDoubleBuffering_);
+    return useMappedBuffers_;
 }
 
 
@@ -1448,6 +2503,171 @@ bool I3CLSimStepToPhotonConverterOpenCL::GetStopDetectedPhotons() const
 
 
 
+void I3CLSimStepToPhotonConverterOpenCL::SetCompactPhotonOutput(bool value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    if ((value) && (saveAllPhotons_))
+        throw I3CLSimStepToPhotonConverter_exception("You cannot set compactPhotonOutput, because saveAllPhotons is set. The options are mutually exclusive.");
+
+    compiled_=false;
+    kernel_.clear();
+    queue_.clear();
+    
+    compactPhotonOutput_=value;
+}
+
+bool I3CLSimStepToPhotonConverterOpenCL::GetCompactPhotonOutput() const
+{
+    return compactPhotonOutput_;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetMediumPropertiesLookupTableBins(uint32_t value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    if (value==1)
+        throw I3CLSimStepToPhotonConverter_exception("The medium properties lookup tables need at least 2 bins (or 0 to disable them).");
+
+    compiled_=false;
+    kernel_.clear();
+    queue_.clear();
+    
+    mediumPropertiesLookupTableBins_=value;
+}
+
+uint32_t I3CLSimStepToPhotonConverterOpenCL::GetMediumPropertiesLookupTableBins() const
+{
+    return mediumPropertiesLookupTableBins_;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetOpticalDepthTableBins(uint32_t value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    if (value==1)
+        throw I3CLSimStepToPhotonConverter_exception("The optical depth tables need at least 2 bins (or 0 to disable them).");
+
+    compiled_=false;
+    kernel_.clear();
+    queue_.clear();
+    
+    opticalDepthTableBins_=value;
+}
+
+uint32_t I3CLSimStepToPhotonConverterOpenCL::GetOpticalDepthTableBins() const
+{
+    return opticalDepthTableBins_;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetUseDOMGrid(bool value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    compiled_=false;
+    kernel_.clear();
+    queue_.clear();
+    
+    useDOMGrid_=value;
+}
+
+bool I3CLSimStepToPhotonConverterOpenCL::GetUseDOMGrid() const
+{
+    return useDOMGrid_;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetDistanceCullingMargin(double value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    if (value < 0.)
+        throw I3CLSimStepToPhotonConverter_exception("The distance culling margin must not be negative!");
+    
+    compiled_=false;
+    kernel_.clear();
+    queue_.clear();
+    
+    distanceCullingMargin_=value;
+}
+
+double I3CLSimStepToPhotonConverterOpenCL::GetDistanceCullingMargin() const
+{
+    return distanceCullingMargin_;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetPhotonSplittingFactor(uint32_t value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    if (value < 1)
+        throw I3CLSimStepToPhotonConverter_exception("The photon splitting factor must be at least 1!");
+    
+    compiled_=false;
+    kernel_.clear();
+    queue_.clear();
+    
+    photonSplittingFactor_=value;
+}
+
+uint32_t I3CLSimStepToPhotonConverterOpenCL::GetPhotonSplittingFactor() const
+{
+    return photonSplittingFactor_;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetPhotonSplittingDistance(double value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    if (isnan(value) || (value < 0.))
+        throw I3CLSimStepToPhotonConverter_exception("The photon splitting distance must not be negative!");
+    
+    compiled_=false;
+    kernel_.clear();
+    queue_.clear();
+    
+    photonSplittingDistance_=value;
+}
+
+double I3CLSimStepToPhotonConverterOpenCL::GetPhotonSplittingDistance() const
+{
+    return photonSplittingDistance_;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetPhotonRouletteDistance(double value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    if (isnan(value) || (value < 0.))
+        throw I3CLSimStepToPhotonConverter_exception("The photon roulette distance must not be negative!");
+    
+    compiled_=false;
+    kernel_.clear();
+    queue_.clear();
+    
+    photonRouletteDistance_=value;
+}
+
+double I3CLSimStepToPhotonConverterOpenCL::GetPhotonRouletteDistance() const
+{
+    return photonRouletteDistance_;
+}
+
+std::size_t I3CLSimStepToPhotonConverterOpenCL::GetOutputPhotonRecordSize() const
+{
+    if (hitWavelengthAcceptance_) return sizeof(I3CLSimHelper::HitRecord_t);
+    return compactPhotonOutput_?sizeof(I3CLSimHelper::CompactPhoton_t):sizeof(I3CLSimPhoton);
+}
+
+
+
 void I3CLSimStepToPhotonConverterOpenCL::SetSaveAllPhotons(bool value)
 {
     if (initialized_)
@@ -1455,6 +2675,9 @@ void I3CLSimStepToPhotonConverterOpenCL::SetSaveAllPhotons(bool value)
     
     if ((value) && (stopDetectedPhotons_))
         throw I3CLSimStepToPhotonConverter_exception("You cannot set saveAllPhotons, because stopDetectedPhotons is set. The options are mutually exclusive.");
+
+    if ((value) && (compactPhotonOutput_))
+        throw I3CLSimStepToPhotonConverter_exception("You cannot set saveAllPhotons, because compactPhotonOutput is set. The options are mutually exclusive.");
     
     compiled_=false;
     kernel_.clear();
@@ -1525,6 +2748,118 @@ double I3CLSimStepToPhotonConverterOpenCL::GetFixedNumberOfAbsorptionLengths() c
 }
 
 
+void I3CLSimStepToPhotonConverterOpenCL::SetTabulationBins(const std::vector<std::vector<double> > &binEdges,
+                                                           double stepLength)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    if (!binEdges.empty()) {
+        if (binEdges.size() != 4)
+            throw I3CLSimStepToPhotonConverter_exception("Photon tables need bin edges in exactly 4 dimensions (r, azimuth, cos(zenith), time residual).");
+        
+        if (I3CLSimHelper::GetTabulationNumBins(binEdges)==0)
+            throw I3CLSimStepToPhotonConverter_exception("Each table dimension needs at least 2 bin edges.");
+        
+        if (isnan(stepLength) || (stepLength <= 0.))
+            throw I3CLSimStepToPhotonConverter_exception("The tabulation step length has to be positive!");
+    }
+    
+    compiled_=false;
+    kernel_.clear();
+    queue_.clear();
+    
+    tabulationBinEdges_=binEdges;
+    tabulationStepLength_=stepLength;
+}
+
+const std::vector<std::vector<double> > &I3CLSimStepToPhotonConverterOpenCL::GetTabulationBinEdges() const
+{
+    return tabulationBinEdges_;
+}
+
+double I3CLSimStepToPhotonConverterOpenCL::GetTabulationStepLength() const
+{
+    return tabulationStepLength_;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetTabulationSource(const I3Particle &source)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    compiled_=false;
+    kernel_.clear();
+    queue_.clear();
+    
+    tabulationParticle_=source;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetTabulationEfficiencies(I3CLSimFunctionConstPtr wavelengthAcceptance,
+                                                                   I3CLSimFunctionConstPtr angularAcceptance,
+                                                                   double domRadius)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    if ((!wavelengthAcceptance) || (!angularAcceptance))
+        throw I3CLSimStepToPhotonConverter_exception("The tabulation acceptances must not be (null)!");
+    
+    if (isnan(domRadius) || (domRadius <= 0.))
+        throw I3CLSimStepToPhotonConverter_exception("The tabulation DOM radius has to be positive!");
+    
+    compiled_=false;
+    kernel_.clear();
+    queue_.clear();
+    
+    tabulationWavelengthAcceptance_=wavelengthAcceptance;
+    tabulationAngularAcceptance_=angularAcceptance;
+    tabulationDOMRadius_=domRadius;
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetHitConversion(I3CLSimFunctionConstPtr wavelengthAcceptance,
+                                                          I3CLSimFunctionConstPtr angularAcceptance,
+                                                          double oversizeFactor)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    if ((!wavelengthAcceptance) || (!angularAcceptance))
+        throw I3CLSimStepToPhotonConverter_exception("The hit conversion acceptances must not be (null)!");
+    
+    if (isnan(oversizeFactor) || (oversizeFactor <= 0.))
+        throw I3CLSimStepToPhotonConverter_exception("The DOM oversize factor has to be positive!");
+    
+    compiled_=false;
+    kernel_.clear();
+    queue_.clear();
+    
+    hitWavelengthAcceptance_=wavelengthAcceptance;
+    hitAngularAcceptance_=angularAcceptance;
+    hitOversizeFactor_=oversizeFactor;
+}
+
+bool I3CLSimStepToPhotonConverterOpenCL::GetHitConversion() const
+{
+    return static_cast<bool>(hitWavelengthAcceptance_);
+}
+
+void I3CLSimStepToPhotonConverterOpenCL::SetHitDOMEfficiencies(const std::map<std::pair<int, unsigned int>, double> &efficiencies,
+                                                               double defaultEfficiency)
+{
+    if (isnan(defaultEfficiency) || (defaultEfficiency < 0.))
+        throw I3CLSimStepToPhotonConverter_exception("The default DOM efficiency must not be negative or NaN!");
+    
+    boost::unique_lock<boost::mutex> guard(hitDOMEfficiency_mutex_);
+    
+    if ((hitDOMEfficiencies_ == efficiencies) && (hitDefaultDOMEfficiency_ == defaultEfficiency)) return; // nothing changed
+    
+    hitDOMEfficiencies_=efficiencies;
+    hitDefaultDOMEfficiency_=defaultEfficiency;
+    ++hitDOMEfficiencyGeneration_;
+}
+
+
 void I3CLSimStepToPhotonConverterOpenCL::SetDOMPancakeFactor(double value)
 {
     if (initialized_)
@@ -1542,6 +2877,19 @@ double I3CLSimStepToPhotonConverterOpenCL::GetDOMPancakeFactor() const
     return pancakeFactor_;
 }
 
+void I3CLSimStepToPhotonConverterOpenCL::SetProgramBinaryCacheDirectory(const std::string &value)
+{
+    if (initialized_)
+        throw I3CLSimStepToPhotonConverter_exception("I3CLSimStepToPhotonConverterOpenCL already initialized!");
+    
+    programBinaryCacheDirectory_=value;
+}
+
+std::string I3CLSimStepToPhotonConverterOpenCL::GetProgramBinaryCacheDirectory() const
+{
+    return programBinaryCacheDirectory_;
+}
+
 
 
 void I3CLSimStepToPhotonConverterOpenCL::SetWlenGenerators(const std::vector<I3CLSimRandomValueConstPtr> &wlenGenerators)
@@ -1632,12 +2980,15 @@ bool I3CLSimStepToPhotonConverterOpenCL::MorePhotonsAvailable() const
 
 // helper
 namespace {
-    inline void ReplaceStringDOMIndexWithStringDOMIDs(I3CLSimPhotonSeries &photons,
+    inline void ReplaceStringDOMIndexWithStringDOMIDs(I3CLSimPhoton *photons,
+                                                      std::size_t numPhotons,
                                                       const std::vector<int> &stringIndexToStringIDBuffer,
                                                       const std::vector<std::vector<unsigned int> > &domIndexToDomIDBuffer_perStringIndex)
     {
-        BOOST_FOREACH(I3CLSimPhoton &photon, photons)
+        for (std::size_t i=0;i<numPhotons;++i)
         {
+            I3CLSimPhoton &photon = photons[i];
+            
             const int16_t stringIndex = photon.stringID;
             const uint16_t DOMIndex = photon.omID;
             
@@ -1678,8 +3029,12 @@ I3CLSimStepToPhotonConverter::ConversionResult_t I3CLSimStepToPhotonConverterOpe
     
     ConversionResult_t result = queueFromOpenCL_->Get();
     
-    if ((result.photons) && (!saveAllPhotons_)) {
-        ReplaceStringDOMIndexWithStringDOMIDs(*result.photons,
+    if ((result.HasPhotons()) && (UsesGeometry())) {
+        // A view handed out by this converter points to our own
+        // mapped memory, so it is safe to modify it in place.
+        const I3CLSimPhotonSeriesView photons = result.GetPhotonView();
+        ReplaceStringDOMIndexWithStringDOMIDs(const_cast<I3CLSimPhoton *>(photons.data()),
+                                              photons.size(),
                                               stringIndexToStringIDBuffer_,
                                               domIndexToDomIDBuffer_perStringIndex_);
         
@@ -205,6 +205,10 @@ void register_I3CLSimLightSourceToStepConverter()
            )
           )
         )
+        .def("SetNumWorkerProcesses", &I3CLSimLightSourceToStepConverterGeant4::SetNumWorkerProcesses)
+        .def("GetNumWorkerProcesses", &I3CLSimLightSourceToStepConverterGeant4::GetNumWorkerProcesses)
+        .def("ForkWorkerProcesses", &I3CLSimLightSourceToStepConverterGeant4::ForkWorkerProcesses)
+        .add_property("numWorkerProcesses", &I3CLSimLightSourceToStepConverterGeant4::GetNumWorkerProcesses, &I3CLSimLightSourceToStepConverterGeant4::SetNumWorkerProcesses)
         .add_static_property("can_use_geant4",bp::make_getter(I3CLSimLightSourceToStepConverterGeant4::canUseGeant4))
         ;
     }
@@ -43,13 +43,47 @@ void register_I3ModuleHelper()
     // this can be used for testing purposes
     bp::def("makeCherenkovWavelengthGenerator", &I3CLSimModuleHelper::makeCherenkovWavelengthGenerator);
     bp::def("makeWavelengthGenerator", &I3CLSimModuleHelper::makeWavelengthGenerator);
+
+#ifndef I3CLSIM_WITHOUT_OPENCL
+    {
+        typedef I3CLSimModuleHelper::OpenCLOptions T;
+        bp::class_<T>("I3CLSimOpenCLOptions")
+        .def_readwrite("enableDoubleBuffering", &T::enableDoubleBuffering)
+        .def_readwrite("doublePrecision", &T::doublePrecision)
+        .def_readwrite("stopDetectedPhotons", &T::stopDetectedPhotons)
+        .def_readwrite("saveAllPhotons", &T::saveAllPhotons)
+        .def_readwrite("saveAllPhotonsPrescale", &T::saveAllPhotonsPrescale)
+        .def_readwrite("fixedNumberOfAbsorptionLengths", &T::fixedNumberOfAbsorptionLengths)
+        .def_readwrite("pancakeFactor", &T::pancakeFactor)
+        .def_readwrite("photonHistoryEntries", &T::photonHistoryEntries)
+        .def_readwrite("limitWorkgroupSize", &T::limitWorkgroupSize)
+        .def_readwrite("numBuffers", &T::numBuffers)
+        .def_readwrite("useMappedBuffers", &T::useMappedBuffers)
+        .def_readwrite("compactPhotonOutput", &T::compactPhotonOutput)
+        .def_readwrite("mediumPropertiesLookupTableBins", &T::mediumPropertiesLookupTableBins)
+        .def_readwrite("opticalDepthTableBins", &T::opticalDepthTableBins)
+        .def_readwrite("useDOMGrid", &T::useDOMGrid)
+        .def_readwrite("distanceCullingMargin", &T::distanceCullingMargin)
+        .def_readwrite("photonSplittingFactor", &T::photonSplittingFactor)
+        .def_readwrite("photonSplittingDistance", &T::photonSplittingDistance)
+        .def_readwrite("photonRouletteDistance", &T::photonRouletteDistance)
+        .add_property("hitWavelengthAcceptance", bp::make_getter(&T::hitWavelengthAcceptance, bp::return_value_policy<bp::return_by_value>()), bp::make_setter(&T::hitWavelengthAcceptance))
+        .add_property("hitAngularAcceptance", bp::make_getter(&T::hitAngularAcceptance, bp::return_value_policy<bp::return_by_value>()), bp::make_setter(&T::hitAngularAcceptance))
+        .def_readwrite("hitOversizeFactor", &T::hitOversizeFactor)
+        ;
+    }
+    
     bp::def("initializeOpenCL", &I3CLSimModuleHelper::initializeOpenCL,
         (bp::arg("openCLDevice"), "randomService", "geometry", "mediumProperties",
 	"wavelengthGenerationBias", "wavelengthGenerators",
-	bp::arg("enableDoubleBuffering")=false, bp::arg("doublePrecision")=false,
+	bp::arg("options")=I3CLSimModuleHelper::OpenCLOptions()));
+#endif
+    bp::def("initializeNative", &I3CLSimModuleHelper::initializeNative,
+        (bp::arg("randomService"), "geometry", "mediumProperties",
+	"wavelengthGenerationBias", "wavelengthGenerators",
 	bp::arg("stopDetectedPhotons")=true, bp::arg("saveAllPhotons")=false,
 	bp::arg("saveAllPhotonsPrescale")=0.01, bp::arg("fixedNumberOfAbsorptionLengths")=NAN,
 	bp::arg("pancakeFactor")=1., bp::arg("photonHistoryEntries")=0,
-	bp::arg("limitWorkgroupSize")=0));
+	bp::arg("numThreads")=0));
     
 }
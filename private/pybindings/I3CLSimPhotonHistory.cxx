@@ -73,6 +73,10 @@ void register_I3CLSimPhotonHistory()
         .def("append", append_fourary)
         .def("__len__", &I3CLSimPhotonHistory::size)
         .def("__getitem__", &I3CLSimPhotonHistory::at)
+        .def("GetX", &I3CLSimPhotonHistory::GetX)
+        .def("GetY", &I3CLSimPhotonHistory::GetY)
+        .def("GetZ", &I3CLSimPhotonHistory::GetZ)
+        .def("GetDistanceInAbsorptionLengths", &I3CLSimPhotonHistory::GetDistanceInAbsorptionLengths)
         
         .def("__str__", i3clsimphotonhistory_prettyprint)
 
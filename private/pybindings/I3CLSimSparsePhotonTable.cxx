@@ -0,0 +1,197 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimSparsePhotonTable.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#include <clsim/tabulator/I3CLSimSparsePhotonTable.h>
+
+#include <dataclasses/I3Vector.h>
+
+#include <boost/foreach.hpp>
+
+#include <string>
+#include <vector>
+
+using namespace boost::python;
+namespace bp = boost::python;
+
+namespace {
+    bp::list I3CLSimSparsePhotonTable_GetBinEdges(const I3CLSimSparsePhotonTable &self)
+    {
+        bp::list binEdges;
+        BOOST_FOREACH(const std::vector<double> &edges, self.GetBinEdges())
+        {
+            bp::list dimension;
+            BOOST_FOREACH(double edge, edges) dimension.append(edge);
+            binEdges.append(dimension);
+        }
+        return binEdges;
+    }
+
+    bp::tuple I3CLSimSparsePhotonTable_GetShape(const I3CLSimSparsePhotonTable &self)
+    {
+        bp::list shape;
+        BOOST_FOREACH(uint64_t bins, self.GetShape()) shape.append(bins);
+        return bp::tuple(shape);
+    }
+
+    bp::dict I3CLSimSparsePhotonTable_GetHeader(const I3CLSimSparsePhotonTable &self)
+    {
+        bp::dict header;
+        BOOST_FOREACH(const I3CLSimSparsePhotonTable::Header_t::value_type &entry, self.GetHeader())
+        {
+            if (entry.second.isInteger)
+                header[entry.first] = static_cast<int64_t>(entry.second.value);
+            else
+                header[entry.first] = entry.second.value;
+        }
+        return header;
+    }
+
+    bp::tuple I3CLSimSparsePhotonTable_ReadChunk(const I3CLSimSparsePhotonTable &self, uint64_t chunk)
+    {
+        I3VectorFloatPtr values(new I3VectorFloat());
+        I3VectorFloatPtr weights(new I3VectorFloat());
+        self.ReadChunk(chunk, *values, *weights);
+        return bp::make_tuple(values, weights);
+    }
+
+    // Returns a pointer to the data of a contiguous one-dimensional
+    // float32 array (e.g. a numpy array) and its number of entries.
+    const float *GetFloatArrayData(bp::object array, uint64_t &size)
+    {
+        if (!PyObject_HasAttrString(array.ptr(), "__array_interface__")) {
+            PyErr_SetString(PyExc_TypeError, "Chunks have to support the array protocol (e.g. numpy arrays)!");
+            bp::throw_error_already_set();
+        }
+
+        bp::dict iface(bp::getattr(array, "__array_interface__"));
+        bp::tuple shape(iface["shape"]);
+        if (bp::len(shape) != 1) {
+            PyErr_SetString(PyExc_ValueError, "Chunks have to be one-dimensional!");
+            bp::throw_error_already_set();
+        }
+        if (iface.has_key("strides") && iface["strides"]) {
+            PyErr_SetString(PyExc_ValueError, "Chunks have to be contiguous!");
+            bp::throw_error_already_set();
+        }
+        const std::string typestr = bp::extract<std::string>(iface["typestr"]);
+        if (typestr != "<f4") {
+            PyErr_SetString(PyExc_TypeError, "Chunks have to be float32 arrays!");
+            bp::throw_error_already_set();
+        }
+
+        size = bp::extract<uint64_t>(shape[0]);
+        return reinterpret_cast<const float *>(bp::extract<ptrdiff_t>(bp::tuple(iface["data"])[0])());
+    }
+
+    boost::shared_ptr<I3CLSimSparsePhotonTableWriter>
+    MakeSparsePhotonTableWriter(const std::string &filename, bp::object binEdges, bp::dict header, uint64_t chunkSize)
+    {
+        std::vector<std::vector<double> > edges;
+        for (bp::ssize_t i=0;i<bp::len(binEdges);++i)
+        {
+            std::vector<double> dimension;
+            for (bp::ssize_t j=0;j<bp::len(binEdges[i]);++j)
+                dimension.push_back(bp::extract<double>(binEdges[i][j]));
+            edges.push_back(dimension);
+        }
+
+        // ints (including numpy integers) are stored as integers, everything else as doubles
+        bp::object integral = bp::import("numbers").attr("Integral");
+
+        I3CLSimSparsePhotonTable::Header_t entries;
+        bp::list items = header.items();
+        for (bp::ssize_t i=0;i<bp::len(items);++i)
+        {
+            const std::string key = bp::extract<std::string>(items[i][0]);
+            bp::object value = items[i][1];
+            const bool isInteger = (!PyBool_Check(value.ptr())) &&
+                (PyObject_IsInstance(value.ptr(), integral.ptr()) == 1);
+            entries[key] = I3CLSimSparsePhotonTable::HeaderEntry(bp::extract<double>(value), isInteger);
+        }
+
+        return boost::shared_ptr<I3CLSimSparsePhotonTableWriter>(
+            new I3CLSimSparsePhotonTableWriter(filename, edges, entries, chunkSize));
+    }
+
+    void I3CLSimSparsePhotonTableWriter_AppendChunk(I3CLSimSparsePhotonTableWriter &self, bp::object values, bp::object weights)
+    {
+        uint64_t numValues, numWeights;
+        const float *valueData = GetFloatArrayData(values, numValues);
+        const float *weightData = GetFloatArrayData(weights, numWeights);
+        if (numValues != numWeights) {
+            PyErr_SetString(PyExc_ValueError, "Values and weights of a chunk have to have the same size!");
+            bp::throw_error_already_set();
+        }
+
+        self.AppendChunk(valueData, weightData, numValues);
+    }
+
+    void MergeSparsePhotonTables(bp::object inputFiles, const std::string &outputFile)
+    {
+        std::vector<std::string> inputs;
+        for (bp::ssize_t i=0;i<bp::len(inputFiles);++i)
+        {
+            inputs.push_back(bp::extract<std::string>(inputFiles[i]));
+        }
+        I3CLSimSparsePhotonTable::Merge(inputs, outputFile);
+    }
+}
+
+void register_I3CLSimSparsePhotonTable()
+{
+    {
+        bp::class_<I3CLSimSparsePhotonTable, boost::shared_ptr<I3CLSimSparsePhotonTable>, boost::noncopyable>
+        ("I3CLSimSparsePhotonTable", 
+         bp::init<const std::string &>(bp::arg("filename"))
+        )
+        .def("GetBinEdges", &I3CLSimSparsePhotonTable_GetBinEdges)
+        .def("GetShape", &I3CLSimSparsePhotonTable_GetShape)
+        .def("GetNumBins", &I3CLSimSparsePhotonTable::GetNumBins)
+        .def("GetHeader", &I3CLSimSparsePhotonTable_GetHeader)
+        .def("GetChunkSize", &I3CLSimSparsePhotonTable::GetChunkSize)
+        .def("GetNumChunks", &I3CLSimSparsePhotonTable::GetNumChunks)
+        .def("GetNumBinsInChunk", &I3CLSimSparsePhotonTable::GetNumBinsInChunk)
+        .def("IsChunkEmpty", &I3CLSimSparsePhotonTable::IsChunkEmpty)
+        .def("ReadChunk", &I3CLSimSparsePhotonTable_ReadChunk)
+        ;
+    }
+
+    {
+        bp::class_<I3CLSimSparsePhotonTableWriter, boost::shared_ptr<I3CLSimSparsePhotonTableWriter>, boost::noncopyable>
+        ("I3CLSimSparsePhotonTableWriter", bp::no_init)
+        .def("__init__", bp::make_constructor(&MakeSparsePhotonTableWriter, bp::default_call_policies(),
+                                              (bp::arg("filename"), bp::arg("binEdges"), bp::arg("header"),
+                                               bp::arg("chunkSize")=I3CLSimSparsePhotonTable::defaultChunkSize)))
+        .def("AppendChunk", &I3CLSimSparsePhotonTableWriter_AppendChunk, (bp::arg("values"), bp::arg("weights")))
+        .def("Close", &I3CLSimSparsePhotonTableWriter::Close)
+        .def("GetNumChunks", &I3CLSimSparsePhotonTableWriter::GetNumChunks)
+        .def("GetChunkSize", &I3CLSimSparsePhotonTableWriter::GetChunkSize)
+        ;
+    }
+
+    bp::def("MergeSparsePhotonTables", &MergeSparsePhotonTables,
+            (bp::arg("inputFiles"), bp::arg("outputFile")));
+}
@@ -27,7 +27,15 @@
 #include <sstream>
 
 #include <clsim/I3CLSimStepToPhotonConverter.h>
+#ifndef I3CLSIM_WITHOUT_OPENCL
 #include <clsim/I3CLSimStepToPhotonConverterOpenCL.h>
+#endif
+#include <clsim/I3CLSimStepToPhotonConverterNative.h>
+#include <clsim/I3CLSimStepToPhotonConverterRemote.h>
+#include <clsim/I3CLSimStepToPhotonConverterServer.h>
+
+#include <icetray/I3Units.h>
+#include <dataclasses/I3Vector.h>
 
 #include <boost/preprocessor/seq.hpp>
 
@@ -59,6 +67,7 @@ struct I3CLSimStepToPhotonConverterWrapper : I3CLSimStepToPhotonConverter, bp::w
     virtual I3CLSimStepToPhotonConverter::ConversionResult_t GetConversionResult() {utils::python_gil_holder gil; return this->get_override("GetConversionResult")();}
 };
 
+#ifndef I3CLSIM_WITHOUT_OPENCL
 struct I3CLSimStepToPhotonConverterOpenCLWrapper : I3CLSimStepToPhotonConverterOpenCL, bp::wrapper<I3CLSimStepToPhotonConverterOpenCL> {
     I3CLSimStepToPhotonConverterOpenCLWrapper(I3RandomServicePtr rng, bool nm)
         : I3CLSimStepToPhotonConverterOpenCL(rng, nm) {}
@@ -77,7 +86,69 @@ struct I3CLSimStepToPhotonConverterOpenCLWrapper : I3CLSimStepToPhotonConverterO
             return I3CLSimStepToPhotonConverterOpenCL::GetCollisionDetectionSource(header);
     }
 };
+#endif
 
+namespace {
+    // results from converters using mapped buffers only have
+    // a view of their photons, so python gets a copy
+    I3CLSimPhotonSeriesPtr ConversionResult_t_GetPhotons(const I3CLSimStepToPhotonConverter::ConversionResult_t &result)
+    {
+        if (result.photons) return result.photons;
+        if (result.photonView.valid()) return result.photonView.Copy();
+        return I3CLSimPhotonSeriesPtr();
+    }
+    
+#ifndef I3CLSIM_WITHOUT_OPENCL
+    // table bin edges are passed as a list of lists (or arrays)
+    void I3CLSimStepToPhotonConverterOpenCL_SetTabulationBins(I3CLSimStepToPhotonConverterOpenCL &self, bp::object binEdges, double stepLength)
+    {
+        std::vector<std::vector<double> > edges;
+        for (int i=0;i<bp::len(binEdges);++i)
+            edges.push_back(bp::extract<std::vector<double> >(binEdges[i]));
+        self.SetTabulationBins(edges, stepLength);
+    }
+    
+    bp::list I3CLSimStepToPhotonConverterOpenCL_GetTabulationBinEdges(const I3CLSimStepToPhotonConverterOpenCL &self)
+    {
+        bp::list retList;
+        BOOST_FOREACH(const std::vector<double> &edges, self.GetTabulationBinEdges())
+        {
+            bp::list edgeList;
+            BOOST_FOREACH(const double edge, edges) edgeList.append(edge);
+            retList.append(edgeList);
+        }
+        return retList;
+    }
+    
+    // the tables are returned as I3VectorFloat, use numpy.asarray() to access them
+    I3VectorFloatPtr I3CLSimStepToPhotonConverterOpenCL_GetTabulatedValues(I3CLSimStepToPhotonConverterOpenCL &self)
+    {
+        const std::vector<float> values = self.GetTabulatedValues();
+        return I3VectorFloatPtr(new I3VectorFloat(values.begin(), values.end()));
+    }
+    
+    I3VectorFloatPtr I3CLSimStepToPhotonConverterOpenCL_GetTabulatedWeights(I3CLSimStepToPhotonConverterOpenCL &self)
+    {
+        const std::vector<float> weights = self.GetTabulatedWeights();
+        return I3VectorFloatPtr(new I3VectorFloat(weights.begin(), weights.end()));
+    }
+
+    // efficiencies are passed as a dict {(string, om): efficiency}
+    void I3CLSimStepToPhotonConverterOpenCL_SetHitDOMEfficiencies(I3CLSimStepToPhotonConverterOpenCL &self, bp::dict efficiencies, double defaultEfficiency)
+    {
+        std::map<std::pair<int, unsigned int>, double> effMap;
+        const bp::list keys = efficiencies.keys();
+        for (bp::ssize_t i=0; i<bp::len(keys); ++i)
+        {
+            bp::object key = keys[i];
+            const int string = bp::extract<int>(key[0]);
+            const unsigned int om = bp::extract<unsigned int>(key[1]);
+            effMap[std::make_pair(string, om)] = bp::extract<double>(efficiencies[key]);
+        }
+        self.SetHitDOMEfficiencies(effMap, defaultEfficiency);
+    }
+#endif
+}
 
 void register_I3CLSimStepToPhotonConverter()
 {
@@ -113,6 +184,7 @@ void register_I3CLSimStepToPhotonConverter()
         .def_readwrite("identifier", &I3CLSimStepToPhotonConverter::ConversionResult_t::identifier)
         .def_readwrite("photons", &I3CLSimStepToPhotonConverter::ConversionResult_t::photons)
         .def_readwrite("photonHistories", &I3CLSimStepToPhotonConverter::ConversionResult_t::photonHistories)
+        .def("GetPhotons", &ConversionResult_t_GetPhotons)
         ;
         
     }
@@ -123,6 +195,7 @@ void register_I3CLSimStepToPhotonConverter()
     
 
     
+#ifndef I3CLSIM_WITHOUT_OPENCL
     // I3CLSimStepToPhotonConverterOpenCL
     {
 
@@ -161,6 +234,10 @@ void register_I3CLSimStepToPhotonConverter()
 
         .def("SetEnableDoubleBuffering", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetEnableDoubleBuffering)
         .def("GetEnableDoubleBuffering", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetEnableDoubleBuffering)
+        .def("SetNumBuffers", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetNumBuffers)
+        .def("GetNumBuffers", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetNumBuffers)
+        .def("SetUseMappedBuffers", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetUseMappedBuffers)
+        .def("GetUseMappedBuffers", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetUseMappedBuffers)
 
         .def("SetDoublePrecision", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetDoublePrecision)
         .def("GetDoublePrecision", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetDoublePrecision)
@@ -168,6 +245,24 @@ void register_I3CLSimStepToPhotonConverter()
         .def("SetStopDetectedPhotons", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetStopDetectedPhotons)
         .def("GetStopDetectedPhotons", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetStopDetectedPhotons)
 
+        .def("SetCompactPhotonOutput", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetCompactPhotonOutput)
+        .def("GetCompactPhotonOutput", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetCompactPhotonOutput)
+        .def("SetMediumPropertiesLookupTableBins", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetMediumPropertiesLookupTableBins)
+        .def("GetMediumPropertiesLookupTableBins", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetMediumPropertiesLookupTableBins)
+        .def("SetOpticalDepthTableBins", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetOpticalDepthTableBins)
+        .def("GetOpticalDepthTableBins", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetOpticalDepthTableBins)
+        .def("SetUseDOMGrid", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetUseDOMGrid)
+        .def("GetUseDOMGrid", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetUseDOMGrid)
+        .def("SetDistanceCullingMargin", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetDistanceCullingMargin)
+        .def("GetDistanceCullingMargin", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetDistanceCullingMargin)
+        .def("SetPhotonSplittingFactor", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetPhotonSplittingFactor)
+        .def("GetPhotonSplittingFactor", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetPhotonSplittingFactor)
+        .def("SetPhotonSplittingDistance", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetPhotonSplittingDistance)
+        .def("GetPhotonSplittingDistance", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetPhotonSplittingDistance)
+        .def("SetPhotonRouletteDistance", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetPhotonRouletteDistance)
+        .def("GetPhotonRouletteDistance", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetPhotonRouletteDistance)
+        .def("UpdateGeometry", &I3CLSimStepToPhotonConverterOpenCLWrapper::UpdateGeometry)
+
         .def("SetSaveAllPhotons", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetSaveAllPhotons)
         .def("GetSaveAllPhotons", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetSaveAllPhotons)
 
@@ -183,22 +278,193 @@ void register_I3CLSimStepToPhotonConverter()
         .def("SetDOMPancakeFactor", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetDOMPancakeFactor)
         .def("GetDOMPancakeFactor", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetDOMPancakeFactor)
 
+        .def("SetProgramBinaryCacheDirectory", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetProgramBinaryCacheDirectory)
+        .def("GetProgramBinaryCacheDirectory", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetProgramBinaryCacheDirectory)
+
+        .def("SetTabulationBins", &I3CLSimStepToPhotonConverterOpenCL_SetTabulationBins, (bp::arg("binEdges"), bp::arg("stepLength")=1.*I3Units::m))
+        .def("GetTabulationBinEdges", &I3CLSimStepToPhotonConverterOpenCL_GetTabulationBinEdges)
+        .def("GetTabulationStepLength", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetTabulationStepLength)
+        .def("SetTabulationSource", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetTabulationSource)
+        .def("SetTabulationEfficiencies", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetTabulationEfficiencies, (bp::arg("wavelengthAcceptance"), bp::arg("angularAcceptance"), bp::arg("domRadius")))
+        .def("GetTabulatedValues", &I3CLSimStepToPhotonConverterOpenCL_GetTabulatedValues)
+        .def("GetTabulatedWeights", &I3CLSimStepToPhotonConverterOpenCL_GetTabulatedWeights)
+        .def("GetTabulatedSumOfPhotonWeights", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetTabulatedSumOfPhotonWeights)
+
+        .def("SetHitConversion", &I3CLSimStepToPhotonConverterOpenCLWrapper::SetHitConversion, (bp::arg("wavelengthAcceptance"), bp::arg("angularAcceptance"), bp::arg("oversizeFactor")=1.))
+        .def("GetHitConversion", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetHitConversion)
+        .def("SetHitDOMEfficiencies", &I3CLSimStepToPhotonConverterOpenCL_SetHitDOMEfficiencies, (bp::arg("efficiencies"), bp::arg("defaultEfficiency")=1.))
+
         
         .add_property("workgroupSize", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetWorkgroupSize, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetWorkgroupSize)
         .add_property("maxNumWorkitems", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetMaxNumWorkitems, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetMaxNumWorkitems)
         .add_property("enableDoubleBuffering", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetEnableDoubleBuffering, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetEnableDoubleBuffering)
+        .add_property("numBuffers", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetNumBuffers, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetNumBuffers)
+        .add_property("useMappedBuffers", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetUseMappedBuffers, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetUseMappedBuffers)
         .add_property("doublePrecision", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetDoublePrecision, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetDoublePrecision)
         .add_property("stopDetectedPhotons", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetStopDetectedPhotons, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetStopDetectedPhotons)
+        .add_property("compactPhotonOutput", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetCompactPhotonOutput, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetCompactPhotonOutput)
+        .add_property("mediumPropertiesLookupTableBins", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetMediumPropertiesLookupTableBins, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetMediumPropertiesLookupTableBins)
+        .add_property("opticalDepthTableBins", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetOpticalDepthTableBins, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetOpticalDepthTableBins)
+        .add_property("useDOMGrid", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetUseDOMGrid, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetUseDOMGrid)
+        .add_property("distanceCullingMargin", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetDistanceCullingMargin, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetDistanceCullingMargin)
+        .add_property("photonSplittingFactor", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetPhotonSplittingFactor, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetPhotonSplittingFactor)
+        .add_property("photonSplittingDistance", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetPhotonSplittingDistance, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetPhotonSplittingDistance)
+        .add_property("photonRouletteDistance", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetPhotonRouletteDistance, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetPhotonRouletteDistance)
         .add_property("saveAllPhotons", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetSaveAllPhotons, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetSaveAllPhotons)
         .add_property("saveAllPhotonsPrescale", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetSaveAllPhotonsPrescale, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetSaveAllPhotonsPrescale)
         .add_property("photonHistoryEntries", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetPhotonHistoryEntries, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetPhotonHistoryEntries)
         .add_property("fixedNumberOfAbsorptionLengths", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetFixedNumberOfAbsorptionLengths, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetFixedNumberOfAbsorptionLengths)
         .add_property("DOMPancakeFactor", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetDOMPancakeFactor, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetDOMPancakeFactor)
+        .add_property("programBinaryCacheDirectory", &I3CLSimStepToPhotonConverterOpenCLWrapper::GetProgramBinaryCacheDirectory, &I3CLSimStepToPhotonConverterOpenCLWrapper::SetProgramBinaryCacheDirectory)
         ;
     }
     
     bp::implicitly_convertible<shared_ptr<I3CLSimStepToPhotonConverterOpenCLWrapper>, shared_ptr<const I3CLSimStepToPhotonConverterOpenCLWrapper> >();
     bp::implicitly_convertible<shared_ptr<I3CLSimStepToPhotonConverterOpenCLWrapper>, shared_ptr<I3CLSimStepToPhotonConverter> >();
     bp::implicitly_convertible<shared_ptr<I3CLSimStepToPhotonConverterOpenCLWrapper>, shared_ptr<const I3CLSimStepToPhotonConverter> >();
+#endif
+
+    // I3CLSimStepToPhotonConverterNative
+    {
+        bp::class_<
+        I3CLSimStepToPhotonConverterNative, 
+        boost::shared_ptr<I3CLSimStepToPhotonConverterNative>, 
+        bases<I3CLSimStepToPhotonConverter>,
+        boost::noncopyable
+        >
+        (
+         "I3CLSimStepToPhotonConverterNative",
+         bp::init<
+         I3RandomServicePtr,std::size_t
+         >(
+           (
+            bp::arg("RandomService"),
+            bp::arg("NumThreads")=0
+           )
+          )
+        )
+        .def("GetNumThreads", &I3CLSimStepToPhotonConverterNative::GetNumThreads)
+        .def("SetNumThreads", &I3CLSimStepToPhotonConverterNative::SetNumThreads)
+        .def("GetWorkgroupSize", &I3CLSimStepToPhotonConverterNative::GetWorkgroupSize)
+        .def("GetMaxNumWorkitems", &I3CLSimStepToPhotonConverterNative::GetMaxNumWorkitems)
+        .def("SetMaxNumWorkitems", &I3CLSimStepToPhotonConverterNative::SetMaxNumWorkitems)
+
+        .def("SetUsePacketPropagation", &I3CLSimStepToPhotonConverterNative::SetUsePacketPropagation)
+        .def("GetUsePacketPropagation", &I3CLSimStepToPhotonConverterNative::GetUsePacketPropagation)
+        .def("GetPacketWidth", &I3CLSimStepToPhotonConverterNative::GetPacketWidth)
+        .staticmethod("GetPacketWidth")
+        .def("GetPacketInstructionSet", &I3CLSimStepToPhotonConverterNative::GetPacketInstructionSet)
+        .staticmethod("GetPacketInstructionSet")
+
+        .def("SetStopDetectedPhotons", &I3CLSimStepToPhotonConverterNative::SetStopDetectedPhotons)
+        .def("GetStopDetectedPhotons", &I3CLSimStepToPhotonConverterNative::GetStopDetectedPhotons)
+
+        .def("SetSaveAllPhotons", &I3CLSimStepToPhotonConverterNative::SetSaveAllPhotons)
+        .def("GetSaveAllPhotons", &I3CLSimStepToPhotonConverterNative::GetSaveAllPhotons)
+
+        .def("SetSaveAllPhotonsPrescale", &I3CLSimStepToPhotonConverterNative::SetSaveAllPhotonsPrescale)
+        .def("GetSaveAllPhotonsPrescale", &I3CLSimStepToPhotonConverterNative::GetSaveAllPhotonsPrescale)
+
+        .def("SetPhotonHistoryEntries", &I3CLSimStepToPhotonConverterNative::SetPhotonHistoryEntries)
+        .def("GetPhotonHistoryEntries", &I3CLSimStepToPhotonConverterNative::GetPhotonHistoryEntries)
+
+        .def("SetFixedNumberOfAbsorptionLengths", &I3CLSimStepToPhotonConverterNative::SetFixedNumberOfAbsorptionLengths)
+        .def("GetFixedNumberOfAbsorptionLengths", &I3CLSimStepToPhotonConverterNative::GetFixedNumberOfAbsorptionLengths)
+
+        .def("SetDOMPancakeFactor", &I3CLSimStepToPhotonConverterNative::SetDOMPancakeFactor)
+        .def("GetDOMPancakeFactor", &I3CLSimStepToPhotonConverterNative::GetDOMPancakeFactor)
+
+        .add_property("numThreads", &I3CLSimStepToPhotonConverterNative::GetNumThreads, &I3CLSimStepToPhotonConverterNative::SetNumThreads)
+        .add_property("workgroupSize", &I3CLSimStepToPhotonConverterNative::GetWorkgroupSize)
+        .add_property("maxNumWorkitems", &I3CLSimStepToPhotonConverterNative::GetMaxNumWorkitems, &I3CLSimStepToPhotonConverterNative::SetMaxNumWorkitems)
+        .add_property("usePacketPropagation", &I3CLSimStepToPhotonConverterNative::GetUsePacketPropagation, &I3CLSimStepToPhotonConverterNative::SetUsePacketPropagation)
+        .add_property("stopDetectedPhotons", &I3CLSimStepToPhotonConverterNative::GetStopDetectedPhotons, &I3CLSimStepToPhotonConverterNative::SetStopDetectedPhotons)
+        .add_property("saveAllPhotons", &I3CLSimStepToPhotonConverterNative::GetSaveAllPhotons, &I3CLSimStepToPhotonConverterNative::SetSaveAllPhotons)
+        .add_property("saveAllPhotonsPrescale", &I3CLSimStepToPhotonConverterNative::GetSaveAllPhotonsPrescale, &I3CLSimStepToPhotonConverterNative::SetSaveAllPhotonsPrescale)
+        .add_property("photonHistoryEntries", &I3CLSimStepToPhotonConverterNative::GetPhotonHistoryEntries, &I3CLSimStepToPhotonConverterNative::SetPhotonHistoryEntries)
+        .add_property("fixedNumberOfAbsorptionLengths", &I3CLSimStepToPhotonConverterNative::GetFixedNumberOfAbsorptionLengths, &I3CLSimStepToPhotonConverterNative::SetFixedNumberOfAbsorptionLengths)
+        .add_property("DOMPancakeFactor", &I3CLSimStepToPhotonConverterNative::GetDOMPancakeFactor, &I3CLSimStepToPhotonConverterNative::SetDOMPancakeFactor)
+        ;
+    }
+    
+    bp::implicitly_convertible<shared_ptr<I3CLSimStepToPhotonConverterNative>, shared_ptr<const I3CLSimStepToPhotonConverterNative> >();
+    bp::implicitly_convertible<shared_ptr<I3CLSimStepToPhotonConverterNative>, shared_ptr<I3CLSimStepToPhotonConverter> >();
+    bp::implicitly_convertible<shared_ptr<I3CLSimStepToPhotonConverterNative>, shared_ptr<const I3CLSimStepToPhotonConverter> >();
+
+    // I3CLSimStepToPhotonConverterRemote
+    {
+        bp::class_<
+        I3CLSimStepToPhotonConverterRemote, 
+        boost::shared_ptr<I3CLSimStepToPhotonConverterRemote>, 
+        bases<I3CLSimStepToPhotonConverter>,
+        boost::noncopyable
+        >
+        (
+         "I3CLSimStepToPhotonConverterRemote",
+         bp::init<
+         const std::string &
+         >(
+           (
+            bp::arg("Address")
+           )
+          )
+        )
+        .def("GetAddress", &I3CLSimStepToPhotonConverterRemote::GetAddress, bp::return_value_policy<bp::copy_const_reference>())
+        .def("GetMaxBunchesInFlight", &I3CLSimStepToPhotonConverterRemote::GetMaxBunchesInFlight)
+        .def("SetMaxBunchesInFlight", &I3CLSimStepToPhotonConverterRemote::SetMaxBunchesInFlight)
+        .def("GetWorkgroupSize", &I3CLSimStepToPhotonConverterRemote::GetWorkgroupSize)
+        .def("GetMaxNumWorkitems", &I3CLSimStepToPhotonConverterRemote::GetMaxNumWorkitems)
+        .def("GetNumBunchesSent", &I3CLSimStepToPhotonConverterRemote::GetNumBunchesSent)
+
+        .add_property("address", bp::make_function(&I3CLSimStepToPhotonConverterRemote::GetAddress, bp::return_value_policy<bp::copy_const_reference>()))
+        .add_property("maxBunchesInFlight", &I3CLSimStepToPhotonConverterRemote::GetMaxBunchesInFlight, &I3CLSimStepToPhotonConverterRemote::SetMaxBunchesInFlight)
+        .add_property("workgroupSize", &I3CLSimStepToPhotonConverterRemote::GetWorkgroupSize)
+        .add_property("maxNumWorkitems", &I3CLSimStepToPhotonConverterRemote::GetMaxNumWorkitems)
+        ;
+    }
+    
+    bp::implicitly_convertible<shared_ptr<I3CLSimStepToPhotonConverterRemote>, shared_ptr<const I3CLSimStepToPhotonConverterRemote> >();
+    bp::implicitly_convertible<shared_ptr<I3CLSimStepToPhotonConverterRemote>, shared_ptr<I3CLSimStepToPhotonConverter> >();
+    bp::implicitly_convertible<shared_ptr<I3CLSimStepToPhotonConverterRemote>, shared_ptr<const I3CLSimStepToPhotonConverter> >();
+
+    // I3CLSimStepToPhotonConverterServer
+    {
+        bp::class_<
+        I3CLSimStepToPhotonConverterServer, 
+        boost::shared_ptr<I3CLSimStepToPhotonConverterServer>, 
+        boost::noncopyable
+        >
+        (
+         "I3CLSimStepToPhotonConverterServer",
+         bp::init<
+         const std::string &, I3CLSimStepToPhotonConverterPtr, std::size_t, std::size_t,
+         const std::vector<I3CLSimRandomValueConstPtr> &, I3CLSimFunctionConstPtr,
+         I3CLSimMediumPropertiesConstPtr, I3CLSimSimpleGeometryConstPtr
+         >(
+           (
+            bp::arg("Address"),
+            bp::arg("Converter"),
+            bp::arg("WorkgroupSize"),
+            bp::arg("MaxNumWorkitems"),
+            bp::arg("WlenGenerators"),
+            bp::arg("WlenBias"),
+            bp::arg("MediumProperties"),
+            bp::arg("Geometry")
+           )
+          )
+        )
+        .def("Start", &I3CLSimStepToPhotonConverterServer::Start)
+        .def("Stop", &I3CLSimStepToPhotonConverterServer::Stop)
+        .def("IsRunning", &I3CLSimStepToPhotonConverterServer::IsRunning)
+        .def("GetAddress", &I3CLSimStepToPhotonConverterServer::GetAddress, bp::return_value_policy<bp::copy_const_reference>())
+        .def("GetNumClientsServed", &I3CLSimStepToPhotonConverterServer::GetNumClientsServed)
+        .def("GetNumBunchesServed", &I3CLSimStepToPhotonConverterServer::GetNumBunchesServed)
+
+        .add_property("running", &I3CLSimStepToPhotonConverterServer::IsRunning)
+        .add_property("address", bp::make_function(&I3CLSimStepToPhotonConverterServer::GetAddress, bp::return_value_policy<bp::copy_const_reference>()))
+        ;
+    }
+    
+    bp::implicitly_convertible<shared_ptr<I3CLSimStepToPhotonConverterServer>, shared_ptr<const I3CLSimStepToPhotonConverterServer> >();
     
 }
@@ -25,15 +25,18 @@
  */
 
 #include <phys-services/I3Calculator.h>
+#include <phys-services/I3GSLRandomService.h>
 #include <dataclasses/I3Constants.h>
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 #include <dataclasses/physics/I3Particle.h>
 #include <dataclasses/I3Position.h>
 #include <dataclasses/I3Direction.h>
 
-#include <boost/numeric/ublas/vector.hpp>
-namespace ublas = boost::numeric::ublas;
+#include <algorithm>
+#include <cmath>
 
 #include <boost/python/tuple.hpp>
 namespace bp = boost::python;
@@ -45,6 +48,109 @@ namespace bp = boost::python;
 
 #include "I3CLSimTabulator.h"
 
+namespace {
+	// Are the edges equally spaced, either in x or in sqrt(x)?
+	bool
+	IsEquallySpaced(const std::vector<double> &edges, bool inSqrt)
+	{
+		if (inSqrt && edges.front() < 0)
+			return false;
+		
+		const std::size_t nbins = edges.size()-1;
+		const double first = inSqrt ? std::sqrt(edges.front()) : edges.front();
+		const double last = inSqrt ? std::sqrt(edges.back()) : edges.back();
+		const double spacing = (last-first)/nbins;
+		if (!(spacing > 0))
+			return false;
+		
+		for (std::size_t i = 1; i < nbins; i++) {
+			const double edge = inSqrt ? std::sqrt(edges[i]) : edges[i];
+			if (std::abs(edge - (first + i*spacing)) > 1e-6*spacing)
+				return false;
+		}
+		
+		return true;
+	}
+}
+
+I3CLSimTabulator::BinLookup::BinLookup(const std::vector<double> &e)
+    : edges(&e), spacing(Irregular), offset(0), scale(0)
+{
+	const std::size_t nbins = e.size()-1;
+	
+	if (IsEquallySpaced(e, false)) {
+		spacing = Linear;
+		offset = e.front();
+		scale = nbins/(e.back()-e.front());
+	} else if (IsEquallySpaced(e, true)) {
+		spacing = Quadratic;
+		offset = std::sqrt(e.front());
+		scale = nbins/(std::sqrt(e.back())-std::sqrt(e.front()));
+	}
+}
+
+off_t
+I3CLSimTabulator::BinLookup::Find(double x) const
+{
+	const std::vector<double> &e = *edges;
+	const off_t nbins = e.size()-1;
+	
+	// Values outside the table are clamped to the first or last bin.
+	// Each bin includes its upper edge.
+	if (x <= e.front())
+		return 0;
+	else if (x >= e.back())
+		return nbins-1;
+	else if (spacing == Irregular)
+		return std::distance(e.begin(),
+		    std::lower_bound(e.begin(), e.end(), x))-1;
+	
+	const double t = (spacing == Quadratic) ? std::sqrt(x) : x;
+	off_t idx = static_cast<off_t>((t-offset)*scale);
+	idx = std::max(off_t(0), std::min(idx, nbins-1));
+	
+	// The estimate can be off by one due to rounding. Check it
+	// against the actual edges to get the same answer as the
+	// binary search.
+	while (idx > 0 && x <= e[idx])
+		idx--;
+	while (idx < nbins-1 && x > e[idx+1])
+		idx++;
+	
+	return idx;
+}
+
+off_t
+I3CLSimTabulator::FindBin(bp::object binEdges, double x)
+{
+	const std::vector<double> edges = bp::extract<std::vector<double> >(binEdges);
+	if (!(edges.size() >= 2))
+		log_fatal("Edge array has only %zu entries!", edges.size());
+	
+	return BinLookup(edges).Find(x);
+}
+
+I3CLSimTabulator::SourceFrame::SourceFrame(const I3Particle &s) : source(s)
+{
+	// Get unit vectors pointing along the source direction
+	// and perpendicular to it, towards +z. For vertical sources,
+	// pick the +x direction.
+	dir[0] = source.GetDir().GetX();
+	dir[1] = source.GetDir().GetY();
+	dir[2] = source.GetDir().GetZ();
+	
+	double perpz = hypot(dir[0], dir[1]);
+	if (perpz > 0.) {
+		perpDir[0] = -dir[0]*dir[2]/perpz;
+		perpDir[1] = -dir[1]*dir[2]/perpz;
+		perpDir[2] = perpz;
+	} else {
+		perpDir[0] = 1.;
+		perpDir[1] = 0.;
+		perpDir[2] = 0.;
+	}
+}
+
 void
 I3CLSimTabulator::SetBins(boost::python::object binEdges, double stepLength)
 {
@@ -53,10 +159,15 @@ I3CLSimTabulator::SetBins(boost::python::object binEdges, double stepLength)
 	Py_XDECREF(values_);
 	Py_XDECREF(weights_);
 	binEdges_.clear();
+	binLookups_.clear();
+	histograms_.clear();
 	
 	for (int i = 0; i < bp::len(binEdges); i++)
 		binEdges_.push_back(bp::extract<std::vector<double> >(binEdges[i]));	
 	
+	if (binEdges_.size() != 4)
+		log_fatal("Need bin edges in 4 dimensions, got %zu!", binEdges_.size());
+	
 	npy_intp dims[binEdges_.size()];
 	for (unsigned i = 0; i < binEdges_.size(); i++) {
 		const std::vector<double> &edges = binEdges_[i];
@@ -64,8 +175,15 @@ I3CLSimTabulator::SetBins(boost::python::object binEdges, double stepLength)
 			log_fatal("Edge array in dimension %d has only %zu entries!", i, edges.size());
 		
 		dims[i] = edges.size()-1;
+		binLookups_.push_back(BinLookup(edges));
 	}
 	
+	// strides of a C-ordered table, in units of bins
+	binStrides_.assign(binEdges_.size(), 1);
+	for (int i = binEdges_.size()-2; i >= 0; i--)
+		binStrides_[i] = binStrides_[i+1]*dims[i+1];
+	tableSize_ = binStrides_[0]*dims[0];
+	
 	#ifdef USE_NUMPY
 	values_ = PyArray_ZEROS(binEdges_.size(), dims, NPY_FLOAT, 0);
 	weights_ = PyArray_ZEROS(binEdges_.size(), dims, NPY_FLOAT, 0);
@@ -81,9 +199,11 @@ I3CLSimTabulator::~I3CLSimTabulator()
 }
 
 bp::object
-I3CLSimTabulator::GetValues() const
+I3CLSimTabulator::GetValues()
 {
 #ifdef USE_NUMPY
+	MergeHistograms();
+	
 	return bp::make_tuple(bp::object(bp::handle<>(values_)),
 	    bp::object(bp::handle<>(weights_)));
 #else
@@ -106,45 +226,27 @@ I3CLSimTabulator::SetRandomService(I3RandomServicePtr rng)
 	rng_ = rng;
 }
 
-ublas::vector<double>
-make_vector(double x, double y, double z)
-{
-	ublas::vector<double> v(3);
-	v[0] = x;
-	v[1] = y;
-	v[2] = z;
-	
-	return v;
-}
-
-ublas::vector<double>
-make_vector(const I3Direction &dir)
-{
-	return make_vector(dir.GetX(), dir.GetY(), dir.GetZ());
-}
-
-inline ublas::vector<double>
-operator+(const I3Position &p1, const I3Position &p2)
-{
-	return make_vector(p1.GetX()+p2.GetX(), p1.GetY()+p2.GetY(), p1.GetZ()+p2.GetZ());
-}
-
-inline I3Position
-operator+(const I3Position &p1, const ublas::vector<double> p2)
+void
+I3CLSimTabulator::SetNumThreads(unsigned numThreads)
 {
-	assert(p2.size() == 3);
-	return I3Position(p1.GetX()+p2[0], p1.GetY()+p2[1], p1.GetZ()+p2[2]);
+	numThreads_ = numThreads;
 }
 
-inline ublas::vector<double>
-subtract(const I3Position &p1, const I3Position &p2)
+unsigned
+I3CLSimTabulator::GetNumThreads() const
 {
-	return make_vector(p1.GetX()-p2.GetX(), p1.GetY()-p2.GetY(), p1.GetZ()-p2.GetZ());
+	if (numThreads_ > 0)
+		return numThreads_;
+	
+	const unsigned hardwareThreads = boost::thread::hardware_concurrency();
+	return (hardwareThreads > 0) ? hardwareThreads : 1;
 }
 
 void
 I3CLSimTabulator::Normalize()
 {
+	MergeHistograms();
+	
 	size_t tableSize = PyArray_SIZE(values_);
 	
 	// The collection efficiency of a bin is effectively the
@@ -179,31 +281,34 @@ I3CLSimTabulator::GetBinVolume(off_t idx) const
 }
 
 off_t
-I3CLSimTabulator::GetBinIndex(const I3Particle &source, const I3Position &pos, double t) const
+I3CLSimTabulator::GetBinIndex(const SourceFrame &frame, const I3Position &pos, double t) const
 {
-	typedef ublas::vector<double> vector;
+	const I3Position &sourcePos = frame.source.GetPos();
+	const double displacement[3] = {pos.GetX()-sourcePos.GetX(),
+	    pos.GetY()-sourcePos.GetY(), pos.GetZ()-sourcePos.GetZ()};
 	
-	// Get unit vectors pointing along the source direction
-	// and perpendicular to it, towards +z. For vertical sources,
-	// pick the +x direction.
-	const vector sourceDir = make_vector(source.GetDir());
-	double perpz = hypot(sourceDir[0], sourceDir[1]);
-	const vector perpDir = (perpz > 0.) ?
-	    make_vector(-sourceDir[0]*sourceDir[2]/perpz, -sourceDir[1]*sourceDir[2]/perpz, perpz)
-	    : make_vector(1., 0., 0.);
+	double l = 0., r2 = 0.;
+	for (int i = 0; i < 3; i++) {
+		l += frame.dir[i]*displacement[i];
+		r2 += displacement[i]*displacement[i];
+	}
 	
-	const vector displacement = subtract(pos,source.GetPos());
-	double l = ublas::inner_prod(sourceDir, displacement);
-	const vector rho = displacement - l*sourceDir;
-	double n_rho = ublas::norm_2(rho);
+	double rho[3];
+	double n_rho2 = 0., rhoDotPerp = 0.;
+	for (int i = 0; i < 3; i++) {
+		rho[i] = displacement[i] - l*frame.dir[i];
+		n_rho2 += rho[i]*rho[i];
+		rhoDotPerp += rho[i]*frame.perpDir[i];
+	}
+	double n_rho = std::sqrt(n_rho2);
 	
 	double coords[4]; // {r, azimuth, cosZen, dt}
-	coords[0] = ublas::norm_2(displacement);
+	coords[0] = std::sqrt(r2);
 	coords[1] = (n_rho > 0) ?
-	    std::acos(ublas::inner_prod(rho, perpDir)/n_rho)/I3Units::degree
+	    std::acos(rhoDotPerp/n_rho)/I3Units::degree
 	    : 0.;
 	coords[2] = (coords[0] > 0) ? l/coords[0] : 1.;
-	coords[3] = I3Calculator::TimeResidual(source, pos, t);
+	coords[3] = I3Calculator::TimeResidual(frame.source, pos, t);
 	
 	// Bail if the photon is too delayed at this point to be recorded
 	if (coords[3] > binEdges_[3].back())
@@ -221,21 +326,12 @@ I3CLSimTabulator::GetBinIndex(const I3Particle &source, const I3Position &pos, d
 	// and compute an index into the flattened table array.
 	off_t idx = 0;
 	for (int i=0; i < 4; i++) {
-		const std::vector<double> &edges = binEdges_[i];
-		
-		off_t dimidx;
-		if (coords[i] <= edges.front())
-			dimidx = 0;
-		else if (coords[i] >= edges.back())
-			dimidx = edges.size()-2;
-		else
-			dimidx = std::distance(edges.begin(),
-			    std::lower_bound(edges.begin(), edges.end(), coords[i]))-1;
+		off_t dimidx = binLookups_[i].Find(coords[i]);
 		
 		assert(dimidx >= 0);
-		assert(dimidx < PyArray_DIM(values_, i));
+		assert(dimidx < off_t(binEdges_[i].size()-1));
 		
-		idx += (PyArray_STRIDE(values_, i)/sizeof(float))*dimidx;
+		idx += binStrides_[i]*dimidx;
 	}
 	
 	return idx;
@@ -244,8 +340,14 @@ I3CLSimTabulator::GetBinIndex(const I3Particle &source, const I3Position &pos, d
 void
 I3CLSimTabulator::RecordPhoton(const I3Particle &source, const I3Photon &photon)
 {
-	typedef ublas::vector<double> vector;
-	
+	RecordPhotonImpl(SourceFrame(source), photon, *rng_,
+	    (float*)PyArray_DATA(values_), (float*)PyArray_DATA(weights_));
+}
+
+void
+I3CLSimTabulator::RecordPhotonImpl(const SourceFrame &frame, const I3Photon &photon,
+    I3RandomService &rng, float *values, float *weights) const
+{
 	double t = photon.GetStartTime();
 	double wlenWeight =
 	    wavelengthAcceptance_->GetValue(photon.GetWavelength())*photon.GetWeight();
@@ -261,9 +363,11 @@ I3CLSimTabulator::RecordPhoton(const I3Particle &source, const I3Photon &photon)
 			photon.GetDistanceInAbsorptionLengthsAtPositionListEntry(i+1)};
 		
 		// A vector connecting the two recording points.
-		vector pdir = subtract(*p1,*p0);
-		double distance = ublas::norm_2(pdir);
-		pdir /= distance;
+		double pdir[3] = {p1->GetX()-p0->GetX(), p1->GetY()-p0->GetY(),
+		    p1->GetZ()-p0->GetZ()};
+		double distance = std::sqrt(pdir[0]*pdir[0] + pdir[1]*pdir[1] + pdir[2]*pdir[2]);
+		for (int j = 0; j < 3; j++)
+			pdir[j] /= distance;
 		
 		// XXX HACK: the cosine of the impact angle with the
 		// DOM is the same as the z-component of the photon
@@ -273,16 +377,16 @@ I3CLSimTabulator::RecordPhoton(const I3Particle &source, const I3Photon &photon)
 		double impactWeight = wlenWeight*angularAcceptance_->GetValue(pdir[2]);
 		
 		int nsamples = floorf(distance/stepLength_);
-		nsamples += (rng_->Uniform() < distance/stepLength_ - nsamples);
-		for (int i = 0; i < nsamples; i++) {
-			double d = distance*rng_->Uniform();
-			off_t idx = GetBinIndex(source, (*p0) + d*pdir, t + d/photon.GetGroupVelocity());
+		nsamples += (rng.Uniform() < distance/stepLength_ - nsamples);
+		for (int k = 0; k < nsamples; k++) {
+			double d = distance*rng.Uniform();
+			off_t idx = GetBinIndex(frame,
+			    I3Position(p0->GetX() + d*pdir[0], p0->GetY() + d*pdir[1], p0->GetZ() + d*pdir[2]),
+			    t + d/photon.GetGroupVelocity());
 			// Once the photon has accumulated enough delay time
 			// to run off the end of the table, there's no going back. Bail.
-			if (idx < 0) {
-				i = nsteps;
-				break;
-			}
+			if (idx < 0)
+				return;
 			
 			// Weight the photon by its probability of:
 			// 1) Being detected, given its wavelength
@@ -291,14 +395,110 @@ I3CLSimTabulator::RecordPhoton(const I3Particle &source, const I3Photon &photon)
 			double weight = impactWeight*std::exp(-(absLengths[0] +
 			    (d/distance)*(absLengths[1]-absLengths[0])));
 			
-			((float*)PyArray_DATA(values_))[idx] += weight;
-			((float*)PyArray_DATA(weights_))[idx] += weight*weight;
+			values[idx] += weight;
+			weights[idx] += weight*weight;
 		}
 		t += distance/photon.GetGroupVelocity();
 	}
 	assert( abs(t-photon.GetTime()) < 10 );
 }
 
+void
+I3CLSimTabulator::RecordPhotons(const I3Particle &source, const I3PhotonSeriesMap &photonMap)
+{
+	std::vector<const I3Photon*> photons;
+	BOOST_FOREACH(const I3PhotonSeriesMap::value_type &pair, photonMap)
+		BOOST_FOREACH(const I3Photon &photon, pair.second)
+			photons.push_back(&photon);
+	
+	if (photons.empty())
+		return;
+	
+	const std::size_t numThreads = std::min(std::size_t(GetNumThreads()), photons.size());
+	const SourceFrame frame(source);
+	
+	// A single thread can fill the table directly, just like
+	// RecordPhoton().
+	if (numThreads == 1) {
+		float *values = (float*)PyArray_DATA(values_);
+		float *weights = (float*)PyArray_DATA(weights_);
+		BOOST_FOREACH(const I3Photon *photon, photons)
+			RecordPhotonImpl(frame, *photon, *rng_, values, weights);
+		return;
+	}
+	
+	// Private tables are allocated once and kept until the
+	// next merge.
+	while (histograms_.size() < numThreads) {
+		HistogramPtr histogram(new Histogram);
+		histogram->values.resize(tableSize_, 0.f);
+		histogram->weights.resize(tableSize_, 0.f);
+		histograms_.push_back(histogram);
+	}
+	
+	// I3RandomService is not thread-safe. Draw a seed for
+	// each worker from the main service instead.
+	std::vector<uint32_t> seeds(numThreads);
+	BOOST_FOREACH(uint32_t &seed, seeds)
+		seed = static_cast<uint32_t>(rng_->Integer(0xffffffff));
+	
+	boost::thread_group threads;
+	for (std::size_t i = 0; i < numThreads; i++)
+		threads.create_thread(boost::bind(&I3CLSimTabulator::RecordPhotonsThread,
+		    this, boost::cref(frame), boost::cref(photons), i, numThreads,
+		    seeds[i], boost::ref(*histograms_[i])));
+	threads.join_all();
+}
+
+void
+I3CLSimTabulator::RecordPhotonsThread(const SourceFrame &frame,
+    const std::vector<const I3Photon*> &photons, std::size_t first,
+    std::size_t stride, uint32_t rngSeed, Histogram &histogram) const
+{
+	I3GSLRandomService rng(rngSeed);
+	
+	// Interleave the photons between the threads. Neighbouring
+	// photons tend to come from the same step, so this spreads
+	// long and short photon paths evenly.
+	for (std::size_t i = first; i < photons.size(); i += stride)
+		RecordPhotonImpl(frame, *photons[i], rng,
+		    &(histogram.values[0]), &(histogram.weights[0]));
+}
+
+void
+I3CLSimTabulator::MergeHistograms()
+{
+	if (histograms_.empty())
+		return;
+	
+	// Each thread sums all private tables over its own range
+	// of bins, so no locking is necessary.
+	const std::size_t numThreads = std::min(std::size_t(GetNumThreads()), tableSize_);
+	const std::size_t chunkSize = (tableSize_ + numThreads - 1)/numThreads;
+	
+	boost::thread_group threads;
+	for (std::size_t begin = 0; begin < tableSize_; begin += chunkSize)
+		threads.create_thread(boost::bind(&I3CLSimTabulator::MergeHistogramsThread,
+		    this, begin, std::min(begin+chunkSize, tableSize_)));
+	threads.join_all();
+	
+	histograms_.clear();
+}
+
+void
+I3CLSimTabulator::MergeHistogramsThread(std::size_t begin, std::size_t end)
+{
+	float *values = (float*)PyArray_DATA(values_);
+	float *weights = (float*)PyArray_DATA(weights_);
+	
+	BOOST_FOREACH(const HistogramPtr &histogram, histograms_) {
+		for (std::size_t i = begin; i < end; i++) {
+			values[i] += histogram->values[i];
+			weights[i] += histogram->weights[i];
+		}
+	}
+}
+
 namespace bp = boost::python;
 
 #ifdef USE_NUMPY
@@ -319,8 +519,13 @@ register_I3CLSimTabulator()
 	    .def("SetBins", &I3CLSimTabulator::SetBins)
 	    .def("SetEfficiencies", &I3CLSimTabulator::SetEfficiencies)
 	    .def("SetRandomService", &I3CLSimTabulator::SetRandomService)
+	    .def("SetNumThreads", &I3CLSimTabulator::SetNumThreads)
+	    .def("GetNumThreads", &I3CLSimTabulator::GetNumThreads)
 	    .def("RecordPhoton", &I3CLSimTabulator::RecordPhoton)
+	    .def("RecordPhotons", &I3CLSimTabulator::RecordPhotons)
 	    .def("Normalize", &I3CLSimTabulator::Normalize)
 	    .def("GetValues", &I3CLSimTabulator::GetValues)
+	    .def("FindBin", &I3CLSimTabulator::FindBin)
+	    .staticmethod("FindBin")
 	;	
 }
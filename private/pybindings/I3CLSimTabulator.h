@@ -33,13 +33,17 @@
 #include <clsim/function/I3CLSimFunction.h>
 
 #include <boost/python/object.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <vector>
 
 class I3Position;
 class I3Particle;
 
 class I3CLSimTabulator {
 public:
-	I3CLSimTabulator() : values_(NULL), weights_(NULL), stepLength_(0), domArea_(0)
+	I3CLSimTabulator() : tableSize_(0), values_(NULL), weights_(NULL), stepLength_(0),
+	    domArea_(0), numThreads_(1)
 	{
 		#ifndef USE_NUMPY
 		log_fatal("I can't work unless built with Numpy support!");
@@ -55,16 +59,70 @@ public:
 	    I3CLSimFunctionConstPtr angularAcceptance, double domRadius);
 	void SetRandomService(I3RandomServicePtr rng);
 	
+	// The number of threads used by RecordPhotons(), 1 by default.
+	// 0 means one per hardware thread. With more than one thread,
+	// each keeps a private copy of the table, so this multiplies
+	// the memory footprint.
+	void SetNumThreads(unsigned numThreads);
+	unsigned GetNumThreads() const;
+	
 	void RecordPhoton(const I3Particle &source, const I3Photon &photon);
+	// Record all photons in the map, spread out over several threads
+	// (or directly into the table in the calling thread).
+	void RecordPhotons(const I3Particle &source, const I3PhotonSeriesMap &photons);
 	
 	void Normalize();
-	boost::python::object GetValues() const;
+	boost::python::object GetValues();
+	
+	// The bin that GetBinIndex() assigns a coordinate to, exposed
+	// for testing.
+	static off_t FindBin(boost::python::object binEdges, double x);
 	
 private:
-	off_t GetBinIndex(const I3Particle &source, const I3Position &pos, double time) const;
+	// Source coordinate system, computed once per source
+	struct SourceFrame {
+		SourceFrame(const I3Particle &source);
+		
+		const I3Particle &source;
+		double dir[3];
+		double perpDir[3];
+	};
+	
+	// Maps a coordinate to a bin without a binary search if
+	// the edges are equally spaced in x or in sqrt(x).
+	struct BinLookup {
+		enum Spacing { Irregular, Linear, Quadratic };
+		
+		BinLookup(const std::vector<double> &edges);
+		off_t Find(double x) const;
+		
+		const std::vector<double> *edges;
+		Spacing spacing;
+		double offset, scale;
+	};
+	
+	// A private table for each worker thread
+	struct Histogram {
+		std::vector<float> values;
+		std::vector<float> weights;
+	};
+	typedef boost::shared_ptr<Histogram> HistogramPtr;
+	
+	void RecordPhotonImpl(const SourceFrame &frame, const I3Photon &photon,
+	    I3RandomService &rng, float *values, float *weights) const;
+	void RecordPhotonsThread(const SourceFrame &frame,
+	    const std::vector<const I3Photon*> &photons, std::size_t first,
+	    std::size_t stride, uint32_t rngSeed, Histogram &histogram) const;
+	void MergeHistograms();
+	void MergeHistogramsThread(std::size_t begin, std::size_t end);
+	
+	off_t GetBinIndex(const SourceFrame &frame, const I3Position &pos, double time) const;
 	double GetBinVolume(off_t idx) const;
 	
 	std::vector<std::vector<double> > binEdges_;
+	std::vector<BinLookup> binLookups_;
+	std::vector<off_t> binStrides_;
+	std::size_t tableSize_;
 	
 	PyObject *values_;
 	PyObject *weights_;
@@ -75,6 +133,9 @@ private:
 	I3CLSimFunctionConstPtr wavelengthAcceptance_;
 	I3RandomServicePtr rng_;
 	
+	unsigned numThreads_;
+	std::vector<HistogramPtr> histograms_;
+	
 	SET_LOGGER("I3CLSimTabulator");
 };
 
@@ -0,0 +1,96 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3ColumnarPhotonSeriesMap.cxx
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#include <sstream>
+
+#include <icetray/I3Units.h>
+
+#include <clsim/I3ColumnarPhotonSeriesMap.h>
+
+#ifdef NO_PYTHON_DATACLASS_SUITE
+#include "icetray_python_backports/copy_suite.hpp"
+#include "icetray_python_backports/boost_serializable_pickle_suite.hpp"
+#else
+#include <icetray/python/copy_suite.hpp>
+#include <icetray/python/boost_serializable_pickle_suite.hpp>
+#endif
+
+using namespace boost::python;
+
+static std::string 
+i3columnarphotonseriesmap_prettyprint(const I3ColumnarPhotonSeriesMap& s)
+{
+    std::ostringstream oss;
+    oss << "[ I3ColumnarPhotonSeriesMap : " << std::endl
+        << "               num blocks : " << s.GetNumBlocks() << std::endl
+        << "              num photons : " << s.GetNumPhotons() << std::endl
+        << "       delta-encode times : " << (s.GetDeltaEncodeTimes() ? "yes" : "no") << std::endl
+        << "      quantize directions : " << (s.GetQuantizeDirections() ? "yes" : "no") << std::endl
+        << "      position resolution : ";
+    if (s.GetQuantizePositions())
+        oss << s.GetPositionResolution()/I3Units::mm << "mm" << std::endl;
+    else
+        oss << "not quantized" << std::endl;
+    oss << "]" ;
+
+    return oss.str();
+}
+
+void register_I3ColumnarPhotonSeriesMap()
+{
+    class_<I3ColumnarPhotonSeriesMap, bases<I3FrameObject>, I3ColumnarPhotonSeriesMapPtr>("I3ColumnarPhotonSeriesMap", init<>())
+    .def(init<const I3PhotonSeriesMap &, bool, bool, double>(
+         (
+          bp::arg("photons"),
+          bp::arg("DeltaEncodeTimes")=false,
+          bp::arg("QuantizeDirections")=false,
+          bp::arg("PositionResolution")=0.
+         )
+        ))
+
+    .def("Fill", &I3ColumnarPhotonSeriesMap::Fill)
+    .def("GetPhotonSeriesMap", &I3ColumnarPhotonSeriesMap::GetPhotonSeriesMap)
+
+    .def("GetNumBlocks", &I3ColumnarPhotonSeriesMap::GetNumBlocks)
+    .def("GetNumPhotons", &I3ColumnarPhotonSeriesMap::GetNumPhotons)
+    .def("GetBlockKey", &I3ColumnarPhotonSeriesMap::GetBlockKey, return_value_policy<copy_const_reference>())
+    .def("GetBlockSize", &I3ColumnarPhotonSeriesMap::GetBlockSize)
+
+    .add_property("numBlocks", &I3ColumnarPhotonSeriesMap::GetNumBlocks)
+    .add_property("numPhotons", &I3ColumnarPhotonSeriesMap::GetNumPhotons)
+    .add_property("deltaEncodeTimes", &I3ColumnarPhotonSeriesMap::GetDeltaEncodeTimes)
+    .add_property("quantizeDirections", &I3ColumnarPhotonSeriesMap::GetQuantizeDirections)
+    .add_property("positionResolution", &I3ColumnarPhotonSeriesMap::GetPositionResolution)
+
+    .def("__len__", &I3ColumnarPhotonSeriesMap::GetNumBlocks)
+    .def("__str__", i3columnarphotonseriesmap_prettyprint)
+
+    .def(bp::copy_suite<I3ColumnarPhotonSeriesMap>())
+    .def_pickle(bp::boost_serializable_pickle_suite<I3ColumnarPhotonSeriesMap>())
+    ;
+
+    register_pointer_conversions<I3ColumnarPhotonSeriesMap>();
+}
@@ -36,11 +36,10 @@ namespace bp = boost::python;
     (I3Photon)(I3CompressedPhoton)                  \
     (I3CLSimEventStatistics)(I3Converters)          \
     (I3CLSimFlasherPulse)(I3ShadowedPhotonRemover)  \
-    (I3ExtraGeometryItem)
+    (I3ExtraGeometryItem)                           \
+    (I3CLSimSparsePhotonTable)                      \
+    (I3ColumnarPhotonSeriesMap)
 
-#ifndef BUILD_CLSIM_DATACLASSES_ONLY
-// all these do depend on either OpenCL and/or Geant4
-// so they may not be compiled if these tools are missing:
 #define REGISTER_THESE_THINGS_TOO                   \
     (I3CLSimStep)(I3CLSimPhoton)                    \
     (I3CLSimPhotonHistory)                          \
@@ -50,11 +49,17 @@ namespace bp = boost::python;
     (I3CLSimStepToPhotonConverter)                  \
     (I3CLSimSimpleGeometry)                         \
     (I3CLSimLightSourceParameterization)            \
-    (I3CLSimTester)(I3ModuleHelper)                 \
+    (I3ModuleHelper)                                \
     (I3CLSimLightSourceToStepConverterUtils)        \
-    (I3CLSimOpenCLDevice)(I3CLSimLightSource)       \
+    (I3CLSimLightSource)                            \
     (I3CLSimSpectrumTable)(I3CLSimScalarField)      \
     (I3CLSimVectorTransform)
+
+#ifndef I3CLSIM_WITHOUT_OPENCL
+// all these do depend on OpenCL
+// so they may not be compiled if it is missing:
+#define REGISTER_THESE_OPENCL_THINGS                \
+    (I3CLSimTester)(I3CLSimOpenCLDevice)
 #endif
 
 #define I3_REGISTRATION_FN_DECL(r, data, t) void BOOST_PP_CAT(register_,t)();
@@ -70,8 +75,9 @@ void register_I3Matrix();
 
 
 BOOST_PP_SEQ_FOR_EACH(I3_REGISTRATION_FN_DECL, ~, REGISTER_THESE_THINGS)
-#ifndef BUILD_CLSIM_DATACLASSES_ONLY
 BOOST_PP_SEQ_FOR_EACH(I3_REGISTRATION_FN_DECL, ~, REGISTER_THESE_THINGS_TOO)
+#ifndef I3CLSIM_WITHOUT_OPENCL
+BOOST_PP_SEQ_FOR_EACH(I3_REGISTRATION_FN_DECL, ~, REGISTER_THESE_OPENCL_THINGS)
 #endif
 
 BOOST_PYTHON_MODULE(clsim)
@@ -85,8 +91,9 @@ BOOST_PYTHON_MODULE(clsim)
     }
 
     BOOST_PP_SEQ_FOR_EACH(I3_REGISTER, ~, REGISTER_THESE_THINGS);
-#ifndef BUILD_CLSIM_DATACLASSES_ONLY
     BOOST_PP_SEQ_FOR_EACH(I3_REGISTER, ~, REGISTER_THESE_THINGS_TOO);
+#ifndef I3CLSIM_WITHOUT_OPENCL
+    BOOST_PP_SEQ_FOR_EACH(I3_REGISTER, ~, REGISTER_THESE_OPENCL_THINGS);
 #endif
     
 #ifdef USE_TABULATOR
@@ -0,0 +1,140 @@
+// Compares the throughput of I3CLSimQueue (mutex + condition variable)
+// and I3CLSimLockFreeQueue with several producer and consumer threads
+// pushing shared pointers through a small bounded queue, i.e. the
+// situation on the step and photon hand-off channels.
+//
+// usage: queue_benchmark [numItemsPerProducer] [queueSize] [maxNumThreads]
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "clsim/I3CLSimQueue.h"
+#include "clsim/I3CLSimLockFreeQueue.h"
+
+namespace {
+    typedef boost::shared_ptr<const std::size_t> Item_t;
+
+    template <typename Queue_t>
+    void Producer(Queue_t &queue, std::size_t numItems)
+    {
+        for (std::size_t i=0;i<numItems;++i)
+        {
+            queue.Put(boost::make_shared<const std::size_t>(i));
+        }
+    }
+
+    template <typename Queue_t>
+    void Consumer(Queue_t &queue, std::size_t numItems, std::size_t &sum)
+    {
+        std::size_t localSum=0;
+        for (std::size_t i=0;i<numItems;++i)
+        {
+            Item_t item = queue.Get();
+            localSum += *item;
+        }
+        sum = localSum;
+    }
+
+    // returns the number of items per second
+    template <typename Queue_t>
+    double RunBenchmark(std::size_t queueSize,
+                        std::size_t numProducers,
+                        std::size_t numConsumers,
+                        std::size_t numItemsPerProducer)
+    {
+        Queue_t queue(queueSize);
+
+        const std::size_t numItems = numProducers*numItemsPerProducer;
+        if (numItems % numConsumers != 0) {
+            std::cerr << "number of items has to be a multiple of the number of consumers" << std::endl;
+            std::exit(1);
+        }
+
+        std::vector<std::size_t> sums(numConsumers, 0);
+
+        const boost::posix_time::ptime startTime =
+        boost::posix_time::microsec_clock::universal_time();
+
+        boost::thread_group threads;
+        for (std::size_t i=0;i<numConsumers;++i)
+        {
+            threads.create_thread(boost::bind(&Consumer<Queue_t>, boost::ref(queue),
+                                              numItems/numConsumers, boost::ref(sums[i])));
+        }
+        for (std::size_t i=0;i<numProducers;++i)
+        {
+            threads.create_thread(boost::bind(&Producer<Queue_t>, boost::ref(queue),
+                                              numItemsPerProducer));
+        }
+        threads.join_all();
+
+        const boost::posix_time::ptime endTime =
+        boost::posix_time::microsec_clock::universal_time();
+
+        // make sure nothing got lost on the way
+        std::size_t sum=0;
+        for (std::size_t i=0;i<numConsumers;++i) sum+=sums[i];
+        const std::size_t expectedSum = numProducers*(numItemsPerProducer*(numItemsPerProducer-1)/2);
+        if (sum != expectedSum) {
+            std::cerr << "checksum mismatch: " << sum << " != " << expectedSum << std::endl;
+            std::exit(1);
+        }
+
+        const double seconds = static_cast<double>((endTime-startTime).total_microseconds())/1e6;
+        return static_cast<double>(numItems)/seconds;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const std::size_t numItemsPerProducer = (argc>1)?std::atol(argv[1]):200000;
+    const std::size_t queueSize = (argc>2)?std::atol(argv[2]):16;
+    const std::size_t maxNumThreads = (argc>3)?std::atol(argv[3]):8;
+
+    if ((numItemsPerProducer==0) || (queueSize==0) || (maxNumThreads==0)) {
+        std::cerr << "usage: " << argv[0] << " [numItemsPerProducer] [queueSize] [maxNumThreads]" << std::endl;
+        return 1;
+    }
+
+    std::cout << "queue size " << queueSize << ", "
+              << numItemsPerProducer << " items per producer" << std::endl;
+    std::cout << std::setw(10) << "producers"
+              << std::setw(10) << "consumers"
+              << std::setw(16) << "mutex [1/s]"
+              << std::setw(16) << "lock-free [1/s]"
+              << std::setw(10) << "ratio" << std::endl;
+
+    for (std::size_t numProducers=1;numProducers<=maxNumThreads;numProducers*=2)
+    {
+        // one consumer (like the OpenCL feeder thread) and as many as producers
+        std::vector<std::size_t> numConsumersList;
+        numConsumersList.push_back(1);
+        if (numProducers>1) numConsumersList.push_back(numProducers);
+
+        for (std::size_t j=0;j<numConsumersList.size();++j)
+        {
+            const std::size_t numConsumers = numConsumersList[j];
+
+            const double rateMutex =
+            RunBenchmark<I3CLSimQueue<Item_t> >(queueSize, numProducers, numConsumers, numItemsPerProducer);
+            const double rateLockFree =
+            RunBenchmark<I3CLSimLockFreeQueue<Item_t> >(queueSize, numProducers, numConsumers, numItemsPerProducer);
+
+            std::cout << std::setw(10) << numProducers
+                      << std::setw(10) << numConsumers
+                      << std::setw(16) << std::fixed << std::setprecision(0) << rateMutex
+                      << std::setw(16) << std::fixed << std::setprecision(0) << rateLockFree
+                      << std::setw(10) << std::fixed << std::setprecision(2) << rateLockFree/rateMutex
+                      << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -40,6 +40,11 @@ static const unsigned i3clsimeventstatistics_version_ = 0;
  * @brief This class collects statistics/information
  * on simulated events (for example the total number
  * of generated photons).
+ *
+ * If photons are split (or play Russian roulette) during
+ * propagation, the number of photons at DOMs counts each
+ * copy that reached a DOM. Only the sums of weights can
+ * be compared to the generated photons in that case.
  */
 class I3CLSimEventStatistics : public I3FrameObject
 {
@@ -35,13 +35,25 @@
 #include <boost/thread/locks.hpp>
 
 #include "clsim/I3CLSimQueue.h"
+#include "clsim/I3CLSimLockFreeQueue.h"
+
+#include <sys/types.h>
 
 #include <map>
+#include <deque>
+#include <vector>
 #include <string>
 
 /**
  * @brief A particle-to-step converter using Geant4
  * for tracking.
+ *
+ * Geant4's run manager keeps global state, so there can only be
+ * one instance of this class per process. Use
+ * SetNumWorkerProcesses() to track several light sources at the
+ * same time: each worker process runs its own copy of Geant4 (and
+ * of all parameterizations) and the steps of all workers are
+ * merged into a single output queue.
  */
 struct I3CLSimLightSourceToStepConverterGeant4 : public I3CLSimLightSourceToStepConverter
 {
@@ -50,7 +62,10 @@ private:
     static bool thereCanBeOnlyOneGeant4;
     
 public:
-    typedef std::pair<I3CLSimStepSeriesConstPtr, bool> FromGeant4Pair_t;
+    // the uint32_t is 0 for regular bunches. Otherwise it is the flush
+    // marker (or flushMarkerBarrier) completed by this bunch.
+    typedef std::pair<I3CLSimStepSeriesConstPtr, uint32_t> FromGeant4Pair_t;
+    static const uint32_t flushMarkerBarrier;
     
     static const std::string default_physicsListName;
     static const double default_maxBetaChangePerStep;
@@ -83,6 +98,42 @@ public:
 
     virtual void SetRandomService(I3RandomServicePtr random);
 
+    /**
+     * Sets the number of worker processes. With a value of 0
+     * (the default) Geant4 runs in a thread of this process.
+     * Otherwise, Initialize() forks this many processes, each
+     * with its own Geant4 instance and its own random number
+     * stream. Light sources are distributed round-robin
+     * and their step bunches keep their identifiers.
+     *
+     * The workers are forked from the calling process, so only
+     * fork them while no other thread holds locks the workers
+     * might need (see ForkWorkerProcesses()).
+     *
+     * If a worker process dies, GetConversionResult() throws.
+     *
+     * Will throw if used after the call to Initialize().
+     */
+    void SetNumWorkerProcesses(uint32_t num);
+
+    /**
+     * Returns the number of worker processes.
+     */
+    uint32_t GetNumWorkerProcesses() const;
+
+    /**
+     * Forks the worker processes without initializing anything
+     * else. Call this before starting any other threads in this
+     * process (e.g. before initializing step-to-photon converters).
+     * The bunch sizes can still be changed afterwards, the workers
+     * receive them in Initialize(). Initialize() forks the workers
+     * itself if this has not been called. Does nothing if no worker
+     * processes are configured.
+     *
+     * Will throw if used after the call to Initialize().
+     */
+    void ForkWorkerProcesses();
+
     /**
      * Sets the wavelength bias. Set this to a constant value
      * of 1 if you do not need biased photon generation.
@@ -145,6 +196,24 @@ public:
      * Will throw if not initialized.
      */
     virtual bool BarrierActive() const;
+
+    /**
+     * Adds a flush marker to the particle queue. Once all light sources
+     * enqueued before the marker have been converted, their remaining
+     * steps are sent (the last bunch padded to the bunch size granularity)
+     * and the marker is returned by GetConversionResultWithMarkerInfo()
+     * along with the last of these bunches. Flushing may be deferred while
+     * more light sources are waiting and only a small bunch could be sent;
+     * in that case the marker is reported with a later flush, after the
+     * steps of the light sources following it.
+     *
+     * Unlike a barrier, this does not block the particle queue.
+     * Markers must not be 0 or flushMarkerBarrier. An enqueued barrier
+     * implies all earlier markers, they will not be reported separately.
+     * 
+     * Will throw if not initialized.
+     */
+    void EnqueueFlushMarker(uint32_t marker);
     
     /**
      * Returns true if more steps are available for the current particle.
@@ -168,6 +237,14 @@ public:
      * Will throw if not initialized.
      */
     virtual I3CLSimStepSeriesConstPtr GetConversionResultWithBarrierInfo(bool &barrierWasReset, double timeout=NAN);
+
+    /**
+     * Same as GetConversionResultWithBarrierInfo(), but also returns the
+     * flush marker completed by this bunch of steps (or 0 if there is none).
+     * All steps of light sources enqueued before the marker have been
+     * returned at this point. The returned bunch may be empty.
+     */
+    I3CLSimStepSeriesConstPtr GetConversionResultWithMarkerInfo(uint32_t &flushMarker, bool &barrierWasReset, double timeout=NAN);
     
 private:
     void LogGeant4Messages(bool allAsWarn=false) const;
@@ -177,6 +254,32 @@ private:
     void Geant4Thread();
     void Geant4Thread_impl(boost::this_thread::disable_interruption &di);
     boost::shared_ptr<boost::thread> geant4ThreadObj_;
+
+    // used if numWorkerProcesses_>0
+    void StartWorkerProcesses(); // sends the bunch sizes and starts the receivers
+    void StopWorkerProcesses();
+    void WorkerProcessMain(int socket, uint32_t seed); // runs in the worker, never returns
+    void WorkerProcessReaderThread(int socket);        // runs in the worker
+    void WorkerReceiverThread(std::size_t workerIndex);
+    void SendMarkerToWorkers(uint32_t marker);
+
+    uint32_t numWorkerProcesses_;
+    std::vector<pid_t> workerPIDs_;
+    std::vector<int> workerSockets_;
+    std::vector<boost::shared_ptr<boost::thread> > workerReceiverThreads_;
+    std::size_t nextWorker_;
+    boost::mutex workerSend_mutex_;
+
+    // Flush markers and barriers sent to the workers, in order. A marker is
+    // reported once all workers have returned it (or a later one).
+    boost::mutex workerMarkers_mutex_;
+    std::deque<std::pair<uint64_t, uint32_t> > workerMarkerSequence_; // (sequence number, marker)
+    std::vector<uint64_t> workerLastMarkerSequenceNumber_;
+    uint64_t nextMarkerSequenceNumber_;
+    uint64_t lastReportedMarkerSequenceNumber_;
+    bool workersShuttingDown_;
+    std::string workerError_; // set if a worker process died
+    boost::mutex workerQueue_mutex_; // keeps the receivers' bunches and markers in order
     boost::condition_variable_any geant4Started_cond_;
     boost::mutex geant4Started_mutex_;
     bool geant4Started_;
@@ -185,7 +288,7 @@ private:
     bool barrier_is_enqueued_;
 
     boost::shared_ptr<I3CLSimQueue<ToGeant4Pair_t> > queueToGeant4_;
-    boost::shared_ptr<I3CLSimQueue<FromGeant4Pair_t> > queueFromGeant4_;
+    boost::shared_ptr<I3CLSimLockFreeQueue<FromGeant4Pair_t> > queueFromGeant4_;
     mutable boost::shared_ptr<I3CLSimQueue<boost::shared_ptr<std::pair<const std::string, bool> > > > queueFromGeant4Messages_;
     
     I3RandomServicePtr randomService_;
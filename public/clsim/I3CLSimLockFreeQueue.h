@@ -0,0 +1,366 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimLockFreeQueue.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMLOCKFREEQUEUE_H_INCLUDED
+#define I3CLSIMLOCKFREEQUEUE_H_INCLUDED
+
+#include <boost/version.hpp>
+
+// boost::atomic is available starting with boost 1.53
+#if BOOST_VERSION >= 105300
+#define I3CLSIM_LOCKFREEQUEUE_USES_ATOMICS
+#endif
+
+#ifdef I3CLSIM_LOCKFREEQUEUE_USES_ATOMICS
+
+#include <stdexcept>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+
+/**
+ * @brief A bounded multi-producer/multi-consumer queue
+ * storing objects of type T in a ring buffer.
+ *
+ * This has the same interface as I3CLSimQueue, but Put() and Get()
+ * do not take a lock as long as the queue is neither full nor empty.
+ * size() and empty() never lock. Threads that have to wait spin
+ * for a short while and then sleep on a condition variable (which
+ * makes the blocking calls boost::thread interruption points,
+ * just like the ones in I3CLSimQueue).
+ *
+ * Each slot carries a sequence number telling producers and consumers
+ * whose turn it is, see D. Vyukov's "bounded MPMC queue". A slot
+ * is free for the write at position "pos" if its sequence number is
+ * 2*pos and holds the entry written at "pos" if it is 2*pos+1.
+ * (The factor of 2 keeps the two states apart for a queue of size 1.)
+ *
+ * Unlike I3CLSimQueue, the maximum size has to be > 0.
+ * Slots are overwritten with T() once they have been read,
+ * so shared pointers are released right away.
+ */
+template <typename T>
+class I3CLSimLockFreeQueue : private boost::noncopyable
+{
+public:
+    I3CLSimLockFreeQueue(std::size_t max_size)
+    :
+    max_size_(max_size),
+    cells_(NULL),
+    numWaitingPutters_(0),
+    numWaitingGetters_(0)
+    {
+        if (max_size_==0)
+            throw std::invalid_argument("I3CLSimLockFreeQueue needs a maximum size > 0");
+
+        cells_ = new Cell[max_size_];
+        for (std::size_t i=0;i<max_size_;++i)
+        {
+            cells_[i].sequence.store(2*i, boost::memory_order_relaxed);
+        }
+        enqueuePos_.store(0, boost::memory_order_relaxed);
+        dequeuePos_.store(0, boost::memory_order_relaxed);
+    }
+
+    ~I3CLSimLockFreeQueue()
+    {
+        delete [] cells_;
+    }
+
+    bool PutNonBlocking(const T &msg)
+    {
+        if (!TryPut(msg)) return false;
+        WakeUp(numWaitingGetters_);
+        return true;
+    }
+
+    void Put(const T &msg)
+    {
+        if (!SpinFor(&I3CLSimLockFreeQueue::TryPut, msg))
+        {
+            // still full, go to sleep
+            boost::unique_lock<boost::mutex> guard(mutex_);
+            WaitingGuard waiting(numWaitingPutters_);
+
+            while (!TryPut(msg))
+            {
+                cond_.wait(guard);
+            }
+        }
+
+        // notify a sleeping consumer thread
+        WakeUp(numWaitingGetters_);
+    }
+
+    T Get()
+    {
+        T msg;
+
+        if (!SpinFor(&I3CLSimLockFreeQueue::TryGet, msg))
+        {
+            // still empty, go to sleep
+            boost::unique_lock<boost::mutex> guard(mutex_);
+            WaitingGuard waiting(numWaitingGetters_);
+
+            while (!TryGet(msg))
+            {
+                cond_.wait(guard);
+            }
+        }
+
+        // notify a sleeping producer that there is space on the queue now
+        WakeUp(numWaitingPutters_);
+
+        return msg;
+    }
+
+    bool GetNonBlocking(T &value)
+    {
+        if (!TryGet(value)) return false;
+        WakeUp(numWaitingPutters_);
+        return true;
+    }
+
+    T Get(double timeout, T returnOnTimeout) // timeout in seconds
+    {
+        T msg;
+
+        if (!TryGet(msg))
+        {
+            const boost::system_time deadline = boost::get_system_time() +
+            boost::posix_time::milliseconds(static_cast<long>(timeout*1000.));
+
+            boost::unique_lock<boost::mutex> guard(mutex_);
+            WaitingGuard waiting(numWaitingGetters_);
+
+            while (!TryGet(msg))
+            {
+                if (!cond_.timed_wait(guard, deadline)) {
+                    // try one last time, there might have been a race with the timeout
+                    if (TryGet(msg)) break;
+
+                    // timeout reached, return dummy
+                    return returnOnTimeout;
+                }
+            }
+        }
+
+        // notify a sleeping producer that there is space on the queue now
+        WakeUp(numWaitingPutters_);
+
+        return msg;
+    }
+
+    bool empty() const
+    {
+        return (size()==0);
+    }
+
+    // this is only a snapshot if other threads are using the queue
+    std::size_t size() const
+    {
+        const std::size_t dequeuePos = dequeuePos_.load(boost::memory_order_relaxed);
+        const std::size_t enqueuePos = enqueuePos_.load(boost::memory_order_relaxed);
+
+        // the two loads are not atomic with respect to each other
+        if (enqueuePos <= dequeuePos) return 0;
+        const std::size_t numEntries = enqueuePos-dequeuePos;
+        return (numEntries > max_size_)?max_size_:numEntries;
+    }
+
+    inline std::size_t max_size() const
+    {
+        return max_size_;
+    }
+
+private:
+    // try this often before going to sleep
+    static const unsigned int numSpins = 64;
+
+    struct Cell
+    {
+        boost::atomic<std::size_t> sequence;
+        T data;
+    };
+
+    // keeps the number of sleeping threads up-to-date
+    class WaitingGuard
+    {
+    public:
+        WaitingGuard(boost::atomic<std::size_t> &counter) : counter_(counter)
+        {
+            counter_.fetch_add(1, boost::memory_order_seq_cst);
+            // the following TryPut()/TryGet() must not be moved above this
+            boost::atomic_thread_fence(boost::memory_order_seq_cst);
+        }
+        ~WaitingGuard()
+        {
+            counter_.fetch_sub(1, boost::memory_order_relaxed);
+        }
+    private:
+        boost::atomic<std::size_t> &counter_;
+    };
+
+    bool TryPut(const T &msg)
+    {
+        std::size_t pos = enqueuePos_.load(boost::memory_order_relaxed);
+        Cell *cell;
+
+        for (;;)
+        {
+            cell = &(cells_[pos % max_size_]);
+            const std::size_t seq = cell->sequence.load(boost::memory_order_acquire);
+            const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq - 2*pos);
+
+            if (diff == 0) {
+                // the slot is free, try to claim it
+                if (enqueuePos_.compare_exchange_weak(pos, pos+1, boost::memory_order_relaxed)) break;
+                // "pos" has been updated by compare_exchange_weak
+            } else if (diff < 0) {
+                // the slot has not been read yet: the queue is full
+                return false;
+            } else {
+                // another producer was faster
+                pos = enqueuePos_.load(boost::memory_order_relaxed);
+            }
+        }
+
+        cell->data = msg;
+        cell->sequence.store(2*pos+1, boost::memory_order_release);
+        return true;
+    }
+
+    bool TryGet(T &msg)
+    {
+        std::size_t pos = dequeuePos_.load(boost::memory_order_relaxed);
+        Cell *cell;
+
+        for (;;)
+        {
+            cell = &(cells_[pos % max_size_]);
+            const std::size_t seq = cell->sequence.load(boost::memory_order_acquire);
+            const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq - (2*pos+1));
+
+            if (diff == 0) {
+                // the slot has been written, try to claim it
+                if (dequeuePos_.compare_exchange_weak(pos, pos+1, boost::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                // nothing has been written to this slot yet: the queue is empty
+                return false;
+            } else {
+                // another consumer was faster
+                pos = dequeuePos_.load(boost::memory_order_relaxed);
+            }
+        }
+
+        msg = cell->data;
+        cell->data = T(); // do not keep a copy around
+        cell->sequence.store(2*(pos+max_size_), boost::memory_order_release);
+        return true;
+    }
+
+    // calls TryPut() or TryGet() a few times, yielding in between
+    template <typename U>
+    bool SpinFor(bool (I3CLSimLockFreeQueue::*tryFunc)(U &), U &msg)
+    {
+        for (unsigned int i=0;i<numSpins;++i)
+        {
+            if ((this->*tryFunc)(msg)) return true;
+            boost::this_thread::yield();
+        }
+        return false;
+    }
+
+    bool SpinFor(bool (I3CLSimLockFreeQueue::*tryFunc)(const T &), const T &msg)
+    {
+        for (unsigned int i=0;i<numSpins;++i)
+        {
+            if ((this->*tryFunc)(msg)) return true;
+            boost::this_thread::yield();
+        }
+        return false;
+    }
+
+    void WakeUp(const boost::atomic<std::size_t> &numWaiting)
+    {
+        // pairs with the fence in WaitingGuard: either the waiting
+        // thread sees our change or we see the waiting thread
+        boost::atomic_thread_fence(boost::memory_order_seq_cst);
+        if (numWaiting.load(boost::memory_order_relaxed) == 0) return;
+
+        // taking the lock makes sure the waiting thread is either
+        // sleeping already or has not yet checked the queue again
+        boost::unique_lock<boost::mutex> guard(mutex_);
+        cond_.notify_all();
+    }
+
+    std::size_t max_size_;
+    Cell *cells_;
+
+    // keep the producer and consumer positions on separate cache lines
+    char padding0_[64];
+    boost::atomic<std::size_t> enqueuePos_;
+    char padding1_[64];
+    boost::atomic<std::size_t> dequeuePos_;
+    char padding2_[64];
+
+    boost::atomic<std::size_t> numWaitingPutters_;
+    boost::atomic<std::size_t> numWaitingGetters_;
+    boost::mutex mutex_;
+    boost::condition_variable_any cond_;
+};
+
+#else //I3CLSIM_LOCKFREEQUEUE_USES_ATOMICS
+
+#include "clsim/I3CLSimQueue.h"
+
+/**
+ * @brief Fallback for old versions of boost without boost::atomic.
+ * This is just a I3CLSimQueue with an additional PutNonBlocking().
+ */
+template <typename T>
+class I3CLSimLockFreeQueue : public I3CLSimQueue<T>
+{
+public:
+    I3CLSimLockFreeQueue(std::size_t max_size)
+    : I3CLSimQueue<T>(max_size) {}
+
+    bool PutNonBlocking(const T &msg)
+    {
+        if (this->size() >= this->max_size()) return false;
+        this->Put(msg); // might block if there are other producers
+        return true;
+    }
+};
+
+#endif //I3CLSIM_LOCKFREEQUEUE_USES_ATOMICS
+
+#endif //I3CLSIMLOCKFREEQUEUE_H_INCLUDED
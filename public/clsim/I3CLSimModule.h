@@ -32,6 +32,7 @@
 
 #include "dataclasses/I3Vector.h"
 #include "dataclasses/physics/I3MCTree.h"
+#include "simclasses/I3MCPE.h"
 
 #include "icetray/OMKey.h"
 
@@ -41,7 +42,9 @@
 
 #include "phys-services/I3RandomService.h"
 
+#ifndef I3CLSIM_WITHOUT_OPENCL
 #include "clsim/I3CLSimOpenCLDevice.h"
+#endif
 
 #include "clsim/random_value/I3CLSimRandomValue.h"
 #include "clsim/function/I3CLSimFunction.h"
@@ -51,7 +54,14 @@
 
 #include "clsim/I3CLSimSimpleGeometryFromI3Geometry.h"
 
+#ifndef I3CLSIM_WITHOUT_OPENCL
 #include "clsim/I3CLSimStepToPhotonConverterOpenCL.h"
+#endif
+#include "clsim/I3CLSimStepToPhotonConverterNative.h"
+#include "clsim/I3CLSimStepToPhotonConverterRemote.h"
+#include "clsim/I3CLSimStepBunchScheduler.h"
+#include "clsim/I3CLSimStepPreCuller.h"
+#include "clsim/I3CLSimQueue.h"
 #include "clsim/I3CLSimLightSourceToStepConverterGeant4.h"
 
 #include "clsim/I3CLSimLightSourceParameterization.h"
@@ -59,6 +69,7 @@
 #include "clsim/I3Photon.h"
 
 #include "clsim/I3CLSimPhotonHistory.h"
+#include "clsim/I3CLSimPhotonSeriesView.h"
 #include "clsim/I3CLSimEventStatistics.h"
 
 #include <boost/thread.hpp>
@@ -66,6 +77,7 @@
 #include <boost/thread/locks.hpp>
 
 #include <vector>
+#include <deque>
 #include <set>
 #include <map>
 #include <string>
@@ -155,11 +167,13 @@ private:
     /// If set to NULL/None, only spectrum #0 (Cherenkov photons) will be available.
     I3CLSimSpectrumTableConstPtr spectrumTable_;
 
-    /// Parameter: Maximum number of events that will be processed by the GPU in parallel.
+    /// Parameter: Maximum number of events that will be held by this module and processed in parallel.
     unsigned int maxNumParallelEvents_;
 
+#ifndef I3CLSIM_WITHOUT_OPENCL
     /// Parameter: A vector of I3CLSimOpenCLDevice objects, describing the devices to be used for simulation.
     I3CLSimOpenCLDeviceSeries openCLDeviceList_;
+#endif
 
     /// Parameter: The DOM radius used during photon tracking.
     double DOMRadius_;
@@ -180,7 +194,26 @@ private:
     /// Parameter: Name of the I3CLSimPhotonSeriesMap frame object that will be written to the frame.
     std::string photonSeriesMapName_;
 
+    /// Parameter: Name of an I3MCPESeriesMap frame object. If set, photons are converted
+    ///   to photo-electrons on the OpenCL device (using "WavelengthAcceptance", "AngularAcceptance"
+    ///   and the relative DOM efficiencies from the Calibration frame) and only the
+    ///   resulting hits are written instead of the I3PhotonSeriesMap.
+    std::string MCPESeriesMapName_;
+
+    /// Parameter: Wavelength acceptance of the DOMs, used with "MCPESeriesMapName".
+    I3CLSimFunctionConstPtr wavelengthAcceptance_;
+
+    /// Parameter: Angular acceptance of the DOMs (as a function of the cosine of the
+    ///   photon direction w.r.t. the down-facing PMT axis), used with "MCPESeriesMapName".
+    I3CLSimFunctionConstPtr angularAcceptance_;
+
+    /// Parameter: Relative DOM efficiency used for DOMs without a (non-NaN) entry
+    ///   in I3Calibration, used with "MCPESeriesMapName".
+    double defaultRelativeDOMEfficiency_;
+
     /// Parameter: Name of a I3VectorOMKey with masked OMKeys. DOMs in this list will not record I3Photons.
+    ///   With UseDOMGrid, the device already skips masked DOMs (photons pass through them if
+    ///   StopDetectedPhotons is set).
     std::string omKeyMaskName_;
     
     /// Parameter: If set to True, muons will not be propagated.
@@ -195,6 +228,9 @@ private:
     /// Parameter: Approximate maximum number of Cherenkov photons generated per step by Geant4.
     uint32_t geant4MaxNumPhotonsPerStep_;
 
+    /// Parameter: Run Geant4 in this many separate worker processes (0: run it in a thread of this process).
+    uint32_t geant4NumWorkerProcesses_;
+
     /// Parameter: Collect statistics in this frame object (e.g. number of photons generated or reaching the DOMs)
     std::string statisticsName_;
     bool collectStatistics_;
@@ -232,6 +268,52 @@ private:
     ///   easy to observe.
     bool enableDoubleBuffering_;
     
+    /// Parameter: Number of step/photon buffer sets in the OpenCL device pipeline.
+    ///   0 means 2 if EnableDoubleBuffering is set and 1 otherwise.
+    uint32_t numOpenCLBuffers_;
+    
+    /// Parameter: Transfer steps and photons through pinned host buffers that stay mapped.
+    ///   Photons are handed to this module as a view of the mapped memory instead of a copy.
+    bool useMappedOpenCLBuffers_;
+    
+    /// Parameter: Let the kernel write compact 40 byte photon records (half precision directions,
+    ///   wavelengths and DOM-relative positions, no start position) that are expanded on the host.
+    bool compactPhotonOutput_;
+    
+    /// Parameter: Number of wavelength bins used to tabulate the medium properties
+    ///   for each layer. The kernel interpolates in these tables. 0 disables them.
+    uint32_t mediumPropertiesLookupTableBins_;
+    
+    /// Parameter: Number of wavelength bins used to tabulate the cumulative optical depth
+    ///   below each layer. The kernel finds interaction layers by binary search. 0 disables this.
+    uint32_t opticalDepthTableBins_;
+    
+    /// Parameter: Use a uniform 3D grid of DOMs (uploaded as buffers) for collision
+    ///   detection instead of the 2D string grid. Works for any DOM layout.
+    ///   The kernel does not depend on the geometry, so further Geometry frames
+    ///   only cost a buffer upload.
+    bool useDOMGrid_;
+    
+    /// Parameter: If not NaN, photons that cannot reach any DOM with their remaining
+    ///   absorption lengths (plus this margin, in units of the largest absorption length)
+    ///   are stopped early. Uses a coarse distance field calculated from the geometry.
+    double distanceCullingMargin_;
+
+    /// Parameter: If larger than 0, steps whose photons reach a DOM with a probability
+    ///   smaller than this are thinned out before propagation (their weights are scaled up).
+    double stepPreCullingProbability_;
+
+    /// Parameter: If larger than 1, photons getting close to a DOM are split into this number
+    ///   of copies and photons far away from all DOMs play Russian roulette (OpenCL only).
+    uint32_t photonSplittingFactor_;
+
+    /// Parameter: Photons closer to a DOM than this are split (see PhotonSplittingFactor).
+    double photonSplittingDistance_;
+
+    /// Parameter: Photons further away from all DOMs than this play Russian roulette
+    ///   (see PhotonSplittingFactor).
+    double photonRouletteDistance_;
+    
     /// Parmeter: Enables double-precision support in the kernel. This slows down calculations and
     ///   requires more memory. The performance hit is minimal on CPUs but up to an order
     ///   of magnitude on GPUs.
@@ -276,6 +358,19 @@ private:
     ///   If set to zero (the default) the largest possible workgroup size will be chosen.
     uint32_t limitWorkgroupSize_;
 
+    /// Parameter: Propagate photons on the host CPU (in addition to any devices
+    ///   in "OpenCLDeviceList"). This does not need an OpenCL runtime.
+    bool useNativePropagator_;
+
+    /// Parameter: Number of worker threads used by the native propagator.
+    ///   If set to zero (the default) one thread per hardware core is used.
+    uint32_t numNativePropagatorThreads_;
+
+    /// Parameter: Addresses ("unix:/path" or "tcp:host:port") of worker processes
+    ///   running an I3CLSimStepToPhotonConverterServer. They are used in addition
+    ///   to all other devices and have to be configured like this module.
+    std::vector<std::string> remoteWorkers_;
+
 
 private:
     // default, assignment, and copy constructor declared private
@@ -293,22 +388,46 @@ private:
     boost::mutex threadStarted_mutex_;
     bool threadStarted_;
     bool threadFinishedOK_;
-    std::vector<uint64_t> numBunchesSentToOpenCL_;
+
+    // Geant4 flush markers reached by the thread, along with the
+    // identifier of the next bunch it was going to send at that point
+    boost::shared_ptr<I3CLSimQueue<std::pair<uint32_t, uint32_t> > > flushMarkersReached_;
 
     
     // helper functions
-    std::size_t FlushFrameCache();
+    std::size_t FlushFrameCache(std::size_t maxNumFramesToKeep=0);
+    void CollectResultsAndMarkers();
+    void AddConversionResult(const I3CLSimStepToPhotonConverter::ConversionResult_t &res);
+    std::size_t PushFinishedFrames();
     void ConvertMCTreeToLightSources(const I3MCTree &mcTree,
                                      std::deque<I3CLSimLightSource> &lightSources,
                                      std::deque<double> &timeOffsets);
     void ConvertFlasherPulsesToLightSources(const I3CLSimFlasherPulseSeries &flasherPulses,
                                             std::deque<I3CLSimLightSource> &lightSources,
                                             std::deque<double> &timeOffsets);
+    uint16_t GetDOMMaskIndex(const std::set<std::pair<int, unsigned int> > &maskedDOMs);
+    void DigestCalibration(I3FramePtr frame);
 
     
     // statistics will be collected here:
+    // (the "generated" maps are filled by the thread)
+    boost::mutex photonsGeneratedPerParticle_mutex_;
     std::map<uint32_t, uint64_t> photonNumGeneratedPerParticle_;
     std::map<uint32_t, double> photonWeightSumGeneratedPerParticle_;
+    std::map<uint32_t, uint64_t> photonNumAtOMPerParticle_;
+    std::map<uint32_t, double> photonWeightSumAtOMPerParticle_;
+    
+    // the DOM mask index of all particles in frames with a mask
+    // (filled by the main thread, the thread applies them to the steps)
+    boost::mutex domMaskIndexPerParticle_mutex_;
+    std::map<uint32_t, uint16_t> domMaskIndexPerParticle_;
+    
+    // DOM masks that have been sent to the OpenCL converters
+    std::map<std::set<std::pair<int, unsigned int> >, uint16_t> domMaskIndices_;
+
+    // relative DOM efficiencies from the last Calibration frame
+    // (only used if photons are converted to hits on the devices)
+    std::map<std::pair<int, unsigned int>, double> hitDOMEfficiencies_;
 
 
 
@@ -316,6 +435,7 @@ private:
     
     bool geometryIsConfigured_;
     uint32_t currentParticleCacheIndex_;
+    uint32_t currentFlushMarker_;
     double totalSimulatedEnergyForFlush_;
     uint64_t totalNumParticlesForFlush_;
     
@@ -323,45 +443,67 @@ private:
     std::vector<I3CLSimRandomValueConstPtr> wavelengthGenerators_;
 
     I3CLSimSimpleGeometryFromI3GeometryPtr geometry_;
+#ifndef I3CLSIM_WITHOUT_OPENCL
     std::vector<I3CLSimStepToPhotonConverterOpenCLPtr> openCLStepsToPhotonsConverters_;
+#endif
+    std::vector<I3CLSimStepToPhotonConverterRemotePtr> remoteStepsToPhotonsConverters_;
+    I3CLSimStepToPhotonConverterNativePtr nativeStepsToPhotonsConverter_;
+    // all of the above (OpenCL devices, remote workers, native), indexed like the scheduler's devices
+    std::vector<I3CLSimStepToPhotonConverterPtr> stepsToPhotonsConverters_;
+    // assigns step bunches to the converters above
+    I3CLSimStepBunchSchedulerPtr stepBunchScheduler_;
+    // thins out steps far away from all DOMs (NULL if disabled)
+    I3CLSimStepPreCullerPtr stepPreCuller_;
     I3CLSimLightSourceToStepConverterGeant4Ptr geant4ParticleToStepsConverter_;
     
-    // list of all currently held frames, in order
-    std::size_t frameListPhysicsFrameCounter_;
-    std::vector<I3FramePtr> frameList_;
-    std::deque<I3FramePtr> frameList2_;
-    std::vector<I3PhotonSeriesMapPtr> photonsForFrameList_;
-    std::vector<int32_t> currentPhotonIdForFrame_;
-    std::vector<bool> frameIsBeingWorkedOn_;
+    struct frameCacheEntry
+    {
+        I3FramePtr frame;
+        bool isBeingWorkedOn; // this frame will receive results (->Put() will be called later)
+        I3PhotonSeriesMapPtr photons;
+        I3MCPESeriesMapPtr mcpes; // set instead of "photons" if the devices convert photons to hits
+        int32_t currentPhotonId;
 #ifdef GRANULAR_GEOMETRY_SUPPORT
-    std::vector<std::set<ModuleKey> > maskedOMKeys_;
+        std::set<ModuleKey> maskedOMKeys;
 #else
-    std::vector<std::set<OMKey> > maskedOMKeys_;
+        std::set<OMKey> maskedOMKeys;
 #endif
+        uint16_t domMaskIndex; // 0 if the DOM mask is only applied on the host
+        uint32_t firstParticleCacheIndex;
+        std::size_t numParticles;
+
+        uint32_t flushMarker; // Geant4 flush marker enqueued after the last particle
+        bool stepsComplete;   // the flush marker has been reached
+        uint32_t bunchesNeeded; // all bunches with identifiers below this one need to be done
+    };
+    
+    // list of all currently held frames, in order
+    std::deque<frameCacheEntry> frameCache_;
+    std::size_t frameCacheFirstEntry_; // absolute entry number of frameCache_.front()
+    
+    // bunch identifiers below this one (modulo 2^32) have been
+    // returned by the devices, completed ones above it are stored
+    uint32_t nextBunchToComplete_;
+    std::set<uint32_t> bunchesCompletedOutOfOrder_;
     
     struct particleCacheEntry
     {
-        std::size_t frameListEntry; // pointer to the frame list by entry number
+        std::size_t frameListEntry; // absolute entry number in the frame cache
         uint64_t particleMajorID;
         int particleMinorID;
         double timeShift; // optional time that needs to be added to the final output photon
+        I3ParticleConstPtr particle; // only kept for I3MCPEs, NULL for flashers
     };
     
     // list of all particles (with pointrs to their frames)
     // currently being simulated
     std::map<uint32_t, particleCacheEntry> particleCache_;
     
-    static void AddPhotonsToFrames(const I3CLSimPhotonSeries &photons,
+    static void AddPhotonsToFrames(const I3CLSimPhotonSeriesView &photons,
                                    I3CLSimPhotonHistorySeriesConstPtr photonHistories,
-                                   const std::vector<I3PhotonSeriesMapPtr> &photonsForFrameList_,
-                                   std::vector<int32_t> &currentPhotonIdForFrame_,
-                                   const std::vector<I3FramePtr> &frameList_,
+                                   std::deque<frameCacheEntry> &frameCache_,
+                                   std::size_t frameCacheFirstEntry_,
                                    const std::map<uint32_t, particleCacheEntry> &particleCache_,
-#ifdef GRANULAR_GEOMETRY_SUPPORT
-                                   const std::vector<std::set<ModuleKey> > &maskedOMKeys_,
-#else
-                                   const std::vector<std::set<OMKey> > &maskedOMKeys_,
-#endif
                                    bool collectStatistics_,
                                    std::map<uint32_t, uint64_t> &photonNumAtOMPerParticle,
                                    std::map<uint32_t, double> &photonWeightSumAtOMPerParticle
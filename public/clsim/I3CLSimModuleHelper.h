@@ -28,6 +28,8 @@
 #define I3CLSIMMODULEHELPER_H_INCLUDED
 
 
+#include "icetray/I3Units.h"
+
 #include "phys-services/I3RandomService.h"
 
 #include "clsim/random_value/I3CLSimRandomValue.h"
@@ -36,17 +38,57 @@
 #include "clsim/I3CLSimMediumProperties.h"
 #include "clsim/I3CLSimSimpleGeometryFromI3Geometry.h"
 
+#ifndef I3CLSIM_WITHOUT_OPENCL
 #include "clsim/I3CLSimStepToPhotonConverterOpenCL.h"
+#endif
+#include "clsim/I3CLSimStepToPhotonConverterNative.h"
 #include "clsim/I3CLSimLightSourceToStepConverterGeant4.h"
 
 #include "clsim/I3CLSimLightSourceParameterization.h"
 
+#ifndef I3CLSIM_WITHOUT_OPENCL
 #include "clsim/I3CLSimOpenCLDevice.h"
+#endif
 
 #include <vector>
 #include <string>
 
 namespace I3CLSimModuleHelper {
+#ifndef I3CLSIM_WITHOUT_OPENCL
+    /**
+     * Settings of the OpenCL converter that are passed to
+     * initializeOpenCL(). The constructor sets the defaults,
+     * see the corresponding setters of I3CLSimStepToPhotonConverterOpenCL.
+     */
+    struct OpenCLOptions
+    {
+        OpenCLOptions();
+
+        bool enableDoubleBuffering;
+        bool doublePrecision;
+        bool stopDetectedPhotons;
+        bool saveAllPhotons;
+        double saveAllPhotonsPrescale;
+        double fixedNumberOfAbsorptionLengths;
+        double pancakeFactor;
+        uint32_t photonHistoryEntries;
+        uint32_t limitWorkgroupSize;   // 0: use the maximum workgroup size of the device
+        uint32_t numBuffers;           // 0: 2 with double buffering, 1 otherwise
+        bool useMappedBuffers;
+        bool compactPhotonOutput;
+        uint32_t mediumPropertiesLookupTableBins;
+        uint32_t opticalDepthTableBins;
+        bool useDOMGrid;
+        double distanceCullingMargin;  // NaN disables distance culling
+        uint32_t photonSplittingFactor;
+        double photonSplittingDistance;
+        double photonRouletteDistance;
+        // photons are converted to hits on the device if this is set
+        I3CLSimFunctionConstPtr hitWavelengthAcceptance;
+        I3CLSimFunctionConstPtr hitAngularAcceptance;
+        double hitOversizeFactor;
+    };
+
     I3CLSimStepToPhotonConverterOpenCLPtr
     initializeOpenCL(const I3CLSimOpenCLDevice &device,
                      I3RandomServicePtr rng,
@@ -54,15 +96,36 @@ namespace I3CLSimModuleHelper {
                      I3CLSimMediumPropertiesConstPtr medium,
                      I3CLSimFunctionConstPtr wavelengthGenerationBias,
                      const std::vector<I3CLSimRandomValueConstPtr> &wavelengthGenerators,
-                     bool enableDoubleBuffering,
-                     bool doublePrecision,
+                     const OpenCLOptions &options=OpenCLOptions());
+#endif
+    
+    I3CLSimStepToPhotonConverterNativePtr
+    initializeNative(I3RandomServicePtr rng,
+                     I3CLSimSimpleGeometryFromI3GeometryPtr geometry,
+                     I3CLSimMediumPropertiesConstPtr medium,
+                     I3CLSimFunctionConstPtr wavelengthGenerationBias,
+                     const std::vector<I3CLSimRandomValueConstPtr> &wavelengthGenerators,
                      bool stopDetectedPhotons,
                      bool saveAllPhotons,
                      double saveAllPhotonsPrescale,
                      double fixedNumberOfAbsorptionLengths,
                      double pancakeFactor,
                      uint32_t photonHistoryEntries,
-                     uint32_t limitWorkgroupSize);
+                     uint32_t numThreads);
+    
+    // Configures Geant4 and forks its worker processes, but does not
+    // initialize it. Call this before creating any step-to-photon
+    // converter, the workers must not inherit their threads. Set
+    // the bunch sizes and call Initialize() afterwards.
+    I3CLSimLightSourceToStepConverterGeant4Ptr
+    createGeant4(I3RandomServicePtr rng,
+                 I3CLSimMediumPropertiesConstPtr medium,
+                 I3CLSimFunctionConstPtr wavelengthGenerationBias,
+                 const I3CLSimLightSourceParameterizationSeries &parameterizationList,
+                 const std::string &physicsListName,
+                 double maxBetaChangePerStep,
+                 uint32_t maxNumPhotonsPerStep,
+                 uint32_t numWorkerProcesses=0);
     
     I3CLSimLightSourceToStepConverterGeant4Ptr
     initializeGeant4(I3RandomServicePtr rng,
@@ -74,7 +137,7 @@ namespace I3CLSimModuleHelper {
                      const std::string &physicsListName,
                      double maxBetaChangePerStep,
                      uint32_t maxNumPhotonsPerStep,
-                     bool multiprocessor=false);
+                     uint32_t numWorkerProcesses=0);
 
     I3CLSimRandomValueConstPtr
     makeCherenkovWavelengthGenerator(I3CLSimFunctionConstPtr wavelengthGenerationBias,
@@ -0,0 +1,104 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimPhotonSeriesColumns.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMPHOTONSERIESCOLUMNS_H_INCLUDED
+#define I3CLSIMPHOTONSERIESCOLUMNS_H_INCLUDED
+
+#include <vector>
+
+#include "clsim/I3CLSimPhoton.h"
+#include "clsim/I3CLSimPhotonSeriesView.h"
+
+/**
+ * @brief The most frequently used photon attributes of a
+ * photon series, stored as one array per attribute
+ * ("structure of arrays").
+ *
+ * This is meant for post-processing photons in bulk. After
+ * SortByIdentifierAndOMKey(), all photons from the same
+ * particle and DOM are next to each other, so per-particle
+ * and per-DOM lookups only have to be done once for each run
+ * of photons. GetIndex() keeps track of where each photon was
+ * in the original series, so any attribute that does not have
+ * its own column can still be read from there.
+ */
+class I3CLSimPhotonSeriesColumns
+{
+public:
+    I3CLSimPhotonSeriesColumns() {;}
+    explicit I3CLSimPhotonSeriesColumns(const I3CLSimPhotonSeriesView &photons);
+
+    /**
+     * Replaces the contents with the photons from the view
+     * (in their original order).
+     */
+    void Fill(const I3CLSimPhotonSeriesView &photons);
+
+    /**
+     * Sorts all columns by (identifier, stringID, omID).
+     * Photons with the same keys keep their relative order.
+     */
+    void SortByIdentifierAndOMKey();
+
+    void clear();
+    inline std::size_t size() const {return index_.size();}
+    inline bool empty() const {return index_.empty();}
+
+    /**
+     * Returns the first entry after "start" with a different
+     * identifier (or size()).
+     */
+    std::size_t FindIdentifierRunEnd(std::size_t start) const;
+
+    /**
+     * Returns the first entry after "start" with a different
+     * identifier, string ID or OM ID (or size()).
+     */
+    std::size_t FindOMKeyRunEnd(std::size_t start) const;
+
+    inline const std::vector<float> &GetTimes() const {return time_;}
+    inline const std::vector<float> &GetWeights() const {return weight_;}
+    inline const std::vector<float> &GetWavelengths() const {return wavelength_;}
+    inline const std::vector<int16_t> &GetStringIDs() const {return stringID_;}
+    inline const std::vector<uint16_t> &GetOMIDs() const {return omID_;}
+    inline const std::vector<uint32_t> &GetIdentifiers() const {return identifier_;}
+
+    /**
+     * The position of each entry in the series used to Fill() this.
+     */
+    inline const std::vector<uint32_t> &GetIndices() const {return index_;}
+
+private:
+    std::vector<float> time_;
+    std::vector<float> weight_;
+    std::vector<float> wavelength_;
+    std::vector<int16_t> stringID_;
+    std::vector<uint16_t> omID_;
+    std::vector<uint32_t> identifier_;
+    std::vector<uint32_t> index_;
+};
+
+#endif //I3CLSIMPHOTONSERIESCOLUMNS_H_INCLUDED
@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimPhotonSeriesView.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMPHOTONSERIESVIEW_H_INCLUDED
+#define I3CLSIMPHOTONSERIESVIEW_H_INCLUDED
+
+#include "clsim/I3CLSimPhoton.h"
+
+#include <boost/shared_ptr.hpp>
+
+/**
+ * @brief A read-only view of a contiguous range of I3CLSimPhotons.
+ *
+ * The photons are not owned by the view. Instead, the view keeps
+ * a reference to whatever object owns the memory (an
+ * I3CLSimPhotonSeries or e.g. a host buffer mapped by OpenCL).
+ * The memory stays valid as long as any copy of the view exists,
+ * so release views as soon as you are done with them. Copying a
+ * view is cheap.
+ */
+class I3CLSimPhotonSeriesView
+{
+public:
+    typedef const I3CLSimPhoton *const_iterator;
+
+    I3CLSimPhotonSeriesView()
+    : data_(NULL), size_(0) {;}
+
+    explicit I3CLSimPhotonSeriesView(I3CLSimPhotonSeriesConstPtr series)
+    : data_(NULL), size_(0), owner_(series)
+    {
+        if ((series) && (!series->empty())) {
+            data_ = &((*series)[0]);
+            size_ = series->size();
+        }
+    }
+
+    /**
+     * "owner" is kept alive as long as this view (or a copy) exists.
+     * It should free "data" (or give it back to wherever it came
+     * from) once it is destroyed.
+     */
+    I3CLSimPhotonSeriesView(const I3CLSimPhoton *data,
+                            std::size_t size,
+                            boost::shared_ptr<const void> owner)
+    : data_(data), size_(size), owner_(owner) {;}
+
+    /**
+     * Returns false for a default-constructed view.
+     * An empty view of an empty series is still valid.
+     */
+    inline bool valid() const {return static_cast<bool>(owner_);}
+
+    inline std::size_t size() const {return size_;}
+    inline bool empty() const {return (size_==0);}
+
+    inline const I3CLSimPhoton &operator[](std::size_t index) const {return data_[index];}
+    inline const I3CLSimPhoton *data() const {return data_;}
+
+    inline const_iterator begin() const {return data_;}
+    inline const_iterator end() const {return data_+size_;}
+
+    /**
+     * Copies the photons into a new series that
+     * does not depend on the view anymore.
+     */
+    I3CLSimPhotonSeriesPtr Copy() const
+    {
+        I3CLSimPhotonSeriesPtr output(new I3CLSimPhotonSeries());
+        output->assign(begin(), end());
+        return output;
+    }
+
+private:
+    const I3CLSimPhoton *data_;
+    std::size_t size_;
+    boost::shared_ptr<const void> owner_;
+};
+
+#endif //I3CLSIMPHOTONSERIESVIEW_H_INCLUDED
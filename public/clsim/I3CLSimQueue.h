@@ -70,7 +70,7 @@ public:
         queue_.push(msg);
         
         // notify the consumer thread
-        cond_.notify_one();
+        cond_.notify_all(); // producers and consumers share cond_
     }
     
     
@@ -92,7 +92,7 @@ public:
         queue_.pop();
         
         // notify the producer that there is space on the queue now
-        cond_.notify_one();
+        cond_.notify_all(); // producers and consumers share cond_
         
         return msg;
     }
@@ -112,7 +112,7 @@ public:
         queue_.pop();
         
         // notify the producer that there is space on the queue now
-        cond_.notify_one();
+        cond_.notify_all(); // producers and consumers share cond_
         
         return true;
     }
@@ -141,7 +141,7 @@ public:
         queue_.pop();
         
         // notify the producer that there is space on the queue now
-        cond_.notify_one();
+        cond_.notify_all(); // producers and consumers share cond_
         
         return msg;
     }
@@ -142,7 +142,7 @@ public:
     cl_uint identifier;
     cl_uchar sourceType;
     cl_uchar dummy1;
-    cl_ushort dummy2;
+    cl_ushort dummy2;       // DOM mask index, see I3CLSimStepToPhotonConverterOpenCL::SetDOMMask()
 
 private:
     friend class boost::serialization::access;
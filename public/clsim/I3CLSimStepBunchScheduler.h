@@ -0,0 +1,197 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimStepBunchScheduler.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMSTEPBUNCHSCHEDULER_H_INCLUDED
+#define I3CLSIMSTEPBUNCHSCHEDULER_H_INCLUDED
+
+#include "icetray/I3TrayHeaders.h"
+
+#include "clsim/I3CLSimStep.h"
+#include "clsim/I3CLSimStepToPhotonConverter.h"
+#include "clsim/I3CLSimQueue.h"
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <vector>
+#include <deque>
+#include <string>
+
+/**
+ * @brief Distributes bunches of steps over a set of
+ * I3CLSimStepToPhotonConverters (i.e. devices).
+ *
+ * Every device gets its own list of pending bunches. New bunches
+ * are assigned to the device that is expected to finish them first,
+ * based on the number of photons already pending for each device and
+ * a running estimate of each device's throughput (photons per second).
+ * The throughput is measured from the rate at which a device drains
+ * its input queue while it is kept busy, so it includes all transfer
+ * and host overheads of the converter.
+ *
+ * Each device has a feeder thread that keeps the converter's input
+ * queue filled to a small depth. Bunches stay with the scheduler until
+ * then, so a device that runs out of work can steal pending bunches
+ * from the tail of the device with the longest estimated backlog,
+ * provided it can finish the stolen bunch earlier than the owner would.
+ *
+ * Results are collected from all devices as soon as they are available
+ * and can be retrieved in order of completion using GetConversionResult().
+ * Do not call GetConversionResult() on the converters directly.
+ *
+ * If a converter fails, its error is kept and rethrown as an
+ * I3CLSimStepToPhotonConverter_exception from EnqueueSteps(),
+ * WaitUntilDispatched() and GetConversionResult().
+ */
+class I3CLSimStepBunchScheduler : private boost::noncopyable
+{
+public:
+    static const std::size_t default_maxQueuedPerDevice;
+    static const std::size_t default_maxPendingPerDevice;
+
+    /**
+     * All converters need to be initialized.
+     * At most maxQueuedPerDevice bunches are put on the input
+     * queue of each converter, the rest is kept here and may
+     * be moved to other devices. EnqueueSteps() blocks once more
+     * than maxPendingPerDevice bunches per device are pending.
+     */
+    I3CLSimStepBunchScheduler(const std::vector<I3CLSimStepToPhotonConverterPtr> &converters,
+                              std::size_t maxQueuedPerDevice=default_maxQueuedPerDevice,
+                              std::size_t maxPendingPerDevice=default_maxPendingPerDevice);
+    ~I3CLSimStepBunchScheduler();
+
+    /**
+     * Assigns a bunch of steps to one of the devices.
+     * The identifier is passed on to the converter unchanged.
+     *
+     * Might block if too many bunches are pending. This is
+     * a boost::thread interruption point.
+     */
+    void EnqueueSteps(I3CLSimStepSeriesConstPtr steps, uint32_t identifier);
+
+    /**
+     * Blocks until all pending bunches have been handed
+     * over to a converter. This is a boost::thread
+     * interruption point.
+     */
+    void WaitUntilDispatched();
+
+    /**
+     * Returns the next result from any of the devices.
+     * Blocks if no result is available yet. This is a
+     * boost::thread interruption point.
+     */
+    I3CLSimStepToPhotonConverter::ConversionResult_t GetConversionResult();
+
+    /**
+     * Same as above, but gives up after the timeout has expired
+     * and returns false in that case. A timeout of 0 never blocks.
+     */
+    bool GetConversionResult(I3CLSimStepToPhotonConverter::ConversionResult_t &result, double timeout);
+
+    /**
+     * Number of devices (converters) being scheduled.
+     */
+    inline std::size_t GetNumDevices() const {return devices_.size();}
+
+    /**
+     * Returns the current throughput estimate for a device
+     * in photons per second (NAN if nothing has been measured yet).
+     */
+    double GetThroughputEstimate(std::size_t deviceIndex) const;
+
+    /**
+     * Returns the total number of bunches a device has
+     * stolen from other devices.
+     */
+    uint64_t GetNumBunchesStolen(std::size_t deviceIndex) const;
+
+private:
+    struct Bunch_t
+    {
+        I3CLSimStepSeriesConstPtr steps;
+        uint32_t identifier;
+        uint64_t numPhotons;
+    };
+
+    struct Device_t
+    {
+        I3CLSimStepToPhotonConverterPtr converter;
+
+        // bunches assigned to this device, but not yet handed over
+        std::deque<Bunch_t> pending;
+        uint64_t pendingPhotons;
+
+        // throughput estimate in photons per second (NAN: unknown)
+        double photonsPerSecond;
+
+        uint64_t numBunchesStolen;
+
+        // photon counts of the bunches we think are still on the converter's queue
+        std::deque<uint64_t> queuedPhotons;
+        boost::posix_time::ptime lastHandover;
+        bool lastHandoverValid;
+
+        boost::shared_ptr<boost::thread> feederThread;
+        boost::shared_ptr<boost::thread> collectorThread;
+    };
+
+    void FeederThread(std::size_t deviceIndex);
+    void SetError(std::size_t deviceIndex, const std::string &what);
+    void ThrowIfFailed() const; // needs the mutex to be locked
+    void FeederThread_impl(std::size_t deviceIndex);
+    void CollectorThread(std::size_t deviceIndex);
+
+    // all of these need the mutex to be locked
+    double EffectiveThroughput(std::size_t deviceIndex) const;
+    bool TakeBunch(std::size_t deviceIndex, Bunch_t &bunch);
+
+    std::size_t maxQueuedPerDevice_;
+    std::size_t maxPendingPerDevice_;
+
+    mutable boost::mutex mutex_;
+    boost::condition_variable_any cond_;
+
+    std::vector<Device_t> devices_;
+    std::size_t numPendingBunches_;
+    std::size_t numBunchesInHandover_;
+
+    // the first error from any of the devices (empty if none)
+    std::string error_;
+
+    // results from all devices (no maximum size)
+    boost::shared_ptr<I3CLSimQueue<I3CLSimStepToPhotonConverter::ConversionResult_t> > results_;
+
+    SET_LOGGER("I3CLSimStepBunchScheduler");
+};
+
+I3_POINTER_TYPEDEFS(I3CLSimStepBunchScheduler);
+
+#endif //I3CLSIMSTEPBUNCHSCHEDULER_H_INCLUDED
@@ -0,0 +1,139 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimStepPreCuller.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMSTEPPRECULLER_H_INCLUDED
+#define I3CLSIMSTEPPRECULLER_H_INCLUDED
+
+#include "icetray/I3TrayHeaders.h"
+#include "phys-services/I3RandomService.h"
+
+#include "clsim/I3CLSimStep.h"
+#include "clsim/I3CLSimSimpleGeometry.h"
+#include "clsim/I3CLSimMediumProperties.h"
+
+#include <boost/thread/mutex.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <vector>
+
+/**
+ * @brief Thins out steps that are too far away from all DOMs
+ * to matter before they are sent to the propagator.
+ *
+ * For each step, an upper limit on the probability of any of
+ * its photons reaching a DOM is calculated from a coarse distance
+ * field of the geometry and the largest absorption length of the
+ * medium. The vertical part of the distance uses the absorption
+ * lengths of the individual layers (unless the ice is tilted).
+ *
+ * Steps with a probability of at least minimumProbability are
+ * not changed. The photons of all other steps are kept with
+ * a probability of probability/minimumProbability and the step
+ * weight is scaled up accordingly, so the expected result does
+ * not change. Steps without any photons left are removed.
+ * This means that photons from far-away steps can have weights > 1.
+ * Changed step series are filled up with no-op steps to a multiple
+ * of bunchSizeGranularity.
+ */
+class I3CLSimStepPreCuller : private boost::noncopyable
+{
+public:
+    I3CLSimStepPreCuller(I3CLSimSimpleGeometryConstPtr geometry,
+                         I3CLSimMediumPropertiesConstPtr mediumProperties,
+                         double minimumProbability,
+                         uint64_t bunchSizeGranularity,
+                         uint32_t rngSeed);
+    ~I3CLSimStepPreCuller();
+
+    /**
+     * Returns the steps that should be propagated instead of "steps".
+     * This is the input object itself if no step was changed.
+     */
+    I3CLSimStepSeriesConstPtr Process(I3CLSimStepSeriesConstPtr steps);
+
+    /**
+     * Returns an upper limit on the probability that
+     * a photon emitted by this step reaches any DOM.
+     */
+    double GetMaxHitProbability(const I3CLSimStep &step) const;
+
+    /**
+     * Replaces the geometry. Do not call this while
+     * Process() is running in another thread.
+     */
+    void UpdateGeometry(I3CLSimSimpleGeometryConstPtr geometry);
+
+    inline double GetMinimumProbability() const {return minimumProbability_;}
+
+    // statistics
+    uint64_t GetTotalNumPhotonsIn() const;
+    uint64_t GetTotalNumPhotonsOut() const;
+    uint64_t GetTotalNumStepsRemoved() const;
+
+private:
+    // lower limit on the distance to the surface of any DOM
+    double GetMinDistanceToDOM(double x, double y, double z) const;
+    
+    // absorption optical depth from the bottom of the lowest
+    // layer to (effective) z, using the largest absorption length
+    // of each layer. Layers are extended above and below.
+    double GetVerticalOpticalDepth(double z) const;
+
+    I3CLSimMediumPropertiesConstPtr mediumProperties_;
+    double minimumProbability_;
+    uint64_t bunchSizeGranularity_;
+    I3RandomServicePtr rng_;
+    I3CLSimStep noOpStep_;
+
+    // the distance field (see I3CLSimHelper::GenerateDOMDistanceField())
+    std::vector<float> distanceField_;
+    double distanceFieldStart_[3];
+    double distanceFieldCellWidth_;
+    uint32_t distanceFieldNumCells_[3];
+
+    // the range of z coordinates covered by DOMs
+    double domZMin_;
+    double domZMax_;
+
+    double maxDistPerAbsLen_;
+
+    // per-layer vertical optical depths (empty if
+    // the ice is tilted and they cannot be used)
+    std::vector<double> maxDistPerAbsLenPerLayer_;
+    std::vector<double> verticalOpticalDepthAtLayerBottom_;
+    double iceTiltZShift_;
+
+    mutable boost::mutex mutex_;
+    uint64_t totalNumPhotonsIn_;
+    uint64_t totalNumPhotonsOut_;
+    uint64_t totalNumStepsRemoved_;
+    
+    SET_LOGGER("I3CLSimStepPreCuller");
+};
+
+I3_POINTER_TYPEDEFS(I3CLSimStepPreCuller);
+
+#endif //I3CLSIMSTEPPRECULLER_H_INCLUDED
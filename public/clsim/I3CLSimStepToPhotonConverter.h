@@ -33,6 +33,7 @@
 
 #include "clsim/I3CLSimStep.h"
 #include "clsim/I3CLSimPhoton.h"
+#include "clsim/I3CLSimPhotonSeriesView.h"
 #include "clsim/I3CLSimPhotonHistory.h"
 #include "clsim/I3CLSimMediumProperties.h"
 #include "clsim/random_value/I3CLSimRandomValue.h"
@@ -80,9 +81,34 @@ public:
         photonHistories(photonHistories_)
         {;}
         
+        ConversionResult_t(uint32_t identifier_,
+                           const I3CLSimPhotonSeriesView &photonView_,
+                           I3CLSimPhotonHistorySeriesPtr photonHistories_=I3CLSimPhotonHistorySeriesPtr())
+        :
+        identifier(identifier_),
+        photonHistories(photonHistories_),
+        photonView(photonView_)
+        {;}
+        
         uint32_t identifier;
         I3CLSimPhotonSeriesPtr photons;
         I3CLSimPhotonHistorySeriesPtr photonHistories;
+        
+        // Converters that hand out photons directly from their own
+        // memory (e.g. mapped OpenCL buffers) set this instead of
+        // "photons". Use GetPhotonView() to access either one.
+        I3CLSimPhotonSeriesView photonView;
+        
+        inline bool HasPhotons() const
+        {
+            return ((photons) || (photonView.valid()));
+        }
+        
+        inline I3CLSimPhotonSeriesView GetPhotonView() const
+        {
+            if (photonView.valid()) return photonView;
+            return I3CLSimPhotonSeriesView(photons);
+        }
     };
     
     //virtual ~I3CLSimStepToPhotonConverter();
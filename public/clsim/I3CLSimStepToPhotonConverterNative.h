@@ -0,0 +1,457 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimStepToPhotonConverterNative.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMSTEPTOPHOTONCONVERTERNATIVE_H_INCLUDED
+#define I3CLSIMSTEPTOPHOTONCONVERTERNATIVE_H_INCLUDED
+
+#include "clsim/I3CLSimStepToPhotonConverter.h"
+
+#include "phys-services/I3RandomService.h"
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "clsim/I3CLSimQueue.h"
+#include "clsim/I3CLSimLockFreeQueue.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <stdexcept>
+
+/**
+ * @brief Creates photons from a given list of steps and propagates
+ * them to a DOM using plain C++ code on a pool of worker threads.
+ *
+ * This implements the same photon creation, scattering, absorption
+ * and DOM collision logic as propagation_kernel.c.cl, but does not
+ * need an OpenCL runtime. All medium properties, wavelength generators
+ * and the wavelength bias need to have a native implementation.
+ *
+ * Each bunch of steps is processed by a single worker thread
+ * using its own random number generator. Its seed is derived from
+ * the bunch sequence number and a seed drawn from the main random
+ * service during Initialize(). Results are thus reproducible for
+ * a given random seed, but may be returned in a different order
+ * than they were enqueued.
+ *
+ * By default, photons are propagated in packets of 8 or 16 (see
+ * GetPacketWidth()) with the per-photon arithmetic done as explicit
+ * single precision SIMD operations. The instruction set (AVX-512, AVX2
+ * or a generic fallback) is chosen at compile time using the
+ * CLSIM_NATIVE_SIMD CMake option and reported by Initialize(), which
+ * fails if the CPU does not support it. SetUsePacketPropagation(false)
+ * switches to a purely scalar double precision code path instead.
+ */
+struct I3CLSimStepToPhotonConverterNative : public I3CLSimStepToPhotonConverter
+{
+public:
+    static const std::size_t default_maxNumWorkitems;
+
+    /**
+     * A numThreads value of 0 will use one thread
+     * per available hardware thread.
+     */
+    I3CLSimStepToPhotonConverterNative(I3RandomServicePtr randomService,
+                                       std::size_t numThreads=0);
+    virtual ~I3CLSimStepToPhotonConverterNative();
+
+    /**
+     * Sets the number of worker threads. A value
+     * of 0 uses one thread per hardware thread.
+     *
+     * Will throw if already initialized.
+     */
+    void SetNumThreads(std::size_t val);
+
+    /**
+     * Gets the number of worker threads.
+     */
+    std::size_t GetNumThreads() const;
+
+    /**
+     * Sets the maximum number of steps per bunch.
+     *
+     * Will throw if already initialized.
+     */
+    void SetMaxNumWorkitems(std::size_t val);
+
+    /**
+     * Gets the maximum number of steps per bunch.
+     */
+    std::size_t GetMaxNumWorkitems() const;
+
+    /**
+     * There is no workgroup structure in this
+     * implementation, so this always returns 1.
+     * (Provided so that the bunch size granularity
+     * can be calculated in the same way as for
+     * OpenCL converters.)
+     */
+    std::size_t GetWorkgroupSize() const;
+
+    /**
+     * Sets whether photons should be propagated in SIMD packets
+     * (the default). If false, each photon is propagated on
+     * its own in double precision.
+     *
+     * Will throw if already initialized.
+     */
+    void SetUsePacketPropagation(bool value);
+
+    /**
+     * Returns true if photons are propagated in SIMD packets.
+     */
+    bool GetUsePacketPropagation() const;
+
+    /**
+     * Returns the number of photons propagated
+     * in parallel in packet propagation mode.
+     */
+    static std::size_t GetPacketWidth();
+
+    /**
+     * Returns the name of the SIMD instruction set
+     * used in packet propagation mode.
+     */
+    static std::string GetPacketInstructionSet();
+
+    /**
+     * Configures behaviour for photons that
+     * hit a DOM. If this is true photons will
+     * be stopped once they hit a DOM. If this is
+     * false (the default, as in the OpenCL
+     * converter), they continue to propagate.
+     *
+     * Will throw if already initialized.
+     */
+    void SetStopDetectedPhotons(bool value);
+
+    /**
+     * Returns true if detected photons are stopped.
+     */
+    bool GetStopDetectedPhotons() const;
+
+    /**
+     * Tell the propagator to save all photons,
+     * regardless of detection. All photons will
+     * be assigned to DOM(0,0).
+     *
+     * Will throw if already initialized.
+     */
+    void SetSaveAllPhotons(bool value);
+
+    /**
+     * Returns true if all photons are saved,
+     * regardless of detection.
+     */
+    bool GetSaveAllPhotons() const;
+
+    /**
+     * Sets the prescale factor of photons
+     * being generated in "saveAllPhotons" mode.
+     * Only this fraction of photons is actually
+     * generated.
+     *
+     * Will throw if already initialized.
+     */
+    void SetSaveAllPhotonsPrescale(double value);
+
+    /**
+     * Returns the prescale factor of photons
+     * being generated in "saveAllPhotons" mode.
+     */
+    double GetSaveAllPhotonsPrescale() const;
+
+    /**
+     * Sets the maximum number of entries in the photon
+     * history table. Each point in the table
+     * will store the position of the photon
+     * at each point of scatter. (Only the most
+     * recent points are stored if there are
+     * more scatters than available entries.)
+     *
+     * Will throw if already initialized.
+     */
+    void SetPhotonHistoryEntries(uint32_t value);
+
+    /**
+     * Returns the maximum number of photon
+     * history entries.
+     */
+    uint32_t GetPhotonHistoryEntries() const;
+
+    /**
+     * Sets the number of absorption lengths each photon
+     * should be propagated. If set to NaN (the default),
+     * the number is sampled from an exponential distribution.
+     * Use this override for table-making.
+     *
+     * Will throw if already initialized.
+     */
+    void SetFixedNumberOfAbsorptionLengths(double value);
+
+    /**
+     * Returns number of absorption lengths each photon
+     * should be propagated.
+     */
+    double GetFixedNumberOfAbsorptionLengths() const;
+
+    /**
+     * Sets the "pancake" factor for DOMs. See
+     * I3CLSimStepToPhotonConverterOpenCL::SetDOMPancakeFactor()
+     * for details.
+     *
+     * Will throw if already initialized.
+     */
+    void SetDOMPancakeFactor(double value);
+
+    /**
+     * Returns the "pancake" factor for DOMs.
+     */
+    double GetDOMPancakeFactor() const;
+
+    /**
+     * Sets the wavelength generators.
+     * The first generator (index 0) is assumed to return a Cherenkov
+     * spectrum that may have a bias applied to it. This bias factor
+     * needs to be set using SetWlenBias().
+     * All other generator indices are assumed to be for flasher/laser
+     * light generation. During generation, no Cherenkov angle
+     * rotation will be applied to those photons with indices >= 1.
+     * Will throw if used after the call to Initialize().
+     */
+    virtual void SetWlenGenerators(const std::vector<I3CLSimRandomValueConstPtr> &wlenGenerators);
+
+    /**
+     * Sets the wavelength weights. Set this to a constant value
+     * of 1 if you do not need biased photon generation.
+     * Will throw if used after the call to Initialize().
+     */
+    virtual void SetWlenBias(I3CLSimFunctionConstPtr wlenBias);
+
+    /**
+     * Sets the medium properties.
+     * Will throw if used after the call to Initialize().
+     */
+    virtual void SetMediumProperties(I3CLSimMediumPropertiesConstPtr mediumProperties);
+
+    /**
+     * Sets the geometry.
+     * Will throw if used after the call to Initialize().
+     */
+    virtual void SetGeometry(I3CLSimSimpleGeometryConstPtr geometry);
+
+    /**
+     * Initializes the simulation and starts the
+     * worker threads.
+     * Will throw if already initialized.
+     */
+    virtual void Initialize();
+
+    /**
+     * Returns true if initialized.
+     * Never throws.
+     */
+    virtual bool IsInitialized() const;
+
+    /**
+     * Adds a new I3CLSimStepSeries to the queue.
+     * The resulting I3CLSimPhotonSeries can be retrieved from the
+     * I3CLSimStepToPhotonConverter after some processing time.
+     *
+     * Will throw if not initialized.
+     */
+    virtual void EnqueueSteps(I3CLSimStepSeriesConstPtr steps, uint32_t identifier);
+
+    /**
+     * Reports the current queue size. The queue works asynchronously,
+     * so this value will probably have changed once you use it.
+     *
+     * Will throw if not initialized.
+     */
+    virtual std::size_t QueueSize() const;
+
+    /**
+     * Returns true if more photons are available.
+     * If the return value is false, the current simulation is finished
+     * and a new step vector may be set.
+     *
+     * Will throw if not initialized.
+     */
+    virtual bool MorePhotonsAvailable() const;
+
+    /**
+     * Returns a bunch of photons stored in a vector<I3CLSimPhoton>.
+     *
+     * Might block if no photons are available.
+     *
+     * Will throw if not initialized or if a worker
+     * thread failed.
+     */
+    virtual I3CLSimStepToPhotonConverter::ConversionResult_t GetConversionResult();
+
+    // "device" time is the sum of all worker thread busy times
+    inline double GetTotalDeviceTime() {boost::unique_lock<boost::mutex> guard(statistics_mutex_); return static_cast<double>(statistics_total_device_duration_in_nanoseconds_);}
+    inline double GetTotalHostTime() {boost::unique_lock<boost::mutex> guard(statistics_mutex_); return static_cast<double>(statistics_total_host_duration_in_nanoseconds_);}
+    inline uint64_t GetNumKernelCalls() {boost::unique_lock<boost::mutex> guard(statistics_mutex_); return statistics_total_kernel_calls_;}
+    inline uint64_t GetTotalNumPhotonsGenerated() {boost::unique_lock<boost::mutex> guard(statistics_mutex_); return statistics_total_num_photons_generated_;}
+    inline uint64_t GetTotalNumPhotonsAtDOMs() {boost::unique_lock<boost::mutex> guard(statistics_mutex_); return statistics_total_num_photons_atDOMs_;}
+
+private:
+    struct WorkItem_t
+    {
+        WorkItem_t() : identifier(0), rngSeed(0) {;}
+        WorkItem_t(uint32_t identifier_, I3CLSimStepSeriesConstPtr steps_, uint32_t rngSeed_)
+        : identifier(identifier_), steps(steps_), rngSeed(rngSeed_) {;}
+
+        uint32_t identifier;
+        I3CLSimStepSeriesConstPtr steps;
+        uint32_t rngSeed;
+    };
+
+    // all DOMs on a single string, used for collision detection
+    struct StringInfo_t
+    {
+        double posX, posY;      // string center
+        double radius;          // max. lateral DOM distance from center (incl. OM radius)
+        double minZ, maxZ;      // DOM z range (without OM radius)
+        std::vector<double> domPosX, domPosY, domPosZ; // sorted by z
+        std::vector<int16_t> stringIDs;
+        std::vector<uint16_t> domIDs;
+    };
+
+    // a single intersection of a photon path segment with a DOM
+    struct DOMHit_t
+    {
+        double distance;
+        int16_t stringID;
+        uint16_t domID;
+    };
+
+    void BuildGeometryIndex();
+
+    void WorkerThread();
+    void WorkerThread_impl(boost::this_thread::disable_interruption &di);
+
+    // stores the error of a failed worker thread (the first one wins)
+    void SetWorkerError(const std::string &what);
+    // throws if a worker thread failed
+    void ThrowIfWorkerFailed();
+
+    // propagates all photons from a single step, appending detected photons to the output
+    void PropagateStep(const I3CLSimStep &step,
+                       const I3RandomServicePtr &rng,
+                       I3CLSimPhotonSeries &outputPhotons,
+                       I3CLSimPhotonHistorySeries *outputHistories) const;
+
+    // propagates all photons from a bunch of steps in SIMD packets
+    void PropagateStepsInPackets(const I3CLSimStepSeries &steps,
+                                 const I3RandomServicePtr &rng,
+                                 I3CLSimPhotonSeries &outputPhotons,
+                                 I3CLSimPhotonHistorySeries *outputHistories) const;
+
+    // PPC-style propagation through the ice layers. Returns the distance to the next
+    // interaction and updates the number of absorption lengths left.
+    double PropagateThroughLayers(double effective_z,
+                                  int currentPhotonLayer,
+                                  double photon_dz,
+                                  double wlen,
+                                  double sca_step_left,
+                                  double &abs_lens_left) const;
+
+    // finds all DOMs intersected by the segment starting at pos in direction dir
+    // with length stepLength. If nearestOnly is set, only the closest hit is returned.
+    void FindDOMIntersections(const double pos[3],
+                              const double dir[3],
+                              double stepLength,
+                              bool nearestOnly,
+                              std::vector<DOMHit_t> &hits) const;
+
+    double GetGroupVelocity(double wlen) const;
+
+    std::vector<boost::shared_ptr<boost::thread> > threadObjs_;
+
+    boost::shared_ptr<I3CLSimLockFreeQueue<WorkItem_t> > queueToWorkers_;
+    boost::shared_ptr<I3CLSimQueue<I3CLSimStepToPhotonConverter::ConversionResult_t> > queueFromWorkers_;
+
+    I3RandomServicePtr randomService_;
+
+    bool initialized_;
+
+    std::size_t numThreads_;
+    std::size_t maxNumWorkitems_;
+    bool stopDetectedPhotons_;
+    bool saveAllPhotons_;
+    double saveAllPhotonsPrescale_;
+    double fixedNumberOfAbsorptionLengths_;
+    double pancakeFactor_;
+    uint32_t photonHistoryEntries_;
+    bool usePacketPropagation_;
+
+    std::vector<I3CLSimRandomValueConstPtr> wlenGenerators_;
+    I3CLSimFunctionConstPtr wlenBias_;
+    I3CLSimMediumPropertiesConstPtr mediumProperties_;
+    I3CLSimSimpleGeometryConstPtr geometry_;
+
+    // these are cached by Initialize() in order not to touch
+    // shared_ptr reference counts from the worker threads
+    I3CLSimRandomValueConstPtr scatteringCosAngleDist_;
+    I3CLSimScalarFieldConstPtr directionalAbsLenCorrection_;
+    I3CLSimScalarFieldConstPtr iceTiltZShift_;
+    I3CLSimVectorTransformConstPtr preScatterDirectionTransform_;
+    I3CLSimVectorTransformConstPtr postScatterDirectionTransform_;
+    double omRadius_;
+
+    // constant fields can be evaluated once for a whole packet
+    bool iceTiltZShiftIsConstant_;
+    double iceTiltZShiftConstant_;
+    bool directionalAbsLenCorrectionIsConstant_;
+    double directionalAbsLenCorrectionConstant_;
+    std::vector<StringInfo_t> strings_;
+
+    // every bunch gets its own random number generator seed
+    boost::mutex enqueue_mutex_;
+    uint32_t rngBaseSeed_;
+    uint32_t numBunchesEnqueued_;
+
+    boost::mutex workerError_mutex_;
+    std::string workerError_;
+
+    boost::mutex statistics_mutex_;
+    uint64_t statistics_total_device_duration_in_nanoseconds_;
+    uint64_t statistics_total_host_duration_in_nanoseconds_;
+    uint64_t statistics_total_kernel_calls_;
+    uint64_t statistics_total_num_photons_generated_;
+    uint64_t statistics_total_num_photons_atDOMs_;
+
+    SET_LOGGER("I3CLSimStepToPhotonConverterNative");
+};
+
+I3_POINTER_TYPEDEFS(I3CLSimStepToPhotonConverterNative);
+
+#endif //I3CLSIMSTEPTOPHOTONCONVERTERNATIVE_H_INCLUDED
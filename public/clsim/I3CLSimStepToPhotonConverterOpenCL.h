@@ -30,17 +30,20 @@
 #include "clsim/I3CLSimStepToPhotonConverter.h"
 
 #include "phys-services/I3RandomService.h"
+#include "dataclasses/physics/I3Particle.h"
 
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 
 #include "clsim/I3CLSimQueue.h"
+#include "clsim/I3CLSimLockFreeQueue.h"
 
 #include "clsim/I3CLSimOpenCLDevice.h"
 
 #include <vector>
 #include <map>
+#include <set>
 #include <string>
 #include <stdexcept>
 
@@ -133,10 +136,59 @@ public:
     void SetEnableDoubleBuffering(bool value);
 
     /**
-     * Returns true if double buffering is enabled.
+     * Returns true if double buffering is enabled
+     * (i.e. if more than one buffer is in use).
      */
     bool GetEnableDoubleBuffering() const;
 
+    /**
+     * Sets the number of step/photon buffer sets
+     * in the device pipeline. Steps are uploaded,
+     * propagated and downloaded through separate
+     * command queues, so with N>1 buffers the next
+     * bunches are already queued on the device while
+     * the host copies the results of the current one.
+     *
+     * Each buffer set needs its own photon output
+     * buffer on the device, so device memory usage
+     * grows linearly with this value.
+     *
+     * SetEnableDoubleBuffering(true/false) is equivalent
+     * to SetNumBuffers(2/1).
+     *
+     * Will throw if already initialized.
+     */
+    void SetNumBuffers(unsigned int value);
+
+    /**
+     * Returns the number of buffer sets in the device pipeline.
+     */
+    unsigned int GetNumBuffers() const;
+
+    /**
+     * Transfers steps and photons through pinned host
+     * buffers that stay mapped for the lifetime of this
+     * object. Steps are copied into the mapped memory and
+     * uploaded from there, photons are downloaded into it
+     * and handed out as an I3CLSimPhotonSeriesView
+     * (ConversionResult_t::photonView) instead of a newly
+     * allocated I3CLSimPhotonSeries. This avoids the
+     * driver's internal staging copies and one host
+     * allocation per kernel call.
+     *
+     * Each buffer set can only be lent out once. Results
+     * for a buffer set whose previous view is still alive
+     * are copied into an I3CLSimPhotonSeries as usual.
+     *
+     * Will throw if already initialized.
+     */
+    void SetUseMappedBuffers(bool value);
+
+    /**
+     * Returns true if mapped host buffers are used.
+     */
+    bool GetUseMappedBuffers() const;
+
     /**
      * Enables double-precision support in the
      * kernel. This slows down calculations and
@@ -170,6 +222,161 @@ public:
      */
     bool GetStopDetectedPhotons() const;
 
+    /**
+     * Makes the kernel write a compact 40 byte photon
+     * record instead of the full 80 byte I3CLSimPhoton,
+     * which halves the amount of data to transfer from
+     * the device. Directions, wavelengths and the position
+     * relative to the hit DOM are stored as half precision
+     * floats and expanded on the host. The start position,
+     * start time and start direction are not available
+     * (they are set to NaN) and the number of scatters
+     * saturates at 65535.
+     *
+     * Cannot be used together with saveAllPhotons
+     * or photon histories.
+     *
+     * Will throw if already initialized.
+     */
+    void SetCompactPhotonOutput(bool value);
+
+    /**
+     * Returns true if the compact photon output is used.
+     */
+    bool GetCompactPhotonOutput() const;
+
+    /**
+     * If set to a value > 1, all wavelength-dependent medium
+     * properties (refractive indices, scattering and absorption
+     * lengths) are sampled on a grid of this many wavelength bins
+     * for each layer when the kernel is compiled. The kernel then
+     * interpolates linearly in these tables instead of evaluating
+     * the original functions. Layers with identical properties share
+     * a single row. Functions that cannot be sampled fall back to
+     * the generated code. A value of 0 (the default) disables the tables.
+     *
+     * Will throw if already initialized.
+     */
+    void SetMediumPropertiesLookupTableBins(uint32_t value);
+
+    /**
+     * Returns the number of wavelength bins used for the
+     * medium property lookup tables (0 if disabled).
+     */
+    uint32_t GetMediumPropertiesLookupTableBins() const;
+
+    /**
+     * If set to a value > 1, the cumulative optical depth
+     * (the sum of inverse scattering and absorption lengths)
+     * below each layer is tabulated for this many wavelengths.
+     * The kernel then finds the layer in which a photon scatters
+     * or is absorbed with a binary search instead of stepping
+     * through all layers in between. Within a propagation step
+     * the scattering and absorption lengths are taken from
+     * these tables (interpolated linearly in wavelength).
+     * A value of 0 (the default) disables the tables.
+     *
+     * Will throw if already initialized.
+     */
+    void SetOpticalDepthTableBins(uint32_t value);
+
+    /**
+     * Returns the number of wavelength bins used for the
+     * optical depth tables (0 if disabled).
+     */
+    uint32_t GetOpticalDepthTableBins() const;
+
+    /**
+     * Use a uniform 3D grid of cells for DOM collision
+     * detection instead of the default 2D grid of strings.
+     * The grid is uploaded to the device as buffers and works
+     * for any DOM layout (non-vertical strings, clusters of
+     * DOMs, ...), including geometries the string grid
+     * cannot handle.
+     *
+     * Will throw if already initialized.
+     */
+    void SetUseDOMGrid(bool value);
+
+    /**
+     * Returns true if the 3D DOM grid is used.
+     */
+    bool GetUseDOMGrid() const;
+
+    /**
+     * Enables early culling of photons that cannot reach any DOM.
+     * A coarse field with a lower bound on the distance to the
+     * closest DOM is calculated from the geometry on initialization.
+     * A photon is stopped once this distance is larger than
+     * the number of absorption lengths it has left plus the margin
+     * (in units of the largest absorption length of the medium).
+     * This does not change the results, but can save a lot of time
+     * for light sources at the edge of the detector.
+     *
+     * The margin is given in absorption lengths, NaN (the default)
+     * disables culling. Culling is not used if all photons are saved.
+     *
+     * Will throw if already initialized.
+     */
+    void SetDistanceCullingMargin(double value);
+
+    /**
+     * Returns the distance culling margin in
+     * absorption lengths (NaN if disabled).
+     */
+    double GetDistanceCullingMargin() const;
+
+    /**
+     * Enables photon splitting and Russian roulette if larger than 1.
+     *
+     * Photons are split into this number of copies when they get
+     * closer to a DOM than the splitting distance, each copy carries
+     * a fraction of the weight. Photons further away from all DOMs than
+     * the roulette distance survive with a probability of 1/factor and
+     * their weight is multiplied by the factor. Photons leaving
+     * the region close to the DOMs or entering the one far away from
+     * them are treated the other way around, so the expected sum of
+     * weights at each DOM stays the same. Photon weights can be larger
+     * than 1 with this option. The distances are checked after each
+     * scatter using the coarse distance field (see SetDistanceCullingMargin()).
+     *
+     * Cannot be used if all photons are saved or with photon histories.
+     *
+     * Will throw if already initialized.
+     */
+    void SetPhotonSplittingFactor(uint32_t value);
+
+    /**
+     * Returns the photon splitting factor (1 if disabled).
+     */
+    uint32_t GetPhotonSplittingFactor() const;
+
+    /**
+     * Sets the distance to the closest DOM below which photons
+     * are split. The default is 10m.
+     *
+     * Will throw if already initialized.
+     */
+    void SetPhotonSplittingDistance(double value);
+
+    /**
+     * Returns the photon splitting distance.
+     */
+    double GetPhotonSplittingDistance() const;
+
+    /**
+     * Sets the distance to the closest DOM above which photons
+     * play Russian roulette. The default is 100m.
+     *
+     * Will throw if already initialized.
+     */
+    void SetPhotonRouletteDistance(double value);
+
+    /**
+     * Returns the photon roulette distance.
+     */
+    double GetPhotonRouletteDistance() const;
+
     /**
      * Tell the propagator to save all photons,
      * regardless of detection. All photons will
@@ -237,6 +444,117 @@ public:
      */
     double GetFixedNumberOfAbsorptionLengths() const;
 
+    /**
+     * Fills a photon table on the device instead of returning photons.
+     * Each photon segment is sampled on average once per stepLength
+     * and its weight is added to a table binned in distance from the
+     * source, azimuth (in degrees, 0-180), cos(zenith) w.r.t. the source
+     * direction and time residual (the same coordinates as I3CLSimTabulator).
+     * Photon histories are not needed for this, no photons are
+     * downloaded and the conversion results are always empty.
+     * Set an empty vector to disable tabulation (the default).
+     *
+     * Cannot be used together with saveAllPhotons, photon histories
+     * or photon splitting. There is no collision detection, so a
+     * geometry is not necessary in this mode.
+     *
+     * Will throw if already initialized.
+     */
+    void SetTabulationBins(const std::vector<std::vector<double> > &binEdges,
+                           double stepLength);
+
+    /**
+     * Returns the table bin edges (empty if tabulation is disabled).
+     */
+    const std::vector<std::vector<double> > &GetTabulationBinEdges() const;
+
+    /**
+     * Returns the tabulation step length.
+     */
+    double GetTabulationStepLength() const;
+
+    /**
+     * Sets the light source the table coordinates are relative to.
+     * Only its position, direction and time are used. Steps
+     * themselves can come from anywhere.
+     *
+     * Will throw if already initialized.
+     */
+    void SetTabulationSource(const I3Particle &source);
+
+    /**
+     * Sets the acceptance of the (virtual) DOM used to weight
+     * photons in the table. Photon weights are multiplied with
+     * the effective area (wavelengthAcceptance times the DOM cross
+     * section) and the angular acceptance of the photon direction.
+     *
+     * Will throw if already initialized.
+     */
+    void SetTabulationEfficiencies(I3CLSimFunctionConstPtr wavelengthAcceptance,
+                                   I3CLSimFunctionConstPtr angularAcceptance,
+                                   double domRadius);
+
+    /**
+     * Download the table. The values are the sum of all weights
+     * in each bin, "weights" is the sum of their squares. Both are not
+     * normalized and the bins are stored in C order (the time residual
+     * running fastest).
+     * All results of the steps enqueued so far have to be retrieved
+     * before calling this.
+     *
+     * Will throw if not initialized or if tabulation is disabled.
+     */
+    std::vector<float> GetTabulatedValues();
+    std::vector<float> GetTabulatedWeights();
+
+    /**
+     * Returns the sum of the weights of all photons generated so far
+     * (this is what the table should be normalized to).
+     *
+     * Will throw if not initialized or if tabulation is disabled.
+     */
+    double GetTabulatedSumOfPhotonWeights();
+
+    /**
+     * Applies the DOM acceptance in the kernel when a photon hits
+     * a DOM, the same way I3PhotonToMCPEConverter does on the host:
+     * the photon weight is multiplied with the wavelength and angular
+     * acceptance and the relative efficiency of the DOM (see
+     * SetHitDOMEfficiencies()) and the result is sampled to a number
+     * of photo-electrons. Only photons producing photo-electrons are
+     * returned, as 16 byte hit records that are expanded on the host
+     * to I3CLSimPhotons with the number of photo-electrons as their
+     * weight and the DOM center as their position. Their times are
+     * corrected for oversized DOMs using "oversizeFactor" and the
+     * pancake factor. All other fields are set to NaN (or zero).
+     * DOMs are assumed to point straight down.
+     *
+     * Needs stopDetectedPhotons. Cannot be used together with
+     * saveAllPhotons, compactPhotonOutput, photon histories or
+     * tabulation.
+     *
+     * Will throw if already initialized.
+     */
+    void SetHitConversion(I3CLSimFunctionConstPtr wavelengthAcceptance,
+                          I3CLSimFunctionConstPtr angularAcceptance,
+                          double oversizeFactor);
+
+    /**
+     * Returns true if hits are converted to photo-electrons
+     * on the device.
+     */
+    bool GetHitConversion() const;
+
+    /**
+     * Sets the relative DOM efficiencies used by the hit conversion
+     * as a map of (string ID, DOM ID) pairs to efficiencies. DOMs
+     * that are not in the map use defaultEfficiency.
+     * This may be called at any time, steps enqueued after the call
+     * use the new efficiencies.
+     */
+    void SetHitDOMEfficiencies(const std::map<std::pair<int, unsigned int>, double> &efficiencies,
+                               double defaultEfficiency=1.);
+
     /**
      * Sets the "pancake" factor for DOMs. For standard
      * oversized-DOM simulations, this should be the
@@ -257,6 +575,25 @@ public:
      */
     double GetDOMPancakeFactor() const;
 
+    /**
+     * Sets the directory used to cache compiled OpenCL program
+     * binaries. Binaries are keyed on the full generated source,
+     * the build options and the device/driver version, so a
+     * matching entry can be loaded instead of re-compiling.
+     * An empty string disables the cache.
+     *
+     * Defaults to $CLSIM_KERNEL_CACHE or, if that is not set,
+     * to $HOME/.cache/clsim/kernels.
+     *
+     * Will throw if already initialized.
+     */
+    void SetProgramBinaryCacheDirectory(const std::string &value);
+
+    /**
+     * Returns the program binary cache directory.
+     */
+    std::string GetProgramBinaryCacheDirectory() const;
+
     /**
      * Sets the wavelength generators. 
      * The first generator (index 0) is assumed to return a Cherenkov
@@ -292,6 +629,35 @@ public:
      */
     virtual void SetGeometry(I3CLSimSimpleGeometryConstPtr geometry);
 
+    /**
+     * Replaces the geometry of an initialized converter.
+     * With the DOM grid (see SetUseDOMGrid()), the geometry is
+     * passed to the kernel as buffers, so this only uploads
+     * new buffers and does not re-compile anything.
+     * All results of the steps enqueued so far have to be
+     * retrieved before calling this.
+     * Will throw if not initialized or if the DOM grid is not used.
+     */
+    void UpdateGeometry(I3CLSimSimpleGeometryConstPtr geometry);
+
+    /**
+     * The number of DOM masks that can be set using SetDOMMask().
+     * (Index 0 is the empty mask and cannot be set.)
+     */
+    static const uint16_t maxNumDOMMasks;
+
+    /**
+     * Sets the DOM mask with index maskIndex to the given list
+     * of (string ID, DOM ID) pairs. Steps with this index in
+     * their "dummy2" field will not produce hits on these DOMs.
+     * With stopDetectedPhotons, their photons pass through the
+     * masked DOMs as if they were not there.
+     * A mask must not be changed while steps using it are
+     * being processed. Replacing the geometry resets all masks.
+     * Will throw if not initialized or if the DOM grid is not used.
+     */
+    void SetDOMMask(uint16_t maskIndex, const std::set<std::pair<int, unsigned int> > &maskedDOMs);
+
     /**
      * Compiles the kernel. Can only be used
      * after medium properties, geometry and device have
@@ -317,6 +683,8 @@ public:
     std::string GetWlenBiasSource();
     virtual std::string GetGeometrySource();
     virtual std::string GetCollisionDetectionSource(bool header=true);
+    std::string GetTabulationSource();
+    std::string GetHitConversionSource();
     
     /**
      * Initializes the simulation.
@@ -384,6 +752,53 @@ private:
     // sets up OpenCL
     void SetupQueueAndKernel(const cl::Platform& platform, const cl::Device &device);
 
+    // size of one photon record in the output buffer
+    std::size_t GetOutputPhotonRecordSize() const;
+
+    void StartOpenCLThread();
+    void StopOpenCLThread();
+    
+    // uploads the DOM grid and sets it as kernel arguments
+    // starting at argN (returns the next argument index)
+    void SetupDOMGridBuffers();
+    unsigned int SetDOMGridKernelArgs(cl::Kernel &kernel, unsigned int argN);
+    
+    // calculates the distance field and the maximum absorption length
+    void GenerateDistanceField();
+    
+    // uploads the distance field and sets it as kernel arguments
+    // starting at argN (returns the next argument index)
+    void SetupDistanceFieldBuffer();
+    unsigned int SetDistanceFieldKernelArgs(cl::Kernel &kernel, unsigned int argN);
+    // the distance field is used for distance culling and photon splitting
+    bool UsesDistanceField() const;
+    
+    // the kernel needs the geometry for collision detection unless
+    // all photons are saved or photons are tabulated
+    bool UsesGeometry() const;
+    
+    // allocates the (zeroed) table and sets it as kernel arguments
+    // starting at argN (returns the next argument index)
+    void SetupTabulationBuffers();
+    unsigned int SetTabulationKernelArgs(cl::Kernel &kernel, unsigned int argN, unsigned int bufferIndex);
+    
+    // adds up the photon weights of a finished kernel
+    void OpenCLThread_impl_downloadTabulationPhotonWeights(unsigned int bufferIndex,
+                                                          std::size_t numberOfInputSteps);
+    
+    // downloads one of the table buffers
+    std::vector<float> DownloadTabulationBuffer(cl::Buffer &buffer);
+    
+    // uploads the per-DOM efficiencies for the hit conversion and sets
+    // them as kernel arguments starting at argN (returns the next argument index)
+    void SetupHitConversionBuffers();
+    unsigned int SetHitConversionKernelArgs(cl::Kernel &kernel, unsigned int argN);
+    
+    // uploads the DOM efficiencies if they changed since the last call
+    void OpenCLThread_impl_updateHitDOMEfficiencies(unsigned int bufferIndex);
+    
+    // uploads the DOM masks if they changed since the last call
+    void OpenCLThread_impl_updateDOMMask(unsigned int bufferIndex);
     
     void OpenCLThread();
     void OpenCLThread_impl(boost::this_thread::disable_interruption &di);
@@ -393,15 +808,21 @@ private:
                                        uint32_t &out_stepsIdentifier,
                                        uint64_t &out_totalNumberOfPhotons,
                                        std::size_t &out_numberOfInputSteps,
+                                       I3CLSimStepSeriesConstPtr &out_steps,
+                                       VECTOR_CLASS<cl::Event> &out_uploadEvents,
                                        bool blocking=true
                                        );
+    // pinned host buffers for the mapped transfer mode
+    struct MappedHostBuffers_t;
+
     void OpenCLThread_impl_downloadPhotons(boost::this_thread::disable_interruption &di,
                                            bool &shouldBreak,
                                            unsigned int bufferIndex,
                                            uint32_t stepsIdentifier);
     void OpenCLThread_impl_runKernel(unsigned int bufferIndex,
                                      cl::Event &kernelFinishEvent,
-                                     std::size_t numberOfInputSteps);
+                                     std::size_t numberOfInputSteps,
+                                     const VECTOR_CLASS<cl::Event> &uploadEvents);
 
     boost::posix_time::ptime DumpStatistics(const cl::Event &kernelFinishEvent,
                                             const boost::posix_time::ptime &last_timestamp,
@@ -424,7 +845,7 @@ private:
     boost::mutex openCLStarted_mutex_;
     bool openCLStarted_;
     
-    boost::shared_ptr<I3CLSimQueue<ToOpenCLPair_t> > queueToOpenCL_;
+    boost::shared_ptr<I3CLSimLockFreeQueue<ToOpenCLPair_t> > queueToOpenCL_;
     boost::shared_ptr<I3CLSimQueue<I3CLSimStepToPhotonConverter::ConversionResult_t> > queueFromOpenCL_;
 
     I3RandomServicePtr randomService_;
@@ -441,9 +862,18 @@ private:
     std::size_t selectedDeviceIndex_;
     bool deviceIsSelected_;
     
-    bool disableDoubleBuffering_;
+    unsigned int numBuffers_;
+    bool useMappedBuffers_;
     bool doublePrecision_;
     bool stopDetectedPhotons_;
+    bool compactPhotonOutput_;
+    uint32_t mediumPropertiesLookupTableBins_;
+    uint32_t opticalDepthTableBins_;
+    bool useDOMGrid_;
+    double distanceCullingMargin_;
+    uint32_t photonSplittingFactor_;
+    double photonSplittingDistance_;
+    double photonRouletteDistance_;
     bool saveAllPhotons_;
     double saveAllPhotonsPrescale_;
     double fixedNumberOfAbsorptionLengths_;
@@ -451,6 +881,35 @@ private:
     
     uint32_t photonHistoryEntries_;
     
+    // the photon table (only filled if tabulationBinEdges_ is not empty)
+    std::vector<std::vector<double> > tabulationBinEdges_;
+    double tabulationStepLength_;
+    I3Particle tabulationParticle_;
+    I3CLSimFunctionConstPtr tabulationWavelengthAcceptance_;
+    I3CLSimFunctionConstPtr tabulationAngularAcceptance_;
+    double tabulationDOMRadius_;
+    
+    // the sum of photon weights is accumulated by the OpenCL thread
+    boost::mutex tabulation_mutex_;
+    double tabulationSumOfPhotonWeights_;
+    
+    // the DOM acceptance for the hit conversion (only
+    // used if hitWavelengthAcceptance_ is set)
+    I3CLSimFunctionConstPtr hitWavelengthAcceptance_;
+    I3CLSimFunctionConstPtr hitAngularAcceptance_;
+    double hitOversizeFactor_;
+    
+    // Relative DOM efficiencies for the hit conversion. Like the DOM
+    // masks, SetHitDOMEfficiencies() may be called from any thread and
+    // the OpenCL thread uploads a new copy whenever the generation changes.
+    boost::mutex hitDOMEfficiency_mutex_;
+    std::map<std::pair<int, unsigned int>, double> hitDOMEfficiencies_;
+    double hitDefaultDOMEfficiency_;
+    uint64_t hitDOMEfficiencyGeneration_;
+    uint64_t hitDOMEfficiencyDeviceGeneration_;
+    std::vector<uint64_t> hitDOMEfficiencyKernelGeneration_;
+    unsigned int hitDOMEfficiencyKernelArg_;
+    
     // some kernel sources loaded on construction
     std::string prependSource_;
     std::string mwcrngKernelSource_;
@@ -458,18 +917,53 @@ private:
     std::string wlenBiasSource_;
     std::string mediumPropertiesSource_;
     std::string geometrySource_;
+    std::string tabulationSource_;
+    std::string hitConversionSource_;
     std::string propagationKernelSource_;
     
     // this is extra geometry information, we upload it to global memory
     std::vector<unsigned short> geoLayerToOMNumIndexPerStringSetInfo_;
     
+    // the 3D DOM grid (only if useDOMGrid_ is set), this goes to global memory, too
+    std::vector<uint32_t> geoGridCellStartBuffer_;
+    std::vector<uint32_t> geoGridCellDomsBuffer_;
+    std::vector<float> geoGridDomPosBuffer_;
+    std::vector<uint32_t> geoGridDomIndexBuffer_;
+    
+    // the DOM grid dimensions, these are passed to the kernel as arguments
+    float geoGridStartAndCellWidth_[4];
+    uint32_t geoGridNumCellsAndDoms_[4];
+    float geoGridOMRadius_;
+    
+    // DOM masks (one bit per DOM in the grid for each mask). SetDOMMask()
+    // may be called from any thread, the OpenCL thread uploads a new copy
+    // of the buffer whenever domMaskGeneration_ changes.
+    boost::mutex domMask_mutex_;
+    std::vector<uint32_t> domMaskBuffer_;
+    uint64_t domMaskGeneration_;
+    uint64_t domMaskDeviceGeneration_;
+    std::vector<uint64_t> domMaskKernelGeneration_;
+    unsigned int domMaskKernelArg_;
+    
+    // the distance field used for culling and splitting photons
+    // (only if UsesDistanceField() is true)
+    std::vector<float> distanceFieldBuffer_;
+    float distanceFieldStartAndCellWidth_[4];
+    uint32_t distanceFieldNumCells_[4];
+    float distanceCullingMaxDistPerAbsLen_;
+    
     // this allows us to convert the string index back to the string ID (which may be negative and non-contiguous)
     std::vector<int> stringIndexToStringIDBuffer_;
 
     // this allows us to convert the DOM index back to the DOM ID (which may be non-contiguous)
     std::vector<std::vector<unsigned int> > domIndexToDomIDBuffer_perStringIndex_;
+
+    // DOM positions as seen by the kernel, used to expand compact photons
+    std::vector<std::vector<float> > domIndexToDomPosBuffer_perStringIndex_;
     
-    // OpenCL command queue and kernel
+    // OpenCL command queues (one each for uploads, kernel
+    // execution and downloads) and one kernel per buffer
+    enum {uploadQueueIndex=0, computeQueueIndex=1, downloadQueueIndex=2, numQueues=3};
     std::vector<shared_ptr<cl::CommandQueue> > queue_;
     std::vector<shared_ptr<cl::Kernel> > kernel_;
     shared_ptr<cl::Context> context_;
@@ -481,6 +975,9 @@ private:
     std::size_t workgroupSize_;
     std::size_t maxNumWorkitems_;
     
+    // compiled program binaries are cached here (empty: no cache)
+    std::string programBinaryCacheDirectory_;
+    
     // rng state per workitem
     std::vector<uint64_t> MWC_RNG_x;
     std::vector<uint32_t> MWC_RNG_a;
@@ -493,8 +990,28 @@ private:
     std::vector<shared_ptr<cl::Buffer> > deviceBuffer_CurrentNumOutputPhotons;
     std::vector<shared_ptr<cl::Buffer> > deviceBuffer_PhotonHistory;
     
-    // this one is constant, so we only need one
+    // these are constant, so we only need one of each
     shared_ptr<cl::Buffer> deviceBuffer_GeoLayerToOMNumIndexPerStringSet;
+    shared_ptr<cl::Buffer> deviceBuffer_GeoGridCellStart;
+    shared_ptr<cl::Buffer> deviceBuffer_GeoGridCellDoms;
+    shared_ptr<cl::Buffer> deviceBuffer_GeoGridDomPos;
+    shared_ptr<cl::Buffer> deviceBuffer_GeoGridDomIndex;
+    shared_ptr<cl::Buffer> deviceBuffer_DOMMask;
+    shared_ptr<cl::Buffer> deviceBuffer_DistanceField;
+    
+    // the photon table is shared by all kernels (they run one after
+    // the other), the photon weights are written per work item
+    shared_ptr<cl::Buffer> deviceBuffer_TabulationValues;
+    shared_ptr<cl::Buffer> deviceBuffer_TabulationWeights;
+    std::vector<shared_ptr<cl::Buffer> > deviceBuffer_TabulationPhotonWeights;
+    
+    // the relative DOM efficiencies for the hit conversion
+    shared_ptr<cl::Buffer> deviceBuffer_HitDOMEfficiencyOffsets;
+    shared_ptr<cl::Buffer> deviceBuffer_HitDOMEfficiencies;
+    
+    // pinned host memory for all buffer sets (only if useMappedBuffers_ is set).
+    // Photon views handed out to the caller keep this alive.
+    shared_ptr<MappedHostBuffers_t> mappedHostBuffers_;
     
     // Size of output photon storage (maximum amount of photons per step bunch)
     uint32_t maxNumOutputPhotons_;
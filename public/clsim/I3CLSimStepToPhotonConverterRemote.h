@@ -0,0 +1,231 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimStepToPhotonConverterRemote.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMSTEPTOPHOTONCONVERTERREMOTE_H_INCLUDED
+#define I3CLSIMSTEPTOPHOTONCONVERTERREMOTE_H_INCLUDED
+
+#include "clsim/I3CLSimStepToPhotonConverter.h"
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "clsim/I3CLSimQueue.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <stdexcept>
+
+/**
+ * @brief Sends steps to an I3CLSimStepToPhotonConverterServer
+ * running in a different process (possibly on a different machine)
+ * and receives the resulting photons from there.
+ *
+ * This allows a single I3CLSimModule to feed a pool of worker
+ * processes. Add one of these converters per worker.
+ *
+ * The address is either "unix:/path/to/socket" for a local socket
+ * or "tcp:host:port". Steps and photons are transferred in their
+ * binary in-memory representation, so the worker needs to run the
+ * same build of clsim on the same architecture.
+ *
+ * The actual propagation is configured on the worker side. The
+ * wavelength generators, wavelength bias, medium properties and
+ * geometry passed to this converter are only used to check that
+ * the worker uses the same configuration (a hash of them is compared
+ * when connecting, Initialize() fails if they differ). DOM masks
+ * (I3CLSimStepToPhotonConverterOpenCL::SetDOMMask()) are not
+ * forwarded either, masked DOMs have to be removed on the host.
+ *
+ * The workgroup size and the maximum number of work items are
+ * taken from the worker during Initialize().
+ */
+struct I3CLSimStepToPhotonConverterRemote : public I3CLSimStepToPhotonConverter
+{
+public:
+    static const std::size_t default_maxBunchesInFlight;
+
+    I3CLSimStepToPhotonConverterRemote(const std::string &address);
+    virtual ~I3CLSimStepToPhotonConverterRemote();
+
+    /**
+     * Returns the address of the worker.
+     */
+    const std::string &GetAddress() const;
+
+    /**
+     * Sets the maximum number of step bunches that are
+     * sent to the worker before the corresponding photons
+     * have been received. Use a value larger than one to keep
+     * the worker busy while results are being transferred.
+     *
+     * Will throw if already initialized.
+     */
+    void SetMaxBunchesInFlight(std::size_t val);
+
+    /**
+     * Gets the maximum number of step bunches in flight.
+     */
+    std::size_t GetMaxBunchesInFlight() const;
+
+    /**
+     * Returns the workgroup size of the worker.
+     *
+     * Will throw if not initialized.
+     */
+    std::size_t GetWorkgroupSize() const;
+
+    /**
+     * Returns the maximum number of steps per bunch
+     * accepted by the worker.
+     *
+     * Will throw if not initialized.
+     */
+    std::size_t GetMaxNumWorkitems() const;
+
+    /**
+     * Only used to check the configuration of the worker.
+     * Will throw if used after the call to Initialize().
+     */
+    virtual void SetWlenGenerators(const std::vector<I3CLSimRandomValueConstPtr> &wlenGenerators);
+
+    /**
+     * Only used to check the configuration of the worker.
+     * Will throw if used after the call to Initialize().
+     */
+    virtual void SetWlenBias(I3CLSimFunctionConstPtr wlenBias);
+
+    /**
+     * Only used to check the configuration of the worker.
+     * Will throw if used after the call to Initialize().
+     */
+    virtual void SetMediumProperties(I3CLSimMediumPropertiesConstPtr mediumProperties);
+
+    /**
+     * Only used to check the configuration of the worker.
+     * Will throw if used after the call to Initialize().
+     */
+    virtual void SetGeometry(I3CLSimSimpleGeometryConstPtr geometry);
+
+    /**
+     * Connects to the worker and starts the
+     * threads talking to it.
+     * Will throw if already initialized or if
+     * the connection fails.
+     */
+    virtual void Initialize();
+
+    /**
+     * Returns true if initialized.
+     * Never throws.
+     */
+    virtual bool IsInitialized() const;
+
+    /**
+     * Adds a new I3CLSimStepSeries to the queue.
+     * The resulting I3CLSimPhotonSeries can be retrieved from the
+     * I3CLSimStepToPhotonConverter after some processing time.
+     *
+     * Will throw if not initialized.
+     */
+    virtual void EnqueueSteps(I3CLSimStepSeriesConstPtr steps, uint32_t identifier);
+
+    /**
+     * Reports the number of bunches that have not been
+     * sent to the worker yet.
+     *
+     * Will throw if not initialized.
+     */
+    virtual std::size_t QueueSize() const;
+
+    /**
+     * Returns true if more photons are available.
+     * If the return value is false, the current simulation is finished
+     * and a new step vector may be set.
+     *
+     * Will throw if not initialized.
+     */
+    virtual bool MorePhotonsAvailable() const;
+
+    /**
+     * Returns a bunch of photons stored in a vector<I3CLSimPhoton>.
+     *
+     * Might block if no photons are available.
+     *
+     * Will throw if not initialized or if the
+     * connection to the worker failed.
+     */
+    virtual I3CLSimStepToPhotonConverter::ConversionResult_t GetConversionResult();
+
+    inline uint64_t GetNumBunchesSent() {boost::unique_lock<boost::mutex> guard(inFlight_mutex_); return statistics_total_bunches_sent_;}
+
+private:
+    typedef std::pair<uint32_t, I3CLSimStepSeriesConstPtr> WorkItem_t;
+
+    void SenderThread();
+    void ReceiverThread();
+
+    // stores the first error and wakes up everybody waiting for results
+    void SetError(const std::string &message);
+
+    std::string address_;
+    int socket_;
+
+    bool initialized_;
+
+    std::size_t maxBunchesInFlight_;
+    std::size_t workgroupSize_;
+    std::size_t maxNumWorkitems_;
+
+    // compared to the worker's configuration
+    std::vector<I3CLSimRandomValueConstPtr> wlenGenerators_;
+    I3CLSimFunctionConstPtr wlenBias_;
+    I3CLSimMediumPropertiesConstPtr mediumProperties_;
+    I3CLSimSimpleGeometryConstPtr geometry_;
+
+    boost::shared_ptr<boost::thread> senderThread_;
+    boost::shared_ptr<boost::thread> receiverThread_;
+
+    boost::shared_ptr<I3CLSimQueue<WorkItem_t> > queueToSender_;
+    boost::shared_ptr<I3CLSimQueue<I3CLSimStepToPhotonConverter::ConversionResult_t> > queueFromReceiver_;
+
+    mutable boost::mutex inFlight_mutex_;
+    boost::condition_variable inFlight_cond_;
+    std::size_t numBunchesInFlight_;
+    uint64_t statistics_total_bunches_sent_;
+
+    mutable boost::mutex error_mutex_;
+    bool shuttingDown_;
+    std::string errorMessage_;
+
+    SET_LOGGER("I3CLSimStepToPhotonConverterRemote");
+};
+
+I3_POINTER_TYPEDEFS(I3CLSimStepToPhotonConverterRemote);
+
+#endif //I3CLSIMSTEPTOPHOTONCONVERTERREMOTE_H_INCLUDED
@@ -0,0 +1,147 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimStepToPhotonConverterServer.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMSTEPTOPHOTONCONVERTERSERVER_H_INCLUDED
+#define I3CLSIMSTEPTOPHOTONCONVERTERSERVER_H_INCLUDED
+
+#include "clsim/I3CLSimStepToPhotonConverter.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief Makes an initialized I3CLSimStepToPhotonConverter
+ * available to I3CLSimStepToPhotonConverterRemote clients
+ * in other processes.
+ *
+ * This is the worker side of a simple broker: the module
+ * process holds one I3CLSimStepToPhotonConverterRemote per worker
+ * and its step bunch scheduler distributes steps among them.
+ * Each worker process configures its own converter (OpenCL or
+ * native) in exactly the same way the module would and serves
+ * it using this class.
+ *
+ * Only one client is served at a time, additional clients
+ * wait until the current one has disconnected.
+ *
+ * The workgroup size and the maximum number of work items
+ * are sent to the client when it connects, so that it can
+ * form bunches the converter accepts. Pass the same wavelength
+ * generators, wavelength bias, medium properties and geometry
+ * the converter has been configured with. Clients configured
+ * differently are rejected.
+ */
+class I3CLSimStepToPhotonConverterServer : private boost::noncopyable
+{
+public:
+    /**
+     * The address is either "unix:/path/to/socket"
+     * or "tcp:host:port" (use an empty host to listen
+     * on all interfaces).
+     */
+    I3CLSimStepToPhotonConverterServer(const std::string &address,
+                                       I3CLSimStepToPhotonConverterPtr converter,
+                                       std::size_t workgroupSize,
+                                       std::size_t maxNumWorkitems,
+                                       const std::vector<I3CLSimRandomValueConstPtr> &wlenGenerators,
+                                       I3CLSimFunctionConstPtr wlenBias,
+                                       I3CLSimMediumPropertiesConstPtr mediumProperties,
+                                       I3CLSimSimpleGeometryConstPtr geometry);
+    ~I3CLSimStepToPhotonConverterServer();
+
+    /**
+     * Starts listening for clients in a background thread.
+     * The converter has to be initialized.
+     *
+     * Will throw if already running.
+     */
+    void Start();
+
+    /**
+     * Disconnects the current client (if any) and stops
+     * listening. Bunches that have already been sent
+     * to the converter are drained first.
+     */
+    void Stop();
+
+    /**
+     * Returns true if the server is running.
+     */
+    bool IsRunning() const;
+
+    /**
+     * Returns the address the server listens on.
+     */
+    const std::string &GetAddress() const;
+
+    inline uint64_t GetNumClientsServed() {boost::unique_lock<boost::mutex> guard(statistics_mutex_); return statistics_total_clients_;}
+    inline uint64_t GetNumBunchesServed() {boost::unique_lock<boost::mutex> guard(statistics_mutex_); return statistics_total_bunches_;}
+
+private:
+    void ListenerThread();
+
+    // reads steps from a single client and passes them to the converter
+    void ServeClient(int clientSocket);
+
+    // sends the converter's results back to the client
+    void WriterThread(int clientSocket);
+
+    std::string address_;
+    I3CLSimStepToPhotonConverterPtr converter_;
+    std::size_t workgroupSize_;
+    std::size_t maxNumWorkitems_;
+    uint64_t configurationHash_;
+
+    int listenSocket_;
+    boost::shared_ptr<boost::thread> listenerThread_;
+
+    // state of the current client
+    boost::mutex client_mutex_;
+    boost::condition_variable client_cond_;
+    int clientSocket_;
+    std::size_t numPending_;
+    bool readerDone_;
+    bool stopping_;
+
+    // both threads may need to send (results or errors)
+    boost::mutex send_mutex_;
+
+    boost::mutex statistics_mutex_;
+    uint64_t statistics_total_clients_;
+    uint64_t statistics_total_bunches_;
+
+    SET_LOGGER("I3CLSimStepToPhotonConverterServer");
+};
+
+I3_POINTER_TYPEDEFS(I3CLSimStepToPhotonConverterServer);
+
+#endif //I3CLSIMSTEPTOPHOTONCONVERTERSERVER_H_INCLUDED
@@ -0,0 +1,176 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3ColumnarPhotonSeriesMap.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3COLUMNARPHOTONSERIESMAP_H_INCLUDED
+#define I3COLUMNARPHOTONSERIESMAP_H_INCLUDED
+
+#include <vector>
+#include <map>
+
+#include "icetray/I3FrameObject.h"
+
+#include "clsim/I3Photon.h"
+
+/**
+ * @brief An I3PhotonSeriesMap stored as one column per photon
+ * attribute ("structure of arrays") instead of one object
+ * per photon.
+ *
+ * The photons of each OM form a contiguous block in all columns.
+ * Only the attributes needed to convert photons into hits are
+ * kept: time, weight, wavelength, group velocity, direction,
+ * position, the ID of the emitting particle and a single bit
+ * telling whether the photon was scattered at all. Photon IDs,
+ * start points, Cherenkov distances and scattering histories
+ * are dropped. Decoded photons that were scattered report
+ * GetNumScattered()==1, their start position is left unset (NaN).
+ *
+ * Weights, wavelengths and group velocities are stored in single
+ * precision (this is what the propagation kernel uses anyway).
+ * Positions are stored in single precision relative to the center
+ * of each block. Optionally, these lossy encodings can be enabled:
+ *
+ *  - delta-encoding of times: photons in each block are sorted
+ *    by time and only the (single precision) difference to the
+ *    previous photon is stored. Decoded photons come back sorted
+ *    by time within each OM.
+ *  - quantized directions: zenith and azimuth are stored as
+ *    16-bit fixed-point numbers (about 5e-5 rad resolution).
+ *  - quantized positions: positions are stored as 16-bit
+ *    fixed-point offsets from the block center. The step size
+ *    is the requested resolution, but it is increased for blocks
+ *    that would not fit into 16 bits otherwise.
+ */
+static const unsigned i3columnarphotonseriesmap_version_ = 1;
+
+class I3ColumnarPhotonSeriesMap : public I3FrameObject
+{
+public:
+    typedef I3PhotonSeriesMap::key_type key_type;
+
+    I3ColumnarPhotonSeriesMap();
+
+    /**
+     * Encodes all photons in "photons". Set "positionResolution"
+     * to a positive value to quantize positions.
+     */
+    explicit I3ColumnarPhotonSeriesMap(const I3PhotonSeriesMap &photons,
+                                       bool deltaEncodeTimes=false,
+                                       bool quantizeDirections=false,
+                                       double positionResolution=0.);
+
+    virtual ~I3ColumnarPhotonSeriesMap();
+
+    /**
+     * Replaces the contents with the photons from "photons",
+     * using the currently configured encoding.
+     */
+    void Fill(const I3PhotonSeriesMap &photons);
+
+    /**
+     * Decodes all blocks into a new I3PhotonSeriesMap.
+     */
+    I3PhotonSeriesMapPtr GetPhotonSeriesMap() const;
+
+    /**
+     * Decodes a single block and appends its photons to "photons".
+     */
+    void DecodeBlock(std::size_t block, I3PhotonSeries &photons) const;
+
+    void clear();
+    inline std::size_t GetNumBlocks() const {return blockKeys_.size();}
+    inline std::size_t GetNumPhotons() const {return particleIndices_.size();}
+    inline const key_type &GetBlockKey(std::size_t block) const {return blockKeys_.at(block);}
+    inline uint32_t GetBlockSize(std::size_t block) const {return blockSizes_.at(block);}
+
+    inline bool GetDeltaEncodeTimes() const {return deltaEncodeTimes_;}
+    inline bool GetQuantizeDirections() const {return quantizeDirections_;}
+    inline double GetPositionResolution() const {return positionResolution_;}
+    inline bool GetQuantizePositions() const {return positionResolution_ > 0.;}
+
+private:
+    void AppendBlock(const key_type &key, const I3PhotonSeries &photons);
+    uint32_t GetParticleIndex(uint64_t majorID, int32_t minorID);
+    bool GetScattered(std::size_t photon) const;
+
+    bool deltaEncodeTimes_;
+    bool quantizeDirections_;
+    double positionResolution_;
+
+    // one entry per block
+    std::vector<key_type> blockKeys_;
+    std::vector<uint32_t> blockSizes_;
+    std::vector<double> blockTimeOrigins_;
+    std::vector<double> blockCenterX_;
+    std::vector<double> blockCenterY_;
+    std::vector<double> blockCenterZ_;
+    std::vector<double> blockPositionSteps_;
+
+    // one entry per particle that emitted any of the photons
+    std::vector<uint64_t> particleMajorIDs_;
+    std::vector<int32_t> particleMinorIDs_;
+
+    // one entry per photon (only one of each
+    // pair of alternative columns is filled)
+    std::vector<double> times_;
+    std::vector<float> timeDeltas_;
+    std::vector<float> weights_;
+    std::vector<float> wavelengths_;
+    std::vector<float> groupVelocities_;
+    std::vector<float> zeniths_;
+    std::vector<float> azimuths_;
+    std::vector<uint16_t> quantizedZeniths_;
+    std::vector<uint16_t> quantizedAzimuths_;
+    std::vector<float> offsetX_;
+    std::vector<float> offsetY_;
+    std::vector<float> offsetZ_;
+    std::vector<int16_t> quantizedOffsetX_;
+    std::vector<int16_t> quantizedOffsetY_;
+    std::vector<int16_t> quantizedOffsetZ_;
+    std::vector<uint32_t> particleIndices_;
+
+    // one bit per photon, set for photons that were scattered
+    // (empty for version 0, all photons count as scattered)
+    std::vector<uint8_t> scatteredFlags_;
+
+    // offset of each block in the photon columns,
+    // rebuilt after filling or loading
+    std::vector<std::size_t> blockOffsets_;
+
+    // (majorID, minorID) -> index, only used while filling
+    std::map<std::pair<uint64_t, int32_t>, uint32_t> particleIndexLookup_;
+
+    friend class boost::serialization::access;
+    template <class Archive> void save(Archive & ar, unsigned version) const;
+    template <class Archive> void load(Archive & ar, unsigned version);
+    BOOST_SERIALIZATION_SPLIT_MEMBER();
+};
+
+BOOST_CLASS_VERSION(I3ColumnarPhotonSeriesMap, i3columnarphotonseriesmap_version_);
+
+I3_POINTER_TYPEDEFS(I3ColumnarPhotonSeriesMap);
+
+#endif //I3COLUMNARPHOTONSERIESMAP_H_INCLUDED
@@ -133,6 +133,10 @@ private:
     /// Parameter: Make photon position/radius check a warning only (instead of a fatal condition)
     bool onlyWarnAboutInvalidPhotonPositions_;
 
+    /// Parameter: Convert photons with hit probabilities > 1 into hits with more than one photo-electron
+    ///            (needed for photon splitting and step pre-culling). Otherwise they are a fatal error.
+    bool allowPhotonWeightsAboveOne_;
+
     
 private:
     // default, assignment, and copy constructor declared private
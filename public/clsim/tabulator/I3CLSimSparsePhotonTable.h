@@ -0,0 +1,200 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file I3CLSimSparsePhotonTable.h
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+#ifndef I3CLSIMSPARSEPHOTONTABLE_H_INCLUDED
+#define I3CLSIMSPARSEPHOTONTABLE_H_INCLUDED
+
+#include "icetray/I3TrayHeaders.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Read access to a photon table stored as a series of
+ * independently compressed chunks.
+ *
+ * The table (values and squared weights, as written by the tabulator)
+ * is flattened in C order and cut into chunks of a fixed number of
+ * bins. Each chunk holds its values followed by its weights (float32)
+ * and is compressed with zlib. Chunks that are all zero are not stored
+ * at all. Since most of a table is empty at large distances and late
+ * times, this is much smaller than the dense FITS format.
+ *
+ * The file is memory-mapped, so only the chunks that are being read
+ * have to be in memory. This makes it possible to sum up tables that
+ * are much larger than the available RAM (see Merge()).
+ *
+ * File layout (native byte order):
+ *   char[8]        magic "CLSIMSPT"
+ *   uint32         format version
+ *   uint32         number of dimensions N
+ *   uint64[N]      number of bins in each dimension
+ *   double[n_i+1]  bin edges, for each dimension
+ *   uint32         number of header entries, then for each entry:
+ *                  uint32 key length, key, uint8 isInteger, double value
+ *   uint64         number of bins per chunk
+ *   uint64         number of chunks
+ *   uint64         file offset of the chunk index
+ *   ...            compressed chunks
+ *   uint64[2]      chunk index: offset and compressed size of each
+ *                  chunk (size 0 means the chunk is empty)
+ */
+class I3CLSimSparsePhotonTable : private boost::noncopyable
+{
+public:
+    struct HeaderEntry
+    {
+        HeaderEntry() : value(0.), isInteger(false) {}
+        HeaderEntry(double value_, bool isInteger_) : value(value_), isInteger(isInteger_) {}
+
+        double value;
+        bool isInteger;
+    };
+    typedef std::map<std::string, HeaderEntry> Header_t;
+
+    static const uint32_t formatVersion;
+    static const uint64_t defaultChunkSize;
+
+    explicit I3CLSimSparsePhotonTable(const std::string &filename);
+    ~I3CLSimSparsePhotonTable();
+
+    const std::vector<std::vector<double> > &GetBinEdges() const {return binEdges_;}
+    const std::vector<uint64_t> &GetShape() const {return shape_;}
+    uint64_t GetNumBins() const {return numBins_;}
+    const Header_t &GetHeader() const {return header_;}
+
+    uint64_t GetChunkSize() const {return chunkSize_;}
+    uint64_t GetNumChunks() const {return chunkIndex_.size();}
+    uint64_t GetNumBinsInChunk(uint64_t chunk) const;
+    bool IsChunkEmpty(uint64_t chunk) const;
+
+    /**
+     * Decompresses a chunk. "values" and "weights" are
+     * resized to GetNumBinsInChunk(chunk).
+     */
+    void ReadChunk(uint64_t chunk,
+                   std::vector<float> &values,
+                   std::vector<float> &weights) const;
+
+    /**
+     * Adds a chunk to the arrays "values" and "weights", which
+     * need to hold at least GetNumBinsInChunk(chunk) entries.
+     * Empty chunks are skipped without being touched.
+     */
+    void AddChunk(uint64_t chunk,
+                  float *values,
+                  float *weights) const;
+
+    /**
+     * Sums up a list of tables with identical binning and writes
+     * the result to outputFile. The tables are added one chunk at
+     * a time, so none of them has to fit into memory. Header entries
+     * have to agree, except for "n_photons", which is summed up.
+     */
+    static void Merge(const std::vector<std::string> &inputFiles,
+                      const std::string &outputFile);
+
+private:
+    struct ChunkIndexEntry
+    {
+        uint64_t offset;
+        uint64_t compressedSize;
+    };
+
+    void Read(void *buffer, std::size_t size, std::size_t &position) const;
+
+    std::string filename_;
+    boost::iostreams::mapped_file_source file_;
+
+    std::vector<std::vector<double> > binEdges_;
+    std::vector<uint64_t> shape_;
+    uint64_t numBins_;
+    Header_t header_;
+    uint64_t chunkSize_;
+    std::vector<ChunkIndexEntry> chunkIndex_;
+
+    SET_LOGGER("I3CLSimSparsePhotonTable");
+};
+
+/**
+ * @brief Writes a photon table in the format read by
+ * I3CLSimSparsePhotonTable, one chunk at a time.
+ */
+class I3CLSimSparsePhotonTableWriter : private boost::noncopyable
+{
+public:
+    I3CLSimSparsePhotonTableWriter(const std::string &filename,
+                                   const std::vector<std::vector<double> > &binEdges,
+                                   const I3CLSimSparsePhotonTable::Header_t &header,
+                                   uint64_t chunkSize=I3CLSimSparsePhotonTable::defaultChunkSize);
+    ~I3CLSimSparsePhotonTableWriter();
+
+    /**
+     * Chunks have to be appended in order. Each of them has
+     * to hold chunkSize bins, except for the last one.
+     */
+    void AppendChunk(const float *values,
+                     const float *weights,
+                     uint64_t numBins);
+
+    /**
+     * Writes the chunk index. Fails if not all chunks have
+     * been appended. Called by the destructor if necessary,
+     * which only logs errors instead of throwing.
+     */
+    void Close();
+
+    uint64_t GetNumChunks() const {return numChunks_;}
+    uint64_t GetChunkSize() const {return chunkSize_;}
+
+private:
+    template <typename T>
+    void Write(const T &value) {file_.write(reinterpret_cast<const char *>(&value), sizeof(T));}
+
+    // writes the index of a complete table and closes the file.
+    // Returns false on write errors, does not throw.
+    bool WriteIndexAndClose();
+
+    std::string filename_;
+    std::ofstream file_;
+    bool closed_;
+
+    uint64_t numBins_;
+    uint64_t chunkSize_;
+    uint64_t numChunks_;
+    std::streampos indexOffsetPosition_;
+    std::vector<uint64_t> chunkIndex_;
+    std::vector<char> compressionBuffer_;
+
+    SET_LOGGER("I3CLSimSparsePhotonTableWriter");
+};
+
+#endif //I3CLSIMSPARSEPHOTONTABLE_H_INCLUDED
@@ -158,6 +158,54 @@ class PhotoTable(Table, object):
             
         return cls(binedges, values, weights, header)
     
+    def save_sparse(self, fname, overwrite=False, chunk_size=65536):
+        """
+        Write the table as a series of zlib-compressed chunks, leaving
+        out chunks that are entirely empty. Tables in this format can be
+        memory-mapped by I3CLSimSparsePhotonTable and summed up without
+        loading them with MergeSparsePhotonTables.
+        """
+        import os
+        from icecube.clsim import I3CLSimSparsePhotonTableWriter
+        
+        if os.path.exists(fname):
+            if overwrite:
+                os.unlink(fname)
+            else:
+                raise IOError("File '%s' exists!" % fname)
+        
+        values = numpy.ascontiguousarray(self.values, dtype=numpy.float32).ravel()
+        if self.weights is None:
+            weights = numpy.zeros(values.shape, dtype=numpy.float32)
+        else:
+            weights = numpy.ascontiguousarray(self.weights, dtype=numpy.float32).ravel()
+        
+        writer = I3CLSimSparsePhotonTableWriter(fname, [numpy.asarray(edges, dtype=numpy.float64) for edges in self.bin_edges], dict(self.header), chunk_size)
+        for start in range(0, values.size, chunk_size):
+            writer.AppendChunk(values[start:start+chunk_size], weights[start:start+chunk_size])
+        writer.Close()
+    
+    @classmethod
+    def load_sparse(cls, fname):
+        from icecube.clsim import I3CLSimSparsePhotonTable
+        
+        table = I3CLSimSparsePhotonTable(fname)
+        binedges = [numpy.asarray(edges) for edges in table.GetBinEdges()]
+        values = numpy.zeros(table.GetNumBins(), dtype=numpy.float32)
+        weights = numpy.zeros(table.GetNumBins(), dtype=numpy.float32)
+        
+        chunk_size = table.GetChunkSize()
+        for i in range(table.GetNumChunks()):
+            if table.IsChunkEmpty(i):
+                continue
+            chunk_values, chunk_weights = table.ReadChunk(i)
+            start = i*chunk_size
+            values[start:start+len(chunk_values)] = chunk_values
+            weights[start:start+len(chunk_weights)] = chunk_weights
+        
+        shape = table.GetShape()
+        return cls(binedges, values.reshape(shape), weights.reshape(shape), table.GetHeader())
+    
 class Tabulator(object):
     _dtype = numpy.float32
     
@@ -177,6 +225,10 @@ class Tabulator(object):
     def SetRandomService(self, rng):
         self.rng = rng
     
+    def SetNumThreads(self, numThreads):
+        # the pure-Python tabulator always runs in a single thread
+        pass
+    
     def GetValues(self):
         return self.values, self.weights
         
@@ -326,6 +378,11 @@ class Tabulator(object):
                 self.weights[indices] += weight*weight
             
             t += distance/photon.groupVelocity
+    
+    def RecordPhotons(self, source, photonmap):
+        for photons in photonmap.values():
+            for photon in photons:
+                self.RecordPhoton(source, photon)
 
 # tabulator = Tabulator
 tabulator = I3CLSimTabulator
@@ -342,6 +399,10 @@ class I3TabulatorModule(I3Module, tabulator):
         self.AddParameter("RandomService", "A random number service", None)
         self.AddParameter("StepLength", "The mean step size for volume sampling", 1*I3Units.m)
         self.AddParameter("TableHeader", "A dictionary of source depth, orientation, etc", empty_header)
+        self.AddParameter("NumThreads", "Number of threads to record photons with (0: one per core).\n"
+                                        "Each thread keeps a private copy of the table (about 600 MB\n"
+                                        "for the default binning)", 1)
+        self.AddParameter("SparseOutput", "Write the table in the chunked sparse format instead of FITS", False)
         
         nbins=(200, 36, 100, 105)
         self.binedges = [
@@ -363,6 +424,7 @@ class I3TabulatorModule(I3Module, tabulator):
         self.rng = self.GetParameter("RandomService")
         self.stepLength = self.GetParameter("StepLength")
         self.header = self.GetParameter("TableHeader")
+        self.sparseOutput = self.GetParameter("SparseOutput")
         
         self.n_photons = 0
         
@@ -375,14 +437,13 @@ class I3TabulatorModule(I3Module, tabulator):
         # XXX magic scaling factor used in CLSim weighted-photon generation
         self.SetEfficiencies(GetIceCubeDOMAcceptance(efficiency=0.75*1.35 * 1.01), GetIceCubeDOMAngularSensitivity(), self.domRadius)
         self.SetRandomService(self.rng)
+        self.SetNumThreads(self.GetParameter("NumThreads"))
         
     def DAQ(self, frame):
         source = frame[self.source]
         photonmap = frame[self.photons]
         
-        for photons in photonmap.values():
-            for photon in photons:
-                self.RecordPhoton(source, photon)
+        self.RecordPhotons(source, photonmap)
         
         # Each I3Photon can only carry a fixed number of intermediate
         # steps, so there may be more than one I3Photon for each generated
@@ -401,7 +462,163 @@ class I3TabulatorModule(I3Module, tabulator):
         values, weights = self.GetValues()
         self.header['n_photons'] = self.n_photons
         table = PhotoTable(self.binedges, values, weights, self.header)
-        table.save(self.fname)
+        if self.sparseOutput:
+            table.save_sparse(self.fname)
+        else:
+            table.save(self.fname)
+
+class I3DeviceTabulatorModule(I3Module):
+    """
+    Fill a photon table directly on an OpenCL device. Instead of
+    recording every photon path in the frame and binning it in Python,
+    the propagation kernel samples the photon tracks and adds their
+    weights to a table in device memory. The table is only
+    downloaded once, in Finish().
+    
+    NB: only cascade-like (point) sources are supported, and every
+    frame must contain the same source.
+    """
+    def __init__(self, ctx):
+        I3Module.__init__(self, ctx)
+        
+        self.AddParameter("Filename", "Output filename", "foo.fits")
+        self.AddParameter("Source", "Name of the source I3Particle in the frame", "Source")
+        self.AddParameter("RandomService", "A random number service", None)
+        self.AddParameter("MediumProperties", "An I3CLSimMediumProperties object describing the ice", None)
+        self.AddParameter("OpenCLDevice", "The I3CLSimOpenCLDevice to run on (default: the first one found)", None)
+        self.AddParameter("StepLength", "The mean step size for volume sampling", 1*I3Units.m)
+        self.AddParameter("FixedNumberOfAbsorptionLengths", "Stop photons after this many absorption lengths", 46.)
+        self.AddParameter("SparseOutput", "Write the table in the chunked sparse format instead of FITS", False)
+        self.AddParameter("TableHeader", "A dictionary of source depth, orientation, etc", empty_header)
+        
+        nbins=(200, 36, 100, 105)
+        binedges = [
+            numpy.linspace(0, numpy.sqrt(580), nbins[0]+1)**2,
+            numpy.linspace(0, 180, nbins[1]+1),
+            numpy.linspace(-1, 1, nbins[2]+1),
+            numpy.linspace(0, numpy.sqrt(7e3), nbins[3]+1)**2,
+        ]
+        self.AddParameter("BinEdges", "A list of the bin edges in each dimension", binedges)
+        
+        self.AddOutBox("OutBox")
+        
+    def Configure(self):
+        from icecube import clsim
+        
+        self.fname = self.GetParameter("Filename")
+        self.source = self.GetParameter("Source")
+        self.rng = self.GetParameter("RandomService")
+        self.mediumProperties = self.GetParameter("MediumProperties")
+        self.openCLDevice = self.GetParameter("OpenCLDevice")
+        self.stepLength = self.GetParameter("StepLength")
+        self.fixedNumberOfAbsorptionLengths = self.GetParameter("FixedNumberOfAbsorptionLengths")
+        self.header = self.GetParameter("TableHeader")
+        self.sparseOutput = self.GetParameter("SparseOutput")
+        self.binedges = self.GetParameter("BinEdges")
+        
+        self.domRadius = 0.16510*I3Units.m
+        
+        if self.rng is None:
+            raise ValueError("You have to specify a RandomService!")
+        if self.mediumProperties is None:
+            self.mediumProperties = clsim.MakeIceCubeMediumProperties()
+        if self.openCLDevice is None:
+            devices = [device for device in clsim.I3CLSimOpenCLDevice.GetAllDevices()]
+            if len(devices) == 0:
+                raise RuntimeError("No OpenCL devices available!")
+            self.openCLDevice = devices[0]
+        
+        # XXX magic scaling factor used in CLSim weighted-photon generation
+        self.wavelengthAcceptance = GetIceCubeDOMAcceptance(efficiency=0.75*1.35 * 1.01)
+        
+        self.stepConverter = None
+        self.photonConverter = None
+        self.tabulationSource = None
+        self.numBunches = 0
+        
+    def _initialize(self, source):
+        from icecube import clsim
+        
+        wavelengthGenerator = clsim.makeCherenkovWavelengthGenerator(self.wavelengthAcceptance, False, self.mediumProperties)
+        
+        self.photonConverter = clsim.I3CLSimStepToPhotonConverterOpenCL(RandomService=self.rng, UseNativeMath=self.openCLDevice.useNativeMath)
+        self.photonConverter.SetDevice(self.openCLDevice)
+        self.photonConverter.SetWlenGenerators([wavelengthGenerator])
+        self.photonConverter.SetWlenBias(self.wavelengthAcceptance)
+        self.photonConverter.SetMediumProperties(self.mediumProperties)
+        self.photonConverter.SetFixedNumberOfAbsorptionLengths(self.fixedNumberOfAbsorptionLengths)
+        self.photonConverter.SetTabulationBins(self.binedges, self.stepLength)
+        self.photonConverter.SetTabulationSource(source)
+        self.photonConverter.SetTabulationEfficiencies(self.wavelengthAcceptance, GetIceCubeDOMAngularSensitivity(), self.domRadius)
+        self.photonConverter.Initialize()
+        
+        # the step bunches have to fit the work-item layout of the device
+        clsim.AutoSetGeant4Environment()
+        self.stepConverter = clsim.I3CLSimLightSourceToStepConverterGeant4()
+        self.stepConverter.SetMediumProperties(self.mediumProperties)
+        self.stepConverter.SetRandomService(self.rng)
+        self.stepConverter.SetWlenBias(self.wavelengthAcceptance)
+        self.stepConverter.SetMaxBunchSize(self.photonConverter.GetMaxNumWorkitems())
+        self.stepConverter.SetBunchSizeGranularity(self.photonConverter.GetWorkgroupSize())
+        self.stepConverter.Initialize()
+        
+        self.tabulationSource = source
+        
+    @staticmethod
+    def _sourceKey(source):
+        return (source.pos.x, source.pos.y, source.pos.z, source.dir.zenith, source.dir.azimuth, source.time)
+        
+    def DAQ(self, frame):
+        from icecube import clsim
+        
+        source = frame[self.source]
+        if self.photonConverter is None:
+            self._initialize(source)
+        elif self._sourceKey(source) != self._sourceKey(self.tabulationSource):
+            raise ValueError("The source has to be the same in every frame when tabulating on the device")
+        
+        self.stepConverter.EnqueueLightSource(clsim.I3CLSimLightSource(source), 0)
+        self.stepConverter.EnqueueBarrier()
+        
+        numBunches = 0
+        while True:
+            steps = self.stepConverter.GetConversionResult()
+            barrierReset = not self.stepConverter.BarrierActive()
+            
+            if len(steps) > 0:
+                self.photonConverter.EnqueueSteps(steps, numBunches)
+                numBunches += 1
+            
+            if barrierReset:
+                break
+        
+        # wait for all bunches to be propagated. The photons themselves
+        # are not interesting, their contribution is already in the table.
+        for i in range(numBunches):
+            self.photonConverter.GetConversionResult()
+        
+        self.PushFrame(frame)
+        
+    def Finish(self):
+        if self.photonConverter is None:
+            return
+        
+        shape = tuple([len(v)-1 for v in self.binedges])
+        values = numpy.asarray(self.photonConverter.GetTabulatedValues(), dtype=numpy.float32).reshape(shape)
+        weights = numpy.asarray(self.photonConverter.GetTabulatedWeights(), dtype=numpy.float32).reshape(shape)
+        
+        # The kernel already includes the DOM area in the photon
+        # weights, so only the sampling density is left to divide out.
+        fluxconst = Tabulator.GetBinVolumes(self.binedges)/self.stepLength
+        values /= fluxconst
+        weights /= fluxconst*fluxconst
+        
+        self.header['n_photons'] = self.photonConverter.GetTabulatedSumOfPhotonWeights()
+        table = PhotoTable(self.binedges, values, weights, self.header)
+        if self.sparseOutput:
+            table.save_sparse(self.fname)
+        else:
+            table.save(self.fname)
 
 def generate_seed():
     import struct
@@ -620,3 +837,59 @@ def PhotonGenerator(tray, name, PhotonSource="CASCADE", Zenith=90.*I3Units.degre
         
     return randomService, header
 
+
+@traysegment
+def DeviceTabulator(tray, name, Filename, Zenith=90.*I3Units.degree, ZCoordinate=0.*I3Units.m,
+    Energy=1.*I3Units.GeV, Seed=12345, NEvents=100, StepLength=1.*I3Units.m,
+    SparseOutput=False, IceModel='spice_mie', DisableTilt=False):
+    """
+    Make a cascade table with I3DeviceTabulatorModule. This replaces
+    PhotonGenerator+I3TabulatorModule and is much faster, since the
+    photon paths never leave the OpenCL device.
+    
+    :param Filename: the output file
+    :param Zenith: the orientation of the source
+    :param ZCoordinate: the depth of the source
+    :param Energy: the energy of the source
+    :param Seed: the seed for the random number service
+    :param NEvents: the number of events to simulate
+    :param StepLength: the mean step size for volume sampling
+    :param SparseOutput: write the table in the chunked sparse format instead of FITS
+    :param IceModel: the path to an ice model in $I3_SRC/clsim/resources/ice
+    :param DisableTilt: if true, disable tilt in ice model
+    """
+    from icecube import icetray, phys_services
+    from icecube.clsim.traysegments.common import parseIceModel
+    from os.path import expandvars
+    
+    randomService = phys_services.I3SPRNGRandomService(
+        seed = Seed,
+        nstreams = 10000,
+        streamnum = 0)
+    
+    iceModelLocation = expandvars("$I3_SRC/clsim/resources/ice/" + IceModel)
+    mediumProperties = parseIceModel(iceModelLocation, disableTilt=DisableTilt)
+    
+    tray.AddModule("I3InfiniteSource",name+"streams",
+                   Stream=icetray.I3Frame.DAQ)
+    
+    ptype = I3Particle.ParticleType.EMinus
+    
+    tray.AddModule(MakeParticle, name+"MakeParticle", PhotonSource="CASCADE", Zenith=Zenith, ZCoordinate=ZCoordinate, 
+        ParticleType=ptype, Energy=Energy, NEvents=NEvents)
+    
+    n_group, n_phase = get_minimum_refractive_index(iceModelLocation)
+    
+    header = dict(empty_header)
+    header['zenith'] = Zenith/I3Units.degree
+    header['z'] = ZCoordinate
+    header['energy'] = Energy
+    header['type'] = int(ptype)
+    header['n_group'] = n_group
+    header['n_phase'] = n_phase
+    header['efficiency'] = Efficiency.RECEIVER | Efficiency.WAVELENGTH
+    
+    tray.AddModule(I3DeviceTabulatorModule, name+"tabulator",
+        Filename=Filename, Source="Source", RandomService=randomService,
+        MediumProperties=mediumProperties, StepLength=StepLength,
+        TableHeader=header, SparseOutput=SparseOutput)
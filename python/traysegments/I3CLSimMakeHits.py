@@ -66,6 +66,7 @@ def I3CLSimMakeHits(tray, name,
                     DOMOversizeFactor=5.,
                     UnshadowedFraction=0.9,
                     UseHoleIceParameterization=True,
+                    ConvertHitsOnDevice=False,
                     ExtraArgumentsToI3CLSimModule=dict(),
                     If=lambda f: True
                     ):
@@ -181,6 +182,12 @@ def I3CLSimMakeHits(tray, name,
         Fraction of photocathode available to receive light (e.g. unshadowed by the cable)
     :param UseHoleIceParameterization:
         Use an angular acceptance correction for hole ice scattering.
+    :param ConvertHitsOnDevice:
+        Convert photons to I3MCPEs in the OpenCL kernel instead of running
+        I3PhotonToMCPEConverter on the host. Only the hits are transferred from
+        the devices, so this cannot be used together with ``PhotonSeriesName``
+        and needs ``StopDetectedPhotons``. The relative DOM efficiencies are
+        taken from the Calibration frame.
     :param If:
         Python function to use as conditional execution test for segment modules.        
     """
@@ -199,6 +206,19 @@ def I3CLSimMakeHits(tray, name,
         print("If this is what you want, you can safely ignore this warning.")
         print("********************")
 
+    if ConvertHitsOnDevice:
+        if MCPESeriesName is None:
+            raise RuntimeError("\"ConvertHitsOnDevice\" needs \"MCPESeriesName\"!")
+        if PhotonSeriesName is not None:
+            raise RuntimeError("\"ConvertHitsOnDevice\" cannot be used together with \"PhotonSeriesName\", there are no photons to store.")
+
+        # same acceptances as I3CLSimMakeHitsFromPhotons()
+        DOMRadius = 0.16510*icetray.I3Units.m # 13" diameter
+        ExtraArgumentsToI3CLSimModule = dict(ExtraArgumentsToI3CLSimModule)
+        ExtraArgumentsToI3CLSimModule["MCPESeriesMapName"] = MCPESeriesName
+        ExtraArgumentsToI3CLSimModule["WavelengthAcceptance"] = clsim.GetIceCubeDOMAcceptance(domRadius = DOMRadius*DOMOversizeFactor, efficiency=UnshadowedFraction)
+        ExtraArgumentsToI3CLSimModule["AngularAcceptance"] = clsim.GetIceCubeDOMAngularSensitivity(holeIce=UseHoleIceParameterization)
+
     if PhotonSeriesName is not None:
         photonsName=PhotonSeriesName
     else:
@@ -258,7 +278,11 @@ def I3CLSimMakeHits(tray, name,
         I3CLSimMakePhotons(tray, name + "_makePhotons",
                            **I3CLSimMakePhotons_kwargs)
 
-    if MCPESeriesName is not None:
+    if (MCPESeriesName is not None) and (not ConvertHitsOnDevice):
+        # photon splitting and step pre-culling produce photons with weights > 1
+        allowPhotonWeightsAboveOne = (ExtraArgumentsToI3CLSimModule.get("PhotonSplittingFactor", 1) > 1) or \
+                                     (ExtraArgumentsToI3CLSimModule.get("StepPreCullingProbability", 0.) > 0.)
+
         I3CLSimMakeHitsFromPhotons_kwargs = dict(MCTreeName=clSimMCTreeName,
                                                  PhotonSeriesName=photonsName,
                                                  MCPESeriesName=MCPESeriesName,
@@ -266,6 +290,7 @@ def I3CLSimMakeHits(tray, name,
                                                  DOMOversizeFactor=DOMOversizeFactor,
                                                  UnshadowedFraction=UnshadowedFraction,
                                                  UseHoleIceParameterization=UseHoleIceParameterization,
+                                                 AllowPhotonWeightsAboveOne=allowPhotonWeightsAboveOne,
                                                  If=If)
         
         if hasattr(icetray, "traysegment"):
@@ -278,7 +303,7 @@ def I3CLSimMakeHits(tray, name,
                             **I3CLSimMakeHitsFromPhotons_kwargs
                             )
             
-    if PhotonSeriesName is None:
+    if (PhotonSeriesName is None) and (not ConvertHitsOnDevice):
         tray.AddModule("Delete", name + "_deletePhotons",
             Keys = [photonsName],
             If=If)
@@ -42,6 +42,7 @@ def I3CLSimMakeHitsFromPhotons(tray, name,
                                DOMOversizeFactor=5.,
                                UnshadowedFraction=0.9,
                                UseHoleIceParameterization=True,
+                               AllowPhotonWeightsAboveOne=False,
                                If=lambda f: True
                                ):
     """
@@ -52,7 +53,8 @@ def I3CLSimMakeHitsFromPhotons(tray, name,
     :param MCTreeName:
         The name of the I3MCTree containing the particles to propagate.
     :param PhotonSeriesName:
-        Name of the input I3PhotonSeriesMap to be converted.
+        Name of the input I3PhotonSeriesMap (or I3ColumnarPhotonSeriesMap)
+        to be converted.
     :param MCPESeriesName:
         Name of the output I3MCPESeriesMap written by the module.
         Set this to None to prevent generating MCPEs from
@@ -68,6 +70,10 @@ def I3CLSimMakeHitsFromPhotons(tray, name,
         Fraction of photocathode available to receive light (e.g. unshadowed by the cable)
     :param UseHoleIceParameterization:
         Use an angular acceptance correction for hole ice scattering.
+    :param AllowPhotonWeightsAboveOne:
+        Convert photons with hit probabilities above one into hits with
+        more than one photo-electron instead of failing. Set this if the
+        photons were generated with photon splitting or step pre-culling.
     :param If:
         Python function to use as conditional execution test for segment modules.        
     """
@@ -93,5 +99,6 @@ def I3CLSimMakeHitsFromPhotons(tray, name,
                    WavelengthAcceptance = domAcceptance,
                    AngularAcceptance = domAngularSensitivity,
                    IgnoreDOMsWithoutDetectorStatusEntry = False, # in icesim4 it is the job of the DOM simulation tools to cut out these DOMs
+                   AllowPhotonWeightsAboveOne = AllowPhotonWeightsAboveOne,
                    If=If)
 
@@ -61,6 +61,8 @@ def I3CLSimMakePhotons(tray, name,
                        UseGeant4=False,
                        StopDetectedPhotons=True,
                        PhotonHistoryEntries=0,
+                       ColumnarPhotonSeries=False,
+                       QuantizePhotons=False,
                        DoNotParallelize=False,
                        DOMOversizeFactor=5.,
                        UnshadowedFraction=0.9,
@@ -165,6 +167,16 @@ def I3CLSimMakePhotons(tray, name,
         The maximum number of scatterings points to be saved for every photon hitting a DOM.
         Only the most recent positions are saved, older positions are overwritten if
         the maximum size is reached.
+    :param ColumnarPhotonSeries:
+        Store the photons as an I3ColumnarPhotonSeriesMap instead of an
+        I3PhotonSeriesMap. This keeps only the information needed to make
+        hits (I3CLSimMakeHitsFromPhotons can read both) and is much
+        smaller and faster to read and write. Photon histories are not stored.
+    :param QuantizePhotons:
+        Only used if *ColumnarPhotonSeries* is active. Delta-encode the
+        photon times and store directions and positions (with a resolution
+        of 0.1mm) as 16-bit fixed-point numbers. This is lossy, but the
+        errors are far below the timing and position resolution of a DOM.
     :param UseGeant4:
         Enabling this setting will disable all cascade and muon light yield
         parameterizations. All particles will sent to Geant4 for a full
@@ -333,13 +345,19 @@ def I3CLSimMakePhotons(tray, name,
         # no spectrum table is necessary when only using the Cherenkov spectrum
         spectrumTable = None
 
-    openCLDevices = configureOpenCLDevices(
-        UseGPUs=UseGPUs,
-        UseCPUs=UseCPUs,
-        OverrideApproximateNumberOfWorkItems=OverrideApproximateNumberOfWorkItems,
-        DoNotParallelize=DoNotParallelize,
-        UseOnlyDeviceNumber=UseOnlyDeviceNumber
-	)
+    ExtraArgumentsToI3CLSimModule = dict(ExtraArgumentsToI3CLSimModule)
+    if hasattr(clsim, "I3CLSimOpenCLDevice"):
+        ExtraArgumentsToI3CLSimModule["OpenCLDeviceList"] = configureOpenCLDevices(
+            UseGPUs=UseGPUs,
+            UseCPUs=UseCPUs,
+            OverrideApproximateNumberOfWorkItems=OverrideApproximateNumberOfWorkItems,
+            DoNotParallelize=DoNotParallelize,
+            UseOnlyDeviceNumber=UseOnlyDeviceNumber
+            )
+    elif ("RemoteWorkers" not in ExtraArgumentsToI3CLSimModule) and ("UseNativePropagator" not in ExtraArgumentsToI3CLSimModule):
+        # clsim has been built without OpenCL support
+        print("clsim has been built without OpenCL support, using the native propagator")
+        ExtraArgumentsToI3CLSimModule["UseNativePropagator"] = True
 
     tray.AddModule("I3CLSimModule", name + "_clsim",
                    MCTreeName=clSimMCTreeName,
@@ -359,7 +377,6 @@ def I3CLSimMakePhotons(tray, name,
                    WavelengthGenerationBias=wavelengthGenerationBias,
                    ParameterizationList=particleParameterizations,
                    MaxNumParallelEvents=ParallelEvents,
-                   OpenCLDeviceList=openCLDevices,
                    #UseHardcodedDeepCoreSubdetector=False, # setting this to true saves GPU constant memory but will reduce performance
                    StopDetectedPhotons=StopDetectedPhotons,
                    PhotonHistoryEntries=PhotonHistoryEntries,
@@ -367,3 +384,26 @@ def I3CLSimMakePhotons(tray, name,
                    **ExtraArgumentsToI3CLSimModule
                    )
 
+    if ColumnarPhotonSeries and (PhotonSeriesName is not None):
+        if PhotonHistoryEntries > 0:
+            raise RuntimeError("Photon histories cannot be stored in an I3ColumnarPhotonSeriesMap. Set PhotonHistoryEntries=0 or disable ColumnarPhotonSeries.")
+
+        def makeColumnarPhotonSeries(frame, photonSeriesName, quantize, If=None):
+            if If is not None:
+                if not If(frame): return
+            if photonSeriesName not in frame: return
+            photons = frame[photonSeriesName]
+            del frame[photonSeriesName]
+            if quantize:
+                frame[photonSeriesName] = clsim.I3ColumnarPhotonSeriesMap(photons,
+                    DeltaEncodeTimes=True,
+                    QuantizeDirections=True,
+                    PositionResolution=0.1*icetray.I3Units.mm)
+            else:
+                frame[photonSeriesName] = clsim.I3ColumnarPhotonSeriesMap(photons)
+        tray.AddModule(makeColumnarPhotonSeries, name + "_columnarPhotons",
+                       photonSeriesName=PhotonSeriesName,
+                       quantize=QuantizePhotons,
+                       Streams=[icetray.I3Frame.DAQ],
+                       If=If)
+
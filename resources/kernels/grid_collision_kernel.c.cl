@@ -0,0 +1,355 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file grid_collision_kernel.c.cl
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+// Collision detection using a uniform 3D grid of cubic cells.
+// The grid (see I3CLSimHelper::GenerateDOMGridGeometrySource())
+// lists each DOM in every cell its sphere overlaps with. The cells
+// along the photon's path are visited in order (3D-DDA) and an
+// intersection with a DOM is only accepted in the cell that
+// contains the point where the photon enters the DOM. This way
+// each DOM is counted only once and, with STOP_PHOTONS_ON_DETECTION,
+// the search can end in the first cell that has a hit.
+// The grid dimensions are kernel arguments, so the compiled
+// program does not depend on the geometry.
+//
+// Steps can refer to a DOM mask (step->dummy2, 0 means no mask).
+// Masked DOMs are invisible: they do not record hits and photons
+// pass through them.
+
+#ifndef GEO_GRID_NO_CROSSING
+#define GEO_GRID_NO_CROSSING 1e30f
+#endif
+
+// narrows [*tEnter;*tExit] to the part of the ray between low and high on one axis
+inline void geoGridClipToSlab(floating_t pos, floating_t dir,
+                              floating_t low, floating_t high,
+                              floating_t *tEnter, floating_t *tExit)
+{
+    if (dir == ZERO) {
+        // parallel to the slab
+        if ((pos < low) || (pos > high)) *tExit = -ONE;
+        return;
+    }
+
+    const floating_t recip_dir = ONE/dir;
+    floating_t t0 = (low-pos)*recip_dir;
+    floating_t t1 = (high-pos)*recip_dir;
+    if (t0 > t1) {const floating_t tmp=t0; t0=t1; t1=tmp;}
+
+    *tEnter = max(*tEnter, t0);
+    *tExit = min(*tExit, t1);
+}
+
+// sets up the traversal on one axis starting in "cell" at the ray parameter tEnter
+inline int geoGridSetupAxis(floating_t pos, floating_t dir,
+                            floating_t start, floating_t cellWidth, int numCells, floating_t tEnter,
+                            int *cellStep, floating_t *tNext, floating_t *tDelta)
+{
+    const int cell = min(max(convert_int(floor((pos+dir*tEnter-start)/cellWidth)), 0), numCells-1);
+
+    if (dir > ZERO) {
+        *cellStep = 1;
+        *tNext = (start+convert_floating_t(cell+1)*cellWidth-pos)/dir;
+        *tDelta = cellWidth/dir;
+    } else if (dir < ZERO) {
+        *cellStep = -1;
+        *tNext = (start+convert_floating_t(cell)*cellWidth-pos)/dir;
+        *tDelta = -cellWidth/dir;
+    } else {
+        *cellStep = 0;
+        *tNext = (floating_t)GEO_GRID_NO_CROSSING;
+        *tDelta = ZERO;
+    }
+
+    return cell;
+}
+
+inline bool checkForCollision(const floating4_t photonPosAndTime,
+    const floating4_t photonDirAndWlen,
+    floating_t inv_groupvel,
+    floating_t photonTotalPathLength,
+    uint photonNumScatters,
+    floating_t distanceTraveledInAbsorptionLengths,
+    const floating4_t photonStartPosAndTime,
+    const floating4_t photonStartDirAndWlen,
+    const struct I3CLSimStep *step,
+#ifdef STOP_PHOTONS_ON_DETECTION
+    floating_t *thisStepLength,
+#else
+    floating_t thisStepLength,
+#endif
+    __global uint* hitIndex,
+    uint maxHitIndex,
+    __write_only __global struct I3CLSimPhoton *outputPhotons,
+#ifdef SAVE_PHOTON_HISTORY
+    __write_only __global float4 *photonHistory,
+    float4 *currentPhotonHistory,
+#endif
+#ifdef HIT_CONVERSION
+    __read_only __global const uint *hitDomEfficiencyOffsets,
+    __read_only __global const float *hitDomEfficiencies,
+    RNG_ARGS,
+#endif
+    __read_only __global const uint *geoGridCellStart,
+    __read_only __global const uint *geoGridCellDoms,
+    __read_only __global const float4 *geoGridDomPos,
+    __read_only __global const uint *geoGridDomIndex,
+    const float4 geoGridStartAndCellWidth,
+    const uint4 geoGridNumCells,
+    const float geoGridOMRadius,
+    __read_only __global const uint *domMask
+    )
+{
+#ifdef DEBUG_STORE_GENERATED_PHOTONS
+    saveHit(photonPosAndTime,
+            photonDirAndWlen,
+            ZERO,
+            inv_groupvel,
+            photonTotalPathLength,
+            photonNumScatters,
+            distanceTraveledInAbsorptionLengths,
+            photonStartPosAndTime,
+            photonStartDirAndWlen,
+            step,
+            0,
+            0,
+#ifdef COMPACT_PHOTON_OUTPUT
+            (floating4_t)(convert_floating_t(geoGridDomPos[0].x), convert_floating_t(geoGridDomPos[0].y), convert_floating_t(geoGridDomPos[0].z), ZERO),
+#endif
+            hitIndex,
+            maxHitIndex,
+            outputPhotons
+#ifdef SAVE_PHOTON_HISTORY
+          , photonHistory,
+            currentPhotonHistory
+#endif
+            );
+    return true;
+#else // DEBUG_STORE_GENERATED_PHOTONS
+
+    const floating_t gridStartX = convert_floating_t(geoGridStartAndCellWidth.x);
+    const floating_t gridStartY = convert_floating_t(geoGridStartAndCellWidth.y);
+    const floating_t gridStartZ = convert_floating_t(geoGridStartAndCellWidth.z);
+    const floating_t cellWidth = convert_floating_t(geoGridStartAndCellWidth.w);
+    const int gridNumX = convert_int(geoGridNumCells.x);
+    const int gridNumY = convert_int(geoGridNumCells.y);
+    const int gridNumZ = convert_int(geoGridNumCells.z);
+    const floating_t omRadius = convert_floating_t(geoGridOMRadius);
+
+    // one bit per DOM for each mask
+    const uint domMaskIndex = convert_uint(step->dummy2);
+    __global const uint *thisDomMask = domMask + domMaskIndex*((geoGridNumCells.w+31u)/32u);
+
+    // the part of the step inside the grid
+    floating_t tEnter = ZERO;
+#ifdef STOP_PHOTONS_ON_DETECTION
+    floating_t tExit = *thisStepLength;
+#else
+    floating_t tExit = thisStepLength;
+#endif
+
+    geoGridClipToSlab(photonPosAndTime.x, photonDirAndWlen.x,
+                      gridStartX, gridStartX+convert_floating_t(gridNumX)*cellWidth,
+                      &tEnter, &tExit);
+    geoGridClipToSlab(photonPosAndTime.y, photonDirAndWlen.y,
+                      gridStartY, gridStartY+convert_floating_t(gridNumY)*cellWidth,
+                      &tEnter, &tExit);
+    geoGridClipToSlab(photonPosAndTime.z, photonDirAndWlen.z,
+                      gridStartZ, gridStartZ+convert_floating_t(gridNumZ)*cellWidth,
+                      &tEnter, &tExit);
+
+    if (tEnter > tExit) return false; // the step does not touch the grid
+
+    int stepX, stepY, stepZ;
+    floating_t tNextX, tNextY, tNextZ;
+    floating_t tDeltaX, tDeltaY, tDeltaZ;
+    int cellX = geoGridSetupAxis(photonPosAndTime.x, photonDirAndWlen.x, gridStartX, cellWidth, gridNumX, tEnter, &stepX, &tNextX, &tDeltaX);
+    int cellY = geoGridSetupAxis(photonPosAndTime.y, photonDirAndWlen.y, gridStartY, cellWidth, gridNumY, tEnter, &stepY, &tNextY, &tDeltaY);
+    int cellZ = geoGridSetupAxis(photonPosAndTime.z, photonDirAndWlen.z, gridStartZ, cellWidth, gridNumZ, tEnter, &stepZ, &tNextZ, &tDeltaZ);
+
+#ifdef STOP_PHOTONS_ON_DETECTION
+    bool hitRecorded=false;
+    unsigned short hitOnString;
+    unsigned short hitOnDom;
+#if defined(COMPACT_PHOTON_OUTPUT) || defined(HIT_CONVERSION)
+    floating4_t hitDomPos;
+#endif
+#endif
+
+    floating_t tCellEnter = tEnter;
+    for (;;)
+    {
+        const floating_t tCellExit = min(min(tNextX, tNextY), min(tNextZ, tExit));
+
+        const uint cellIndex = convert_uint((cellZ*gridNumY + cellY)*gridNumX + cellX);
+        const uint lastEntry = geoGridCellStart[cellIndex+1];
+        for (uint entry=geoGridCellStart[cellIndex];entry<lastEntry;++entry)
+        {
+            const uint domFlatIndex = geoGridCellDoms[entry];
+            if ((domMaskIndex != 0) && (thisDomMask[domFlatIndex/32u] & (1u << (domFlatIndex%32u)))) continue; // masked
+            
+            const float4 domPos = geoGridDomPos[domFlatIndex];
+
+            floating_t urdot, discr;
+            {
+                const floating4_t drvec = (const floating4_t)(convert_floating_t(domPos.x) - photonPosAndTime.x,
+                                                              convert_floating_t(domPos.y) - photonPosAndTime.y,
+                                                              convert_floating_t(domPos.z) - photonPosAndTime.z,
+                                                              ZERO);
+                const floating_t dr2 = dot(drvec,drvec);
+
+                urdot = dot(drvec, photonDirAndWlen); // this assumes drvec.w==0
+                discr   = sqr(urdot) - dr2 + omRadius*omRadius;   // (discr)^2
+            }
+
+            if (discr < ZERO) continue; // no intersection with this DOM
+
+#ifdef PANCAKE_FACTOR
+            discr = my_sqrt(discr)/PANCAKE_FACTOR;
+#else
+            discr = my_sqrt(discr);
+#endif
+
+            // distance from current point along the track to the first intersection
+            // (photons starting inside a DOM are allowed to leave, see sparse_collision_kernel.c.cl)
+            const floating_t smin1 = urdot - discr;
+
+            // only handle the intersection in the cell it is in
+            // (this also rejects smin1 < 0 and smin1 >= thisStepLength)
+            if ((smin1 < tCellEnter) || (smin1 >= tCellExit)) continue;
+
+            const uint domIndex = geoGridDomIndex[domFlatIndex];
+
+#ifdef STOP_PHOTONS_ON_DETECTION
+            if (smin1 < *thisStepLength)
+            {
+                // record a hit (for later, the actual recording is done below)
+                *thisStepLength=smin1; // limit step length
+                hitOnString=convert_ushort(domIndex >> 16);
+                hitOnDom=convert_ushort(domIndex & 0xFFFF);
+#if defined(COMPACT_PHOTON_OUTPUT) || defined(HIT_CONVERSION)
+                hitDomPos=(floating4_t)(convert_floating_t(domPos.x), convert_floating_t(domPos.y), convert_floating_t(domPos.z), ZERO);
+#endif
+                hitRecorded=true;
+                // continue searching, there might be a closer DOM in this cell
+            }
+#else //STOP_PHOTONS_ON_DETECTION
+            // save the hit right here
+            saveHit(photonPosAndTime,
+                    photonDirAndWlen,
+                    smin1, // this is the limited thisStepLength
+                    inv_groupvel,
+                    photonTotalPathLength,
+                    photonNumScatters,
+                    distanceTraveledInAbsorptionLengths,
+                    photonStartPosAndTime,
+                    photonStartDirAndWlen,
+                    step,
+                    convert_ushort(domIndex >> 16),
+                    convert_ushort(domIndex & 0xFFFF),
+#ifdef COMPACT_PHOTON_OUTPUT
+                    (floating4_t)(convert_floating_t(domPos.x), convert_floating_t(domPos.y), convert_floating_t(domPos.z), ZERO),
+#endif
+                    hitIndex,
+                    maxHitIndex,
+                    outputPhotons
+#ifdef SAVE_PHOTON_HISTORY
+                  , photonHistory,
+                    currentPhotonHistory
+#endif //SAVE_PHOTON_HISTORY
+                    );
+#endif //STOP_PHOTONS_ON_DETECTION
+        }
+
+#ifdef STOP_PHOTONS_ON_DETECTION
+        // cells are visited in order, none of the
+        // following ones can have a closer hit
+        if (hitRecorded) break;
+#endif
+
+        if (tCellExit >= tExit) break; // end of step (or grid) reached
+
+        // step to the next cell
+        tCellEnter = tCellExit;
+        if ((tNextX <= tNextY) && (tNextX <= tNextZ)) {
+            cellX += stepX;
+            if ((cellX < 0) || (cellX >= gridNumX)) break;
+            tNextX += tDeltaX;
+        } else if (tNextY <= tNextZ) {
+            cellY += stepY;
+            if ((cellY < 0) || (cellY >= gridNumY)) break;
+            tNextY += tDeltaY;
+        } else {
+            cellZ += stepZ;
+            if ((cellZ < 0) || (cellZ >= gridNumZ)) break;
+            tNextZ += tDeltaZ;
+        }
+    }
+
+#ifdef STOP_PHOTONS_ON_DETECTION
+    // In case photons are stopped on detection
+    // (i.e. absorbed by the DOM), we need to record
+    // them here (after all possible DOM intersections
+    // have been checked).
+    if (hitRecorded) {
+        saveHit(photonPosAndTime,
+                photonDirAndWlen,
+                *thisStepLength,
+                inv_groupvel,
+                photonTotalPathLength,
+                photonNumScatters,
+                distanceTraveledInAbsorptionLengths,
+                photonStartPosAndTime,
+                photonStartDirAndWlen,
+                step,
+                hitOnString,
+                hitOnDom,
+#if defined(COMPACT_PHOTON_OUTPUT) || defined(HIT_CONVERSION)
+                hitDomPos,
+#endif
+#ifdef HIT_CONVERSION
+                hitDomEfficiencyOffsets,
+                hitDomEfficiencies,
+                RNG_ARGS_TO_CALL,
+#endif
+                hitIndex,
+                maxHitIndex,
+                outputPhotons
+#ifdef SAVE_PHOTON_HISTORY
+              , photonHistory,
+                currentPhotonHistory
+#endif
+                );
+    }
+    return hitRecorded;
+#else // STOP_PHOTONS_ON_DETECTION
+    // in case photons should *not* be absorbed when they
+    // hit a DOM, this will always return false (i.e.
+    // no detection.)
+    return false;
+#endif // STOP_PHOTONS_ON_DETECTION
+#endif // DEBUG_STORE_GENERATED_PHOTONS
+}
@@ -0,0 +1,61 @@
+/**
+ * Copyright (c) 2011, 2012
+ * Claudio Kopper <claudio.kopper@icecube.wisc.edu>
+ * and the IceCube Collaboration <http://www.icecube.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * $Id$
+ *
+ * @file grid_collision_kernel.h.cl
+ * @version $Revision$
+ * @date $Date$
+ * @author Claudio Kopper
+ */
+
+inline bool checkForCollision(const floating4_t photonPosAndTime,
+    const floating4_t photonDirAndWlen,
+    floating_t inv_groupvel,
+    floating_t photonTotalPathLength,
+    uint photonNumScatters,
+    floating_t distanceTraveledInAbsorptionLengths,
+    const floating4_t photonStartPosAndTime,
+    const floating4_t photonStartDirAndWlen,
+    const struct I3CLSimStep *step,
+#ifdef STOP_PHOTONS_ON_DETECTION
+    floating_t *thisStepLength,
+#else
+    floating_t thisStepLength,
+#endif
+    __global uint* hitIndex,
+    uint maxHitIndex,
+    __write_only __global struct I3CLSimPhoton *outputPhotons,
+#ifdef SAVE_PHOTON_HISTORY
+    __write_only __global float4 *photonHistory,
+    float4 *currentPhotonHistory,
+#endif
+#ifdef HIT_CONVERSION
+    __read_only __global const uint *hitDomEfficiencyOffsets,
+    __read_only __global const float *hitDomEfficiencies,
+    RNG_ARGS,
+#endif
+    __read_only __global const uint *geoGridCellStart,
+    __read_only __global const uint *geoGridCellDoms,
+    __read_only __global const float4 *geoGridDomPos,
+    __read_only __global const uint *geoGridDomIndex,
+    const float4 geoGridStartAndCellWidth,
+    const uint4 geoGridNumCells,
+    const float geoGridOMRadius,
+    __read_only __global const uint *domMask
+    );
@@ -30,6 +30,63 @@
 #endif
 #endif
 
+#ifdef COMPACT_PHOTON_OUTPUT
+#ifdef SAVE_ALL_PHOTONS
+#error The SAVE_ALL_PHOTONS and COMPACT_PHOTON_OUTPUT options cannot be used at the same time.
+#endif
+#ifdef SAVE_PHOTON_HISTORY
+#error The SAVE_PHOTON_HISTORY and COMPACT_PHOTON_OUTPUT options cannot be used at the same time.
+#endif
+#endif
+
+#ifdef HIT_CONVERSION
+#ifndef STOP_PHOTONS_ON_DETECTION
+#error The HIT_CONVERSION option needs STOP_PHOTONS_ON_DETECTION.
+#endif
+#ifdef SAVE_ALL_PHOTONS
+#error The SAVE_ALL_PHOTONS and HIT_CONVERSION options cannot be used at the same time.
+#endif
+#ifdef SAVE_PHOTON_HISTORY
+#error The SAVE_PHOTON_HISTORY and HIT_CONVERSION options cannot be used at the same time.
+#endif
+#ifdef COMPACT_PHOTON_OUTPUT
+#error The COMPACT_PHOTON_OUTPUT and HIT_CONVERSION options cannot be used at the same time.
+#endif
+#ifdef TABULATE
+#error The TABULATE and HIT_CONVERSION options cannot be used at the same time.
+#endif
+#ifdef DEBUG_STORE_GENERATED_PHOTONS
+#error The DEBUG_STORE_GENERATED_PHOTONS and HIT_CONVERSION options cannot be used at the same time.
+#endif
+#endif
+
+#ifdef DISTANCE_CULLING
+#ifdef SAVE_ALL_PHOTONS
+#error The SAVE_ALL_PHOTONS and DISTANCE_CULLING options cannot be used at the same time.
+#endif
+#endif
+
+#ifdef PHOTON_SPLITTING
+#ifdef SAVE_ALL_PHOTONS
+#error The SAVE_ALL_PHOTONS and PHOTON_SPLITTING options cannot be used at the same time.
+#endif
+#ifdef SAVE_PHOTON_HISTORY
+#error The SAVE_PHOTON_HISTORY and PHOTON_SPLITTING options cannot be used at the same time.
+#endif
+#endif
+
+#ifdef TABULATE
+#ifdef SAVE_ALL_PHOTONS
+#error The SAVE_ALL_PHOTONS and TABULATE options cannot be used at the same time.
+#endif
+#ifdef SAVE_PHOTON_HISTORY
+#error The SAVE_PHOTON_HISTORY and TABULATE options cannot be used at the same time.
+#endif
+#ifdef PHOTON_SPLITTING
+#error The PHOTON_SPLITTING and TABULATE options cannot be used at the same time.
+#endif
+#endif
+
 
 #ifdef DOUBLE_PRECISION
 // can't have native_math with double precision
@@ -80,6 +137,81 @@ inline floating_t mediumLayerBoundary(int layer)
     return (convert_floating_t(layer)*((floating_t)MEDIUM_LAYER_THICKNESS)) + (floating_t)MEDIUM_LAYER_BOTTOM_POS;
 }
 
+#ifdef MEDIUM_OPTICAL_DEPTH_TABLES
+// sum of 1/length over all layers below "layer", interpolated between
+// the two wavelength bins starting at "tableOffset"
+inline floating_t opticalDepthBelowLayer(__constant const float *table, uint tableOffset, floating_t frac, int layer)
+{
+    return mix(convert_floating_t(table[tableOffset+layer]),
+               convert_floating_t(table[tableOffset+(MEDIUM_LAYERS+1)+layer]),
+               frac);
+}
+
+// the largest layer <= startLayer with an optical depth below it of at most "depth" (or 0)
+inline int findLayerDownwards(__constant const float *table, uint tableOffset, floating_t frac, int startLayer, floating_t depth)
+{
+    int lo=0, hi=startLayer;
+    while (lo<hi)
+    {
+        const int mid=(lo+hi+1)/2;
+        if (opticalDepthBelowLayer(table, tableOffset, frac, mid) <= depth) lo=mid; else hi=mid-1;
+    }
+    return lo;
+}
+
+// the smallest layer >= startLayer with an optical depth below its top of at least "depth" (or MEDIUM_LAYERS-1)
+inline int findLayerUpwards(__constant const float *table, uint tableOffset, floating_t frac, int startLayer, floating_t depth)
+{
+    int lo=startLayer, hi=MEDIUM_LAYERS-1;
+    while (lo<hi)
+    {
+        const int mid=(lo+hi)/2;
+        if (opticalDepthBelowLayer(table, tableOffset, frac, mid+1) >= depth) hi=mid; else lo=mid+1;
+    }
+    return lo;
+}
+#endif
+
+#if defined(DISTANCE_CULLING) || defined(PHOTON_SPLITTING)
+// A lower bound on the distance from "pos" to the surface of any DOM.
+// Points outside of the field use the value of the closest cell and
+// their distance to the field.
+inline floating_t getMinDistanceToDOM(floating4_t pos,
+    __global const float *distanceField,
+    const float4 distanceFieldStartAndCellWidth,
+    const uint4 distanceFieldNumCells)
+{
+    const floating_t cellWidth = distanceFieldStartAndCellWidth.w;
+    const floating_t startX = distanceFieldStartAndCellWidth.x;
+    const floating_t startY = distanceFieldStartAndCellWidth.y;
+    const floating_t startZ = distanceFieldStartAndCellWidth.z;
+
+    const floating_t outsideX = fmax(fmax(startX-pos.x, pos.x-(startX+convert_floating_t(distanceFieldNumCells.x)*cellWidth)), ZERO);
+    const floating_t outsideY = fmax(fmax(startY-pos.y, pos.y-(startY+convert_floating_t(distanceFieldNumCells.y)*cellWidth)), ZERO);
+    const floating_t outsideZ = fmax(fmax(startZ-pos.z, pos.z-(startZ+convert_floating_t(distanceFieldNumCells.z)*cellWidth)), ZERO);
+
+    const int cellX = clamp(convert_int(floor((pos.x-startX)/cellWidth)), 0, convert_int(distanceFieldNumCells.x)-1);
+    const int cellY = clamp(convert_int(floor((pos.y-startY)/cellWidth)), 0, convert_int(distanceFieldNumCells.y)-1);
+    const int cellZ = clamp(convert_int(floor((pos.z-startZ)/cellWidth)), 0, convert_int(distanceFieldNumCells.z)-1);
+
+    const floating_t cellValue = distanceField[(convert_uint(cellZ)*distanceFieldNumCells.y+convert_uint(cellY))*distanceFieldNumCells.x+convert_uint(cellX)];
+
+    return my_sqrt(sqr(outsideX)+sqr(outsideY)+sqr(outsideZ)+sqr(cellValue));
+}
+#endif
+
+#ifdef PHOTON_SPLITTING
+// The importance of a region for photon splitting: 2 close
+// to a DOM, 0 far away from all DOMs and 1 everywhere else.
+// Photon weights change by PHOTON_SPLITTING_FACTOR per level.
+inline int getPhotonSplittingLevel(floating_t minDistanceToDOM)
+{
+    if (minDistanceToDOM < PHOTON_SPLITTING_DISTANCE) return 2;
+    if (minDistanceToDOM > PHOTON_ROULETTE_DISTANCE) return 0;
+    return 1;
+}
+#endif
+
 void scatterDirectionByAngle(floating_t cosa,
     floating_t sina,
     floating4_t *direction,
@@ -237,6 +369,14 @@ inline void saveHit(
     const struct I3CLSimStep *step,
     unsigned short hitOnString,
     unsigned short hitOnDom,
+#if defined(COMPACT_PHOTON_OUTPUT) || defined(HIT_CONVERSION)
+    const floating4_t hitDomPos, // the position of the DOM that was hit
+#endif
+#ifdef HIT_CONVERSION
+    __read_only __global const uint *hitDomEfficiencyOffsets,
+    __read_only __global const float *hitDomEfficiencies,
+    RNG_ARGS,
+#endif
     __global uint* hitIndex,
     uint maxHitIndex,
     __write_only __global struct I3CLSimPhoton *outputPhotons
@@ -246,6 +386,24 @@ inline void saveHit(
 #endif
     )
 {
+#ifdef HIT_CONVERSION
+    // Apply the DOM acceptance right here and only record photons
+    // that produce photo-electrons (this is what I3PhotonToMCPEConverter
+    // does on the host). The DOM is assumed to look straight down, so
+    // the cosine of the impact angle is the z-component of the photon
+    // direction. Weights above one (e.g. from photon splitting) can
+    // produce more than one photo-electron.
+    const floating_t hitProbability =
+        convert_floating_t(step->weight / getWavelengthBias(photonDirAndWlen.w)) *
+        convert_floating_t(getHitWavelengthAcceptance(photonDirAndWlen.w)) *
+        convert_floating_t(getHitAngularAcceptance(clamp(convert_float(photonDirAndWlen.z), -1.f, 1.f))) *
+        convert_floating_t(hitDomEfficiencies[hitDomEfficiencyOffsets[hitOnString]+convert_uint(hitOnDom)]);
+    
+    uint numPE = convert_uint(hitProbability);
+    if (RNG_CALL_UNIFORM_CO < hitProbability-convert_floating_t(numPE)) ++numPE;
+    if (numPE==0) return;
+#endif
+
     uint myIndex = atom_inc(hitIndex);
     if (myIndex < maxHitIndex)
     {
@@ -254,6 +412,49 @@ inline void saveHit(
             myIndex);
 #endif
 
+#if defined(HIT_CONVERSION)
+        {
+            // Move the hit to where the photon would have hit a DOM of
+            // the real size (the oversized DOM is squashed along the
+            // photon direction, see PANCAKE_FACTOR).
+            const floating_t distToCenter =
+                (hitDomPos.x-(photonPosAndTime.x+thisStepLength*photonDirAndWlen.x))*photonDirAndWlen.x +
+                (hitDomPos.y-(photonPosAndTime.y+thisStepLength*photonDirAndWlen.y))*photonDirAndWlen.y +
+                (hitDomPos.z-(photonPosAndTime.z+thisStepLength*photonDirAndWlen.z))*photonDirAndWlen.z;
+
+            outputPhotons[myIndex].time = convert_float(photonPosAndTime.w+(thisStepLength+distToCenter*(floating_t)HIT_TIME_CORRECTION_FACTOR)*inv_groupvel);
+            outputPhotons[myIndex].identifier = step->identifier;
+            outputPhotons[myIndex].stringID = convert_short(hitOnString);
+            outputPhotons[myIndex].omID = convert_ushort(hitOnDom);
+            outputPhotons[myIndex].numPE = numPE;
+        }
+#elif defined(COMPACT_PHOTON_OUTPUT)
+        {
+            // store the position relative to the DOM, this
+            // keeps enough precision for half floats
+            const float2 dir = sphDirFromCar(photonDirAndWlen);
+
+            outputPhotons[myIndex].time = convert_float(photonPosAndTime.w+thisStepLength*inv_groupvel);
+            outputPhotons[myIndex].weight = step->weight / getWavelengthBias(photonDirAndWlen.w);
+            outputPhotons[myIndex].identifier = step->identifier;
+            outputPhotons[myIndex].cherenkovDist = photonTotalPathLength+thisStepLength;
+
+            outputPhotons[myIndex].stringID = convert_short(hitOnString);
+            outputPhotons[myIndex].omID = convert_ushort(hitOnDom);
+
+            vstore_half(convert_float(photonPosAndTime.x+thisStepLength*photonDirAndWlen.x-hitDomPos.x), 0, (__global half *)&(outputPhotons[myIndex].relPos[0]));
+            vstore_half(convert_float(photonPosAndTime.y+thisStepLength*photonDirAndWlen.y-hitDomPos.y), 0, (__global half *)&(outputPhotons[myIndex].relPos[1]));
+            vstore_half(convert_float(photonPosAndTime.z+thisStepLength*photonDirAndWlen.z-hitDomPos.z), 0, (__global half *)&(outputPhotons[myIndex].relPos[2]));
+            vstore_half(dir.x, 0, (__global half *)&(outputPhotons[myIndex].dir[0]));
+            vstore_half(dir.y, 0, (__global half *)&(outputPhotons[myIndex].dir[1]));
+            vstore_half(convert_float(photonDirAndWlen.w*1e9f), 0, (__global half *)&(outputPhotons[myIndex].wavelength));
+            vstore_half(convert_float(my_recip(inv_groupvel)), 0, (__global half *)&(outputPhotons[myIndex].groupVelocity));
+            vstore_half(convert_float(distanceTraveledInAbsorptionLengths), 0, (__global half *)&(outputPhotons[myIndex].distInAbsLens));
+
+            outputPhotons[myIndex].numScatters = convert_ushort_sat(photonNumScatters);
+            outputPhotons[myIndex].dummy = 0;
+        }
+#else
         outputPhotons[myIndex].posAndTime = (float4)
             (
             photonPosAndTime.x+thisStepLength*photonDirAndWlen.x,
@@ -283,6 +484,7 @@ inline void saveHit(
         outputPhotons[myIndex].groupVelocity = my_recip(inv_groupvel);
 
         outputPhotons[myIndex].distInAbsLens = distanceTraveledInAbsorptionLengths;
+#endif
 
 #ifdef SAVE_PHOTON_HISTORY
         for (uint i=0;i<NUM_PHOTONS_IN_HISTORY;++i)
@@ -291,7 +493,7 @@ inline void saveHit(
         }
 #endif
 
-#ifdef PRINTF_ENABLED
+#if defined(PRINTF_ENABLED) && !defined(COMPACT_PHOTON_OUTPUT) && !defined(HIT_CONVERSION)
         dbg_printf("     -> stored photon: p=(%f,%f,%f), d=(%f,%f), t=%f, wlen=%fnm\n",
             outputPhotons[myIndex].posAndTime.x, outputPhotons[myIndex].posAndTime.y, outputPhotons[myIndex].posAndTime.z,
             outputPhotons[myIndex].dir.x, outputPhotons[myIndex].dir.y,
@@ -303,10 +505,138 @@ inline void saveHit(
     
 }
 
+#ifdef TABULATE
+// There are no floating point atomics in OpenCL 1.x,
+// so swap in the sum until nobody else got in between.
+inline void atomicAddFloat(volatile __global float *address, float value)
+{
+    union {uint u; float f;} oldValue, newValue;
+    do {
+        oldValue.f = *address;
+        newValue.f = oldValue.f + value;
+    } while (atom_cmpxchg((volatile __global uint *)address, oldValue.u, newValue.u) != oldValue.u);
+}
+
+// Returns the bin with the last lower edge below value.
+// Values outside of the table end up in the first or last bin.
+inline uint findTabulationBin(float value, uint edgesOffset, uint numBins)
+{
+    uint lower=0;
+    uint upper=numBins-1;
+    while (lower < upper)
+    {
+        const uint middle = (lower+upper+1)/2;
+        if (tabulationBinEdges[edgesOffset+middle] < value) {
+            lower = middle;
+        } else {
+            upper = middle-1;
+        }
+    }
+    return lower;
+}
+
+// Deposit a straight photon segment in the table. The segment
+// is sampled on average once per TABULATION_STEP_LENGTH at random
+// positions (the same as I3CLSimTabulator does for photon histories).
+// Returns true if the photon is too late for the table at the
+// end of the segment and cannot come back.
+inline bool tabulatePhotonSegment(
+    const floating4_t segmentStartPosAndTime,
+    const floating4_t photonDirAndWlen,
+    floating_t segmentLength,
+    floating_t inv_groupvel,
+    floating_t absLensAtStart,
+    floating_t absLensAtEnd,
+    float photonWeight,
+    __global float *tabulationValues,
+    __global float *tabulationWeights,
+    RNG_ARGS)
+{
+    // the cosine of the impact angle is the z-component of the
+    // photon direction for a DOM pointing straight down
+    const float impactWeight = photonWeight*getTabulationAngularAcceptance(convert_float(photonDirAndWlen.z));
+    
+    const floating_t meanNumSamples = segmentLength*(floating_t)TABULATION_RECIP_STEP_LENGTH;
+    uint numSamples = convert_uint(meanNumSamples);
+    if (RNG_CALL_UNIFORM_CO < meanNumSamples-convert_floating_t(numSamples)) ++numSamples;
+    
+    for (uint sample=0;sample<numSamples;++sample)
+    {
+        const floating_t d = segmentLength*RNG_CALL_UNIFORM_CO;
+        
+        // source-centered coordinates
+        const floating_t dx = segmentStartPosAndTime.x + photonDirAndWlen.x*d - (floating_t)TABULATION_SOURCE_POS_X;
+        const floating_t dy = segmentStartPosAndTime.y + photonDirAndWlen.y*d - (floating_t)TABULATION_SOURCE_POS_Y;
+        const floating_t dz = segmentStartPosAndTime.z + photonDirAndWlen.z*d - (floating_t)TABULATION_SOURCE_POS_Z;
+        const floating_t r = my_sqrt(dx*dx + dy*dy + dz*dz);
+        
+        const floating_t timeResidual = segmentStartPosAndTime.w + d*inv_groupvel - (floating_t)TABULATION_SOURCE_TIME - r*(floating_t)TABULATION_RECIP_GROUP_SPEED;
+        if (timeResidual > (floating_t)TABULATION_MAX_TIME_RESIDUAL) continue;
+        
+        const floating_t l = dx*(floating_t)TABULATION_SOURCE_DIR_X + dy*(floating_t)TABULATION_SOURCE_DIR_Y + dz*(floating_t)TABULATION_SOURCE_DIR_Z;
+        const floating_t rhoX = dx - l*(floating_t)TABULATION_SOURCE_DIR_X;
+        const floating_t rhoY = dy - l*(floating_t)TABULATION_SOURCE_DIR_Y;
+        const floating_t rhoZ = dz - l*(floating_t)TABULATION_SOURCE_DIR_Z;
+        const floating_t rho = my_sqrt(rhoX*rhoX + rhoY*rhoY + rhoZ*rhoZ);
+        
+        floating_t azimuth = ZERO;
+        if (rho > ZERO) {
+            const floating_t cosAzimuth = (rhoX*(floating_t)TABULATION_SOURCE_PERP_DIR_X + rhoY*(floating_t)TABULATION_SOURCE_PERP_DIR_Y + rhoZ*(floating_t)TABULATION_SOURCE_PERP_DIR_Z)/rho;
+            azimuth = acos(clamp(cosAzimuth, -ONE, ONE))*((floating_t)180./PI);
+        }
+        const floating_t cosZenith = (r > ZERO)?(l/r):ONE;
+        
+        const uint binR = findTabulationBin(convert_float(r), TABULATION_EDGES_OFFSET_0, TABULATION_NUM_BINS_0);
+        const uint binAzimuth = findTabulationBin(convert_float(azimuth), TABULATION_EDGES_OFFSET_1, TABULATION_NUM_BINS_1);
+        const uint binCosZenith = findTabulationBin(convert_float(cosZenith), TABULATION_EDGES_OFFSET_2, TABULATION_NUM_BINS_2);
+        const uint binTime = findTabulationBin(convert_float(timeResidual), TABULATION_EDGES_OFFSET_3, TABULATION_NUM_BINS_3);
+        const uint bin = ((binR*TABULATION_NUM_BINS_1 + binAzimuth)*TABULATION_NUM_BINS_2 + binCosZenith)*TABULATION_NUM_BINS_3 + binTime;
+        
+        // survival probability at this point
+        const floating_t absLens = absLensAtStart + (absLensAtEnd-absLensAtStart)*my_divide(d, segmentLength);
+        const float weight = impactWeight*convert_float(my_exp(-absLens));
+        
+        atomicAddFloat(&(tabulationValues[bin]), weight);
+        atomicAddFloat(&(tabulationWeights[bin]), weight*weight);
+    }
+    
+    // The time residual can only decrease along the photon path if
+    // the photon is faster than the group velocity used for the table.
+    const floating_t endX = segmentStartPosAndTime.x + photonDirAndWlen.x*segmentLength - (floating_t)TABULATION_SOURCE_POS_X;
+    const floating_t endY = segmentStartPosAndTime.y + photonDirAndWlen.y*segmentLength - (floating_t)TABULATION_SOURCE_POS_Y;
+    const floating_t endZ = segmentStartPosAndTime.z + photonDirAndWlen.z*segmentLength - (floating_t)TABULATION_SOURCE_POS_Z;
+    const floating_t endTimeResidual = segmentStartPosAndTime.w + segmentLength*inv_groupvel - (floating_t)TABULATION_SOURCE_TIME - my_sqrt(endX*endX + endY*endY + endZ*endZ)*(floating_t)TABULATION_RECIP_GROUP_SPEED;
+    
+    return ((endTimeResidual > (floating_t)TABULATION_MAX_TIME_RESIDUAL) && (inv_groupvel >= (floating_t)TABULATION_RECIP_GROUP_SPEED));
+}
+#endif
+
 __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOutputPhotons
     const uint maxHitIndex,    // maxNumOutputPhotons_
-#ifndef SAVE_ALL_PHOTONS
+#if !defined(SAVE_ALL_PHOTONS) && !defined(TABULATE)
+#ifdef DOM_GRID_COLLISION
+    __read_only __global const uint *geoGridCellStart,
+    __read_only __global const uint *geoGridCellDoms,
+    __read_only __global const float4 *geoGridDomPos,
+    __read_only __global const uint *geoGridDomIndex,
+    const float4 geoGridStartAndCellWidth,
+    const uint4 geoGridNumCells,
+    const float geoGridOMRadius,
+    __read_only __global const uint *domMask,
+#else
     __read_only __global unsigned short *geoLayerToOMNumIndexPerStringSet,
+#endif
+#if defined(DISTANCE_CULLING) || defined(PHOTON_SPLITTING)
+    __read_only __global const float *distanceField,
+    const float4 distanceFieldStartAndCellWidth,
+    const uint4 distanceFieldNumCells,
+    const float distanceCullingMaxDistPerAbsLen,
+    const float distanceCullingMargin,
+#endif
+#ifdef HIT_CONVERSION
+    __read_only __global const uint *hitDomEfficiencyOffsets, // first entry for each string index
+    __read_only __global const float *hitDomEfficiencies,     // relative efficiency for each DOM
+#endif
 #endif
 
     __read_only __global struct I3CLSimStep *inputSteps, // deviceBuffer_InputSteps
@@ -316,6 +646,12 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
     __write_only __global float4 *photonHistory,
 #endif
 
+#ifdef TABULATE
+    __global float *tabulationValues,   // deviceBuffer_TabulationValues
+    __global float *tabulationWeights,  // deviceBuffer_TabulationWeights
+    __write_only __global float *tabulationPhotonWeights, // deviceBuffer_TabulationPhotonWeights
+#endif
+
     __global ulong* MWC_RNG_x,
     __global uint* MWC_RNG_a)
 {
@@ -326,7 +662,7 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
     dbg_printf("Start kernel... (work item %u of %u)\n", i, global_size);
 #endif
 
-#ifndef SAVE_ALL_PHOTONS
+#if !defined(SAVE_ALL_PHOTONS) && !defined(TABULATE) && !defined(DOM_GRID_COLLISION)
     __local unsigned short geoLayerToOMNumIndexPerStringSetLocal[GEO_geoLayerToOMNumIndexPerStringSet_BUFFER_SIZE];
 
     // copy the geo data to our local memory (this is done by a whole work group in parallel)
@@ -362,7 +698,12 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
     step.sourceType = inputSteps[i].sourceType;
 #endif
     //step.dummy1 = inputSteps[i].dummy1;  // NOT USED
+#ifdef DOM_GRID_COLLISION
+    // the DOM mask to use for this step
+    step.dummy2 = inputSteps[i].dummy2;
+#else
     //step.dummy2 = inputSteps[i].dummy2;  // NOT USED
+#endif
     //step = inputSteps[i]; // Intel OpenCL does not like this
 
     floating4_t stepDir;
@@ -409,6 +750,38 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
 #error This kernel only works with a constant group velocity (constant w.r.t. layers)
 #endif
     floating_t inv_groupvel=ZERO;
+#ifdef MEDIUM_OPTICAL_DEPTH_TABLES
+    uint opticalDepthTableOffset=0;
+    floating_t opticalDepthTableFrac=ZERO;
+#endif
+
+#ifdef PHOTON_SPLITTING
+    // The weight of the current photon is kept in step.weight,
+    // it changes when photons are split or play Russian roulette.
+    const float stepWeight = step.weight;
+    int photonSplittingLevel=1;
+    
+    // The copies of the last photon that has been split. They all
+    // start from the same state and are propagated one after the other.
+    uint splitCopiesLeft=0;
+    floating4_t splitPosAndTime;
+    floating4_t splitDirAndWlen;
+    floating_t splitAbsLensLeft=ZERO;
+    uint splitNumScatters=0;
+    floating_t splitTotalPathLength=ZERO;
+    float splitWeight=0.f;
+    int splitLevel=1;
+#ifdef getTiltZShift_IS_CONSTANT
+    int splitPhotonLayer=0;
+#endif
+#endif
+
+#ifdef TABULATE
+    // the weight of the current photon in the table (including the
+    // effective area of the DOM) and the sum of all photon weights
+    float tabulationPhotonWeight=0.f;
+    float tabulationSumOfPhotonWeights=0.f;
+#endif
 
 
     while (photonsLeftToPropagate > 0)
@@ -429,6 +802,19 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
             photonNumScatters=0;
             photonTotalPathLength=ZERO;
             
+#ifdef PHOTON_SPLITTING
+            step.weight = stepWeight;
+            photonSplittingLevel=1;
+#endif
+
+#ifdef TABULATE
+            {
+                const float photonWeight = step.weight/getWavelengthBias(photonDirAndWlen.w);
+                tabulationPhotonWeight = photonWeight*getTabulationWavelengthAcceptance(photonDirAndWlen.w)*TABULATION_DOM_AREA;
+                tabulationSumOfPhotonWeights += photonWeight;
+            }
+#endif
+            
 #ifdef PRINTF_ENABLED
             dbg_printf("   created photon %u at: p=(%f,%f,%f), d=(%f,%f,%f), t=%f, wlen=%fnm\n",
                 photonsLeftToPropagate-step.numPhotons,
@@ -442,6 +828,17 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
 #endif
 
             inv_groupvel = my_recip(getGroupVelocity(0, photonDirAndWlen.w));
+
+#ifdef MEDIUM_OPTICAL_DEPTH_TABLES
+            // the wavelength does not change, so find the table bins only once per photon
+            {
+                const floating_t binPos = clamp((photonDirAndWlen.w-(floating_t)MEDIUM_OPTICAL_DEPTH_TABLE_MIN_WLEN)*(floating_t)MEDIUM_OPTICAL_DEPTH_TABLE_INV_BIN_WIDTH,
+                                                ZERO, (floating_t)(MEDIUM_OPTICAL_DEPTH_TABLE_BINS-1));
+                const uint bin = min(convert_uint(binPos), (uint)(MEDIUM_OPTICAL_DEPTH_TABLE_BINS-2));
+                opticalDepthTableOffset = bin*(MEDIUM_LAYERS+1);
+                opticalDepthTableFrac = binPos-convert_floating_t(bin);
+            }
+#endif
             
             // the photon needs a lifetime. determine distance to next scatter and absorption
             // (this is in units of absorption/scattering lengths)
@@ -459,6 +856,11 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
 #endif
         }
 
+#ifdef TABULATE
+        // the absorption lengths traveled before this segment
+        const floating_t absLensAtSegmentStart = abs_lens_initial-abs_lens_left;
+#endif
+
         // this block is along the lines of the PPC kernel
         floating_t distancePropagated;
         {
@@ -489,8 +891,19 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
             dbg_printf("   - next scatter in %f scattering lengths\n", sca_step_left);
 #endif
             
+#ifdef MEDIUM_OPTICAL_DEPTH_TABLES
+            // take the lengths from the tables, too. Otherwise the layer
+            // search would not be consistent with the distances calculated below.
+            const floating_t scaDepthBelow = opticalDepthBelowLayer(mediumScatteringDepthTable, opticalDepthTableOffset, opticalDepthTableFrac, currentPhotonLayer);
+            const floating_t absDepthBelow = opticalDepthBelowLayer(mediumAbsorptionDepthTable, opticalDepthTableOffset, opticalDepthTableFrac, currentPhotonLayer);
+            const floating_t scaDepthAbove = opticalDepthBelowLayer(mediumScatteringDepthTable, opticalDepthTableOffset, opticalDepthTableFrac, currentPhotonLayer+1);
+            const floating_t absDepthAbove = opticalDepthBelowLayer(mediumAbsorptionDepthTable, opticalDepthTableOffset, opticalDepthTableFrac, currentPhotonLayer+1);
+            floating_t currentScaLen = my_recip(scaDepthAbove-scaDepthBelow);
+            floating_t currentAbsLen = my_recip(absDepthAbove-absDepthBelow);
+#else
             floating_t currentScaLen = getScatteringLength(currentPhotonLayer, photonDirAndWlen.w);
             floating_t currentAbsLen = getAbsorptionLength(currentPhotonLayer, photonDirAndWlen.w);
+#endif
             
             floating_t ais=( photon_dz*sca_step_left - my_divide((mediumBoundary-effective_z),currentScaLen) )*(ONE/(floating_t)MEDIUM_LAYER_THICKNESS);
             floating_t aia=( photon_dz*abs_lens_left - my_divide((mediumBoundary-effective_z),currentAbsLen) )*(ONE/(floating_t)MEDIUM_LAYER_THICKNESS);
@@ -501,6 +914,39 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
         
             // propagate through layers
             int j=currentPhotonLayer;
+#ifdef MEDIUM_OPTICAL_DEPTH_TABLES
+            // Same as the loops below, but the layer of the next interaction is
+            // found with a binary search over the cumulative optical depths.
+            // (ais/aia would be >= 0 (<= 0 when going upwards) after the loop
+            // reached layer j if the depth below (above) j passes ais (aia).)
+            if(photon_dz<0) {
+                const int jSca = findLayerDownwards(mediumScatteringDepthTable, opticalDepthTableOffset, opticalDepthTableFrac, currentPhotonLayer, ais+scaDepthBelow);
+                const int jAbs = findLayerDownwards(mediumAbsorptionDepthTable, opticalDepthTableOffset, opticalDepthTableFrac, currentPhotonLayer, aia+absDepthBelow);
+                j = max(jSca, jAbs);
+            } else {
+                const int jSca = findLayerUpwards(mediumScatteringDepthTable, opticalDepthTableOffset, opticalDepthTableFrac, currentPhotonLayer, ais+scaDepthAbove);
+                const int jAbs = findLayerUpwards(mediumAbsorptionDepthTable, opticalDepthTableOffset, opticalDepthTableFrac, currentPhotonLayer, aia+absDepthAbove);
+                j = min(jSca, jAbs);
+            }
+            
+            if (j != currentPhotonLayer) {
+                const floating_t scaDepthBelowJ = opticalDepthBelowLayer(mediumScatteringDepthTable, opticalDepthTableOffset, opticalDepthTableFrac, j);
+                const floating_t absDepthBelowJ = opticalDepthBelowLayer(mediumAbsorptionDepthTable, opticalDepthTableOffset, opticalDepthTableFrac, j);
+                const floating_t scaDepthAboveJ = opticalDepthBelowLayer(mediumScatteringDepthTable, opticalDepthTableOffset, opticalDepthTableFrac, j+1);
+                const floating_t absDepthAboveJ = opticalDepthBelowLayer(mediumAbsorptionDepthTable, opticalDepthTableOffset, opticalDepthTableFrac, j+1);
+                
+                if (j < currentPhotonLayer) {
+                    ais += scaDepthBelow-scaDepthBelowJ;
+                    aia += absDepthBelow-absDepthBelowJ;
+                } else {
+                    ais -= scaDepthAboveJ-scaDepthAbove;
+                    aia -= absDepthAboveJ-absDepthAbove;
+                }
+                mediumBoundary += convert_floating_t(j-currentPhotonLayer)*(floating_t)MEDIUM_LAYER_THICKNESS;
+                currentScaLen = my_recip(scaDepthAboveJ-scaDepthBelowJ);
+                currentAbsLen = my_recip(absDepthAboveJ-absDepthBelowJ);
+            }
+#else
             if(photon_dz<0) {
                 for (; (j>0) && (ais<ZERO) && (aia<ZERO); 
                      mediumBoundary-=(floating_t)MEDIUM_LAYER_THICKNESS,
@@ -516,6 +962,7 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
                      ais-=my_recip(currentScaLen),
                      aia-=my_recip(currentAbsLen)) ++j;
             }
+#endif
         
 #ifdef PRINTF_ENABLED
             dbg_printf("   - j_final=%i\n", j);
@@ -552,8 +999,27 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
         }
 
 
-#ifndef SAVE_ALL_PHOTONS
+#ifdef TABULATE
+        // record the segment the photon just traveled in the table
+        // and stop it once it is too late for the table
+        if (tabulatePhotonSegment(photonPosAndTime,
+                photonDirAndWlen,
+                distancePropagated,
+                inv_groupvel,
+                absLensAtSegmentStart,
+                abs_lens_initial-abs_lens_left,
+                tabulationPhotonWeight,
+                tabulationValues,
+                tabulationWeights,
+                RNG_ARGS_TO_CALL))
+        {
+            abs_lens_left = ZERO;
+        }
+#endif
+
+#if !defined(SAVE_ALL_PHOTONS) && !defined(TABULATE)
         // no photon collission detection in case all photons should be saved
+        // (or if photons are only tabulated)
         
         // the photon is now either being absorbed or scattered.
         // Check for collisions in its way
@@ -587,7 +1053,23 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
             photonHistory,
             currentPhotonHistory,
 #endif //SAVE_PHOTON_HISTORY
+#ifdef HIT_CONVERSION
+            hitDomEfficiencyOffsets,
+            hitDomEfficiencies,
+            RNG_ARGS_TO_CALL,
+#endif //HIT_CONVERSION
+#ifdef DOM_GRID_COLLISION
+            geoGridCellStart,
+            geoGridCellDoms,
+            geoGridDomPos,
+            geoGridDomIndex,
+            geoGridStartAndCellWidth,
+            geoGridNumCells,
+            geoGridOMRadius,
+            domMask
+#else //DOM_GRID_COLLISION
             geoLayerToOMNumIndexPerStringSetLocal
+#endif //DOM_GRID_COLLISION
             );
             
 #ifdef STOP_PHOTONS_ON_DETECTION
@@ -605,7 +1087,7 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
         }
 #endif //STOP_PHOTONS_ON_DETECTION
         
-#endif //not SAVE_ALL_PHOTONS
+#endif //not SAVE_ALL_PHOTONS and not TABULATE
         
         // update the track to its next position
         photonPosAndTime.x += photonDirAndWlen.x*distancePropagated;
@@ -614,6 +1096,97 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
         photonPosAndTime.w += inv_groupvel*distancePropagated;
         photonTotalPathLength += distancePropagated;
 
+#ifdef DISTANCE_CULLING
+        // Get rid of the photon if it cannot reach any DOM before being
+        // absorbed. This does not change the result as long as the
+        // distance field and the maximum absorption length are
+        // conservative, the margin is there to be on the safe side.
+        if (abs_lens_left >= EPSILON)
+        {
+            const floating_t minDistanceToDOM = getMinDistanceToDOM(photonPosAndTime,
+                distanceField,
+                distanceFieldStartAndCellWidth,
+                distanceFieldNumCells);
+            
+            if (minDistanceToDOM > (abs_lens_left+distanceCullingMargin)*distanceCullingMaxDistPerAbsLen)
+            {
+#ifdef PRINTF_ENABLED
+                dbg_printf("   - photon cannot reach any DOM (distance %f), culling it\n", minDistanceToDOM);
+#endif
+                abs_lens_left = ZERO;
+            }
+        }
+#endif
+
+#ifdef PHOTON_SPLITTING
+        // Split photons that get closer to a DOM, play Russian roulette
+        // with photons that move away from them. This happens before the
+        // photon is scattered, so all copies scatter independently.
+        if (abs_lens_left >= EPSILON)
+        {
+            const int newLevel = getPhotonSplittingLevel(getMinDistanceToDOM(photonPosAndTime,
+                distanceField,
+                distanceFieldStartAndCellWidth,
+                distanceFieldNumCells));
+            
+            const uint levelFactor = (abs(newLevel-photonSplittingLevel)==2)?(PHOTON_SPLITTING_FACTOR*PHOTON_SPLITTING_FACTOR):PHOTON_SPLITTING_FACTOR;
+            
+            if (newLevel < photonSplittingLevel)
+            {
+                // survive with a probability of 1/levelFactor
+                if (RNG_CALL_UNIFORM_CO*convert_floating_t(levelFactor) < ONE) {
+                    step.weight *= convert_float(levelFactor);
+                    photonSplittingLevel = newLevel;
+                } else {
+#ifdef PRINTF_ENABLED
+                    dbg_printf("   - photon lost Russian roulette\n");
+#endif
+                    abs_lens_left = ZERO;
+                }
+            }
+            else if ((newLevel > photonSplittingLevel) && (splitCopiesLeft==0))
+            {
+                // Continue with this photon and save its state for the other
+                // copies. Photons are not split again while copies are left,
+                // they just keep their (higher) weight in that case.
+                step.weight /= convert_float(levelFactor);
+                photonSplittingLevel = newLevel;
+                
+                splitCopiesLeft = levelFactor-1;
+                splitPosAndTime = photonPosAndTime;
+                splitDirAndWlen = photonDirAndWlen;
+                splitAbsLensLeft = abs_lens_left;
+                splitNumScatters = photonNumScatters;
+                splitTotalPathLength = photonTotalPathLength;
+                splitWeight = step.weight;
+                splitLevel = photonSplittingLevel;
+#ifdef getTiltZShift_IS_CONSTANT
+                splitPhotonLayer = currentPhotonLayer;
+#endif
+                
+#ifdef PRINTF_ENABLED
+                dbg_printf("   - photon split into %u copies\n", levelFactor);
+#endif
+            }
+        }
+        
+        if ((abs_lens_left < EPSILON) && (splitCopiesLeft > 0))
+        {
+            // this copy is gone, continue with the next one
+            // (it will be scattered below)
+            --splitCopiesLeft;
+            photonPosAndTime = splitPosAndTime;
+            photonDirAndWlen = splitDirAndWlen;
+            abs_lens_left = splitAbsLensLeft;
+            photonNumScatters = splitNumScatters;
+            photonTotalPathLength = splitTotalPathLength;
+            step.weight = splitWeight;
+            photonSplittingLevel = splitLevel;
+#ifdef getTiltZShift_IS_CONSTANT
+            currentPhotonLayer = splitPhotonLayer;
+#endif
+        }
+#endif
 
         // absorb or scatter the photon
         if (abs_lens_left < EPSILON) 
@@ -711,6 +1284,10 @@ __kernel void propKernel(__global uint *hitIndex,   // deviceBuffer_CurrentNumOu
     dbg_printf("Kernel finished.\n");
 #endif
 
+#ifdef TABULATE
+    tabulationPhotonWeights[i] = tabulationSumOfPhotonWeights;
+#endif
+
     //upload MWC RNG state
     MWC_RNG_x[i] = real_rnd_x;
     MWC_RNG_a[i] = real_rnd_a;
@@ -56,10 +56,45 @@ struct __attribute__ ((packed)) I3CLSimStep
     uint identifier;                                        //    32bit unsigned
     uchar sourceType;                                       //     8bit unsigned
     uchar dummy1;                                           //     8bit unsigned
-    ushort dummy2;                                          //    16bit unsigned
+    ushort dummy2;                                          //    16bit unsigned (DOM mask index with DOM_GRID_COLLISION)
                                                             // total: 12x 32bit float = 48 bytes
 };
 
+#if defined(HIT_CONVERSION)
+// The hit record. Has to match I3CLSimHelper::HitRecord_t.
+// The DOM acceptance has already been applied, so this is
+// all that is left of a photon that produced photo-electrons.
+struct __attribute__ ((packed)) I3CLSimPhoton 
+{
+    float time; // corrected for oversized DOMs            //    32bit float
+    uint identifier;                                        //    32bit unsigned
+    short stringID;                                         //    16bit signed
+    ushort omID;                                            //    16bit unsigned
+    uint numPE; // number of photo-electrons                //    32bit unsigned
+                                                            // total: 4x 32bit float = 16 bytes
+};
+#elif defined(COMPACT_PHOTON_OUTPUT)
+// The compact output record. Has to match I3CLSimHelper::CompactPhoton_t,
+// the host expands it back to the full record. The "half" values are
+// written using vstore_half(). There is no start position/direction.
+struct __attribute__ ((packed)) I3CLSimPhoton 
+{
+    float time;                                             //    32bit float
+    float weight;                                           //    32bit float
+    uint identifier;                                        //    32bit unsigned
+    float cherenkovDist; // Cherenkov distance travelled    //    32bit float
+    short stringID;                                         //    16bit signed
+    ushort omID;                                            //    16bit unsigned
+    ushort relPos[3]; // x,y,z relative to the DOM center   // 3x 16bit half
+    ushort dir[2]; // theta,phi                             // 2x 16bit half
+    ushort wavelength; // photon wavelength in nm           //    16bit half
+    ushort groupVelocity;                                   //    16bit half
+    ushort distInAbsLens;                                   //    16bit half
+    ushort numScatters; // saturates at 0xFFFF              //    16bit unsigned
+    ushort dummy;                                           //    16bit unsigned
+                                                            // total: 10x 32bit float = 40 bytes
+};
+#else
 struct __attribute__ ((packed)) I3CLSimPhoton 
 {
     float4 posAndTime;   // x,y,z,time                      // 4x 32bit float
@@ -77,6 +112,7 @@ struct __attribute__ ((packed)) I3CLSimPhoton
     float distInAbsLens;                                    //    32bit float
                                                             // total: 20x 32bit float = 80 bytes
 };
+#endif
 
 ///////////////// forward declarations
 
@@ -114,6 +150,14 @@ inline void saveHit(
     const struct I3CLSimStep *step,
     unsigned short hitOnString,
     unsigned short hitOnDom,
+#if defined(COMPACT_PHOTON_OUTPUT) || defined(HIT_CONVERSION)
+    const floating4_t hitDomPos,
+#endif
+#ifdef HIT_CONVERSION
+    __read_only __global const uint *hitDomEfficiencyOffsets,
+    __read_only __global const float *hitDomEfficiencies,
+    RNG_ARGS,
+#endif
     __global uint* hitIndex,
     uint maxHitIndex,
     __write_only __global struct I3CLSimPhoton *outputPhotons
@@ -123,6 +167,20 @@ inline void saveHit(
 #endif
     );
 
+#ifdef TABULATE
+inline bool tabulatePhotonSegment(
+    const floating4_t segmentStartPosAndTime,
+    const floating4_t photonDirAndWlen,
+    floating_t segmentLength,
+    floating_t inv_groupvel,
+    floating_t absLensAtStart,
+    floating_t absLensAtEnd,
+    float photonWeight,
+    __global float *tabulationValues,
+    __global float *tabulationWeights,
+    RNG_ARGS);
+#endif
+
 ///////////////////////// some constants
 
 #ifdef DOUBLE_PRECISION
@@ -176,6 +176,9 @@ inline void checkForCollision_OnString(
                     step,
                     stringNum,
                     domNum,
+#ifdef COMPACT_PHOTON_OUTPUT
+                    (floating4_t)(domPosX, domPosY, domPosZ, ZERO),
+#endif
                     hitIndex,
                     maxHitIndex,
                     outputPhotons
@@ -479,11 +482,20 @@ inline bool checkForCollision(const floating4_t photonPosAndTime,
 #ifdef SAVE_PHOTON_HISTORY
     __write_only __global float4 *photonHistory,
    float4 *currentPhotonHistory,
+#endif
+#ifdef HIT_CONVERSION
+    __read_only __global const uint *hitDomEfficiencyOffsets,
+    __read_only __global const float *hitDomEfficiencies,
+    RNG_ARGS,
 #endif
     __local const unsigned short *geoLayerToOMNumIndexPerStringSetLocal
     )
 {
 #ifdef DEBUG_STORE_GENERATED_PHOTONS
+#ifdef COMPACT_PHOTON_OUTPUT
+    floating_t domPosX, domPosY, domPosZ;
+    geometryGetDomPosition(0, 0, &domPosX, &domPosY, &domPosZ);
+#endif
     saveHit(photonPosAndTime,
             photonDirAndWlen,
             ZERO,
@@ -496,6 +508,9 @@ inline bool checkForCollision(const floating4_t photonPosAndTime,
             step,
             0,
             0,
+#ifdef COMPACT_PHOTON_OUTPUT
+            (floating4_t)(domPosX, domPosY, domPosZ, ZERO),
+#endif
             hitIndex,
             maxHitIndex,
             outputPhotons
@@ -555,6 +570,10 @@ inline bool checkForCollision(const floating4_t photonPosAndTime,
     // the intersection detection further down in
     // checkForCollision_*().
     if (hitRecorded) {
+#if defined(COMPACT_PHOTON_OUTPUT) || defined(HIT_CONVERSION)
+        floating_t domPosX, domPosY, domPosZ;
+        geometryGetDomPosition(hitOnString, hitOnDom, &domPosX, &domPosY, &domPosZ);
+#endif
         saveHit(photonPosAndTime,
                 photonDirAndWlen,
                 *thisStepLength,
@@ -567,6 +586,14 @@ inline bool checkForCollision(const floating4_t photonPosAndTime,
                 step,
                 hitOnString,
                 hitOnDom,
+#if defined(COMPACT_PHOTON_OUTPUT) || defined(HIT_CONVERSION)
+                (floating4_t)(domPosX, domPosY, domPosZ, ZERO),
+#endif
+#ifdef HIT_CONVERSION
+                hitDomEfficiencyOffsets,
+                hitDomEfficiencies,
+                RNG_ARGS_TO_CALL,
+#endif
                 hitIndex,
                 maxHitIndex,
                 outputPhotons
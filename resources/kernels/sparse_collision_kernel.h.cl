@@ -140,6 +140,11 @@ inline bool checkForCollision(const floating4_t photonPosAndTime,
 #ifdef SAVE_PHOTON_HISTORY
     __write_only __global float4 *photonHistory,
     float4 *currentPhotonHistory,
+#endif
+#ifdef HIT_CONVERSION
+    __read_only __global const uint *hitDomEfficiencyOffsets,
+    __read_only __global const float *hitDomEfficiencies,
+    RNG_ARGS,
 #endif
     __local const unsigned short *geoLayerToOMNumIndexPerStringSetLocal
     );
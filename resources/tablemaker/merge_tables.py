@@ -0,0 +1,25 @@
+from optparse import OptionParser
+from os import path, unlink
+
+usage = "usage: %prog [options] outputfile inputfile [inputfile ...]"
+parser = OptionParser(usage)
+
+parser.add_option("--overwrite", dest="overwrite", action="store_true", default=False,
+    help="Overwrite output file if it already exists")
+
+opts, args = parser.parse_args()
+
+if len(args) < 2:
+	parser.error("You must specify an output file and at least one input file!")
+outfile, infiles = args[0], args[1:]
+if path.exists(outfile):
+	if opts.overwrite:
+		unlink(outfile)
+	else:
+		parser.error("Output file exists! Pass --overwrite to overwrite it.")
+
+# Tables written with --sparse are summed up one chunk at a time,
+# so this never needs more than a few chunks in memory.
+from icecube.clsim import MergeSparsePhotonTables
+
+MergeSparsePhotonTables(infiles, outfile)
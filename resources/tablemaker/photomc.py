@@ -18,6 +18,10 @@ parser.add_option("--energy", dest="energy", type="float", default=1,
     help="Energy of light source, in GeV [%default]")
 parser.add_option("--step", dest="steplength", type="float", default=1,
     help="Sampling step length in meters [%default]")
+parser.add_option("--device", dest="device", action="store_true", default=False,
+    help="Fill the table directly on the first OpenCL device instead of recording photon paths")
+parser.add_option("--sparse", dest="sparse", action="store_true", default=False,
+    help="Write the table in the chunked sparse format (see merge_tables.py) instead of FITS")
 parser.add_option("--overwrite", dest="overwrite", action="store_true", default=False,
     help="Overwrite output file if it already exists")
     
@@ -33,7 +37,7 @@ if path.exists(outfile):
 		parser.error("Output file exists! Pass --overwrite to overwrite it.")
 
 from icecube import icetray
-from icecube.clsim.tablemaker.tabulator import PhotonGenerator, I3TabulatorModule, generate_seed
+from icecube.clsim.tablemaker.tabulator import PhotonGenerator, DeviceTabulator, I3TabulatorModule, generate_seed
 
 outfile = args[0]
 if opts.seed is None:
@@ -44,13 +48,18 @@ from I3Tray import I3Tray
 
 tray = I3Tray()
 
-rng, header = tray.AddSegment(PhotonGenerator, 'generator', Seed=opts.seed,
-    Zenith=opts.zenith, ZCoordinate=opts.z, Energy=opts.energy, NEvents=opts.nevents)
-    
-tray.AddModule(I3TabulatorModule, 'beancounter',
-    Source='Source', Photons='PropagatedPhotons', Statistics='I3CLSimStatistics',
-    Filename=outfile, StepLength=opts.steplength, RandomService=rng,
-    TableHeader=header)
+if opts.device:
+	tray.AddSegment(DeviceTabulator, 'tabulator', Filename=outfile, Seed=opts.seed,
+	    Zenith=opts.zenith, ZCoordinate=opts.z, Energy=opts.energy, NEvents=opts.nevents,
+	    StepLength=opts.steplength, SparseOutput=opts.sparse)
+else:
+	rng, header = tray.AddSegment(PhotonGenerator, 'generator', Seed=opts.seed,
+	    Zenith=opts.zenith, ZCoordinate=opts.z, Energy=opts.energy, NEvents=opts.nevents)
+	
+	tray.AddModule(I3TabulatorModule, 'beancounter',
+	    Source='Source', Photons='PropagatedPhotons', Statistics='I3CLSimStatistics',
+	    Filename=outfile, StepLength=opts.steplength, RandomService=rng,
+	    TableHeader=header, SparseOutput=opts.sparse)
     
 tray.AddModule('TrashCan', 'MemoryHole')
 tray.Execute()
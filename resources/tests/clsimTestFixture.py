@@ -0,0 +1,157 @@
+from __future__ import print_function
+import time
+import collections
+
+from icecube import icetray, dataclasses, clsim
+from I3Tray import I3Units
+
+# Common setup of the step-to-photon converter tests in this
+# directory: a small detector of 3 strings with 20 DOMs each (use
+# large DOMs to get a reasonable number of hits), light sources
+# around it and helpers to configure and run the converters.
+
+stringPositions = [(-20.*I3Units.m, 0.*I3Units.m), (20.*I3Units.m, 0.*I3Units.m), (0.*I3Units.m, 35.*I3Units.m)]
+domsPerString = 20
+domSpacing = 17.*I3Units.m
+domRadius = 1.*I3Units.m
+
+# sources at these positions (the detector is centered around the origin,
+# the first one is just outside, the second one far away from it)
+sourcePositions = [dataclasses.I3Position(0.*I3Units.m, 70.*I3Units.m, 0.*I3Units.m),
+                   dataclasses.I3Position(0.*I3Units.m, 250.*I3Units.m, -100.*I3Units.m)]
+
+mediumProperties = clsim.MakeIceCubeMediumProperties()
+domAcceptance = clsim.GetIceCubeDOMAcceptance()
+angularAcceptance = clsim.GetIceCubeDOMAngularSensitivity()
+wavelengthGenerator = clsim.makeCherenkovWavelengthGenerator(domAcceptance, False, mediumProperties)
+
+def makeGeometry():
+    geometry = clsim.I3CLSimSimpleGeometryUserConfigurable(domRadius, len(stringPositions)*domsPerString)
+
+    index = 0
+    for stringIndex, (x, y) in enumerate(stringPositions):
+        for domIndex in range(domsPerString):
+            geometry.SetStringID(index, stringIndex+1)
+            geometry.SetDomID(index, domIndex+1)
+            geometry.SetPosX(index, x)
+            geometry.SetPosY(index, y)
+            geometry.SetPosZ(index, (float(domIndex)-float(domsPerString-1)/2.)*domSpacing)
+            geometry.SetSubdetector(index, "IceCube")
+            index += 1
+
+    return geometry
+
+geometry = makeGeometry()
+
+# {(stringID, domID): (x, y, z)}
+domPositions = dict()
+for index in range(len(geometry)):
+    domPositions[(geometry.GetStringID(index), geometry.GetDomID(index))] = \
+        (geometry.GetPosX(index), geometry.GetPosY(index), geometry.GetPosZ(index))
+
+def getOpenCLDevice(required=True):
+    """
+    Returns the first OpenCL device. If there is none (or clsim
+    was built without OpenCL), this raises unless required is
+    False, in which case it returns None.
+    """
+    if hasattr(clsim, "I3CLSimOpenCLDevice"):
+        openCLDevices = [device for device in clsim.I3CLSimOpenCLDevice.GetAllDevices()]
+    else:
+        openCLDevices = []
+    if len(openCLDevices)==0:
+        if not required:
+            print("           no OpenCL devices available")
+            return None
+        raise RuntimeError("No OpenCL devices available!")
+    openCLDevice = openCLDevices[0]
+
+    openCLDevice.useNativeMath=False
+    print("           using platform:", openCLDevice.platform)
+    print("             using device:", openCLDevice.device)
+    return openCLDevice
+
+def configureConverter(converter):
+    """
+    Sets the wavelength generators, the medium and the geometry
+    of the fixture. Converters stop photons at the first DOM they
+    hit. Call Initialize() after any further settings.
+    """
+    converter.SetWlenGenerators([wavelengthGenerator])
+    converter.SetWlenBias(domAcceptance)
+    converter.SetMediumProperties(mediumProperties)
+    converter.SetGeometry(geometry)
+    converter.SetStopDetectedPhotons(True)
+    return converter
+
+def makeOpenCLConverter(rng, openCLDevice):
+    converter = clsim.I3CLSimStepToPhotonConverterOpenCL(RandomService=rng, UseNativeMath=False)
+    converter.SetDevice(openCLDevice)
+    return configureConverter(converter)
+
+def makeNativeConverter(rng):
+    converter = clsim.I3CLSimStepToPhotonConverterNative(RandomService=rng)
+    return configureConverter(converter)
+
+def makeSteps(position, numberOfSteps, photonsPerStep):
+    steps = clsim.I3CLSimStepSeries()
+    for i in range(numberOfSteps):
+        step = clsim.I3CLSimStep()
+        step.pos = position
+        step.time = 0.
+        step.dir = dataclasses.I3Direction(0.,0.,-1.)
+        step.length = 1.*I3Units.m
+        step.beta = 1.
+        step.num = photonsPerStep
+        step.weight = 1.
+        step.id = i
+        step.sourceType = 0
+        steps.append(step)
+    return steps
+
+def runConverter(converter, steps, numberOfIterations):
+    """
+    Propagates the steps numberOfIterations times and returns
+    the list of all photons and the time it took.
+    """
+    photons = []
+
+    startTime = time.time()
+    for iteration in range(numberOfIterations):
+        converter.EnqueueSteps(steps, iteration)
+        result = converter.GetConversionResult()
+        if result.identifier != iteration:
+            raise RuntimeError("expected bunch {0}, got {1}".format(iteration, result.identifier))
+        photons.extend(result.GetPhotons())
+    duration = time.time()-startTime
+
+    return photons, duration
+
+HitStatistics = collections.namedtuple("HitStatistics",
+    ["numHits", "sumOfWeights", "sumOfWeightsSquared", "meanTime", "varTime"])
+
+def hitStatistics(photons):
+    """
+    Number of photons, sums of their weights and squared weights and
+    the weighted mean and variance of their arrival times.
+    """
+    numHits = 0
+    sumOfWeights = 0.
+    sumOfWeightsSquared = 0.
+    sumOfWeightedTimes = 0.
+    sumOfWeightedTimesSquared = 0.
+    for photon in photons:
+        numHits += 1
+        sumOfWeights += photon.weight
+        sumOfWeightsSquared += photon.weight**2
+        sumOfWeightedTimes += photon.weight*photon.time
+        sumOfWeightedTimesSquared += photon.weight*photon.time**2
+
+    if sumOfWeights > 0.:
+        meanTime = sumOfWeightedTimes/sumOfWeights
+        varTime = max(sumOfWeightedTimesSquared/sumOfWeights - meanTime**2, 0.)
+    else:
+        meanTime = float('nan')
+        varTime = float('nan')
+
+    return HitStatistics(numHits, sumOfWeights, sumOfWeightsSquared, meanTime, varTime)
@@ -0,0 +1,113 @@
+#!/usr/bin/env python
+
+from __future__ import print_function
+import pickle
+import math
+import random
+
+from icecube import icetray, dataclasses, clsim
+from I3Tray import I3Units
+
+# Stores a random I3PhotonSeriesMap as an I3ColumnarPhotonSeriesMap
+# (with and without quantization), serializes and deserializes it and
+# checks that the decoded photons agree with the original ones within
+# the precision of the chosen encoding and that scattered photons
+# are still marked as scattered.
+
+# test parameters
+numberOfOMs = 20
+photonsPerOM = 500
+domRadius = 5.*0.16510*I3Units.m
+positionResolution = 0.1*I3Units.mm
+
+random.seed(1)
+
+if hasattr(dataclasses, "I3ModuleGeo"):
+    Key = dataclasses.ModuleKey
+else:
+    Key = icetray.OMKey
+
+photons = clsim.I3PhotonSeriesMap()
+for om in range(numberOfOMs):
+    center = dataclasses.I3Position(random.uniform(-500.,500.)*I3Units.m,
+                                    random.uniform(-500.,500.)*I3Units.m,
+                                    random.uniform(-500.,500.)*I3Units.m)
+    series = clsim.I3PhotonSeries()
+    # leave one OM empty
+    for i in range(photonsPerOM if om != 3 else 0):
+        photon = clsim.I3Photon()
+        photon.SetParticleMajorID(1234)
+        photon.SetParticleMinorID(i % 7)
+        photon.time = random.uniform(1e4, 2e4)*I3Units.ns
+        photon.weight = random.uniform(0., 3.)
+        photon.wavelength = random.uniform(300., 600.)*I3Units.nanometer
+        photon.groupVelocity = random.uniform(0.21, 0.22)*I3Units.m/I3Units.ns
+        photon.dir = dataclasses.I3Direction(math.acos(random.uniform(-1.,1.)), random.uniform(0., 2.*math.pi))
+        onSurface = dataclasses.I3Direction(math.acos(random.uniform(-1.,1.)), random.uniform(0., 2.*math.pi))
+        photon.pos = dataclasses.I3Position(center.x + domRadius*onSurface.x,
+                                            center.y + domRadius*onSurface.y,
+                                            center.z + domRadius*onSurface.z)
+        photon.numScattered = random.choice([0, 0, 1, 5])
+        series.append(photon)
+    photons[Key(1, om+1)] = series
+
+def angularDistance(a, b):
+    return math.acos(max(-1., min(1., a.x*b.x + a.y*b.y + a.z*b.z)))
+
+def check(encoded, maxTimeError, maxAngleError, maxPositionError):
+    if encoded.numPhotons != numberOfOMs*photonsPerOM - photonsPerOM:
+        raise RuntimeError("wrong number of encoded photons")
+    if encoded.numBlocks != numberOfOMs:
+        raise RuntimeError("wrong number of blocks")
+
+    decoded = pickle.loads(pickle.dumps(encoded)).GetPhotonSeriesMap()
+
+    if len(decoded) != len(photons):
+        raise RuntimeError("the decoded map has the wrong number of OMs")
+
+    for key, series in photons.items():
+        original = list(series)
+        restored = list(decoded[key])
+        if len(original) != len(restored):
+            raise RuntimeError("OM {0} has the wrong number of photons".format(key))
+
+        # delta-encoding sorts photons by time
+        if encoded.deltaEncodeTimes:
+            original.sort(key=lambda p: p.time)
+
+        for a, b in zip(original, restored):
+            if (a.GetParticleMajorID() != b.GetParticleMajorID()) or (a.GetParticleMinorID() != b.GetParticleMinorID()):
+                raise RuntimeError("particle IDs do not match")
+            if abs(a.time-b.time) > maxTimeError:
+                raise RuntimeError("time differs by {0}ns".format((a.time-b.time)/I3Units.ns))
+            if abs(a.weight-b.weight) > 1e-6*a.weight:
+                raise RuntimeError("weights do not match")
+            if abs(a.wavelength-b.wavelength) > 1e-6*a.wavelength:
+                raise RuntimeError("wavelengths do not match")
+            if abs(a.groupVelocity-b.groupVelocity) > 1e-6*a.groupVelocity:
+                raise RuntimeError("group velocities do not match")
+            if angularDistance(a.dir, b.dir) > maxAngleError:
+                raise RuntimeError("direction differs by {0}rad".format(angularDistance(a.dir, b.dir)))
+            if (a.numScattered > 0) != (b.numScattered > 0):
+                raise RuntimeError("scattered flags do not match")
+            dist = math.sqrt((a.pos.x-b.pos.x)**2 + (a.pos.y-b.pos.y)**2 + (a.pos.z-b.pos.z)**2)
+            if dist > maxPositionError:
+                raise RuntimeError("position differs by {0}mm".format(dist/I3Units.mm))
+
+    print(encoded)
+    print("pickled size: {0} bytes ({1:.1f} bytes/photon)".format(len(pickle.dumps(encoded)), float(len(pickle.dumps(encoded)))/encoded.numPhotons))
+
+check(clsim.I3ColumnarPhotonSeriesMap(photons),
+      maxTimeError=1e-9*I3Units.ns,
+      maxAngleError=1e-6,
+      maxPositionError=1e-3*I3Units.mm)
+
+check(clsim.I3ColumnarPhotonSeriesMap(photons,
+                                      DeltaEncodeTimes=True,
+                                      QuantizeDirections=True,
+                                      PositionResolution=positionResolution),
+      maxTimeError=1e-3*I3Units.ns,
+      maxAngleError=1e-4,
+      maxPositionError=math.sqrt(3.)*positionResolution)
+
+print("all OK")
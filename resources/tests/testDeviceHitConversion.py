@@ -0,0 +1,92 @@
+#!/usr/bin/env python
+
+from __future__ import print_function
+import math
+
+from icecube import icetray, dataclasses, clsim, phys_services
+from I3Tray import I3Units
+
+from clsimTestFixture import getOpenCLDevice, makeOpenCLConverter, makeSteps, runConverter
+from clsimTestFixture import domsPerString, domPositions, domAcceptance, angularAcceptance
+
+# Propagates the same light source with a converter that returns
+# photons and with one that converts them to photo-electrons on the
+# device. The expected number of photo-electrons computed on the host
+# from the returned photons has to agree with the number of
+# photo-electrons returned by the device. DOMs with a relative
+# efficiency of zero must not record any hits.
+
+# test parameters
+numberOfIterations = 10
+photonsPerStep = 1000
+numberOfSteps = 2000
+relativeEfficiency = 0.8
+disabledString = 2
+
+minimumNumberOfHits = 100
+maximumDeviationInSigmas = 5.
+
+sourcePosition = dataclasses.I3Position(0.*I3Units.m, 10.*I3Units.m, 0.*I3Units.m)
+
+openCLDevice = getOpenCLDevice()
+rng = phys_services.I3GSLRandomService(seed=4)
+
+def makeConverter(convertHits):
+    converter = makeOpenCLConverter(rng, openCLDevice)
+    if convertHits:
+        converter.SetHitConversion(domAcceptance, angularAcceptance)
+        efficiencies = dict()
+        for om in range(1, domsPerString+1):
+            efficiencies[(disabledString, om)] = 0.
+        converter.SetHitDOMEfficiencies(efficiencies, relativeEfficiency)
+    converter.Initialize()
+    return converter
+
+steps = makeSteps(sourcePosition, numberOfSteps, photonsPerStep)
+
+photonConverter = makeConverter(False)
+hitConverter = makeConverter(True)
+
+# expected photo-electrons from the photons, converted on the host
+expectedNPE = 0.
+expectedNPEVariance = 0.
+photons, duration = runConverter(photonConverter, steps, numberOfIterations)
+for photon in photons:
+    if photon.stringID == disabledString: continue
+    # DOMs face down
+    cosAngle = max(-1., min(1., photon.dir.z))
+    probability = photon.weight * domAcceptance.GetValue(photon.wavelength) \
+        * angularAcceptance.GetValue(cosAngle) * relativeEfficiency
+    expectedNPE += probability
+    expectedNPEVariance += probability**2
+
+# photo-electrons from the device
+numHits = 0
+deviceNPE = 0.
+deviceNPEVariance = 0.
+hits, duration = runConverter(hitConverter, steps, numberOfIterations)
+for hit in hits:
+    if hit.stringID == disabledString:
+        raise RuntimeError("a DOM with zero efficiency recorded a hit")
+    if (hit.weight < 1.) or (hit.weight != math.floor(hit.weight)):
+        raise RuntimeError("hits have to carry a positive integer number of photo-electrons, got {0}".format(hit.weight))
+    x, y, z = domPositions[(hit.stringID, hit.omID)]
+    if math.sqrt((hit.pos.x-x)**2 + (hit.pos.y-y)**2 + (hit.pos.z-z)**2) > 1.*I3Units.mm:
+        raise RuntimeError("hit is not at the position of its DOM")
+    numHits += 1
+    deviceNPE += hit.weight
+    deviceNPEVariance += hit.weight**2
+
+print("expected photo-electrons from photons: {0:.1f}".format(expectedNPE))
+print("  photo-electrons from the device: {0:.1f} in {1} hits".format(deviceNPE, numHits))
+
+if numHits < minimumNumberOfHits:
+    raise RuntimeError("not enough hits for a meaningful test")
+
+deviation = (deviceNPE-expectedNPE)/math.sqrt(deviceNPEVariance+expectedNPEVariance)
+print("deviation: {0:.2f} sigma".format(deviation))
+
+if abs(deviation) > maximumDeviationInSigmas:
+    raise RuntimeError("photo-electrons converted on the device do not match the ones expected from the photons")
+
+print("all OK")
@@ -0,0 +1,241 @@
+#!/usr/bin/env python
+
+from __future__ import print_function
+import numpy
+import math
+
+from icecube import icetray, dataclasses, clsim, phys_services
+from I3Tray import I3Units
+
+# Fills a small photon table on the OpenCL device and checks it for
+# consistency: with an unbiased wavelength spectrum every photon has
+# unit weight, so the sum of photon weights has to be the number of
+# photons emitted. The table itself has to be finite and non-empty
+# and its variance estimates have to be compatible with its values.
+# A small table filled on the device has to agree with the same
+# table filled on the host by I3CLSimTabulator from the photon
+# histories of an equivalent converter.
+
+# test parameters
+numberOfIterations = 5
+photonsPerStep = 100
+numberOfSteps = 2000
+stepLength = 1.*I3Units.m
+
+binEdges = [
+    numpy.linspace(0, numpy.sqrt(100), 21)**2,
+    numpy.linspace(0, 180, 7),
+    numpy.linspace(-1, 1, 11),
+    numpy.linspace(0, numpy.sqrt(1e3), 21)**2,
+]
+
+# the comparison with the host uses a small table and short photon
+# paths, so that the photon histories stay complete
+comparisonIterations = 20
+comparisonDeviceSteps = 200
+comparisonHostSteps = 10
+comparisonAbsorptionLengths = 2.
+comparisonHistoryEntries = 1000
+comparisonBinEdges = [
+    numpy.linspace(0, numpy.sqrt(30), 7)**2,
+    numpy.linspace(0, 180, 4),
+    numpy.linspace(-1, 1, 5),
+    numpy.linspace(0, numpy.sqrt(300), 7)**2,
+]
+
+maximumDeviationInSigmas = 5.
+
+# get OpenCL devices
+openCLDevices = [device for device in clsim.I3CLSimOpenCLDevice.GetAllDevices()]
+if len(openCLDevices)==0:
+    raise RuntimeError("No OpenCL devices available!")
+openCLDevice = openCLDevices[0]
+
+openCLDevice.useNativeMath=False
+print("           using platform:", openCLDevice.platform)
+print("             using device:", openCLDevice.device)
+
+rng = phys_services.I3GSLRandomService(seed=3)
+mediumProperties = clsim.MakeIceCubeMediumProperties()
+noBias = clsim.I3CLSimFunctionConstant(1.)
+wavelengthGenerator = clsim.makeCherenkovWavelengthGenerator(noBias, False, mediumProperties)
+
+source = dataclasses.I3Particle()
+source.pos = dataclasses.I3Position(0., 0., 0.)
+source.dir = dataclasses.I3Direction(0., 0., -1.)
+source.time = 0.
+source.type = dataclasses.I3Particle.ParticleType.EMinus
+
+domAcceptance = clsim.GetIceCubeDOMAcceptance()
+angularAcceptance = clsim.GetIceCubeDOMAngularSensitivity()
+domRadius = 0.16510*I3Units.m
+
+def makeConverter(fixedNumberOfAbsorptionLengths):
+    converter = clsim.I3CLSimStepToPhotonConverterOpenCL(RandomService=rng, UseNativeMath=False)
+    converter.SetDevice(openCLDevice)
+    converter.SetWlenGenerators([wavelengthGenerator])
+    converter.SetWlenBias(noBias)
+    converter.SetMediumProperties(mediumProperties)
+    converter.SetFixedNumberOfAbsorptionLengths(fixedNumberOfAbsorptionLengths)
+    return converter
+
+def makeTabulatingConverter(binEdges, fixedNumberOfAbsorptionLengths):
+    converter = makeConverter(fixedNumberOfAbsorptionLengths)
+    converter.SetTabulationBins(binEdges, stepLength)
+    converter.SetTabulationSource(source)
+    converter.SetTabulationEfficiencies(domAcceptance, angularAcceptance, domRadius)
+    converter.Initialize()
+    return converter
+
+# all steps sit at the source position and have (almost) no extent
+def makeSteps(numberOfSteps):
+    steps = clsim.I3CLSimStepSeries()
+    for i in range(numberOfSteps):
+        step = clsim.I3CLSimStep()
+        step.pos = source.pos
+        step.time = 0.
+        step.dir = source.dir
+        step.length = 1e-6*I3Units.m
+        step.beta = 1.
+        step.num = photonsPerStep
+        step.weight = 1.
+        step.id = i
+        step.sourceType = 0
+        steps.append(step)
+    return steps
+
+converter = makeTabulatingConverter(binEdges, 46.)
+steps = makeSteps(numberOfSteps)
+
+for iteration in range(numberOfIterations):
+    converter.EnqueueSteps(steps, iteration)
+    result = converter.GetConversionResult()
+    if len(result.photons) != 0:
+        raise RuntimeError("the converter should not return any photons while tabulating")
+
+values = numpy.asarray(converter.GetTabulatedValues())
+weights = numpy.asarray(converter.GetTabulatedWeights())
+sumOfPhotonWeights = converter.GetTabulatedSumOfPhotonWeights()
+
+expectedNumberOfPhotons = numberOfIterations*numberOfSteps*photonsPerStep
+print("sum of photon weights: {0:.1f} (expected {1})".format(sumOfPhotonWeights, expectedNumberOfPhotons))
+print("table: {0} of {1} bins filled, sum of values {2:.4g}".format(numpy.count_nonzero(values), values.size, values.sum()))
+
+if values.size != numpy.prod([len(e)-1 for e in binEdges]):
+    raise RuntimeError("the table has the wrong size")
+if abs(sumOfPhotonWeights-expectedNumberOfPhotons) > 1e-6*expectedNumberOfPhotons:
+    raise RuntimeError("the sum of photon weights does not match the number of emitted photons")
+if not (numpy.all(numpy.isfinite(values)) and numpy.all(numpy.isfinite(weights))):
+    raise RuntimeError("the table contains non-finite entries")
+if numpy.any(values < 0.) or numpy.any(weights < 0.):
+    raise RuntimeError("the table contains negative entries")
+if numpy.count_nonzero(values) == 0:
+    raise RuntimeError("the table is empty")
+
+# each bin is a sum of positive weights, so its sum of squared weights
+# can neither be zero while the sum is not nor exceed the squared sum
+filled = values > 0.
+if numpy.any(weights[filled] <= 0.) or numpy.any(weights[filled] > values[filled]**2*(1.+1e-3)):
+    raise RuntimeError("the sums of squared weights are inconsistent with the table values")
+
+# Fill the small table on the host from converted photons, the
+# same way the module would hand them to I3TabulatorModule.
+def recordPhotons(tabulator, result):
+    for photon, history in zip(result.photons, result.photonHistories):
+        if len(history) < photon.numScatters:
+            raise RuntimeError("the photon history is incomplete, the comparison needs all scattering points")
+        hostPhoton = clsim.I3Photon()
+        hostPhoton.time = photon.time
+        hostPhoton.startTime = photon.startTime
+        hostPhoton.weight = photon.weight
+        hostPhoton.wavelength = photon.wavelength
+        hostPhoton.groupVelocity = photon.groupVelocity
+        hostPhoton.numScattered = photon.numScatters
+        hostPhoton.pos = photon.pos
+        hostPhoton.startPos = photon.startPos
+        hostPhoton.distanceInAbsorptionLengths = photon.distInAbsLens
+        for k in range(len(history)):
+            hostPhoton.AppendToIntermediatePositionList(history[k], history.GetDistanceInAbsorptionLengths(k))
+        tabulator.RecordPhoton(source, hostPhoton)
+
+# The samples along one photon path are correlated, so the sums of
+# squared weights underestimate the variance. Estimate it from the
+# spread between independent batches instead.
+def batchMeanAndError(tables):
+    tables = numpy.asarray(tables)
+    return tables.mean(axis=0), tables.std(axis=0, ddof=1)/numpy.sqrt(len(tables))
+
+def projections(table):
+    numDimensions = len(table.shape)
+    return [table.sum(axis=tuple(d for d in range(numDimensions) if d != dim)) for dim in range(numDimensions)]
+
+comparisonShape = tuple(len(e)-1 for e in comparisonBinEdges)
+
+deviceConverter = makeTabulatingConverter(comparisonBinEdges, comparisonAbsorptionLengths)
+deviceSteps = makeSteps(comparisonDeviceSteps)
+deviceTables = []
+previousValues = numpy.zeros(comparisonShape)
+for iteration in range(comparisonIterations):
+    deviceConverter.EnqueueSteps(deviceSteps, iteration)
+    deviceConverter.GetConversionResult()
+    # the device table accumulates over all bunches
+    values = numpy.asarray(deviceConverter.GetTabulatedValues(), dtype=float).reshape(comparisonShape)
+    deviceTables.append((values-previousValues)/float(comparisonDeviceSteps*photonsPerStep))
+    previousValues = values
+
+# a single DOM far away, photons are only saved when absorbed
+farGeometry = clsim.I3CLSimSimpleGeometryUserConfigurable(domRadius, 1)
+farGeometry.SetStringID(0, 1)
+farGeometry.SetDomID(0, 1)
+farGeometry.SetPosX(0, 10.*I3Units.km)
+farGeometry.SetPosY(0, 0.)
+farGeometry.SetPosZ(0, 0.)
+farGeometry.SetSubdetector(0, "IceCube")
+
+hostConverter = makeConverter(comparisonAbsorptionLengths)
+hostConverter.SetGeometry(farGeometry)
+hostConverter.SetSaveAllPhotons(True)
+hostConverter.SetSaveAllPhotonsPrescale(1.)
+hostConverter.SetPhotonHistoryEntries(comparisonHistoryEntries)
+hostConverter.Initialize()
+
+hostSteps = makeSteps(comparisonHostSteps)
+hostTables = []
+for iteration in range(comparisonIterations):
+    hostConverter.EnqueueSteps(hostSteps, iteration)
+    result = hostConverter.GetConversionResult()
+    if len(result.photons) != comparisonHostSteps*photonsPerStep:
+        raise RuntimeError("expected every photon to be saved when it is absorbed")
+
+    tabulator = clsim.I3CLSimTabulator()
+    tabulator.SetBins(comparisonBinEdges, stepLength)
+    tabulator.SetEfficiencies(domAcceptance, angularAcceptance, domRadius)
+    tabulator.SetRandomService(rng)
+    recordPhotons(tabulator, result)
+    values, weights = tabulator.GetValues()
+    # the device includes the DOM area in the photon weight
+    hostTables.append(numpy.asarray(values, dtype=float)*(math.pi*domRadius**2)/float(comparisonHostSteps*photonsPerStep))
+
+deviceMean, deviceError = batchMeanAndError([[t.sum()] for t in deviceTables])
+hostMean, hostError = batchMeanAndError([[t.sum()] for t in hostTables])
+totalDeviation = (deviceMean[0]-hostMean[0])/math.sqrt(deviceError[0]**2+hostError[0]**2)
+print("small table per photon: {0:.4g} +- {1:.2g} (device), {2:.4g} +- {3:.2g} (host), deviation {4:.2f} sigma".format(
+    deviceMean[0], deviceError[0], hostMean[0], hostError[0], totalDeviation))
+if abs(totalDeviation) > maximumDeviationInSigmas:
+    raise RuntimeError("the table filled on the device does not match the one filled on the host")
+
+# compare the projections onto each dimension bin by bin
+deviceProjections = [projections(t) for t in deviceTables]
+hostProjections = [projections(t) for t in hostTables]
+for dim in range(len(comparisonShape)):
+    deviceMean, deviceError = batchMeanAndError([p[dim] for p in deviceProjections])
+    hostMean, hostError = batchMeanAndError([p[dim] for p in hostProjections])
+    error = numpy.sqrt(deviceError**2+hostError**2)
+    filled = error > 0.
+    deviation = numpy.zeros(comparisonShape[dim])
+    deviation[filled] = (deviceMean[filled]-hostMean[filled])/error[filled]
+    print("   dimension {0}: largest deviation {1:.2f} sigma".format(dim, numpy.abs(deviation).max()))
+    if numpy.any(numpy.abs(deviation) > maximumDeviationInSigmas):
+        raise RuntimeError("the table filled on the device does not match the one filled on the host in dimension {0}".format(dim))
+
+print("all OK")
@@ -0,0 +1,72 @@
+#!/usr/bin/env python
+
+from __future__ import print_function
+import math
+
+from icecube import icetray, dataclasses, clsim, phys_services
+from I3Tray import I3Units
+
+from clsimTestFixture import getOpenCLDevice, makeOpenCLConverter, makeSteps, runConverter, hitStatistics, sourcePositions
+
+# Propagates the same light sources with and without distance
+# culling and checks that the detected photons agree within
+# their statistical uncertainties. Culling may only drop photons
+# that would never have reached a DOM.
+
+# test parameters
+distanceCullingMargin = 0.5
+numberOfIterations = 10
+photonsPerStep = 1000
+numberOfSteps = 2000
+
+minimumNumberOfHits = 50
+maximumDeviationInSigmas = 5.
+
+openCLDevice = getOpenCLDevice()
+rng = phys_services.I3GSLRandomService(seed=2)
+
+def makeConverter(distanceCullingMargin):
+    converter = makeOpenCLConverter(rng, openCLDevice)
+    converter.SetDistanceCullingMargin(distanceCullingMargin)
+    converter.Initialize()
+    return converter
+
+converterWithoutCulling = makeConverter(float('nan'))
+converterWithCulling = makeConverter(distanceCullingMargin)
+
+failed = False
+for position in sourcePositions:
+    print("source at", position)
+    steps = makeSteps(position, numberOfSteps, photonsPerStep)
+
+    photonsRef, durationRef = runConverter(converterWithoutCulling, steps, numberOfIterations)
+    photons, duration = runConverter(converterWithCulling, steps, numberOfIterations)
+    ref = hitStatistics(photonsRef)
+    culled = hitStatistics(photons)
+
+    print("   without culling: {0} hits, mean time {1:.1f}ns ({2:.2f}s)".format(ref.numHits, ref.meanTime/I3Units.ns, durationRef))
+    print("      with culling: {0} hits, mean time {1:.1f}ns ({2:.2f}s)".format(culled.numHits, culled.meanTime/I3Units.ns, duration))
+
+    if ref.numHits < minimumNumberOfHits:
+        raise RuntimeError("not enough hits for a meaningful test, the source is too far away")
+    if culled.numHits == 0:
+        print("   -> FAILED (culling removed all hits)")
+        failed = True
+        continue
+
+    # the number of hits is Poisson-distributed in both cases
+    hitsDeviation = float(culled.numHits-ref.numHits)/math.sqrt(float(culled.numHits+ref.numHits))
+
+    # so is the mean of the arrival times
+    timeDeviation = (culled.meanTime-ref.meanTime)/math.sqrt(culled.varTime/float(culled.numHits) + ref.varTime/float(ref.numHits))
+
+    print("   deviation: {0:.2f} sigma (number of hits), {1:.2f} sigma (mean time)".format(hitsDeviation, timeDeviation))
+
+    if (abs(hitsDeviation) > maximumDeviationInSigmas) or (abs(timeDeviation) > maximumDeviationInSigmas):
+        print("   -> FAILED")
+        failed = True
+
+if failed:
+    raise RuntimeError("results with distance culling do not match the results without it")
+
+print("all OK")
@@ -0,0 +1,98 @@
+#!/usr/bin/env python
+
+from __future__ import print_function
+import math
+
+from icecube import icetray, dataclasses, clsim, phys_services
+from I3Tray import I3Units
+
+from clsimTestFixture import getOpenCLDevice, makeOpenCLConverter, makeNativeConverter, makeSteps, runConverter, hitStatistics, sourcePositions, domPositions, domRadius
+
+# Checks the native propagator on its own: no photon may arrive at
+# a DOM before light in vacuum could get there, and the number of
+# detected photons has to scale with the number of emitted photons.
+# If an OpenCL device is available, the same light sources are also
+# propagated with the OpenCL converter, and the numbers of detected
+# photons and their mean arrival times have to agree within their
+# statistical uncertainties.
+
+# test parameters
+numberOfIterations = 10
+photonsPerStep = 1000
+numberOfSteps = 2000
+stepLength = 1.*I3Units.m # as set by makeSteps()
+
+minimumNumberOfHits = 50
+maximumDeviationInSigmas = 5.
+
+openCLDevice = getOpenCLDevice(required=False)
+rng = phys_services.I3GSLRandomService(seed=5)
+
+if openCLDevice is not None:
+    openCLConverter = makeOpenCLConverter(rng, openCLDevice)
+    openCLConverter.Initialize()
+
+nativeConverter = makeNativeConverter(rng)
+nativeConverter.Initialize()
+
+def earliestArrivalTime(position, photon):
+    x, y, z = domPositions[(photon.stringID, photon.omID)]
+    distance = math.sqrt((x-position.x)**2 + (y-position.y)**2 + (z-position.z)**2)
+    return max(distance-domRadius-stepLength, 0.)/dataclasses.I3Constants.c
+
+failed = False
+for position in sourcePositions:
+    print("source at", position)
+    steps = makeSteps(position, numberOfSteps, photonsPerStep)
+
+    photons, duration = runConverter(nativeConverter, steps, numberOfIterations)
+    native = hitStatistics(photons)
+    print("   native: {0} hits, mean time {1:.1f}ns ({2:.2f}s)".format(native.numHits, native.meanTime/I3Units.ns, duration))
+
+    if native.numHits < minimumNumberOfHits:
+        raise RuntimeError("not enough hits for a meaningful test, the source is too far away")
+
+    # causality (allowing for single precision rounding)
+    numTooEarly = sum(1 for photon in photons if photon.time < earliestArrivalTime(position, photon)-0.01*I3Units.ns)
+    if numTooEarly > 0:
+        print("   -> FAILED ({0} photons arrive faster than light in vacuum)".format(numTooEarly))
+        failed = True
+
+    # twice the photons, twice the hits (both are Poisson-distributed)
+    photonsDouble, durationDouble = runConverter(nativeConverter, makeSteps(position, numberOfSteps, 2*photonsPerStep), numberOfIterations)
+    numHitsDouble = len(photonsDouble)
+    scalingDeviation = float(numHitsDouble-2*native.numHits)/math.sqrt(float(numHitsDouble+4*native.numHits))
+    print("   native, twice the photons: {0} hits ({1:.2f}s), deviation {2:.2f} sigma".format(numHitsDouble, durationDouble, scalingDeviation))
+    if abs(scalingDeviation) > maximumDeviationInSigmas:
+        print("   -> FAILED (the number of hits does not scale with the number of photons)")
+        failed = True
+
+    if openCLDevice is None:
+        continue
+
+    photonsRef, durationRef = runConverter(openCLConverter, steps, numberOfIterations)
+    ref = hitStatistics(photonsRef)
+    print("   OpenCL: {0} hits, mean time {1:.1f}ns ({2:.2f}s)".format(ref.numHits, ref.meanTime/I3Units.ns, durationRef))
+
+    if ref.numHits < minimumNumberOfHits:
+        raise RuntimeError("not enough hits for a meaningful test, the source is too far away")
+
+    # the number of hits is Poisson-distributed in both cases
+    hitsDeviation = float(native.numHits-ref.numHits)/math.sqrt(float(native.numHits+ref.numHits))
+
+    # so is the mean of the arrival times
+    timeDeviation = (native.meanTime-ref.meanTime)/math.sqrt(native.varTime/float(native.numHits) + ref.varTime/float(ref.numHits))
+
+    print("   deviation: {0:.2f} sigma (number of hits), {1:.2f} sigma (mean time)".format(hitsDeviation, timeDeviation))
+
+    if (abs(hitsDeviation) > maximumDeviationInSigmas) or (abs(timeDeviation) > maximumDeviationInSigmas):
+        print("   -> FAILED")
+        failed = True
+
+if failed:
+    raise RuntimeError("results of the native propagator are not consistent")
+
+if openCLDevice is None:
+    print("no OpenCL device, skipped the comparison with the OpenCL converter")
+
+print("all OK")
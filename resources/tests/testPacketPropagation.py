@@ -0,0 +1,73 @@
+#!/usr/bin/env python
+
+from __future__ import print_function
+import math
+
+from icecube import icetray, dataclasses, clsim, phys_services
+from I3Tray import I3Units
+
+from clsimTestFixture import makeNativeConverter, makeSteps, runConverter, hitStatistics, sourcePositions
+
+# Propagates the same light sources with the native propagator in
+# SIMD packets and with its scalar code path and checks that the
+# numbers of detected photons and their mean arrival times agree
+# within their statistical uncertainties. Does not need OpenCL.
+
+# test parameters
+numberOfIterations = 10
+photonsPerStep = 1000
+numberOfSteps = 2000
+
+minimumNumberOfHits = 50
+maximumDeviationInSigmas = 5.
+
+print("packets of {0} photons ({1})".format(
+    clsim.I3CLSimStepToPhotonConverterNative.GetPacketWidth(),
+    clsim.I3CLSimStepToPhotonConverterNative.GetPacketInstructionSet()))
+
+rng = phys_services.I3GSLRandomService(seed=7)
+
+scalarConverter = makeNativeConverter(rng)
+scalarConverter.SetUsePacketPropagation(False)
+scalarConverter.Initialize()
+
+packetConverter = makeNativeConverter(rng)
+packetConverter.SetUsePacketPropagation(True)
+packetConverter.Initialize()
+
+failed = False
+for position in sourcePositions:
+    print("source at", position)
+    steps = makeSteps(position, numberOfSteps, photonsPerStep)
+
+    photonsRef, durationRef = runConverter(scalarConverter, steps, numberOfIterations)
+    photons, duration = runConverter(packetConverter, steps, numberOfIterations)
+    ref = hitStatistics(photonsRef)
+    packet = hitStatistics(photons)
+
+    print("   scalar: {0} hits, mean time {1:.1f}ns ({2:.2f}s)".format(ref.numHits, ref.meanTime/I3Units.ns, durationRef))
+    print("   packet: {0} hits, mean time {1:.1f}ns ({2:.2f}s)".format(packet.numHits, packet.meanTime/I3Units.ns, duration))
+
+    if ref.numHits < minimumNumberOfHits:
+        raise RuntimeError("not enough hits for a meaningful test, the source is too far away")
+    if packet.numHits == 0:
+        print("   -> FAILED (no hits in packet propagation mode)")
+        failed = True
+        continue
+
+    # the number of hits is Poisson-distributed in both cases
+    hitsDeviation = float(packet.numHits-ref.numHits)/math.sqrt(float(packet.numHits+ref.numHits))
+
+    # so is the mean of the arrival times
+    timeDeviation = (packet.meanTime-ref.meanTime)/math.sqrt(packet.varTime/float(packet.numHits) + ref.varTime/float(ref.numHits))
+
+    print("   deviation: {0:.2f} sigma (number of hits), {1:.2f} sigma (mean time)".format(hitsDeviation, timeDeviation))
+
+    if (abs(hitsDeviation) > maximumDeviationInSigmas) or (abs(timeDeviation) > maximumDeviationInSigmas):
+        print("   -> FAILED")
+        failed = True
+
+if failed:
+    raise RuntimeError("results of the packet propagation do not match the scalar propagation")
+
+print("all OK")
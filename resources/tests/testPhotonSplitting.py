@@ -0,0 +1,71 @@
+#!/usr/bin/env python
+
+from __future__ import print_function
+import math
+
+from icecube import icetray, dataclasses, clsim, phys_services
+from I3Tray import I3Units
+
+from clsimTestFixture import getOpenCLDevice, makeOpenCLConverter, makeSteps, runConverter, hitStatistics, sourcePositions
+
+# Propagates the same light sources with and without photon
+# splitting and checks that the sums of weights of the detected
+# photons agree within their statistical uncertainties. Splitting
+# and Russian roulette may change the number of detected photons,
+# but not their expected weight at the DOMs.
+
+# test parameters
+photonSplittingFactor = 4
+photonSplittingDistance = 5.*I3Units.m
+photonRouletteDistance = 30.*I3Units.m
+numberOfIterations = 10
+photonsPerStep = 1000
+numberOfSteps = 2000
+
+minimumNumberOfHits = 100
+maximumDeviationInSigmas = 5.
+
+openCLDevice = getOpenCLDevice()
+rng = phys_services.I3GSLRandomService(seed=2)
+
+def makeConverter(photonSplittingFactor):
+    converter = makeOpenCLConverter(rng, openCLDevice)
+    converter.SetPhotonSplittingFactor(photonSplittingFactor)
+    converter.SetPhotonSplittingDistance(photonSplittingDistance)
+    converter.SetPhotonRouletteDistance(photonRouletteDistance)
+    converter.Initialize()
+    return converter
+
+converterWithoutSplitting = makeConverter(1)
+converterWithSplitting = makeConverter(photonSplittingFactor)
+
+failed = False
+for position in sourcePositions:
+    print("source at", position)
+    steps = makeSteps(position, numberOfSteps, photonsPerStep)
+
+    photonsRef, durationRef = runConverter(converterWithoutSplitting, steps, numberOfIterations)
+    photons, duration = runConverter(converterWithSplitting, steps, numberOfIterations)
+    ref = hitStatistics(photonsRef)
+    split = hitStatistics(photons)
+
+    print("   without splitting: {0} hits, sum of weights {1:.1f}, mean time {2:.1f}ns ({3:.2f}s)".format(ref.numHits, ref.sumOfWeights, ref.meanTime/I3Units.ns, durationRef))
+    print("      with splitting: {0} hits, sum of weights {1:.1f}, mean time {2:.1f}ns ({3:.2f}s)".format(split.numHits, split.sumOfWeights, split.meanTime/I3Units.ns, duration))
+
+    if ref.numHits < minimumNumberOfHits:
+        raise RuntimeError("not enough hits for a meaningful test, the source is too far away")
+
+    # sums of weights are compound Poisson-distributed, their
+    # variance is estimated by the sums of squared weights
+    weightDeviation = (split.sumOfWeights-ref.sumOfWeights)/math.sqrt(split.sumOfWeightsSquared+ref.sumOfWeightsSquared)
+
+    print("   deviation: {0:.2f} sigma (sum of weights)".format(weightDeviation))
+
+    if abs(weightDeviation) > maximumDeviationInSigmas:
+        print("   -> FAILED")
+        failed = True
+
+if failed:
+    raise RuntimeError("results with photon splitting do not match the results without it")
+
+print("all OK")
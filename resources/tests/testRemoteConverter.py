@@ -0,0 +1,125 @@
+#!/usr/bin/env python
+
+from __future__ import print_function
+import math
+import os
+import tempfile
+import time
+
+from icecube import icetray, dataclasses, clsim, phys_services
+from I3Tray import I3Units
+
+from clsimTestFixture import makeNativeConverter, makeSteps, runConverter
+from clsimTestFixture import wavelengthGenerator, domAcceptance, mediumProperties, geometry, makeGeometry
+
+# Serves a native propagator on a local socket and sends steps
+# to it through I3CLSimStepToPhotonConverterRemote. All bunches
+# have to come back and the results have to agree with the same
+# propagator used directly. A client configured differently from
+# the server has to be rejected.
+
+# test parameters
+numberOfIterations = 10
+photonsPerStep = 1000
+numberOfSteps = 512
+
+minimumNumberOfHits = 100
+maximumDeviationInSigmas = 5.
+
+sourcePosition = dataclasses.I3Position(0.*I3Units.m, 20.*I3Units.m, 0.*I3Units.m)
+
+socketDir = tempfile.mkdtemp()
+address = "unix:" + os.path.join(socketDir, "clsim-worker.sock")
+
+rng = phys_services.I3GSLRandomService(seed=3)
+
+# keeps all bunches in flight at the same time
+def runPipelined(converter, steps):
+    numHits = 0
+
+    startTime = time.time()
+    for iteration in range(numberOfIterations):
+        converter.EnqueueSteps(steps, iteration)
+
+    identifiers = set()
+    for iteration in range(numberOfIterations):
+        result = converter.GetConversionResult()
+        identifiers.add(result.identifier)
+        numHits += len(result.photons)
+    duration = time.time()-startTime
+
+    if identifiers != set(range(numberOfIterations)):
+        raise RuntimeError("did not receive all bunches back (got {0})".format(sorted(identifiers)))
+
+    return numHits, duration
+
+# the remote converter only uses these to check the worker's configuration
+def makeRemoteConverter(geometry):
+    converter = clsim.I3CLSimStepToPhotonConverterRemote(Address=address)
+    converter.SetWlenGenerators([wavelengthGenerator])
+    converter.SetWlenBias(domAcceptance)
+    converter.SetMediumProperties(mediumProperties)
+    converter.SetGeometry(geometry)
+    return converter
+
+localConverter = makeNativeConverter(rng)
+localConverter.Initialize()
+
+workerConverter = makeNativeConverter(rng)
+workerConverter.Initialize()
+server = clsim.I3CLSimStepToPhotonConverterServer(Address=address,
+                                                  Converter=workerConverter,
+                                                  WorkgroupSize=workerConverter.GetWorkgroupSize(),
+                                                  MaxNumWorkitems=workerConverter.GetMaxNumWorkitems(),
+                                                  WlenGenerators=[wavelengthGenerator],
+                                                  WlenBias=domAcceptance,
+                                                  MediumProperties=mediumProperties,
+                                                  Geometry=geometry)
+server.Start()
+
+try:
+    # a client with a different geometry has to be rejected
+    shiftedGeometry = makeGeometry()
+    shiftedGeometry.SetPosX(0, shiftedGeometry.GetPosX(0)+1.*I3Units.m)
+    mismatchedConverter = makeRemoteConverter(shiftedGeometry)
+    try:
+        mismatchedConverter.Initialize()
+    except Exception as e:
+        print("rejected differently configured client:", e)
+    else:
+        raise RuntimeError("a client with a different geometry was not rejected")
+    del mismatchedConverter
+
+    remoteConverter = makeRemoteConverter(geometry)
+    remoteConverter.Initialize()
+    print("connected to", address)
+    print("   workgroup size:", remoteConverter.GetWorkgroupSize(), "max. work items:", remoteConverter.GetMaxNumWorkitems())
+
+    steps = makeSteps(sourcePosition, numberOfSteps, photonsPerStep)
+
+    photonsRef, durationRef = runConverter(localConverter, steps, numberOfIterations)
+    hitsRef = len(photonsRef)
+    hits, duration = runPipelined(remoteConverter, steps)
+
+    print("   local:  {0} hits ({1:.2f}s)".format(hitsRef, durationRef))
+    print("   remote: {0} hits ({1:.2f}s)".format(hits, duration))
+
+    if hitsRef+hits < minimumNumberOfHits:
+        raise RuntimeError("not enough hits for a meaningful test")
+
+    # independent random numbers, the number of hits is Poisson-distributed in both cases
+    hitsDeviation = float(hits-hitsRef)/math.sqrt(float(hits+hitsRef))
+    print("   deviation: {0:.2f} sigma".format(hitsDeviation))
+
+    if abs(hitsDeviation) > maximumDeviationInSigmas:
+        raise RuntimeError("results from the remote worker do not match the local results")
+
+    del remoteConverter
+finally:
+    server.Stop()
+    os.rmdir(socketDir)
+
+if server.GetNumBunchesServed() != numberOfIterations:
+    raise RuntimeError("the server did not see all bunches")
+
+print("all OK")
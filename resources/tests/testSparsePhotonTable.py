@@ -0,0 +1,102 @@
+#!/usr/bin/env python
+
+from __future__ import print_function
+import numbers
+import numpy
+import os
+import shutil
+import tempfile
+
+from icecube import icetray, dataclasses, clsim
+from icecube.clsim.tablemaker.tabulator import PhotoTable, empty_header
+
+# Writes photon tables in the sparse format and reads them back.
+# Values, weights, bin edges and the header have to survive the
+# roundtrip. Merging tables with MergeSparsePhotonTables has to sum
+# up their values and weights as well as their numbers of photons.
+
+# test parameters
+chunkSize = 100
+numberOfPhotons = [1000, 2500]
+
+# the number of bins is not a multiple of the chunk size
+binEdges = [
+    numpy.linspace(0, numpy.sqrt(100), 11)**2,
+    numpy.linspace(0, 180, 4),
+    numpy.linspace(-1, 1, 6),
+    numpy.linspace(0, numpy.sqrt(1e3), 8)**2,
+]
+shape = tuple(len(e)-1 for e in binEdges)
+
+numpy.random.seed(1)
+
+# most of a table is empty, so most chunks are left out
+def makeTable(nPhotons):
+    values = numpy.random.exponential(1., shape).astype(numpy.float32)
+    values[numpy.random.uniform(size=shape) < 0.8] = 0.
+    values[6:] = 0.
+    weights = (values**2/10.).astype(numpy.float32)
+    header = dict(empty_header)
+    header['n_photons'] = nPhotons
+    header['z'] = 12.5
+    return PhotoTable(binEdges, values, weights, header)
+
+def checkTable(table, values, weights, nPhotons, name):
+    if len(table.bin_edges) != len(binEdges):
+        raise RuntimeError("{0}: wrong number of dimensions".format(name))
+    for loaded, edges in zip(table.bin_edges, binEdges):
+        if not numpy.array_equal(loaded, edges):
+            raise RuntimeError("{0}: bin edges differ".format(name))
+    if not numpy.array_equal(table.values, values):
+        raise RuntimeError("{0}: values differ".format(name))
+    if not numpy.array_equal(table.weights, weights):
+        raise RuntimeError("{0}: weights differ".format(name))
+    if table.header['n_photons'] != nPhotons:
+        raise RuntimeError("{0}: n_photons is {1}, expected {2}".format(name, table.header['n_photons'], nPhotons))
+    if not isinstance(table.header['n_photons'], numbers.Integral):
+        raise RuntimeError("{0}: n_photons is not an integer".format(name))
+    for k, v in empty_header.items():
+        if k == 'n_photons': continue
+        expected = 12.5 if k == 'z' else v
+        if table.header[k] != expected:
+            raise RuntimeError("{0}: header entry {1} is {2}, expected {3}".format(name, k, table.header[k], expected))
+
+tempDir = tempfile.mkdtemp()
+try:
+    tables = [makeTable(n) for n in numberOfPhotons]
+    filenames = []
+    for i, table in enumerate(tables):
+        filename = os.path.join(tempDir, "table{0}.clsimspt".format(i))
+        table.save_sparse(filename, chunk_size=chunkSize)
+        filenames.append(filename)
+
+        sparse = clsim.I3CLSimSparsePhotonTable(filename)
+        numEmpty = sum(sparse.IsChunkEmpty(c) for c in range(sparse.GetNumChunks()))
+        print("table {0}: {1} bins in {2} chunks, {3} of them empty, {4} bytes".format(
+            i, sparse.GetNumBins(), sparse.GetNumChunks(), numEmpty, os.path.getsize(filename)))
+        if sparse.GetChunkSize() != chunkSize:
+            raise RuntimeError("the table has the wrong chunk size")
+        if numEmpty == 0:
+            raise RuntimeError("empty chunks should not be stored")
+        del sparse
+
+        checkTable(PhotoTable.load_sparse(filename), table.values, table.weights, numberOfPhotons[i], "roundtrip {0}".format(i))
+
+    # existing files are only replaced on request
+    try:
+        tables[0].save_sparse(filenames[0], chunk_size=chunkSize)
+    except IOError:
+        pass
+    else:
+        raise RuntimeError("an existing table was overwritten")
+
+    mergedFilename = os.path.join(tempDir, "merged.clsimspt")
+    clsim.MergeSparsePhotonTables(filenames, mergedFilename)
+    checkTable(PhotoTable.load_sparse(mergedFilename),
+               tables[0].values+tables[1].values,
+               tables[0].weights+tables[1].weights,
+               sum(numberOfPhotons), "merged")
+finally:
+    shutil.rmtree(tempDir)
+
+print("all OK")
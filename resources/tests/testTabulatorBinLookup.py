@@ -0,0 +1,57 @@
+#!/usr/bin/env python
+
+from __future__ import print_function
+import numpy
+
+from icecube import icetray, dataclasses, clsim, phys_services
+
+# Checks the bin lookup of I3CLSimTabulator against a binary search
+# on the bin edges. Equally spaced edges (in x or in sqrt(x)) are
+# looked up without a search and have to give the same bins,
+# including for values right on an edge. Values outside of the
+# table are clamped to the first or last bin.
+
+# test parameters
+numberOfValues = 10000
+
+binEdges = {
+    "linear": numpy.linspace(-1, 1, 101),
+    "sqrt-spaced": numpy.linspace(0, numpy.sqrt(580), 201)**2,
+    "irregular": numpy.concatenate(([0.], numpy.logspace(-2, 3, 50))),
+}
+
+numpy.random.seed(1)
+
+# each bin includes its upper edge
+def referenceBin(edges, x):
+    idx = numpy.searchsorted(edges, x, side='left')-1
+    return min(max(idx, 0), len(edges)-2)
+
+failed = False
+for name, edges in sorted(binEdges.items()):
+    edgeList = [float(e) for e in edges]
+    span = edges[-1]-edges[0]
+    values = numpy.concatenate((
+        numpy.random.uniform(edges[0]-0.1*span, edges[-1]+0.1*span, numberOfValues),
+        edges,
+        numpy.nextafter(edges, numpy.inf),
+        numpy.nextafter(edges, -numpy.inf),
+    ))
+
+    mismatches = 0
+    for x in values:
+        found = clsim.I3CLSimTabulator.FindBin(edgeList, float(x))
+        expected = referenceBin(edges, x)
+        if found != expected:
+            if mismatches == 0:
+                print("   first mismatch at x={0!r}: bin {1} (expected {2})".format(x, found, expected))
+            mismatches += 1
+
+    print("{0} edges: {1} of {2} values in the wrong bin".format(name, mismatches, len(values)))
+    if mismatches > 0:
+        failed = True
+
+if failed:
+    raise RuntimeError("the bin lookup does not match the binary search")
+
+print("all OK")